@@ -90,6 +90,13 @@ man_pages = [
         [author],
         1,
     ),
+    (
+        "ref/pgcopydb_copy-cluster",
+        "pgcopydb copy-cluster",
+        "pgcopydb copy-cluster",
+        [author],
+        1,
+    ),
     (
         "ref/pgcopydb_dump",
         "pgcopydb dump",
@@ -118,4 +125,25 @@ man_pages = [
         [author],
         1,
     ),
+    (
+        "ref/pgcopydb_bench",
+        "pgcopydb bench",
+        "pgcopydb bench",
+        [author],
+        1,
+    ),
+    (
+        "ref/pgcopydb_plan",
+        "pgcopydb plan",
+        "pgcopydb plan",
+        [author],
+        1,
+    ),
+    (
+        "ref/pgcopydb_compare",
+        "pgcopydb compare",
+        "pgcopydb compare",
+        [author],
+        1,
+    ),
 ]
@@ -20,6 +20,8 @@
  * IN THE SOFTWARE.
  */
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -31,6 +33,24 @@
 
 #include "log.h"
 
+/*
+ * Each log line is formatted in memory and then written to stderr with a
+ * single write(2) call, so that the lines of concurrent processes do not
+ * interleave without having to take a lock. With log_set_buffered(), TRACE
+ * and DEBUG lines are batched in a per-process buffer of PIPE_BUF bytes,
+ * which is written as a whole before the next INFO (or higher) line, when
+ * full, when older than LOG_BUFFER_MAX_AGE seconds, at fork(), and at exit.
+ *
+ * A process might not log anything for a long while after a DEBUG line, when
+ * it waits for a sub-process or for a shared resource: the application then
+ * calls log_flush() before it sleeps.
+ *
+ * The threads of a process share the buffer, which is protected by a mutex.
+ */
+#define LOG_LINE_SIZE 1024
+#define LOG_BUFFER_SIZE 4096
+#define LOG_BUFFER_MAX_AGE 1
+
 static struct {
   void *udata;
   log_LockFn lock;
@@ -38,7 +58,17 @@ static struct {
   int level;
   int quiet;
   int useColors;
-} L;
+
+  int buffered;
+  pthread_mutex_t mutex;        /* protects the buffer and lastTimeStr */
+  pid_t pid;                    /* cached getpid(), see log_atfork_child() */
+  time_t bufferTime;            /* when the oldest buffered line was logged */
+  size_t bufferLen;
+  char buffer[LOG_BUFFER_SIZE];
+
+  time_t lastTime;              /* cache the formatted time of the day */
+  char lastTimeStr[16];
+} L = { .mutex = PTHREAD_MUTEX_INITIALIZER };
 
 
 static const char *level_names[] = {
@@ -64,6 +94,137 @@ static void unlock(void) {
 }
 
 
+/*
+ * log_write_all writes the given data to stderr, retrying partial writes.
+ */
+static void log_write_all(const char *data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t written = write(STDERR_FILENO, data, size);
+
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return;
+		}
+
+		data += written;
+		size -= written;
+	}
+}
+
+
+/*
+ * log_flush_buffer writes the buffered lines. The caller must hold L.mutex.
+ */
+static void log_flush_buffer(void)
+{
+	if (L.bufferLen > 0)
+	{
+		log_write_all(L.buffer, L.bufferLen);
+		L.bufferLen = 0;
+	}
+}
+
+
+/*
+ * log_atfork_prepare writes our buffered lines before fork(), and keeps the
+ * mutex until fork() is done, so that no other thread is using the buffer
+ * when the child process gets its copy.
+ */
+static void log_atfork_prepare(void)
+{
+	pthread_mutex_lock(&L.mutex);
+	log_flush_buffer();
+}
+
+
+static void log_atfork_parent(void)
+{
+	pthread_mutex_unlock(&L.mutex);
+}
+
+
+/*
+ * log_atfork_child resets the logging state that belongs to the parent
+ * process, which has written its buffered lines already.
+ */
+static void log_atfork_child(void)
+{
+	L.pid = getpid();
+	L.bufferLen = 0;
+
+	pthread_mutex_unlock(&L.mutex);
+}
+
+
+static pid_t log_getpid(void)
+{
+	if (L.pid == 0)
+	{
+		pthread_atfork(log_atfork_prepare, log_atfork_parent, log_atfork_child);
+		L.pid = getpid();
+	}
+
+	return L.pid;
+}
+
+
+/*
+ * log_write writes a whole line, or adds it to the per-process buffer. The
+ * caller must hold L.mutex.
+ */
+static void log_write(int level, const char *line, size_t size, time_t t)
+{
+	if (L.buffered &&
+		level <= LOG_DEBUG &&
+		size <= LOG_BUFFER_SIZE &&
+		(L.bufferLen == 0 || t - L.bufferTime < LOG_BUFFER_MAX_AGE))
+	{
+		if (L.bufferLen + size > LOG_BUFFER_SIZE)
+		{
+			log_flush_buffer();
+		}
+
+		if (L.bufferLen == 0)
+		{
+			L.bufferTime = t;
+		}
+
+		memcpy(L.buffer + L.bufferLen, line, size);
+		L.bufferLen += size;
+	}
+	else
+	{
+		log_flush_buffer();
+		log_write_all(line, size);
+	}
+}
+
+
+void log_flush(void)
+{
+	pthread_mutex_lock(&L.mutex);
+	log_flush_buffer();
+	pthread_mutex_unlock(&L.mutex);
+}
+
+
+void log_set_buffered(int enable)
+{
+	if (!enable)
+	{
+		log_flush();
+	}
+
+	L.buffered = enable ? 1 : 0;
+}
+
+
 void log_set_udata(void *udata) {
   L.udata = udata;
 }
@@ -114,6 +275,9 @@ void log_log(int level, const char *file, int line, const char *fmt, ...)
   /* Acquire lock */
   lock();
 
+  /* the threads of this process share the buffer and the time cache */
+  pthread_mutex_lock(&L.mutex);
+
   /* Get current time */
   t = time(NULL);
   lt = localtime(&t);
@@ -121,38 +285,83 @@ void log_log(int level, const char *file, int line, const char *fmt, ...)
   /* Log to stderr */
   if (!L.quiet) {
     va_list args;
-    char buf[16];
+	char msg[LOG_LINE_SIZE];
+	char *data = msg;
 	int showLineNumber = L.level <= 1;
+	int len = 0;
 
-    buf[strftime(buf, sizeof(buf), "%H:%M:%S", lt)] = '\0';
+	if (t != L.lastTime)
+	{
+		L.lastTime = t;
+		L.lastTimeStr[strftime(L.lastTimeStr,
+							   sizeof(L.lastTimeStr),
+							   "%H:%M:%S", lt)] = '\0';
+	}
 
 	if (L.useColors)
 	{
-		pg_fprintf(stderr, "%s %d %s%-5s\x1b[0m ",
-				   buf,
-				   getpid(),
-				   level_colors[level],
-				   level_names[level]);
+		len = pg_snprintf(msg, sizeof(msg), "%s %d %s%-5s\x1b[0m ",
+						  L.lastTimeStr,
+						  log_getpid(),
+						  level_colors[level],
+						  level_names[level]);
 
 		if (showLineNumber)
 		{
-			pg_fprintf(stderr, "\x1b[90m%s:%d:\x1b[0m ", file, line);
+			len += pg_snprintf(msg + len, sizeof(msg) - len,
+							   "\x1b[90m%s:%d:\x1b[0m ", file, line);
 		}
 	}
 	else
 	{
-		pg_fprintf(stderr, "%s %d %-5s ", buf, getpid(), level_names[level]);
+		len = pg_snprintf(msg, sizeof(msg), "%s %d %-5s ",
+						  L.lastTimeStr, log_getpid(), level_names[level]);
 
 		if (showLineNumber)
 		{
-			pg_fprintf(stderr, "%s:%d ", file, line);
+			len += pg_snprintf(msg + len, sizeof(msg) - len,
+							   "%s:%d ", file, line);
 		}
 	}
 
     va_start(args, fmt);
-    pg_vfprintf(stderr, fmt, args);
+	int msglen = pg_vsnprintf(msg + len, sizeof(msg) - len, fmt, args);
     va_end(args);
-    pg_fprintf(stderr, "\n");
+
+	/* long messages are formatted again in a large enough buffer */
+	if (msglen >= 0 && len + msglen + 1 > (int) sizeof(msg))
+	{
+		char *large = (char *) malloc(len + msglen + 2);
+
+		if (large != NULL)
+		{
+			memcpy(large, msg, len);
+
+			va_start(args, fmt);
+			pg_vsnprintf(large + len, msglen + 1, fmt, args);
+			va_end(args);
+
+			data = large;
+		}
+		else
+		{
+			msglen = sizeof(msg) - len - 2;
+		}
+	}
+
+	if (msglen < 0)
+	{
+		msglen = 0;
+	}
+
+	data[len + msglen] = '\n';
+
+	log_write(level, data, len + msglen + 1, t);
+
+	if (data != msg)
+	{
+		free(data);
+	}
   }
 
   /* Log to file */
@@ -169,5 +378,6 @@ void log_log(int level, const char *file, int line, const char *fmt, ...)
   }
 
   /* Release lock */
+  pthread_mutex_unlock(&L.mutex);
   unlock();
 }
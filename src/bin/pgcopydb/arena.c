@@ -0,0 +1,267 @@
+/*
+ * src/bin/pgcopydb/arena.c
+ *   Arena memory allocator and string interning
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "defaults.h"
+#include "log.h"
+
+/* allocations are aligned on 8 bytes */
+#define ARENA_ALIGN(size) (((size) + 7) & ~((size_t) 7))
+
+/* the hash table of interned strings starts with that many slots */
+#define ARENA_STRINGS_INITIAL_SIZE 1024
+
+
+static ArenaBlock * arena_new_block(size_t size);
+static uint32_t arena_hash_string(const char *str);
+static bool arena_grow_strings(Arena *arena);
+
+
+/*
+ * arena_alloc returns size bytes of memory from the arena, or NULL when out
+ * of memory.
+ *
+ * Allocations that are larger than a quarter of a block get a block of
+ * their own, linked after the current one, so that the room left in the
+ * current block is not wasted.
+ */
+void *
+arena_alloc(Arena *arena, size_t size)
+{
+	size = ARENA_ALIGN(size);
+
+	ArenaBlock *block = arena->blocks;
+
+	if (block != NULL && block->size - block->used >= size)
+	{
+		void *ptr = block->data + block->used;
+		block->used += size;
+		return ptr;
+	}
+
+	if (size > ARENA_BLOCK_SIZE / 4)
+	{
+		ArenaBlock *large = arena_new_block(size);
+
+		if (large == NULL)
+		{
+			return NULL;
+		}
+
+		large->used = size;
+		arena->bytes += size;
+
+		if (block == NULL)
+		{
+			arena->blocks = large;
+		}
+		else
+		{
+			large->next = block->next;
+			block->next = large;
+		}
+
+		return large->data;
+	}
+
+	ArenaBlock *next = arena_new_block(ARENA_BLOCK_SIZE);
+
+	if (next == NULL)
+	{
+		return NULL;
+	}
+
+	next->next = block;
+	next->used = size;
+
+	arena->blocks = next;
+	arena->bytes += ARENA_BLOCK_SIZE;
+
+	return next->data;
+}
+
+
+/*
+ * arena_strdup copies the given string in the arena.
+ */
+char *
+arena_strdup(Arena *arena, const char *str)
+{
+	size_t len = strlen(str);
+	char *copy = (char *) arena_alloc(arena, len + 1);
+
+	if (copy == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return NULL;
+	}
+
+	memcpy(copy, str, len + 1);
+
+	return copy;
+}
+
+
+/*
+ * arena_intern returns the arena copy of the given string, which is only
+ * copied the first time we see it. Catalog names such as schema names repeat
+ * a lot, one interned copy is shared by all the objects that use it.
+ */
+char *
+arena_intern(Arena *arena, const char *str)
+{
+	/* keep the load factor under 1/2 */
+	if ((arena->stringsCount + 1) * 2 > arena->stringsSize)
+	{
+		if (!arena_grow_strings(arena))
+		{
+			/* errors have already been logged */
+			return NULL;
+		}
+	}
+
+	uint32_t mask = arena->stringsSize - 1;
+	uint32_t slot = arena_hash_string(str) & mask;
+
+	while (arena->strings[slot] != NULL)
+	{
+		if (strcmp(arena->strings[slot], str) == 0)
+		{
+			return arena->strings[slot];
+		}
+
+		slot = (slot + 1) & mask;
+	}
+
+	char *copy = arena_strdup(arena, str);
+
+	if (copy == NULL)
+	{
+		/* errors have already been logged */
+		return NULL;
+	}
+
+	arena->strings[slot] = copy;
+	++arena->stringsCount;
+
+	return copy;
+}
+
+
+/*
+ * arena_free releases all the memory allocated in the arena at once.
+ */
+void
+arena_free(Arena *arena)
+{
+	ArenaBlock *block = arena->blocks;
+
+	while (block != NULL)
+	{
+		ArenaBlock *next = block->next;
+		free(block);
+		block = next;
+	}
+
+	free(arena->strings);
+
+	arena->blocks = NULL;
+	arena->bytes = 0;
+	arena->strings = NULL;
+	arena->stringsSize = 0;
+	arena->stringsCount = 0;
+}
+
+
+/*
+ * arena_new_block allocates a new block with a data area of the given size.
+ */
+static ArenaBlock *
+arena_new_block(size_t size)
+{
+	ArenaBlock *block = (ArenaBlock *) malloc(sizeof(ArenaBlock) + size);
+
+	if (block == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return NULL;
+	}
+
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+
+	return block;
+}
+
+
+/*
+ * arena_hash_string implements the FNV-1a hash function.
+ */
+static uint32_t
+arena_hash_string(const char *str)
+{
+	uint32_t hash = 2166136261u;
+
+	for (const unsigned char *p = (const unsigned char *) str; *p; p++)
+	{
+		hash ^= *p;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+
+/*
+ * arena_grow_strings doubles the size of the interned strings hash table.
+ */
+static bool
+arena_grow_strings(Arena *arena)
+{
+	uint32_t size =
+		arena->stringsSize == 0
+		? ARENA_STRINGS_INITIAL_SIZE
+		: arena->stringsSize * 2;
+
+	char **strings = (char **) calloc(size, sizeof(char *));
+
+	if (strings == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	uint32_t mask = size - 1;
+
+	for (uint32_t i = 0; i < arena->stringsSize; i++)
+	{
+		char *str = arena->strings[i];
+
+		if (str == NULL)
+		{
+			continue;
+		}
+
+		uint32_t slot = arena_hash_string(str) & mask;
+
+		while (strings[slot] != NULL)
+		{
+			slot = (slot + 1) & mask;
+		}
+
+		strings[slot] = str;
+	}
+
+	free(arena->strings);
+
+	arena->strings = strings;
+	arena->stringsSize = size;
+
+	return true;
+}
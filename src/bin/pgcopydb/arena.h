@@ -0,0 +1,43 @@
+/*
+ * src/bin/pgcopydb/arena.h
+ *   Arena memory allocator and string interning
+ */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* allocations are carved out of blocks of that size */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock
+{
+	struct ArenaBlock *next;
+	size_t size;                /* size of the data area */
+	size_t used;
+	char data[];
+} ArenaBlock;
+
+/*
+ * An Arena hands out memory that is only ever released all at once, with
+ * arena_free(). Interned strings are also registered in a hash table, so that
+ * the same string is only stored once in the arena.
+ */
+typedef struct Arena
+{
+	ArenaBlock *blocks;         /* current block first */
+	uint64_t bytes;             /* total size of the blocks */
+
+	char **strings;             /* open addressing hash table */
+	uint32_t stringsSize;       /* power of two */
+	uint32_t stringsCount;
+} Arena;
+
+void * arena_alloc(Arena *arena, size_t size);
+char * arena_strdup(Arena *arena, const char *str);
+char * arena_intern(Arena *arena, const char *str);
+void arena_free(Arena *arena);
+
+#endif /* ARENA_H */
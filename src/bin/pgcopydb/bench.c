@@ -0,0 +1,779 @@
+/*
+ * src/bin/pgcopydb/bench.c
+ *     Measure the COPY throughput of the source and the target separately
+ *
+ * pgcopydb bench runs the same COPY machinery as pgcopydb copy-db, see
+ * pg_copy(), with an increasing count of concurrent jobs:
+ *
+ *  - read: COPY TO STDOUT from the source, and the data is discarded,
+ *  - write: COPY FROM STDIN to the target, with generated rows,
+ *  - copy: COPY from the source to the target, end-to-end.
+ *
+ * The rows are generated with generate_series() on the source, or in
+ * pgcopydb itself for the target, and have an id column and a payload column
+ * of --row-size bytes. With bench read, --table reads an existing table.
+ *
+ * Each job is a sub-process that opens its connections, and then waits until
+ * all the jobs of the step are ready, so that connection times are not
+ * measured and the jobs run concurrently.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "cli_common.h"
+#include "copydb.h"
+#include "log.h"
+#include "parson.h"
+#include "pgsql.h"
+#include "signals.h"
+#include "string_utils.h"
+
+
+/* each job has its own slot in shared memory, and is the only writer */
+typedef struct BenchJob
+{
+	bool ready;                 /* connected, waiting for the start signal */
+	bool done;
+	bool failed;
+	uint64_t durationUs;
+	CopyStats stats;
+} BenchJob;
+
+typedef struct BenchArea
+{
+	size_t size;                /* size of the shared memory area */
+	bool start;                 /* all the jobs are ready, go */
+	bool abort;                 /* a job failed before the start */
+	BenchJob jobs[];
+} BenchArea;
+
+/* bench write generates "id\tpayload\n" text COPY rows */
+typedef struct BenchRowGenerator
+{
+	uint64_t next;
+	uint64_t rows;
+	char *buffer;               /* malloc'ed area: id, then payload */
+	int rowSize;
+} BenchRowGenerator;
+
+/* room for the id and its tab separator in front of the payload */
+#define BENCH_ID_SIZE 24
+
+
+static bool bench_run_step(BenchSpecs *specs, int jobs, BenchResult *result);
+static bool bench_start_jobs(BenchSpecs *specs, BenchArea *area, int jobs);
+static bool bench_wait_for_jobs(BenchArea *area, int jobs);
+static bool bench_job(BenchSpecs *specs, BenchArea *area, int jobIndex);
+static bool bench_job_run(BenchSpecs *specs, BenchJob *job, int jobIndex,
+						  PGSQL *src, PGSQL *dst, BenchArea *area);
+static bool bench_prepare_table(PGSQL *dst, const char *qname);
+static bool bench_generate_row(void *context, const char **row, int *len);
+static void bench_throughput(BenchResult *result, double *mbps, double *rps);
+static char * bench_bound(CopyStats *stats);
+static void bench_print_json(BenchSpecs *specs, BenchResult *results);
+
+
+/*
+ * bench_parse_jobs parses the --jobs option, a comma separated list of job
+ * counts such as 1,2,4,8, one per step of the benchmark.
+ */
+bool
+bench_parse_jobs(const char *str, BenchSpecs *specs)
+{
+	char buffer[BUFSIZE] = { 0 };
+	char *saveptr = NULL;
+
+	strlcpy(buffer, str, sizeof(buffer));
+
+	specs->stepCount = 0;
+
+	for (char *token = strtok_r(buffer, ",", &saveptr);
+		 token != NULL;
+		 token = strtok_r(NULL, ",", &saveptr))
+	{
+		int jobs = 0;
+
+		if (specs->stepCount >= BENCH_MAX_STEPS)
+		{
+			log_error("Failed to parse --jobs \"%s\": "
+					  "pgcopydb bench supports up to %d steps",
+					  str,
+					  BENCH_MAX_STEPS);
+			return false;
+		}
+
+		if (!stringToInt(token, &jobs) || jobs < 1 || jobs > 128)
+		{
+			log_error("Failed to parse --jobs \"%s\": "
+					  "\"%s\" is not a count of jobs between 1 and 128",
+					  str,
+					  token);
+			return false;
+		}
+
+		specs->jobs[specs->stepCount++] = jobs;
+	}
+
+	if (specs->stepCount == 0)
+	{
+		log_error("Failed to parse --jobs \"%s\"", str);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * BenchModeToString returns the name of the bench command of the mode.
+ */
+char *
+BenchModeToString(BenchMode mode)
+{
+	switch (mode)
+	{
+		case BENCH_MODE_READ:
+		{
+			return "read";
+		}
+
+		case BENCH_MODE_WRITE:
+		{
+			return "write";
+		}
+
+		case BENCH_MODE_COPY:
+		{
+			return "copy";
+		}
+	}
+
+	return "unknown";
+}
+
+
+/*
+ * bench_run runs a step of the benchmark per --jobs count, and fills-in one
+ * result per step. We stop at the first step that fails.
+ */
+bool
+bench_run(BenchSpecs *specs, BenchResult *results)
+{
+	for (int i = 0; i < specs->stepCount; i++)
+	{
+		int jobs = specs->jobs[i];
+
+		log_info("Running pgcopydb bench %s with %d jobs of %lld rows",
+				 BenchModeToString(specs->mode),
+				 jobs,
+				 (long long) specs->rows);
+
+		if (!bench_run_step(specs, jobs, &(results[i])))
+		{
+			log_error("Failed to run pgcopydb bench %s with %d jobs, "
+					  "see above for details",
+					  BenchModeToString(specs->mode),
+					  jobs);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * bench_run_step runs the given count of jobs concurrently, and sums their
+ * statistics in the result. The duration is the longest of the jobs COPY
+ * durations, which leave out preparing and dropping the job tables, and
+ * closing the connections.
+ */
+static bool
+bench_run_step(BenchSpecs *specs, int jobs, BenchResult *result)
+{
+	size_t size = sizeof(BenchArea) + jobs * sizeof(BenchJob);
+
+	void *p = mmap(NULL, size,
+				   PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_ANONYMOUS,
+				   -1, 0);
+
+	if (p == MAP_FAILED)
+	{
+		log_error("Failed to create the benchmark shared memory: %m");
+		return false;
+	}
+
+	BenchArea *area = (BenchArea *) p;
+
+	memset(area, 0, size);
+	area->size = size;
+
+	result->jobs = jobs;
+	result->durationUs = 0;
+	result->success = false;
+
+	if (!bench_start_jobs(specs, area, jobs))
+	{
+		/* errors have already been logged */
+		area->abort = true;
+		(void) copydb_wait_for_subprocesses();
+		(void) munmap(p, size);
+		return false;
+	}
+
+	if (!bench_wait_for_jobs(area, jobs))
+	{
+		area->abort = true;
+		(void) copydb_wait_for_subprocesses();
+		(void) munmap(p, size);
+		return false;
+	}
+
+	area->start = true;
+
+	bool success = copydb_wait_for_subprocesses();
+
+	for (int i = 0; i < jobs; i++)
+	{
+		BenchJob *job = &(area->jobs[i]);
+
+		if (job->failed || !job->done)
+		{
+			success = false;
+		}
+
+		if (job->durationUs > result->durationUs)
+		{
+			result->durationUs = job->durationUs;
+		}
+
+		result->stats.rows += job->stats.rows;
+		result->stats.bytes += job->stats.bytes;
+		result->stats.flushes += job->stats.flushes;
+		result->stats.srcWaitUs += job->stats.srcWaitUs;
+		result->stats.dstWaitUs += job->stats.dstWaitUs;
+
+		if (job->stats.peakBufferSize > result->stats.peakBufferSize)
+		{
+			result->stats.peakBufferSize = job->stats.peakBufferSize;
+		}
+	}
+
+	result->success = success;
+
+	if (munmap(p, size) != 0)
+	{
+		log_warn("Failed to release the benchmark shared memory: %m");
+	}
+
+	return success;
+}
+
+
+/*
+ * bench_start_jobs forks the given count of job sub-processes.
+ */
+static bool
+bench_start_jobs(BenchSpecs *specs, BenchArea *area, int jobs)
+{
+	for (int jobIndex = 0; jobIndex < jobs; jobIndex++)
+	{
+		/* Flush stdio channels just before fork, to avoid double-output problems */
+		fflush(stdout);
+		fflush(stderr);
+
+		int fpid = fork();
+
+		switch (fpid)
+		{
+			case -1:
+			{
+				log_error("Failed to fork benchmark job %d", jobIndex);
+				return false;
+			}
+
+			case 0:
+			{
+				/* child process runs the command */
+				bool success = bench_job(specs, area, jobIndex);
+
+				area->jobs[jobIndex].failed = !success;
+				area->jobs[jobIndex].done = true;
+
+				if (!success)
+				{
+					/* errors have already been logged */
+					exit(EXIT_CODE_INTERNAL_ERROR);
+				}
+
+				exit(EXIT_CODE_QUIT);
+			}
+
+			default:
+			{
+				/* fork succeeded, in parent */
+				log_debug("[%d] is benchmark job %d", fpid, jobIndex);
+				break;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * bench_wait_for_jobs waits until all the jobs are connected and ready to
+ * start, and returns false when one of them failed before that.
+ */
+static bool
+bench_wait_for_jobs(BenchArea *area, int jobs)
+{
+	for (;;)
+	{
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			return false;
+		}
+
+		int readyCount = 0;
+
+		for (int i = 0; i < jobs; i++)
+		{
+			if (area->jobs[i].failed)
+			{
+				log_error("Benchmark job %d failed, see above for details", i);
+				return false;
+			}
+
+			if (area->jobs[i].ready)
+			{
+				++readyCount;
+			}
+		}
+
+		if (readyCount == jobs)
+		{
+			return true;
+		}
+
+		log_flush();
+
+		pg_usleep(10 * 1000); /* 10 ms */
+	}
+}
+
+
+/*
+ * bench_job connects to the source and the target databases as needed by the
+ * benchmark mode, waits until all the jobs are ready, and then runs the COPY.
+ */
+static bool
+bench_job(BenchSpecs *specs, BenchArea *area, int jobIndex)
+{
+	BenchJob *job = &(area->jobs[jobIndex]);
+
+	PGSQL src = { 0 };
+	PGSQL dst = { 0 };
+
+	char dstQname[NAMEDATALEN] = { 0 };
+
+	sformat(dstQname, sizeof(dstQname), "%s_%d", BENCH_TABLE_NAME, jobIndex);
+
+	if (specs->mode != BENCH_MODE_WRITE)
+	{
+		if (!pgsql_init(&src, specs->source_pguri, PGSQL_CONN_SOURCE) ||
+			!pgsql_open_persistent_connection(&src))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	if (specs->mode != BENCH_MODE_READ)
+	{
+		if (!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET) ||
+			!pgsql_open_persistent_connection(&dst) ||
+			!bench_prepare_table(&dst, dstQname))
+		{
+			/* errors have already been logged */
+			pgsql_finish(&src);
+			pgsql_finish(&dst);
+			return false;
+		}
+	}
+
+	bool success = bench_job_run(specs, job, jobIndex, &src, &dst, area);
+
+	/* the COPY might have closed the connection on errors */
+	if (specs->mode != BENCH_MODE_READ)
+	{
+		char sql[BUFSIZE] = { 0 };
+
+		sformat(sql, sizeof(sql), "drop table if exists %s", dstQname);
+
+		if ((dst.connection == NULL && !pgsql_open_persistent_connection(&dst)) ||
+			!pgsql_execute(&dst, sql))
+		{
+			log_warn("Failed to drop benchmark table \"%s\" on the target",
+					 dstQname);
+		}
+	}
+
+	pgsql_finish(&src);
+	pgsql_finish(&dst);
+
+	return success;
+}
+
+
+/*
+ * bench_job_run waits for the start signal and then runs the COPY of the
+ * job, and publishes its statistics.
+ */
+static bool
+bench_job_run(BenchSpecs *specs, BenchJob *job, int jobIndex,
+			  PGSQL *src, PGSQL *dst, BenchArea *area)
+{
+	char srcQname[BUFSIZE] = { 0 };
+	char dstQname[NAMEDATALEN] = { 0 };
+
+	if (IS_EMPTY_STRING_BUFFER(specs->table))
+	{
+		sformat(srcQname, sizeof(srcQname),
+				"(select g as id, repeat('x', %d) as payload "
+				"from generate_series(1, %lld) as g)",
+				specs->rowSize,
+				(long long) specs->rows);
+	}
+	else
+	{
+		strlcpy(srcQname, specs->table, sizeof(srcQname));
+	}
+
+	sformat(dstQname, sizeof(dstQname), "%s_%d", BENCH_TABLE_NAME, jobIndex);
+
+	CopyArgs args = {
+		.srcQname = srcQname,
+		.dstQname = dstQname,
+		.format = COPY_FORMAT_TEXT,
+		.freeze = false,
+		.bufferSize = specs->copyBufferSize,
+		.pipelineDepth = specs->copyPipelineDepth,
+		.keepConnections = true,
+		.fanout = NULL,
+		.fanoutCount = 0,
+		.throttle = NULL,
+		.throttleContext = NULL,
+		.progress = NULL
+	};
+
+	job->ready = true;
+
+	while (!area->start)
+	{
+		/* don't block user's interrupt (C-c and the like) */
+		if (area->abort || asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			return false;
+		}
+
+		log_flush();
+
+		pg_usleep(1000); /* 1 ms */
+	}
+
+	instr_time startTime;
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	bool success = false;
+
+	switch (specs->mode)
+	{
+		case BENCH_MODE_READ:
+		{
+			success = pg_copy_read(src, &args, &(job->stats));
+			break;
+		}
+
+		case BENCH_MODE_WRITE:
+		{
+			BenchRowGenerator generator = {
+				.next = 1,
+				.rows = specs->rows,
+				.buffer = NULL,
+				.rowSize = specs->rowSize
+			};
+
+			generator.buffer = (char *) malloc(BENCH_ID_SIZE + specs->rowSize + 1);
+
+			if (generator.buffer == NULL)
+			{
+				log_fatal(ALLOCATION_FAILED_ERROR);
+				return false;
+			}
+
+			/* the payload never changes, only the id in front of it does */
+			memset(generator.buffer + BENCH_ID_SIZE, 'x', specs->rowSize);
+			generator.buffer[BENCH_ID_SIZE + specs->rowSize] = '\n';
+
+			success = pg_copy_from_rows(dst, &args,
+										&bench_generate_row, &generator,
+										&(job->stats));
+
+			free(generator.buffer);
+			break;
+		}
+
+		case BENCH_MODE_COPY:
+		{
+			success = pg_copy(src, dst, &args, &(job->stats));
+			break;
+		}
+	}
+
+	instr_time duration;
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, startTime);
+
+	job->durationUs = INSTR_TIME_GET_MICROSEC(duration);
+
+	return success;
+}
+
+
+/*
+ * bench_prepare_table creates the table where a benchmark job writes, with
+ * the same columns as the generated rows. A table left over by a previous
+ * run that was interrupted is dropped first.
+ */
+static bool
+bench_prepare_table(PGSQL *dst, const char *qname)
+{
+	char sql[BUFSIZE] = { 0 };
+
+	sformat(sql, sizeof(sql), "drop table if exists %s", qname);
+
+	if (!pgsql_execute(dst, sql))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	sformat(sql, sizeof(sql),
+			"create table %s(id bigint, payload text)",
+			qname);
+
+	return pgsql_execute(dst, sql);
+}
+
+
+/*
+ * bench_generate_row is a CopyNextRowCB that returns the next generated row,
+ * in the COPY text format. The payload is set once, and the id is formatted
+ * right in front of it, so that a row costs a single small sformat() call.
+ */
+static bool
+bench_generate_row(void *context, const char **row, int *len)
+{
+	BenchRowGenerator *generator = (BenchRowGenerator *) context;
+
+	if (generator->next > generator->rows)
+	{
+		return false;
+	}
+
+	char id[BENCH_ID_SIZE] = { 0 };
+
+	int idLen = sformat(id, sizeof(id), "%" PRIu64 "\t", generator->next++);
+	char *start = generator->buffer + BENCH_ID_SIZE - idLen;
+
+	memcpy(start, id, idLen);
+
+	*row = start;
+	*len = idLen + generator->rowSize + 1;
+
+	return true;
+}
+
+
+/*
+ * bench_print_results prints the results of each step of the benchmark, with
+ * the speedup of each step relative to the first one.
+ */
+void
+bench_print_results(BenchSpecs *specs, BenchResult *results)
+{
+	if (outputJSON)
+	{
+		(void) bench_print_json(specs, results);
+		return;
+	}
+
+	double baseMbps = 0.0;
+
+	fformat(stdout, "\n");
+
+	fformat(stdout, "%5s | %12s | %10s | %10s | %8s | %10s | %7s | %6s\n",
+			"jobs", "rows", "bytes", "duration", "MB/s", "rows/s",
+			"speedup", "bound");
+
+	fformat(stdout, "%5s-+-%12s-+-%10s-+-%10s-+-%8s-+-%10s-+-%7s-+-%6s\n",
+			"-----", "------------", "----------", "----------", "--------",
+			"----------", "-------", "------");
+
+	for (int i = 0; i < specs->stepCount; i++)
+	{
+		BenchResult *result = &(results[i]);
+
+		char bytes[BUFSIZE] = { 0 };
+		char duration[BUFSIZE] = { 0 };
+		char speedup[BUFSIZE] = { 0 };
+
+		double mbps = 0.0;
+		double rps = 0.0;
+
+		(void) bench_throughput(result, &mbps, &rps);
+
+		if (i == 0)
+		{
+			baseMbps = mbps;
+		}
+
+		(void) pretty_print_bytes(bytes, sizeof(bytes), result->stats.bytes);
+
+		sformat(duration, sizeof(duration), "%.3fs",
+				(double) result->durationUs / 1000000.0);
+
+		if (baseMbps > 0.0)
+		{
+			sformat(speedup, sizeof(speedup), "%.2fx", mbps / baseMbps);
+		}
+		else
+		{
+			strlcpy(speedup, "-", sizeof(speedup));
+		}
+
+		fformat(stdout, "%5d | %12lld | %10s | %10s | %8.1f | %10.0f | %7s | %6s\n",
+				result->jobs,
+				(long long) result->stats.rows,
+				bytes,
+				duration,
+				mbps,
+				rps,
+				speedup,
+				bench_bound(&(result->stats)));
+	}
+
+	fformat(stdout, "\n");
+}
+
+
+/*
+ * bench_throughput computes the MB/s and rows/s of the given step.
+ */
+static void
+bench_throughput(BenchResult *result, double *mbps, double *rps)
+{
+	double seconds = (double) result->durationUs / 1000000.0;
+
+	if (seconds > 0.0)
+	{
+		*mbps = ((double) result->stats.bytes / (1024 * 1024)) / seconds;
+		*rps = (double) result->stats.rows / seconds;
+	}
+	else
+	{
+		*mbps = 0.0;
+		*rps = 0.0;
+	}
+}
+
+
+/*
+ * bench_bound returns which side the COPY was waiting on, as in the summary
+ * table of pgcopydb copy-db. Only bench copy reads and writes, the other
+ * modes wait on the only side they use.
+ */
+static char *
+bench_bound(CopyStats *stats)
+{
+	if (stats->srcWaitUs == 0 && stats->dstWaitUs == 0)
+	{
+		return "-";
+	}
+	else if (stats->srcWaitUs >= 2 * stats->dstWaitUs)
+	{
+		return "source";
+	}
+	else if (stats->dstWaitUs >= 2 * stats->srcWaitUs)
+	{
+		return "target";
+	}
+
+	return "both";
+}
+
+
+/*
+ * bench_print_json prints the results as a JSON object, with the steps in
+ * an array.
+ */
+static void
+bench_print_json(BenchSpecs *specs, BenchResult *results)
+{
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *jsObj = json_value_get_object(js);
+
+	json_object_set_string(jsObj, "mode", BenchModeToString(specs->mode));
+	json_object_set_number(jsObj, "rows-per-job", (double) specs->rows);
+	json_object_set_number(jsObj, "row-size", (double) specs->rowSize);
+
+	if (!IS_EMPTY_STRING_BUFFER(specs->table))
+	{
+		json_object_set_string(jsObj, "table", specs->table);
+	}
+
+	JSON_Value *jsSteps = json_value_init_array();
+	JSON_Array *jsStepsArray = json_value_get_array(jsSteps);
+
+	for (int i = 0; i < specs->stepCount; i++)
+	{
+		BenchResult *result = &(results[i]);
+
+		double mbps = 0.0;
+		double rps = 0.0;
+
+		(void) bench_throughput(result, &mbps, &rps);
+
+		JSON_Value *jsStep = json_value_init_object();
+		JSON_Object *jsStepObj = json_value_get_object(jsStep);
+
+		json_object_set_number(jsStepObj, "jobs", (double) result->jobs);
+		json_object_set_number(jsStepObj, "rows", (double) result->stats.rows);
+		json_object_set_number(jsStepObj, "bytes", (double) result->stats.bytes);
+		json_object_set_number(jsStepObj, "duration-ms",
+							   (double) result->durationUs / 1000.0);
+		json_object_set_number(jsStepObj, "mbps", mbps);
+		json_object_set_number(jsStepObj, "rows-per-second", rps);
+		json_object_set_number(jsStepObj, "src-wait-ms",
+							   (double) result->stats.srcWaitUs / 1000.0);
+		json_object_set_number(jsStepObj, "dst-wait-ms",
+							   (double) result->stats.dstWaitUs / 1000.0);
+		json_object_set_string(jsStepObj, "bound",
+							   bench_bound(&(result->stats)));
+
+		json_array_append_value(jsStepsArray, jsStep);
+	}
+
+	json_object_set_value(jsObj, "steps", jsSteps);
+
+	(void) cli_pprint_json(js);
+}
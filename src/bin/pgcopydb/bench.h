@@ -0,0 +1,64 @@
+/*
+ * src/bin/pgcopydb/bench.h
+ *     Measure the COPY throughput of the source and the target separately
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pgsql.h"
+
+/* --jobs 1,2,4,8 runs that many steps, one per count of jobs */
+#define BENCH_MAX_STEPS 16
+#define BENCH_DEFAULT_JOBS "1,2,4,8"
+#define BENCH_DEFAULT_ROWS 1000000
+#define BENCH_DEFAULT_ROW_SIZE 100
+#define BENCH_MAX_ROW_SIZE (1024 * 1024)
+
+/* each job writes to its own table on the target, then drops it */
+#define BENCH_TABLE_NAME "pgcopydb_bench"
+
+typedef enum
+{
+	BENCH_MODE_READ = 0,        /* COPY TO STDOUT, data is discarded */
+	BENCH_MODE_WRITE,           /* COPY FROM STDIN, data is generated */
+	BENCH_MODE_COPY             /* COPY from the source to the target */
+} BenchMode;
+
+typedef struct BenchSpecs
+{
+	BenchMode mode;
+
+	char source_pguri[MAXCONNINFO];
+	char target_pguri[MAXCONNINFO];
+
+	/* bench read --table reads that table rather than generated rows */
+	char table[BUFSIZE];
+
+	int jobs[BENCH_MAX_STEPS];
+	int stepCount;
+
+	uint64_t rows;              /* per job */
+	int rowSize;                /* bytes in the payload column */
+
+	int copyBufferSize;
+	int copyPipelineDepth;
+} BenchSpecs;
+
+typedef struct BenchResult
+{
+	int jobs;
+	bool success;
+	uint64_t durationUs;        /* from the start of the first job */
+	CopyStats stats;            /* sum of the stats of all the jobs */
+} BenchResult;
+
+bool bench_parse_jobs(const char *str, BenchSpecs *specs);
+char * BenchModeToString(BenchMode mode);
+
+bool bench_run(BenchSpecs *specs, BenchResult *results);
+void bench_print_results(BenchSpecs *specs, BenchResult *results);
+
+#endif /* BENCH_H */
@@ -0,0 +1,573 @@
+/*
+ * src/bin/pgcopydb/bulkload.c
+ *     Implementation of a CLI to copy a database between two Postgres instances
+ */
+
+#include <ctype.h>
+#include <string.h>
+
+#include "copydb.h"
+#include "file_utils.h"
+#include "log.h"
+#include "pgsql.h"
+#include "string_utils.h"
+
+
+static bool copydb_parse_bulk_load_setting(char *str, BulkLoadSetting *setting);
+static bool copydb_bulk_load_phase_from_string(const char *str,
+											   BulkLoadPhase *phase);
+static bool copydb_bulk_load_name_is_valid(const char *name);
+static bool copydb_append_session_option(char *options, size_t size,
+										 BulkLoadSetting *setting);
+
+
+/*
+ * copydb_parse_bulk_load_profile parses a --bulk-load-profile string, which
+ * is a comma separated list of [phase.]name=value settings, such as:
+ *
+ *   synchronous_commit=off,index.maintenance_work_mem=2GB
+ *
+ * A setting without a phase prefix applies to all the target connections.
+ * The prefix is only a phase when it's one of copy, index, constraints or
+ * vacuum, so that custom settings such as auto_explain.log_min_duration can
+ * still be used.
+ */
+bool
+copydb_parse_bulk_load_profile(const char *str, BulkLoadProfile *profile)
+{
+	char buffer[BUFSIZE] = { 0 };
+
+	profile->count = 0;
+
+	if (strlcpy(buffer, str, sizeof(buffer)) >= sizeof(buffer))
+	{
+		log_error("Failed to parse bulk-load profile: "
+				  "string is longer than %d bytes",
+				  BUFSIZE - 1);
+		return false;
+	}
+
+	char *ptr = buffer;
+
+	while (ptr != NULL)
+	{
+		char *next = strchr(ptr, ',');
+
+		if (next != NULL)
+		{
+			*next = '\0';
+			++next;
+		}
+
+		/* skip empty entries, such as with a trailing comma */
+		char *entry = ptr;
+
+		while (isspace((unsigned char) *entry))
+		{
+			++entry;
+		}
+
+		if (*entry != '\0')
+		{
+			if (profile->count == MAX_BULK_LOAD_SETTINGS)
+			{
+				log_error("Failed to parse bulk-load profile: "
+						  "pgcopydb supports up to %d settings",
+						  MAX_BULK_LOAD_SETTINGS);
+				return false;
+			}
+
+			BulkLoadSetting *setting = &(profile->array[profile->count]);
+
+			if (!copydb_parse_bulk_load_setting(entry, setting))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+
+			for (int i = 0; i < profile->count; i++)
+			{
+				BulkLoadSetting *other = &(profile->array[i]);
+
+				if (other->phase == setting->phase &&
+					strcmp(other->name, setting->name) == 0)
+				{
+					log_error("Failed to parse bulk-load profile: "
+							  "setting \"%s%s%s\" is used more than once",
+							  setting->phase == BULK_LOAD_PHASE_ALL ? "" :
+							  copydb_bulk_load_phase_to_string(setting->phase),
+							  setting->phase == BULK_LOAD_PHASE_ALL ? "" : ".",
+							  setting->name);
+					return false;
+				}
+			}
+
+			++profile->count;
+		}
+
+		ptr = next;
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_parse_bulk_load_setting parses a single [phase.]name=value entry.
+ */
+static bool
+copydb_parse_bulk_load_setting(char *str, BulkLoadSetting *setting)
+{
+	char *equal = strchr(str, '=');
+
+	if (equal == NULL)
+	{
+		log_error("Failed to parse bulk-load setting \"%s\": "
+				  "expected name=value",
+				  str);
+		return false;
+	}
+
+	*equal = '\0';
+
+	char *name = str;
+	char *value = equal + 1;
+
+	/* trim spaces around the name and around the value */
+	char *end = equal - 1;
+
+	while (end >= name && isspace((unsigned char) *end))
+	{
+		*end-- = '\0';
+	}
+
+	while (isspace((unsigned char) *value))
+	{
+		++value;
+	}
+
+	end = value + strlen(value) - 1;
+
+	while (end >= value && isspace((unsigned char) *end))
+	{
+		*end-- = '\0';
+	}
+
+	setting->phase = BULK_LOAD_PHASE_ALL;
+
+	char *dot = strchr(name, '.');
+
+	if (dot != NULL)
+	{
+		*dot = '\0';
+
+		if (copydb_bulk_load_phase_from_string(name, &(setting->phase)))
+		{
+			name = dot + 1;
+		}
+		else
+		{
+			*dot = '.';
+		}
+	}
+
+	if (!copydb_bulk_load_name_is_valid(name))
+	{
+		log_error("Failed to parse bulk-load setting \"%s\": "
+				  "invalid setting name",
+				  name);
+		return false;
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(value))
+	{
+		log_error("Failed to parse bulk-load setting \"%s\": "
+				  "value is empty",
+				  name);
+		return false;
+	}
+
+	if (strlcpy(setting->name, name, sizeof(setting->name)) >=
+		sizeof(setting->name) ||
+		strlcpy(setting->value, value, sizeof(setting->value)) >=
+		sizeof(setting->value))
+	{
+		log_error("Failed to parse bulk-load setting \"%s\": "
+				  "name or value is too long",
+				  name);
+		return false;
+	}
+
+	setting->effective[0] = '\0';
+
+	return true;
+}
+
+
+/*
+ * copydb_bulk_load_phase_from_string parses a bulk-load phase name.
+ */
+static bool
+copydb_bulk_load_phase_from_string(const char *str, BulkLoadPhase *phase)
+{
+	if (strcmp(str, "copy") == 0)
+	{
+		*phase = BULK_LOAD_PHASE_COPY;
+		return true;
+	}
+	else if (strcmp(str, "index") == 0)
+	{
+		*phase = BULK_LOAD_PHASE_INDEX;
+		return true;
+	}
+	else if (strcmp(str, "constraints") == 0)
+	{
+		*phase = BULK_LOAD_PHASE_CONSTRAINTS;
+		return true;
+	}
+	else if (strcmp(str, "vacuum") == 0)
+	{
+		*phase = BULK_LOAD_PHASE_VACUUM;
+		return true;
+	}
+
+	return false;
+}
+
+
+/*
+ * copydb_bulk_load_phase_to_string returns the name of a bulk-load phase.
+ */
+char *
+copydb_bulk_load_phase_to_string(BulkLoadPhase phase)
+{
+	switch (phase)
+	{
+		case BULK_LOAD_PHASE_ALL:
+		{
+			return "all";
+		}
+
+		case BULK_LOAD_PHASE_COPY:
+		{
+			return "copy";
+		}
+
+		case BULK_LOAD_PHASE_INDEX:
+		{
+			return "index";
+		}
+
+		case BULK_LOAD_PHASE_CONSTRAINTS:
+		{
+			return "constraints";
+		}
+
+		case BULK_LOAD_PHASE_VACUUM:
+		{
+			return "vacuum";
+		}
+	}
+
+	return "unknown";
+}
+
+
+/*
+ * copydb_bulk_load_name_is_valid returns true when the given setting name
+ * only uses letters, digits, underscores and dots. The name is then used
+ * as-is in connection options and in RESET commands.
+ */
+static bool
+copydb_bulk_load_name_is_valid(const char *name)
+{
+	if (IS_EMPTY_STRING_BUFFER(name))
+	{
+		return false;
+	}
+
+	for (const char *ptr = name; *ptr != '\0'; ptr++)
+	{
+		if (!isalnum((unsigned char) *ptr) && *ptr != '_' && *ptr != '.')
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_set_target_session prepares the given connection to use the
+ * settings of the bulk-load profile that apply to all the target
+ * connections, and then the settings of the given phase, which override the
+ * former.
+ *
+ * The settings are sent as connection options ("-c name=value") rather than
+ * with SET commands: they are then the session defaults, and survive a
+ * RESET, such as the one that copydb_create_index() uses after a CREATE
+ * INDEX command.
+ */
+bool
+copydb_set_target_session(BulkLoadProfile *profile,
+						  BulkLoadPhase phase,
+						  PGSQL *pgsql)
+{
+	char options[BUFSIZE] = { 0 };
+
+	BulkLoadPhase phases[] = { BULK_LOAD_PHASE_ALL, phase };
+	int phaseCount = phase == BULK_LOAD_PHASE_ALL ? 1 : 2;
+
+	for (int p = 0; p < phaseCount; p++)
+	{
+		for (int i = 0; i < profile->count; i++)
+		{
+			BulkLoadSetting *setting = &(profile->array[i]);
+
+			if (setting->phase != phases[p])
+			{
+				continue;
+			}
+
+			if (!copydb_append_session_option(options, sizeof(options), setting))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+		}
+	}
+
+	strlcpy(pgsql->sessionOptions, options, sizeof(pgsql->sessionOptions));
+
+	return true;
+}
+
+
+/*
+ * copydb_append_session_option appends "-c name=value" to the given libpq
+ * options string, where spaces and backslashes have to be escaped with a
+ * backslash.
+ */
+static bool
+copydb_append_session_option(char *options, size_t size,
+							 BulkLoadSetting *setting)
+{
+	size_t len = strlen(options);
+
+	int n = sformat(options + len, size - len, "%s-c %s=",
+					len > 0 ? " " : "",
+					setting->name);
+
+	len += n;
+
+	for (const char *ptr = setting->value; *ptr != '\0' && len < size; ptr++)
+	{
+		if (*ptr == ' ' || *ptr == '\\')
+		{
+			options[len++] = '\\';
+		}
+
+		if (len < size)
+		{
+			options[len++] = *ptr;
+		}
+	}
+
+	if (len >= size)
+	{
+		log_error("Failed to prepare target connection options: the "
+				  "bulk-load profile is longer than %lld bytes",
+				  (long long) size - 1);
+		return false;
+	}
+
+	options[len] = '\0';
+
+	return true;
+}
+
+
+/*
+ * copydb_bulk_load_begin_phase sets the settings of the given phase on an
+ * open target connection. This is used for the constraints phase, which runs
+ * on the connection of an index worker.
+ */
+bool
+copydb_bulk_load_begin_phase(BulkLoadProfile *profile,
+							 BulkLoadPhase phase,
+							 PGSQL *pgsql)
+{
+	char *sql = "select pg_catalog.set_config($1, $2, false)";
+
+	for (int i = 0; i < profile->count; i++)
+	{
+		BulkLoadSetting *setting = &(profile->array[i]);
+
+		if (setting->phase != phase)
+		{
+			continue;
+		}
+
+		int paramCount = 2;
+		Oid paramTypes[2] = { TEXTOID, TEXTOID };
+		const char *paramValues[2] = { setting->name, setting->value };
+
+		if (!pgsql_execute_with_params(pgsql, sql,
+									   paramCount, paramTypes, paramValues,
+									   NULL, NULL))
+		{
+			log_error("Failed to set \"%s\" to \"%s\" for the %s phase",
+					  setting->name,
+					  setting->value,
+					  copydb_bulk_load_phase_to_string(phase));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_bulk_load_end_phase resets the settings of the given phase, which
+ * then get back to the values of the connection options.
+ */
+bool
+copydb_bulk_load_end_phase(BulkLoadProfile *profile,
+						   BulkLoadPhase phase,
+						   PGSQL *pgsql)
+{
+	for (int i = 0; i < profile->count; i++)
+	{
+		BulkLoadSetting *setting = &(profile->array[i]);
+
+		if (setting->phase != phase)
+		{
+			continue;
+		}
+
+		char sql[BUFSIZE] = { 0 };
+
+		sformat(sql, sizeof(sql), "RESET %s", setting->name);
+
+		if (!pgsql_execute(pgsql, sql))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_check_bulk_load_profile connects to the target database with the
+ * settings of each phase of the bulk-load profile, and fetches the effective
+ * value of each setting. This fails early when a setting can't be used, and
+ * the effective values are then printed in the summary.
+ */
+bool
+copydb_check_bulk_load_profile(CopyDataSpec *specs)
+{
+	BulkLoadProfile *profile = &(specs->bulkLoadProfile);
+
+	BulkLoadPhase phases[] = {
+		BULK_LOAD_PHASE_ALL,
+		BULK_LOAD_PHASE_COPY,
+		BULK_LOAD_PHASE_INDEX,
+		BULK_LOAD_PHASE_CONSTRAINTS,
+		BULK_LOAD_PHASE_VACUUM
+	};
+
+	int phaseCount = sizeof(phases) / sizeof(phases[0]);
+
+	for (int p = 0; p < phaseCount; p++)
+	{
+		BulkLoadPhase phase = phases[p];
+		bool hasSettings = false;
+
+		for (int i = 0; i < profile->count; i++)
+		{
+			if (profile->array[i].phase == phase)
+			{
+				hasSettings = true;
+				break;
+			}
+		}
+
+		if (!hasSettings)
+		{
+			continue;
+		}
+
+		/* constraints are created on the index worker connections */
+		bool setPhase = phase == BULK_LOAD_PHASE_CONSTRAINTS;
+
+		BulkLoadPhase connectionPhase = setPhase ? BULK_LOAD_PHASE_INDEX : phase;
+
+		PGSQL dst = { 0 };
+
+		if (!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET) ||
+			!copydb_set_target_session(profile, connectionPhase, &dst) ||
+			!pgsql_open_persistent_connection(&dst))
+		{
+			log_error("Failed to connect to the target database using "
+					  "the bulk-load profile for the %s phase",
+					  copydb_bulk_load_phase_to_string(phase));
+			return false;
+		}
+
+		if (setPhase && !copydb_bulk_load_begin_phase(profile, phase, &dst))
+		{
+			/* errors have already been logged */
+			pgsql_finish(&dst);
+			return false;
+		}
+
+		for (int i = 0; i < profile->count; i++)
+		{
+			BulkLoadSetting *setting = &(profile->array[i]);
+
+			if (setting->phase != phase)
+			{
+				continue;
+			}
+
+			SingleValueResultContext context =
+			{ { 0 }, PGSQL_RESULT_STRING, false };
+
+			char *sql = "select pg_catalog.current_setting($1)";
+
+			int paramCount = 1;
+			Oid paramTypes[1] = { TEXTOID };
+			const char *paramValues[1] = { setting->name };
+
+			if (!pgsql_execute_with_params(&dst, sql,
+										   paramCount, paramTypes, paramValues,
+										   &context, &parseSingleValueResult) ||
+				!context.parsedOk ||
+				context.strVal == NULL)
+			{
+				log_error("Failed to fetch the value of \"%s\" on the target",
+						  setting->name);
+				pgsql_finish(&dst);
+				return false;
+			}
+
+			strlcpy(setting->effective, context.strVal,
+					sizeof(setting->effective));
+			free(context.strVal);
+
+			log_info("Using %s = '%s' on target connections for the %s phase",
+					 setting->name,
+					 setting->effective,
+					 copydb_bulk_load_phase_to_string(phase));
+		}
+
+		pgsql_finish(&dst);
+	}
+
+	return true;
+}
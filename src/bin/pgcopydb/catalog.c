@@ -0,0 +1,832 @@
+/*
+ * src/bin/pgcopydb/catalog.c
+ *     Cache the source catalogs in the work directory
+ *
+ * Listing the tables of a source database computes the size of each table
+ * and its indexes, which takes minutes on a catalog with hundreds of
+ * thousands of relations. The split workflow (dump schema, restore pre-data,
+ * copy table-data, copy indexes, copy constraints, restore post-data) would
+ * run the same catalog queries in each subcommand.
+ *
+ * The first subcommand writes the tables, indexes, and foreign keys that it
+ * fetched in schema/catalog.json, and the sequences in schema/sequences.json,
+ * along with a fingerprint of the source catalogs, see
+ * schema_catalog_fingerprint(). The next subcommands compute the fingerprint
+ * again, which is cheap, and load the catalog cache when it has not changed.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "parson.h"
+
+#include "copydb.h"
+#include "file_utils.h"
+#include "log.h"
+#include "schema.h"
+#include "string_utils.h"
+
+
+static JSON_Value * copydb_catalog_parse_cache(const char *filename,
+											   const char *fingerprint);
+static JSON_Value * copydb_catalog_attach_to_json(SourceIndexAttachArray *attachArray);
+static bool copydb_catalog_attach_from_json(JSON_Array *jsAttach,
+											SourceIndexAttachArray *attachArray);
+static JSON_Value * copydb_catalog_fkeys_to_json(SourceForeignKeyArray *fkeyArray);
+static bool copydb_catalog_fkeys_from_json(JSON_Array *jsFkeys,
+										   SourceForeignKeyArray *fkeyArray);
+static bool copydb_catalog_write_file(JSON_Value *js, const char *filename);
+
+
+/*
+ * copydb_catalog_fingerprint computes the fingerprint of the source catalogs
+ * in specs->catalogFingerprint. The catalog cache is not used when that
+ * fails, which is not an error.
+ */
+bool
+copydb_catalog_fingerprint(CopyDataSpec *specs, PGSQL *pgsql)
+{
+	if (!schema_catalog_fingerprint(pgsql,
+									specs->catalogFingerprint,
+									sizeof(specs->catalogFingerprint)))
+	{
+		log_warn("Failed to compute the source catalogs fingerprint, "
+				 "skipping the catalog cache");
+		specs->catalogFingerprint[0] = '\0';
+		return false;
+	}
+
+	log_debug("Source catalogs fingerprint is \"%s\"",
+			  specs->catalogFingerprint);
+
+	return true;
+}
+
+
+/*
+ * copydb_catalog_read_cache loads the tables, and the indexes and foreign
+ * keys when asked to, from the catalog cache of the work directory. When the
+ * cache does not exist, has been written for another fingerprint, or lacks
+ * the indexes or the foreign keys, then *cached is false and the caller
+ * fetches the catalogs from the source database.
+ */
+bool
+copydb_catalog_read_cache(CopyDataSpec *specs,
+						  SourceTableArray *tableArray,
+						  bool needIndexes,
+						  bool needForeignKeys,
+						  bool *cached)
+{
+	const char *filename = specs->cfPaths.catalogcachefile;
+
+	*cached = false;
+
+	if (IS_EMPTY_STRING_BUFFER(specs->catalogFingerprint))
+	{
+		return true;
+	}
+
+	JSON_Value *js =
+		copydb_catalog_parse_cache(filename, specs->catalogFingerprint);
+	JSON_Object *root = json_value_get_object(js);
+
+	if (root == NULL)
+	{
+		json_value_free(js);
+		return true;
+	}
+
+	JSON_Array *jsTables = json_object_get_array(root, "tables");
+	JSON_Array *jsIndexes = json_object_get_array(root, "indexes");
+	JSON_Array *jsPartIndexes =
+		json_object_get_array(root, "partitioned-indexes");
+	JSON_Array *jsAttach = json_object_get_array(root, "index-attachments");
+	JSON_Array *jsFkeys = json_object_get_array(root, "foreign-keys");
+
+	if (jsTables == NULL ||
+		(needIndexes &&
+		 (jsIndexes == NULL || jsPartIndexes == NULL || jsAttach == NULL)) ||
+		(needForeignKeys && jsFkeys == NULL))
+	{
+		log_debug("Catalog cache \"%s\" lacks the indexes or foreign keys",
+				  filename);
+		json_value_free(js);
+		return true;
+	}
+
+	if (!copydb_catalog_tables_from_json(jsTables, tableArray) ||
+		(needIndexes &&
+		 (!copydb_catalog_indexes_from_json(jsIndexes,
+											&(specs->sourceIndexArray)) ||
+		  !copydb_catalog_indexes_from_json(
+			  jsPartIndexes,
+			  &(specs->sourcePartitionedIndexArray)) ||
+		  !copydb_catalog_attach_from_json(
+			  jsAttach,
+			  &(specs->sourceIndexAttachArray)))) ||
+		(needForeignKeys &&
+		 !copydb_catalog_fkeys_from_json(jsFkeys, &(specs->sourceFkeyArray))))
+	{
+		log_error("Failed to parse the catalog cache \"%s\"", filename);
+		json_value_free(js);
+		return false;
+	}
+
+	json_value_free(js);
+
+	log_info("Read the list of %d tables, %d indexes, and %d foreign keys "
+			 "from the catalog cache \"%s\"",
+			 tableArray->count,
+			 specs->sourceIndexArray.count,
+			 specs->sourceFkeyArray.count,
+			 filename);
+
+	*cached = true;
+
+	return true;
+}
+
+
+/*
+ * copydb_catalog_write_cache writes the tables, and the indexes and foreign
+ * keys when they have been fetched, to the catalog cache of the work
+ * directory.
+ */
+bool
+copydb_catalog_write_cache(CopyDataSpec *specs,
+						   SourceTableArray *tableArray,
+						   bool hasIndexes,
+						   bool hasForeignKeys)
+{
+	if (IS_EMPTY_STRING_BUFFER(specs->catalogFingerprint))
+	{
+		return true;
+	}
+
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *root = json_value_get_object(js);
+
+	json_object_set_string(root, "pgcopydb", PGCOPYDB_VERSION);
+	json_object_set_string(root, "fingerprint", specs->catalogFingerprint);
+
+	json_object_set_value(root, "tables",
+						  copydb_catalog_tables_to_json(specs, tableArray));
+
+	if (hasIndexes)
+	{
+		json_object_set_value(root, "indexes",
+							  copydb_catalog_indexes_to_json(
+								  &(specs->sourceIndexArray)));
+
+		json_object_set_value(root, "partitioned-indexes",
+							  copydb_catalog_indexes_to_json(
+								  &(specs->sourcePartitionedIndexArray)));
+
+		json_object_set_value(root, "index-attachments",
+							  copydb_catalog_attach_to_json(
+								  &(specs->sourceIndexAttachArray)));
+	}
+
+	if (hasForeignKeys)
+	{
+		json_object_set_value(root, "foreign-keys",
+							  copydb_catalog_fkeys_to_json(
+								  &(specs->sourceFkeyArray)));
+	}
+
+	bool success = copydb_catalog_write_file(js, specs->cfPaths.catalogcachefile);
+
+	json_value_free(js);
+
+	return success;
+}
+
+
+/*
+ * copydb_catalog_read_sequences_cache loads the list of sequences from the
+ * sequences cache of the work directory, without their values.
+ */
+bool
+copydb_catalog_read_sequences_cache(CopyDataSpec *specs,
+									SourceSequenceArray *sequenceArray,
+									bool *cached)
+{
+	const char *filename = specs->cfPaths.sequencecachefile;
+
+	*cached = false;
+
+	if (IS_EMPTY_STRING_BUFFER(specs->catalogFingerprint))
+	{
+		return true;
+	}
+
+	JSON_Value *js =
+		copydb_catalog_parse_cache(filename, specs->catalogFingerprint);
+	JSON_Object *root = json_value_get_object(js);
+	JSON_Array *jsSequences = json_object_get_array(root, "sequences");
+
+	if (jsSequences == NULL)
+	{
+		json_value_free(js);
+		return true;
+	}
+
+	int count = json_array_get_count(jsSequences);
+
+	sequenceArray->count = count;
+	sequenceArray->array =
+		(SourceSequence *) calloc(count + 1, sizeof(SourceSequence));
+
+	if (sequenceArray->array == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		json_value_free(js);
+		return false;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		JSON_Object *jsSeq = json_array_get_object(jsSequences, i);
+		SourceSequence *seq = &(sequenceArray->array[i]);
+
+		const char *nspname = json_object_get_string(jsSeq, "schema");
+		const char *relname = json_object_get_string(jsSeq, "name");
+
+		if (nspname == NULL || relname == NULL)
+		{
+			log_error("Failed to parse the sequences cache \"%s\"", filename);
+			json_value_free(js);
+			return false;
+		}
+
+		seq->oid = (uint32_t) json_object_get_number(jsSeq, "oid");
+		strlcpy(seq->nspname, nspname, sizeof(seq->nspname));
+		strlcpy(seq->relname, relname, sizeof(seq->relname));
+	}
+
+	json_value_free(js);
+
+	log_info("Read the list of %d sequences from the catalog cache \"%s\"",
+			 sequenceArray->count,
+			 filename);
+
+	*cached = true;
+
+	return true;
+}
+
+
+/*
+ * copydb_catalog_write_sequences_cache writes the list of sequences to the
+ * sequences cache of the work directory. Their values are always fetched
+ * from the source database again.
+ */
+bool
+copydb_catalog_write_sequences_cache(CopyDataSpec *specs,
+									 SourceSequenceArray *sequenceArray)
+{
+	if (IS_EMPTY_STRING_BUFFER(specs->catalogFingerprint))
+	{
+		return true;
+	}
+
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *root = json_value_get_object(js);
+
+	json_object_set_string(root, "pgcopydb", PGCOPYDB_VERSION);
+	json_object_set_string(root, "fingerprint", specs->catalogFingerprint);
+
+	JSON_Value *jsSequences = json_value_init_array();
+	JSON_Array *jsSequenceArray = json_value_get_array(jsSequences);
+
+	for (int i = 0; i < sequenceArray->count; i++)
+	{
+		SourceSequence *seq = &(sequenceArray->array[i]);
+
+		JSON_Value *jsSeq = json_value_init_object();
+		JSON_Object *jsSeqObj = json_value_get_object(jsSeq);
+
+		json_object_set_number(jsSeqObj, "oid", (double) seq->oid);
+		json_object_set_string(jsSeqObj, "schema", seq->nspname);
+		json_object_set_string(jsSeqObj, "name", seq->relname);
+
+		json_array_append_value(jsSequenceArray, jsSeq);
+	}
+
+	json_object_set_value(root, "sequences", jsSequences);
+
+	bool success =
+		copydb_catalog_write_file(js, specs->cfPaths.sequencecachefile);
+
+	json_value_free(js);
+
+	return success;
+}
+
+
+/*
+ * copydb_catalog_tables_to_json returns a JSON array of the given tables, as
+ * used in the catalog cache and in the catalog of pgcopydb dump data.
+ */
+JSON_Value *
+copydb_catalog_tables_to_json(CopyDataSpec *specs, SourceTableArray *tableArray)
+{
+	JSON_Value *jsTables = json_value_init_array();
+	JSON_Array *jsTableArray = json_value_get_array(jsTables);
+
+	for (int i = 0; i < tableArray->count; i++)
+	{
+		SourceTable *table = &(tableArray->array[i]);
+
+		JSON_Value *jsTable = json_value_init_object();
+		JSON_Object *jsTableObj = json_value_get_object(jsTable);
+
+		json_object_set_number(jsTableObj, "oid", (double) table->oid);
+		json_object_set_string(jsTableObj, "schema", table->nspname);
+		json_object_set_string(jsTableObj, "name", table->relname);
+		json_object_set_boolean(jsTableObj, "binary-unsafe", table->binaryUnsafe);
+		json_object_set_number(jsTableObj, "index-count", table->indexCount);
+		json_object_set_number(jsTableObj, "reltuples", (double) table->reltuples);
+		json_object_set_number(jsTableObj, "bytes", (double) table->bytes);
+		json_object_set_string(jsTableObj, "bytes-pretty", table->bytesPretty);
+		json_object_set_number(jsTableObj, "relpages", (double) table->relpages);
+		json_object_set_number(jsTableObj, "index-bytes",
+							   (double) table->indexBytes);
+		json_object_set_number(jsTableObj, "toast-bytes",
+							   (double) table->toastBytes);
+		json_object_set_number(jsTableObj, "column-count", table->columnCount);
+		json_object_set_number(jsTableObj, "binary-column-count",
+							   table->binaryColumnCount);
+		json_object_set_boolean(jsTableObj, "partition", table->isPartition);
+
+		if (table->copyColumns != NULL)
+		{
+			json_object_set_string(jsTableObj, "copy-columns", table->copyColumns);
+		}
+		json_object_set_number(jsTableObj, "parts",
+							   copydb_table_part_count(specs, table));
+
+		json_array_append_value(jsTableArray, jsTable);
+	}
+
+	return jsTables;
+}
+
+
+/*
+ * copydb_catalog_tables_from_json allocates and fills in the given table
+ * array from a JSON array written by copydb_catalog_tables_to_json().
+ */
+bool
+copydb_catalog_tables_from_json(JSON_Array *jsTables,
+								SourceTableArray *tableArray)
+{
+	int tableCount = jsTables == NULL ? 0 : json_array_get_count(jsTables);
+
+	tableArray->count = tableCount;
+	tableArray->array =
+		(SourceTable *) calloc(tableCount + 1, sizeof(SourceTable));
+
+	if (tableArray->array == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	int errors = 0;
+
+	for (int i = 0; i < tableCount; i++)
+	{
+		JSON_Object *jsTable = json_array_get_object(jsTables, i);
+		SourceTable *table = &(tableArray->array[i]);
+
+		const char *nspname = json_object_get_string(jsTable, "schema");
+		const char *relname = json_object_get_string(jsTable, "name");
+		const char *bytesPretty = json_object_get_string(jsTable, "bytes-pretty");
+
+		if (nspname == NULL || relname == NULL || bytesPretty == NULL ||
+			!schema_catalog_intern(nspname, &(table->nspname)) ||
+			!schema_catalog_intern(relname, &(table->relname)) ||
+			!schema_catalog_intern(bytesPretty, &(table->bytesPretty)))
+		{
+			++errors;
+			continue;
+		}
+
+		table->oid = (uint32_t) json_object_get_number(jsTable, "oid");
+		table->binaryUnsafe = json_object_get_boolean(jsTable, "binary-unsafe") == 1;
+		table->indexCount = (int) json_object_get_number(jsTable, "index-count");
+		table->reltuples = (int64_t) json_object_get_number(jsTable, "reltuples");
+		table->bytes = (int64_t) json_object_get_number(jsTable, "bytes");
+		table->relpages = (int64_t) json_object_get_number(jsTable, "relpages");
+		table->indexBytes =
+			(int64_t) json_object_get_number(jsTable, "index-bytes");
+		table->toastBytes =
+			(int64_t) json_object_get_number(jsTable, "toast-bytes");
+		table->columnCount =
+			(int) json_object_get_number(jsTable, "column-count");
+		table->binaryColumnCount =
+			(int) json_object_get_number(jsTable, "binary-column-count");
+		table->isPartition =
+			json_object_get_boolean(jsTable, "partition") == 1;
+
+		const char *copyColumns = json_object_get_string(jsTable, "copy-columns");
+
+		if (copyColumns != NULL &&
+			!schema_catalog_strdup(copyColumns, &(table->copyColumns)))
+		{
+			++errors;
+		}
+	}
+
+	if (errors > 0)
+	{
+		log_error("Failed to parse %d tables from the JSON catalog", errors);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_catalog_indexes_to_json returns a JSON array of the given indexes,
+ * as used in the catalog cache and in the catalog of pgcopydb dump data.
+ */
+JSON_Value *
+copydb_catalog_indexes_to_json(SourceIndexArray *indexArray)
+{
+	JSON_Value *jsIndexes = json_value_init_array();
+	JSON_Array *jsIndexArray = json_value_get_array(jsIndexes);
+
+	for (int i = 0; i < indexArray->count; i++)
+	{
+		SourceIndex *index = &(indexArray->array[i]);
+
+		JSON_Value *jsIndex = json_value_init_object();
+		JSON_Object *jsIndexObj = json_value_get_object(jsIndex);
+
+		json_object_set_number(jsIndexObj, "oid", (double) index->indexOid);
+		json_object_set_number(jsIndexObj, "table-oid", (double) index->tableOid);
+		json_object_set_number(jsIndexObj, "constraint-oid",
+							   (double) index->constraintOid);
+		json_object_set_boolean(jsIndexObj, "primary", index->isPrimary);
+		json_object_set_boolean(jsIndexObj, "unique", index->isUnique);
+		json_object_set_string(jsIndexObj, "schema", index->indexNamespace);
+		json_object_set_string(jsIndexObj, "name", index->indexRelname);
+		json_object_set_string(jsIndexObj, "table-schema", index->tableNamespace);
+		json_object_set_string(jsIndexObj, "table-name", index->tableRelname);
+		json_object_set_string(jsIndexObj, "columns", index->indexColumns);
+		json_object_set_string(jsIndexObj, "definition", index->indexDef);
+		json_object_set_string(jsIndexObj, "constraint-name",
+							   index->constraintName);
+		json_object_set_string(jsIndexObj, "constraint-definition",
+							   index->constraintDef);
+		json_object_set_number(jsIndexObj, "bytes", (double) index->indexBytes);
+
+		json_array_append_value(jsIndexArray, jsIndex);
+	}
+
+	return jsIndexes;
+}
+
+
+/*
+ * copydb_catalog_indexes_from_json allocates and fills in the given index
+ * array from a JSON array written by copydb_catalog_indexes_to_json(). The
+ * indexes are sorted by table oid already.
+ */
+bool
+copydb_catalog_indexes_from_json(JSON_Array *jsIndexes,
+								 SourceIndexArray *indexArray)
+{
+	int indexCount = jsIndexes == NULL ? 0 : json_array_get_count(jsIndexes);
+
+	indexArray->count = indexCount;
+	indexArray->array =
+		(SourceIndex *) calloc(indexCount + 1, sizeof(SourceIndex));
+
+	if (indexArray->array == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	int errors = 0;
+
+	for (int i = 0; i < indexCount; i++)
+	{
+		JSON_Object *jsIndex = json_array_get_object(jsIndexes, i);
+		SourceIndex *index = &(indexArray->array[i]);
+
+		const char *names[] = {
+			"schema", "name", "table-schema", "table-name",
+			"columns", "definition", "constraint-name", "constraint-definition"
+		};
+
+		char **fields[] = {
+			&(index->indexNamespace), &(index->indexRelname),
+			&(index->tableNamespace), &(index->tableRelname),
+			&(index->indexColumns), &(index->indexDef),
+			&(index->constraintName), &(index->constraintDef)
+		};
+
+		int fieldCount = sizeof(names) / sizeof(names[0]);
+
+		for (int f = 0; f < fieldCount; f++)
+		{
+			const char *value = json_object_get_string(jsIndex, names[f]);
+
+			if (value == NULL || !schema_catalog_strdup(value, fields[f]))
+			{
+				++errors;
+			}
+		}
+
+		index->indexOid = (uint32_t) json_object_get_number(jsIndex, "oid");
+		index->tableOid = (uint32_t) json_object_get_number(jsIndex, "table-oid");
+		index->constraintOid =
+			(uint32_t) json_object_get_number(jsIndex, "constraint-oid");
+		index->isPrimary = json_object_get_boolean(jsIndex, "primary") == 1;
+		index->isUnique = json_object_get_boolean(jsIndex, "unique") == 1;
+		index->indexBytes = (int64_t) json_object_get_number(jsIndex, "bytes");
+	}
+
+	if (errors > 0)
+	{
+		log_error("Failed to parse %d index fields from the JSON catalog",
+				  errors);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_catalog_attach_to_json returns a JSON array of the given partition
+ * index attachments, sorted by parent index oid.
+ */
+static JSON_Value *
+copydb_catalog_attach_to_json(SourceIndexAttachArray *attachArray)
+{
+	JSON_Value *jsAttach = json_value_init_array();
+	JSON_Array *jsAttachArray = json_value_get_array(jsAttach);
+
+	for (int i = 0; i < attachArray->count; i++)
+	{
+		SourceIndexAttach *attach = &(attachArray->array[i]);
+
+		JSON_Value *jsItem = json_value_init_object();
+		JSON_Object *jsItemObj = json_value_get_object(jsItem);
+
+		json_object_set_number(jsItemObj, "parent-oid", (double) attach->parentOid);
+		json_object_set_string(jsItemObj, "parent-schema", attach->parentNamespace);
+		json_object_set_string(jsItemObj, "parent-name", attach->parentRelname);
+		json_object_set_number(jsItemObj, "oid", (double) attach->childOid);
+		json_object_set_string(jsItemObj, "schema", attach->childNamespace);
+		json_object_set_string(jsItemObj, "name", attach->childRelname);
+
+		json_array_append_value(jsAttachArray, jsItem);
+	}
+
+	return jsAttach;
+}
+
+
+/*
+ * copydb_catalog_attach_from_json allocates and fills in the given partition
+ * index attachments array from a JSON array written by
+ * copydb_catalog_attach_to_json().
+ */
+static bool
+copydb_catalog_attach_from_json(JSON_Array *jsAttach,
+								SourceIndexAttachArray *attachArray)
+{
+	int count = jsAttach == NULL ? 0 : json_array_get_count(jsAttach);
+
+	attachArray->count = count;
+	attachArray->array =
+		(SourceIndexAttach *) calloc(count + 1, sizeof(SourceIndexAttach));
+
+	if (attachArray->array == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	int errors = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		JSON_Object *jsItem = json_array_get_object(jsAttach, i);
+		SourceIndexAttach *attach = &(attachArray->array[i]);
+
+		const char *parentNamespace =
+			json_object_get_string(jsItem, "parent-schema");
+		const char *parentRelname = json_object_get_string(jsItem, "parent-name");
+		const char *childNamespace = json_object_get_string(jsItem, "schema");
+		const char *childRelname = json_object_get_string(jsItem, "name");
+
+		if (parentNamespace == NULL || parentRelname == NULL ||
+			childNamespace == NULL || childRelname == NULL ||
+			!schema_catalog_intern(parentNamespace, &(attach->parentNamespace)) ||
+			!schema_catalog_intern(parentRelname, &(attach->parentRelname)) ||
+			!schema_catalog_intern(childNamespace, &(attach->childNamespace)) ||
+			!schema_catalog_intern(childRelname, &(attach->childRelname)))
+		{
+			++errors;
+			continue;
+		}
+
+		attach->parentOid =
+			(uint32_t) json_object_get_number(jsItem, "parent-oid");
+		attach->childOid = (uint32_t) json_object_get_number(jsItem, "oid");
+	}
+
+	if (errors > 0)
+	{
+		log_error("Failed to parse %d partition indexes from the JSON catalog",
+				  errors);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_catalog_fkeys_to_json returns a JSON array of the given foreign
+ * keys, sorted by constraint oid.
+ */
+static JSON_Value *
+copydb_catalog_fkeys_to_json(SourceForeignKeyArray *fkeyArray)
+{
+	JSON_Value *jsFkeys = json_value_init_array();
+	JSON_Array *jsFkeyArray = json_value_get_array(jsFkeys);
+
+	for (int i = 0; i < fkeyArray->count; i++)
+	{
+		SourceForeignKey *fkey = &(fkeyArray->array[i]);
+
+		JSON_Value *jsFkey = json_value_init_object();
+		JSON_Object *jsFkeyObj = json_value_get_object(jsFkey);
+
+		json_object_set_number(jsFkeyObj, "oid", (double) fkey->constraintOid);
+		json_object_set_number(jsFkeyObj, "table-oid", (double) fkey->tableOid);
+		json_object_set_number(jsFkeyObj, "referenced-table-oid",
+							   (double) fkey->referencedTableOid);
+		json_object_set_boolean(jsFkeyObj, "validated", fkey->isValidated);
+		json_object_set_string(jsFkeyObj, "name", fkey->constraintName);
+		json_object_set_string(jsFkeyObj, "table-schema", fkey->tableNamespace);
+		json_object_set_string(jsFkeyObj, "table-name", fkey->tableRelname);
+		json_object_set_string(jsFkeyObj, "definition", fkey->constraintDef);
+
+		json_array_append_value(jsFkeyArray, jsFkey);
+	}
+
+	return jsFkeys;
+}
+
+
+/*
+ * copydb_catalog_fkeys_from_json allocates and fills in the given foreign
+ * keys array from a JSON array written by copydb_catalog_fkeys_to_json().
+ */
+static bool
+copydb_catalog_fkeys_from_json(JSON_Array *jsFkeys,
+							   SourceForeignKeyArray *fkeyArray)
+{
+	int fkeyCount = jsFkeys == NULL ? 0 : json_array_get_count(jsFkeys);
+
+	fkeyArray->count = fkeyCount;
+	fkeyArray->array =
+		(SourceForeignKey *) calloc(fkeyCount + 1, sizeof(SourceForeignKey));
+
+	if (fkeyArray->array == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	int errors = 0;
+
+	for (int i = 0; i < fkeyCount; i++)
+	{
+		JSON_Object *jsFkey = json_array_get_object(jsFkeys, i);
+		SourceForeignKey *fkey = &(fkeyArray->array[i]);
+
+		const char *name = json_object_get_string(jsFkey, "name");
+		const char *nspname = json_object_get_string(jsFkey, "table-schema");
+		const char *relname = json_object_get_string(jsFkey, "table-name");
+		const char *def = json_object_get_string(jsFkey, "definition");
+
+		if (name == NULL || nspname == NULL || relname == NULL || def == NULL ||
+			!schema_catalog_intern(name, &(fkey->constraintName)) ||
+			!schema_catalog_intern(nspname, &(fkey->tableNamespace)) ||
+			!schema_catalog_intern(relname, &(fkey->tableRelname)) ||
+			!schema_catalog_strdup(def, &(fkey->constraintDef)))
+		{
+			++errors;
+			continue;
+		}
+
+		fkey->constraintOid = (uint32_t) json_object_get_number(jsFkey, "oid");
+		fkey->tableOid = (uint32_t) json_object_get_number(jsFkey, "table-oid");
+		fkey->referencedTableOid =
+			(uint32_t) json_object_get_number(jsFkey, "referenced-table-oid");
+		fkey->isValidated = json_object_get_boolean(jsFkey, "validated") == 1;
+	}
+
+	if (errors > 0)
+	{
+		log_error("Failed to parse %d foreign keys from the JSON catalog",
+				  errors);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_catalog_parse_cache parses the given cache file, and returns NULL
+ * when the file does not exist or has been written for another fingerprint
+ * of the source catalogs.
+ */
+static JSON_Value *
+copydb_catalog_parse_cache(const char *filename, const char *fingerprint)
+{
+	if (!file_exists(filename))
+	{
+		return NULL;
+	}
+
+	JSON_Value *js = json_parse_file(filename);
+	JSON_Object *root = json_value_get_object(js);
+
+	if (root == NULL)
+	{
+		log_warn("Failed to parse JSON file \"%s\", skipping the catalog cache",
+				 filename);
+		json_value_free(js);
+		return NULL;
+	}
+
+	const char *cachedFingerprint = json_object_get_string(root, "fingerprint");
+
+	if (cachedFingerprint == NULL || !streq(cachedFingerprint, fingerprint))
+	{
+		log_info("Source catalogs have changed since \"%s\" was written",
+				 filename);
+		json_value_free(js);
+		return NULL;
+	}
+
+	return js;
+}
+
+
+/*
+ * copydb_catalog_write_file writes the given JSON value in a compact form.
+ * The file is written under a temporary name and then renamed, so that a
+ * concurrent reader never finds a partial cache.
+ */
+static bool
+copydb_catalog_write_file(JSON_Value *js, const char *filename)
+{
+	char tmpfilename[MAXPGPATH] = { 0 };
+
+	sformat(tmpfilename, sizeof(tmpfilename), "%s.%d", filename, getpid());
+
+	char *serialized = json_serialize_to_string(js);
+
+	if (serialized == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	bool success = write_file(serialized, strlen(serialized), tmpfilename);
+
+	json_free_serialized_string(serialized);
+
+	if (!success)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (rename(tmpfilename, filename) != 0)
+	{
+		log_error("Failed to rename \"%s\" to \"%s\": %m",
+				  tmpfilename,
+				  filename);
+		return false;
+	}
+
+	log_debug("Wrote the catalog cache \"%s\"", filename);
+
+	return true;
+}
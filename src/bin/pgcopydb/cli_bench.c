@@ -0,0 +1,380 @@
+/*
+ * src/bin/pgcopydb/cli_bench.c
+ *     Implementation of a CLI which lets you run individual routines
+ *     directly
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+
+#include "bench.h"
+#include "cli_common.h"
+#include "cli_root.h"
+#include "commandline.h"
+#include "env_utils.h"
+#include "log.h"
+#include "pgsql.h"
+#include "string_utils.h"
+
+static BenchSpecs benchSpecs = { 0 };
+
+static int cli_bench_read_getopts(int argc, char **argv);
+static int cli_bench_write_getopts(int argc, char **argv);
+static int cli_bench_copy_getopts(int argc, char **argv);
+static int cli_bench_getopts(int argc, char **argv, BenchMode mode);
+static void cli_bench(int argc, char **argv);
+
+static CommandLine bench_read_command =
+	make_command(
+		"read",
+		"Measure how fast COPY TO STDOUT reads from the source",
+		" --source ... [ --jobs ... --rows ... --row-size ... --table ... ] ",
+		"  --source          Postgres URI to the source database\n"
+		"  --jobs            Comma separated counts of concurrent jobs (1,2,4,8)\n"
+		"  --rows            Number of rows that each job reads (1000000)\n"
+		"  --row-size        Size in bytes of the payload of each row (100)\n"
+		"  --table           Read this table rather than generated rows\n",
+		cli_bench_read_getopts,
+		cli_bench);
+
+static CommandLine bench_write_command =
+	make_command(
+		"write",
+		"Measure how fast COPY FROM STDIN writes to the target",
+		" --target ... [ --jobs ... --rows ... --row-size ... ] ",
+		"  --target          Postgres URI to the target database\n"
+		"  --jobs            Comma separated counts of concurrent jobs (1,2,4,8)\n"
+		"  --rows            Number of rows that each job writes (1000000)\n"
+		"  --row-size        Size in bytes of the payload of each row (100)\n"
+		"  --copy-buffer-size  Coalesce COPY rows up to this size (256 kB)\n",
+		cli_bench_write_getopts,
+		cli_bench);
+
+static CommandLine bench_copy_command =
+	make_command(
+		"copy",
+		"Measure how fast COPY goes from the source to the target",
+		" --source ... --target ... [ --jobs ... --rows ... --row-size ... ] ",
+		"  --source          Postgres URI to the source database\n"
+		"  --target          Postgres URI to the target database\n"
+		"  --jobs            Comma separated counts of concurrent jobs (1,2,4,8)\n"
+		"  --rows            Number of rows that each job copies (1000000)\n"
+		"  --row-size        Size in bytes of the payload of each row (100)\n"
+		"  --copy-buffer-size  Coalesce COPY rows up to this size (256 kB)\n"
+		"  --copy-pipeline-depth  Use a reader thread and a ring of N buffers\n",
+		cli_bench_copy_getopts,
+		cli_bench);
+
+static CommandLine *bench_subcommands[] = {
+	&bench_read_command,
+	&bench_write_command,
+	&bench_copy_command,
+	NULL
+};
+
+CommandLine bench_commands =
+	make_command_set("bench",
+					 "Measure the COPY throughput of the source and the target",
+					 NULL, NULL, NULL, bench_subcommands);
+
+
+/*
+ * cli_bench_read_getopts parses the CLI options for the `bench read` command.
+ */
+static int
+cli_bench_read_getopts(int argc, char **argv)
+{
+	return cli_bench_getopts(argc, argv, BENCH_MODE_READ);
+}
+
+
+/*
+ * cli_bench_write_getopts parses the CLI options for the `bench write`
+ * command.
+ */
+static int
+cli_bench_write_getopts(int argc, char **argv)
+{
+	return cli_bench_getopts(argc, argv, BENCH_MODE_WRITE);
+}
+
+
+/*
+ * cli_bench_copy_getopts parses the CLI options for the `bench copy` command.
+ */
+static int
+cli_bench_copy_getopts(int argc, char **argv)
+{
+	return cli_bench_getopts(argc, argv, BENCH_MODE_COPY);
+}
+
+
+/*
+ * cli_bench_getopts parses the CLI options for the bench commands, and checks
+ * that the options needed by the given mode have been given.
+ */
+static int
+cli_bench_getopts(int argc, char **argv, BenchMode mode)
+{
+	BenchSpecs options = { 0 };
+	int c, option_index = 0;
+	int errors = 0, verboseCount = 0;
+
+	static struct option long_options[] = {
+		{ "source", required_argument, NULL, 'S' },
+		{ "target", required_argument, NULL, 'T' },
+		{ "jobs", required_argument, NULL, 'J' },
+		{ "rows", required_argument, NULL, 'n' },
+		{ "row-size", required_argument, NULL, 'w' },
+		{ "table", required_argument, NULL, 't' },
+		{ "copy-buffer-size", required_argument, NULL, 'B' },
+		{ "copy-pipeline-depth", required_argument, NULL, 'P' },
+		{ "version", no_argument, NULL, 'V' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	optind = 0;
+
+	/* install default values */
+	options.mode = mode;
+	options.rows = BENCH_DEFAULT_ROWS;
+	options.rowSize = BENCH_DEFAULT_ROW_SIZE;
+	options.copyBufferSize = DEFAULT_COPY_BUFFER_SIZE;
+
+	if (!bench_parse_jobs(BENCH_DEFAULT_JOBS, &options))
+	{
+		log_fatal("BUG: failed to parse the default --jobs value");
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	/* read values from the environment */
+	if (env_exists(PGCOPYDB_SOURCE_PGURI))
+	{
+		if (!get_env_copy(PGCOPYDB_SOURCE_PGURI,
+						  options.source_pguri,
+						  sizeof(options.source_pguri)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_TARGET_PGURI))
+	{
+		if (!get_env_copy(PGCOPYDB_TARGET_PGURI,
+						  options.target_pguri,
+						  sizeof(options.target_pguri)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	while ((c = getopt_long(argc, argv, "S:T:J:n:w:t:B:P:Vvqh",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'S':
+			{
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --source connection string, "
+							  "see above for details.");
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				strlcpy(options.source_pguri, optarg, MAXCONNINFO);
+				log_trace("--source %s", options.source_pguri);
+				break;
+			}
+
+			case 'T':
+			{
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --target connection string, "
+							  "see above for details.");
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				strlcpy(options.target_pguri, optarg, MAXCONNINFO);
+				log_trace("--target %s", options.target_pguri);
+				break;
+			}
+
+			case 'J':
+			{
+				if (!bench_parse_jobs(optarg, &options))
+				{
+					/* errors have already been logged */
+					++errors;
+				}
+				log_trace("--jobs %s", optarg);
+				break;
+			}
+
+			case 'n':
+			{
+				if (!stringToUInt64(optarg, &options.rows) || options.rows < 1)
+				{
+					log_fatal("Failed to parse --rows: \"%s\"", optarg);
+					++errors;
+				}
+				log_trace("--rows %lld", (long long) options.rows);
+				break;
+			}
+
+			case 'w':
+			{
+				if (!stringToInt(optarg, &options.rowSize) ||
+					options.rowSize < 1 ||
+					options.rowSize > BENCH_MAX_ROW_SIZE)
+				{
+					log_fatal("Failed to parse --row-size: \"%s\"", optarg);
+					++errors;
+				}
+				log_trace("--row-size %d", options.rowSize);
+				break;
+			}
+
+			case 't':
+			{
+				strlcpy(options.table, optarg, sizeof(options.table));
+				log_trace("--table %s", options.table);
+				break;
+			}
+
+			case 'B':
+			{
+				uint64_t bytes = 0;
+				char pretty[NAMEDATALEN] = { 0 };
+
+				if (!cli_parse_bytes_pretty(optarg, &bytes,
+											pretty, sizeof(pretty)) ||
+					bytes > MAX_COPY_BUFFER_SIZE)
+				{
+					log_fatal("Failed to parse --copy-buffer-size: \"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				options.copyBufferSize = (int) bytes;
+
+				log_trace("--copy-buffer-size %s (%d)",
+						  pretty,
+						  options.copyBufferSize);
+				break;
+			}
+
+			case 'P':
+			{
+				if (!stringToInt(optarg, &options.copyPipelineDepth) ||
+					options.copyPipelineDepth < 0 ||
+					options.copyPipelineDepth > MAX_COPY_PIPELINE_DEPTH)
+				{
+					log_fatal("Failed to parse --copy-pipeline-depth: \"%s\"",
+							  optarg);
+					++errors;
+				}
+				log_trace("--copy-pipeline-depth %d", options.copyPipelineDepth);
+				break;
+			}
+
+			case 'V':
+			{
+				/* keeper_cli_print_version prints version and exits. */
+				cli_print_version(argc, argv);
+				break;
+			}
+
+			case 'v':
+			{
+				++verboseCount;
+				switch (verboseCount)
+				{
+					case 1:
+					{
+						log_set_level(LOG_INFO);
+						break;
+					}
+
+					case 2:
+					{
+						log_set_level(LOG_DEBUG);
+						break;
+					}
+
+					default:
+					{
+						log_set_level(LOG_TRACE);
+						break;
+					}
+				}
+				break;
+			}
+
+			case 'q':
+			{
+				log_set_level(LOG_ERROR);
+				break;
+			}
+
+			case 'h':
+			{
+				commandline_help(stderr);
+				exit(EXIT_CODE_QUIT);
+				break;
+			}
+		}
+	}
+
+	if (mode != BENCH_MODE_WRITE && IS_EMPTY_STRING_BUFFER(options.source_pguri))
+	{
+		log_fatal("Option --source is mandatory");
+		++errors;
+	}
+
+	if (mode != BENCH_MODE_READ && IS_EMPTY_STRING_BUFFER(options.target_pguri))
+	{
+		log_fatal("Option --target is mandatory");
+		++errors;
+	}
+
+	/* the target tables have the columns of the generated rows */
+	if (mode != BENCH_MODE_READ && !IS_EMPTY_STRING_BUFFER(options.table))
+	{
+		log_fatal("Option --table is only supported with pgcopydb bench read");
+		++errors;
+	}
+
+	if (errors > 0)
+	{
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* publish our option parsing in the global variable */
+	benchSpecs = options;
+
+	return optind;
+}
+
+
+/*
+ * cli_bench implements the commands: pgcopydb bench read|write|copy
+ */
+static void
+cli_bench(int argc, char **argv)
+{
+	BenchResult results[BENCH_MAX_STEPS] = { 0 };
+
+	if (!bench_run(&benchSpecs, results))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	(void) bench_print_results(&benchSpecs, results);
+}
@@ -191,3 +191,26 @@ logLevelToString(int logLevel)
 
 	return "";
 }
+
+
+/*
+ * cli_parse_bytes_pretty parses a pretty printed byte value (such as "10 GB"
+ * or "256MB") and fills-in both the number of bytes and a normalized pretty
+ * printed representation of the same value.
+ */
+bool
+cli_parse_bytes_pretty(const char *byteString,
+					   uint64_t *bytes,
+					   char *bytesPretty,
+					   size_t bytesPrettySize)
+{
+	if (!parse_pretty_printed_bytes(byteString, bytes))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	(void) pretty_print_bytes(bytesPretty, bytesPrettySize, *bytes);
+
+	return true;
+}
@@ -13,6 +13,7 @@
 
 #include <getopt.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "defaults.h"
 #include "parson.h"
@@ -27,4 +28,9 @@ void cli_print_version(int argc, char **argv);
 void cli_pprint_json(JSON_Value *js);
 char * logLevelToString(int logLevel);
 
+bool cli_parse_bytes_pretty(const char *byteString,
+							uint64_t *bytes,
+							char *bytesPretty,
+							size_t bytesPrettySize);
+
 #endif  /* CLI_COMMON_H */
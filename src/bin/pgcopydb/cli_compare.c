@@ -0,0 +1,320 @@
+/*
+ * src/bin/pgcopydb/cli_compare.c
+ *     Implementation of a CLI which lets you run individual routines
+ *     directly
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+
+#include "cli_common.h"
+#include "cli_copy.h"
+#include "cli_root.h"
+#include "commandline.h"
+#include "compare.h"
+#include "copydb.h"
+#include "env_utils.h"
+#include "log.h"
+#include "parsing.h"
+#include "pgsql.h"
+#include "string_utils.h"
+
+static CopyDBOptions compareDBoptions = { 0 };
+static bool compareMarkForRecopy = false;
+
+static int cli_compare_getopts(int argc, char **argv);
+static void cli_compare_data(int argc, char **argv);
+
+static CommandLine compare_data_command =
+	make_command(
+		"data",
+		"Compare the data of all the tables between source and target",
+		" --source ... --target ... [ --table-jobs ... --mark-for-recopy ] ",
+		"  --source          Postgres URI to the source database\n"
+		"  --target          Postgres URI to the target database\n"
+		"  --table-jobs      Number of concurrent compare jobs to run\n"
+		"  --split-tables-larger-than  Compare larger tables in primary key ranges\n"
+		"  --snapshot        Use snapshot obtained with pg_export_snapshot\n"
+		"  --not-consistent  Allow taking a new snapshot on the source database\n"
+		"  --mark-for-recopy  Have copy table-data --resume copy tables that differ\n",
+		cli_compare_getopts,
+		cli_compare_data);
+
+static CommandLine *compare_subcommands[] = {
+	&compare_data_command,
+	NULL
+};
+
+CommandLine compare_commands =
+	make_command_set("compare",
+					 "Compare the source and the target databases",
+					 NULL, NULL, NULL, compare_subcommands);
+
+
+/*
+ * cli_compare_getopts parses the CLI options for the `compare data` command.
+ */
+static int
+cli_compare_getopts(int argc, char **argv)
+{
+	CopyDBOptions options = { 0 };
+	int c, option_index = 0;
+	int errors = 0, verboseCount = 0;
+
+	static struct option long_options[] = {
+		{ "source", required_argument, NULL, 'S' },
+		{ "target", required_argument, NULL, 'T' },
+		{ "jobs", required_argument, NULL, 'J' },
+		{ "table-jobs", required_argument, NULL, 'J' },
+		{ "split-tables-larger-than", required_argument, NULL, 'L' },
+		{ "snapshot", required_argument, NULL, 'N' },
+		{ "not-consistent", no_argument, NULL, 'C' },
+		{ "mark-for-recopy", no_argument, NULL, 'm' },
+		{ "version", no_argument, NULL, 'V' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	optind = 0;
+
+	/* install default values */
+	options.tableJobs = 4;
+
+	/* read values from the environment */
+	if (!cli_copydb_getenv(&options))
+	{
+		log_fatal("Failed to read default values from the environment");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	while ((c = getopt_long(argc, argv, "S:T:J:L:N:CmVvqh",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'S':
+			{
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --source connection string, "
+							  "see above for details.");
+					++errors;
+				}
+				strlcpy(options.source_pguri, optarg, MAXCONNINFO);
+				log_trace("--source %s", options.source_pguri);
+				break;
+			}
+
+			case 'T':
+			{
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --target connection string, "
+							  "see above for details.");
+					++errors;
+				}
+				strlcpy(options.target_pguri, optarg, MAXCONNINFO);
+				log_trace("--target %s", options.target_pguri);
+				break;
+			}
+
+			case 'J':
+			{
+				if (!stringToInt(optarg, &options.tableJobs) ||
+					options.tableJobs < 1 ||
+					options.tableJobs > 128)
+				{
+					log_fatal("Failed to parse --jobs count: \"%s\"", optarg);
+					++errors;
+				}
+				log_trace("--table-jobs %d", options.tableJobs);
+				break;
+			}
+
+			case 'L':
+			{
+				if (!cli_parse_bytes_pretty(
+						optarg,
+						&options.splitTablesLargerThan,
+						options.splitTablesLargerThanPretty,
+						sizeof(options.splitTablesLargerThanPretty)))
+				{
+					log_fatal("Failed to parse --split-tables-larger-than: \"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				log_trace("--split-tables-larger-than %s (%lld)",
+						  options.splitTablesLargerThanPretty,
+						  (long long) options.splitTablesLargerThan);
+				break;
+			}
+
+			case 'N':
+			{
+				strlcpy(options.snapshot, optarg, sizeof(options.snapshot));
+				log_trace("--snapshot %s", options.snapshot);
+				break;
+			}
+
+			case 'C':
+			{
+				options.notConsistent = true;
+				log_trace("--not-consistent");
+				break;
+			}
+
+			case 'm':
+			{
+				compareMarkForRecopy = true;
+				log_trace("--mark-for-recopy");
+				break;
+			}
+
+			case 'V':
+			{
+				/* keeper_cli_print_version prints version and exits. */
+				cli_print_version(argc, argv);
+				break;
+			}
+
+			case 'v':
+			{
+				++verboseCount;
+				switch (verboseCount)
+				{
+					case 1:
+					{
+						log_set_level(LOG_INFO);
+						break;
+					}
+
+					case 2:
+					{
+						log_set_level(LOG_DEBUG);
+						break;
+					}
+
+					default:
+					{
+						log_set_level(LOG_TRACE);
+						break;
+					}
+				}
+				break;
+			}
+
+			case 'q':
+			{
+				log_set_level(LOG_ERROR);
+				break;
+			}
+
+			case 'h':
+			{
+				commandline_help(stderr);
+				exit(EXIT_CODE_QUIT);
+				break;
+			}
+		}
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(options.source_pguri) ||
+		IS_EMPTY_STRING_BUFFER(options.target_pguri))
+	{
+		log_fatal("Options --source and --target are mandatory");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (options.notConsistent && !IS_EMPTY_STRING_BUFFER(options.snapshot))
+	{
+		log_fatal("Options --snapshot and --not-consistent are not compatible");
+		++errors;
+	}
+
+	if (errors > 0)
+	{
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* publish our option parsing in the global variable */
+	compareDBoptions = options;
+
+	return optind;
+}
+
+
+/*
+ * cli_compare_data implements the command: pgcopydb compare data
+ */
+static void
+cli_compare_data(int argc, char **argv)
+{
+	CopyDataSpec copySpecs = { 0 };
+	CompareSpecs compareSpecs = {
+		.copySpecs = &copySpecs,
+		.markForRecopy = compareMarkForRecopy
+	};
+
+	log_info("[SOURCE] Comparing database \"%s\"", compareDBoptions.source_pguri);
+	log_info("[TARGET] Comparing database \"%s\"", compareDBoptions.target_pguri);
+
+	/* the work directory of a previous copy has the state files we use */
+	if (!copydb_init_workdir(&(copySpecs.cfPaths), NULL, false))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (!copydb_init_specs(&copySpecs,
+						   &compareDBoptions,
+						   DATA_SECTION_TABLE_DATA))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (!copydb_prepare_snapshot(&copySpecs))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_SOURCE);
+	}
+
+	bool success = compare_data(&compareSpecs);
+
+	/* all the source queries are done now, release the snapshot */
+	if (!copydb_close_snapshot(&copySpecs))
+	{
+		/* errors have already been logged */
+		(void) compare_finish(&compareSpecs);
+		exit(EXIT_CODE_SOURCE);
+	}
+
+	if (!success)
+	{
+		/* errors have already been logged */
+		(void) compare_finish(&compareSpecs);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	(void) compare_print_results(&compareSpecs);
+
+	if (compareSpecs.markForRecopy && !compare_mark_for_recopy(&compareSpecs))
+	{
+		/* errors have already been logged */
+		(void) compare_finish(&compareSpecs);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	int mismatchChunkCount = compareSpecs.mismatchChunkCount;
+
+	(void) compare_finish(&compareSpecs);
+
+	if (mismatchChunkCount > 0)
+	{
+		exit(EXIT_CODE_TARGET);
+	}
+}
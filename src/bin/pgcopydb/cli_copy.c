@@ -14,18 +14,29 @@
 #include "copydb.h"
 #include "commandline.h"
 #include "env_utils.h"
+#include "file_utils.h"
 #include "log.h"
 #include "parsing.h"
 #include "pgsql.h"
+#include "relay.h"
 #include "string_utils.h"
 #include "summary.h"
 
 CopyDBOptions copyDBoptions = { 0 };
 
-static bool cli_copydb_getenv(CopyDBOptions *options);
+static bool cli_parse_copy_buffer_size(const char *value,
+									   CopyDBOptions *options);
+static bool cli_append_table_filter(char *filters, size_t size,
+									const char *value);
+static bool cli_parse_copy_strategy(const char *value, bool *copyStrategyAuto);
+static bool cli_parse_metrics_listen(const char *value, CopyDBOptions *options);
 static int cli_copy_db_getopts(int argc, char **argv);
 
 static void cli_copy_db(int argc, char **argv);
+static void cli_copy_db_run(CopyDataSpec *copySpecs);
+static void cli_copy_cluster(int argc, char **argv);
+static bool cli_copy_cluster_database(CopyClusterSpecs *specs,
+									  CopyClusterDatabase *database);
 static void cli_copy_data(int argc, char **argv);
 static void cli_copy_table_data(int argc, char **argv);
 static void cli_copy_sequences(int argc, char **argv);
@@ -43,13 +54,88 @@ CommandLine copy__db_command =
 		" --source ... --target ... [ --table-jobs ... --index-jobs ... ] ",
 		"  --source          Postgres URI to the source database\n"
 		"  --target          Postgres URI to the target database\n"
+		"  --source-replica  Postgres URI to a standby of the source, COPY from there\n"
+		"  --fanout-target   Postgres URI to another target database, COPY there too\n"
+		"  --relay           Get the COPY data from pgcopydb relay server at host:port\n"
 		"  --table-jobs      Number of concurrent COPY jobs to run\n"
 		"  --index-jobs      Number of concurrent CREATE INDEX jobs to run\n"
+		"  --index-memory-budget  Share this much maintenance_work_mem between index jobs\n"
+		"  --vacuum-jobs     Number of concurrent VACUUM jobs to run\n"
+		"  --analyze-only    Run ANALYZE rather than VACUUM ANALYZE on tables\n"
+		"  --vacuum-parallel  Use VACUUM (PARALLEL n) on tables\n"
+		"  --restore-jobs    Number of concurrent jobs for pg_restore\n"
+		"  --large-object-jobs  Number of concurrent large object copy jobs to run\n"
+		"  --bulk-load-profile  Settings to use on target connections, [phase.]name=value\n"
 		"  --drop-if-exists  On the target database, clean-up from a previous run first\n"
-		"  --no-owner        Do not set ownership of objects to match the original database\n",
+		"  --no-owner        Do not set ownership of objects to match the original database\n"
+		"  --resume          Skip what a previous interrupted run has done already\n"
+		"  --state-files     Also write a done file per index and constraint\n"
+		"  --trace           Write a timeline of the workers activity in trace.json\n"
+		"  --metrics-port    Serve Prometheus metrics of the workers on this port\n"
+		"  --metrics-listen  Serve Prometheus metrics of the workers at host:port\n"
+		"  --eta-interval    Log the estimated completion time every N seconds (60)\n"
+		"  --split-tables-larger-than  Same-table concurrency size threshold\n"
+		"  --snapshot        Use snapshot obtained with pg_export_snapshot\n"
+		"  --not-consistent  Allow taking a new snapshot on the source database\n"
+		"  --follow          Apply changes from logical decoding until asked to stop\n"
+		"  --slot-name       Logical replication slot to use with --follow\n"
+		"  --copy-format     COPY format to use: text (default) or binary\n"
+		"  --copy-freeze     TRUNCATE and COPY FREEZE each table in one transaction\n"
+		"  --copy-strategy   Copy strategy: manual (default) or auto, per table\n"
+		"  --copy-buffer-size  Coalesce COPY rows up to this size (256 kB)\n"
+		"  --copy-pipeline-depth  Use a reader thread and a ring of N buffers\n"
+		"  --multiplex-tables-smaller-than  Copy small tables from a single process\n"
+		"  --multiplex-streams  Number of concurrent COPY streams in that process\n"
+		"  --order-by-pk-smaller-than  COPY smaller tables in primary key order\n"
+		"  --copy-memory-budget  Share this much COPY buffer memory between table jobs\n"
+		"  --max-copy-rate   Limit the COPY of all workers to this many bytes per second\n"
+		"  --include-schema  Only copy the tables of these schemas (patterns)\n"
+		"  --exclude-schema  Skip the tables of these schemas (patterns)\n"
+		"  --include-table   Only copy these tables (patterns)\n"
+		"  --exclude-table   Skip these tables (patterns)\n"
+		"  --exclude-tables-larger-than  Skip the tables larger than this size\n"
+		"  --table-sample    Copy a [pattern=]percent sample of the table rows\n"
+		"  --adaptive-max-lag  Pause table workers when source standbys lag this much\n"
+		"  --adaptive-max-backends  Pause table workers above this many active source backends\n",
 		cli_copy_db_getopts,
 		cli_copy_db);
 
+CommandLine copy__cluster_command =
+	make_command(
+		"copy-cluster",
+		"Copy all the databases of a cluster from source to target",
+		" --source ... --target ... [ --database-jobs ... --table-jobs ... ] ",
+		"  --source          Postgres URI to a database of the source cluster\n"
+		"  --target          Postgres URI to a database of the target cluster\n"
+		"  --database-jobs   Number of databases to copy at the same time (4)\n"
+		"  --table-jobs      Number of concurrent COPY jobs in the whole cluster\n"
+		"  --index-jobs      Number of concurrent CREATE INDEX jobs in the whole cluster\n"
+		"  --index-memory-budget  Share this much maintenance_work_mem between index jobs\n"
+		"  --vacuum-jobs     Number of concurrent VACUUM jobs in the whole cluster\n"
+		"  --analyze-only    Run ANALYZE rather than VACUUM ANALYZE on tables\n"
+		"  --vacuum-parallel  Use VACUUM (PARALLEL n) on tables\n"
+		"  --restore-jobs    Number of concurrent jobs for pg_restore\n"
+		"  --large-object-jobs  Number of concurrent large object copy jobs to run\n"
+		"  --bulk-load-profile  Settings to use on target connections, [phase.]name=value\n"
+		"  --drop-if-exists  On the target database, clean-up from a previous run first\n"
+		"  --no-owner        Do not set ownership of objects to match the original database\n"
+		"  --resume          Skip what a previous interrupted run has done already\n"
+		"  --state-files     Also write a done file per index and constraint\n"
+		"  --trace           Write a timeline of the workers activity in trace.json\n"
+		"  --eta-interval    Log the estimated completion time every N seconds (60)\n"
+		"  --split-tables-larger-than  Same-table concurrency size threshold\n"
+		"  --not-consistent  Allow taking a new snapshot on the source database\n"
+		"  --copy-format     COPY format to use: text (default) or binary\n"
+		"  --copy-freeze     TRUNCATE and COPY FREEZE each table in one transaction\n"
+		"  --copy-strategy   Copy strategy: manual (default) or auto, per table\n"
+		"  --copy-buffer-size  Coalesce COPY rows up to this size (256 kB)\n"
+		"  --copy-pipeline-depth  Use a reader thread and a ring of N buffers\n"
+		"  --multiplex-tables-smaller-than  Copy small tables from a single process\n"
+		"  --multiplex-streams  Number of concurrent COPY streams in that process\n"
+		"  --order-by-pk-smaller-than  COPY smaller tables in primary key order\n",
+		cli_copy_db_getopts,
+		cli_copy_cluster);
+
 /* have pgcopydb copy-db and pgcopydb copy db aliases to each-other */
 static CommandLine copy_db_command =
 	make_command(
@@ -58,10 +144,49 @@ static CommandLine copy_db_command =
 		" --source ... --target ... [ --table-jobs ... --index-jobs ... ] ",
 		"  --source          Postgres URI to the source database\n"
 		"  --target          Postgres URI to the target database\n"
+		"  --source-replica  Postgres URI to a standby of the source, COPY from there\n"
+		"  --fanout-target   Postgres URI to another target database, COPY there too\n"
+		"  --relay           Get the COPY data from pgcopydb relay server at host:port\n"
 		"  --table-jobs      Number of concurrent COPY jobs to run\n"
 		"  --index-jobs      Number of concurrent CREATE INDEX jobs to run\n"
+		"  --index-memory-budget  Share this much maintenance_work_mem between index jobs\n"
+		"  --vacuum-jobs     Number of concurrent VACUUM jobs to run\n"
+		"  --analyze-only    Run ANALYZE rather than VACUUM ANALYZE on tables\n"
+		"  --vacuum-parallel  Use VACUUM (PARALLEL n) on tables\n"
+		"  --restore-jobs    Number of concurrent jobs for pg_restore\n"
+		"  --large-object-jobs  Number of concurrent large object copy jobs to run\n"
+		"  --bulk-load-profile  Settings to use on target connections, [phase.]name=value\n"
 		"  --drop-if-exists  On the target database, clean-up from a previous run first\n"
-		"  --no-owner        Do not set ownership of objects to match the original database\n",
+		"  --no-owner        Do not set ownership of objects to match the original database\n"
+		"  --resume          Skip what a previous interrupted run has done already\n"
+		"  --state-files     Also write a done file per index and constraint\n"
+		"  --trace           Write a timeline of the workers activity in trace.json\n"
+		"  --metrics-port    Serve Prometheus metrics of the workers on this port\n"
+		"  --metrics-listen  Serve Prometheus metrics of the workers at host:port\n"
+		"  --eta-interval    Log the estimated completion time every N seconds (60)\n"
+		"  --split-tables-larger-than  Same-table concurrency size threshold\n"
+		"  --snapshot        Use snapshot obtained with pg_export_snapshot\n"
+		"  --not-consistent  Allow taking a new snapshot on the source database\n"
+		"  --follow          Apply changes from logical decoding until asked to stop\n"
+		"  --slot-name       Logical replication slot to use with --follow\n"
+		"  --copy-format     COPY format to use: text (default) or binary\n"
+		"  --copy-freeze     TRUNCATE and COPY FREEZE each table in one transaction\n"
+		"  --copy-strategy   Copy strategy: manual (default) or auto, per table\n"
+		"  --copy-buffer-size  Coalesce COPY rows up to this size (256 kB)\n"
+		"  --copy-pipeline-depth  Use a reader thread and a ring of N buffers\n"
+		"  --multiplex-tables-smaller-than  Copy small tables from a single process\n"
+		"  --multiplex-streams  Number of concurrent COPY streams in that process\n"
+		"  --order-by-pk-smaller-than  COPY smaller tables in primary key order\n"
+		"  --copy-memory-budget  Share this much COPY buffer memory between table jobs\n"
+		"  --max-copy-rate   Limit the COPY of all workers to this many bytes per second\n"
+		"  --include-schema  Only copy the tables of these schemas (patterns)\n"
+		"  --exclude-schema  Skip the tables of these schemas (patterns)\n"
+		"  --include-table   Only copy these tables (patterns)\n"
+		"  --exclude-table   Skip these tables (patterns)\n"
+		"  --exclude-tables-larger-than  Skip the tables larger than this size\n"
+		"  --table-sample    Copy a [pattern=]percent sample of the table rows\n"
+		"  --adaptive-max-lag  Pause table workers when source standbys lag this much\n"
+		"  --adaptive-max-backends  Pause table workers above this many active source backends\n",
 		cli_copy_db_getopts,
 		cli_copy_db);
 
@@ -76,8 +201,44 @@ static CommandLine copy_data_command =
 		" --source ... --target ... [ --table-jobs ... --index-jobs ... ] ",
 		"  --source          Postgres URI to the source database\n"
 		"  --target          Postgres URI to the target database\n"
+		"  --source-replica  Postgres URI to a standby of the source, COPY from there\n"
+		"  --relay           Get the COPY data from pgcopydb relay server at host:port\n"
 		"  --table-jobs      Number of concurrent COPY jobs to run\n"
-		"  --index-jobs      Number of concurrent CREATE INDEX jobs to run\n",
+		"  --index-jobs      Number of concurrent CREATE INDEX jobs to run\n"
+		"  --index-memory-budget  Share this much maintenance_work_mem between index jobs\n"
+		"  --vacuum-jobs     Number of concurrent VACUUM jobs to run\n"
+		"  --analyze-only    Run ANALYZE rather than VACUUM ANALYZE on tables\n"
+		"  --vacuum-parallel  Use VACUUM (PARALLEL n) on tables\n"
+		"  --large-object-jobs  Number of concurrent large object copy jobs to run\n"
+		"  --bulk-load-profile  Settings to use on target connections, [phase.]name=value\n"
+		"  --resume          Skip what a previous interrupted run has done already\n"
+		"  --refresh         Copy again only the tables that changed since the last run\n"
+		"  --state-files     Also write a done file per index and constraint\n"
+		"  --trace           Write a timeline of the workers activity in trace.json\n"
+		"  --metrics-port    Serve Prometheus metrics of the workers on this port\n"
+		"  --metrics-listen  Serve Prometheus metrics of the workers at host:port\n"
+		"  --eta-interval    Log the estimated completion time every N seconds (60)\n"
+		"  --split-tables-larger-than  Same-table concurrency size threshold\n"
+		"  --snapshot        Use snapshot obtained with pg_export_snapshot\n"
+		"  --not-consistent  Allow taking a new snapshot on the source database\n"
+		"  --copy-format     COPY format to use: text (default) or binary\n"
+		"  --copy-freeze     TRUNCATE and COPY FREEZE each table in one transaction\n"
+		"  --copy-strategy   Copy strategy: manual (default) or auto, per table\n"
+		"  --copy-buffer-size  Coalesce COPY rows up to this size (256 kB)\n"
+		"  --copy-pipeline-depth  Use a reader thread and a ring of N buffers\n"
+		"  --multiplex-tables-smaller-than  Copy small tables from a single process\n"
+		"  --multiplex-streams  Number of concurrent COPY streams in that process\n"
+		"  --order-by-pk-smaller-than  COPY smaller tables in primary key order\n"
+		"  --copy-memory-budget  Share this much COPY buffer memory between table jobs\n"
+		"  --max-copy-rate   Limit the COPY of all workers to this many bytes per second\n"
+		"  --include-schema  Only copy the tables of these schemas (patterns)\n"
+		"  --exclude-schema  Skip the tables of these schemas (patterns)\n"
+		"  --include-table   Only copy these tables (patterns)\n"
+		"  --exclude-table   Skip these tables (patterns)\n"
+		"  --exclude-tables-larger-than  Skip the tables larger than this size\n"
+		"  --table-sample    Copy a [pattern=]percent sample of the table rows\n"
+		"  --adaptive-max-lag  Pause table workers when source standbys lag this much\n"
+		"  --adaptive-max-backends  Pause table workers above this many active source backends\n",
 		cli_copy_db_getopts,
 		cli_copy_data);
 
@@ -88,7 +249,30 @@ static CommandLine copy_table_data_command =
 		" --source ... --target ... [ --table-jobs ... --index-jobs ... ] ",
 		"  --source          Postgres URI to the source database\n"
 		"  --target          Postgres URI to the target database\n"
-		"  --table-jobs      Number of concurrent COPY jobs to run\n",
+		"  --source-replica  Postgres URI to a standby of the source, COPY from there\n"
+		"  --relay           Get the COPY data from pgcopydb relay server at host:port\n"
+		"  --table-jobs      Number of concurrent COPY jobs to run\n"
+		"  --split-tables-larger-than  Same-table concurrency size threshold\n"
+		"  --snapshot        Use snapshot obtained with pg_export_snapshot\n"
+		"  --not-consistent  Allow taking a new snapshot on the source database\n"
+		"  --copy-format     COPY format to use: text (default) or binary\n"
+		"  --copy-freeze     TRUNCATE and COPY FREEZE each table in one transaction\n"
+		"  --copy-strategy   Copy strategy: manual (default) or auto, per table\n"
+		"  --copy-buffer-size  Coalesce COPY rows up to this size (256 kB)\n"
+		"  --copy-pipeline-depth  Use a reader thread and a ring of N buffers\n"
+		"  --multiplex-tables-smaller-than  Copy small tables from a single process\n"
+		"  --multiplex-streams  Number of concurrent COPY streams in that process\n"
+		"  --order-by-pk-smaller-than  COPY smaller tables in primary key order\n"
+		"  --copy-memory-budget  Share this much COPY buffer memory between table jobs\n"
+		"  --max-copy-rate   Limit the COPY of all workers to this many bytes per second\n"
+		"  --include-schema  Only copy the tables of these schemas (patterns)\n"
+		"  --exclude-schema  Skip the tables of these schemas (patterns)\n"
+		"  --include-table   Only copy these tables (patterns)\n"
+		"  --exclude-table   Skip these tables (patterns)\n"
+		"  --exclude-tables-larger-than  Skip the tables larger than this size\n"
+		"  --table-sample    Copy a [pattern=]percent sample of the table rows\n"
+		"  --adaptive-max-lag  Pause table workers when source standbys lag this much\n"
+		"  --adaptive-max-backends  Pause table workers above this many active source backends\n",
 		cli_copy_db_getopts,
 		cli_copy_table_data);
 
@@ -154,11 +338,52 @@ cli_copy_db_getopts(int argc, char **argv)
 	static struct option long_options[] = {
 		{ "source", required_argument, NULL, 'S' },
 		{ "target", required_argument, NULL, 'T' },
+		{ "source-replica", required_argument, NULL, 'Y' },
+		{ "fanout-target", required_argument, NULL, 'G' },
+		{ "relay", required_argument, NULL, 'y' },
 		{ "jobs", required_argument, NULL, 'J' },
 		{ "table-jobs", required_argument, NULL, 'J' },
 		{ "index-jobs", required_argument, NULL, 'I' },
+		{ "vacuum-jobs", required_argument, NULL, 'U' },
+		{ "analyze-only", no_argument, NULL, 'A' },
+		{ "vacuum-parallel", required_argument, NULL, 'p' },
+		{ "restore-jobs", required_argument, NULL, 'R' },
+		{ "large-object-jobs", required_argument, NULL, 'j' },
+		{ "database-jobs", required_argument, NULL, 'a' },
 		{ "drop-if-exists", no_argument, NULL, 'c' }, /* pg_restore -c */
 		{ "no-owner", no_argument, NULL, 'O' },       /* pg_restore -O */
+		{ "resume", no_argument, NULL, 'r' },
+		{ "refresh", no_argument, NULL, 'u' },
+		{ "state-files", no_argument, NULL, 'E' },
+		{ "trace", no_argument, NULL, 'D' },
+		{ "metrics-port", required_argument, NULL, 'K' },
+		{ "metrics-listen", required_argument, NULL, 'd' },
+		{ "eta-interval", required_argument, NULL, 'e' },
+		{ "split-tables-larger-than", required_argument, NULL, 'L' },
+		{ "snapshot", required_argument, NULL, 'N' },
+		{ "not-consistent", no_argument, NULL, 'C' },
+		{ "follow", no_argument, NULL, 'f' },
+		{ "slot-name", required_argument, NULL, 's' },
+		{ "copy-format", required_argument, NULL, 'F' },
+		{ "copy-strategy", required_argument, NULL, 'g' },
+		{ "copy-freeze", no_argument, NULL, 'Z' },
+		{ "copy-buffer-size", required_argument, NULL, 'B' },
+		{ "copy-pipeline-depth", required_argument, NULL, 'P' },
+		{ "multiplex-tables-smaller-than", required_argument, NULL, 'M' },
+		{ "multiplex-streams", required_argument, NULL, 'm' },
+		{ "order-by-pk-smaller-than", required_argument, NULL, 'o' },
+		{ "index-memory-budget", required_argument, NULL, 'W' },
+		{ "bulk-load-profile", required_argument, NULL, 'X' },
+		{ "copy-memory-budget", required_argument, NULL, 'x' },
+		{ "max-copy-rate", required_argument, NULL, 'b' },
+		{ "include-schema", required_argument, NULL, 'n' },
+		{ "exclude-schema", required_argument, NULL, 'H' },
+		{ "include-table", required_argument, NULL, 't' },
+		{ "exclude-table", required_argument, NULL, 'w' },
+		{ "exclude-tables-larger-than", required_argument, NULL, 'z' },
+		{ "table-sample", required_argument, NULL, 'i' },
+		{ "adaptive-max-lag", required_argument, NULL, 'l' },
+		{ "adaptive-max-backends", required_argument, NULL, 'k' },
 		{ "version", no_argument, NULL, 'V' },
 		{ "verbose", no_argument, NULL, 'v' },
 		{ "quiet", no_argument, NULL, 'q' },
@@ -171,6 +396,19 @@ cli_copy_db_getopts(int argc, char **argv)
 	/* install default values */
 	options.tableJobs = 4;
 	options.indexJobs = 4;
+	options.vacuumJobs = 2;
+	options.restoreJobs = 4;
+	options.largeObjectJobs = 4;
+	options.databaseJobs = DEFAULT_DATABASE_JOBS;
+	options.copyBufferSize = DEFAULT_COPY_BUFFER_SIZE;
+	options.multiplexStreams = DEFAULT_MULTIPLEX_STREAMS;
+	options.etaInterval = DEFAULT_ETA_INTERVAL;
+	strlcpy(options.metricsHost,
+			DEFAULT_METRICS_HOST,
+			sizeof(options.metricsHost));
+	strlcpy(options.copyBufferSizePretty,
+			DEFAULT_COPY_BUFFER_SIZE_PRETTY,
+			sizeof(options.copyBufferSizePretty));
 
 	/* read values from the environment */
 	if (!cli_copydb_getenv(&options))
@@ -179,7 +417,7 @@ cli_copy_db_getopts(int argc, char **argv)
 		exit(EXIT_CODE_BAD_ARGS);
 	}
 
-	while ((c = getopt_long(argc, argv, "S:T:J:I:cOVvqh",
+	while ((c = getopt_long(argc, argv, "S:T:Y:G:y:J:I:U:Ap:R:j:a:cOruEDK:d:e:L:N:Cfs:F:ZB:P:M:m:o:W:X:x:b:l:k:n:H:t:w:z:i:g:Vvqh",
 							long_options, &option_index)) != -1)
 	{
 		switch (c)
@@ -197,6 +435,78 @@ cli_copy_db_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'Y':
+			{
+				if (options.sourceReplicaCount >= MAX_SOURCE_REPLICAS)
+				{
+					log_fatal("Option --source-replica may be used at most "
+							  "%d times",
+							  MAX_SOURCE_REPLICAS);
+					++errors;
+					break;
+				}
+
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --source-replica connection "
+							  "string, see above for details.");
+					++errors;
+					break;
+				}
+
+				int i = options.sourceReplicaCount++;
+
+				strlcpy(options.sourceReplicas[i], optarg, MAXCONNINFO);
+				log_trace("--source-replica %s", options.sourceReplicas[i]);
+				break;
+			}
+
+			case 'G':
+			{
+				if (options.fanoutTargetCount >= MAX_FANOUT_TARGETS)
+				{
+					log_fatal("Option --fanout-target may be used at most "
+							  "%d times",
+							  MAX_FANOUT_TARGETS);
+					++errors;
+					break;
+				}
+
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --fanout-target connection "
+							  "string, see above for details.");
+					++errors;
+					break;
+				}
+
+				int i = options.fanoutTargetCount++;
+
+				strlcpy(options.fanoutTargets[i], optarg, MAXCONNINFO);
+				log_trace("--fanout-target %s", options.fanoutTargets[i]);
+				break;
+			}
+
+			case 'y':
+			{
+				char host[BUFSIZE] = { 0 };
+				char port[NAMEDATALEN] = { 0 };
+
+				if (!relay_parse_address(optarg,
+										 host, sizeof(host),
+										 port, sizeof(port)))
+				{
+					/* errors have already been logged */
+					++errors;
+					break;
+				}
+
+				strlcpy(options.relayAddress, optarg,
+						sizeof(options.relayAddress));
+				log_trace("--relay %s", options.relayAddress);
+				break;
+			}
+
 			case 'T':
 			{
 				if (!validate_connection_string(optarg))
@@ -236,6 +546,83 @@ cli_copy_db_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'U':
+			{
+				if (!stringToInt(optarg, &options.vacuumJobs) ||
+					options.vacuumJobs < 1 ||
+					options.vacuumJobs > 128)
+				{
+					log_fatal("Failed to parse --vacuum-jobs count: \"%s\"",
+							  optarg);
+					++errors;
+				}
+				log_trace("--vacuum-jobs %d", options.vacuumJobs);
+				break;
+			}
+
+			case 'R':
+			{
+				if (!stringToInt(optarg, &options.restoreJobs) ||
+					options.restoreJobs < 1 ||
+					options.restoreJobs > 128)
+				{
+					log_fatal("Failed to parse --restore-jobs count: \"%s\"",
+							  optarg);
+					++errors;
+				}
+				log_trace("--restore-jobs %d", options.restoreJobs);
+				break;
+			}
+
+			case 'j':
+			{
+				if (!stringToInt(optarg, &options.largeObjectJobs) ||
+					options.largeObjectJobs < 1 ||
+					options.largeObjectJobs > 128)
+				{
+					log_fatal("Failed to parse --large-object-jobs count: \"%s\"",
+							  optarg);
+					++errors;
+				}
+				log_trace("--large-object-jobs %d", options.largeObjectJobs);
+				break;
+			}
+
+			case 'a':
+			{
+				if (!stringToInt(optarg, &options.databaseJobs) ||
+					options.databaseJobs < 1 ||
+					options.databaseJobs > 128)
+				{
+					log_fatal("Failed to parse --database-jobs count: \"%s\"",
+							  optarg);
+					++errors;
+				}
+				log_trace("--database-jobs %d", options.databaseJobs);
+				break;
+			}
+
+			case 'A':
+			{
+				options.analyzeOnly = true;
+				log_trace("--analyze-only");
+				break;
+			}
+
+			case 'p':
+			{
+				if (!stringToInt(optarg, &options.vacuumParallel) ||
+					options.vacuumParallel < 0 ||
+					options.vacuumParallel > 1024)
+				{
+					log_fatal("Failed to parse --vacuum-parallel: \"%s\"",
+							  optarg);
+					++errors;
+				}
+				log_trace("--vacuum-parallel %d", options.vacuumParallel);
+				break;
+			}
+
 			case 'c':
 			{
 				options.dropIfExists = true;
@@ -250,146 +637,1247 @@ cli_copy_db_getopts(int argc, char **argv)
 				break;
 			}
 
-			case 'V':
+			case 'r':
 			{
-				/* keeper_cli_print_version prints version and exits. */
-				cli_print_version(argc, argv);
+				options.resume = true;
+				log_trace("--resume");
 				break;
 			}
 
-			case 'v':
+			case 'u':
 			{
-				++verboseCount;
-				switch (verboseCount)
+				options.refresh = true;
+				log_trace("--refresh");
+				break;
+			}
+
+			case 'E':
+			{
+				options.stateFiles = true;
+				log_trace("--state-files");
+				break;
+			}
+
+			case 'D':
+			{
+				options.trace = true;
+				log_trace("--trace");
+				break;
+			}
+
+			case 'K':
+			{
+				if (!stringToInt(optarg, &options.metricsPort) ||
+					options.metricsPort < 1 ||
+					options.metricsPort > 65535)
 				{
-					case 1:
-					{
-						log_set_level(LOG_INFO);
-						break;
-					}
+					log_fatal("Failed to parse --metrics-port: \"%s\"",
+							  optarg);
+					++errors;
+				}
+				log_trace("--metrics-port %d", options.metricsPort);
+				break;
+			}
 
-					case 2:
-					{
-						log_set_level(LOG_DEBUG);
-						break;
-					}
+			case 'd':
+			{
+				if (!cli_parse_metrics_listen(optarg, &options))
+				{
+					log_fatal("Failed to parse --metrics-listen: \"%s\"",
+							  optarg);
+					++errors;
+				}
+				log_trace("--metrics-listen %s:%d",
+						  options.metricsHost,
+						  options.metricsPort);
+				break;
+			}
 
-					default:
-					{
-						log_set_level(LOG_TRACE);
-						break;
-					}
+			case 'e':
+			{
+				if (!stringToInt(optarg, &options.etaInterval) ||
+					options.etaInterval < 0)
+				{
+					log_fatal("Failed to parse --eta-interval: \"%s\"",
+							  optarg);
+					++errors;
 				}
+				log_trace("--eta-interval %d", options.etaInterval);
 				break;
 			}
 
-			case 'q':
+			case 'L':
 			{
-				log_set_level(LOG_ERROR);
+				if (!cli_parse_bytes_pretty(
+						optarg,
+						&options.splitTablesLargerThan,
+						options.splitTablesLargerThanPretty,
+						sizeof(options.splitTablesLargerThanPretty)))
+				{
+					log_fatal("Failed to parse --split-tables-larger-than: \"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				log_trace("--split-tables-larger-than %s (%lld)",
+						  options.splitTablesLargerThanPretty,
+						  (long long) options.splitTablesLargerThan);
 				break;
 			}
 
-			case 'h':
+			case 'N':
 			{
-				commandline_help(stderr);
-				exit(EXIT_CODE_QUIT);
+				strlcpy(options.snapshot, optarg, sizeof(options.snapshot));
+				log_trace("--snapshot %s", options.snapshot);
 				break;
 			}
-		}
-	}
 
-	if (IS_EMPTY_STRING_BUFFER(options.source_pguri) ||
-		IS_EMPTY_STRING_BUFFER(options.target_pguri))
-	{
-		log_fatal("Options --source and --target are mandatory");
-		exit(EXIT_CODE_BAD_ARGS);
-	}
+			case 'C':
+			{
+				options.notConsistent = true;
+				log_trace("--not-consistent");
+				break;
+			}
 
-	if (errors > 0)
-	{
-		commandline_help(stderr);
-		exit(EXIT_CODE_BAD_ARGS);
-	}
+			case 'f':
+			{
+				options.follow = true;
+				log_trace("--follow");
+				break;
+			}
 
-	/* publish our option parsing in the global variable */
-	copyDBoptions = options;
+			case 's':
+			{
+				strlcpy(options.slotName, optarg, sizeof(options.slotName));
+				log_trace("--slot-name %s", options.slotName);
+				break;
+			}
 
-	return optind;
-}
+			case 'F':
+			{
+				if (!copy_format_from_string(optarg, &options.copyFormat))
+				{
+					log_fatal("Failed to parse --copy-format \"%s\", "
+							  "expected either text or binary",
+							  optarg);
+					++errors;
+				}
+				log_trace("--copy-format %s",
+						  CopyFormatToString(options.copyFormat));
+				break;
+			}
 
+			case 'Z':
+			{
+				options.copyFreeze = true;
+				log_trace("--copy-freeze");
+				break;
+			}
 
-/*
- * cli_copydb_getenv reads from the environment variables and fills-in the
- * command line options.
- */
-static bool
-cli_copydb_getenv(CopyDBOptions *options)
-{
-	int errors = 0;
+			case 'g':
+			{
+				if (!cli_parse_copy_strategy(optarg, &options.copyStrategyAuto))
+				{
+					log_fatal("Failed to parse --copy-strategy \"%s\", "
+							  "expected either manual or auto",
+							  optarg);
+					++errors;
+				}
+				log_trace("--copy-strategy %s",
+						  options.copyStrategyAuto ? "auto" : "manual");
+				break;
+			}
+
+			case 'B':
+			{
+				if (!cli_parse_copy_buffer_size(optarg, &options))
+				{
+					log_fatal("Failed to parse --copy-buffer-size: \"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				log_trace("--copy-buffer-size %s (%d)",
+						  options.copyBufferSizePretty,
+						  options.copyBufferSize);
+				break;
+			}
+
+			case 'P':
+			{
+				if (!stringToInt(optarg, &options.copyPipelineDepth) ||
+					options.copyPipelineDepth < 0 ||
+					options.copyPipelineDepth > MAX_COPY_PIPELINE_DEPTH)
+				{
+					log_fatal("Failed to parse --copy-pipeline-depth: \"%s\"",
+							  optarg);
+					++errors;
+				}
+				log_trace("--copy-pipeline-depth %d", options.copyPipelineDepth);
+				break;
+			}
+
+			case 'M':
+			{
+				if (!cli_parse_bytes_pretty(
+						optarg,
+						&options.multiplexTablesSmallerThan,
+						options.multiplexTablesSmallerThanPretty,
+						sizeof(options.multiplexTablesSmallerThanPretty)))
+				{
+					log_fatal("Failed to parse --multiplex-tables-smaller-than: "
+							  "\"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				log_trace("--multiplex-tables-smaller-than %s (%lld)",
+						  options.multiplexTablesSmallerThanPretty,
+						  (long long) options.multiplexTablesSmallerThan);
+				break;
+			}
+
+			case 'o':
+			{
+				if (!cli_parse_bytes_pretty(
+						optarg,
+						&options.orderByPkSmallerThan,
+						options.orderByPkSmallerThanPretty,
+						sizeof(options.orderByPkSmallerThanPretty)))
+				{
+					log_fatal("Failed to parse --order-by-pk-smaller-than: "
+							  "\"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				log_trace("--order-by-pk-smaller-than %s (%lld)",
+						  options.orderByPkSmallerThanPretty,
+						  (long long) options.orderByPkSmallerThan);
+				break;
+			}
+
+			case 'm':
+			{
+				if (!stringToInt(optarg, &options.multiplexStreams) ||
+					options.multiplexStreams < 1 ||
+					options.multiplexStreams > MAX_MULTIPLEX_STREAMS)
+				{
+					log_fatal("Failed to parse --multiplex-streams: \"%s\", "
+							  "expected a number of streams between 1 and %d",
+							  optarg,
+							  MAX_MULTIPLEX_STREAMS);
+					++errors;
+				}
+				log_trace("--multiplex-streams %d", options.multiplexStreams);
+				break;
+			}
+
+			case 'W':
+			{
+				if (!cli_parse_bytes_pretty(
+						optarg,
+						&options.indexMemoryBudget,
+						options.indexMemoryBudgetPretty,
+						sizeof(options.indexMemoryBudgetPretty)))
+				{
+					log_fatal("Failed to parse --index-memory-budget: \"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				log_trace("--index-memory-budget %s (%lld)",
+						  options.indexMemoryBudgetPretty,
+						  (long long) options.indexMemoryBudget);
+				break;
+			}
+
+			case 'x':
+			{
+				if (!cli_parse_bytes_pretty(
+						optarg,
+						&options.copyMemoryBudget,
+						options.copyMemoryBudgetPretty,
+						sizeof(options.copyMemoryBudgetPretty)))
+				{
+					log_fatal("Failed to parse --copy-memory-budget: \"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				log_trace("--copy-memory-budget %s (%lld)",
+						  options.copyMemoryBudgetPretty,
+						  (long long) options.copyMemoryBudget);
+				break;
+			}
+
+			case 'b':
+			{
+				if (!cli_parse_bytes_pretty(
+						optarg,
+						&options.maxCopyRate,
+						options.maxCopyRatePretty,
+						sizeof(options.maxCopyRatePretty)))
+				{
+					log_fatal("Failed to parse --max-copy-rate: \"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				log_trace("--max-copy-rate %s (%lld)",
+						  options.maxCopyRatePretty,
+						  (long long) options.maxCopyRate);
+				break;
+			}
+
+			case 'l':
+			{
+				if (!cli_parse_bytes_pretty(
+						optarg,
+						&options.adaptiveMaxLag,
+						options.adaptiveMaxLagPretty,
+						sizeof(options.adaptiveMaxLagPretty)))
+				{
+					log_fatal("Failed to parse --adaptive-max-lag: \"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				log_trace("--adaptive-max-lag %s (%lld)",
+						  options.adaptiveMaxLagPretty,
+						  (long long) options.adaptiveMaxLag);
+				break;
+			}
+
+			case 'k':
+			{
+				if (!stringToInt(optarg, &options.adaptiveMaxBackends) ||
+					options.adaptiveMaxBackends < 1)
+				{
+					log_fatal("Failed to parse --adaptive-max-backends: \"%s\"",
+							  optarg);
+					++errors;
+				}
+				log_trace("--adaptive-max-backends %d",
+						  options.adaptiveMaxBackends);
+				break;
+			}
+
+			case 'X':
+			{
+				BulkLoadProfile profile = { 0 };
+
+				if (!copydb_parse_bulk_load_profile(optarg, &profile))
+				{
+					log_fatal("Failed to parse --bulk-load-profile: \"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				strlcpy(options.bulkLoadProfile, optarg,
+						sizeof(options.bulkLoadProfile));
+
+				log_trace("--bulk-load-profile %s", options.bulkLoadProfile);
+				break;
+			}
+
+			case 'n':
+			{
+				if (!cli_append_table_filter(options.includeSchema,
+											 sizeof(options.includeSchema),
+											 optarg))
+				{
+					log_fatal("Failed to parse --include-schema: \"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				log_trace("--include-schema %s", options.includeSchema);
+				break;
+			}
+
+			case 'H':
+			{
+				if (!cli_append_table_filter(options.excludeSchema,
+											 sizeof(options.excludeSchema),
+											 optarg))
+				{
+					log_fatal("Failed to parse --exclude-schema: \"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				log_trace("--exclude-schema %s", options.excludeSchema);
+				break;
+			}
+
+			case 't':
+			{
+				if (!cli_append_table_filter(options.includeTable,
+											 sizeof(options.includeTable),
+											 optarg))
+				{
+					log_fatal("Failed to parse --include-table: \"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				log_trace("--include-table %s", options.includeTable);
+				break;
+			}
+
+			case 'w':
+			{
+				if (!cli_append_table_filter(options.excludeTable,
+											 sizeof(options.excludeTable),
+											 optarg))
+				{
+					log_fatal("Failed to parse --exclude-table: \"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				log_trace("--exclude-table %s", options.excludeTable);
+				break;
+			}
+
+			case 'z':
+			{
+				if (!cli_parse_bytes_pretty(
+						optarg,
+						&options.excludeTablesLargerThan,
+						options.excludeTablesLargerThanPretty,
+						sizeof(options.excludeTablesLargerThanPretty)))
+				{
+					log_fatal("Failed to parse --exclude-tables-larger-than: "
+							  "\"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				log_trace("--exclude-tables-larger-than %s (%lld)",
+						  options.excludeTablesLargerThanPretty,
+						  (long long) options.excludeTablesLargerThan);
+				break;
+			}
+
+			case 'i':
+			{
+				TableSampleList sample = { 0 };
+
+				if (!copydb_parse_table_sample(optarg, &sample))
+				{
+					log_fatal("Failed to parse --table-sample: \"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				strlcpy(options.tableSample, optarg,
+						sizeof(options.tableSample));
+
+				log_trace("--table-sample %s", options.tableSample);
+				break;
+			}
+
+			case 'V':
+			{
+				/* keeper_cli_print_version prints version and exits. */
+				cli_print_version(argc, argv);
+				break;
+			}
+
+			case 'v':
+			{
+				++verboseCount;
+				switch (verboseCount)
+				{
+					case 1:
+					{
+						log_set_level(LOG_INFO);
+						break;
+					}
+
+					case 2:
+					{
+						log_set_level(LOG_DEBUG);
+						break;
+					}
+
+					default:
+					{
+						log_set_level(LOG_TRACE);
+						break;
+					}
+				}
+				break;
+			}
+
+			case 'q':
+			{
+				log_set_level(LOG_ERROR);
+				break;
+			}
+
+			case 'h':
+			{
+				commandline_help(stderr);
+				exit(EXIT_CODE_QUIT);
+				break;
+			}
+		}
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(options.source_pguri) ||
+		IS_EMPTY_STRING_BUFFER(options.target_pguri))
+	{
+		log_fatal("Options --source and --target are mandatory");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (options.notConsistent && !IS_EMPTY_STRING_BUFFER(options.snapshot))
+	{
+		log_fatal("Options --snapshot and --not-consistent are not compatible");
+		++errors;
+	}
+
+	if (options.resume && options.dropIfExists)
+	{
+		log_fatal("Options --resume and --drop-if-exists are not compatible");
+		++errors;
+	}
+
+	if (options.follow &&
+		(options.notConsistent || !IS_EMPTY_STRING_BUFFER(options.snapshot)))
+	{
+		log_fatal("Option --follow is not compatible with either --snapshot "
+				  "or --not-consistent: it needs to export its own snapshot");
+		++errors;
+	}
+
+	if (options.follow && options.sourceReplicaCount > 0)
+	{
+		log_fatal("Options --follow and --source-replica are not compatible");
+		++errors;
+	}
+
+	/* each standby exports its own snapshot, at its own replay LSN */
+	if (options.sourceReplicaCount > 1 && !options.notConsistent)
+	{
+		log_fatal("Using more than one --source-replica requires "
+				  "--not-consistent: the standby servers snapshots are not "
+				  "taken at the same LSN");
+		++errors;
+	}
+
+	if (options.follow && options.resume)
+	{
+		log_fatal("Options --follow and --resume are not compatible");
+		++errors;
+	}
+
+	if (options.fanoutTargetCount > 0 &&
+		(options.follow || options.resume || options.copyFreeze))
+	{
+		log_fatal("Option --fanout-target is not compatible with either "
+				  "--follow, --resume, or --copy-freeze");
+		++errors;
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(options.relayAddress) &&
+		(options.sourceReplicaCount > 0 || options.fanoutTargetCount > 0))
+	{
+		log_fatal("Option --relay is not compatible with either "
+				  "--source-replica or --fanout-target");
+		++errors;
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(options.slotName))
+	{
+		strlcpy(options.slotName, DEFAULT_SLOT_NAME, sizeof(options.slotName));
+	}
+	else if (!copydb_validate_slot_name(options.slotName))
+	{
+		log_fatal("Failed to parse --slot-name \"%s\": replication slot "
+				  "names may only contain lower case letters, numbers, "
+				  "and the underscore character",
+				  options.slotName);
+		++errors;
+	}
+
+	if (options.analyzeOnly && options.vacuumParallel > 0)
+	{
+		log_fatal("Options --analyze-only and --vacuum-parallel "
+				  "are not compatible");
+		++errors;
+	}
+
+	if (options.refresh &&
+		(options.follow ||
+		 options.dropIfExists ||
+		 !IS_EMPTY_STRING_BUFFER(options.snapshot)))
+	{
+		log_fatal("Option --refresh is not compatible with either --follow, "
+				  "--drop-if-exists, or --snapshot: the tables change markers "
+				  "are read before exporting the snapshot");
+		++errors;
+	}
+
+	/* --refresh skips what the previous run has done, as --resume does */
+	if (options.refresh)
+	{
+		options.resume = true;
+	}
+
+	if (options.indexMemoryBudget > 0 &&
+		options.indexMemoryBudget < (uint64_t) options.indexJobs * INDEX_MEMORY_MIN)
+	{
+		log_fatal("Option --index-memory-budget %s is too small for "
+				  "--index-jobs %d: each index job needs at least 1 MB",
+				  options.indexMemoryBudgetPretty,
+				  options.indexJobs);
+		++errors;
+	}
+
+	if (options.copyMemoryBudget > 0 &&
+		options.copyMemoryBudget <
+		(uint64_t) options.tableJobs * options.copyBufferSize)
+	{
+		log_fatal("Option --copy-memory-budget %s is too small for "
+				  "--table-jobs %d: each table job needs at least "
+				  "--copy-buffer-size %s",
+				  options.copyMemoryBudgetPretty,
+				  options.tableJobs,
+				  options.copyBufferSizePretty);
+		++errors;
+	}
+
+	if (errors > 0)
+	{
+		commandline_help(stderr);
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* publish our option parsing in the global variable */
+	copyDBoptions = options;
+
+	return optind;
+}
+
+
+/*
+ * cli_copydb_getenv reads from the environment variables and fills-in the
+ * command line options.
+ */
+bool
+cli_copydb_getenv(CopyDBOptions *options)
+{
+	int errors = 0;
+
+	/* now some of the options can be also set from the environment */
+	if (env_exists(PGCOPYDB_SOURCE_PGURI))
+	{
+		if (!get_env_copy(PGCOPYDB_SOURCE_PGURI,
+						  options->source_pguri,
+						  sizeof(options->source_pguri)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_TARGET_PGURI))
+	{
+		if (!get_env_copy(PGCOPYDB_TARGET_PGURI,
+						  options->target_pguri,
+						  sizeof(options->target_pguri)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_TARGET_TABLE_JOBS))
+	{
+		char jobs[BUFSIZE] = { 0 };
+
+		if (get_env_copy(PGCOPYDB_TARGET_TABLE_JOBS, jobs, sizeof(jobs)))
+		{
+			if (!stringToInt(jobs, &options->tableJobs) ||
+				options->tableJobs < 1 ||
+				options->tableJobs > 128)
+			{
+				log_fatal("Failed to parse PGCOPYDB_TARGET_TABLE_JOBS: \"%s\"",
+						  jobs);
+				++errors;
+			}
+		}
+		else
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_TARGET_INDEX_JOBS))
+	{
+		char jobs[BUFSIZE] = { 0 };
+
+		if (get_env_copy(PGCOPYDB_TARGET_INDEX_JOBS, jobs, sizeof(jobs)))
+		{
+			if (!stringToInt(jobs, &options->indexJobs) ||
+				options->indexJobs < 1 ||
+				options->indexJobs > 128)
+			{
+				log_fatal("Failed to parse PGCOPYDB_TARGET_INDEX_JOBS: \"%s\"",
+						  jobs);
+				++errors;
+			}
+		}
+		else
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_TARGET_VACUUM_JOBS))
+	{
+		char jobs[BUFSIZE] = { 0 };
+
+		if (get_env_copy(PGCOPYDB_TARGET_VACUUM_JOBS, jobs, sizeof(jobs)))
+		{
+			if (!stringToInt(jobs, &options->vacuumJobs) ||
+				options->vacuumJobs < 1 ||
+				options->vacuumJobs > 128)
+			{
+				log_fatal("Failed to parse PGCOPYDB_TARGET_VACUUM_JOBS: \"%s\"",
+						  jobs);
+				++errors;
+			}
+		}
+		else
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_RESTORE_JOBS))
+	{
+		char jobs[BUFSIZE] = { 0 };
+
+		if (get_env_copy(PGCOPYDB_RESTORE_JOBS, jobs, sizeof(jobs)))
+		{
+			if (!stringToInt(jobs, &options->restoreJobs) ||
+				options->restoreJobs < 1 ||
+				options->restoreJobs > 128)
+			{
+				log_fatal("Failed to parse PGCOPYDB_RESTORE_JOBS: \"%s\"",
+						  jobs);
+				++errors;
+			}
+		}
+		else
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_LARGE_OBJECT_JOBS))
+	{
+		char jobs[BUFSIZE] = { 0 };
+
+		if (get_env_copy(PGCOPYDB_LARGE_OBJECT_JOBS, jobs, sizeof(jobs)))
+		{
+			if (!stringToInt(jobs, &options->largeObjectJobs) ||
+				options->largeObjectJobs < 1 ||
+				options->largeObjectJobs > 128)
+			{
+				log_fatal("Failed to parse PGCOPYDB_LARGE_OBJECT_JOBS: \"%s\"",
+						  jobs);
+				++errors;
+			}
+		}
+		else
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_DATABASE_JOBS))
+	{
+		char jobs[BUFSIZE] = { 0 };
+
+		if (get_env_copy(PGCOPYDB_DATABASE_JOBS, jobs, sizeof(jobs)))
+		{
+			if (!stringToInt(jobs, &options->databaseJobs) ||
+				options->databaseJobs < 1 ||
+				options->databaseJobs > 128)
+			{
+				log_fatal("Failed to parse PGCOPYDB_DATABASE_JOBS: \"%s\"",
+						  jobs);
+				++errors;
+			}
+		}
+		else
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_ANALYZE_ONLY))
+	{
+		char ANALYZE_ONLY[BUFSIZE] = { 0 };
+
+		if (!get_env_copy(PGCOPYDB_ANALYZE_ONLY,
+						  ANALYZE_ONLY,
+						  sizeof(ANALYZE_ONLY)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+		else if (!parse_bool(ANALYZE_ONLY, &(options->analyzeOnly)))
+		{
+			log_error("Failed to parse environment variable \"%s\" "
+					  "value \"%s\", expected a boolean (on/off)",
+					  PGCOPYDB_ANALYZE_ONLY,
+					  ANALYZE_ONLY);
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_VACUUM_PARALLEL))
+	{
+		char parallel[BUFSIZE] = { 0 };
+
+		if (get_env_copy(PGCOPYDB_VACUUM_PARALLEL, parallel, sizeof(parallel)))
+		{
+			if (!stringToInt(parallel, &options->vacuumParallel) ||
+				options->vacuumParallel < 0 ||
+				options->vacuumParallel > 1024)
+			{
+				log_fatal("Failed to parse PGCOPYDB_VACUUM_PARALLEL: \"%s\"",
+						  parallel);
+				++errors;
+			}
+		}
+		else
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_SPLIT_TABLES_LARGER_THAN))
+	{
+		char bytes[BUFSIZE] = { 0 };
+
+		if (!get_env_copy(PGCOPYDB_SPLIT_TABLES_LARGER_THAN,
+						  bytes,
+						  sizeof(bytes)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+		else if (!cli_parse_bytes_pretty(
+					 bytes,
+					 &options->splitTablesLargerThan,
+					 options->splitTablesLargerThanPretty,
+					 sizeof(options->splitTablesLargerThanPretty)))
+		{
+			log_fatal("Failed to parse PGCOPYDB_SPLIT_TABLES_LARGER_THAN: "
+					  " \"%s\"",
+					  bytes);
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_SNAPSHOT))
+	{
+		if (!get_env_copy(PGCOPYDB_SNAPSHOT,
+						  options->snapshot,
+						  sizeof(options->snapshot)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_COPY_FORMAT))
+	{
+		char format[BUFSIZE] = { 0 };
+
+		if (!get_env_copy(PGCOPYDB_COPY_FORMAT, format, sizeof(format)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+		else if (!copy_format_from_string(format, &(options->copyFormat)))
+		{
+			log_fatal("Failed to parse PGCOPYDB_COPY_FORMAT: \"%s\", "
+					  "expected either text or binary",
+					  format);
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_COPY_FREEZE))
+	{
+		char COPY_FREEZE[BUFSIZE] = { 0 };
+
+		if (!get_env_copy(PGCOPYDB_COPY_FREEZE,
+						  COPY_FREEZE,
+						  sizeof(COPY_FREEZE)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+		else if (!parse_bool(COPY_FREEZE, &(options->copyFreeze)))
+		{
+			log_error("Failed to parse environment variable \"%s\" "
+					  "value \"%s\", expected a boolean (on/off)",
+					  PGCOPYDB_COPY_FREEZE,
+					  COPY_FREEZE);
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_COPY_STRATEGY))
+	{
+		char strategy[BUFSIZE] = { 0 };
+
+		if (!get_env_copy(PGCOPYDB_COPY_STRATEGY, strategy, sizeof(strategy)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+		else if (!cli_parse_copy_strategy(strategy,
+										  &(options->copyStrategyAuto)))
+		{
+			log_fatal("Failed to parse PGCOPYDB_COPY_STRATEGY: \"%s\", "
+					  "expected either manual or auto",
+					  strategy);
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_STATE_FILES))
+	{
+		char STATE_FILES[BUFSIZE] = { 0 };
+
+		if (!get_env_copy(PGCOPYDB_STATE_FILES,
+						  STATE_FILES,
+						  sizeof(STATE_FILES)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+		else if (!parse_bool(STATE_FILES, &(options->stateFiles)))
+		{
+			log_error("Failed to parse environment variable \"%s\" "
+					  "value \"%s\", expected a boolean (on/off)",
+					  PGCOPYDB_STATE_FILES,
+					  STATE_FILES);
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_TRACE))
+	{
+		char TRACE[BUFSIZE] = { 0 };
+
+		if (!get_env_copy(PGCOPYDB_TRACE, TRACE, sizeof(TRACE)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+		else if (!parse_bool(TRACE, &(options->trace)))
+		{
+			log_error("Failed to parse environment variable \"%s\" "
+					  "value \"%s\", expected a boolean (on/off)",
+					  PGCOPYDB_TRACE,
+					  TRACE);
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_METRICS_PORT))
+	{
+		char port[BUFSIZE] = { 0 };
+
+		if (get_env_copy(PGCOPYDB_METRICS_PORT, port, sizeof(port)))
+		{
+			if (!stringToInt(port, &options->metricsPort) ||
+				options->metricsPort < 1 ||
+				options->metricsPort > 65535)
+			{
+				log_fatal("Failed to parse PGCOPYDB_METRICS_PORT: \"%s\"",
+						  port);
+				++errors;
+			}
+		}
+		else
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_METRICS_LISTEN))
+	{
+		char address[BUFSIZE] = { 0 };
+
+		if (get_env_copy(PGCOPYDB_METRICS_LISTEN, address, sizeof(address)))
+		{
+			if (!cli_parse_metrics_listen(address, options))
+			{
+				log_fatal("Failed to parse PGCOPYDB_METRICS_LISTEN: \"%s\"",
+						  address);
+				++errors;
+			}
+		}
+		else
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_RELAY))
+	{
+		char host[BUFSIZE] = { 0 };
+		char port[NAMEDATALEN] = { 0 };
+
+		if (!get_env_copy(PGCOPYDB_RELAY,
+						  options->relayAddress,
+						  sizeof(options->relayAddress)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+		else if (!relay_parse_address(options->relayAddress,
+									  host, sizeof(host),
+									  port, sizeof(port)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_ETA_INTERVAL))
+	{
+		char interval[BUFSIZE] = { 0 };
+
+		if (get_env_copy(PGCOPYDB_ETA_INTERVAL, interval, sizeof(interval)))
+		{
+			if (!stringToInt(interval, &options->etaInterval) ||
+				options->etaInterval < 0)
+			{
+				log_fatal("Failed to parse PGCOPYDB_ETA_INTERVAL: \"%s\"",
+						  interval);
+				++errors;
+			}
+		}
+		else
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_COPY_BUFFER_SIZE))
+	{
+		char bytes[BUFSIZE] = { 0 };
+
+		if (!get_env_copy(PGCOPYDB_COPY_BUFFER_SIZE, bytes, sizeof(bytes)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+		else if (!cli_parse_copy_buffer_size(bytes, options))
+		{
+			log_fatal("Failed to parse PGCOPYDB_COPY_BUFFER_SIZE: \"%s\"",
+					  bytes);
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_COPY_PIPELINE_DEPTH))
+	{
+		char depth[BUFSIZE] = { 0 };
+
+		if (get_env_copy(PGCOPYDB_COPY_PIPELINE_DEPTH, depth, sizeof(depth)))
+		{
+			if (!stringToInt(depth, &options->copyPipelineDepth) ||
+				options->copyPipelineDepth < 0 ||
+				options->copyPipelineDepth > MAX_COPY_PIPELINE_DEPTH)
+			{
+				log_fatal("Failed to parse PGCOPYDB_COPY_PIPELINE_DEPTH: \"%s\"",
+						  depth);
+				++errors;
+			}
+		}
+		else
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_MULTIPLEX_TABLES_SMALLER_THAN))
+	{
+		char bytes[BUFSIZE] = { 0 };
+
+		if (!get_env_copy(PGCOPYDB_MULTIPLEX_TABLES_SMALLER_THAN,
+						  bytes,
+						  sizeof(bytes)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+		else if (!cli_parse_bytes_pretty(
+					 bytes,
+					 &options->multiplexTablesSmallerThan,
+					 options->multiplexTablesSmallerThanPretty,
+					 sizeof(options->multiplexTablesSmallerThanPretty)))
+		{
+			log_fatal("Failed to parse PGCOPYDB_MULTIPLEX_TABLES_SMALLER_THAN: "
+					  "\"%s\"",
+					  bytes);
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_ORDER_BY_PK_SMALLER_THAN))
+	{
+		char bytes[BUFSIZE] = { 0 };
+
+		if (!get_env_copy(PGCOPYDB_ORDER_BY_PK_SMALLER_THAN,
+						  bytes,
+						  sizeof(bytes)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+		else if (!cli_parse_bytes_pretty(
+					 bytes,
+					 &options->orderByPkSmallerThan,
+					 options->orderByPkSmallerThanPretty,
+					 sizeof(options->orderByPkSmallerThanPretty)))
+		{
+			log_fatal("Failed to parse PGCOPYDB_ORDER_BY_PK_SMALLER_THAN: "
+					  "\"%s\"",
+					  bytes);
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_MULTIPLEX_STREAMS))
+	{
+		char streams[BUFSIZE] = { 0 };
+
+		if (get_env_copy(PGCOPYDB_MULTIPLEX_STREAMS, streams, sizeof(streams)))
+		{
+			if (!stringToInt(streams, &options->multiplexStreams) ||
+				options->multiplexStreams < 1 ||
+				options->multiplexStreams > MAX_MULTIPLEX_STREAMS)
+			{
+				log_fatal("Failed to parse PGCOPYDB_MULTIPLEX_STREAMS: \"%s\", "
+						  "expected a number of streams between 1 and %d",
+						  streams,
+						  MAX_MULTIPLEX_STREAMS);
+				++errors;
+			}
+		}
+		else
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
 
-	/* now some of the options can be also set from the environment */
-	if (env_exists(PGCOPYDB_SOURCE_PGURI))
+	if (env_exists(PGCOPYDB_INDEX_MEMORY_BUDGET))
 	{
-		if (!get_env_copy(PGCOPYDB_SOURCE_PGURI,
-						  options->source_pguri,
-						  sizeof(options->source_pguri)))
+		char bytes[BUFSIZE] = { 0 };
+
+		if (!get_env_copy(PGCOPYDB_INDEX_MEMORY_BUDGET, bytes, sizeof(bytes)))
 		{
 			/* errors have already been logged */
 			++errors;
 		}
+		else if (!cli_parse_bytes_pretty(
+					 bytes,
+					 &options->indexMemoryBudget,
+					 options->indexMemoryBudgetPretty,
+					 sizeof(options->indexMemoryBudgetPretty)))
+		{
+			log_fatal("Failed to parse PGCOPYDB_INDEX_MEMORY_BUDGET: \"%s\"",
+					  bytes);
+			++errors;
+		}
 	}
 
-	if (env_exists(PGCOPYDB_TARGET_PGURI))
+	if (env_exists(PGCOPYDB_COPY_MEMORY_BUDGET))
 	{
-		if (!get_env_copy(PGCOPYDB_TARGET_PGURI,
-						  options->target_pguri,
-						  sizeof(options->target_pguri)))
+		char bytes[BUFSIZE] = { 0 };
+
+		if (!get_env_copy(PGCOPYDB_COPY_MEMORY_BUDGET, bytes, sizeof(bytes)))
 		{
 			/* errors have already been logged */
 			++errors;
 		}
+		else if (!cli_parse_bytes_pretty(
+					 bytes,
+					 &options->copyMemoryBudget,
+					 options->copyMemoryBudgetPretty,
+					 sizeof(options->copyMemoryBudgetPretty)))
+		{
+			log_fatal("Failed to parse PGCOPYDB_COPY_MEMORY_BUDGET: \"%s\"",
+					  bytes);
+			++errors;
+		}
 	}
 
-	if (env_exists(PGCOPYDB_TARGET_TABLE_JOBS))
+	if (env_exists(PGCOPYDB_MAX_COPY_RATE))
 	{
-		char jobs[BUFSIZE] = { 0 };
+		char bytes[BUFSIZE] = { 0 };
 
-		if (get_env_copy(PGCOPYDB_TARGET_TABLE_JOBS, jobs, sizeof(jobs)))
+		if (!get_env_copy(PGCOPYDB_MAX_COPY_RATE, bytes, sizeof(bytes)))
 		{
-			if (!stringToInt(jobs, &options->tableJobs) ||
-				options->tableJobs < 1 ||
-				options->tableJobs > 128)
-			{
-				log_fatal("Failed to parse PGCOPYDB_TARGET_TABLE_JOBS: \"%s\"",
-						  jobs);
-				++errors;
-			}
+			/* errors have already been logged */
+			++errors;
 		}
-		else
+		else if (!cli_parse_bytes_pretty(
+					 bytes,
+					 &options->maxCopyRate,
+					 options->maxCopyRatePretty,
+					 sizeof(options->maxCopyRatePretty)))
 		{
-			/* errors have already been logged */
+			log_fatal("Failed to parse PGCOPYDB_MAX_COPY_RATE: \"%s\"",
+					  bytes);
 			++errors;
 		}
 	}
 
-	if (env_exists(PGCOPYDB_TARGET_INDEX_JOBS))
+	if (env_exists(PGCOPYDB_BULK_LOAD_PROFILE))
 	{
-		char jobs[BUFSIZE] = { 0 };
+		BulkLoadProfile profile = { 0 };
 
-		if (get_env_copy(PGCOPYDB_TARGET_INDEX_JOBS, jobs, sizeof(jobs)))
+		if (!get_env_copy(PGCOPYDB_BULK_LOAD_PROFILE,
+						  options->bulkLoadProfile,
+						  sizeof(options->bulkLoadProfile)))
 		{
-			if (!stringToInt(jobs, &options->indexJobs) ||
-				options->indexJobs < 1 ||
-				options->indexJobs > 128)
-			{
-				log_fatal("Failed to parse PGCOPYDB_TARGET_INDEX_JOBS: \"%s\"",
-						  jobs);
-				++errors;
-			}
+			/* errors have already been logged */
+			++errors;
 		}
-		else
+		else if (!copydb_parse_bulk_load_profile(options->bulkLoadProfile,
+												 &profile))
 		{
-			/* errors have already been logged */
+			log_fatal("Failed to parse PGCOPYDB_BULK_LOAD_PROFILE: \"%s\"",
+					  options->bulkLoadProfile);
 			++errors;
 		}
 	}
@@ -423,6 +1911,121 @@ cli_copydb_getenv(CopyDBOptions *options)
 }
 
 
+/*
+ * cli_parse_copy_buffer_size parses a pretty printed byte size for the COPY
+ * buffer, and checks it is within the supported range. Zero disables the
+ * buffering of COPY rows entirely.
+ */
+static bool
+cli_parse_copy_buffer_size(const char *value, CopyDBOptions *options)
+{
+	uint64_t bytes = 0;
+
+	if (!cli_parse_bytes_pretty(value,
+								&bytes,
+								options->copyBufferSizePretty,
+								sizeof(options->copyBufferSizePretty)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (bytes > MAX_COPY_BUFFER_SIZE)
+	{
+		log_error("COPY buffer size %s is larger than the maximum of 64 MB",
+				  options->copyBufferSizePretty);
+		return false;
+	}
+
+	options->copyBufferSize = (int) bytes;
+
+	return true;
+}
+
+
+/*
+ * cli_parse_metrics_listen parses the --metrics-listen host:port option. The
+ * host part is optional, ":9187" serves the metrics on all the addresses.
+ */
+static bool
+cli_parse_metrics_listen(const char *value, CopyDBOptions *options)
+{
+	char host[BUFSIZE] = { 0 };
+	char port[NAMEDATALEN] = { 0 };
+
+	if (!relay_parse_address(value, host, sizeof(host), port, sizeof(port)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	int metricsPort = 0;
+
+	if (!stringToInt(port, &metricsPort) ||
+		metricsPort < 1 ||
+		metricsPort > 65535)
+	{
+		log_error("Failed to parse port \"%s\": expected a number "
+				  "between 1 and 65535",
+				  port);
+		return false;
+	}
+
+	strlcpy(options->metricsHost, host, sizeof(options->metricsHost));
+	options->metricsPort = metricsPort;
+
+	return true;
+}
+
+
+/*
+ * cli_parse_copy_strategy parses the --copy-strategy option: with manual, the
+ * command line options apply to all the tables, and with auto the strategy of
+ * each table is chosen from the source catalog stats.
+ */
+static bool
+cli_parse_copy_strategy(const char *value, bool *copyStrategyAuto)
+{
+	if (streq(value, "manual"))
+	{
+		*copyStrategyAuto = false;
+		return true;
+	}
+	else if (streq(value, "auto"))
+	{
+		*copyStrategyAuto = true;
+		return true;
+	}
+
+	return false;
+}
+
+
+/*
+ * cli_append_table_filter appends the patterns of a table filter option to
+ * the ones given already, so that the option may be used several times, and
+ * checks that the resulting list can be parsed.
+ */
+static bool
+cli_append_table_filter(char *filters, size_t size, const char *value)
+{
+	TableFilterList list = { 0 };
+
+	size_t len = strlen(filters);
+
+	if (sformat(filters + len, size - len, "%s%s",
+				len > 0 ? "," : "", value) >= (int) (size - len))
+	{
+		log_error("Failed to parse table filter: "
+				  "the list of patterns is longer than %d bytes",
+				  (int) size - 1);
+		return false;
+	}
+
+	return copydb_parse_filter_patterns(filters, &list);
+}
+
+
 /*
  * cli_copy_db implements the command: pgcopydb copy db
  */
@@ -431,18 +2034,50 @@ cli_copy_db(int argc, char **argv)
 {
 	CopyDataSpec copySpecs = { 0 };
 
+	if (copyDBoptions.refresh)
+	{
+		log_fatal("Option --refresh is only supported by the command "
+				  "pgcopydb copy data");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
 	(void) cli_copy_prepare_specs(&copySpecs, DATA_SECTION_ALL);
 
+	(void) cli_copy_db_run(&copySpecs);
+}
+
+
+/*
+ * cli_copy_db_run runs all the steps of pgcopydb copy db with the given
+ * specs, and exits the process when a step fails.
+ */
+static void
+cli_copy_db_run(CopyDataSpec *copySpecs)
+{
 	Summary summary = { 0 };
 	TopLevelTimings *timings = &(summary.timings);
 
 	(void) summary_set_current_time(timings, TIMING_STEP_START);
 
+	if (!copydb_prepare_snapshot(copySpecs))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_SOURCE);
+	}
+
 	log_info("STEP 1: dump the source database schema (pre/post data)");
 
 	(void) summary_set_current_time(timings, TIMING_STEP_BEFORE_SCHEMA_DUMP);
 
-	if (!copydb_dump_source_schema(&copySpecs, PG_DUMP_SECTION_SCHEMA))
+	if (copySpecs->resume &&
+		file_exists(copySpecs->dumpPaths.preFilename) &&
+		file_exists(copySpecs->dumpPaths.postFilename))
+	{
+		log_info("Skipping schema dump, re-using \"%s\" and \"%s\"",
+				 copySpecs->dumpPaths.preFilename,
+				 copySpecs->dumpPaths.postFilename);
+	}
+	else if (!copydb_dump_source_schema(copySpecs, PG_DUMP_SECTION_SCHEMA))
 	{
 		/* errors have already been logged */
 		exit(EXIT_CODE_INTERNAL_ERROR);
@@ -452,9 +2087,22 @@ cli_copy_db(int argc, char **argv)
 
 	(void) summary_set_current_time(timings, TIMING_STEP_BEFORE_PREPARE_SCHEMA);
 
-	if (!copydb_target_prepare_schema(&copySpecs))
+	/* the rest of the pre-data section is restored while copying tables */
+	if (copySpecs->resume && file_exists(copySpecs->dumpPaths.preDoneFilename))
+	{
+		log_info("Skipping pre-data restore, done in a previous run");
+	}
+	else if (!copydb_start_target_prepare_schema(copySpecs))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_TARGET);
+	}
+
+	/* the COPY to the --fanout-target needs all the tables to exist there */
+	if (!copydb_fanout_prepare_schema(copySpecs))
 	{
 		/* errors have already been logged */
+		(void) copydb_stop_target_prepare_schema(copySpecs);
 		exit(EXIT_CODE_TARGET);
 	}
 
@@ -464,15 +2112,37 @@ cli_copy_db(int argc, char **argv)
 	log_info("STEP 4: create indexes and constraints in parallel");
 	log_info("STEP 5: vacuum analyze each table");
 
-	if (!copydb_copy_all_table_data(&copySpecs))
+	if (!copydb_copy_all_table_data(copySpecs))
+	{
+		/* errors have already been logged */
+		(void) copydb_stop_target_prepare_schema(copySpecs);
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (!copydb_finish_target_prepare_schema(copySpecs))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_TARGET);
+	}
+
+	log_info("Copy large objects from source to target in sub-processes");
+
+	if (!copydb_copy_all_large_objects(copySpecs))
 	{
 		/* errors have already been logged */
 		exit(EXIT_CODE_INTERNAL_ERROR);
 	}
 
+	/* all the COPY commands are done now, release the source snapshot */
+	if (!copydb_close_snapshot(copySpecs))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_SOURCE);
+	}
+
 	log_info("STEP 6: reset the sequences values on the target database");
 
-	if (!copydb_copy_all_sequences(&copySpecs))
+	if (!copydb_copy_all_sequences(copySpecs))
 	{
 		/* errors have already been logged */
 		exit(EXIT_CODE_INTERNAL_ERROR);
@@ -482,16 +2152,151 @@ cli_copy_db(int argc, char **argv)
 
 	(void) summary_set_current_time(timings, TIMING_STEP_BEFORE_FINALIZE_SCHEMA);
 
-	if (!copydb_target_finalize_schema(&copySpecs))
+	if (!copydb_target_finalize_schema(copySpecs))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_TARGET);
+	}
+
+	if (!copydb_fanout_finalize_schema(copySpecs))
 	{
 		/* errors have already been logged */
 		exit(EXIT_CODE_TARGET);
 	}
 
 	(void) summary_set_current_time(timings, TIMING_STEP_AFTER_FINALIZE_SCHEMA);
+
+	if (copySpecs->follow)
+	{
+		log_info("STEP 8: apply changes from the replication slot until cutover");
+
+		if (!copydb_follow_changes(copySpecs))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_TARGET);
+		}
+
+		/* sequences are not decoded, reset them again after the cutover */
+		if (!copydb_copy_all_sequences(copySpecs))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+	}
+
 	(void) summary_set_current_time(timings, TIMING_STEP_END);
 
-	(void) print_summary(&summary, &copySpecs);
+	(void) print_summary(&summary, copySpecs);
+	copydb_free_table_specs(&(copySpecs->tableSpecsArray));
+}
+
+
+/*
+ * cli_copy_cluster implements the command: pgcopydb copy-cluster
+ */
+static void
+cli_copy_cluster(int argc, char **argv)
+{
+	CopyClusterSpecs clusterSpecs = { 0 };
+
+	if (copyDBoptions.sourceReplicaCount > 0 ||
+		copyDBoptions.fanoutTargetCount > 0 ||
+		copyDBoptions.follow ||
+		copyDBoptions.refresh ||
+		!IS_EMPTY_STRING_BUFFER(copyDBoptions.snapshot) ||
+		!IS_EMPTY_STRING_BUFFER(copyDBoptions.relayAddress))
+	{
+		log_fatal("Options --source-replica, --fanout-target, --follow, "
+				  "--refresh, --snapshot and --relay are not supported by "
+				  "pgcopydb copy-cluster");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* the databases can't all listen on the same port */
+	if (copyDBoptions.metricsPort > 0)
+	{
+		log_warn("Ignoring --metrics-port and --metrics-listen "
+				 "with pgcopydb copy-cluster");
+		copyDBoptions.metricsPort = 0;
+	}
+
+	log_info("[SOURCE] Copying cluster from \"%s\"", copyDBoptions.source_pguri);
+	log_info("[TARGET] Copying cluster into \"%s\"", copyDBoptions.target_pguri);
+
+	(void) find_pg_commands(&(clusterSpecs.pgPaths));
+
+	bool removeDir = !copyDBoptions.resume;
+
+	if (!copydb_init_workdir(&(clusterSpecs.cfPaths), NULL, removeDir))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	strlcpy(clusterSpecs.source_pguri,
+			copyDBoptions.source_pguri,
+			sizeof(clusterSpecs.source_pguri));
+
+	strlcpy(clusterSpecs.target_pguri,
+			copyDBoptions.target_pguri,
+			sizeof(clusterSpecs.target_pguri));
+
+	clusterSpecs.resume = copyDBoptions.resume;
+	clusterSpecs.databaseJobs = copyDBoptions.databaseJobs;
+	clusterSpecs.tableJobs = copyDBoptions.tableJobs;
+	clusterSpecs.indexJobs = copyDBoptions.indexJobs;
+	clusterSpecs.vacuumJobs = copyDBoptions.vacuumJobs;
+
+	if (!copydb_copy_cluster(&clusterSpecs, &cli_copy_cluster_database))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+}
+
+
+/*
+ * cli_copy_cluster_database copies a database of the cluster, in a database
+ * sub-process of pgcopydb copy-cluster, with the same steps as pgcopydb copy
+ * db. Its table, index and vacuum workers share the cluster job budget.
+ */
+static bool
+cli_copy_cluster_database(CopyClusterSpecs *specs,
+						  CopyClusterDatabase *database)
+{
+	CopyDataSpec copySpecs = { 0 };
+
+	(void) trace_set_process_name(database->database->datname);
+
+	log_info("[SOURCE] Copying database \"%s\"", database->database->datname);
+
+	strlcpy(copyDBoptions.source_pguri,
+			database->source_pguri,
+			sizeof(copyDBoptions.source_pguri));
+
+	strlcpy(copyDBoptions.target_pguri,
+			database->target_pguri,
+			sizeof(copyDBoptions.target_pguri));
+
+	copySpecs.pgPaths = specs->pgPaths;
+
+	if (!copydb_init_workdir(&(copySpecs.cfPaths), database->dir, false))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!copydb_init_specs(&copySpecs, &copyDBoptions, DATA_SECTION_ALL))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	copySpecs.budget = &(specs->budget);
+
+	(void) cli_copy_db_run(&copySpecs);
+
+	return true;
 }
 
 
@@ -508,6 +2313,13 @@ cli_copy_data(int argc, char **argv)
 {
 	CopyDataSpec copySpecs = { 0 };
 
+	if (copyDBoptions.fanoutTargetCount > 0)
+	{
+		log_fatal("Option --fanout-target is only supported by the command "
+				  "pgcopydb copy db");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
 	(void) cli_copy_prepare_specs(&copySpecs, DATA_SECTION_ALL);
 
 	Summary summary = { 0 };
@@ -515,6 +2327,12 @@ cli_copy_data(int argc, char **argv)
 
 	(void) summary_set_current_time(timings, TIMING_STEP_START);
 
+	if (!copydb_prepare_snapshot(&copySpecs))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_SOURCE);
+	}
+
 	log_info("Copy data from source to target in sub-processes");
 	log_info("Create indexes and constraints in parallel");
 	log_info("Vacuum analyze each table");
@@ -525,6 +2343,21 @@ cli_copy_data(int argc, char **argv)
 		exit(EXIT_CODE_INTERNAL_ERROR);
 	}
 
+	log_info("Copy large objects from source to target in sub-processes");
+
+	if (!copydb_copy_all_large_objects(&copySpecs))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	/* all the COPY commands are done now, release the source snapshot */
+	if (!copydb_close_snapshot(&copySpecs))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_SOURCE);
+	}
+
 	log_info("Reset the sequences values on the target database");
 
 	if (!copydb_copy_all_sequences(&copySpecs))
@@ -535,6 +2368,7 @@ cli_copy_data(int argc, char **argv)
 
 	(void) summary_set_current_time(timings, TIMING_STEP_END);
 	(void) print_summary(&summary, &copySpecs);
+	copydb_free_table_specs(&(copySpecs.tableSpecsArray));
 }
 
 
@@ -555,6 +2389,12 @@ cli_copy_table_data(int argc, char **argv)
 
 	(void) summary_set_current_time(timings, TIMING_STEP_START);
 
+	if (!copydb_prepare_snapshot(&copySpecs))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_SOURCE);
+	}
+
 	log_info("Copy data from source to target in sub-processes");
 
 	if (!copydb_copy_all_table_data(&copySpecs))
@@ -563,8 +2403,16 @@ cli_copy_table_data(int argc, char **argv)
 		exit(EXIT_CODE_INTERNAL_ERROR);
 	}
 
+	/* all the COPY commands are done now, release the source snapshot */
+	if (!copydb_close_snapshot(&copySpecs))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_SOURCE);
+	}
+
 	(void) summary_set_current_time(timings, TIMING_STEP_END);
 	(void) print_summary(&summary, &copySpecs);
+	copydb_free_table_specs(&(copySpecs.tableSpecsArray));
 }
 
 
@@ -595,6 +2443,7 @@ cli_copy_sequences(int argc, char **argv)
 
 	(void) summary_set_current_time(timings, TIMING_STEP_END);
 	(void) print_summary(&summary, &copySpecs);
+	copydb_free_table_specs(&(copySpecs.tableSpecsArray));
 }
 
 
@@ -624,6 +2473,7 @@ cli_copy_indexes(int argc, char **argv)
 
 	(void) summary_set_current_time(timings, TIMING_STEP_END);
 	(void) print_summary(&summary, &copySpecs);
+	copydb_free_table_specs(&(copySpecs.tableSpecsArray));
 }
 
 
@@ -654,6 +2504,7 @@ cli_copy_constraints(int argc, char **argv)
 
 	(void) summary_set_current_time(timings, TIMING_STEP_END);
 	(void) print_summary(&summary, &copySpecs);
+	copydb_free_table_specs(&(copySpecs.tableSpecsArray));
 }
 
 
@@ -680,8 +2531,25 @@ cli_copy_prepare_specs(CopyDataSpec *copySpecs, CopyDataSection section)
 			  copySpecs->pgPaths.pg_version,
 			  copySpecs->pgPaths.pg_restore);
 
-	/* only remove the top-level directory when doing a full copy  */
-	bool removeDir = section == DATA_SECTION_ALL;
+	/*
+	 * Only remove the top-level directory when doing a full copy, and keep
+	 * it when resuming a previous run: that's where its progress is tracked.
+	 */
+	bool removeDir = section == DATA_SECTION_ALL && !copyDBoptions.resume;
+
+	if (section != DATA_SECTION_ALL && copyDBoptions.fanoutTargetCount > 0)
+	{
+		log_fatal("Option --fanout-target is only supported by the command "
+				  "pgcopydb copy db");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (section != DATA_SECTION_ALL && copyDBoptions.refresh)
+	{
+		log_fatal("Option --refresh is only supported by the command "
+				  "pgcopydb copy data");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
 
 	if (!copydb_init_workdir(cfPaths, NULL, removeDir))
 	{
@@ -689,14 +2557,7 @@ cli_copy_prepare_specs(CopyDataSpec *copySpecs, CopyDataSection section)
 		exit(EXIT_CODE_INTERNAL_ERROR);
 	}
 
-	if (!copydb_init_specs(copySpecs,
-						   copyDBoptions.source_pguri,
-						   copyDBoptions.target_pguri,
-						   copyDBoptions.tableJobs,
-						   copyDBoptions.indexJobs,
-						   section,
-						   copyDBoptions.dropIfExists,
-						   copyDBoptions.noOwner))
+	if (!copydb_init_specs(copySpecs, &copyDBoptions, section))
 	{
 		/* errors have already been logged */
 		exit(EXIT_CODE_INTERNAL_ERROR);
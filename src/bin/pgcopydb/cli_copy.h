@@ -19,11 +19,65 @@ typedef struct CopyDBOptions
 {
 	char source_pguri[MAXCONNINFO];
 	char target_pguri[MAXCONNINFO];
+	char sourceReplicas[MAX_SOURCE_REPLICAS][MAXCONNINFO];
+	int sourceReplicaCount;
+	char fanoutTargets[MAX_FANOUT_TARGETS][MAXCONNINFO];
+	int fanoutTargetCount;
+	char relayAddress[BUFSIZE];
 	int tableJobs;
 	int indexJobs;
+	int vacuumJobs;
+	bool analyzeOnly;
+	int vacuumParallel;
+	int restoreJobs;
+	int largeObjectJobs;
+	int databaseJobs;
+	bool stateFiles;
+	bool trace;
+	char metricsHost[BUFSIZE];
+	int metricsPort;
+	int etaInterval;
 	bool dropIfExists;
 	bool noOwner;
+	bool resume;
+	bool refresh;
+	bool follow;
+	char slotName[NAMEDATALEN];
+	uint64_t splitTablesLargerThan;
+	char splitTablesLargerThanPretty[NAMEDATALEN];
+	char snapshot[BUFSIZE];
+	bool notConsistent;
+	CopyFormat copyFormat;
+	bool copyFreeze;
+	bool copyStrategyAuto;
+	int copyBufferSize;
+	char copyBufferSizePretty[NAMEDATALEN];
+	int copyPipelineDepth;
+	uint64_t multiplexTablesSmallerThan;
+	char multiplexTablesSmallerThanPretty[NAMEDATALEN];
+	int multiplexStreams;
+	uint64_t orderByPkSmallerThan;
+	char orderByPkSmallerThanPretty[NAMEDATALEN];
+	uint64_t indexMemoryBudget;
+	char indexMemoryBudgetPretty[NAMEDATALEN];
+	uint64_t copyMemoryBudget;
+	char copyMemoryBudgetPretty[NAMEDATALEN];
+	uint64_t maxCopyRate;
+	char maxCopyRatePretty[NAMEDATALEN];
+	uint64_t adaptiveMaxLag;
+	char adaptiveMaxLagPretty[NAMEDATALEN];
+	int adaptiveMaxBackends;
+	char bulkLoadProfile[BUFSIZE];
+	char includeSchema[BUFSIZE];
+	char excludeSchema[BUFSIZE];
+	char includeTable[BUFSIZE];
+	char excludeTable[BUFSIZE];
+	uint64_t excludeTablesLargerThan;
+	char excludeTablesLargerThanPretty[NAMEDATALEN];
+	char tableSample[BUFSIZE];
 } CopyDBOptions;
 
+bool cli_copydb_getenv(CopyDBOptions *options);
+
 
 #endif  /* CLI_COPY_H */
@@ -9,18 +9,26 @@
 #include <inttypes.h>
 
 #include "cli_common.h"
+#include "cli_copy.h"
 #include "cli_dump.h"
 #include "cli_root.h"
 #include "copydb.h"
 #include "commandline.h"
 #include "env_utils.h"
+#include "file_utils.h"
 #include "log.h"
+#include "parsing.h"
 #include "pgcmd.h"
 #include "pgsql.h"
 #include "string_utils.h"
+#include "summary.h"
 
 DumpDBOptions dumpDBoptions = { 0 };
 
+static CopyDBOptions dumpDataOptions = { 0 };
+static char dumpDataDir[MAXPGPATH] = { 0 };
+static SpoolCompression dumpDataCompression = SPOOL_COMPRESSION_ZSTD;
+
 static int cli_dump_schema_getopts(int argc, char **argv);
 static void cli_dump_schema(int argc, char **argv);
 static void cli_dump_schema_pre_data(int argc, char **argv);
@@ -29,6 +37,9 @@ static void cli_dump_schema_post_data(int argc, char **argv);
 static void cli_dump_schema_section(DumpDBOptions *dumpDBoptions,
 									PostgresDumpSection section);
 
+static int cli_dump_data_getopts(int argc, char **argv);
+static void cli_dump_data(int argc, char **argv);
+
 static CommandLine dump_schema_command =
 	make_command(
 		"schema",
@@ -59,10 +70,27 @@ static CommandLine dump_schema_post_data_command =
 		cli_dump_schema_getopts,
 		cli_dump_schema_post_data);
 
+static CommandLine dump_data_command =
+	make_command(
+		"data",
+		"Dump source database table data as compressed COPY files in target directory",
+		" --source <URI> --target <dir> [ --table-jobs ... --compression ... ] ",
+		"  --source          Postgres URI to the source database\n"
+		"  --target          Directory where to save the data files\n"
+		"  --table-jobs      Number of concurrent COPY jobs to run\n"
+		"  --split-tables-larger-than  Same-table concurrency size threshold\n"
+		"  --copy-format     COPY format to use: text (default) or binary\n"
+		"  --compression     Compression of the data files: none, lz4, zstd (default)\n"
+		"  --snapshot        Use snapshot obtained with pg_export_snapshot\n"
+		"  --not-consistent  Allow taking a new snapshot on the source database\n",
+		cli_dump_data_getopts,
+		cli_dump_data);
+
 static CommandLine *dump_subcommands[] = {
 	&dump_schema_command,
 	&dump_schema_pre_data_command,
 	&dump_schema_post_data_command,
+	&dump_data_command,
 	NULL
 };
 
@@ -255,14 +283,16 @@ cli_dump_schema_section(DumpDBOptions *dumpDBoptions,
 		exit(EXIT_CODE_INTERNAL_ERROR);
 	}
 
-	if (!copydb_init_specs(&copySpecs,
-						   dumpDBoptions->source_pguri,
-						   NULL, /* target_pguri */
-						   1,    /* table jobs */
-						   1,    /* index jobs */
-						   DATA_SECTION_NONE,
-						   false, /* dropIfExists */
-						   false)) /* noOwner */
+	CopyDBOptions options = { 0 };
+
+	strlcpy(options.source_pguri,
+			dumpDBoptions->source_pguri,
+			sizeof(options.source_pguri));
+
+	options.tableJobs = 1;
+	options.indexJobs = 1;
+
+	if (!copydb_init_specs(&copySpecs, &options, DATA_SECTION_NONE))
 	{
 		/* errors have already been logged */
 		exit(EXIT_CODE_INTERNAL_ERROR);
@@ -281,3 +311,298 @@ cli_dump_schema_section(DumpDBOptions *dumpDBoptions,
 		exit(EXIT_CODE_INTERNAL_ERROR);
 	}
 }
+
+
+/*
+ * cli_dump_data_getopts parses the CLI options for the `dump data` command.
+ */
+static int
+cli_dump_data_getopts(int argc, char **argv)
+{
+	CopyDBOptions options = { 0 };
+	char targetDir[MAXPGPATH] = { 0 };
+	SpoolCompression compression = SPOOL_COMPRESSION_ZSTD;
+	int c, option_index = 0;
+	int errors = 0, verboseCount = 0;
+
+	static struct option long_options[] = {
+		{ "source", required_argument, NULL, 'S' },
+		{ "target", required_argument, NULL, 'T' },
+		{ "jobs", required_argument, NULL, 'J' },
+		{ "table-jobs", required_argument, NULL, 'J' },
+		{ "split-tables-larger-than", required_argument, NULL, 'L' },
+		{ "copy-format", required_argument, NULL, 'F' },
+		{ "compression", required_argument, NULL, 'Z' },
+		{ "snapshot", required_argument, NULL, 'N' },
+		{ "not-consistent", no_argument, NULL, 'C' },
+		{ "version", no_argument, NULL, 'V' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	optind = 0;
+
+	/* install default values */
+	options.tableJobs = 4;
+
+	/* read values from the environment */
+	if (!cli_copydb_getenv(&options))
+	{
+		log_fatal("Failed to read default values from the environment");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	while ((c = getopt_long(argc, argv, "S:T:J:L:F:Z:N:CVvqh",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'S':
+			{
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --source connection string, "
+							  "see above for details.");
+					++errors;
+				}
+				strlcpy(options.source_pguri, optarg, MAXCONNINFO);
+				log_trace("--source %s", options.source_pguri);
+				break;
+			}
+
+			case 'T':
+			{
+				strlcpy(targetDir, optarg, MAXPGPATH);
+				log_trace("--target %s", targetDir);
+				break;
+			}
+
+			case 'J':
+			{
+				if (!stringToInt(optarg, &options.tableJobs) ||
+					options.tableJobs < 1 ||
+					options.tableJobs > 128)
+				{
+					log_fatal("Failed to parse --jobs count: \"%s\"", optarg);
+					++errors;
+				}
+				log_trace("--table-jobs %d", options.tableJobs);
+				break;
+			}
+
+			case 'L':
+			{
+				if (!cli_parse_bytes_pretty(
+						optarg,
+						&options.splitTablesLargerThan,
+						options.splitTablesLargerThanPretty,
+						sizeof(options.splitTablesLargerThanPretty)))
+				{
+					log_fatal("Failed to parse --split-tables-larger-than: \"%s\"",
+							  optarg);
+					++errors;
+				}
+
+				log_trace("--split-tables-larger-than %s (%lld)",
+						  options.splitTablesLargerThanPretty,
+						  (long long) options.splitTablesLargerThan);
+				break;
+			}
+
+			case 'F':
+			{
+				if (!copy_format_from_string(optarg, &options.copyFormat))
+				{
+					log_fatal("Failed to parse --copy-format \"%s\", "
+							  "expected either text or binary",
+							  optarg);
+					++errors;
+				}
+				log_trace("--copy-format %s",
+						  CopyFormatToString(options.copyFormat));
+				break;
+			}
+
+			case 'Z':
+			{
+				if (!spool_compression_from_string(optarg, &compression))
+				{
+					log_fatal("Failed to parse --compression \"%s\", "
+							  "expected one of none, lz4, or zstd",
+							  optarg);
+					++errors;
+				}
+				log_trace("--compression %s",
+						  spool_compression_to_string(compression));
+				break;
+			}
+
+			case 'N':
+			{
+				strlcpy(options.snapshot, optarg, sizeof(options.snapshot));
+				log_trace("--snapshot %s", options.snapshot);
+				break;
+			}
+
+			case 'C':
+			{
+				options.notConsistent = true;
+				log_trace("--not-consistent");
+				break;
+			}
+
+			case 'V':
+			{
+				/* keeper_cli_print_version prints version and exits. */
+				cli_print_version(argc, argv);
+				break;
+			}
+
+			case 'v':
+			{
+				++verboseCount;
+				switch (verboseCount)
+				{
+					case 1:
+					{
+						log_set_level(LOG_INFO);
+						break;
+					}
+
+					case 2:
+					{
+						log_set_level(LOG_DEBUG);
+						break;
+					}
+
+					default:
+					{
+						log_set_level(LOG_TRACE);
+						break;
+					}
+				}
+				break;
+			}
+
+			case 'q':
+			{
+				log_set_level(LOG_ERROR);
+				break;
+			}
+
+			case 'h':
+			{
+				commandline_help(stderr);
+				exit(EXIT_CODE_QUIT);
+				break;
+			}
+		}
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(options.source_pguri))
+	{
+		log_fatal("Option --source is mandatory");
+		++errors;
+	}
+
+	if (options.notConsistent && !IS_EMPTY_STRING_BUFFER(options.snapshot))
+	{
+		log_fatal("Options --snapshot and --not-consistent are not compatible");
+		++errors;
+	}
+
+	if (errors > 0)
+	{
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* publish our option parsing in the global variables */
+	dumpDataOptions = options;
+	dumpDataCompression = compression;
+	strlcpy(dumpDataDir, targetDir, sizeof(dumpDataDir));
+
+	return optind;
+}
+
+
+/*
+ * cli_dump_data implements the command: pgcopydb dump data
+ *
+ * The table data is written in the data directory next to the schema
+ * directory, one compressed COPY file per table or table part, and then the
+ * list of tables, indexes, and sequences is written in the catalog file that
+ * pgcopydb restore data reads.
+ */
+static void
+cli_dump_data(int argc, char **argv)
+{
+	CopyDataSpec copySpecs = { 0 };
+	CopyFilePaths *cfPaths = &(copySpecs.cfPaths);
+
+	char *dir = IS_EMPTY_STRING_BUFFER(dumpDataDir) ? NULL : dumpDataDir;
+
+	/* the directory may already contain the pgcopydb dump schema files */
+	if (!copydb_init_workdir(cfPaths, dir, false))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (!ensure_empty_dir(cfPaths->datadir, 0700) ||
+		!ensure_empty_dir(cfPaths->tbldir, 0700))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (!copydb_init_specs(&copySpecs, &dumpDataOptions, DATA_SECTION_TABLE_DATA))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	copySpecs.spoolMode = COPY_SPOOL_WRITE;
+	copySpecs.spoolCompression = dumpDataCompression;
+
+	log_info("Dumping table data from \"%s\"", copySpecs.source_pguri);
+	log_info("Dumping table data into directory \"%s\" using %s compression",
+			 cfPaths->datadir,
+			 spool_compression_to_string(copySpecs.spoolCompression));
+
+	Summary summary = { 0 };
+	TopLevelTimings *timings = &(summary.timings);
+
+	(void) summary_set_current_time(timings, TIMING_STEP_START);
+
+	if (!copydb_prepare_snapshot(&copySpecs))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_SOURCE);
+	}
+
+	if (!copydb_copy_all_table_data(&copySpecs))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	/* all the COPY commands are done now, release the source snapshot */
+	if (!copydb_close_snapshot(&copySpecs))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_SOURCE);
+	}
+
+	(void) summary_set_current_time(timings, TIMING_STEP_END);
+	(void) print_summary(&summary, &copySpecs);
+	copydb_free_table_specs(&(copySpecs.tableSpecsArray));
+
+	/* pgcopydb restore data starts with its own set of done files */
+	if (!ensure_empty_dir(cfPaths->tbldir, 0700))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+}
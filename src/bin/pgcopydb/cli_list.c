@@ -7,11 +7,13 @@
 #include <errno.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <time.h>
 
 #include "cli_common.h"
 #include "cli_list.h"
 #include "cli_root.h"
 #include "commandline.h"
+#include "copydb.h"
 #include "env_utils.h"
 #include "log.h"
 #include "pgcmd.h"
@@ -25,6 +27,9 @@ static int cli_list_db_getopts(int argc, char **argv);
 static void cli_list_tables(int argc, char **argv);
 static void cli_list_sequences(int argc, char **argv);
 static void cli_list_indexes(int argc, char **argv);
+static int cli_list_progress_getopts(int argc, char **argv);
+static void cli_list_progress(int argc, char **argv);
+static char * cli_list_progress_step(ProgressStep step);
 
 static CommandLine list_tables_command =
 	make_command(
@@ -55,11 +60,21 @@ static CommandLine list_indexes_command =
 		cli_list_db_getopts,
 		cli_list_indexes);
 
+static CommandLine list_progress_command =
+	make_command(
+		"progress",
+		"List the progress of the running pgcopydb table and index workers",
+		" [ --target ... ] ",
+		"  --target          Postgres URI to the target database\n",
+		cli_list_progress_getopts,
+		cli_list_progress);
+
 
 static CommandLine *list_subcommands[] = {
 	&list_tables_command,
 	&list_sequences_command,
 	&list_indexes_command,
+	&list_progress_command,
 	NULL
 };
 
@@ -393,3 +408,329 @@ cli_list_indexes(int argc, char **argv)
 
 	fformat(stdout, "\n");
 }
+
+
+/*
+ * cli_list_progress_getopts parses the CLI options for the `list progress`
+ * command, where the --source option is not needed.
+ */
+static int
+cli_list_progress_getopts(int argc, char **argv)
+{
+	ListDBOptions options = { 0 };
+	int c, option_index = 0;
+	int errors = 0, verboseCount = 0;
+
+	static struct option long_options[] = {
+		{ "target", required_argument, NULL, 'T' },
+		{ "version", no_argument, NULL, 'V' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	optind = 0;
+
+	while ((c = getopt_long(argc, argv, "T:Vvqh",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'T':
+			{
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --target connection string, "
+							  "see above for details.");
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				strlcpy(options.target_pguri, optarg, MAXCONNINFO);
+				log_trace("--target %s", options.target_pguri);
+				break;
+			}
+
+			case 'V':
+			{
+				/* keeper_cli_print_version prints version and exits. */
+				cli_print_version(argc, argv);
+				break;
+			}
+
+			case 'v':
+			{
+				++verboseCount;
+				switch (verboseCount)
+				{
+					case 1:
+					{
+						log_set_level(LOG_INFO);
+						break;
+					}
+
+					case 2:
+					{
+						log_set_level(LOG_DEBUG);
+						break;
+					}
+
+					default:
+					{
+						log_set_level(LOG_TRACE);
+						break;
+					}
+				}
+				break;
+			}
+
+			case 'q':
+			{
+				log_set_level(LOG_ERROR);
+				break;
+			}
+
+			case 'h':
+			{
+				commandline_help(stderr);
+				exit(EXIT_CODE_QUIT);
+				break;
+			}
+		}
+	}
+
+	/* the target is optional, only used for the CREATE INDEX progress */
+	if (IS_EMPTY_STRING_BUFFER(options.target_pguri) &&
+		env_exists(PGCOPYDB_TARGET_PGURI))
+	{
+		if (!get_env_copy(PGCOPYDB_TARGET_PGURI,
+						  options.target_pguri,
+						  sizeof(options.target_pguri)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (errors > 0)
+	{
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* publish our option parsing in the global variable */
+	listDBoptions = options;
+
+	return optind;
+}
+
+
+/*
+ * cli_list_progress implements the command: pgcopydb list progress
+ *
+ * The table and index workers of a running pgcopydb process publish their
+ * progress in the run/progress file, which we read here. When a target is
+ * given, the CREATE INDEX phases are fetched from the target server.
+ */
+static void
+cli_list_progress(int argc, char **argv)
+{
+	CopyFilePaths cfPaths = { 0 };
+	ProgressArea *progress = NULL;
+	IndexProgressArray indexProgressArray = { 0, NULL };
+
+	if (!copydb_prepare_filepaths(&cfPaths, NULL))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (!copydb_progress_read(cfPaths.progressfile, &progress))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(listDBoptions.target_pguri))
+	{
+		PGSQL pgsql = { 0 };
+		int version = 0;
+
+		if (!pgsql_init(&pgsql, listDBoptions.target_pguri, PGSQL_CONN_TARGET))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_TARGET);
+		}
+
+		if (!pgsql_server_version_num(&pgsql, &version))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_TARGET);
+		}
+
+		/* pg_stat_progress_create_index is new in Postgres 12 */
+		if (version >= 120000 &&
+			!schema_list_index_progress(&pgsql, &indexProgressArray))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_TARGET);
+		}
+
+		pgsql_finish(&pgsql);
+	}
+
+	uint64_t now = time(NULL);
+
+	log_info("pgcopydb process %d started %llds ago, "
+			 "%d table workers and %d index workers",
+			 progress->pid,
+			 (long long) (now - progress->startTime),
+			 progress->tableWorkers,
+			 progress->indexWorkers);
+
+	if (progress->etaTime > now)
+	{
+		char eta[BUFSIZE] = { 0 };
+
+		(void) IntervalToString((progress->etaTime - now) * 1000, eta, BUFSIZE);
+
+		log_info("Estimated completion in %s, see --eta-interval", eta);
+	}
+
+	fformat(stdout, "%8s | %12s | %40s | %9s | %12s | %10s | %8s | %s\n",
+			"PID", "Step", "Object", "Part", "Rows", "Bytes", "Elapsed",
+			"Progress");
+
+	fformat(stdout, "%8s-+-%12s-+-%40s-+-%9s-+-%12s-+-%10s-+-%8s-+-%s\n",
+			"--------",
+			"------------",
+			"----------------------------------------",
+			"---------",
+			"------------",
+			"----------",
+			"--------",
+			"--------------------");
+
+	int count = progress->tableWorkers + progress->indexWorkers;
+
+	for (int i = 0; i < count; i++)
+	{
+		ProgressSlot *slot = &(progress->slots[i]);
+
+		if (slot->step == PROGRESS_STEP_IDLE)
+		{
+			continue;
+		}
+
+		char object[BUFSIZE] = { 0 };
+		char part[BUFSIZE] = { 0 };
+		char bytes[BUFSIZE] = { 0 };
+		char elapsed[BUFSIZE] = { 0 };
+		char status[BUFSIZE] = { 0 };
+
+		sformat(object, sizeof(object), "\"%s\".\"%s\"",
+				slot->nspname,
+				slot->relname);
+
+		if (slot->partCount > 1)
+		{
+			sformat(part, sizeof(part), "%d/%d",
+					slot->partNumber + 1,
+					slot->partCount);
+		}
+
+		pretty_print_bytes(bytes, sizeof(bytes), slot->stats.bytes);
+
+		sformat(elapsed, sizeof(elapsed), "%llds",
+				(long long) (now - slot->startTime));
+
+		if (slot->step == PROGRESS_STEP_COPY && slot->estimatedBytes > 0)
+		{
+			char estimated[BUFSIZE] = { 0 };
+
+			pretty_print_bytes(estimated, sizeof(estimated),
+							   slot->estimatedBytes);
+
+			/* COPY bytes are not on-disk bytes, that's only an estimate */
+			sformat(status, sizeof(status), "~%.0f%% of %s on-disk",
+					100.0 * slot->stats.bytes / slot->estimatedBytes,
+					estimated);
+		}
+		else if (slot->step == PROGRESS_STEP_CREATE_INDEX)
+		{
+			for (int p = 0; p < indexProgressArray.count; p++)
+			{
+				IndexProgress *ip = &(indexProgressArray.array[p]);
+
+				if (ip->pid != slot->backendPid)
+				{
+					continue;
+				}
+
+				if (ip->blocksTotal > 0)
+				{
+					sformat(status, sizeof(status), "%s: %.0f%% of blocks",
+							ip->phase,
+							100.0 * ip->blocksDone / ip->blocksTotal);
+				}
+				else if (ip->tuplesTotal > 0)
+				{
+					sformat(status, sizeof(status), "%s: %.0f%% of tuples",
+							ip->phase,
+							100.0 * ip->tuplesDone / ip->tuplesTotal);
+				}
+				else
+				{
+					strlcpy(status, ip->phase, sizeof(status));
+				}
+				break;
+			}
+		}
+
+		fformat(stdout, "%8d | %12s | %40s | %9s | %12lld | %10s | %8s | %s\n",
+				slot->pid,
+				cli_list_progress_step(slot->step),
+				object,
+				part,
+				(long long) slot->stats.rows,
+				bytes,
+				elapsed,
+				status);
+	}
+
+	fformat(stdout, "\n");
+
+	free(progress);
+	free(indexProgressArray.array);
+}
+
+
+/*
+ * cli_list_progress_step returns a string representation of the step.
+ */
+static char *
+cli_list_progress_step(ProgressStep step)
+{
+	switch (step)
+	{
+		case PROGRESS_STEP_IDLE:
+		{
+			return "idle";
+		}
+
+		case PROGRESS_STEP_COPY:
+		{
+			return "copy";
+		}
+
+		case PROGRESS_STEP_CREATE_INDEX:
+		{
+			return "create index";
+		}
+
+		case PROGRESS_STEP_CONSTRAINTS:
+		{
+			return "constraints";
+		}
+	}
+
+	return "unknown";
+}
@@ -0,0 +1,241 @@
+/*
+ * src/bin/pgcopydb/cli_plan.c
+ *     Implementation of a CLI which lets you run individual routines
+ *     directly
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+
+#include "cli_common.h"
+#include "cli_root.h"
+#include "commandline.h"
+#include "env_utils.h"
+#include "log.h"
+#include "pgsql.h"
+#include "plan.h"
+#include "string_utils.h"
+
+static PlanSpecs planSpecs = { 0 };
+
+static int cli_plan_getopts(int argc, char **argv);
+static void cli_plan(int argc, char **argv);
+
+CommandLine plan_command =
+	make_command(
+		"plan",
+		"Recommend --table-jobs, --index-jobs and --split-tables-larger-than",
+		" --source ... [ --max-jobs ... --bench --target ... --bench-rows ... ] ",
+		"  --source          Postgres URI to the source database\n"
+		"  --max-jobs        Largest count of jobs to consider (16)\n"
+		"  --bench           Measure the COPY throughput with pgcopydb bench copy\n"
+		"  --target          Postgres URI to the target database, for --bench\n"
+		"  --bench-rows      Number of rows that each bench job copies (100000)\n",
+		cli_plan_getopts,
+		cli_plan);
+
+
+/*
+ * cli_plan_getopts parses the CLI options for the `plan` command.
+ */
+static int
+cli_plan_getopts(int argc, char **argv)
+{
+	PlanSpecs options = { 0 };
+	int c, option_index = 0;
+	int errors = 0, verboseCount = 0;
+
+	static struct option long_options[] = {
+		{ "source", required_argument, NULL, 'S' },
+		{ "target", required_argument, NULL, 'T' },
+		{ "max-jobs", required_argument, NULL, 'j' },
+		{ "bench", no_argument, NULL, 'b' },
+		{ "bench-rows", required_argument, NULL, 'n' },
+		{ "version", no_argument, NULL, 'V' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	optind = 0;
+
+	/* install default values */
+	options.maxJobs = PLAN_DEFAULT_MAX_JOBS;
+	options.benchRows = PLAN_DEFAULT_BENCH_ROWS;
+
+	/* read values from the environment */
+	if (env_exists(PGCOPYDB_SOURCE_PGURI))
+	{
+		if (!get_env_copy(PGCOPYDB_SOURCE_PGURI,
+						  options.source_pguri,
+						  sizeof(options.source_pguri)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	if (env_exists(PGCOPYDB_TARGET_PGURI))
+	{
+		if (!get_env_copy(PGCOPYDB_TARGET_PGURI,
+						  options.target_pguri,
+						  sizeof(options.target_pguri)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	while ((c = getopt_long(argc, argv, "S:T:j:bn:Vvqh",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'S':
+			{
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --source connection string, "
+							  "see above for details.");
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				strlcpy(options.source_pguri, optarg, MAXCONNINFO);
+				log_trace("--source %s", options.source_pguri);
+				break;
+			}
+
+			case 'T':
+			{
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --target connection string, "
+							  "see above for details.");
+					exit(EXIT_CODE_BAD_ARGS);
+				}
+				strlcpy(options.target_pguri, optarg, MAXCONNINFO);
+				log_trace("--target %s", options.target_pguri);
+				break;
+			}
+
+			case 'j':
+			{
+				if (!stringToInt(optarg, &options.maxJobs) ||
+					options.maxJobs < 1 ||
+					options.maxJobs > PLAN_MAX_JOBS)
+				{
+					log_fatal("Failed to parse --max-jobs: \"%s\"", optarg);
+					++errors;
+				}
+				log_trace("--max-jobs %d", options.maxJobs);
+				break;
+			}
+
+			case 'b':
+			{
+				options.bench = true;
+				log_trace("--bench");
+				break;
+			}
+
+			case 'n':
+			{
+				if (!stringToUInt64(optarg, &options.benchRows) ||
+					options.benchRows < 1)
+				{
+					log_fatal("Failed to parse --bench-rows: \"%s\"", optarg);
+					++errors;
+				}
+				log_trace("--bench-rows %lld", (long long) options.benchRows);
+				break;
+			}
+
+			case 'V':
+			{
+				/* keeper_cli_print_version prints version and exits. */
+				cli_print_version(argc, argv);
+				break;
+			}
+
+			case 'v':
+			{
+				++verboseCount;
+				switch (verboseCount)
+				{
+					case 1:
+					{
+						log_set_level(LOG_INFO);
+						break;
+					}
+
+					case 2:
+					{
+						log_set_level(LOG_DEBUG);
+						break;
+					}
+
+					default:
+					{
+						log_set_level(LOG_TRACE);
+						break;
+					}
+				}
+				break;
+			}
+
+			case 'q':
+			{
+				log_set_level(LOG_ERROR);
+				break;
+			}
+
+			case 'h':
+			{
+				commandline_help(stderr);
+				exit(EXIT_CODE_QUIT);
+				break;
+			}
+		}
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(options.source_pguri))
+	{
+		log_fatal("Option --source is mandatory");
+		++errors;
+	}
+
+	if (options.bench && IS_EMPTY_STRING_BUFFER(options.target_pguri))
+	{
+		log_fatal("Option --bench requires option --target");
+		++errors;
+	}
+
+	if (errors > 0)
+	{
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* publish our option parsing in the global variable */
+	planSpecs = options;
+
+	return optind;
+}
+
+
+/*
+ * cli_plan implements the command: pgcopydb plan
+ */
+static void
+cli_plan(int argc, char **argv)
+{
+	PlanResult result = { 0 };
+
+	if (!plan_run(&planSpecs, &result))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	(void) plan_print_results(&planSpecs, &result);
+}
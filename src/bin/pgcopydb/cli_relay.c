@@ -0,0 +1,265 @@
+/*
+ * src/bin/pgcopydb/cli_relay.c
+ *     Implementation of a CLI which lets you run individual routines
+ *     directly
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+
+#include "cli_common.h"
+#include "cli_root.h"
+#include "commandline.h"
+#include "env_utils.h"
+#include "log.h"
+#include "pgsql.h"
+#include "relay.h"
+#include "string_utils.h"
+
+static RelayServerSpecs relayServerSpecs = { 0 };
+
+static int cli_relay_server_getopts(int argc, char **argv);
+static void cli_relay_server(int argc, char **argv);
+
+static CommandLine relay_server_command =
+	make_command(
+		"server",
+		"Serve compressed COPY data from the source database to pgcopydb --relay",
+		" --source ... --listen [host]:port --trusted-network "
+		"[ --compression ... --max-connections ... ] ",
+		"  --source          Postgres URI to the source database\n"
+		"  --listen          Address and port to listen to, as host:port\n"
+		"  --trusted-network The relay connections are not encrypted, say it's ok\n"
+		"  --compression     Compression of the COPY data: none, lz4, zstd (default)\n"
+		"  --max-connections Refuse connections above this count (default 64)\n",
+		cli_relay_server_getopts,
+		cli_relay_server);
+
+static CommandLine *relay_subcommands[] = {
+	&relay_server_command,
+	NULL
+};
+
+CommandLine relay_commands =
+	make_command_set("relay",
+					 "Relay COPY data between distant source and target",
+					 NULL, NULL, NULL, relay_subcommands);
+
+
+/*
+ * cli_relay_server_getopts parses the CLI options for the `relay server`
+ * command.
+ */
+static int
+cli_relay_server_getopts(int argc, char **argv)
+{
+	RelayServerSpecs specs = { 0 };
+	int c, option_index = 0;
+	int errors = 0, verboseCount = 0;
+
+	static struct option long_options[] = {
+		{ "source", required_argument, NULL, 'S' },
+		{ "listen", required_argument, NULL, 'l' },
+		{ "compression", required_argument, NULL, 'Z' },
+		{ "max-connections", required_argument, NULL, 'c' },
+		{ "trusted-network", no_argument, NULL, 't' },
+		{ "version", no_argument, NULL, 'V' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	optind = 0;
+
+	/* install default values */
+	specs.compression = SPOOL_COMPRESSION_ZSTD;
+	specs.maxConnections = RELAY_MAX_CONNECTIONS;
+
+	while ((c = getopt_long(argc, argv, "S:l:Z:c:tVvqh",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'S':
+			{
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --source connection string, "
+							  "see above for details.");
+					++errors;
+				}
+				strlcpy(specs.source_pguri, optarg, MAXCONNINFO);
+				log_trace("--source %s", specs.source_pguri);
+				break;
+			}
+
+			case 'l':
+			{
+				char host[BUFSIZE] = { 0 };
+				char port[NAMEDATALEN] = { 0 };
+
+				if (!relay_parse_address(optarg,
+										 host, sizeof(host),
+										 port, sizeof(port)))
+				{
+					/* errors have already been logged */
+					++errors;
+					break;
+				}
+
+				strlcpy(specs.listen, optarg, sizeof(specs.listen));
+				log_trace("--listen %s", specs.listen);
+				break;
+			}
+
+			case 'Z':
+			{
+				if (!spool_compression_from_string(optarg, &specs.compression))
+				{
+					log_fatal("Failed to parse --compression \"%s\", "
+							  "expected one of none, lz4, or zstd",
+							  optarg);
+					++errors;
+				}
+				log_trace("--compression %s",
+						  spool_compression_to_string(specs.compression));
+				break;
+			}
+
+			case 'c':
+			{
+				if (!stringToInt(optarg, &specs.maxConnections) ||
+					specs.maxConnections < 1)
+				{
+					log_fatal("Failed to parse --max-connections: \"%s\"",
+							  optarg);
+					++errors;
+				}
+				log_trace("--max-connections %d", specs.maxConnections);
+				break;
+			}
+
+			case 't':
+			{
+				specs.trustedNetwork = true;
+				log_trace("--trusted-network");
+				break;
+			}
+
+			case 'V':
+			{
+				/* keeper_cli_print_version prints version and exits. */
+				cli_print_version(argc, argv);
+				break;
+			}
+
+			case 'v':
+			{
+				++verboseCount;
+				switch (verboseCount)
+				{
+					case 1:
+					{
+						log_set_level(LOG_INFO);
+						break;
+					}
+
+					case 2:
+					{
+						log_set_level(LOG_DEBUG);
+						break;
+					}
+
+					default:
+					{
+						log_set_level(LOG_TRACE);
+						break;
+					}
+				}
+				break;
+			}
+
+			case 'q':
+			{
+				log_set_level(LOG_ERROR);
+				break;
+			}
+
+			case 'h':
+			{
+				commandline_help(stderr);
+				exit(EXIT_CODE_QUIT);
+				break;
+			}
+		}
+	}
+
+	/* relay commands support the source URI environment variable */
+	if (IS_EMPTY_STRING_BUFFER(specs.source_pguri) &&
+		env_exists(PGCOPYDB_SOURCE_PGURI) &&
+		!get_env_copy(PGCOPYDB_SOURCE_PGURI,
+					  specs.source_pguri,
+					  sizeof(specs.source_pguri)))
+	{
+		/* errors have already been logged */
+		++errors;
+	}
+
+	/* the token is not an option, command lines are visible in ps */
+	if (env_exists(PGCOPYDB_RELAY_TOKEN) &&
+		!get_env_copy(PGCOPYDB_RELAY_TOKEN, specs.token, sizeof(specs.token)))
+	{
+		/* errors have already been logged */
+		++errors;
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(specs.source_pguri) ||
+		IS_EMPTY_STRING_BUFFER(specs.listen))
+	{
+		log_fatal("Options --source and --listen are mandatory");
+		++errors;
+	}
+
+	/* the token and the COPY data cross the network in clear text */
+	if (!specs.trustedNetwork)
+	{
+		log_fatal("The relay connections are not encrypted: use "
+				  "--trusted-network when the network between the relay "
+				  "server and its clients is trusted, or an SSH tunnel or "
+				  "a VPN otherwise");
+		++errors;
+	}
+
+	if (errors > 0)
+	{
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(specs.token))
+	{
+		log_warn("PGCOPYDB_RELAY_TOKEN is not set: any client that can "
+				 "connect to %s can read the source database",
+				 specs.listen);
+	}
+
+	/* publish our option parsing in the global variable */
+	relayServerSpecs = specs;
+
+	return optind;
+}
+
+
+/*
+ * cli_relay_server implements the command: pgcopydb relay server
+ */
+static void
+cli_relay_server(int argc, char **argv)
+{
+	if (!relay_server(&relayServerSpecs))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+}
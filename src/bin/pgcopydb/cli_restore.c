@@ -9,19 +9,25 @@
 #include <inttypes.h>
 
 #include "cli_common.h"
+#include "cli_copy.h"
 #include "cli_restore.h"
 #include "cli_root.h"
 #include "copydb.h"
 #include "commandline.h"
 #include "env_utils.h"
+#include "file_utils.h"
 #include "log.h"
 #include "parsing.h"
 #include "pgcmd.h"
 #include "pgsql.h"
 #include "string_utils.h"
+#include "summary.h"
 
 RestoreDBOptions restoreDBoptions = { 0 };
 
+static CopyDBOptions restoreDataOptions = { 0 };
+static char restoreDataDir[MAXPGPATH] = { 0 };
+
 static int cli_restore_schema_getopts(int argc, char **argv);
 static void cli_restore_schema(int argc, char **argv);
 static void cli_restore_schema_pre_data(int argc, char **argv);
@@ -29,6 +35,9 @@ static void cli_restore_schema_post_data(int argc, char **argv);
 
 static void cli_restore_prepare_specs(CopyDataSpec *copySpecs);
 
+static int cli_restore_data_getopts(int argc, char **argv);
+static void cli_restore_data(int argc, char **argv);
+
 static CommandLine restore_schema_command =
 	make_command(
 		"schema",
@@ -37,7 +46,8 @@ static CommandLine restore_schema_command =
 		"  --source          Directory where to find the schema custom files\n"
 		"  --target          Postgres URI to the source database\n"
 		"  --drop-if-exists  On the target database, clean-up from a previous run first\n"
-		"  --no-owner        Do not set ownership of objects to match the original database\n",
+		"  --no-owner        Do not set ownership of objects to match the original database\n"
+		"  --restore-jobs    Number of concurrent jobs for pg_restore\n",
 		cli_restore_schema_getopts,
 		cli_restore_schema);
 
@@ -60,14 +70,30 @@ static CommandLine restore_schema_post_data_command =
 		" --source <dir> --target <URI> ",
 		"  --source          Directory where to find the schema custom files\n"
 		"  --target          Postgres URI to the source database\n"
-		"  --no-owner        Do not set ownership of objects to match the original database\n",
+		"  --no-owner        Do not set ownership of objects to match the original database\n"
+		"  --restore-jobs    Number of concurrent jobs for pg_restore\n",
 		cli_restore_schema_getopts,
 		cli_restore_schema_post_data);
 
+static CommandLine restore_data_command =
+	make_command(
+		"data",
+		"Restore table data from compressed COPY files to target database",
+		" --source <dir> --target <URI> [ --table-jobs ... --index-jobs ... ] ",
+		"  --source          Directory where to find the pgcopydb dump data files\n"
+		"  --target          Postgres URI to the target database\n"
+		"  --table-jobs      Number of concurrent COPY jobs to run\n"
+		"  --index-jobs      Number of concurrent CREATE INDEX jobs to run\n"
+		"  --vacuum-jobs     Number of concurrent VACUUM jobs to run\n"
+		"  --resume          Allow resuming operations after a failure\n",
+		cli_restore_data_getopts,
+		cli_restore_data);
+
 static CommandLine *restore_subcommands[] = {
 	&restore_schema_command,
 	&restore_schema_pre_data_command,
 	&restore_schema_post_data_command,
+	&restore_data_command,
 	NULL
 };
 
@@ -86,6 +112,7 @@ cli_restore_schema_getopts(int argc, char **argv)
 	RestoreDBOptions options = { 0 };
 	int c, option_index = 0;
 	int errors = 0, verboseCount = 0;
+	bool restoreJobsOption = false;
 
 	static struct option long_options[] = {
 		{ "source", required_argument, NULL, 'S' },
@@ -93,6 +120,7 @@ cli_restore_schema_getopts(int argc, char **argv)
 		{ "schema", required_argument, NULL, 's' },
 		{ "drop-if-exists", no_argument, NULL, 'c' }, /* pg_restore -c */
 		{ "no-owner", no_argument, NULL, 'O' },       /* pg_restore -O */
+		{ "restore-jobs", required_argument, NULL, 'R' },
 		{ "version", no_argument, NULL, 'V' },
 		{ "verbose", no_argument, NULL, 'v' },
 		{ "quiet", no_argument, NULL, 'q' },
@@ -102,7 +130,10 @@ cli_restore_schema_getopts(int argc, char **argv)
 
 	optind = 0;
 
-	while ((c = getopt_long(argc, argv, "S:T:cOVvqh",
+	/* install default values */
+	options.restoreJobs = 4;
+
+	while ((c = getopt_long(argc, argv, "S:T:cOR:Vvqh",
 							long_options, &option_index)) != -1)
 	{
 		switch (c)
@@ -141,6 +172,21 @@ cli_restore_schema_getopts(int argc, char **argv)
 				break;
 			}
 
+			case 'R':
+			{
+				if (!stringToInt(optarg, &options.restoreJobs) ||
+					options.restoreJobs < 1 ||
+					options.restoreJobs > 128)
+				{
+					log_fatal("Failed to parse --restore-jobs count: \"%s\"",
+							  optarg);
+					++errors;
+				}
+				restoreJobsOption = true;
+				log_trace("--restore-jobs %d", options.restoreJobs);
+				break;
+			}
+
 			case 'V':
 			{
 				/* keeper_cli_print_version prints version and exits. */
@@ -235,6 +281,25 @@ cli_restore_schema_getopts(int argc, char **argv)
 		}
 	}
 
+	/* when --restore-jobs has not been used, check PGCOPYDB_RESTORE_JOBS */
+	if (!restoreJobsOption && env_exists(PGCOPYDB_RESTORE_JOBS))
+	{
+		char jobs[BUFSIZE] = { 0 };
+
+		if (!get_env_copy(PGCOPYDB_RESTORE_JOBS, jobs, sizeof(jobs)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+		else if (!stringToInt(jobs, &(options.restoreJobs)) ||
+				 options.restoreJobs < 1 ||
+				 options.restoreJobs > 128)
+		{
+			log_fatal("Failed to parse PGCOPYDB_RESTORE_JOBS: \"%s\"", jobs);
+			++errors;
+		}
+	}
+
 	if (errors > 0)
 	{
 		exit(EXIT_CODE_BAD_ARGS);
@@ -332,14 +397,19 @@ cli_restore_prepare_specs(CopyDataSpec *copySpecs)
 		exit(EXIT_CODE_INTERNAL_ERROR);
 	}
 
-	if (!copydb_init_specs(copySpecs,
-						   NULL, /* source_pguri */
-						   restoreDBoptions.target_pguri,
-						   1,    /* table jobs */
-						   1,    /* index jobs */
-						   DATA_SECTION_NONE,
-						   restoreDBoptions.dropIfExists,
-						   restoreDBoptions.noOwner))
+	CopyDBOptions options = { 0 };
+
+	strlcpy(options.target_pguri,
+			restoreDBoptions.target_pguri,
+			sizeof(options.target_pguri));
+
+	options.tableJobs = 1;
+	options.indexJobs = 1;
+	options.dropIfExists = restoreDBoptions.dropIfExists;
+	options.noOwner = restoreDBoptions.noOwner;
+	options.restoreJobs = restoreDBoptions.restoreJobs;
+
+	if (!copydb_init_specs(copySpecs, &options, DATA_SECTION_NONE))
 	{
 		/* errors have already been logged */
 		exit(EXIT_CODE_INTERNAL_ERROR);
@@ -352,3 +422,264 @@ cli_restore_prepare_specs(CopyDataSpec *copySpecs)
 			 pgPaths->pg_version,
 			 pgPaths->pg_restore);
 }
+
+
+/*
+ * cli_restore_data_getopts parses the CLI options for the `restore data`
+ * command.
+ */
+static int
+cli_restore_data_getopts(int argc, char **argv)
+{
+	CopyDBOptions options = { 0 };
+	char sourceDir[MAXPGPATH] = { 0 };
+	int c, option_index = 0;
+	int errors = 0, verboseCount = 0;
+
+	static struct option long_options[] = {
+		{ "source", required_argument, NULL, 'S' },
+		{ "target", required_argument, NULL, 'T' },
+		{ "jobs", required_argument, NULL, 'J' },
+		{ "table-jobs", required_argument, NULL, 'J' },
+		{ "index-jobs", required_argument, NULL, 'I' },
+		{ "vacuum-jobs", required_argument, NULL, 'W' },
+		{ "resume", no_argument, NULL, 'r' },
+		{ "version", no_argument, NULL, 'V' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+	optind = 0;
+
+	/* install default values */
+	options.tableJobs = 4;
+	options.indexJobs = 4;
+	options.vacuumJobs = 2;
+
+	/* read values from the environment */
+	if (!cli_copydb_getenv(&options))
+	{
+		log_fatal("Failed to read default values from the environment");
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	while ((c = getopt_long(argc, argv, "S:T:J:I:W:rVvqh",
+							long_options, &option_index)) != -1)
+	{
+		switch (c)
+		{
+			case 'S':
+			{
+				strlcpy(sourceDir, optarg, MAXPGPATH);
+				log_trace("--source %s", sourceDir);
+				break;
+			}
+
+			case 'T':
+			{
+				if (!validate_connection_string(optarg))
+				{
+					log_fatal("Failed to parse --target connection string, "
+							  "see above for details.");
+					++errors;
+				}
+				strlcpy(options.target_pguri, optarg, MAXCONNINFO);
+				log_trace("--target %s", options.target_pguri);
+				break;
+			}
+
+			case 'J':
+			{
+				if (!stringToInt(optarg, &options.tableJobs) ||
+					options.tableJobs < 1 ||
+					options.tableJobs > 128)
+				{
+					log_fatal("Failed to parse --jobs count: \"%s\"", optarg);
+					++errors;
+				}
+				log_trace("--table-jobs %d", options.tableJobs);
+				break;
+			}
+
+			case 'I':
+			{
+				if (!stringToInt(optarg, &options.indexJobs) ||
+					options.indexJobs < 1 ||
+					options.indexJobs > 128)
+				{
+					log_fatal("Failed to parse --index-jobs count: \"%s\"",
+							  optarg);
+					++errors;
+				}
+				log_trace("--index-jobs %d", options.indexJobs);
+				break;
+			}
+
+			case 'W':
+			{
+				if (!stringToInt(optarg, &options.vacuumJobs) ||
+					options.vacuumJobs < 1 ||
+					options.vacuumJobs > 128)
+				{
+					log_fatal("Failed to parse --vacuum-jobs count: \"%s\"",
+							  optarg);
+					++errors;
+				}
+				log_trace("--vacuum-jobs %d", options.vacuumJobs);
+				break;
+			}
+
+			case 'r':
+			{
+				options.resume = true;
+				log_trace("--resume");
+				break;
+			}
+
+			case 'V':
+			{
+				/* keeper_cli_print_version prints version and exits. */
+				cli_print_version(argc, argv);
+				break;
+			}
+
+			case 'v':
+			{
+				++verboseCount;
+				switch (verboseCount)
+				{
+					case 1:
+					{
+						log_set_level(LOG_INFO);
+						break;
+					}
+
+					case 2:
+					{
+						log_set_level(LOG_DEBUG);
+						break;
+					}
+
+					default:
+					{
+						log_set_level(LOG_TRACE);
+						break;
+					}
+				}
+				break;
+			}
+
+			case 'q':
+			{
+				log_set_level(LOG_ERROR);
+				break;
+			}
+
+			case 'h':
+			{
+				commandline_help(stderr);
+				exit(EXIT_CODE_QUIT);
+				break;
+			}
+		}
+	}
+
+	if (IS_EMPTY_STRING_BUFFER(options.target_pguri))
+	{
+		log_fatal("Option --target is mandatory");
+		++errors;
+	}
+
+	if (errors > 0)
+	{
+		exit(EXIT_CODE_BAD_ARGS);
+	}
+
+	/* the table data comes from files, never from a source database */
+	options.source_pguri[0] = '\0';
+	options.notConsistent = true;
+
+	/* publish our option parsing in the global variables */
+	restoreDataOptions = options;
+	strlcpy(restoreDataDir, sourceDir, sizeof(restoreDataDir));
+
+	return optind;
+}
+
+
+/*
+ * cli_restore_data implements the command: pgcopydb restore data
+ *
+ * The COPY files written by pgcopydb dump data are sent to the target
+ * database by the table workers, and then the indexes, constraints, and
+ * VACUUM jobs run in the same pipeline as with pgcopydb copy db.
+ */
+static void
+cli_restore_data(int argc, char **argv)
+{
+	CopyDataSpec copySpecs = { 0 };
+	CopyFilePaths *cfPaths = &(copySpecs.cfPaths);
+
+	char *dir = IS_EMPTY_STRING_BUFFER(restoreDataDir) ? NULL : restoreDataDir;
+
+	if (!copydb_init_workdir(cfPaths, dir, false))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	/* without --resume, forget about the done files of a previous restore */
+	if (!restoreDataOptions.resume)
+	{
+		if (!ensure_empty_dir(cfPaths->tbldir, 0700) ||
+			!ensure_empty_dir(cfPaths->idxdir, 0700))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+
+		if (file_exists(cfPaths->journalfile) &&
+			!unlink_file(cfPaths->journalfile))
+		{
+			/* errors have already been logged */
+			exit(EXIT_CODE_INTERNAL_ERROR);
+		}
+	}
+
+	if (!copydb_init_specs(&copySpecs, &restoreDataOptions, DATA_SECTION_ALL))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	copySpecs.spoolMode = COPY_SPOOL_READ;
+
+	log_info("Restoring table data from \"%s\"", cfPaths->datadir);
+	log_info("Restoring table data into \"%s\"", copySpecs.target_pguri);
+
+	Summary summary = { 0 };
+	TopLevelTimings *timings = &(summary.timings);
+
+	(void) summary_set_current_time(timings, TIMING_STEP_START);
+
+	if (!copydb_copy_all_table_data(&copySpecs))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_INTERNAL_ERROR);
+	}
+
+	SourceSequenceArray sequenceArray = { 0, NULL };
+
+	if (!copydb_spool_read_sequences(&copySpecs, &sequenceArray) ||
+		!copydb_set_all_sequences(&copySpecs, &sequenceArray))
+	{
+		/* errors have already been logged */
+		exit(EXIT_CODE_TARGET);
+	}
+
+	(void) summary_set_current_time(timings, TIMING_STEP_END);
+	(void) print_summary(&summary, &copySpecs);
+	copydb_free_table_specs(&(copySpecs.tableSpecsArray));
+}
@@ -21,6 +21,7 @@ typedef struct RestoreDBOptions
 	char target_pguri[MAXCONNINFO];
 	bool dropIfExists;
 	bool noOwner;
+	int restoreJobs;
 } RestoreDBOptions;
 
 
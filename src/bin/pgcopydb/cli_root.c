@@ -23,10 +23,15 @@ CommandLine version =
  */
 CommandLine *root_subcommands_with_debug[] = {
 	&copy__db_command,
+	&copy__cluster_command,
 	&dump_commands,
 	&restore_commands,
 	&copy_commands,
 	&list_commands,
+	&bench_commands,
+	&plan_command,
+	&compare_commands,
+	&relay_commands,
 	&help,
 	&version,
 	NULL
@@ -43,10 +48,15 @@ CommandLine root_with_debug =
  */
 CommandLine *root_subcommands[] = {
 	&copy__db_command,
+	&copy__cluster_command,
 	&dump_commands,
 	&restore_commands,
 	&copy_commands,
 	&list_commands,
+	&bench_commands,
+	&plan_command,
+	&compare_commands,
+	&relay_commands,
 	&help,
 	&version,
 	NULL
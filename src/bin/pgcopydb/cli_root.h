@@ -35,6 +35,7 @@ int root_options(int argc, char **argv);
 
 /* cli_copy.h */
 extern CommandLine copy__db_command;
+extern CommandLine copy__cluster_command;
 extern CommandLine copy_commands;
 
 /* cli_dump.h */
@@ -46,4 +47,16 @@ extern CommandLine restore_commands;
 /* cli_list.h */
 extern CommandLine list_commands;
 
+/* cli_bench.c */
+extern CommandLine bench_commands;
+
+/* cli_plan.c */
+extern CommandLine plan_command;
+
+/* cli_compare.c */
+extern CommandLine compare_commands;
+
+/* cli_relay.c */
+extern CommandLine relay_commands;
+
 #endif  /* CLI_ROOT_H */
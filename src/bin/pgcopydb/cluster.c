@@ -0,0 +1,730 @@
+/*
+ * src/bin/pgcopydb/cluster.c
+ *     Implementation of a CLI to copy all the databases of a Postgres cluster
+ */
+
+#include <errno.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "copydb.h"
+#include "file_utils.h"
+#include "lock_utils.h"
+#include "log.h"
+#include "parsing.h"
+#include "pgcmd.h"
+#include "pgsql.h"
+#include "pqexpbuffer.h"
+#include "schema.h"
+#include "signals.h"
+#include "string_utils.h"
+
+
+static bool copydb_cluster_copy_globals(CopyClusterSpecs *specs);
+static bool copydb_cluster_filter_globals(CopyClusterSpecs *specs);
+static bool copydb_cluster_global_exists(char *existing, const char *line);
+static bool copydb_cluster_create_databases(CopyClusterSpecs *specs);
+static bool copydb_cluster_create_database(PGSQL *dst, SourceDatabase *database);
+static bool copydb_cluster_prepare_database(CopyClusterSpecs *specs,
+											SourceDatabase *database,
+											CopyClusterDatabase *clusterDatabase);
+static bool copydb_cluster_start_database(CopyClusterSpecs *specs,
+										  CopyClusterDatabase *clusterDatabase,
+										  CopyClusterDatabaseFun *fun,
+										  pid_t *pid);
+
+
+/*
+ * copydb_copy_cluster copies all the databases of the source cluster to the
+ * target cluster. The globals (roles and tablespaces) are copied first, then
+ * the databases are created on the target, and then at most --database-jobs
+ * database sub-processes copy the databases, largest first.
+ *
+ * The table, index and vacuum workers of all the databases share a global
+ * budget of --table-jobs, --index-jobs and --vacuum-jobs slots, so that the
+ * given counts of jobs are the total for the cluster, whatever the count of
+ * databases that are being copied at the same time.
+ */
+bool
+copydb_copy_cluster(CopyClusterSpecs *specs, CopyClusterDatabaseFun *fun)
+{
+	CopyFilePaths *cfPaths = &(specs->cfPaths);
+	SourceDatabaseArray *databaseArray = &(specs->databaseArray);
+
+	sformat(specs->globalsFilename, sizeof(specs->globalsFilename),
+			"%s/globals.sql",
+			cfPaths->schemadir);
+
+	sformat(specs->globalsTargetFilename, sizeof(specs->globalsTargetFilename),
+			"%s/globals.target.sql",
+			cfPaths->schemadir);
+
+	sformat(specs->globalsDoneFile, sizeof(specs->globalsDoneFile),
+			"%s/globals.done",
+			cfPaths->schemadir);
+
+	sformat(specs->databasesDir, sizeof(specs->databasesDir),
+			"%s/databases",
+			cfPaths->topdir);
+
+	if (pg_mkdir_p(specs->databasesDir, 0700) == -1)
+	{
+		log_fatal("Failed to create directory \"%s\"", specs->databasesDir);
+		return false;
+	}
+
+	PGSQL src = { 0 };
+
+	if (!pgsql_init(&src, specs->source_pguri, PGSQL_CONN_SOURCE))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!schema_list_databases(&src, databaseArray))
+	{
+		/* errors have already been logged */
+		pgsql_finish(&src);
+		return false;
+	}
+
+	pgsql_finish(&src);
+
+	log_info("Fetched information for %d databases", databaseArray->count);
+
+	if (!copydb_cluster_copy_globals(specs))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!copydb_cluster_create_databases(specs))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!copydb_job_budget_init(&(specs->budget),
+								specs->tableJobs,
+								specs->indexJobs,
+								specs->vacuumJobs))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	int count = databaseArray->count;
+	pid_t *pids = (pid_t *) calloc(count > 0 ? count : 1, sizeof(pid_t));
+
+	if (pids == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		(void) copydb_job_budget_finish(&(specs->budget));
+		return false;
+	}
+
+	bool success = true;
+	int next = 0;
+	int running = 0;
+
+	for (;;)
+	{
+		/* start databases until we have --database-jobs of them running */
+		while (success &&
+			   running < specs->databaseJobs &&
+			   next < count &&
+			   !(asked_to_quit || asked_to_stop || asked_to_stop_fast))
+		{
+			SourceDatabase *database = &(databaseArray->array[next]);
+			CopyClusterDatabase clusterDatabase = { 0 };
+
+			if (!copydb_cluster_prepare_database(specs,
+												 database,
+												 &clusterDatabase))
+			{
+				/* errors have already been logged */
+				success = false;
+				break;
+			}
+
+			if (specs->resume && file_exists(clusterDatabase.doneFile))
+			{
+				log_info("Skipping database \"%s\", done in a previous run",
+						 database->datname);
+				++next;
+				continue;
+			}
+
+			if (!copydb_cluster_start_database(specs,
+											   &clusterDatabase,
+											   fun,
+											   &(pids[next])))
+			{
+				/* errors have already been logged */
+				success = false;
+				break;
+			}
+
+			log_info("Started copying database \"%s\" (%d/%d) in process %d",
+					 database->datname,
+					 next + 1,
+					 count,
+					 pids[next]);
+
+			++next;
+			++running;
+		}
+
+		if (running == 0)
+		{
+			break;
+		}
+
+		int status;
+
+		log_flush();
+
+		pid_t pid = waitpid(-1, &status, 0);
+
+		if (pid == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			log_error("Failed to wait for the database sub-processes: %m");
+			success = false;
+			break;
+		}
+
+		int dbIndex = -1;
+
+		for (int i = 0; i < next; i++)
+		{
+			if (pids[i] == pid)
+			{
+				dbIndex = i;
+				break;
+			}
+		}
+
+		if (dbIndex == -1)
+		{
+			continue;
+		}
+
+		--running;
+
+		SourceDatabase *database = &(databaseArray->array[dbIndex]);
+		int returnCode = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+		if (returnCode == 0)
+		{
+			log_info("Copied database \"%s\"", database->datname);
+		}
+		else
+		{
+			log_error("Failed to copy database \"%s\": "
+					  "process %d exited with code %d",
+					  database->datname,
+					  pid,
+					  returnCode);
+			success = false;
+		}
+	}
+
+	if (next < count && success)
+	{
+		log_error("Copied %d databases out of %d", next, count);
+		success = false;
+	}
+
+	free(pids);
+
+	if (!copydb_job_budget_finish(&(specs->budget)))
+	{
+		/* errors have already been logged */
+		success = false;
+	}
+
+	return success;
+}
+
+
+/*
+ * copydb_cluster_copy_globals dumps the roles and the tablespaces of the
+ * source cluster with pg_dumpall --globals-only, and replays the script on
+ * the target cluster. Roles and tablespaces that already exist on the
+ * target, such as the bootstrap superuser, are not created again, see
+ * copydb_cluster_filter_globals(), and any other error stops the script.
+ */
+static bool
+copydb_cluster_copy_globals(CopyClusterSpecs *specs)
+{
+	if (specs->resume && file_exists(specs->globalsDoneFile))
+	{
+		log_info("Skipping globals, done in a previous run");
+		return true;
+	}
+
+	log_info("Copy the roles and tablespaces of the source cluster");
+
+	if (!pg_dumpall_globals(&(specs->pgPaths),
+							specs->source_pguri,
+							specs->globalsFilename))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!copydb_cluster_filter_globals(specs))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!psql_run_file(&(specs->pgPaths),
+					   specs->target_pguri,
+					   specs->globalsTargetFilename))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!write_file("", 0, specs->globalsDoneFile))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_cluster_filter_globals writes a copy of the pg_dumpall script where
+ * the CREATE ROLE and CREATE TABLESPACE commands of the roles and tablespaces
+ * that exist on the target cluster already are commented out. pg_dumpall
+ * writes each of those commands on a line of its own, and the ALTER ROLE
+ * commands that follow still apply the source attributes to existing roles.
+ */
+static bool
+copydb_cluster_filter_globals(CopyClusterSpecs *specs)
+{
+	PGSQL dst = { 0 };
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+
+	/* the same quoting as pg_dumpall, one command prefix per line */
+	char *sql =
+		"select coalesce(string_agg(prefix, E'\\n'), '') "
+		"  from (select 'CREATE ROLE ' || quote_ident(rolname) || ';' "
+		"          from pg_roles "
+		"         union all "
+		"        select 'CREATE TABLESPACE ' || quote_ident(spcname) || ' ' "
+		"          from pg_tablespace) as existing(prefix)";
+
+	if (!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pgsql_execute_with_params(&dst, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult) ||
+		!context.parsedOk)
+	{
+		log_error("Failed to list the roles and tablespaces of the target");
+		pgsql_finish(&dst);
+		return false;
+	}
+
+	pgsql_finish(&dst);
+
+	char *contents = NULL;
+	long fileSize = 0L;
+
+	if (!read_file(specs->globalsFilename, &contents, &fileSize))
+	{
+		/* errors have already been logged */
+		free(context.strVal);
+		return false;
+	}
+
+	PQExpBuffer script = createPQExpBuffer();
+	int skipped = 0;
+
+	char *line = contents;
+
+	while (line != NULL && *line != '\0')
+	{
+		char *newline = strchr(line, '\n');
+
+		if (newline != NULL)
+		{
+			*newline = '\0';
+		}
+
+		if (copydb_cluster_global_exists(context.strVal, line))
+		{
+			log_debug("Skipping existing global object: %s", line);
+			appendPQExpBuffer(script, "-- exists on the target: %s\n", line);
+			++skipped;
+		}
+		else
+		{
+			appendPQExpBuffer(script, "%s\n", line);
+		}
+
+		line = newline != NULL ? newline + 1 : NULL;
+	}
+
+	free(contents);
+	free(context.strVal);
+
+	if (PQExpBufferBroken(script))
+	{
+		log_error("Failed to prepare the globals script: out of memory");
+		destroyPQExpBuffer(script);
+		return false;
+	}
+
+	log_info("Skipping %d roles and tablespaces that exist on the target",
+			 skipped);
+
+	bool success =
+		write_file(script->data, script->len, specs->globalsTargetFilename);
+
+	destroyPQExpBuffer(script);
+
+	return success;
+}
+
+
+/*
+ * copydb_cluster_global_exists returns true when the given script line
+ * starts with one of the newline separated command prefixes in existing.
+ */
+static bool
+copydb_cluster_global_exists(char *existing, const char *line)
+{
+	if (strncmp(line, "CREATE ROLE ", 12) != 0 &&
+		strncmp(line, "CREATE TABLESPACE ", 18) != 0)
+	{
+		return false;
+	}
+
+	for (char *prefix = existing; prefix != NULL && *prefix != '\0';)
+	{
+		char *next = strchr(prefix, '\n');
+		size_t len = next != NULL ? (size_t) (next - prefix) : strlen(prefix);
+
+		if (len > 0 && strncmp(line, prefix, len) == 0)
+		{
+			return true;
+		}
+
+		prefix = next != NULL ? next + 1 : NULL;
+	}
+
+	return false;
+}
+
+
+/*
+ * copydb_cluster_create_databases creates the databases of the source
+ * cluster that do not exist yet on the target cluster, with the same owner,
+ * encoding and locale.
+ */
+static bool
+copydb_cluster_create_databases(CopyClusterSpecs *specs)
+{
+	SourceDatabaseArray *databaseArray = &(specs->databaseArray);
+	PGSQL dst = { 0 };
+
+	if (!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int i = 0; i < databaseArray->count; i++)
+	{
+		if (!copydb_cluster_create_database(&dst, &(databaseArray->array[i])))
+		{
+			/* errors have already been logged */
+			pgsql_finish(&dst);
+			return false;
+		}
+	}
+
+	pgsql_finish(&dst);
+
+	return true;
+}
+
+
+/*
+ * copydb_cluster_create_database creates the given database on the target
+ * cluster, unless it exists there already.
+ */
+static bool
+copydb_cluster_create_database(PGSQL *dst, SourceDatabase *database)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BOOL, false };
+
+	char *sql =
+		"select exists(select 1 from pg_database where datname = $1)";
+
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { database->datname };
+
+	if (!pgsql_execute_with_params(dst, sql, 1, paramTypes, paramValues,
+								   &context, &parseSingleValueResult) ||
+		!context.parsedOk)
+	{
+		log_error("Failed to check if database \"%s\" exists on the target",
+				  database->datname);
+		return false;
+	}
+
+	if (context.boolVal)
+	{
+		log_info("Database \"%s\" already exists on the target",
+				 database->datname);
+		return true;
+	}
+
+	/* we need a connection to quote the identifiers and literals */
+	if (dst->connection == NULL && !pgsql_open_persistent_connection(dst))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	PGconn *conn = dst->connection;
+
+	char *datname =
+		PQescapeIdentifier(conn, database->datname, strlen(database->datname));
+	char *owner =
+		PQescapeIdentifier(conn, database->owner, strlen(database->owner));
+	char *encoding =
+		PQescapeLiteral(conn, database->encoding, strlen(database->encoding));
+	char *collate =
+		PQescapeLiteral(conn, database->collate, strlen(database->collate));
+	char *ctype =
+		PQescapeLiteral(conn, database->ctype, strlen(database->ctype));
+
+	bool success = false;
+
+	if (datname != NULL && owner != NULL && encoding != NULL &&
+		collate != NULL && ctype != NULL)
+	{
+		char create[BUFSIZE] = { 0 };
+
+		sformat(create, sizeof(create),
+				"CREATE DATABASE %s WITH TEMPLATE template0 OWNER %s "
+				"ENCODING %s LC_COLLATE %s LC_CTYPE %s",
+				datname, owner, encoding, collate, ctype);
+
+		log_info("%s", create);
+
+		success = pgsql_execute(dst, create);
+	}
+	else
+	{
+		log_error("Failed to quote the properties of database \"%s\": %s",
+				  database->datname,
+				  PQerrorMessage(conn));
+	}
+
+	PQfreemem(datname);
+	PQfreemem(owner);
+	PQfreemem(encoding);
+	PQfreemem(collate);
+	PQfreemem(ctype);
+
+	return success;
+}
+
+
+/*
+ * copydb_cluster_prepare_database computes the work directory and the
+ * connection strings of the given database.
+ */
+static bool
+copydb_cluster_prepare_database(CopyClusterSpecs *specs,
+								SourceDatabase *database,
+								CopyClusterDatabase *clusterDatabase)
+{
+	clusterDatabase->database = database;
+
+	sformat(clusterDatabase->dir, sizeof(clusterDatabase->dir),
+			"%s/%u",
+			specs->databasesDir,
+			database->oid);
+
+	sformat(clusterDatabase->doneFile, sizeof(clusterDatabase->doneFile),
+			"%s/%u.done",
+			specs->databasesDir,
+			database->oid);
+
+	if (!build_connection_string_for_dbname(specs->source_pguri,
+											database->datname,
+											clusterDatabase->source_pguri) ||
+		!build_connection_string_for_dbname(specs->target_pguri,
+											database->datname,
+											clusterDatabase->target_pguri))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_cluster_start_database forks a sub-process that copies the given
+ * database, and writes its doneFile when successful.
+ */
+static bool
+copydb_cluster_start_database(CopyClusterSpecs *specs,
+							  CopyClusterDatabase *clusterDatabase,
+							  CopyClusterDatabaseFun *fun,
+							  pid_t *pid)
+{
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	int fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork a database sub-process");
+			return false;
+		}
+
+		case 0:
+		{
+			/* child process runs the command */
+			if (!(*fun)(specs, clusterDatabase))
+			{
+				/* errors have already been logged */
+				exit(EXIT_CODE_INTERNAL_ERROR);
+			}
+
+			if (!write_file("", 0, clusterDatabase->doneFile))
+			{
+				/* errors have already been logged */
+				exit(EXIT_CODE_INTERNAL_ERROR);
+			}
+
+			exit(EXIT_CODE_QUIT);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			*pid = fpid;
+
+			return true;
+		}
+	}
+}
+
+
+/*
+ * copydb_job_budget_init creates the counting semaphores of the global job
+ * budget, with as many slots as the given counts of jobs.
+ */
+bool
+copydb_job_budget_init(CopyJobBudget *budget,
+					   int tableJobs,
+					   int indexJobs,
+					   int vacuumJobs)
+{
+	int slots[COPY_JOB_BUDGET_COUNT] = { 0 };
+
+	slots[COPY_JOB_BUDGET_TABLE] = tableJobs;
+	slots[COPY_JOB_BUDGET_INDEX] = indexJobs;
+	slots[COPY_JOB_BUDGET_VACUUM] = vacuumJobs;
+
+	for (int i = 0; i < COPY_JOB_BUDGET_COUNT; i++)
+	{
+		budget->slots[i].initValue = slots[i] > 0 ? slots[i] : 1;
+
+		if (!semaphore_create(&(budget->slots[i])))
+		{
+			log_error("Failed to create the job budget semaphores");
+
+			for (int j = 0; j < i; j++)
+			{
+				(void) semaphore_finish(&(budget->slots[j]));
+			}
+			return false;
+		}
+	}
+
+	log_info("Sharing %d table jobs, %d index jobs and %d vacuum jobs "
+			 "between all the databases",
+			 budget->slots[COPY_JOB_BUDGET_TABLE].initValue,
+			 budget->slots[COPY_JOB_BUDGET_INDEX].initValue,
+			 budget->slots[COPY_JOB_BUDGET_VACUUM].initValue);
+
+	return true;
+}
+
+
+/*
+ * copydb_job_budget_finish removes the semaphores of the global job budget.
+ */
+bool
+copydb_job_budget_finish(CopyJobBudget *budget)
+{
+	bool success = true;
+
+	for (int i = 0; i < COPY_JOB_BUDGET_COUNT; i++)
+	{
+		success = semaphore_finish(&(budget->slots[i])) && success;
+	}
+
+	return success;
+}
+
+
+/*
+ * copydb_job_budget_acquire waits until a slot of the given kind of jobs is
+ * available in the global job budget, and takes it. Without a budget, that's
+ * outside of pgcopydb copy-cluster, there's nothing to wait for.
+ */
+bool
+copydb_job_budget_acquire(CopyJobBudget *budget, CopyJobBudgetKind kind)
+{
+	if (budget == NULL)
+	{
+		return true;
+	}
+
+	return semaphore_lock(&(budget->slots[kind]));
+}
+
+
+/*
+ * copydb_job_budget_release gives back a slot of the global job budget. The
+ * semaphore operations use SEM_UNDO, so the slots of a worker that exits
+ * without releasing them are also given back.
+ */
+void
+copydb_job_budget_release(CopyJobBudget *budget, CopyJobBudgetKind kind)
+{
+	if (budget == NULL)
+	{
+		return;
+	}
+
+	(void) semaphore_unlock(&(budget->slots[kind]));
+}
@@ -0,0 +1,1321 @@
+/*
+ * src/bin/pgcopydb/compare.c
+ *     Compare the data of the source and target databases
+ *
+ * pgcopydb compare data computes the count of rows and an order independent
+ * hash of the rows of each table, on the source in the exported snapshot and
+ * on the target, and reports the tables where they differ.
+ *
+ * The hash of a row is the first 64 bits of the md5 of its text output, and
+ * the hash of a set of rows is the sum of its row hashes, so that the rows
+ * may be read in any order. The session settings that change the text output
+ * of some data types are the same on both sides, see compareSettings.
+ *
+ * Tables that are larger than --split-tables-larger-than, and have a single
+ * column primary key, are compared in several chunks that are ranges of
+ * their primary key values, as found in a sample of the source table. The
+ * chunks are then processed by --table-jobs compare workers, largest first.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cli_common.h"
+#include "compare.h"
+#include "copydb.h"
+#include "file_utils.h"
+#include "log.h"
+#include "parson.h"
+#include "pgsql.h"
+#include "signals.h"
+#include "string_utils.h"
+
+
+/* the same text output for the same data on the source and on the target */
+static char *compareSettings[] = {
+	"set datestyle to 'ISO, YMD'",
+	"set intervalstyle to 'postgres'",
+	"set timezone to 'UTC'",
+	"set extra_float_digits to 3",
+	"set bytea_output to 'hex'",
+	NULL
+};
+
+/* the primary key range boundaries of a table, found on the source */
+typedef struct CompareBoundsContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	int count;
+	char **values;              /* malloc'ed area */
+	bool parsedOk;
+} CompareBoundsContext;
+
+/* the count of rows and the hash of a chunk */
+typedef struct CompareHashContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	int64_t rows;
+	char hash[COMPARE_HASH_SIZE];
+	bool parsedOk;
+} CompareHashContext;
+
+
+static bool compare_prepare_chunks(CompareSpecs *specs, PGSQL *pgsql,
+								   CompareChunk **chunks, int *chunkCount);
+static bool compare_table_bounds(CopyDataSpec *copySpecs,
+								 CopyTableDataSpec *tableSpecs,
+								 PGSQL *pgsql,
+								 char **pkColumn,
+								 CompareBoundsContext *bounds);
+static bool compare_queue_init(CompareSpecs *specs,
+							   CompareChunk *chunks,
+							   int chunkCount);
+static int compare_chunks_by_size(const void *a, const void *b);
+static bool compare_start_workers(CompareSpecs *specs, int workerCount);
+static bool compare_worker(CompareSpecs *specs, int workerIndex);
+static bool compare_queue_pop(CompareQueue *queue, int *chunkIndex);
+static bool compare_set_settings(PGSQL *pgsql);
+static bool compare_chunk(CompareSpecs *specs, CompareChunk *chunk,
+						  PGSQL *src, PGSQL *dst);
+static bool compare_chunk_hash(CompareSpecs *specs, CompareChunk *chunk,
+							   PGSQL *pgsql,
+							   int64_t *rows, char *hash);
+static bool compare_chunk_differs(CompareChunk *chunk);
+static bool compare_table_referencing_fkeys(PGSQL *dst,
+											SourceTable *table,
+											char **fkeys);
+static void compare_chunk_range(CompareChunk *chunk, char *buffer, size_t size);
+static void compare_print_json(CompareSpecs *specs);
+static void getBounds(void *ctx, PGresult *result);
+static void getChunkHash(void *ctx, PGresult *result);
+
+
+/*
+ * compare_data lists the tables of the source database in the exported
+ * snapshot, splits them in chunks, and then compares each chunk on the
+ * source and the target in parallel.
+ */
+bool
+compare_data(CompareSpecs *specs)
+{
+	CopyDataSpec *copySpecs = specs->copySpecs;
+	PGSQL pgsql = { 0 };
+
+	log_info("Listing ordinary tables in \"%s\"", copySpecs->source_pguri);
+
+	if (!pgsql_init(&pgsql, copySpecs->source_pguri, PGSQL_CONN_SOURCE))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* list the tables and their chunks as seen in the snapshot */
+	if (!copydb_set_snapshot(&(copySpecs->sourceSnapshot), &pgsql))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!schema_list_ordinary_tables(&pgsql, &(specs->tableArray)))
+	{
+		/* errors have already been logged */
+		pgsql_finish(&pgsql);
+		return false;
+	}
+
+	log_info("Fetched information for %d tables", specs->tableArray.count);
+
+	CompareChunk *chunks = NULL;
+	int chunkCount = 0;
+
+	if (!compare_prepare_chunks(specs, &pgsql, &chunks, &chunkCount))
+	{
+		/* errors have already been logged */
+		pgsql_finish(&pgsql);
+		return false;
+	}
+
+	/* close the read-only transaction and the connection */
+	pgsql_finish(&pgsql);
+
+	if (!compare_queue_init(specs, chunks, chunkCount))
+	{
+		/* errors have already been logged */
+		free(chunks);
+		return false;
+	}
+
+	free(chunks);
+
+	int workerCount = copySpecs->tableJobs;
+
+	if (workerCount > chunkCount)
+	{
+		workerCount = chunkCount;
+	}
+
+	log_info("Comparing %d tables in %d chunks using %d compare workers",
+			 specs->tableArray.count,
+			 chunkCount,
+			 workerCount);
+
+	bool success = compare_start_workers(specs, workerCount);
+
+	/* wait for the workers that have been started, even on errors */
+	success = copydb_wait_for_subprocesses() && success;
+
+	CompareQueue *queue = specs->queue;
+
+	/* the chunks of a table are not next to each other in the queue */
+	bool *tableDiffers =
+		(bool *) calloc(copySpecs->tableSpecsArray.count + 1, sizeof(bool));
+
+	if (tableDiffers == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	specs->mismatchChunkCount = 0;
+	specs->mismatchTableCount = 0;
+
+	for (int i = 0; i < queue->count; i++)
+	{
+		CompareChunk *chunk = &(queue->array[i]);
+
+		if (chunk->failed || !chunk->done)
+		{
+			success = false;
+			continue;
+		}
+
+		if (compare_chunk_differs(chunk))
+		{
+			++specs->mismatchChunkCount;
+
+			if (!tableDiffers[chunk->specsIndex])
+			{
+				tableDiffers[chunk->specsIndex] = true;
+				++specs->mismatchTableCount;
+			}
+		}
+	}
+
+	free(tableDiffers);
+
+	if (!success)
+	{
+		log_error("Some compare workers failed, see above for details");
+	}
+
+	return success;
+}
+
+
+/*
+ * compare_prepare_chunks prepares the table specs of all the tables and
+ * their parts, as pgcopydb copy table-data does, and then the chunks that
+ * we compare: tables that are split in parts for the COPY are compared in
+ * the same count of primary key ranges, when possible.
+ */
+static bool
+compare_prepare_chunks(CompareSpecs *specs, PGSQL *pgsql,
+					   CompareChunk **chunks, int *chunkCount)
+{
+	CopyDataSpec *copySpecs = specs->copySpecs;
+	SourceTableArray *tableArray = &(specs->tableArray);
+	CopyTableDataSpecsArray *tableSpecsArray = &(copySpecs->tableSpecsArray);
+
+	int count = 0;
+
+	*chunks = NULL;
+	*chunkCount = 0;
+
+	if (tableArray->count == 0)
+	{
+		return true;
+	}
+
+	for (int tableIndex = 0; tableIndex < tableArray->count; tableIndex++)
+	{
+		count += copydb_table_part_count(copySpecs,
+										 &(tableArray->array[tableIndex]));
+	}
+
+	tableSpecsArray->count = count;
+	tableSpecsArray->array =
+		(CopyTableDataSpec *) calloc(count, sizeof(CopyTableDataSpec));
+
+	/* we have at most as many chunks as we have table parts */
+	*chunks = (CompareChunk *) calloc(count, sizeof(CompareChunk));
+
+	if (tableSpecsArray->array == NULL || *chunks == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	int specsCount = 0;
+
+	for (int tableIndex = 0; tableIndex < tableArray->count; tableIndex++)
+	{
+		SourceTable *source = &(tableArray->array[tableIndex]);
+		int partCount = copydb_table_part_count(copySpecs, source);
+		int specsIndex = specsCount;
+
+		for (int partNumber = 0; partNumber < partCount; partNumber++)
+		{
+			CopyTableDataSpec *tableSpecs =
+				&(tableSpecsArray->array[specsCount++]);
+
+			if (!copydb_init_table_specs(tableSpecs, copySpecs, source,
+										 partNumber))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+		}
+
+		char *pkColumn = NULL;
+		CompareBoundsContext bounds = { { 0 }, 0, NULL, false };
+
+		if (partCount > 1 &&
+			!compare_table_bounds(copySpecs,
+								  &(tableSpecsArray->array[specsIndex]),
+								  pgsql,
+								  &pkColumn,
+								  &bounds))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		int tableChunkCount = pkColumn == NULL ? 1 : bounds.count + 1;
+
+		if (partCount > 1 && pkColumn == NULL)
+		{
+			log_info("Table \"%s\".\"%s\" has no single column primary key "
+					 "that we can split in ranges, "
+					 "comparing it as a whole",
+					 source->nspname,
+					 source->relname);
+		}
+
+		for (int c = 0; c < tableChunkCount; c++)
+		{
+			CompareChunk *chunk = &((*chunks)[(*chunkCount)++]);
+
+			chunk->specsIndex = specsIndex;
+			chunk->chunkNumber = c;
+			chunk->chunkCount = tableChunkCount;
+			chunk->pkColumn = pkColumn;
+			chunk->min = c == 0 ? NULL : bounds.values[c - 1];
+			chunk->max = c == (tableChunkCount - 1) ? NULL : bounds.values[c];
+			chunk->estimatedBytes = source->bytes / tableChunkCount;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * compare_table_bounds finds the boundaries of the primary key ranges of a
+ * table that is split in several parts, so that each range has about the
+ * same count of rows. The boundaries are percentiles of the primary key
+ * values found in a sample of the table.
+ *
+ * Only a single column primary key of a data type that has no collation is
+ * used: the ranges must contain the same rows on the source and the target,
+ * where the collations might sort text differently. Otherwise pkColumn is
+ * left NULL and the table is compared as a whole.
+ */
+static bool
+compare_table_bounds(CopyDataSpec *copySpecs,
+					 CopyTableDataSpec *tableSpecs,
+					 PGSQL *pgsql,
+					 char **pkColumn,
+					 CompareBoundsContext *bounds)
+{
+	SourceTable *source = tableSpecs->sourceTable;
+	int partCount = tableSpecs->part.partCount;
+
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+
+	char *pkSql =
+		"select pg_catalog.quote_ident(a.attname) "
+		"  from pg_catalog.pg_index i "
+		"       join pg_catalog.pg_attribute a "
+		"         on a.attrelid = i.indrelid "
+		"        and a.attnum = i.indkey[0] "
+		" where i.indrelid = $1 "
+		"   and i.indisprimary "
+		"   and i.indnatts = 1 "
+		"   and a.attcollation = 0";
+
+	int paramCount = 1;
+	Oid paramTypes[1] = { OIDOID };
+	const char *paramValues[1] = { intToString(source->oid).strValue };
+
+	if (!pgsql_execute_with_params(pgsql, pkSql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to fetch the primary key of \"%s\".\"%s\"",
+				  source->nspname,
+				  source->relname);
+		return false;
+	}
+
+	if (context.ntuples == 0 || !context.parsedOk)
+	{
+		*pkColumn = NULL;
+		return true;
+	}
+
+	/* percentile_disc() accepts an array of fractions */
+	char fractions[BUFSIZE] = { 0 };
+	int len = sformat(fractions, sizeof(fractions), "{");
+
+	for (int i = 1; i <= partCount && len < (int) sizeof(fractions); i++)
+	{
+		if (i == partCount)
+		{
+			len += sformat(fractions + len, sizeof(fractions) - len, "}");
+			break;
+		}
+
+		len += sformat(fractions + len, sizeof(fractions) - len,
+					   "%s%g",
+					   i == 1 ? "" : ",",
+					   (double) i / (double) partCount);
+	}
+
+	double samplePct = 100.0;
+
+	if (source->relpages > COMPARE_SAMPLE_BLOCKS)
+	{
+		samplePct =
+			100.0 * (double) COMPARE_SAMPLE_BLOCKS / (double) source->relpages;
+	}
+
+	char sql[BUFSIZE] = { 0 };
+
+	sformat(sql, sizeof(sql),
+			"select b.value::text "
+			"  from unnest(( "
+			"        select percentile_disc('%s'::float8[]) "
+			"               within group (order by %s) "
+			"          from only \"%s\".\"%s\" tablesample system(%g) "
+			"       )) with ordinality as b(value, n) "
+			" where b.value is not null "
+			"order by b.n",
+			fractions,
+			context.strVal,
+			source->nspname,
+			source->relname,
+			samplePct);
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   bounds, &getBounds))
+	{
+		log_error("Failed to sample the primary key of \"%s\".\"%s\"",
+				  source->nspname,
+				  source->relname);
+		return false;
+	}
+
+	if (!bounds->parsedOk)
+	{
+		log_error("Failed to parse the primary key ranges of \"%s\".\"%s\"",
+				  source->nspname,
+				  source->relname);
+		return false;
+	}
+
+	/* an empty sample is compared as a whole */
+	*pkColumn = bounds->count > 0 ? context.strVal : NULL;
+
+	log_debug("Table \"%s\".\"%s\" is compared in %d ranges of %s",
+			  source->nspname,
+			  source->relname,
+			  bounds->count + 1,
+			  context.strVal);
+
+	return true;
+}
+
+
+/*
+ * compare_queue_init copies the chunks to a shared memory area, sorted by
+ * estimated size, largest first, from where the compare workers pull them.
+ */
+static bool
+compare_queue_init(CompareSpecs *specs, CompareChunk *chunks, int chunkCount)
+{
+	size_t size = sizeof(CompareQueue) + chunkCount * sizeof(CompareChunk);
+
+	void *area = mmap(NULL, size,
+					  PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_ANONYMOUS,
+					  -1, 0);
+
+	if (area == MAP_FAILED)
+	{
+		log_error("Failed to allocate %lld bytes of shared memory for "
+				  "the compare queue: %m",
+				  (long long) size);
+		return false;
+	}
+
+	CompareQueue *queue = (CompareQueue *) area;
+
+	queue->size = size;
+	queue->next = 0;
+	queue->count = chunkCount;
+
+	if (chunkCount > 0)
+	{
+		qsort(chunks, chunkCount, sizeof(CompareChunk), compare_chunks_by_size);
+		memcpy(queue->array, chunks, chunkCount * sizeof(CompareChunk));
+	}
+
+	/* the semaphore initValue defaults to 1: a mutex */
+	queue->semaphore.initValue = 1;
+
+	if (!semaphore_create(&(queue->semaphore)))
+	{
+		log_error("Failed to create the compare queue semaphore");
+		(void) munmap(area, size);
+		return false;
+	}
+
+	specs->queue = queue;
+
+	return true;
+}
+
+
+/*
+ * compare_chunks_by_size is a qsort() comparison function that sorts the
+ * chunks largest first, and then in table and range order.
+ */
+static int
+compare_chunks_by_size(const void *a, const void *b)
+{
+	const CompareChunk *ca = (const CompareChunk *) a;
+	const CompareChunk *cb = (const CompareChunk *) b;
+
+	if (ca->estimatedBytes != cb->estimatedBytes)
+	{
+		return ca->estimatedBytes > cb->estimatedBytes ? -1 : 1;
+	}
+
+	if (ca->specsIndex != cb->specsIndex)
+	{
+		return ca->specsIndex < cb->specsIndex ? -1 : 1;
+	}
+
+	return ca->chunkNumber - cb->chunkNumber;
+}
+
+
+/*
+ * compare_finish releases the table specs, and the shared memory and the
+ * semaphore of the queue.
+ */
+void
+compare_finish(CompareSpecs *specs)
+{
+	CompareQueue *queue = specs->queue;
+
+	copydb_free_table_specs(&(specs->copySpecs->tableSpecsArray));
+
+	if (queue == NULL)
+	{
+		return;
+	}
+
+	(void) semaphore_finish(&(queue->semaphore));
+
+	if (munmap(queue, queue->size) != 0)
+	{
+		log_warn("Failed to release the compare queue shared memory: %m");
+	}
+
+	specs->queue = NULL;
+}
+
+
+/*
+ * compare_start_workers forks the given count of compare workers.
+ */
+static bool
+compare_start_workers(CompareSpecs *specs, int workerCount)
+{
+	for (int workerIndex = 0; workerIndex < workerCount; workerIndex++)
+	{
+		/* Flush stdio channels just before fork, to avoid double-output problems */
+		fflush(stdout);
+		fflush(stderr);
+
+		int fpid = fork();
+
+		switch (fpid)
+		{
+			case -1:
+			{
+				log_error("Failed to fork compare worker %d", workerIndex);
+				return false;
+			}
+
+			case 0:
+			{
+				/* child process runs the command */
+				if (!compare_worker(specs, workerIndex))
+				{
+					/* errors have already been logged */
+					exit(EXIT_CODE_INTERNAL_ERROR);
+				}
+
+				exit(EXIT_CODE_QUIT);
+			}
+
+			default:
+			{
+				/* fork succeeded, in parent */
+				log_debug("[%d] is compare worker %d", fpid, workerIndex);
+				break;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * compare_worker opens its source and target connections, and then compares
+ * chunks from the queue until it's empty. The source connection imports the
+ * snapshot of the main process.
+ */
+static bool
+compare_worker(CompareSpecs *specs, int workerIndex)
+{
+	CopyDataSpec *copySpecs = specs->copySpecs;
+	CompareQueue *queue = specs->queue;
+
+	PGSQL src = { 0 };
+	PGSQL dst = { 0 };
+
+	(void) set_ps_title("pgcopydb: compare worker");
+
+	if (!pgsql_init(&src, copySpecs->source_pguri, PGSQL_CONN_SOURCE) ||
+		!copydb_set_snapshot(&(copySpecs->sourceSnapshot), &src))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* when not using a snapshot, each query is its own transaction */
+	if (src.connection == NULL && !pgsql_open_persistent_connection(&src))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pgsql_init(&dst, copySpecs->target_pguri, PGSQL_CONN_TARGET) ||
+		!pgsql_open_persistent_connection(&dst))
+	{
+		/* errors have already been logged */
+		pgsql_finish(&src);
+		return false;
+	}
+
+	if (!compare_set_settings(&src) || !compare_set_settings(&dst))
+	{
+		/* errors have already been logged */
+		pgsql_finish(&src);
+		pgsql_finish(&dst);
+		return false;
+	}
+
+	bool success = true;
+
+	for (;;)
+	{
+		int chunkIndex = -1;
+
+		if (!compare_queue_pop(queue, &chunkIndex))
+		{
+			/* errors have already been logged */
+			success = false;
+			break;
+		}
+
+		/* the queue is empty: we're done */
+		if (chunkIndex == -1)
+		{
+			break;
+		}
+
+		CompareChunk *chunk = &(queue->array[chunkIndex]);
+
+		if (!compare_chunk(specs, chunk, &src, &dst))
+		{
+			/* errors have already been logged */
+			chunk->failed = true;
+			success = false;
+			break;
+		}
+
+		chunk->done = true;
+	}
+
+	pgsql_finish(&src);
+	pgsql_finish(&dst);
+
+	log_debug("Compare worker %d is done", workerIndex);
+
+	return success;
+}
+
+
+/*
+ * compare_queue_pop sets chunkIndex to the next chunk to compare, or to -1
+ * when the queue is empty.
+ */
+static bool
+compare_queue_pop(CompareQueue *queue, int *chunkIndex)
+{
+	/* don't block user's interrupt (C-c and the like) */
+	if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+	{
+		return false;
+	}
+
+	if (!semaphore_lock(&(queue->semaphore)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	*chunkIndex = queue->next < queue->count ? queue->next++ : -1;
+
+	(void) semaphore_unlock(&(queue->semaphore));
+
+	return true;
+}
+
+
+/*
+ * compare_set_settings sets the session settings that change the text
+ * output of some data types to the same values on the source and the target.
+ */
+static bool
+compare_set_settings(PGSQL *pgsql)
+{
+	int count = 0;
+
+	while (compareSettings[count] != NULL)
+	{
+		++count;
+	}
+
+	/* errors have already been logged */
+	return pgsql_execute_batch(pgsql, (const char **) compareSettings, count);
+}
+
+
+/*
+ * compare_chunk computes the count of rows and the hash of the given chunk
+ * on the source and then on the target.
+ */
+static bool
+compare_chunk(CompareSpecs *specs, CompareChunk *chunk, PGSQL *src, PGSQL *dst)
+{
+	CopyTableDataSpec *tableSpecs =
+		&(specs->copySpecs->tableSpecsArray.array[chunk->specsIndex]);
+	SourceTable *source = tableSpecs->sourceTable;
+
+	if (!compare_chunk_hash(specs, chunk, src,
+							&(chunk->sourceRows), chunk->sourceHash))
+	{
+		log_error("Failed to compute the hash of \"%s\".\"%s\" chunk %d/%d "
+				  "on the source",
+				  source->nspname,
+				  source->relname,
+				  chunk->chunkNumber + 1,
+				  chunk->chunkCount);
+		return false;
+	}
+
+	if (!compare_chunk_hash(specs, chunk, dst,
+							&(chunk->targetRows), chunk->targetHash))
+	{
+		log_error("Failed to compute the hash of \"%s\".\"%s\" chunk %d/%d "
+				  "on the target",
+				  source->nspname,
+				  source->relname,
+				  chunk->chunkNumber + 1,
+				  chunk->chunkCount);
+		return false;
+	}
+
+	log_debug("Compared \"%s\".\"%s\" chunk %d/%d: %lld rows on the source, "
+			  "%lld rows on the target",
+			  source->nspname,
+			  source->relname,
+			  chunk->chunkNumber + 1,
+			  chunk->chunkCount,
+			  (long long) chunk->sourceRows,
+			  (long long) chunk->targetRows);
+
+	return true;
+}
+
+
+/*
+ * compare_chunk_hash runs the count and hash query of the given chunk on the
+ * given connection. The range boundaries are sent as parameters of unknown
+ * type, so that Postgres parses them as values of the primary key type.
+ */
+static bool
+compare_chunk_hash(CompareSpecs *specs, CompareChunk *chunk, PGSQL *pgsql,
+				   int64_t *rows, char *hash)
+{
+	CopyTableDataSpec *tableSpecs =
+		&(specs->copySpecs->tableSpecsArray.array[chunk->specsIndex]);
+	SourceTable *source = tableSpecs->sourceTable;
+
+	char where[BUFSIZE] = { 0 };
+
+	int paramCount = 0;
+	Oid paramTypes[2] = { InvalidOid, InvalidOid };
+	const char *paramValues[2] = { NULL, NULL };
+
+	if (chunk->min != NULL && chunk->max != NULL)
+	{
+		sformat(where, sizeof(where), " where %s >= $1 and %s < $2",
+				chunk->pkColumn,
+				chunk->pkColumn);
+
+		paramValues[paramCount++] = chunk->min;
+		paramValues[paramCount++] = chunk->max;
+	}
+	else if (chunk->min != NULL)
+	{
+		sformat(where, sizeof(where), " where %s >= $1", chunk->pkColumn);
+		paramValues[paramCount++] = chunk->min;
+	}
+	else if (chunk->max != NULL)
+	{
+		sformat(where, sizeof(where), " where %s < $1", chunk->pkColumn);
+		paramValues[paramCount++] = chunk->max;
+	}
+
+	char sql[BUFSIZE] = { 0 };
+
+	sformat(sql, sizeof(sql),
+			"select count(*), "
+			"       coalesce(sum(('x' || substr(md5(row(t.*)::text), 1, 16))"
+			"                    ::bit(64)::bigint), 0) "
+			"  from only \"%s\".\"%s\" t%s",
+			source->nspname,
+			source->relname,
+			where);
+
+	CompareHashContext context = { { 0 }, 0, { 0 }, false };
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &getChunkHash))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the count and hash of \"%s\".\"%s\"",
+				  source->nspname,
+				  source->relname);
+		return false;
+	}
+
+	*rows = context.rows;
+	strlcpy(hash, context.hash, COMPARE_HASH_SIZE);
+
+	return true;
+}
+
+
+/*
+ * compare_table_referencing_fkeys lists the foreign keys of the target
+ * database that reference the given table from another table, as a comma
+ * separated malloc'ed string, which is empty when there are none.
+ */
+static bool
+compare_table_referencing_fkeys(PGSQL *dst, SourceTable *table, char **fkeys)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+
+	char *sql =
+		"select coalesce(string_agg(format('%I on %s', c.conname, "
+		"                                  c.conrelid::regclass), "
+		"                           ', ' order by c.conname), '') "
+		"  from pg_constraint c "
+		" where c.contype = 'f' "
+		"   and c.conrelid <> c.confrelid "
+		"   and c.confrelid = to_regclass(format('%I.%I', $1, $2))";
+
+	int paramCount = 2;
+	Oid paramTypes[2] = { TEXTOID, TEXTOID };
+	const char *paramValues[2] = { table->nspname, table->relname };
+
+	if (!pgsql_execute_with_params(dst, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult) ||
+		!context.parsedOk)
+	{
+		log_error("Failed to list the foreign keys that reference "
+				  "table \"%s\".\"%s\" on the target",
+				  table->nspname,
+				  table->relname);
+		return false;
+	}
+
+	*fkeys = context.strVal;
+
+	return true;
+}
+
+
+/*
+ * compare_chunk_differs returns true when the given chunk does not have the
+ * same count of rows or the same hash on the source and the target.
+ */
+static bool
+compare_chunk_differs(CompareChunk *chunk)
+{
+	return chunk->sourceRows != chunk->targetRows ||
+		   !streq(chunk->sourceHash, chunk->targetHash);
+}
+
+
+/*
+ * compare_chunk_range prints the primary key range of the given chunk as a
+ * WHERE clause that can be used to fetch its rows.
+ */
+static void
+compare_chunk_range(CompareChunk *chunk, char *buffer, size_t size)
+{
+	if (chunk->min != NULL && chunk->max != NULL)
+	{
+		sformat(buffer, size, "%s >= '%s' and %s < '%s'",
+				chunk->pkColumn, chunk->min,
+				chunk->pkColumn, chunk->max);
+	}
+	else if (chunk->min != NULL)
+	{
+		sformat(buffer, size, "%s >= '%s'", chunk->pkColumn, chunk->min);
+	}
+	else if (chunk->max != NULL)
+	{
+		sformat(buffer, size, "%s < '%s'", chunk->pkColumn, chunk->max);
+	}
+	else
+	{
+		strlcpy(buffer, "", size);
+	}
+}
+
+
+/*
+ * compare_print_results prints the chunks that differ between the source
+ * and the target, if any.
+ */
+void
+compare_print_results(CompareSpecs *specs)
+{
+	if (outputJSON)
+	{
+		(void) compare_print_json(specs);
+		return;
+	}
+
+	CompareQueue *queue = specs->queue;
+
+	if (specs->mismatchChunkCount == 0)
+	{
+		log_info("Compared %d tables in %d chunks: no difference found",
+				 specs->tableArray.count,
+				 queue->count);
+		return;
+	}
+
+	log_warn("Compared %d tables in %d chunks: "
+			 "%d chunks of %d tables differ",
+			 specs->tableArray.count,
+			 queue->count,
+			 specs->mismatchChunkCount,
+			 specs->mismatchTableCount);
+
+	fformat(stdout, "\n");
+
+	fformat(stdout, "%40s | %7s | %12s | %12s | %7s | %s\n",
+			"table", "chunk", "source rows", "target rows", "hash", "range");
+
+	fformat(stdout, "%40s-+-%7s-+-%12s-+-%12s-+-%7s-+-%s\n",
+			"----------------------------------------",
+			"-------", "------------", "------------", "-------",
+			"----------");
+
+	for (int i = 0; i < queue->count; i++)
+	{
+		CompareChunk *chunk = &(queue->array[i]);
+
+		if (!chunk->done || !compare_chunk_differs(chunk))
+		{
+			continue;
+		}
+
+		CopyTableDataSpec *tableSpecs =
+			&(specs->copySpecs->tableSpecsArray.array[chunk->specsIndex]);
+		SourceTable *source = tableSpecs->sourceTable;
+
+		char qname[BUFSIZE] = { 0 };
+		char chunkRange[BUFSIZE] = { 0 };
+		char chunkName[NAMEDATALEN] = { 0 };
+
+		sformat(qname, sizeof(qname), "\"%s\".\"%s\"",
+				source->nspname,
+				source->relname);
+
+		sformat(chunkName, sizeof(chunkName), "%d/%d",
+				chunk->chunkNumber + 1,
+				chunk->chunkCount);
+
+		(void) compare_chunk_range(chunk, chunkRange, sizeof(chunkRange));
+
+		fformat(stdout, "%40s | %7s | %12lld | %12lld | %7s | %s\n",
+				qname,
+				chunkName,
+				(long long) chunk->sourceRows,
+				(long long) chunk->targetRows,
+				streq(chunk->sourceHash, chunk->targetHash) ? "same" : "differs",
+				chunkRange);
+	}
+
+	fformat(stdout, "\n");
+}
+
+
+/*
+ * compare_print_json prints the results as a JSON object, with the chunks
+ * that differ in an array.
+ */
+static void
+compare_print_json(CompareSpecs *specs)
+{
+	CompareQueue *queue = specs->queue;
+
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *jsObj = json_value_get_object(js);
+
+	json_object_set_number(jsObj, "tables", (double) specs->tableArray.count);
+	json_object_set_number(jsObj, "chunks", (double) queue->count);
+
+	JSON_Value *jsChunks = json_value_init_array();
+	JSON_Array *jsChunksArray = json_value_get_array(jsChunks);
+
+	for (int i = 0; i < queue->count; i++)
+	{
+		CompareChunk *chunk = &(queue->array[i]);
+
+		if (!chunk->done || !compare_chunk_differs(chunk))
+		{
+			continue;
+		}
+
+		CopyTableDataSpec *tableSpecs =
+			&(specs->copySpecs->tableSpecsArray.array[chunk->specsIndex]);
+		SourceTable *source = tableSpecs->sourceTable;
+
+		JSON_Value *jsChunk = json_value_init_object();
+		JSON_Object *jsChunkObj = json_value_get_object(jsChunk);
+
+		json_object_set_number(jsChunkObj, "oid", (double) source->oid);
+		json_object_set_string(jsChunkObj, "schema", source->nspname);
+		json_object_set_string(jsChunkObj, "name", source->relname);
+		json_object_set_number(jsChunkObj, "chunk",
+							   (double) (chunk->chunkNumber + 1));
+		json_object_set_number(jsChunkObj, "chunks",
+							   (double) chunk->chunkCount);
+
+		if (chunk->pkColumn != NULL)
+		{
+			json_object_set_string(jsChunkObj, "column", chunk->pkColumn);
+		}
+
+		if (chunk->min != NULL)
+		{
+			json_object_set_string(jsChunkObj, "min", chunk->min);
+		}
+
+		if (chunk->max != NULL)
+		{
+			json_object_set_string(jsChunkObj, "max", chunk->max);
+		}
+
+		json_object_set_number(jsChunkObj, "source-rows",
+							   (double) chunk->sourceRows);
+		json_object_set_number(jsChunkObj, "target-rows",
+							   (double) chunk->targetRows);
+		json_object_set_string(jsChunkObj, "source-hash", chunk->sourceHash);
+		json_object_set_string(jsChunkObj, "target-hash", chunk->targetHash);
+
+		json_array_append_value(jsChunksArray, jsChunk);
+	}
+
+	json_object_set_value(jsObj, "mismatches", jsChunks);
+
+	(void) cli_pprint_json(js);
+}
+
+
+/*
+ * compare_mark_for_recopy prepares the work directory so that pgcopydb copy
+ * table-data --resume copies the tables that differ again: their parts are
+ * marked as not done, and the lock file of a COPY that was interrupted
+ * without a known transaction is left behind, which makes the resume code
+ * TRUNCATE the target table and COPY it again entirely.
+ *
+ * The primary key ranges don't map to the ctid ranges of the COPY parts, so
+ * we can't only copy the chunks that differ again.
+ *
+ * TRUNCATE fails on a table that the foreign keys of other tables reference.
+ * Such tables are not marked, and an error lists those foreign keys: they
+ * have to be dropped on the target before copying the table again.
+ */
+bool
+compare_mark_for_recopy(CompareSpecs *specs)
+{
+	CopyTableDataSpecsArray *tableSpecsArray =
+		&(specs->copySpecs->tableSpecsArray);
+	CompareQueue *queue = specs->queue;
+
+	PGSQL dst = { 0 };
+	bool success = true;
+
+	if (!pgsql_init(&dst, specs->copySpecs->target_pguri, PGSQL_CONN_TARGET))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int s = 0; s < tableSpecsArray->count; s++)
+	{
+		CopyTableDataSpec *tableSpecs = &(tableSpecsArray->array[s]);
+		bool differs = false;
+
+		if (tableSpecs->part.partNumber != 0)
+		{
+			continue;
+		}
+
+		for (int i = 0; i < queue->count && !differs; i++)
+		{
+			CompareChunk *chunk = &(queue->array[i]);
+
+			differs = chunk->specsIndex == s &&
+					  chunk->done &&
+					  compare_chunk_differs(chunk);
+		}
+
+		if (!differs)
+		{
+			continue;
+		}
+
+		char *fkeys = NULL;
+
+		if (!compare_table_referencing_fkeys(&dst,
+											 tableSpecs->sourceTable,
+											 &fkeys))
+		{
+			/* errors have already been logged */
+			pgsql_finish(&dst);
+			return false;
+		}
+
+		if (fkeys != NULL && !IS_EMPTY_STRING_BUFFER(fkeys))
+		{
+			log_error("Table \"%s\".\"%s\" differs and can't be truncated "
+					  "on the target to be copied again, it is referenced "
+					  "by foreign keys: %s",
+					  tableSpecs->sourceTable->nspname,
+					  tableSpecs->sourceTable->relname,
+					  fkeys);
+
+			free(fkeys);
+			success = false;
+			continue;
+		}
+
+		free(fkeys);
+
+		int partCount = tableSpecs->part.partCount;
+
+		for (int p = 0; p < partCount && (s + p) < tableSpecsArray->count; p++)
+		{
+			TablePartFilePaths partPaths = { 0 };
+
+			(void) copydb_part_file_paths(&(tableSpecsArray->array[s + p]),
+										  &partPaths);
+
+			if (!unlink_file(partPaths.doneFile) ||
+				!unlink_file(partPaths.lockFile) ||
+				!unlink_file(partPaths.xidFile))
+			{
+				/* errors have already been logged */
+				pgsql_finish(&dst);
+				return false;
+			}
+
+			if (p == 0 && !write_file("", 0, partPaths.lockFile))
+			{
+				log_error("Failed to create the lock file \"%s\"",
+						  partPaths.lockFile);
+				pgsql_finish(&dst);
+				return false;
+			}
+		}
+
+		if (partCount > 1)
+		{
+			TableFilePaths tablePaths = { 0 };
+
+			(void) copydb_table_file_paths(tableSpecs, &tablePaths);
+
+			if (!unlink_file(tablePaths.doneFile))
+			{
+				/* errors have already been logged */
+				pgsql_finish(&dst);
+				return false;
+			}
+		}
+
+		log_info("Table \"%s\".\"%s\" is going to be copied again by "
+				 "pgcopydb copy table-data --resume",
+				 tableSpecs->sourceTable->nspname,
+				 tableSpecs->sourceTable->relname);
+	}
+
+	pgsql_finish(&dst);
+
+	return success;
+}
+
+
+/*
+ * getBounds loops over the result of the primary key ranges query and
+ * fills-in the boundaries, skipping duplicates.
+ */
+static void
+getBounds(void *ctx, PGresult *result)
+{
+	CompareBoundsContext *context = (CompareBoundsContext *) ctx;
+	int nTuples = PQntuples(result);
+
+	if (PQnfields(result) != 1)
+	{
+		log_error("Query returned %d columns, expected 1", PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	context->count = 0;
+	context->values = NULL;
+
+	if (nTuples > 0)
+	{
+		context->values = (char **) calloc(nTuples, sizeof(char *));
+
+		if (context->values == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			context->parsedOk = false;
+			return;
+		}
+	}
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		char *value = PQgetvalue(result, rowNumber, 0);
+
+		/* percentiles of a small sample often are the same value */
+		if (context->count > 0 &&
+			streq(context->values[context->count - 1], value))
+		{
+			continue;
+		}
+
+		context->values[context->count] = strdup(value);
+
+		if (context->values[context->count] == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			context->parsedOk = false;
+			return;
+		}
+
+		++context->count;
+	}
+
+	context->parsedOk = true;
+}
+
+
+/*
+ * getChunkHash parses the count of rows and the hash of a chunk.
+ */
+static void
+getChunkHash(void *ctx, PGresult *result)
+{
+	CompareHashContext *context = (CompareHashContext *) ctx;
+
+	if (PQnfields(result) != 2 || PQntuples(result) != 1)
+	{
+		log_error("Query returned %d rows of %d columns, expected 1 row of 2",
+				  PQntuples(result),
+				  PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	char *value = PQgetvalue(result, 0, 0);
+
+	if (!stringToInt64(value, &(context->rows)))
+	{
+		log_error("Failed to parse count of rows \"%s\"", value);
+		context->parsedOk = false;
+		return;
+	}
+
+	value = PQgetvalue(result, 0, 1);
+
+	if (strlen(value) >= COMPARE_HASH_SIZE)
+	{
+		log_error("Failed to parse hash \"%s\"", value);
+		context->parsedOk = false;
+		return;
+	}
+
+	strlcpy(context->hash, value, sizeof(context->hash));
+
+	context->parsedOk = true;
+}
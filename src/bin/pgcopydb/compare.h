@@ -0,0 +1,75 @@
+/*
+ * src/bin/pgcopydb/compare.h
+ *     Compare the data of the source and target databases
+ */
+#ifndef COMPARE_H
+#define COMPARE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "copydb.h"
+#include "lock_utils.h"
+#include "schema.h"
+
+/* the primary key ranges are found in a sample of about that many blocks */
+#define COMPARE_SAMPLE_BLOCKS 1000
+
+/* the hash of a chunk is the numeric sum of 64-bit row hashes, as text */
+#define COMPARE_HASH_SIZE 64
+
+/*
+ * A CompareChunk is either a whole table, or a range of its primary key
+ * values when the table is larger than --split-tables-larger-than. The
+ * ranges are computed on the source and are meant to also apply to the
+ * target, where the same rows are to be found in a different physical
+ * order, which rules out ctid ranges.
+ */
+typedef struct CompareChunk
+{
+	int specsIndex;             /* first part of the table in tableSpecsArray */
+	int chunkNumber;
+	int chunkCount;
+
+	char *pkColumn;             /* quoted, NULL when not split */
+	char *min;                  /* NULL when the range has no lower bound */
+	char *max;                  /* NULL when the range has no upper bound */
+	int64_t estimatedBytes;
+
+	/* filled-in by the compare worker that processed the chunk */
+	bool done;
+	bool failed;
+	int64_t sourceRows;
+	int64_t targetRows;
+	char sourceHash[COMPARE_HASH_SIZE];
+	char targetHash[COMPARE_HASH_SIZE];
+} CompareChunk;
+
+/* the compare workers share the chunks, largest first, in this queue */
+typedef struct CompareQueue
+{
+	size_t size;                /* size of the shared memory area */
+	Semaphore semaphore;
+	int next;
+	int count;
+	CompareChunk array[];
+} CompareQueue;
+
+typedef struct CompareSpecs
+{
+	CopyDataSpec *copySpecs;
+	bool markForRecopy;         /* so that copy table-data --resume fixes it */
+
+	SourceTableArray tableArray;
+	CompareQueue *queue;
+
+	int mismatchChunkCount;
+	int mismatchTableCount;
+} CompareSpecs;
+
+bool compare_data(CompareSpecs *specs);
+void compare_print_results(CompareSpecs *specs);
+bool compare_mark_for_recopy(CompareSpecs *specs);
+void compare_finish(CompareSpecs *specs);
+
+#endif /* COMPARE_H */
@@ -4,6 +4,7 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
 #include <sys/wait.h>
@@ -17,24 +18,56 @@
 #include "lock_utils.h"
 #include "log.h"
 #include "pidfile.h"
+#include "pqexpbuffer.h"
 #include "schema.h"
 #include "signals.h"
 #include "string_utils.h"
 #include "summary.h"
 
 
-static int waitUntilOneSubprocessIsDone(TableDataProcessArray *subProcessArray);
+static bool copydb_start_dump_process(CopyDataSpec *specs,
+									  char *snapshot,
+									  const char *section,
+									  const char *filename,
+									  TableDataProcess *process);
+static bool copydb_fetch_source_indexes(CopyDataSpec *specs, PGSQL *pgsql);
+static bool copydb_write_filtered_pre_data_list(CopyDataSpec *specs);
+static int copydb_compare_index_table_oid(const void *a, const void *b);
+static void copydb_table_index_array(CopyDataSpec *specs,
+									 SourceTable *source,
+									 SourceIndexArray *slice);
+static char * copydb_table_order_by_columns(CopyDataSpec *specs,
+											CopyTableDataSpec *tableSpecs);
+static bool copydb_prepare_copy_query(CopyTableDataSpec *tableSpecs);
+static bool copydb_prepare_resume(CopyDataSpec *specs);
+static bool copydb_resume_part(CopyTableDataSpec *tableSpecs,
+							   PGSQL *dst,
+							   int serverVersion,
+							   bool *truncate);
+static bool copydb_write_copy_xid(CopyTableDataSpec *tableSpecs, PGSQL *dst);
+static bool copydb_get_copy_status(TablePartFilePaths *partPaths,
+								   PGSQL *dst,
+								   char *status,
+								   size_t size);
+static bool copydb_copy_table_data(CopyTableDataSpec *tableSpecs,
+								   PGSQL *src,
+								   PGSQL *dst,
+								   const char *qname);
+static bool copydb_prepare_index_command(CopyTableDataSpec *tableSpecs,
+										 SourceIndex *index,
+										 PQExpBuffer command);
+static bool copydb_run_index_command(PGSQL *dst, const char *command,
+									 IndexMemoryGrant *grant);
 
 
 /*
- * copydb_init_tempdir initialises the file paths that are going to be used to
- * store temporary information while the pgcopydb process is running.
+ * copydb_prepare_filepaths initialises the file paths that are going to be
+ * used to store temporary information while the pgcopydb process is running,
+ * without creating any directory.
  */
 bool
-copydb_init_workdir(CopyFilePaths *cfPaths, char *dir, bool removeDir)
+copydb_prepare_filepaths(CopyFilePaths *cfPaths, const char *dir)
 {
-	pid_t pid = getpid();
-
 	if (dir != NULL && !IS_EMPTY_STRING_BUFFER(dir))
 	{
 		strlcpy(cfPaths->topdir, dir, sizeof(cfPaths->topdir));
@@ -58,6 +91,7 @@ copydb_init_workdir(CopyFilePaths *cfPaths, char *dir, bool removeDir)
 	/* now that we have our topdir, prepare all the others from there */
 	sformat(cfPaths->pidfile, MAXPGPATH, "%s/pgcopydb.pid", cfPaths->topdir);
 	sformat(cfPaths->schemadir, MAXPGPATH, "%s/schema", cfPaths->topdir);
+	sformat(cfPaths->datadir, MAXPGPATH, "%s/data", cfPaths->topdir);
 	sformat(cfPaths->rundir, MAXPGPATH, "%s/run", cfPaths->topdir);
 	sformat(cfPaths->tbldir, MAXPGPATH, "%s/run/tables", cfPaths->topdir);
 	sformat(cfPaths->idxdir, MAXPGPATH, "%s/run/indexes", cfPaths->topdir);
@@ -65,6 +99,46 @@ copydb_init_workdir(CopyFilePaths *cfPaths, char *dir, bool removeDir)
 	sformat(cfPaths->idxfilepath, MAXPGPATH,
 			"%s/run/indexes.json", cfPaths->topdir);
 
+	sformat(cfPaths->catalogfile, MAXPGPATH,
+			"%s/data/%s", cfPaths->topdir, SPOOL_CATALOG_FILENAME);
+
+	sformat(cfPaths->catalogcachefile, MAXPGPATH,
+			"%s/schema/catalog.json", cfPaths->topdir);
+
+	sformat(cfPaths->sequencecachefile, MAXPGPATH,
+			"%s/schema/sequences.json", cfPaths->topdir);
+
+	sformat(cfPaths->journalfile, MAXPGPATH,
+			"%s/run/state.journal", cfPaths->topdir);
+
+	sformat(cfPaths->progressfile, MAXPGPATH,
+			"%s/run/progress", cfPaths->topdir);
+
+	sformat(cfPaths->summaryfile, MAXPGPATH,
+			"%s/summary.json", cfPaths->topdir);
+
+	sformat(cfPaths->tracefile, MAXPGPATH,
+			"%s/trace.json", cfPaths->topdir);
+
+	return true;
+}
+
+
+/*
+ * copydb_init_tempdir initialises the file paths that are going to be used to
+ * store temporary information while the pgcopydb process is running.
+ */
+bool
+copydb_init_workdir(CopyFilePaths *cfPaths, char *dir, bool removeDir)
+{
+	pid_t pid = getpid();
+
+	if (!copydb_prepare_filepaths(cfPaths, dir))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
 	/* now create the target directories that we depend on. */
 	if (directory_exists(cfPaths->topdir))
 	{
@@ -192,13 +266,8 @@ copydb_init_workdir(CopyFilePaths *cfPaths, char *dir, bool removeDir)
  */
 bool
 copydb_init_specs(CopyDataSpec *specs,
-				  char *source_pguri,
-				  char *target_pguri,
-				  int tableJobs,
-				  int indexJobs,
-				  CopyDataSection section,
-				  bool dropIfExists,
-				  bool noOwner)
+				  CopyDBOptions *options,
+				  CopyDataSection section)
 {
 	/* fill-in a structure with the help of the C compiler */
 	CopyDataSpec tmpCopySpecs = {
@@ -209,28 +278,189 @@ copydb_init_specs(CopyDataSpec *specs,
 		.target_pguri = { 0 },
 
 		.section = section,
-		.dropIfExists = dropIfExists,
-		.noOwner = noOwner,
-
-		.tableJobs = tableJobs,
-		.indexJobs = indexJobs,
-		.indexSemaphore = { 0 }
+		.dropIfExists = options->dropIfExists,
+		.noOwner = options->noOwner,
+		.resume = options->resume,
+		.refresh = options->refresh,
+		.follow = options->follow,
+
+		.tableJobs = options->tableJobs,
+		.indexJobs = options->indexJobs,
+		.vacuumJobs = options->vacuumJobs,
+		.restoreJobs = options->restoreJobs,
+		.largeObjectJobs = options->largeObjectJobs,
+		.stateFiles = options->stateFiles,
+		.trace = options->trace,
+		.metricsPort = options->metricsPort,
+		.etaInterval = options->etaInterval,
+		.analyzeOnly = options->analyzeOnly,
+		.vacuumParallel = options->vacuumParallel,
+
+		.splitTablesLargerThan = options->splitTablesLargerThan,
+		.splitTablesLargerThanPretty = { 0 },
+
+		.copyFormat = options->copyFormat,
+		.copyFreeze = options->copyFreeze,
+		.copyStrategyAuto = options->copyStrategyAuto,
+		.copyBufferSize = options->copyBufferSize,
+		.copyBufferSizePretty = { 0 },
+		.copyPipelineDepth = options->copyPipelineDepth,
+
+		.multiplexTablesSmallerThan = options->multiplexTablesSmallerThan,
+		.multiplexTablesSmallerThanPretty = { 0 },
+		.multiplexStreams = options->multiplexStreams,
+
+		.orderByPkSmallerThan = options->orderByPkSmallerThan,
+		.orderByPkSmallerThanPretty = { 0 },
+
+		.indexMemoryBudget = options->indexMemoryBudget,
+		.indexMemoryBudgetPretty = { 0 },
+
+		.copyMemoryBudget = options->copyMemoryBudget,
+		.copyMemoryBudgetPretty = { 0 },
+
+		.maxCopyRate = options->maxCopyRate,
+		.maxCopyRatePretty = { 0 },
+		.adaptiveMaxLag = options->adaptiveMaxLag,
+		.adaptiveMaxLagPretty = { 0 },
+		.adaptiveMaxBackends = options->adaptiveMaxBackends,
+
+		.sourceSnapshot = {
+			.pgsql = { 0 },
+			.pguri = { 0 },
+			.connectionType = PGSQL_CONN_SOURCE,
+			.state = SNAPSHOT_STATE_UNKNOWN,
+			.snapshot = { 0 },
+			.createSlot = false,
+			.slotName = { 0 },
+			.plugin = { 0 },
+			.startLSN = { 0 }
+		}
 	};
 
 	/* initialize the connection strings */
-	if (source_pguri != NULL)
+	if (!IS_EMPTY_STRING_BUFFER(options->source_pguri))
+	{
+		strlcpy(tmpCopySpecs.source_pguri, options->source_pguri, MAXCONNINFO);
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(options->target_pguri))
+	{
+		strlcpy(tmpCopySpecs.target_pguri, options->target_pguri, MAXCONNINFO);
+	}
+
+	strlcpy(tmpCopySpecs.splitTablesLargerThanPretty,
+			options->splitTablesLargerThanPretty,
+			sizeof(tmpCopySpecs.splitTablesLargerThanPretty));
+
+	strlcpy(tmpCopySpecs.copyBufferSizePretty,
+			options->copyBufferSizePretty,
+			sizeof(tmpCopySpecs.copyBufferSizePretty));
+
+	strlcpy(tmpCopySpecs.multiplexTablesSmallerThanPretty,
+			options->multiplexTablesSmallerThanPretty,
+			sizeof(tmpCopySpecs.multiplexTablesSmallerThanPretty));
+
+	strlcpy(tmpCopySpecs.orderByPkSmallerThanPretty,
+			options->orderByPkSmallerThanPretty,
+			sizeof(tmpCopySpecs.orderByPkSmallerThanPretty));
+
+	strlcpy(tmpCopySpecs.indexMemoryBudgetPretty,
+			options->indexMemoryBudgetPretty,
+			sizeof(tmpCopySpecs.indexMemoryBudgetPretty));
+
+	strlcpy(tmpCopySpecs.copyMemoryBudgetPretty,
+			options->copyMemoryBudgetPretty,
+			sizeof(tmpCopySpecs.copyMemoryBudgetPretty));
+
+	strlcpy(tmpCopySpecs.maxCopyRatePretty,
+			options->maxCopyRatePretty,
+			sizeof(tmpCopySpecs.maxCopyRatePretty));
+
+	strlcpy(tmpCopySpecs.adaptiveMaxLagPretty,
+			options->adaptiveMaxLagPretty,
+			sizeof(tmpCopySpecs.adaptiveMaxLagPretty));
+
+	if (!copydb_parse_bulk_load_profile(options->bulkLoadProfile,
+										&(tmpCopySpecs.bulkLoadProfile)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!copydb_init_table_filters(&(tmpCopySpecs.filters), options))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* prepare the snapshot we're going to share with all sub-processes */
+	TransactionSnapshot *snapshot = &(tmpCopySpecs.sourceSnapshot);
+
+	strlcpy(snapshot->pguri, tmpCopySpecs.source_pguri, MAXCONNINFO);
+
+	if (options->notConsistent)
+	{
+		snapshot->state = SNAPSHOT_STATE_SKIPPED;
+	}
+	else if (!IS_EMPTY_STRING_BUFFER(options->snapshot))
+	{
+		snapshot->state = SNAPSHOT_STATE_SET;
+		strlcpy(snapshot->snapshot, options->snapshot, sizeof(snapshot->snapshot));
+	}
+
+	/* the replicas snapshots are exported once they have caught up */
+	for (int i = 0; i < options->sourceReplicaCount; i++)
+	{
+		TransactionSnapshot *replica = &(tmpCopySpecs.replicaSnapshots[i]);
+
+		strlcpy(replica->pguri, options->sourceReplicas[i], MAXCONNINFO);
+		replica->connectionType = PGSQL_CONN_SOURCE;
+		replica->state = options->notConsistent
+						 ? SNAPSHOT_STATE_SKIPPED
+						 : SNAPSHOT_STATE_UNKNOWN;
+	}
+
+	tmpCopySpecs.sourceReplicaCount = options->sourceReplicaCount;
+
+	for (int i = 0; i < options->fanoutTargetCount; i++)
 	{
-		strlcpy(tmpCopySpecs.source_pguri, source_pguri, MAXCONNINFO);
+		strlcpy(tmpCopySpecs.fanoutTargets[i],
+				options->fanoutTargets[i],
+				MAXCONNINFO);
 	}
 
-	if (target_pguri != NULL)
+	tmpCopySpecs.fanoutCount = options->fanoutTargetCount;
+
+	strlcpy(tmpCopySpecs.relayAddress,
+			options->relayAddress,
+			sizeof(tmpCopySpecs.relayAddress));
+
+	strlcpy(tmpCopySpecs.metricsHost,
+			options->metricsHost,
+			sizeof(tmpCopySpecs.metricsHost));
+
+	if (options->follow)
 	{
-		strlcpy(tmpCopySpecs.target_pguri, target_pguri, MAXCONNINFO);
+		snapshot->createSlot = true;
+		strlcpy(snapshot->slotName, options->slotName, sizeof(snapshot->slotName));
+		strlcpy(snapshot->plugin, FOLLOW_OUTPUT_PLUGIN, sizeof(snapshot->plugin));
 	}
 
 	/* copy the structure as a whole memory area to the target place */
 	*specs = tmpCopySpecs;
 
+	/* with --state-files, the journal also writes the per-object done files */
+	journal_init(&(specs->journal),
+				 specs->cfPaths.journalfile,
+				 specs->stateFiles ? specs->cfPaths.idxdir : NULL);
+
+	/* a trace is not worth failing the copy for */
+	if (specs->trace && !trace_init(specs->cfPaths.tracefile))
+	{
+		log_warn("Failed to open the trace file, continuing without --trace");
+	}
+
 	/* now compute some global paths that are needed for pgcopydb */
 	sformat(specs->dumpPaths.preFilename, MAXPGPATH, "%s/%s",
 			specs->cfPaths.schemadir, "pre.dump");
@@ -241,18 +471,47 @@ copydb_init_specs(CopyDataSpec *specs,
 	sformat(specs->dumpPaths.listFilename, MAXPGPATH, "%s/%s",
 			specs->cfPaths.schemadir, "post.list");
 
-	/* create the index semaphore */
-	specs->indexSemaphore.initValue = indexJobs;
+	sformat(specs->dumpPaths.preTocFilename, MAXPGPATH, "%s/%s",
+			specs->cfPaths.schemadir, "pre.toc");
+
+	sformat(specs->dumpPaths.postTocFilename, MAXPGPATH, "%s/%s",
+			specs->cfPaths.schemadir, "post.toc");
+
+	sformat(specs->dumpPaths.preListFilename, MAXPGPATH, "%s/%s",
+			specs->cfPaths.schemadir, "pre.list");
+
+	sformat(specs->dumpPaths.preDoneFilename, MAXPGPATH, "%s/%s",
+			specs->cfPaths.schemadir, "pre.done");
+
+	sformat(specs->dumpPaths.preRestoredFilename, MAXPGPATH, "%s/%s",
+			specs->cfPaths.schemadir, "pre.restored");
+
+	return true;
+}
 
-	if (!semaphore_create(&(specs->indexSemaphore)))
+
+/*
+ * copydb_free_table_specs releases the table specs array, and the COPY query
+ * and target that copydb_prepare_copy_query() allocated for each table part.
+ */
+void
+copydb_free_table_specs(CopyTableDataSpecsArray *tableSpecsArray)
+{
+	for (int i = 0; i < tableSpecsArray->count; i++)
 	{
-		log_error("Failed to create the index concurrency semaphore "
-				  "to orchestrate up to %d CREATE INDEX jobs at the same time",
-				  indexJobs);
-		return false;
+		CopyTableDataSpec *tableSpecs = &(tableSpecsArray->array[i]);
+
+		free(tableSpecs->copyQuery);
+		free(tableSpecs->copyTarget);
+
+		tableSpecs->copyQuery = NULL;
+		tableSpecs->copyTarget = NULL;
 	}
 
-	return true;
+	free(tableSpecsArray->array);
+
+	tableSpecsArray->array = NULL;
+	tableSpecsArray->count = 0;
 }
 
 
@@ -260,165 +519,295 @@ copydb_init_specs(CopyDataSpec *specs,
  * copydb_init_table_specs prepares a CopyTableDataSpec structure from its
  * pieces and also initialises files paths necessary for the orchestration of
  * the per-table processes and their summary files.
+ *
+ * When the table is split in several parts, the partNumber selects which part
+ * of the table this CopyTableDataSpec is responsible for.
  */
 bool
 copydb_init_table_specs(CopyTableDataSpec *tableSpecs,
 						CopyDataSpec *specs,
 						SourceTable *source,
-						TableDataProcess *process)
+						int partNumber)
 {
 	/* fill-in a structure with the help of the C compiler */
 	CopyTableDataSpec tmpTableSpecs = {
 		.cfPaths = &(specs->cfPaths),
 		.pgPaths = &(specs->pgPaths),
 
-		.source_pguri = { 0 },
-		.target_pguri = { 0 },
+		.source_pguri = specs->source_pguri,
+		.target_pguri = specs->target_pguri,
 
 		.section = specs->section,
+		.resume = specs->resume,
+		.unchanged = false,
 
 		.sourceTable = source,
 		.indexArray = NULL,
-		.process = process,
+		.tableIndexArray = { 0, NULL },
+		.sourceSnapshot = &(specs->sourceSnapshot),
+		.fanout = NULL,
+		.fanoutCount = 0,
+
+		.relayAddress =
+			IS_EMPTY_STRING_BUFFER(specs->relayAddress)
+			? NULL
+			: specs->relayAddress,
+
+		.part = {
+			.partNumber = partNumber,
+			.partCount = copydb_table_part_count(specs, source),
+			.min = 0,
+			.max = -1
+		},
+		.orderByColumns = NULL,
+		.copyQuery = NULL,
+		.copyTarget = NULL,
+
+		/* COPY binary is not supported for some column data types */
+		.copyFormat = source->binaryUnsafe ? COPY_FORMAT_TEXT : specs->copyFormat,
+		.copyFreeze = specs->copyFreeze,
+		.copyBufferSize = specs->copyBufferSize,
+		.copyPipelineDepth = specs->copyPipelineDepth,
+
+		.spoolMode = specs->spoolMode,
+		.spoolCompression = specs->spoolCompression,
 
 		.tableJobs = specs->tableJobs,
 		.indexJobs = specs->indexJobs,
-		.indexSemaphore = &(specs->indexSemaphore)
+		.indexQueue = NULL,
+		.vacuumQueue = NULL,
+		.throttle = NULL,
+		.memoryGrant = NULL,
+		.journal = &(specs->journal),
+
+		.analyzeOnly = specs->analyzeOnly,
+		.vacuumParallel = specs->vacuumParallel
 	};
 
-	/* initialize the connection strings */
-	strlcpy(tmpTableSpecs.source_pguri, specs->source_pguri, MAXCONNINFO);
-	strlcpy(tmpTableSpecs.target_pguri, specs->target_pguri, MAXCONNINFO);
-
 	/* copy the structure as a whole memory area to the target place */
 	*tableSpecs = tmpTableSpecs;
 
-	/* now compute the table-specific paths we are using in copydb */
-	sformat(tableSpecs->tablePaths.lockFile, MAXPGPATH, "%s/%d",
+	/* with --copy-strategy auto, each table has its own strategy */
+	if (source->strategy.chosen)
+	{
+		tableSpecs->copyFormat = source->strategy.copyFormat;
+		tableSpecs->copyFreeze = source->strategy.freeze;
+	}
+
+	copydb_table_index_array(specs, source, &(tableSpecs->tableIndexArray));
+
+	/* small enough tables are copied in primary key order */
+	tableSpecs->orderByColumns =
+		copydb_table_order_by_columns(specs, tableSpecs);
+
+	/* when the table is split, prepare the part ctid range */
+	CopyTableDataPartSpec *part = &(tableSpecs->part);
+
+	if (part->partCount > 1)
+	{
+		int64_t blocksPerPart =
+			(source->relpages + part->partCount - 1) / part->partCount;
+
+		part->min = partNumber * blocksPerPart;
+		part->max = (partNumber + 1) * blocksPerPart;
+
+		/* the last part is open-ended */
+		if (partNumber == (part->partCount - 1))
+		{
+			part->max = -1;
+		}
+	}
+
+	return copydb_prepare_copy_query(tableSpecs);
+}
+
+
+/*
+ * copydb_table_file_paths computes the table-specific paths we are using in
+ * copydb for the table of the given CopyTableDataSpec.
+ */
+void
+copydb_table_file_paths(CopyTableDataSpec *tableSpecs,
+						TableFilePaths *tablePaths)
+{
+	uint32_t oid = tableSpecs->sourceTable->oid;
+
+	sformat(tablePaths->lockFile, MAXPGPATH, "%s/%u",
 			tableSpecs->cfPaths->rundir,
-			source->oid);
+			oid);
 
-	sformat(tableSpecs->tablePaths.doneFile, MAXPGPATH, "%s/%d.done",
+	sformat(tablePaths->doneFile, MAXPGPATH, "%s/%u.done",
 			tableSpecs->cfPaths->tbldir,
-			source->oid);
+			oid);
 
-	sformat(tableSpecs->tablePaths.idxListFile, MAXPGPATH, "%s/%u.idx",
+	sformat(tablePaths->idxListFile, MAXPGPATH, "%s/%u.idx",
 			tableSpecs->cfPaths->tbldir,
-			source->oid);
-
-	return true;
+			oid);
 }
 
 
 /*
- * copydb_init_index_file_paths prepares a given index (and constraint) file
- * paths to help orchestrate the concurrent operations.
+ * copydb_part_file_paths computes the paths of the files that track the COPY
+ * of the table part of the given CopyTableDataSpec. A table that is not split
+ * is a single part that uses the table lockFile and doneFile.
  */
-bool
-copydb_init_indexes_paths(CopyTableDataSpec *tableSpecs)
+void
+copydb_part_file_paths(CopyTableDataSpec *tableSpecs,
+					   TablePartFilePaths *partPaths)
 {
-	SourceIndexArray *indexArray = tableSpecs->indexArray;
-	IndexFilePathsArray *indexPathsArray = &(tableSpecs->indexPathsArray);
-
-	indexPathsArray->count = indexArray->count;
-	indexPathsArray->array =
-		(IndexFilePaths *) malloc(indexArray->count * sizeof(IndexFilePaths));
+	CopyTableDataPartSpec *part = &(tableSpecs->part);
+	uint32_t oid = tableSpecs->sourceTable->oid;
 
-	for (int i = 0; i < indexArray->count; i++)
+	if (part->partCount > 1)
 	{
-		SourceIndex *index = &(indexArray->array[i]);
-		IndexFilePaths *indexPaths = &(indexPathsArray->array[i]);
-
-		sformat(indexPaths->lockFile, sizeof(indexPaths->lockFile),
-				"%s/%u",
+		sformat(partPaths->lockFile, MAXPGPATH, "%s/%u.%d",
+				tableSpecs->cfPaths->tbldir,
+				oid,
+				part->partNumber);
+
+		sformat(partPaths->doneFile, MAXPGPATH, "%s/%u.%d.done",
+				tableSpecs->cfPaths->tbldir,
+				oid,
+				part->partNumber);
+
+		sformat(partPaths->xidFile, MAXPGPATH, "%s/%u.%d.xid",
+				tableSpecs->cfPaths->tbldir,
+				oid,
+				part->partNumber);
+
+		sformat(partPaths->spoolFile, MAXPGPATH, "%s/%u.%d.copy%s",
+				tableSpecs->cfPaths->datadir,
+				oid,
+				part->partNumber,
+				spool_compression_suffix(tableSpecs->spoolCompression));
+	}
+	else
+	{
+		sformat(partPaths->lockFile, MAXPGPATH, "%s/%u",
 				tableSpecs->cfPaths->rundir,
-				index->indexOid);
+				oid);
 
-		sformat(indexPaths->doneFile, sizeof(indexPaths->doneFile),
-				"%s/%u.done",
-				tableSpecs->cfPaths->idxdir,
-				index->indexOid);
+		sformat(partPaths->doneFile, MAXPGPATH, "%s/%u.done",
+				tableSpecs->cfPaths->tbldir,
+				oid);
 
-		sformat(indexPaths->constraintDoneFile,
-				sizeof(indexPaths->constraintDoneFile),
-				"%s/%u.done",
-				tableSpecs->cfPaths->idxdir,
-				index->constraintOid);
-	}
+		sformat(partPaths->xidFile, MAXPGPATH, "%s/%u.xid",
+				tableSpecs->cfPaths->tbldir,
+				oid);
 
-	return true;
+		sformat(partPaths->spoolFile, MAXPGPATH, "%s/%u.copy%s",
+				tableSpecs->cfPaths->datadir,
+				oid,
+				spool_compression_suffix(tableSpecs->spoolCompression));
+	}
 }
 
 
 /*
- * copydb_objectid_has_been_processed_already returns true when a doneFile
- * could be found on-disk for the given target object OID.
+ * copydb_prepare_copy_query prepares the COPY source query of the table part
+ * of the given CopyTableDataSpec, using either its ctid range, its
+ * --table-sample clause, or its --order-by-pk-smaller-than columns, and the
+ * name of the target table with its column list when the table has generated
+ * columns.
+ *
+ * The query reads FROM ONLY the table, as the children of a table that uses
+ * inheritance are copied as tables of their own. The stored generated columns
+ * are computed again by the target, so they are neither read nor sent. Both
+ * strings are left NULL when COPY can use the table directly.
  */
-bool
-copydb_objectid_has_been_processed_already(CopyDataSpec *specs, uint32_t oid)
+static bool
+copydb_prepare_copy_query(CopyTableDataSpec *tableSpecs)
 {
-	char doneFile[MAXPGPATH] = { 0 };
+	CopyTableDataPartSpec *part = &(tableSpecs->part);
+	SourceTable *source = tableSpecs->sourceTable;
 
-	/* build the doneFile for the target index or constraint */
-	sformat(doneFile, sizeof(doneFile), "%s/%u.done",
-			specs->cfPaths.idxdir,
-			oid);
+	char qname[BUFSIZE] = { 0 };
+
+	sformat(qname, sizeof(qname), "\"%s\".\"%s\"",
+			source->nspname,
+			source->relname);
+
+	const char *columns =
+		source->copyColumns != NULL ? source->copyColumns : "*";
+
+	tableSpecs->copyQuery = NULL;
+	tableSpecs->copyTarget = NULL;
+
+	/* a table with many columns doesn't fit in BUFSIZE */
+	PQExpBuffer query = createPQExpBuffer();
+	PQExpBuffer target = createPQExpBuffer();
 
-	if (file_exists(doneFile))
+	if (part->partCount > 1)
 	{
-		char *sql = NULL;
-		long size = 0L;
+		appendPQExpBuffer(query, "(SELECT %s FROM ONLY %s", columns, qname);
 
-		if (!read_file(doneFile, &sql, &size))
+		if (part->partNumber == 0)
+		{
+			appendPQExpBuffer(query,
+							  " WHERE ctid < '(%lld,0)'::tid)",
+							  (long long) part->max);
+		}
+		else if (part->max == -1)
+		{
+			appendPQExpBuffer(query,
+							  " WHERE ctid >= '(%lld,0)'::tid)",
+							  (long long) part->min);
+		}
+		else
 		{
-			/* no worries, just skip then */
+			appendPQExpBuffer(query,
+							  " WHERE ctid >= '(%lld,0)'::tid"
+							  " AND ctid < '(%lld,0)'::tid)",
+							  (long long) part->min,
+							  (long long) part->max);
 		}
+	}
+	else if (tableSpecs->orderByColumns != NULL || source->samplePercent > 0.0)
+	{
+		char sample[NAMEDATALEN] = { 0 };
 
-		log_debug("Skipping dumpId %d (%s)", oid, sql);
+		appendPQExpBuffer(query, "(SELECT %s FROM ONLY %s%s",
+						  columns,
+						  qname,
+						  copydb_table_sample_clause(source,
+													 sample,
+													 sizeof(sample)));
 
-		/* read_file allocates memory */
-		free(sql);
+		if (tableSpecs->orderByColumns != NULL)
+		{
+			appendPQExpBuffer(query, " ORDER BY %s",
+							  tableSpecs->orderByColumns);
+		}
 
-		return true;
+		appendPQExpBufferChar(query, ')');
 	}
 
-	return false;
-}
+	if (source->copyColumns != NULL)
+	{
+		appendPQExpBuffer(target, "%s (%s)", qname, source->copyColumns);
+	}
 
+	bool success = !PQExpBufferBroken(query) && !PQExpBufferBroken(target);
 
-/*
- * copydb_dump_source_schema uses pg_dump -Fc --schema --section=pre-data or
- * --section=post-data to dump the source database schema to files.
- */
-bool
-copydb_dump_source_schema(CopyDataSpec *specs, PostgresDumpSection section)
-{
-	if (section == PG_DUMP_SECTION_SCHEMA ||
-		section == PG_DUMP_SECTION_PRE_DATA ||
-		section == PG_DUMP_SECTION_ALL)
+	if (success && query->len > 0)
 	{
-		if (!pg_dump_db(&(specs->pgPaths),
-						specs->source_pguri,
-						"pre-data",
-						specs->dumpPaths.preFilename))
-		{
-			/* errors have already been logged */
-			return false;
-		}
+		tableSpecs->copyQuery = strdup(query->data);
+		success = tableSpecs->copyQuery != NULL;
 	}
 
-	if (section == PG_DUMP_SECTION_SCHEMA ||
-		section == PG_DUMP_SECTION_POST_DATA ||
-		section == PG_DUMP_SECTION_ALL)
+	if (success && target->len > 0)
 	{
-		if (!pg_dump_db(&(specs->pgPaths),
-						specs->source_pguri,
-						"post-data",
-						specs->dumpPaths.postFilename))
-		{
-			/* errors have already been logged */
-			return false;
-		}
+		tableSpecs->copyTarget = strdup(target->data);
+		success = tableSpecs->copyTarget != NULL;
+	}
+
+	destroyPQExpBuffer(query);
+	destroyPQExpBuffer(target);
+
+	if (!success)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
 	}
 
 	return true;
@@ -426,24 +815,37 @@ copydb_dump_source_schema(CopyDataSpec *specs, PostgresDumpSection section)
 
 
 /*
- * copydb_target_prepare_schema restores the pre.dump file into the target
- * database.
+ * copydb_fetch_source_indexes lists all the indexes of the source database in
+ * a single catalog query, and sorts them by table oid. The table workers then
+ * find the indexes of each table they copy in their own slice of this array,
+ * see copydb_table_index_array(), rather than each querying the source
+ * catalogs again. Our sub-processes inherit the array at fork() time.
  */
-bool
-copydb_target_prepare_schema(CopyDataSpec *specs)
+static bool
+copydb_fetch_source_indexes(CopyDataSpec *specs, PGSQL *pgsql)
 {
-	if (!file_exists(specs->dumpPaths.preFilename))
+	SourceIndexArray *indexArray = &(specs->sourceIndexArray);
+
+	log_info("Listing indexes in \"%s\"", specs->source_pguri);
+
+	if (!schema_list_all_indexes(pgsql, indexArray))
 	{
-		log_fatal("File \"%s\" does not exists", specs->dumpPaths.preFilename);
+		/* errors have already been logged */
 		return false;
 	}
 
-	if (!pg_restore_db(&(specs->pgPaths),
-					   specs->target_pguri,
-					   specs->dumpPaths.preFilename,
-					   NULL,
-					   specs->dropIfExists,
-					   specs->noOwner))
+	if (indexArray->count > 1)
+	{
+		qsort(indexArray->array,
+			  indexArray->count,
+			  sizeof(SourceIndex),
+			  copydb_compare_index_table_oid);
+	}
+
+	log_info("Fetched information for %d indexes", indexArray->count);
+
+	/* the partitioned tables indexes are created once all indexes are built */
+	if (!copydb_fetch_source_partitioned_indexes(specs, pgsql))
 	{
 		/* errors have already been logged */
 		return false;
@@ -454,95 +856,203 @@ copydb_target_prepare_schema(CopyDataSpec *specs)
 
 
 /*
- * copydb_target_finalize_schema finalizes the schema after all the data has
- * been copied over, and after indexes and their constraints have been created
- * too.
+ * copydb_compare_index_table_oid is a qsort() comparison function that sorts
+ * indexes by their table oid, and then by their own oid.
  */
-bool
-copydb_target_finalize_schema(CopyDataSpec *specs)
+static int
+copydb_compare_index_table_oid(const void *a, const void *b)
 {
-	if (!file_exists(specs->dumpPaths.postFilename))
+	const SourceIndex *ia = (const SourceIndex *) a;
+	const SourceIndex *ib = (const SourceIndex *) b;
+
+	if (ia->tableOid != ib->tableOid)
 	{
-		log_fatal("File \"%s\" does not exists", specs->dumpPaths.postFilename);
-		return false;
+		return ia->tableOid < ib->tableOid ? -1 : 1;
 	}
 
-	/*
-	 * The post.dump archive file contains all the objects to create once the
-	 * table data has been copied over. It contains in particular the
-	 * constraints and indexes that we have already built concurrently in the
-	 * previous step, so we want to filter those out.
-	 *
-	 * Here's how to filter out some objects with pg_restore:
-	 *
-	 *   1. pg_restore -f- --list post.dump > post.list
-	 *   2. edit post.list to comment out lines
-	 *   3. pg_restore --use-list post.list post.dump
-	 */
-	ArchiveContentArray contents = { 0 };
-
-	if (!pg_restore_list(&(specs->pgPaths),
-						 specs->dumpPaths.postFilename,
-						 &contents))
+	if (ia->indexOid != ib->indexOid)
 	{
-		/* errors have already been logged */
-		return false;
+		return ia->indexOid < ib->indexOid ? -1 : 1;
 	}
 
-	/* edit our post.list file now */
-	PQExpBuffer listContents = createPQExpBuffer();
+	return 0;
+}
 
-	if (listContents == NULL)
-	{
-		log_error(ALLOCATION_FAILED_ERROR);
-		free(listContents);
-		return false;
-	}
 
-	/* for each object in the list, comment when we already processed it */
-	for (int i = 0; i < contents.count; i++)
-	{
-		uint32_t oid = contents.array[i].objectOid;
+/*
+ * copydb_table_index_array sets the given SourceIndexArray to the slice of
+ * specs->sourceIndexArray that holds the indexes of the given table. The
+ * slice points into the main array and must not be free'd.
+ */
+static void
+copydb_table_index_array(CopyDataSpec *specs,
+						 SourceTable *source,
+						 SourceIndexArray *slice)
+{
+	SourceIndexArray *indexArray = &(specs->sourceIndexArray);
 
-		/* commenting is done by prepending ";" as prefix to the line */
-		char *prefix =
-			copydb_objectid_has_been_processed_already(specs, oid) ? ";" : "";
+	slice->count = 0;
+	slice->array = NULL;
 
-		appendPQExpBuffer(listContents, "%s%d; %u %u\n",
-						  prefix,
-						  contents.array[i].dumpId,
-						  contents.array[i].catalogOid,
-						  contents.array[i].objectOid);
+	/* binary search for the first index of the table */
+	int lo = 0;
+	int hi = indexArray->count;
+
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+
+		if (indexArray->array[mid].tableOid < source->oid)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
 	}
 
-	/* memory allocation could have failed while building string */
-	if (PQExpBufferBroken(listContents))
+	int count = 0;
+
+	while (lo + count < indexArray->count &&
+		   indexArray->array[lo + count].tableOid == source->oid)
 	{
-		log_error("Failed to create pg_restore list file: out of memory");
-		destroyPQExpBuffer(listContents);
-		return false;
+		++count;
 	}
 
-	if (!write_file(listContents->data,
-					listContents->len,
-					specs->dumpPaths.listFilename))
+	if (count > 0)
 	{
-		/* errors have already been logged */
-		destroyPQExpBuffer(listContents);
-		return false;
+		slice->count = count;
+		slice->array = &(indexArray->array[lo]);
 	}
+}
 
-	destroyPQExpBuffer(listContents);
 
-	if (!pg_restore_db(&(specs->pgPaths),
-					   specs->target_pguri,
-					   specs->dumpPaths.postFilename,
-					   specs->dumpPaths.listFilename,
-					   specs->dropIfExists,
-					   specs->noOwner))
+/*
+ * copydb_table_order_by_columns returns the primary key columns of the table
+ * when it should be copied in primary key order, and NULL otherwise.
+ *
+ * With --order-by-pk-smaller-than, the source sorts the rows of the tables
+ * that are smaller than the given size, and the target then builds the
+ * primary key index from a heap that is already in order, and that keeps the
+ * locality of range scans on the key. Tables that are split are copied in
+ * ctid ranges, which are not sorted. With --copy-strategy auto, the choice is
+ * made for each table, see strategy.c.
+ */
+static char *
+copydb_table_order_by_columns(CopyDataSpec *specs,
+							  CopyTableDataSpec *tableSpecs)
+{
+	SourceTable *source = tableSpecs->sourceTable;
+
+	bool orderByPk =
+		source->strategy.chosen
+		? source->strategy.orderByPk
+		: (specs->orderByPkSmallerThan > 0 &&
+		   source->bytes > 0 &&
+		   (uint64_t) source->bytes < specs->orderByPkSmallerThan);
+
+	if (!orderByPk || tableSpecs->part.partCount > 1)
 	{
-		/* errors have already been logged */
-		return false;
+		return NULL;
+	}
+
+	for (int i = 0; i < tableSpecs->tableIndexArray.count; i++)
+	{
+		SourceIndex *index = &(tableSpecs->tableIndexArray.array[i]);
+
+		if (!index->isPrimary ||
+			index->indexColumns == NULL ||
+			IS_EMPTY_STRING_BUFFER(index->indexColumns))
+		{
+			continue;
+		}
+
+		return index->indexColumns;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * copydb_table_part_count returns how many parts the given table should be
+ * split into, and 1 when the table is not to be split. Only tables that are
+ * larger than --split-tables-larger-than are split, or than the threshold
+ * that --copy-strategy auto chose for them, and only when we are copying the
+ * table data.
+ *
+ * Each part holds at least one block of the main relation fork, and the
+ * count of parts is adjusted so that none of the parts is empty.
+ */
+int
+copydb_table_part_count(CopyDataSpec *specs, SourceTable *source)
+{
+	uint64_t threshold =
+		source->strategy.chosen
+		? source->strategy.splitTablesLargerThan
+		: specs->splitTablesLargerThan;
+
+	/* a sample of the rows is not split, see --table-sample */
+	if (threshold == 0 ||
+		source->samplePercent > 0.0 ||
+		source->bytes <= 0 ||
+		(uint64_t) source->bytes <= threshold)
+	{
+		return 1;
+	}
+
+	if (specs->section != DATA_SECTION_TABLE_DATA &&
+		specs->section != DATA_SECTION_ALL)
+	{
+		return 1;
+	}
+
+	int64_t partCount = (source->bytes + threshold - 1) / threshold;
+
+	/* the TOAST relation might be large when the main fork is not */
+	if (partCount > source->relpages)
+	{
+		partCount = source->relpages;
+	}
+
+	if (partCount <= 1)
+	{
+		return 1;
+	}
+
+	/* avoid empty parts at the end of the ctid range */
+	int64_t blocksPerPart = (source->relpages + partCount - 1) / partCount;
+
+	partCount = (source->relpages + blocksPerPart - 1) / blocksPerPart;
+
+	return partCount > INT_MAX ? INT_MAX : (int) partCount;
+}
+
+
+/*
+ * copydb_init_index_file_paths prepares a given index (and constraint) file
+ * paths to help orchestrate the concurrent operations.
+ */
+bool
+copydb_init_indexes_paths(CopyTableDataSpec *tableSpecs)
+{
+	SourceIndexArray *indexArray = tableSpecs->indexArray;
+	IndexFilePathsArray *indexPathsArray = &(tableSpecs->indexPathsArray);
+
+	indexPathsArray->count = indexArray->count;
+	indexPathsArray->array =
+		(IndexFilePaths *) malloc(indexArray->count * sizeof(IndexFilePaths));
+
+	for (int i = 0; i < indexArray->count; i++)
+	{
+		SourceIndex *index = &(indexArray->array[i]);
+		IndexFilePaths *indexPaths = &(indexPathsArray->array[i]);
+
+		sformat(indexPaths->lockFile, sizeof(indexPaths->lockFile),
+				"%s/%u",
+				tableSpecs->cfPaths->rundir,
+				index->indexOid);
 	}
 
 	return true;
@@ -550,681 +1060,2497 @@ copydb_target_finalize_schema(CopyDataSpec *specs)
 
 
 /*
- * copydb_table_data fetches the list of tables from the source database and
- * then run a pg_dump --data-only --schema ... --table ... | pg_restore on each
- * of them, using up to tblJobs sub-processes for that.
+ * copydb_objectid_has_been_processed_already returns true when the given
+ * target object OID has been registered in the journal, which must have been
+ * loaded with journal_load() already.
+ */
+bool
+copydb_objectid_has_been_processed_already(CopyDataSpec *specs, uint32_t oid)
+{
+	JournalEntry *entry = journal_lookup(&(specs->journal), oid);
+
+	if (entry != NULL)
+	{
+		log_debug("Skipping dumpId %d (%s)", oid, entry->command);
+		return true;
+	}
+
+	return false;
+}
+
+
+/*
+ * copydb_dump_source_schema uses pg_dump -Fc --schema --section=pre-data or
+ * --section=post-data to dump the source database schema to files.
  *
- * Each subprocess also fetches a list of indexes for each given table, and
- * creates those indexes in parallel using up to idxJobs sub-processes for
- * that.
+ * When both sections are needed, the post-data pg_dump runs in a sub-process
+ * at the same time as the pre-data one. Both use the same snapshot when we
+ * have one, so the two files still describe the same schema.
  */
 bool
-copydb_copy_all_table_data(CopyDataSpec *specs)
+copydb_dump_source_schema(CopyDataSpec *specs, PostgresDumpSection section)
 {
-	PGSQL pgsql = { 0 };
-	SourceTableArray tableArray = { 0, NULL };
-	TableDataProcessArray tableProcessArray = { specs->tableJobs, NULL };
-	CopyTableDataSpecsArray *tableSpecsArray = &(specs->tableSpecsArray);
+	TransactionSnapshot *sourceSnapshot = &(specs->sourceSnapshot);
+	char *snapshot = NULL;
 
-	tableProcessArray.array =
-		(TableDataProcess *) malloc(specs->tableJobs * sizeof(TableDataProcess));
+	if (sourceSnapshot->state == SNAPSHOT_STATE_EXPORTED ||
+		sourceSnapshot->state == SNAPSHOT_STATE_SET)
+	{
+		snapshot = sourceSnapshot->snapshot;
+	}
 
-	if (tableProcessArray.array == NULL)
+	bool preData =
+		section == PG_DUMP_SECTION_SCHEMA ||
+		section == PG_DUMP_SECTION_PRE_DATA ||
+		section == PG_DUMP_SECTION_ALL;
+
+	bool postData =
+		section == PG_DUMP_SECTION_SCHEMA ||
+		section == PG_DUMP_SECTION_POST_DATA ||
+		section == PG_DUMP_SECTION_ALL;
+
+	TableDataProcess postDataProcess = { 0 };
+
+	if (preData && postData)
 	{
-		log_fatal(ALLOCATION_FAILED_ERROR);
+		if (!copydb_start_dump_process(specs,
+									   snapshot,
+									   "post-data",
+									   specs->dumpPaths.postFilename,
+									   &postDataProcess))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+	else if (postData)
+	{
+		if (!pg_dump_db(&(specs->pgPaths),
+						specs->source_pguri,
+						snapshot,
+						"post-data",
+						specs->dumpPaths.postFilename))
+		{
+			/* errors have already been logged */
+			return false;
+		}
 	}
 
-	/* ensure the memory area is initialized to all zeroes */
-	memset((void *) tableProcessArray.array,
-		   0,
-		   specs->tableJobs * sizeof(TableDataProcess));
+	bool success = true;
 
-	log_info("Listing ordinary tables in \"%s\"", specs->source_pguri);
+	if (preData)
+	{
+		success = pg_dump_db(&(specs->pgPaths),
+							 specs->source_pguri,
+							 snapshot,
+							 "pre-data",
+							 specs->dumpPaths.preFilename);
+	}
 
-	if (!pgsql_init(&pgsql, specs->source_pguri, PGSQL_CONN_SOURCE))
+	/* always wait for the post-data pg_dump sub-process, when we have one */
+	if (postDataProcess.pid > 0)
+	{
+		if (!copydb_wait_for_processes(&postDataProcess, 1))
+		{
+			log_error("Failed to dump the post-data section, "
+					  "see above for details");
+			success = false;
+		}
+	}
+
+	return success;
+}
+
+
+/*
+ * copydb_start_dump_process forks a sub-process that runs pg_dump for the
+ * given section, and registers it in the given process slot.
+ */
+static bool
+copydb_start_dump_process(CopyDataSpec *specs,
+						  char *snapshot,
+						  const char *section,
+						  const char *filename,
+						  TableDataProcess *process)
+{
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	int fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork a pg_dump process for the %s section",
+					  section);
+			return false;
+		}
+
+		case 0:
+		{
+			/* child process runs the command */
+			if (!pg_dump_db(&(specs->pgPaths),
+							specs->source_pguri,
+							snapshot,
+							section,
+							filename))
+			{
+				/* errors have already been logged */
+				exit(EXIT_CODE_SOURCE);
+			}
+
+			exit(EXIT_CODE_QUIT);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			process->pid = fpid;
+
+			return true;
+		}
+	}
+}
+
+
+/*
+ * copydb_target_prepare_schema restores the pre.dump file into the target
+ * database. When using table filters, the objects of the tables that are
+ * excluded are commented out of a pg_restore --use-list file.
+ */
+bool
+copydb_target_prepare_schema(CopyDataSpec *specs)
+{
+	if (!file_exists(specs->dumpPaths.preFilename))
+	{
+		log_fatal("File \"%s\" does not exists", specs->dumpPaths.preFilename);
+		return false;
+	}
+
+	char *listFilename = NULL;
+
+	if (copydb_has_table_filters(&(specs->filters)))
+	{
+		if (!copydb_write_filtered_pre_data_list(specs))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		listFilename = specs->dumpPaths.preListFilename;
+	}
+
+	/* pg_restore --jobs restores the pre-data objects serially anyway */
+	if (!pg_restore_db(&(specs->pgPaths),
+					   specs->target_pguri,
+					   specs->dumpPaths.preFilename,
+					   listFilename,
+					   specs->dropIfExists,
+					   specs->noOwner,
+					   false,
+					   1))
 	{
 		/* errors have already been logged */
 		return false;
 	}
 
-	if (!schema_list_ordinary_tables(&pgsql, &tableArray))
+	return true;
+}
+
+
+/*
+ * copydb_write_filtered_pre_data_list writes the pg_restore --use-list file
+ * of the pre.dump archive with the objects that the table filters exclude
+ * commented out.
+ */
+static bool
+copydb_write_filtered_pre_data_list(CopyDataSpec *specs)
+{
+	ArchiveContentArray contents = { 0 };
+
+	if (!copydb_prepare_table_filters(specs, NULL))
 	{
 		/* errors have already been logged */
 		return false;
 	}
 
-	log_info("Fetched information for %d tables", tableArray.count);
+	if (!pg_restore_list(&(specs->pgPaths),
+						 specs->dumpPaths.preFilename,
+						 specs->dumpPaths.preTocFilename,
+						 &contents))
+	{
+		/* errors have already been logged */
+		return false;
+	}
 
-	int count = tableArray.count;
+	PQExpBuffer listContents = createPQExpBuffer();
 
-	specs->tableSpecsArray.count = count;
-	specs->tableSpecsArray.array =
-		(CopyTableDataSpec *) malloc(count * sizeof(CopyTableDataSpec));
+	if (listContents == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		free(contents.array);
+		return false;
+	}
 
-	for (int tableIndex = 0; tableIndex < tableArray.count; tableIndex++)
+	for (int i = 0; i < contents.count; i++)
 	{
-		int subProcessIndex =
-			waitUntilOneSubprocessIsDone(&tableProcessArray);
+		/* commenting is done by prepending ";" as prefix to the line */
+		char *prefix =
+			copydb_archive_item_is_filtered_out(specs, &(contents.array[i]))
+			? ";" : "";
 
-		/* initialize our TableDataProcess entry now */
-		SourceTable *source = &(tableArray.array[tableIndex]);
-		TableDataProcess *process = &(tableProcessArray.array[subProcessIndex]);
+		appendPQExpBuffer(listContents, "%s%d; %u %u\n",
+						  prefix,
+						  contents.array[i].dumpId,
+						  contents.array[i].catalogOid,
+						  contents.array[i].objectOid);
+	}
+
+	free(contents.array);
+
+	/* memory allocation could have failed while building string */
+	if (PQExpBufferBroken(listContents))
+	{
+		log_error("Failed to create pg_restore list file: out of memory");
+		destroyPQExpBuffer(listContents);
+		return false;
+	}
+
+	if (!write_file(listContents->data,
+					listContents->len,
+					specs->dumpPaths.preListFilename))
+	{
+		/* errors have already been logged */
+		destroyPQExpBuffer(listContents);
+		return false;
+	}
+
+	destroyPQExpBuffer(listContents);
+
+	return true;
+}
+
+
+/*
+ * copydb_target_finalize_schema finalizes the schema after all the data has
+ * been copied over, and after indexes and their constraints have been created
+ * too.
+ */
+bool
+copydb_target_finalize_schema(CopyDataSpec *specs)
+{
+	if (!file_exists(specs->dumpPaths.postFilename))
+	{
+		log_fatal("File \"%s\" does not exists", specs->dumpPaths.postFilename);
+		return false;
+	}
+
+	/*
+	 * The post.dump archive file contains all the objects to create once the
+	 * table data has been copied over. It contains in particular the
+	 * constraints and indexes that we have already built concurrently in the
+	 * previous step, so we want to filter those out.
+	 *
+	 * Here's how to filter out some objects with pg_restore:
+	 *
+	 *   1. pg_restore -f- --list post.dump > post.list
+	 *   2. edit post.list to comment out lines
+	 *   3. pg_restore --use-list post.list post.dump
+	 *
+	 * The foreign keys that we listed from the source database are filtered
+	 * out too, and created later by copydb_create_foreign_keys().
+	 */
+	ArchiveContentArray contents = { 0 };
+
+	/* the objects of the tables that the filters exclude are skipped too */
+	if (!copydb_prepare_table_filters(specs, NULL))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* the objects we processed already are registered in the journal */
+	if (!journal_load(&(specs->journal)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pg_restore_list(&(specs->pgPaths),
+						 specs->dumpPaths.postFilename,
+						 specs->dumpPaths.postTocFilename,
+						 &contents))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* edit our post.list file now */
+	PQExpBuffer listContents = createPQExpBuffer();
+	int *fkeyIndexes = (int *) calloc(contents.count + 1, sizeof(int));
+	int fkeyCount = 0;
+
+	if (listContents == NULL || fkeyIndexes == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		free(listContents);
+		free(fkeyIndexes);
+		return false;
+	}
+
+	/* for each object in the list, comment when we already processed it */
+	for (int i = 0; i < contents.count; i++)
+	{
+		uint32_t oid = contents.array[i].objectOid;
+
+		/* commenting is done by prepending ";" as prefix to the line */
+		char *prefix =
+			copydb_objectid_has_been_processed_already(specs, oid) ||
+			copydb_archive_item_is_filtered_out(specs, &(contents.array[i]))
+			? ";" : "";
+
+		if (IS_EMPTY_STRING_BUFFER(prefix) &&
+			streq(contents.array[i].desc, "FK CONSTRAINT"))
+		{
+			SourceForeignKey *fkey = copydb_lookup_foreign_key(specs, oid);
+
+			if (fkey != NULL)
+			{
+				fkeyIndexes[fkeyCount++] =
+					fkey - specs->sourceFkeyArray.array;
+				prefix = ";";
+			}
+		}
+
+		appendPQExpBuffer(listContents, "%s%d; %u %u\n",
+						  prefix,
+						  contents.array[i].dumpId,
+						  contents.array[i].catalogOid,
+						  contents.array[i].objectOid);
+	}
+
+	/* memory allocation could have failed while building string */
+	if (PQExpBufferBroken(listContents))
+	{
+		log_error("Failed to create pg_restore list file: out of memory");
+		destroyPQExpBuffer(listContents);
+		free(fkeyIndexes);
+		return false;
+	}
+
+	if (!write_file(listContents->data,
+					listContents->len,
+					specs->dumpPaths.listFilename))
+	{
+		/* errors have already been logged */
+		destroyPQExpBuffer(listContents);
+		free(fkeyIndexes);
+		return false;
+	}
+
+	destroyPQExpBuffer(listContents);
+
+	if (!pg_restore_db(&(specs->pgPaths),
+					   specs->target_pguri,
+					   specs->dumpPaths.postFilename,
+					   specs->dumpPaths.listFilename,
+					   specs->dropIfExists,
+					   specs->noOwner,
+					   false,
+					   specs->restoreJobs))
+	{
+		/* errors have already been logged */
+		free(fkeyIndexes);
+		return false;
+	}
+
+	/* the referenced unique indexes and constraints all exist now */
+	if (!copydb_create_foreign_keys(specs, fkeyIndexes, fkeyCount))
+	{
+		/* errors have already been logged */
+		free(fkeyIndexes);
+		return false;
+	}
+
+	free(fkeyIndexes);
+
+	return true;
+}
+
+
+static bool copydb_fetch_source_catalogs(CopyDataSpec *specs,
+										 SourceTableArray *tableArray);
+static void copydb_abort_table_data(CopyDataSpec *specs,
+									TableDataProcessArray *tableProcessArray);
+
+
+/*
+ * copydb_table_data fetches the list of tables from the source database and
+ * then COPY the data of each of them, using up to tblJobs table workers for
+ * that. The workers are long-lived sub-processes that pull their next table
+ * from a shared queue, re-using their connections from one table to the next.
+ *
+ * Each table's indexes are then created in parallel using up to idxJobs
+ * sub-processes for that.
+ */
+bool
+copydb_copy_all_table_data(CopyDataSpec *specs)
+{
+	SourceTableArray tableArray = { 0, NULL };
+	CopyTableDataSpecsArray *tableSpecsArray = &(specs->tableSpecsArray);
+
+	/* fail early when the target can't use our bulk-load profile */
+	if (!copydb_check_bulk_load_profile(specs))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/*
+	 * Table workers, multiplexed COPY process, index and vacuum workers, the
+	 * throttle monitor, the metrics server, and the ETA monitor.
+	 */
+	TableDataProcessArray tableProcessArray = {
+		specs->tableJobs + 1 + specs->indexJobs + specs->vacuumJobs + 3, NULL
+	};
+
+	tableProcessArray.array =
+		(TableDataProcess *) calloc(tableProcessArray.count,
+									sizeof(TableDataProcess));
+
+	if (tableProcessArray.array == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	/* pgcopydb restore data reads the catalog written by pgcopydb dump data */
+	bool listed =
+		specs->spoolMode == COPY_SPOOL_READ
+		? copydb_spool_read_catalog(specs, &tableArray)
+		: copydb_fetch_source_catalogs(specs, &tableArray);
+
+	if (!listed)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* the doneFiles register the change markers, see --refresh */
+	(void) copydb_set_table_markers(specs, &tableArray);
+
+	if (specs->copyFormat == COPY_FORMAT_BINARY &&
+		specs->spoolMode == COPY_SPOOL_NONE &&
+		(specs->section == DATA_SECTION_TABLE_DATA ||
+		 specs->section == DATA_SECTION_ALL))
+	{
+		if (!copydb_check_copy_format(specs))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	/* with --copy-strategy auto, classify the tables from their stats */
+	if (!copydb_choose_copy_strategies(specs, &tableArray))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/*
+	 * Tables that are larger than --split-tables-larger-than are split in
+	 * several parts, each part is then handled as its own COPY job.
+	 */
+	int count = 0;
+
+	for (int tableIndex = 0; tableIndex < tableArray.count; tableIndex++)
+	{
+		SourceTable *source = &(tableArray.array[tableIndex]);
+		int partCount = copydb_table_part_count(specs, source);
+
+		if (partCount > 1 && source->strategy.chosen)
+		{
+			log_info("Table \"%s\".\"%s\" is %s large "
+					 "and is going to be split in %d parts",
+					 source->nspname,
+					 source->relname,
+					 source->bytesPretty,
+					 partCount);
+		}
+		else if (partCount > 1)
+		{
+			log_info("Table \"%s\".\"%s\" is %s large "
+					 "which is larger than --split-tables-larger-than %s, "
+					 "and is going to be split in %d parts",
+					 source->nspname,
+					 source->relname,
+					 source->bytesPretty,
+					 specs->splitTablesLargerThanPretty,
+					 partCount);
+		}
+
+		if (specs->copyFormat == COPY_FORMAT_BINARY && source->binaryUnsafe)
+		{
+			log_warn("Table \"%s\".\"%s\" has columns with data types that "
+					 "are not supported by COPY binary format, "
+					 "using COPY text format for this table",
+					 source->nspname,
+					 source->relname);
+		}
+
+		count += partCount;
+	}
+
+	specs->tableSpecsArray.count = count;
+	specs->tableSpecsArray.array =
+		(CopyTableDataSpec *) malloc(count * sizeof(CopyTableDataSpec));
+
+	if (specs->tableSpecsArray.array == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	int specsCount = 0;
+
+	for (int tableIndex = 0; tableIndex < tableArray.count; tableIndex++)
+	{
+		SourceTable *source = &(tableArray.array[tableIndex]);
+		int partCount = copydb_table_part_count(specs, source);
+
+		for (int partNumber = 0; partNumber < partCount; partNumber++)
+		{
+			CopyTableDataSpec *tableSpecs =
+				&(tableSpecsArray->array[specsCount++]);
+
+			if (!copydb_init_table_specs(tableSpecs, specs, source, partNumber))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+		}
+	}
+
+	char catalogBytesPretty[BUFSIZE] = { 0 };
+	char specsBytesPretty[BUFSIZE] = { 0 };
+
+	(void) pretty_print_bytes(catalogBytesPretty,
+							  sizeof(catalogBytesPretty),
+							  schema_catalog_bytes());
+
+	(void) pretty_print_bytes(specsBytesPretty,
+							  sizeof(specsBytesPretty),
+							  count * sizeof(CopyTableDataSpec));
+
+	log_debug("Catalog strings use %s, and the %d table copy specs use %s",
+			  catalogBytesPretty,
+			  count,
+			  specsBytesPretty);
+
+	/* with --resume, find out what a previous run has done already */
+	if (specs->resume && !copydb_prepare_resume(specs))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* with --refresh, skip the tables that have not changed since then */
+	if (specs->refresh && !copydb_prepare_refresh(specs))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/*
+	 * Small tables are all handled by a single sub-process, and the other
+	 * tables (and table parts) are pushed to a shared queue from which our
+	 * pool of table workers pulls its next COPY job.
+	 */
+	int multiplexCount = 0;
+
+	for (int specsIndex = 0; specsIndex < count; specsIndex++)
+	{
+		CopyTableDataSpec *tableSpecs = &(tableSpecsArray->array[specsIndex]);
+
+		if (copydb_table_is_multiplexed(specs, tableSpecs))
+		{
+			++multiplexCount;
+		}
+	}
+
+	if (!copydb_table_queue_init(specs) ||
+		!copydb_index_queue_init(specs) ||
+		!copydb_vacuum_queue_init(specs))
+	{
+		/* errors have already been logged */
+		(void) copydb_table_queue_finish(specs);
+		(void) copydb_index_queue_finish(specs);
+		return false;
+	}
+
+	/* progress reporting is not worth failing the copy for */
+	if (!copydb_progress_init(specs))
+	{
+		log_warn("Failed to prepare the progress area, "
+				 "pgcopydb list progress is not going to be available");
+	}
+
+	tableProcessArray.count = 0;
+
+	/*
+	 * Start the index workers and the vacuum workers first, they wait until
+	 * the first table has been copied and its jobs queued.
+	 */
+	int indexWorkerCount =
+		specs->section == DATA_SECTION_TABLE_DATA ? 0 : specs->indexJobs;
+
+	if (indexWorkerCount > specs->indexQueue->capacity)
+	{
+		indexWorkerCount = specs->indexQueue->capacity;
+	}
+
+	/* the index memory budget is shared between the index workers */
+	specs->indexQueue->workerCount = indexWorkerCount;
+
+	if (specs->indexMemoryBudget > 0 && indexWorkerCount > 0)
+	{
+		log_info("Sharing an index memory budget of %s "
+				 "between %d index workers",
+				 specs->indexMemoryBudgetPretty,
+				 indexWorkerCount);
+	}
+
+	for (int workerIndex = 0; workerIndex < indexWorkerCount; workerIndex++)
+	{
+		TableDataProcess *process =
+			&(tableProcessArray.array[tableProcessArray.count++]);
+
+		if (!copydb_start_index_worker(specs, process, workerIndex))
+		{
+			log_fatal("Failed to start index worker %d, "
+					  "see above for details",
+					  workerIndex);
+
+			(void) copydb_abort_table_data(specs, &tableProcessArray);
+			return false;
+		}
+
+		log_debug("[%d] is index worker %d", process->pid, workerIndex);
+	}
+
+	int vacuumWorkerCount =
+		specs->section == DATA_SECTION_VACUUM ||
+		specs->section == DATA_SECTION_ALL
+		? specs->vacuumJobs
+		: 0;
+
+	if (vacuumWorkerCount > specs->vacuumQueue->capacity)
+	{
+		vacuumWorkerCount = specs->vacuumQueue->capacity;
+	}
+
+	for (int workerIndex = 0; workerIndex < vacuumWorkerCount; workerIndex++)
+	{
+		TableDataProcess *process =
+			&(tableProcessArray.array[tableProcessArray.count++]);
+
+		if (!copydb_start_vacuum_worker(specs, process))
+		{
+			log_fatal("Failed to start vacuum worker %d, "
+					  "see above for details",
+					  workerIndex);
+
+			(void) copydb_abort_table_data(specs, &tableProcessArray);
+			return false;
+		}
+
+		log_debug("[%d] is vacuum worker %d", process->pid, workerIndex);
+	}
+
+	/* the metrics server exits when the progress area is closed */
+	if (specs->metricsPort > 0)
+	{
+		TableDataProcess *process =
+			&(tableProcessArray.array[tableProcessArray.count]);
+
+		if (copydb_start_metrics_server(specs, process))
+		{
+			++tableProcessArray.count;
+		}
+		else
+		{
+			log_warn("Failed to start the metrics server at \"%s:%d\", "
+					 "see above for details",
+					 specs->metricsHost,
+					 specs->metricsPort);
+		}
+	}
+
+	/* the ETA monitor also exits when the progress area is closed */
+	if (specs->etaInterval > 0 && specs->progress != NULL)
+	{
+		TableDataProcess *process =
+			&(tableProcessArray.array[tableProcessArray.count]);
+
+		if (copydb_start_eta_monitor(specs, process))
+		{
+			++tableProcessArray.count;
+		}
+		else
+		{
+			log_warn("Failed to start the ETA monitor, "
+					 "see above for details");
+		}
+	}
+
+	/* the index and vacuum workers are not waited for until COPY is done */
+	int firstTableProcess = tableProcessArray.count;
+
+	/* the multiplexed process uses one of the --table-jobs slots */
+	int workerCount =
+		multiplexCount > 0 && specs->tableJobs > 1
+		? specs->tableJobs - 1
+		: specs->tableJobs;
+
+	if (workerCount > specs->tableQueue->count)
+	{
+		workerCount = specs->tableQueue->count;
+	}
+
+	if (!copydb_schedule_table_queue(specs, workerCount))
+	{
+		/* errors have already been logged */
+		(void) copydb_abort_table_data(specs, &tableProcessArray);
+		return false;
+	}
+
+	/* --max-copy-rate and the adaptive mode share the throttle area */
+	if (!copydb_throttle_init(specs, workerCount))
+	{
+		/* errors have already been logged */
+		(void) copydb_abort_table_data(specs, &tableProcessArray);
+		return false;
+	}
+
+	if (!copydb_memory_budget_init(specs, workerCount))
+	{
+		/* errors have already been logged */
+		(void) copydb_abort_table_data(specs, &tableProcessArray);
+		return false;
+	}
+
+	/* the monitor is waited for with the table workers */
+	if (copydb_throttle_is_adaptive(specs) &&
+		(specs->section == DATA_SECTION_TABLE_DATA ||
+		 specs->section == DATA_SECTION_ALL))
+	{
+		TableDataProcess *process =
+			&(tableProcessArray.array[tableProcessArray.count++]);
+
+		if (!copydb_start_throttle_monitor(specs, process))
+		{
+			log_fatal("Failed to start the COPY throttle monitor, "
+					  "see above for details");
+
+			(void) copydb_abort_table_data(specs, &tableProcessArray);
+			return false;
+		}
+
+		log_info("Scaling up to %d table workers from the source load, "
+				 "sampled every %d seconds",
+				 workerCount,
+				 THROTTLE_SAMPLE_INTERVAL_MS / 1000);
+	}
+
+	if (multiplexCount > 0)
+	{
+		TableDataProcess *process =
+			&(tableProcessArray.array[tableProcessArray.count++]);
+
+		if (!copydb_start_multiplexed_tables(specs, process))
+		{
+			log_fatal("Failed to start the process for tables smaller "
+					  "than --multiplex-tables-smaller-than %s, "
+					  "see above for details",
+					  specs->multiplexTablesSmallerThanPretty);
+
+			(void) copydb_abort_table_data(specs, &tableProcessArray);
+			return false;
+		}
+	}
+
+	instr_time startTime;
+	INSTR_TIME_SET_CURRENT(startTime);
+
+	for (int workerIndex = 0; workerIndex < workerCount; workerIndex++)
+	{
+		TableDataProcess *process =
+			&(tableProcessArray.array[tableProcessArray.count++]);
+
+		if (!copydb_start_table_worker(specs, process, workerIndex))
+		{
+			log_fatal("Failed to start table data worker %d, "
+					  "see above for details",
+					  workerIndex);
+
+			(void) copydb_abort_table_data(specs, &tableProcessArray);
+			return false;
+		}
+
+		log_debug("[%d] is table data worker %d", process->pid, workerIndex);
+	}
+
+	/* wait until all the COPY are done, and all the indexes are queued */
+	bool success =
+		copydb_wait_for_processes(tableProcessArray.array + firstTableProcess,
+								  tableProcessArray.count - firstTableProcess);
+
+	/* now the index workers exit when they're done with the queue */
+	if (!copydb_index_queue_close(specs->indexQueue))
+	{
+		log_warn("Failed to close the index queue, see above for details");
+	}
+
+	/* the index workers queue tables for VACUUM, wait until they're done */
+	if (!copydb_wait_for_processes(tableProcessArray.array, indexWorkerCount))
+	{
+		success = false;
+	}
+
+	if (!copydb_vacuum_queue_close(specs->vacuumQueue))
+	{
+		log_warn("Failed to close the vacuum queue, see above for details");
+	}
+
+	/* now the metrics server and the ETA monitor exit too */
+	(void) copydb_progress_close(specs);
+
+	if (!copydb_wait_for_subprocesses())
+	{
+		success = false;
+	}
+
+	instr_time duration;
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, startTime);
+
+	(void) copydb_report_schedule(specs, INSTR_TIME_GET_MILLISEC(duration));
+
+	if (!copydb_table_queue_finish(specs))
+	{
+		log_warn("Failed to release the table queue, see above for details");
+	}
+
+	if (!copydb_index_queue_finish(specs))
+	{
+		log_warn("Failed to release the index queue, see above for details");
+	}
+
+	if (!copydb_vacuum_queue_finish(specs))
+	{
+		log_warn("Failed to release the vacuum queue, see above for details");
+	}
+
+	if (!copydb_throttle_finish(specs))
+	{
+		log_warn("Failed to release the COPY throttle, see above for details");
+	}
+
+	if (!copydb_memory_budget_finish(specs))
+	{
+		log_warn("Failed to release the COPY memory budget, "
+				 "see above for details");
+	}
+
+	if (!copydb_progress_finish(specs))
+	{
+		log_warn("Failed to release the progress area, see above for details");
+	}
+
+	/* the catalog is written last, it marks the data dump as complete */
+	if (success && specs->spoolMode == COPY_SPOOL_WRITE)
+	{
+		success = copydb_spool_write_catalog(specs, &tableArray);
+	}
+
+	/* attach the partitions indexes now that they have all been built */
+	if (success &&
+		(specs->section == DATA_SECTION_ALL ||
+		 specs->section == DATA_SECTION_INDEXES ||
+		 specs->section == DATA_SECTION_CONSTRAINTS))
+	{
+		success = copydb_create_partitioned_indexes(specs);
+	}
+
+	/* the foreign keys dropped by --refresh reference the new indexes */
+	if (success && specs->refresh)
+	{
+		success = copydb_refresh_foreign_keys(specs);
+	}
+
+	return success;
+}
+
+
+/*
+ * copydb_fetch_source_catalogs lists the tables of the source database, and
+ * the indexes and foreign keys when the data section needs them, in the
+ * snapshot that the table workers are going to COPY from.
+ */
+static bool
+copydb_fetch_source_catalogs(CopyDataSpec *specs, SourceTableArray *tableArray)
+{
+	PGSQL pgsql = { 0 };
+
+	log_info("Listing ordinary tables in \"%s\"", specs->source_pguri);
+
+	if (!pgsql_init(&pgsql, specs->source_pguri, PGSQL_CONN_SOURCE))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* list the tables as seen in the snapshot that we are going to COPY */
+	if (!copydb_set_snapshot(&(specs->sourceSnapshot), &pgsql))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/*
+	 * The table-data section only needs the indexes to COPY in primary key
+	 * order, or to write them in the catalog of pgcopydb dump data. The
+	 * foreign keys are created when finalizing the schema.
+	 */
+	bool needIndexes =
+		(specs->section != DATA_SECTION_TABLE_DATA &&
+		 specs->section != DATA_SECTION_VACUUM) ||
+		(specs->section == DATA_SECTION_TABLE_DATA &&
+		 (specs->orderByPkSmallerThan > 0 || specs->copyStrategyAuto)) ||
+		specs->spoolMode == COPY_SPOOL_WRITE;
+
+	bool needForeignKeys = specs->section == DATA_SECTION_ALL;
+
+	/* a previous subcommand might have cached the same catalogs already */
+	bool cached = false;
+
+	if (copydb_catalog_fingerprint(specs, &pgsql) &&
+		!copydb_catalog_read_cache(specs,
+								   tableArray,
+								   needIndexes,
+								   needForeignKeys,
+								   &cached))
+	{
+		/* errors have already been logged */
+		pgsql_finish(&pgsql);
+		return false;
+	}
+
+	if (cached)
+	{
+		/* the cache always contains the whole list of tables */
+		bool success = copydb_filter_source_catalogs(specs, &pgsql, tableArray);
+
+		pgsql_finish(&pgsql);
+		return success;
+	}
+
+	if (!schema_list_ordinary_tables(&pgsql, tableArray))
+	{
+		/* errors have already been logged */
+		pgsql_finish(&pgsql);
+		return false;
+	}
+
+	log_info("Fetched information for %d tables", tableArray->count);
+
+	/* list all the indexes at once, in the same snapshot as the tables */
+	if (needIndexes)
+	{
+		if (!copydb_fetch_source_indexes(specs, &pgsql))
+		{
+			/* errors have already been logged */
+			pgsql_finish(&pgsql);
+			return false;
+		}
+	}
+
+	if (needForeignKeys)
+	{
+		if (!copydb_fetch_source_foreign_keys(specs, &pgsql))
+		{
+			/* errors have already been logged */
+			pgsql_finish(&pgsql);
+			return false;
+		}
+	}
+
+	/* failing to write the cache only means the next run queries again */
+	(void) copydb_catalog_write_cache(specs,
+									  tableArray,
+									  needIndexes,
+									  needForeignKeys);
+
+	/* apply --include-table and the other filters, and --table-sample */
+	bool success = copydb_filter_source_catalogs(specs, &pgsql, tableArray);
+
+	/* close the read-only transaction and the connection, if any */
+	pgsql_finish(&pgsql);
+
+	return success;
+}
+
+
+/*
+ * copydb_abort_table_data closes the queues so that the workers that are
+ * already running exit, then terminates them, and releases the queues.
+ */
+static void
+copydb_abort_table_data(CopyDataSpec *specs,
+						TableDataProcessArray *tableProcessArray)
+{
+	(void) copydb_index_queue_close(specs->indexQueue);
+	(void) copydb_vacuum_queue_close(specs->vacuumQueue);
+	(void) copydb_progress_close(specs);
+	(void) copydb_fatal_exit(tableProcessArray);
+	(void) copydb_table_queue_finish(specs);
+	(void) copydb_index_queue_finish(specs);
+	(void) copydb_vacuum_queue_finish(specs);
+	(void) copydb_throttle_finish(specs);
+	(void) copydb_memory_budget_finish(specs);
+	(void) copydb_progress_finish(specs);
+}
+
+
+/*
+ * copydb_check_copy_format checks that COPY binary format can be used between
+ * the source and the target databases. The binary format of a data type is
+ * only guaranteed to be the same when using the same Postgres major version
+ * on both sides, so we refuse to use it otherwise.
+ *
+ * Some data types are not supported at all in the binary format (no send or
+ * receive function), and the binary format for arrays and composite types
+ * embeds the OIDs of the element types, which are not the same on the target
+ * for user-defined types. Tables with such columns are copied using the text
+ * format, see the binary_unsafe column in schema_list_ordinary_tables().
+ */
+bool
+copydb_check_copy_format(CopyDataSpec *specs)
+{
+	PGSQL src = { 0 };
+	PGSQL dst = { 0 };
+
+	int srcVersion = 0;
+	int dstVersion = 0;
+
+	if (!pgsql_init(&src, specs->source_pguri, PGSQL_CONN_SOURCE) ||
+		!pgsql_server_version_num(&src, &srcVersion))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET) ||
+		!pgsql_server_version_num(&dst, &dstVersion))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* before Postgres 10 the major version is made of two numbers */
+	int srcMajor = srcVersion >= 100000 ? srcVersion / 10000 : srcVersion / 100;
+	int dstMajor = dstVersion >= 100000 ? dstVersion / 10000 : dstVersion / 100;
+
+	if (srcMajor != dstMajor)
+	{
+		log_error("Failed to use --copy-format binary: source server version "
+				  "is %d and target server version is %d, "
+				  "COPY binary format requires the same major version",
+				  srcVersion,
+				  dstVersion);
+		return false;
+	}
+
+	log_info("Using COPY binary format, source and target server versions "
+			 "are %d and %d",
+			 srcVersion,
+			 dstVersion);
+
+	return true;
+}
+
+
+/*
+ * copydb_copy_all_sequences fetches the list of sequences from the source
+ * database, then fetches their last_value and is_called in a single query on
+ * the source database, and calls setval() on the target database with the
+ * same values in a single statement, see schema_get_all_sequence_values() and
+ * schema_set_all_sequence_values().
+ *
+ * When the batched setval() fails, we retry each sequence in turn so that one
+ * failing sequence does not prevent the other ones from being reset.
+ */
+bool
+copydb_copy_all_sequences(CopyDataSpec *specs)
+{
+	PGSQL src = { 0 };
+
+	/* initialize our connection object, connection is opened lazily */
+	if (!pgsql_init(&src, specs->source_pguri, PGSQL_CONN_SOURCE))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	SourceSequenceArray sequenceArray = { 0, NULL };
+	bool cached = false;
+
+	if (copydb_catalog_fingerprint(specs, &src) &&
+		!copydb_catalog_read_sequences_cache(specs, &sequenceArray, &cached))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!cached)
+	{
+		log_info("Listing sequences in \"%s\"", specs->source_pguri);
+
+		if (!schema_list_sequences(&src, &sequenceArray))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		log_info("Fetched information for %d sequences", sequenceArray.count);
+
+		(void) copydb_catalog_write_sequences_cache(specs, &sequenceArray);
+	}
+
+	/* skip the sequences owned by the tables that the filters exclude */
+	if (!copydb_prepare_table_filters(specs, NULL))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	(void) copydb_filter_source_sequences(specs, &sequenceArray);
+
+	if (sequenceArray.count == 0)
+	{
+		return true;
+	}
+
+	if (!pgsql_begin(&src))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!schema_get_all_sequence_values(&src, &sequenceArray))
+	{
+		/* errors have already been logged */
+		(void) pgsql_rollback(&src);
+		return false;
+	}
+
+	if (!pgsql_commit(&src))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	return copydb_set_all_sequences(specs, &sequenceArray);
+}
+
+
+/*
+ * copydb_set_all_sequences calls setval() on the target database for the
+ * given sequences, which have been fetched from the source database either
+ * just now or by pgcopydb dump data.
+ */
+bool
+copydb_set_all_sequences(CopyDataSpec *specs, SourceSequenceArray *sequenceArray)
+{
+	PGSQL dst = { 0 };
+
+	if (sequenceArray->count == 0)
+	{
+		return true;
+	}
+
+	if (!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET) ||
+		!copydb_set_target_session(&(specs->bulkLoadProfile),
+								   BULK_LOAD_PHASE_ALL,
+								   &dst))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	int errors = 0;
+
+	for (int seqIndex = 0; seqIndex < sequenceArray->count; seqIndex++)
+	{
+		if (!sequenceArray->array[seqIndex].fetched)
+		{
+			/* a warning has already been logged */
+			++errors;
+		}
+	}
+
+	if (!pgsql_begin(&dst))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!schema_set_all_sequence_values(&dst, sequenceArray))
+	{
+		log_warn("Failed to set sequence values in a single statement, "
+				 "retrying one sequence at a time");
+
+		/* the transaction is now aborted, start a new one */
+		(void) pgsql_rollback(&dst);
+
+		if (!pgsql_begin(&dst))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		for (int seqIndex = 0; seqIndex < sequenceArray->count; seqIndex++)
+		{
+			SourceSequence *seq = &(sequenceArray->array[seqIndex]);
+
+			if (!seq->fetched)
+			{
+				continue;
+			}
+
+			/* use a savepoint so that one failure doesn't abort the others */
+			if (!pgsql_execute(&dst, "SAVEPOINT pgcopydb_setval"))
+			{
+				/* errors have already been logged */
+				(void) pgsql_rollback(&dst);
+				return false;
+			}
+
+			if (!schema_set_sequence_value(&dst, seq))
+			{
+				/* just skip this one */
+				log_warn("Failed to set sequence values for \"%s\".\"%s\"",
+						 seq->nspname,
+						 seq->relname);
+				++errors;
+
+				if (!pgsql_execute(&dst, "ROLLBACK TO SAVEPOINT pgcopydb_setval"))
+				{
+					/* errors have already been logged */
+					(void) pgsql_rollback(&dst);
+					return false;
+				}
+			}
+		}
+	}
+
+	if (!pgsql_commit(&dst))
+	{
+		/* errors have already been logged */
+		++errors;
+	}
+
+	return errors == 0;
+}
+
+
+/*
+ * copydb_fatal_exit sends a termination signal to all the subprocess and waits
+ * until all the known subprocess are finished, then returns true.
+ */
+bool
+copydb_fatal_exit(TableDataProcessArray *subProcessArray)
+{
+	log_fatal("Terminating all subprocesses");
+	return copydb_wait_for_subprocesses();
+}
+
+
+/*
+ * copydb_wait_for_subprocesses calls waitpid() until no child process is known
+ * running. It also fetches the return code of all the sub-processes, and
+ * returns true only when all the subprocesses have returned zero (success).
+ */
+bool
+copydb_wait_for_subprocesses()
+{
+	bool allReturnCodeAreZero = true;
+
+	log_debug("Waiting for sub-processes to finish");
+
+	for (;;)
+	{
+		int status;
+
+		/* ignore errors */
+		pid_t pid = waitpid(-1, &status, WNOHANG);
+
+		switch (pid)
+		{
+			case -1:
+			{
+				if (errno == ECHILD)
+				{
+					/* no more childrens */
+					return allReturnCodeAreZero;
+				}
+
+				log_flush();
+
+				pg_usleep(100 * 1000); /* 100 ms */
+				break;
+			}
+
+			case 0:
+			{
+				/*
+				 * We're using WNOHANG, 0 means there are no stopped or exited
+				 * children sleep for awhile and ask again later.
+				 */
+				log_flush();
+
+				pg_usleep(100 * 1000); /* 100 ms */
+				break;
+			}
+
+			default:
+			{
+				int returnCode = WEXITSTATUS(status);
+
+				if (returnCode == 0)
+				{
+					log_debug("Sub-processes exited with code %d", returnCode);
+				}
+				else
+				{
+					allReturnCodeAreZero = false;
+
+					log_error("Sub-processes exited with code %d", returnCode);
+				}
+			}
+		}
+	}
+
+	return allReturnCodeAreZero;
+}
+
+
+/*
+ * copydb_wait_for_processes waits until the given sub-processes are done, and
+ * returns true only when all of them have returned zero (success). The other
+ * sub-processes are left running.
+ */
+bool
+copydb_wait_for_processes(TableDataProcess *array, int count)
+{
+	bool allReturnCodeAreZero = true;
+
+	for (int i = 0; i < count; i++)
+	{
+		int status;
+		pid_t pid;
+
+		log_flush();
+
+		do {
+			pid = waitpid(array[i].pid, &status, 0);
+		} while (pid == -1 && errno == EINTR);
+
+		if (pid == -1)
+		{
+			log_error("Failed to wait for sub-process %d: %m", array[i].pid);
+			allReturnCodeAreZero = false;
+			continue;
+		}
+
+		int returnCode = WEXITSTATUS(status);
+
+		if (returnCode == 0)
+		{
+			log_debug("Sub-process %d exited with code %d", pid, returnCode);
+		}
+		else
+		{
+			allReturnCodeAreZero = false;
+
+			log_error("Sub-process %d exited with code %d", pid, returnCode);
+		}
+	}
+
+	return allReturnCodeAreZero;
+}
+
+
+/*
+ * copydb_copy_table implements the table worker activity to COPY the table's
+ * data from the source to the target, and then queue the table indexes for
+ * the index workers, which also create the constraints, and then the table
+ * for the vacuum workers.
+ *
+ * The src and dst connections are owned by the table worker, and are kept
+ * open from one table to the next. The source connection imports the main
+ * process snapshot when it's opened, so all the tables that a worker copies
+ * are read in the same transaction.
+ */
+bool
+copydb_copy_table(CopyTableDataSpec *tableSpecs, PGSQL *src, PGSQL *dst)
+{
+	char qname[BUFSIZE] = { 0 };
+
+	sformat(qname, sizeof(qname), "\"%s\".\"%s\"",
+			tableSpecs->sourceTable->nspname,
+			tableSpecs->sourceTable->relname);
+
+	CopyTableDataPartSpec *part = &(tableSpecs->part);
+	TablePartFilePaths partPaths = { 0 };
+
+	(void) copydb_part_file_paths(tableSpecs, &partPaths);
+
+	/* with --resume, the doneFile tells us the COPY is done already */
+	if (tableSpecs->resume && file_exists(partPaths.doneFile))
+	{
+		log_info("Skipping COPY of table %s part %d/%d, "
+				 "done in a previous run",
+				 qname,
+				 part->partNumber + 1,
+				 part->partCount);
+	}
+	else if (!copydb_copy_table_data(tableSpecs, src, dst, qname))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/*
+	 * When the table has been split, only the process that copies the last
+	 * part of the table (in time, not in the ctid range) goes on to create
+	 * the indexes and constraints, and run VACUUM.
+	 */
+	if (part->partCount > 1)
+	{
+		bool isLastPart = false;
+
+		if (!copydb_table_parts_are_all_done(tableSpecs, &isLastPart))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (!isLastPart)
+		{
+			log_debug("Done with part %d/%d of table %s, "
+					  "other parts are still being copied",
+					  part->partNumber + 1,
+					  part->partCount,
+					  qname);
+			return true;
+		}
+
+		log_info("All %d parts of table %s have been copied",
+				 part->partCount,
+				 qname);
+	}
+
+	return copydb_queue_table_indexes(tableSpecs);
+}
+
+
+/*
+ * copydb_copy_table_data runs the COPY command for the table (or table part)
+ * and maintains the lockFile and doneFile of the table (or table part).
+ */
+static bool
+copydb_copy_table_data(CopyTableDataSpec *tableSpecs,
+					   PGSQL *src,
+					   PGSQL *dst,
+					   const char *qname)
+{
+	TablePartFilePaths partPaths = { 0 };
+
+	(void) copydb_part_file_paths(tableSpecs, &partPaths);
+
+	/* a table part, sample, or ordering, see copydb_prepare_copy_query() */
+	const char *copySource =
+		tableSpecs->copyQuery != NULL ? tableSpecs->copyQuery : qname;
+
+	const char *copyTarget =
+		tableSpecs->copyTarget != NULL ? tableSpecs->copyTarget : qname;
+
+	/* the lockFile command is informative, a long column list is skipped */
+	const char *commandSource =
+		strlen(copySource) < BUFSIZE / 2 ? copySource : qname;
+
+	/* First, write the lockFile, with a summary of what's going-on */
+	CopyTableSummary summary = {
+		.pid = getpid(),
+		.table = tableSpecs->sourceTable,
+	};
+
+	bool freeze = copydb_table_uses_freeze(tableSpecs);
+
+	if (tableSpecs->spoolMode == COPY_SPOOL_WRITE)
+	{
+		sformat(summary.command, sizeof(summary.command), "COPY %s TO '%s'%s;",
+				commandSource,
+				partPaths.spoolFile,
+				copydb_copy_options(tableSpecs, false));
+	}
+	else if (tableSpecs->spoolMode == COPY_SPOOL_READ)
+	{
+		sformat(summary.command, sizeof(summary.command), "COPY %s FROM '%s'%s;",
+				qname,
+				partPaths.spoolFile,
+				copydb_copy_options(tableSpecs, freeze));
+	}
+	else
+	{
+		sformat(summary.command, sizeof(summary.command), "COPY %s%s;",
+				commandSource,
+				copydb_copy_options(tableSpecs, freeze));
+	}
+
+	if (!open_table_summary(&summary, partPaths.lockFile))
+	{
+		log_info("Failed to create the lock file at \"%s\"", partPaths.lockFile);
+		return false;
+	}
+
+	/* pgcopydb dump data writes the COPY data to a file */
+	if (tableSpecs->spoolMode == COPY_SPOOL_WRITE)
+	{
+		log_info("%s", summary.command);
+
+		if (!copydb_spool_write_table_data(tableSpecs,
+										   src,
+										   copySource,
+										   &partPaths,
+										   &(summary.copyStats)))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	/* COPY the data from the source table to the target table */
+	else if (tableSpecs->section == DATA_SECTION_TABLE_DATA ||
+			 tableSpecs->section == DATA_SECTION_ALL)
+	{
+		/* Now copy the data from source to target */
+		log_info("%s", summary.command);
+
+		/* open the connections once, and keep them open across tables */
+		if (tableSpecs->spoolMode != COPY_SPOOL_READ &&
+			tableSpecs->relayAddress == NULL &&
+			!copydb_open_table_source(tableSpecs, src))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (dst->connection == NULL && !pgsql_open_persistent_connection(dst))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		/* --fanout-target: each extra target gets its own COPY transaction */
+		for (int i = 0; i < tableSpecs->fanoutCount; i++)
+		{
+			PGSQL *fanout = &(tableSpecs->fanout[i]);
+
+			if (fanout->connection == NULL &&
+				!pgsql_open_persistent_connection(fanout))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+
+			if (!pgsql_execute(fanout, "BEGIN"))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+		}
+
+		if (!copydb_begin_copy_freeze(tableSpecs, dst, qname, &freeze))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		/* COPY in a transaction whose xid we write down first */
+		if (!freeze && !pgsql_execute(dst, "BEGIN"))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (!copydb_write_copy_xid(tableSpecs, dst))
+		{
+			/* errors have already been logged */
+			(void) pgsql_execute(dst, "ROLLBACK");
+			return false;
+		}
+
+		CopyArgs args = {
+			.srcQname = copySource,
+			.dstQname = copyTarget,
+			.format = tableSpecs->copyFormat,
+			.freeze = freeze,
+			.bufferSize = tableSpecs->copyBufferSize,
+			.pipelineDepth = tableSpecs->copyPipelineDepth,
+			.keepConnections = true,
+			.fanout = tableSpecs->fanout,
+			.fanoutCount = tableSpecs->fanoutCount,
+			.throttle = &copydb_throttle_copy_data,
+			.throttleContext = tableSpecs->throttle,
+			.reserveMemory =
+				tableSpecs->memoryGrant == NULL
+				? NULL
+				: &copydb_memory_reserve_rows,
+			.releaseMemory =
+				tableSpecs->memoryGrant == NULL
+				? NULL
+				: &copydb_memory_release_rows,
+			.memoryContext = tableSpecs->memoryGrant,
+			.progress =
+				tableSpecs->progress == NULL
+				? NULL
+				: &(tableSpecs->progress->stats)
+		};
+
+		(void) copydb_progress_start_copy(tableSpecs, dst);
+
+		TraceEvent event = { 0 };
+
+		trace_begin(&event, "copy", "COPY %s.%s %d/%d",
+					tableSpecs->sourceTable->nspname,
+					tableSpecs->sourceTable->relname,
+					tableSpecs->part.partNumber + 1,
+					tableSpecs->part.partCount > 0
+					? tableSpecs->part.partCount
+					: 1);
+
+		bool copied = false;
+
+		/* pgcopydb restore data reads the COPY data from a file */
+		if (tableSpecs->spoolMode == COPY_SPOOL_READ)
+		{
+			copied = copydb_spool_read_table_data(tableSpecs, dst, &args,
+												  &partPaths,
+												  &(summary.copyStats));
+		}
+		else if (tableSpecs->relayAddress != NULL)
+		{
+			copied = copydb_relay_copy_table_data(tableSpecs, dst, &args,
+												  &(summary.copyStats));
+		}
+		else
+		{
+			copied = pg_copy(src, dst, &args, &(summary.copyStats));
+		}
 
-		/* okay now start the subprocess for this table */
-		CopyTableDataSpec *tableSpecs = &(tableSpecsArray->array[tableIndex]);
+		trace_end(&event);
+		(void) copydb_progress_done(tableSpecs);
 
-		if (!copydb_init_table_specs(tableSpecs, specs, source, process))
+		if (!copied)
 		{
 			/* errors have already been logged */
 			return false;
 		}
 
-		if (!copydb_start_table_data(tableSpecs))
+		/*
+		 * The main target first: when its COMMIT fails, the extra targets
+		 * transactions are rolled back when their connections are closed,
+		 * and none of the targets has the rows.
+		 */
+		if (!pgsql_execute(dst, "COMMIT"))
 		{
-			log_fatal("Failed to start a table data copy process for table "
-					  "\"%s\".\"%s\", see above for details",
-					  tableSpecs->sourceTable->nspname,
-					  tableSpecs->sourceTable->relname);
-
-			(void) copydb_fatal_exit(&tableProcessArray);
+			/* errors have already been logged */
 			return false;
 		}
 
-		log_debug("[%d] is processing table %d \"%s\".\"%s\" with oid %d",
-				  tableSpecs->process->pid,
-				  tableIndex,
-				  tableSpecs->sourceTable->nspname,
-				  tableSpecs->sourceTable->relname,
-				  tableSpecs->process->oid);
+		for (int i = 0; i < tableSpecs->fanoutCount; i++)
+		{
+			if (!pgsql_execute(&(tableSpecs->fanout[i]), "COMMIT"))
+			{
+				log_error("[FANOUT %d] Failed to commit table \"%s\".\"%s\" "
+						  "part %d/%d, which has been committed on the main "
+						  "target and on the %d previous fan-out targets",
+						  i + 1,
+						  tableSpecs->sourceTable->nspname,
+						  tableSpecs->sourceTable->relname,
+						  tableSpecs->part.partNumber + 1,
+						  tableSpecs->part.partCount > 0
+						  ? tableSpecs->part.partCount
+						  : 1,
+						  i);
+				return false;
+			}
+		}
 	}
 
-	/* now we have a unknown count of subprocesses still running */
-	bool success = copydb_wait_for_subprocesses();
+	/* now say we're done with the table data */
+	if (!finish_table_summary(&summary, partPaths.doneFile))
+	{
+		log_info("Failed to create the summary file at \"%s\"",
+				 partPaths.doneFile);
+		return false;
+	}
 
-	/*
-	 * Now that all the sub-processes are done, we can also unlink the index
-	 * concurrency semaphore.
-	 */
-	if (!semaphore_finish(&(specs->indexSemaphore)))
+	/* also remove the lockFile, we don't need it anymore */
+	if (!unlink_file(partPaths.lockFile))
 	{
-		log_warn("Failed to remove index concurrency semaphore %d, "
-				 "see above for details",
-				 specs->indexSemaphore.semId);
+		/* just continue, this is not a show-stopper */
+		log_warn("Failed to remove the lockFile \"%s\"", partPaths.lockFile);
 	}
 
-	return success;
+	(void) unlink_file(partPaths.xidFile);
+
+	return true;
 }
 
 
 /*
- * copydb_copy_all_sequences fetches the list of sequences from the source
- * database and then for each of them runs a SELECT last_value, is_called FROM
- * the sequence on the source database and then calls SELECT setval(); on the
- * target database with the same values.
+ * copydb_open_table_source opens the source connection of a table worker
+ * once, in the main process snapshot, and keeps it open across tables.
  */
 bool
-copydb_copy_all_sequences(CopyDataSpec *specs)
+copydb_open_table_source(CopyTableDataSpec *tableSpecs, PGSQL *src)
 {
-	PGSQL src = { 0 };
-	PGSQL dst = { 0 };
+	if (src->connection != NULL)
+	{
+		return true;
+	}
 
-	/* initialize our connection objects, connection is opened lazily */
-	if (!pgsql_init(&src, specs->source_pguri, PGSQL_CONN_SOURCE))
+	if (!copydb_set_snapshot(tableSpecs->sourceSnapshot, src))
 	{
 		/* errors have already been logged */
 		return false;
 	}
 
-	if (!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET))
+	/* when not using a snapshot, each COPY is its own transaction */
+	if (src->connection == NULL && !pgsql_open_persistent_connection(src))
 	{
 		/* errors have already been logged */
 		return false;
 	}
 
-	SourceSequenceArray sequenceArray = { 0, NULL };
+	return true;
+}
 
-	log_info("Listing sequences in \"%s\"", specs->source_pguri);
 
-	if (!schema_list_sequences(&src, &sequenceArray))
-	{
-		/* errors have already been logged */
-		return false;
-	}
+/*
+ * copydb_write_copy_xid writes the transaction id of the COPY transaction
+ * that is starting on the target connection to the part xidFile, before
+ * running the COPY itself. When a run is interrupted, the xidFile allows
+ * the next --resume run to ask the target server whether the part has been
+ * committed, see copydb_get_copy_status().
+ */
+static bool
+copydb_write_copy_xid(CopyTableDataSpec *tableSpecs, PGSQL *dst)
+{
+	TablePartFilePaths partPaths = { 0 };
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BIGINT, false };
 
-	log_info("Fetched information for %d sequences", sequenceArray.count);
+	(void) copydb_part_file_paths(tableSpecs, &partPaths);
 
-	if (!pgsql_begin(&src))
+	if (!pgsql_execute_with_params(dst, "select txid_current()",
+								   0, NULL, NULL,
+								   &context, &parseSingleValueResult) ||
+		!context.parsedOk)
 	{
-		/* errors have already been logged */
+		log_error("Failed to fetch the target transaction id");
 		return false;
 	}
 
-	if (!pgsql_begin(&dst))
+	char xid[BUFSIZE] = { 0 };
+
+	sformat(xid, sizeof(xid), "%llu\n", (unsigned long long) context.bigint);
+
+	if (!write_file(xid, strlen(xid), partPaths.xidFile))
 	{
 		/* errors have already been logged */
 		return false;
 	}
 
-	int errors = 0;
-
-	for (int seqIndex = 0; seqIndex < sequenceArray.count; seqIndex++)
-	{
-		SourceSequence *seq = &(sequenceArray.array[seqIndex]);
+	return true;
+}
 
-		char qname[BUFSIZE] = { 0 };
 
-		sformat(qname, sizeof(qname), "\"%s\".\"%s\"",
-				seq->nspname,
-				seq->relname);
+/*
+ * copydb_get_copy_status reads the xidFile of a part that was being copied
+ * when a previous run stopped, and asks the target server about the status
+ * of that transaction with txid_status(), which is available from Postgres
+ * 10 on. The status is one of "committed", "aborted", or "in progress", and
+ * "unknown" when we can't tell.
+ */
+static bool
+copydb_get_copy_status(TablePartFilePaths *partPaths,
+					   PGSQL *dst,
+					   char *status,
+					   size_t size)
+{
+	char *contents = NULL;
+	long fileSize = 0L;
 
-		if (!schema_get_sequence_value(&src, seq))
-		{
-			/* just skip this one */
-			log_warn("Failed to get sequence values for %s", qname);
-			++errors;
-			continue;
-		}
+	strlcpy(status, "unknown", size);
 
-		if (!schema_set_sequence_value(&dst, seq))
-		{
-			/* just skip this one */
-			log_warn("Failed to set sequence values for %s", qname);
-			++errors;
-			continue;
-		}
+	if (!file_exists(partPaths->xidFile))
+	{
+		return true;
 	}
 
-	if (!pgsql_commit(&dst))
+	if (!read_file(partPaths->xidFile, &contents, &fileSize))
 	{
 		/* errors have already been logged */
-		++errors;
+		return false;
 	}
 
-	if (!pgsql_commit(&src))
+	/* read_file allocates memory, and a NUL byte at the end */
+	char *newline = strchr(contents, '\n');
+
+	if (newline != NULL)
 	{
-		/* errors have already been logged */
+		*newline = '\0';
+	}
+
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+
+	char *sql = "select coalesce(txid_status($1::bigint), 'unknown')";
+
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { contents };
+
+	if (!pgsql_execute_with_params(dst, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult) ||
+		!context.parsedOk)
+	{
+		log_error("Failed to get the status of transaction %s", contents);
+		free(contents);
 		return false;
 	}
 
-	return errors == 0;
-}
+	strlcpy(status, context.strVal, size);
 
+	free(context.strVal);
+	free(contents);
 
-/*
- * copydb_fatal_exit sends a termination signal to all the subprocess and waits
- * until all the known subprocess are finished, then returns true.
- */
-bool
-copydb_fatal_exit(TableDataProcessArray *subProcessArray)
-{
-	log_fatal("Terminating all subprocesses");
-	return copydb_wait_for_subprocesses();
+	return true;
 }
 
 
 /*
- * copydb_wait_for_subprocesses calls waitpid() until no child process is known
- * running. It also fetches the return code of all the sub-processes, and
- * returns true only when all the subprocesses have returned zero (success).
+ * copydb_prepare_resume looks at the lockFile and doneFile of each table (and
+ * table part) as left behind by a previous run, when using --resume.
+ *
+ * A table part that has a lockFile without its doneFile was being copied
+ * when the previous run stopped. Each COPY runs in its own transaction, and
+ * the transaction id is written to the part xidFile before the COPY starts,
+ * so we can ask the target server whether that transaction committed: see
+ * copydb_resume_part(). Only the interrupted parts are then copied again,
+ * and there is nothing to delete on the target, as an aborted COPY leaves no
+ * rows behind.
+ *
+ * When we can't tell, the table might contain some of the rows of the
+ * interrupted part already: it is then truncated on the target database and
+ * all its parts are copied again. The table doneFile of split tables is
+ * removed so that the last part still queues the indexes.
  */
-bool
-copydb_wait_for_subprocesses()
+static bool
+copydb_prepare_resume(CopyDataSpec *specs)
 {
-	bool allReturnCodeAreZero = true;
+	CopyTableDataSpecsArray *tableSpecsArray = &(specs->tableSpecsArray);
 
-	log_debug("Waiting for sub-processes to finish");
+	PGSQL dst = { 0 };
+	int serverVersion = 0;
 
-	for (;;)
+	int doneCount = 0;
+	int resumedCount = 0;
+	int truncateCount = 0;
+
+	/* the index workers skip the indexes found in the journal */
+	if (!journal_load(&(specs->journal)))
 	{
-		int status;
+		/* errors have already been logged */
+		return false;
+	}
 
-		/* ignore errors */
-		pid_t pid = waitpid(-1, &status, WNOHANG);
+	if (!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET) ||
+		!pgsql_server_version_num(&dst, &serverVersion))
+	{
+		/* errors have already been logged */
+		return false;
+	}
 
-		switch (pid)
+	/* the parts of a split table are next to each other in the array */
+	for (int i = 0; i < tableSpecsArray->count; i++)
+	{
+		CopyTableDataSpec *tableSpecs = &(tableSpecsArray->array[i]);
+		int partCount = tableSpecs->part.partCount;
+
+		if (tableSpecs->part.partNumber != 0)
 		{
-			case -1:
+			continue;
+		}
+
+		bool truncate = false;
+		bool allDone = true;
+
+		for (int p = 0; p < partCount && (i + p) < tableSpecsArray->count; p++)
+		{
+			CopyTableDataSpec *partSpecs = &(tableSpecsArray->array[i + p]);
+			TablePartFilePaths partPaths = { 0 };
+
+			(void) copydb_part_file_paths(partSpecs, &partPaths);
+
+			if (!file_exists(partPaths.doneFile) &&
+				file_exists(partPaths.lockFile))
 			{
-				if (errno == ECHILD)
+				if (!copydb_resume_part(partSpecs, &dst, serverVersion,
+										&truncate))
 				{
-					/* no more childrens */
-					return true;
+					/* errors have already been logged */
+					return false;
 				}
 
-				pg_usleep(100 * 1000); /* 100 ms */
-				break;
+				++resumedCount;
 			}
 
-			case 0:
+			allDone = allDone && file_exists(partPaths.doneFile);
+		}
+
+		if (truncate)
+		{
+			char sql[BUFSIZE] = { 0 };
+
+			sformat(sql, sizeof(sql), "TRUNCATE ONLY \"%s\".\"%s\"",
+					tableSpecs->sourceTable->nspname,
+					tableSpecs->sourceTable->relname);
+
+			log_info("Table \"%s\".\"%s\" was being copied when the previous "
+					 "run stopped: %s;",
+					 tableSpecs->sourceTable->nspname,
+					 tableSpecs->sourceTable->relname,
+					 sql);
+
+			if (!pgsql_execute(&dst, sql))
 			{
-				/*
-				 * We're using WNOHANG, 0 means there are no stopped or exited
-				 * children sleep for awhile and ask again later.
-				 */
-				pg_usleep(100 * 1000); /* 100 ms */
-				break;
+				/* errors have already been logged */
+				return false;
 			}
 
-			default:
+			++truncateCount;
+		}
+		else if (allDone)
+		{
+			++doneCount;
+		}
+
+		for (int p = 0; p < partCount && (i + p) < tableSpecsArray->count; p++)
+		{
+			CopyTableDataSpec *partSpecs = &(tableSpecsArray->array[i + p]);
+			TablePartFilePaths partPaths = { 0 };
+
+			(void) copydb_part_file_paths(partSpecs, &partPaths);
+
+			if (truncate && !unlink_file(partPaths.doneFile))
 			{
-				int returnCode = WEXITSTATUS(status);
+				/* errors have already been logged */
+				return false;
+			}
 
-				if (returnCode == 0)
-				{
-					log_debug("Sub-processes exited with code %d", returnCode);
-				}
-				else
-				{
-					allReturnCodeAreZero = false;
+			/* the lockFile of a part that is done was left behind, fine */
+			if (!unlink_file(partPaths.lockFile) ||
+				!unlink_file(partPaths.xidFile))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+		}
 
-					log_error("Sub-processes exited with code %d", returnCode);
-				}
+		if (partCount > 1)
+		{
+			TableFilePaths tablePaths = { 0 };
+
+			(void) copydb_table_file_paths(tableSpecs, &tablePaths);
+
+			if (!unlink_file(tablePaths.doneFile))
+			{
+				/* errors have already been logged */
+				return false;
 			}
 		}
 	}
 
-	return allReturnCodeAreZero;
+	log_info("Resuming a previous run: %d tables have been copied already, "
+			 "%d parts were interrupted, %d tables are copied again",
+			 doneCount,
+			 resumedCount,
+			 truncateCount);
+
+	return true;
 }
 
 
 /*
- * waitUntilOneSubprocessIsDone waits until one of the subprocess (any one of
- * them) has created its doneFile, and returns the array index of that process.
- *
- * The subProcessArray entry that is found done is also cleaned-up.
+ * copydb_resume_part decides what to do with a table part that was being
+ * copied when the previous run stopped. When its COPY transaction has been
+ * committed, the part doneFile is created now from its lockFile. When the
+ * transaction has been aborted the part is going to be copied again. When
+ * we can't tell, truncate is set to true.
  */
-static int
-waitUntilOneSubprocessIsDone(TableDataProcessArray *subProcessArray)
+static bool
+copydb_resume_part(CopyTableDataSpec *tableSpecs,
+				   PGSQL *dst,
+				   int serverVersion,
+				   bool *truncate)
 {
-	for (;;)
+	CopyTableDataPartSpec *part = &(tableSpecs->part);
+	SourceTable *table = tableSpecs->sourceTable;
+	TablePartFilePaths partPaths = { 0 };
+
+	char status[NAMEDATALEN] = { 0 };
+
+	(void) copydb_part_file_paths(tableSpecs, &partPaths);
+
+	/* txid_status() appeared in Postgres 10 */
+	if (serverVersion < 100000)
+	{
+		*truncate = true;
+		return true;
+	}
+
+	if (!copydb_get_copy_status(&partPaths, dst, status, sizeof(status)))
 	{
-		/* don't block user's interrupt (C-c and the like) */
-		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (streq(status, "committed"))
+	{
+		/* read_table_summary writes into the SourceTable, use a copy */
+		SourceTable partTable = { 0 };
+		CopyTableSummary summary = { .table = &partTable };
+
+		if (!read_table_summary(&summary, partPaths.lockFile))
 		{
-			(void) copydb_fatal_exit(subProcessArray);
+			/* errors have already been logged */
 			return false;
 		}
 
-		/* probe each sub-process' doneFile */
-		for (int procIndex = 0; procIndex < subProcessArray->count; procIndex++)
-		{
-			/* when the subprocess pid is zero, we have found an entry */
-			if (subProcessArray->array[procIndex].pid == 0)
-			{
-				log_debug("waitUntilOneSubprocessIsDone: %d", procIndex);
-				return procIndex;
-			}
+		summary.table = table;
+		summary.doneTime = time(NULL);
+		summary.durationMs = (summary.doneTime - summary.startTime) * 1000;
 
-			/* when we have a doneFile, the process is done */
-			if (file_exists(subProcessArray->array[procIndex].doneFile))
-			{
-				log_debug("waitUntilOneSubprocessIsDone: found \"%s\"",
-						  subProcessArray->array[procIndex].doneFile);
+		log_info("Table \"%s\".\"%s\" part %d/%d has been copied "
+				 "by the previous run already",
+				 table->nspname,
+				 table->relname,
+				 part->partNumber + 1,
+				 part->partCount);
 
-				/* clean-up the array entry, stop tracking this PID */
-				subProcessArray->array[procIndex].pid = 0;
+		return write_table_summary(&summary, partPaths.doneFile);
+	}
+	else if (streq(status, "aborted"))
+	{
+		log_info("Table \"%s\".\"%s\" part %d/%d was interrupted, "
+				 "it is going to be copied again",
+				 table->nspname,
+				 table->relname,
+				 part->partNumber + 1,
+				 part->partCount);
 
-				/* now we have a slot to process the current table */
-				log_debug("waitUntilOneSubprocessIsDone: %d", procIndex);
-				return procIndex;
-			}
-		}
+		return true;
+	}
+	else if (streq(status, "in progress"))
+	{
+		log_error("Table \"%s\".\"%s\" part %d/%d is still being copied "
+				  "by the previous run on the target server, "
+				  "please try again later",
+				  table->nspname,
+				  table->relname,
+				  part->partNumber + 1,
+				  part->partCount);
 
-		/*
-		 * If all subprocesses are still running, wait for a little
-		 * while and then check again. The check being cheap enough
-		 * (it's just an access(2) system call), we sleep for 150ms
-		 * only.
-		 */
-		pg_usleep(150 * 1000);
+		return false;
 	}
+
+	*truncate = true;
+
+	return true;
 }
 
 
 /*
- * copydb_start_table_data forks a sub-process that handles the table data
- * copying, using pg_dump | pg_restore for a specific given table.
+ * copydb_table_uses_freeze returns true when the table is to be copied with
+ * COPY FREEZE. The parts of a split table are copied concurrently by
+ * different processes, and COPY FREEZE requires the table to have been
+ * created or truncated in the same transaction, so we only use it for tables
+ * that are copied in a single part.
  */
 bool
-copydb_start_table_data(CopyTableDataSpec *tableSpecs)
+copydb_table_uses_freeze(CopyTableDataSpec *tableSpecs)
 {
-	/* first prepare the status and summary files paths and contents */
-	SourceTable *source = tableSpecs->sourceTable;
-	TableDataProcess *process = tableSpecs->process;
+	return tableSpecs->copyFreeze && tableSpecs->part.partCount <= 1;
+}
 
-	process->oid = source->oid;
 
-	sformat(process->lockFile, sizeof(process->lockFile),
-			"%s/%d", tableSpecs->cfPaths->rundir, process->oid);
+/*
+ * copydb_copy_options returns the WITH clause of the COPY command that we use
+ * on the target table, as shown in the logs and the summary files.
+ */
+char *
+copydb_copy_options(CopyTableDataSpec *tableSpecs, bool freeze)
+{
+	if (tableSpecs->copyFormat == COPY_FORMAT_BINARY)
+	{
+		return freeze ? " WITH (FORMAT binary, FREEZE)" : " WITH (FORMAT binary)";
+	}
+
+	return freeze ? " WITH (FREEZE)" : "";
+}
 
-	sformat(process->doneFile, sizeof(process->doneFile),
-			"%s/%d.done", tableSpecs->cfPaths->tbldir, process->oid);
 
-	/* Flush stdio channels just before fork, to avoid double-output problems */
-	fflush(stdout);
-	fflush(stderr);
+/*
+ * copydb_begin_copy_freeze opens a transaction on the target connection and
+ * truncates the target table, so that the COPY command that follows in the
+ * same transaction may use the FREEZE option: the rows are then loaded
+ * already frozen and the VACUUM that follows has almost nothing to do. With
+ * wal_level minimal, Postgres also skips writing WAL for the new data.
+ *
+ * When the TRUNCATE fails, for instance because the table is referenced by a
+ * foreign key already, we roll back and copy the table without FREEZE.
+ *
+ * The caller must COMMIT when freeze has been set to true.
+ */
+bool
+copydb_begin_copy_freeze(CopyTableDataSpec *tableSpecs,
+						 PGSQL *dst,
+						 const char *qname,
+						 bool *freeze)
+{
+	*freeze = false;
 
-	/* time to create the node_active sub-process */
-	int fpid = fork();
+	if (!copydb_table_uses_freeze(tableSpecs))
+	{
+		return true;
+	}
 
-	switch (fpid)
+	if (!pgsql_execute(dst, "BEGIN"))
 	{
-		case -1:
-		{
-			log_error("Failed to fork a process for copying table data for "
-					  "\"%s\".\"%s\"",
-					  tableSpecs->sourceTable->nspname,
-					  tableSpecs->sourceTable->relname);
-			return -1;
-		}
+		/* errors have already been logged */
+		return false;
+	}
 
-		case 0:
-		{
-			/* child process runs the command */
-			if (!copydb_copy_table(tableSpecs))
-			{
-				/* errors have already been logged */
-				exit(EXIT_CODE_INTERNAL_ERROR);
-			}
+	char sql[BUFSIZE] = { 0 };
 
-			exit(EXIT_CODE_QUIT);
-		}
+	sformat(sql, sizeof(sql), "TRUNCATE ONLY %s", qname);
 
-		default:
-		{
-			/* fork succeeded, in parent */
-			tableSpecs->process->pid = fpid;
+	if (!pgsql_execute(dst, sql))
+	{
+		log_warn("Failed to TRUNCATE table %s, copying it without FREEZE",
+				 qname);
 
-			return true;
-		}
+		return pgsql_execute(dst, "ROLLBACK");
 	}
+
+	*freeze = true;
+
+	return true;
 }
 
 
 /*
- * copydb_copy_table implements the sub-process activity to pg_dump |
- * pg_restore the table's data and then create the indexes and the constraints
- * in parallel.
+ * copydb_table_parts_are_all_done checks whether all the parts of a split
+ * table have been copied already. When that's the case, the calling process
+ * might be the last one to have finished copying its part, or another process
+ * might be finishing at the same time.
+ *
+ * To decide which process goes on with creating the indexes for the table,
+ * and then the constraints and VACUUM, we create the table doneFile with
+ * O_EXCL: only one process can succeed, and that one is the last part.
+ *
+ * The table doneFile then contains a summary for the whole table, using the
+ * cumulative durations of all the parts.
  */
 bool
-copydb_copy_table(CopyTableDataSpec *tableSpecs)
+copydb_table_parts_are_all_done(CopyTableDataSpec *tableSpecs, bool *isLastPart)
 {
-	PGSQL src = { 0 };
-	PGSQL dst = { 0 };
-
-	char qname[BUFSIZE] = { 0 };
+	CopyTableDataPartSpec *part = &(tableSpecs->part);
+	SourceTable *table = tableSpecs->sourceTable;
+	TableFilePaths tablePaths = { 0 };
 
-	sformat(qname, sizeof(qname), "\"%s\".\"%s\"",
-			tableSpecs->sourceTable->nspname,
-			tableSpecs->sourceTable->relname);
+	(void) copydb_table_file_paths(tableSpecs, &tablePaths);
 
-	/* First, write the lockFile, with a summary of what's going-on */
-	CopyTableSummary summary = {
+	CopyTableSummary tableSummary = {
 		.pid = getpid(),
-		.table = tableSpecs->sourceTable,
+		.table = table,
+		.startTime = 0,
+		.doneTime = 0,
+		.durationMs = 0
 	};
 
-	sformat(summary.command, sizeof(summary.command), "COPY %s;", qname);
-
-	if (!open_table_summary(&summary, tableSpecs->process->lockFile))
-	{
-		log_info("Failed to create the lock file at \"%s\"",
-				 tableSpecs->process->lockFile);
-		return false;
-	}
-
-	/* initialize our connection objects, connection is opened lazily */
-	if (!pgsql_init(&src, tableSpecs->source_pguri, PGSQL_CONN_SOURCE))
-	{
-		/* errors have already been logged */
-		return false;
-	}
+	*isLastPart = false;
 
-	if (!pgsql_init(&dst, tableSpecs->target_pguri, PGSQL_CONN_TARGET))
+	for (int partNumber = 0; partNumber < part->partCount; partNumber++)
 	{
-		/* errors have already been logged */
-		return false;
-	}
+		char partDoneFile[MAXPGPATH] = { 0 };
 
-	/* COPY the data from the source table to the target table */
-	if (tableSpecs->section == DATA_SECTION_TABLE_DATA ||
-		tableSpecs->section == DATA_SECTION_ALL)
-	{
-		/* Now copy the data from source to target */
-		log_info("%s", summary.command);
+		sformat(partDoneFile, sizeof(partDoneFile), "%s/%u.%d.done",
+				tableSpecs->cfPaths->tbldir,
+				table->oid,
+				partNumber);
 
-		if (!pg_copy(&src, &dst, qname, qname))
+		if (!file_exists(partDoneFile))
 		{
-			/* errors have already been logged */
-			return false;
+			/* another part is still being copied */
+			return true;
 		}
-	}
-
-	/* now say we're done with the table data */
-	if (!finish_table_summary(&summary, tableSpecs->process->doneFile))
-	{
-		log_info("Failed to create the summary file at \"%s\"",
-				 tableSpecs->process->doneFile);
-		return false;
-	}
-
-	/* also remove the lockFile, we don't need it anymore */
-	if (!unlink_file(tableSpecs->process->lockFile))
-	{
-		/* just continue, this is not a show-stopper */
-		log_warn("Failed to remove the lockFile \"%s\"",
-				 tableSpecs->process->lockFile);
-	}
 
-	/* then fetch the index list for this table */
-	SourceIndexArray indexArray = { 0 };
+		/* read_table_summary writes into the SourceTable, use a copy */
+		SourceTable partTable = { 0 };
+		CopyTableSummary partSummary = { .table = &partTable };
 
-	tableSpecs->indexArray = &indexArray;
-
-	if (tableSpecs->section == DATA_SECTION_INDEXES ||
-		tableSpecs->section == DATA_SECTION_CONSTRAINTS ||
-		tableSpecs->section == DATA_SECTION_ALL)
-	{
-		if (!schema_list_table_indexes(&src,
-									   tableSpecs->sourceTable->nspname,
-									   tableSpecs->sourceTable->relname,
-									   tableSpecs->indexArray))
+		if (!read_table_summary(&partSummary, partDoneFile))
 		{
 			/* errors have already been logged */
 			return false;
 		}
 
-		/* build the index file paths we need for the upcoming operations */
-		if (!copydb_init_indexes_paths(tableSpecs))
+		if (tableSummary.startTime == 0 ||
+			partSummary.startTime < tableSummary.startTime)
 		{
-			/* errors have already been logged */
-			return false;
+			tableSummary.startTime = partSummary.startTime;
 		}
 
-		/* pgcopydb copy constraints does not create indexes again */
-		if (tableSpecs->section != DATA_SECTION_CONSTRAINTS)
+		if (partSummary.doneTime > tableSummary.doneTime)
 		{
-			/*
-			 * Indexes are created all-at-once in parallel, a sub-process is
-			 * forked per index definition to send each SQL/DDL command to the
-			 * Postgres server.
-			 */
-			if (tableSpecs->indexArray->count >= 1)
-			{
-				log_info("Creating %d index%s for table \"%s\".\"%s\"",
-						 tableSpecs->indexArray->count,
-						 tableSpecs->indexArray->count > 1 ? "es" : "",
-						 tableSpecs->sourceTable->nspname,
-						 tableSpecs->sourceTable->relname);
-			}
-			else
-			{
-				log_debug("Table \"%s\".\"%s\" has no index attached",
-						  tableSpecs->sourceTable->nspname,
-						  tableSpecs->sourceTable->relname);
-			}
+			tableSummary.doneTime = partSummary.doneTime;
+		}
 
-			if (!copydb_start_create_indexes(tableSpecs))
-			{
-				log_error("Failed to create indexes, see above for details");
-				return false;
-			}
+		tableSummary.durationMs += partSummary.durationMs;
+
+		/* parts copied by different runs don't have a common marker */
+		if (partNumber == 0)
+		{
+			strlcpy(tableSummary.changeMarker,
+					partSummary.changeMarker,
+					sizeof(tableSummary.changeMarker));
+		}
+		else if (!streq(tableSummary.changeMarker, partSummary.changeMarker))
+		{
+			tableSummary.changeMarker[0] = '\0';
 		}
 
-		/*
-		 * Create an index list file for the table, so that we can easily find
-		 * relevant indexing information from the table itself.
-		 */
-		if (!create_table_index_file(&summary,
-									 tableSpecs->indexArray,
-									 tableSpecs->tablePaths.idxListFile))
+		tableSummary.copyStats.rows += partSummary.copyStats.rows;
+		tableSummary.copyStats.bytes += partSummary.copyStats.bytes;
+		tableSummary.copyStats.flushes += partSummary.copyStats.flushes;
+		tableSummary.copyStats.srcWaitUs += partSummary.copyStats.srcWaitUs;
+		tableSummary.copyStats.dstWaitUs += partSummary.copyStats.dstWaitUs;
+
+		if (partSummary.copyStats.peakBufferSize >
+			tableSummary.copyStats.peakBufferSize)
 		{
-			/* this only means summary is missing some indexing information */
-			log_warn("Failed to create table %s index list file \"%s\"",
-					 qname,
-					 tableSpecs->tablePaths.idxListFile);
+			tableSummary.copyStats.peakBufferSize =
+				partSummary.copyStats.peakBufferSize;
 		}
 	}
 
-	/*
-	 * Once all the indexes have been created in parallel, then we can create
-	 * the constraints that are associated with the indexes. The ALTER TABLE
-	 * commands are taking an exclusive lock on the table, so it's better to
-	 * just run the commands serially (one after the other).
-	 */
-	if (tableSpecs->section == DATA_SECTION_CONSTRAINTS ||
-		tableSpecs->section == DATA_SECTION_ALL)
+	/* all the parts are done: now race to create the table doneFile */
+	int fd = open(tablePaths.doneFile,
+				  O_WRONLY | O_CREAT | O_EXCL,
+				  0644);
+
+	if (fd == -1)
 	{
-		if (!copydb_create_constraints(tableSpecs))
+		if (errno == EEXIST)
 		{
-			log_error("Failed to create constraints, see above for details");
-			return false;
+			/* another process is done with its part at the same time */
+			return true;
 		}
+
+		log_error("Failed to create the summary file at \"%s\": %m",
+				  tablePaths.doneFile);
+		return false;
 	}
 
-	/* finally, vacuum analyze the table and its indexes */
-	if (tableSpecs->section == DATA_SECTION_VACUUM ||
-		tableSpecs->section == DATA_SECTION_ALL)
-	{
-		char vacuum[BUFSIZE] = { 0 };
+	close(fd);
 
-		sformat(vacuum, sizeof(vacuum), "VACUUM ANALYZE %s", qname);
+	*isLastPart = true;
 
-		log_info("%s;", vacuum);
+	sformat(tableSummary.command, sizeof(tableSummary.command),
+			"COPY \"%s\".\"%s\"; -- in %d parts",
+			table->nspname,
+			table->relname,
+			part->partCount);
 
-		if (!pgsql_execute(&dst, vacuum))
-		{
-			/* errors have already been logged */
-			return false;
-		}
+	if (!write_table_summary(&tableSummary, tablePaths.doneFile))
+	{
+		log_error("Failed to create the summary file at \"%s\"",
+				  tablePaths.doneFile);
+		return false;
 	}
 
-	/* now we're done */
 	return true;
 }
 
 
 /*
- * copydb_start_create_indexes creates all the indexes for a given table in
- * parallel, using a sub-process to send each index command.
+ * copydb_create_index creates the given index of a table, using the dst
+ * connection of the calling index worker. When a memory grant is given, the
+ * CREATE INDEX command runs with the granted maintenance_work_mem and
+ * max_parallel_maintenance_workers, which are then reset.
  */
 bool
-copydb_start_create_indexes(CopyTableDataSpec *tableSpecs)
+copydb_create_index(CopyTableDataSpec *tableSpecs, int idx, PGSQL *dst,
+					IndexMemoryGrant *grant)
 {
-	/* At the moment we disregard the jobs limitation */
-	int jobs = tableSpecs->indexJobs;
+	IndexFilePaths *indexPaths = &(tableSpecs->indexPathsArray.array[idx]);
+	SourceIndexArray *indexArray = tableSpecs->indexArray;
+	SourceIndex *index = &(indexArray->array[idx]);
+
+	/* First, write the lockFile, with a summary of what's going-on */
+	CopyIndexSummary summary = {
+		.pid = getpid(),
+		.index = index,
+		.command = { 0 }
+	};
 
-	(void) jobs;                /* TODO */
+	/* with --resume, skip the indexes that a previous run has built */
+	if (tableSpecs->resume &&
+		journal_lookup(tableSpecs->journal, index->indexOid) != NULL)
+	{
+		log_info("Skipping index \"%s\".\"%s\", done in a previous run",
+				 index->indexNamespace,
+				 index->indexRelname);
+		return true;
+	}
 
-	SourceTable *sourceTable = tableSpecs->sourceTable;
-	SourceIndexArray *indexArray = tableSpecs->indexArray;
+	/* index definitions are not limited in size, the summary command is */
+	PQExpBuffer command = createPQExpBuffer();
 
-	for (int i = 0; i < indexArray->count; i++)
+	if (!copydb_prepare_index_command(tableSpecs, index, command))
 	{
-		/*
-		 * Fork a sub-process for each index, so that they're created in
-		 * parallel. Flush stdio channels just before fork, to avoid
-		 * double-output problems.
-		 */
-		fflush(stdout);
-		fflush(stderr);
+		/* errors have already been logged */
+		destroyPQExpBuffer(command);
+		return false;
+	}
 
-		/* time to create the node_active sub-process */
-		int fpid = fork();
+	strlcpy(summary.command, command->data, sizeof(summary.command));
 
-		switch (fpid)
-		{
-			case -1:
-			{
-				log_error("Failed to fork a process for creating index for "
-						  "table \"%s\".\"%s\"",
-						  sourceTable->nspname,
-						  sourceTable->relname);
-				return -1;
-			}
+	/* the lockFile is only part of the --state-files layout */
+	char *lockFile =
+		IS_EMPTY_STRING_BUFFER(tableSpecs->journal->exportDir)
+		? NULL
+		: indexPaths->lockFile;
 
-			case 0:
-			{
-				/* child process runs the command */
-				if (!copydb_create_index(tableSpecs, i))
-				{
-					/* errors have already been logged */
-					exit(EXIT_CODE_INTERNAL_ERROR);
-				}
+	if (!open_index_summary(&summary, lockFile))
+	{
+		log_info("Failed to create the lock file at \"%s\"",
+				 indexPaths->lockFile);
+		destroyPQExpBuffer(command);
+		return false;
+	}
 
-				exit(EXIT_CODE_QUIT);
-			}
+	(void) copydb_progress_start_index(tableSpecs, index, dst);
 
-			default:
-			{
-				/* fork succeeded, in parent */
-				break;
-			}
-		}
+	TraceEvent event = { 0 };
+
+	trace_begin(&event, "index", "CREATE INDEX %s.%s",
+				index->indexNamespace,
+				index->indexRelname);
+
+	bool success = copydb_run_index_command(dst, command->data, grant);
+
+	trace_end(&event);
+	(void) copydb_progress_done(tableSpecs);
+
+	if (!success)
+	{
+		/* errors have already been logged */
+		destroyPQExpBuffer(command);
+		return false;
 	}
 
-	return copydb_wait_for_subprocesses();
+	(void) finish_index_summary(&summary, NULL);
+
+	/* register the index in the journal, with its full command */
+	JournalEntry entry = {
+		.oid = index->indexOid,
+		.kind = JOURNAL_RECORD_INDEX,
+		.pid = summary.pid,
+		.startTime = summary.startTime,
+		.doneTime = summary.doneTime,
+		.durationMs = summary.durationMs,
+		.nspname = index->indexNamespace,
+		.relname = index->indexRelname,
+		.command = command->data
+	};
+
+	success = journal_append(tableSpecs->journal, &entry);
+
+	destroyPQExpBuffer(command);
+
+	if (!success)
+	{
+		log_error("Failed to register index \"%s\".\"%s\" in the journal",
+				  index->indexNamespace,
+				  index->indexRelname);
+		return false;
+	}
+
+	/* also remove the lockFile, we don't need it anymore */
+	if (lockFile != NULL && !unlink_file(lockFile))
+	{
+		/* just continue, this is not a show-stopper */
+		log_warn("Failed to remove the lockFile \"%s\"", lockFile);
+	}
+
+	return true;
 }
 
 
 /*
- * copydb_create_indexes creates all the indexes for a given table in
- * parallel, using a sub-process to send each index command.
+ * copydb_prepare_index_command prepares the CREATE INDEX command for the
+ * given index, adding IF NOT EXISTS when the index might exist already.
  */
-bool
-copydb_create_index(CopyTableDataSpec *tableSpecs, int idx)
+static bool
+copydb_prepare_index_command(CopyTableDataSpec *tableSpecs,
+							 SourceIndex *index,
+							 PQExpBuffer command)
 {
-	IndexFilePaths *indexPaths = &(tableSpecs->indexPathsArray.array[idx]);
-	SourceIndexArray *indexArray = tableSpecs->indexArray;
-	SourceIndex *index = &(indexArray->array[idx]);
-
-	const char *pguri = tableSpecs->target_pguri;
-	PGSQL pgconn = { 0 };
-
-	/* First, write the lockFile, with a summary of what's going-on */
-	CopyIndexSummary summary = {
-		.pid = getpid(),
-		.index = index,
-		.command = { 0 }
-	};
-
-	/* prepare the CREATE INDEX command, adding IF NOT EXISTS */
-	if (tableSpecs->section == DATA_SECTION_INDEXES)
+	if (tableSpecs->section == DATA_SECTION_INDEXES || tableSpecs->resume)
 	{
 		int ci_len = strlen("CREATE INDEX ");
 		int cu_len = strlen("CREATE UNIQUE INDEX ");
 
 		if (strncmp(index->indexDef, "CREATE INDEX ", ci_len) == 0)
 		{
-			sformat(summary.command, sizeof(summary.command),
-					"CREATE INDEX IF NOT EXISTS %s;",
-					index->indexDef + ci_len);
+			appendPQExpBuffer(command,
+							  "CREATE INDEX IF NOT EXISTS %s;",
+							  index->indexDef + ci_len);
 		}
 		else if (strncmp(index->indexDef, "CREATE UNIQUE INDEX ", cu_len) == 0)
 		{
-			sformat(summary.command, sizeof(summary.command),
-					"CREATE UNIQUE INDEX IF NOT EXISTS %s;",
-					index->indexDef + cu_len);
+			appendPQExpBuffer(command,
+							  "CREATE UNIQUE INDEX IF NOT EXISTS %s;",
+							  index->indexDef + cu_len);
 		}
 		else
 		{
@@ -1238,87 +3564,148 @@ copydb_create_index(CopyTableDataSpec *tableSpecs, int idx)
 		 * Just use the pg_get_indexdef() command, with an added semi-colon for
 		 * logging clarity.
 		 */
-		sformat(summary.command, sizeof(summary.command),
-				"%s;",
-				index->indexDef);
+		appendPQExpBuffer(command, "%s;", index->indexDef);
 	}
 
-	if (!open_index_summary(&summary, indexPaths->lockFile))
+	/* memory allocation could have failed while building string */
+	if (PQExpBufferBroken(command))
 	{
-		log_info("Failed to create the lock file at \"%s\"",
-				 indexPaths->lockFile);
+		log_error("Failed to prepare the CREATE INDEX command: out of memory");
 		return false;
 	}
 
-	/* now grab an index semaphore lock */
-	(void) semaphore_lock(tableSpecs->indexSemaphore);
+	return true;
+}
 
-	if (!pgsql_init(&pgconn, (char *) pguri, PGSQL_CONN_TARGET))
-	{
-		/* errors have already been logged */
-		exit(EXIT_CODE_TARGET);
-	}
 
-	log_info("%s", summary.command);
+/*
+ * copydb_run_index_command runs the given CREATE INDEX command on the dst
+ * connection, within the given memory grant if any.
+ */
+static bool
+copydb_run_index_command(PGSQL *dst, const char *command,
+						 IndexMemoryGrant *grant)
+{
+	bool useGrant = grant != NULL && grant->maintenanceWorkMem > 0;
+
+	/* max_parallel_maintenance_workers appeared in Postgres 11 */
+	bool parallelWorkers = false;
 
-	if (!pgsql_execute(&pgconn, summary.command))
+	if (useGrant)
 	{
-		/* errors have already been logged */
-		(void) semaphore_unlock(tableSpecs->indexSemaphore);
-		exit(EXIT_CODE_TARGET);
-	}
+		if (dst->connection == NULL && !pgsql_open_persistent_connection(dst))
+		{
+			/* errors have already been logged */
+			return false;
+		}
 
-	/* the CREATE INDEX command is done, release our lock */
-	(void) semaphore_unlock(tableSpecs->indexSemaphore);
+		parallelWorkers = PQserverVersion(dst->connection) >= 110000;
 
-	/* create the doneFile for the index */
-	if (!finish_index_summary(&summary, indexPaths->doneFile))
-	{
-		log_info("Failed to create the summary file at \"%s\"",
-				 indexPaths->doneFile);
-		return false;
+		char sql[BUFSIZE] = { 0 };
+
+		char workers[BUFSIZE] = { 0 };
+
+		sformat(sql, sizeof(sql),
+				"SET maintenance_work_mem TO '%lldkB'",
+				(long long) (grant->maintenanceWorkMem / 1024));
+
+		sformat(workers, sizeof(workers),
+				"SET max_parallel_maintenance_workers TO %d",
+				grant->parallelWorkers);
+
+		const char *settings[] = { sql, workers };
+
+		if (!pgsql_execute_batch(dst, settings, parallelWorkers ? 2 : 1))
+		{
+			/* errors have already been logged */
+			return false;
+		}
 	}
 
-	/* also remove the lockFile, we don't need it anymore */
-	if (!unlink_file(indexPaths->lockFile))
+	log_info("%s", command);
+
+	bool success = pgsql_execute(dst, command);
+
+	/* the constraints and VACUUM run with the default settings */
+	if (useGrant)
 	{
-		/* just continue, this is not a show-stopper */
-		log_warn("Failed to remove the lockFile \"%s\"", indexPaths->lockFile);
+		const char *reset[] = {
+			"RESET maintenance_work_mem",
+			"RESET max_parallel_maintenance_workers"
+		};
+
+		if (!pgsql_execute_batch(dst, reset, parallelWorkers ? 2 : 1))
+		{
+			/* errors have already been logged */
+			return false;
+		}
 	}
 
-	return true;
+	return success;
 }
 
 
 /*
  * copydb_create_constraints loops over the index definitions for a given table
- * and creates all the associated constraints, one after the other.
+ * and creates all the associated constraints, sending them all to the target
+ * server as a single batch.
  */
 bool
-copydb_create_constraints(CopyTableDataSpec *tableSpecs)
+copydb_create_constraints(CopyTableDataSpec *tableSpecs, PGSQL *dst)
 {
 	SourceIndexArray *indexArray = tableSpecs->indexArray;
 
-	const char *pguri = tableSpecs->target_pguri;
-	PGSQL pgconn = { 0 };
+	(void) copydb_progress_start_constraints(tableSpecs);
 
-	if (!pgsql_init(&pgconn, (char *) pguri, PGSQL_CONN_TARGET))
+	if (indexArray->count == 0)
 	{
-		/* errors have already been logged */
+		(void) copydb_progress_done(tableSpecs);
+		return true;
+	}
+
+	TraceEvent event = { 0 };
+
+	trace_begin(&event, "constraints", "constraints %s.%s",
+				tableSpecs->sourceTable->nspname,
+				tableSpecs->sourceTable->relname);
+
+	SourceIndex **batchIndexes =
+		(SourceIndex **) calloc(indexArray->count, sizeof(SourceIndex *));
+	char **batchCommands = (char **) calloc(indexArray->count, sizeof(char *));
+	char *batchBuffer = (char *) calloc(indexArray->count, BUFSIZE);
+
+	if (batchIndexes == NULL || batchCommands == NULL || batchBuffer == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		free(batchIndexes);
+		free(batchCommands);
+		free(batchBuffer);
+		trace_end(&event);
+		(void) copydb_progress_done(tableSpecs);
 		return false;
 	}
 
+	int batchCount = 0;
+
 	for (int i = 0; i < indexArray->count; i++)
 	{
 		SourceIndex *index = &(indexArray->array[i]);
-		IndexFilePaths *indexPaths = &(tableSpecs->indexPathsArray.array[i]);
 
 		if (index->constraintOid > 0 &&
 			!IS_EMPTY_STRING_BUFFER(index->constraintName))
 		{
-			char sql[BUFSIZE] = { 0 };
+			char *sql = batchBuffer + (size_t) batchCount * BUFSIZE;
+
+			/* with --resume, skip the constraints created already */
+			if (tableSpecs->resume &&
+				journal_lookup(tableSpecs->journal, index->constraintOid) != NULL)
+			{
+				log_info("Skipping constraint \"%s\", done in a previous run",
+						 index->constraintName);
+				continue;
+			}
 
-			sformat(sql, sizeof(sql),
+			sformat(sql, BUFSIZE,
 					"ALTER TABLE \"%s\".\"%s\" "
 					"ADD CONSTRAINT \"%s\" %s "
 					"USING INDEX \"%s\"",
@@ -1332,27 +3719,102 @@ copydb_create_constraints(CopyTableDataSpec *tableSpecs)
 
 			log_info("%s;", sql);
 
-			if (!pgsql_execute(&pgconn, sql))
-			{
-				/* errors have already been logged */
-				return false;
-			}
-
-			/* create the doneFile for the constraint */
-			char contents[BUFSIZE] = { 0 };
+			batchIndexes[batchCount] = index;
+			batchCommands[batchCount] = sql;
+			++batchCount;
+		}
+	}
 
-			sformat(contents, sizeof(contents), "%s;\n", sql);
+	if (!pgsql_execute_batch(dst, (const char **) batchCommands, batchCount))
+	{
+		/* errors have already been logged */
+		free(batchIndexes);
+		free(batchCommands);
+		free(batchBuffer);
+		trace_end(&event);
+		(void) copydb_progress_done(tableSpecs);
+		return false;
+	}
 
-			if (!write_file(contents,
-							strlen(contents),
-							indexPaths->constraintDoneFile))
-			{
-				log_warn("Failed to create the constraint done file");
-				log_warn("Restoring the --post-data part of the schema "
-						 "might fail because of already existing objects");
-			}
+	/* register the constraints in the journal */
+	for (int i = 0; i < batchCount; i++)
+	{
+		SourceIndex *index = batchIndexes[i];
+
+		JournalEntry entry = {
+			.oid = index->constraintOid,
+			.kind = JOURNAL_RECORD_CONSTRAINT,
+			.pid = getpid(),
+			.doneTime = time(NULL),
+			.nspname = index->tableNamespace,
+			.relname = index->constraintName,
+			.command = batchCommands[i]
+		};
+
+		if (!journal_append(tableSpecs->journal, &entry))
+		{
+			log_warn("Failed to register the constraint in the journal");
+			log_warn("Restoring the --post-data part of the schema "
+					 "might fail because of already existing objects");
 		}
 	}
 
+	free(batchIndexes);
+	free(batchCommands);
+	free(batchBuffer);
+
+	trace_end(&event);
+	(void) copydb_progress_done(tableSpecs);
+
 	return true;
 }
+
+
+/*
+ * copydb_vacuum_table runs VACUUM ANALYZE on the target table, once its
+ * indexes and constraints have been created, or only ANALYZE when using
+ * --analyze-only. With --vacuum-parallel, the index vacuuming phase uses
+ * that many parallel workers on the target server.
+ */
+bool
+copydb_vacuum_table(CopyTableDataSpec *tableSpecs, PGSQL *dst)
+{
+	char vacuum[BUFSIZE] = { 0 };
+
+	if (tableSpecs->analyzeOnly)
+	{
+		sformat(vacuum, sizeof(vacuum), "ANALYZE \"%s\".\"%s\"",
+				tableSpecs->sourceTable->nspname,
+				tableSpecs->sourceTable->relname);
+	}
+	else if (tableSpecs->vacuumParallel > 0)
+	{
+		sformat(vacuum, sizeof(vacuum),
+				"VACUUM (ANALYZE, PARALLEL %d) \"%s\".\"%s\"",
+				tableSpecs->vacuumParallel,
+				tableSpecs->sourceTable->nspname,
+				tableSpecs->sourceTable->relname);
+	}
+	else
+	{
+		sformat(vacuum, sizeof(vacuum), "VACUUM ANALYZE \"%s\".\"%s\"",
+				tableSpecs->sourceTable->nspname,
+				tableSpecs->sourceTable->relname);
+	}
+
+	log_info("%s;", vacuum);
+
+	TraceEvent event = { 0 };
+
+	trace_begin(&event, "vacuum", "%s %s.%s",
+				tableSpecs->analyzeOnly ? "ANALYZE" : "VACUUM",
+				tableSpecs->sourceTable->nspname,
+				tableSpecs->sourceTable->relname);
+
+	bool success = pgsql_execute(dst, vacuum);
+
+	trace_end(&event);
+
+	/* errors have already been logged */
+	return success;
+}
@@ -6,9 +6,13 @@
 #ifndef COPYDB_H
 #define COPYDB_H
 
+#include "cli_copy.h"
+#include "journal.h"
 #include "lock_utils.h"
 #include "pgcmd.h"
 #include "schema.h"
+#include "spool.h"
+#include "trace.h"
 
 
 /* maintain all the internal paths we need in one place */
@@ -17,10 +21,18 @@ typedef struct CopyFilePaths
 	char topdir[MAXPGPATH];           /* /tmp/pgcopydb */
 	char pidfile[MAXPGPATH];          /* /tmp/pgcopydb/pgcopydb.pid */
 	char schemadir[MAXPGPATH];        /* /tmp/pgcopydb/schema */
+	char datadir[MAXPGPATH];          /* /tmp/pgcopydb/data */
+	char catalogfile[MAXPGPATH];      /* /tmp/pgcopydb/data/tables.json */
+	char catalogcachefile[MAXPGPATH];  /* /tmp/pgcopydb/schema/catalog.json */
+	char sequencecachefile[MAXPGPATH]; /* /tmp/pgcopydb/schema/sequences.json */
 	char rundir[MAXPGPATH];           /* /tmp/pgcopydb/run */
 	char tbldir[MAXPGPATH];           /* /tmp/pgcopydb/run/tables */
 	char idxdir[MAXPGPATH];           /* /tmp/pgcopydb/run/indexes */
 	char idxfilepath[MAXPGPATH];      /* /tmp/pgcopydb/run/indexes.json */
+	char journalfile[MAXPGPATH];      /* /tmp/pgcopydb/run/state.journal */
+	char progressfile[MAXPGPATH];     /* /tmp/pgcopydb/run/progress */
+	char summaryfile[MAXPGPATH];      /* /tmp/pgcopydb/summary.json */
+	char tracefile[MAXPGPATH];        /* /tmp/pgcopydb/trace.json */
 } CopyFilePaths;
 
 
@@ -29,7 +41,8 @@ typedef struct TableDataProcess
 {
 	pid_t pid;
 	uint32_t oid;
-	char lockFile[MAXPGPATH];   /* /tmp/pgcopydb/run/tables/{oid} */
+	int partNumber;
+	char lockFile[MAXPGPATH];   /* /tmp/pgcopydb/run/{oid} */
 	char doneFile[MAXPGPATH];   /* /tmp/pgcopydb/run/tables/{oid}.done */
 } TableDataProcess;
 
@@ -47,10 +60,15 @@ typedef struct DumpPaths
 	char preFilename[MAXPGPATH];  /* pg_dump --section=pre-data */
 	char postFilename[MAXPGPATH]; /* pg_dump --section=post-data */
 	char listFilename[MAXPGPATH]; /* pg_restore --list */
+	char preTocFilename[MAXPGPATH];   /* cached pg_restore --list pre.dump */
+	char postTocFilename[MAXPGPATH];  /* cached pg_restore --list post.dump */
+	char preListFilename[MAXPGPATH];  /* pre-data batch --use-list */
+	char preDoneFilename[MAXPGPATH];  /* pre-data has been restored */
+	char preRestoredFilename[MAXPGPATH];  /* pre-data entries restored */
 } DumpPaths;
 
 
-/* per-table file paths */
+/* per-table file paths, computed on demand: see copydb_table_file_paths() */
 typedef struct TableFilePaths
 {
 	char lockFile[MAXPGPATH];    /* table lock file */
@@ -59,12 +77,44 @@ typedef struct TableFilePaths
 } TableFilePaths;
 
 
-/* per-index file paths */
+/*
+ * Tables that are larger than --split-tables-larger-than are copied in
+ * several parts, each part being a range of blocks of the main relation fork,
+ * and each part being copied by its own sub-process.
+ *
+ * A part covers the ctid range [ '(min,0)', '(max,0)' [ and the last part
+ * is open-ended, so that rows found in blocks added to the table after we
+ * fetched relpages are copied too.
+ */
+typedef struct CopyTableDataPartSpec
+{
+	int partNumber;             /* from 0 to partCount - 1 */
+	int partCount;              /* 1 when the table is not split */
+	int64_t min;                /* first block of the range, inclusive */
+	int64_t max;                /* last block of the range, exclusive */
+} CopyTableDataPartSpec;
+
+
+/*
+ * Per-part file paths, computed on demand: see copydb_part_file_paths(). A
+ * table that is not split uses the table lockFile and doneFile.
+ */
+typedef struct TablePartFilePaths
+{
+	char lockFile[MAXPGPATH];   /* /tmp/pgcopydb/run/tables/{oid}.{part} */
+	char doneFile[MAXPGPATH];   /* /tmp/pgcopydb/run/tables/{oid}.{part}.done */
+	char xidFile[MAXPGPATH];    /* /tmp/pgcopydb/run/tables/{oid}.{part}.xid */
+	char spoolFile[MAXPGPATH];  /* /tmp/pgcopydb/data/{oid}.{part}.copy.zst */
+} TablePartFilePaths;
+
+
+/*
+ * Per-index file paths. The indexes and constraints that are done are
+ * registered in the journal, see journal.h.
+ */
 typedef struct IndexFilePaths
 {
-	char lockFile[MAXPGPATH];           /* index lock file */
-	char doneFile[MAXPGPATH];           /* index done file (summary) */
-	char constraintDoneFile[MAXPGPATH]; /* constraint done file */
+	char lockFile[MAXPGPATH];           /* index lock file (--state-files) */
 } IndexFilePaths;
 
 typedef struct IndexFilePathsArray
@@ -74,6 +124,41 @@ typedef struct IndexFilePathsArray
 } IndexFilePathsArray;
 
 
+/*
+ * The main process exports a snapshot on the source database and keeps the
+ * exporting transaction open for the whole duration of the copy, and then
+ * every sub-process uses SET TRANSACTION SNAPSHOT so that all the COPY
+ * commands see the same consistent data, as pg_dump --jobs does.
+ *
+ * With --follow the snapshot is exported by the creation of a logical
+ * replication slot instead, on a replication connection that is kept idle
+ * for the same duration, so that the changes decoded from the slot are
+ * exactly the ones that the COPY commands did not see.
+ */
+typedef enum
+{
+	SNAPSHOT_STATE_UNKNOWN = 0,
+	SNAPSHOT_STATE_SKIPPED,     /* --not-consistent */
+	SNAPSHOT_STATE_EXPORTED,    /* we own the snapshot transaction */
+	SNAPSHOT_STATE_SET,         /* --snapshot: exported by someone else */
+	SNAPSHOT_STATE_CLOSED
+} TransactionSnapshotState;
+
+typedef struct TransactionSnapshot
+{
+	PGSQL pgsql;
+	char pguri[MAXCONNINFO];
+	ConnectionType connectionType;
+	TransactionSnapshotState state;
+	char snapshot[BUFSIZE];
+
+	bool createSlot;                    /* --follow */
+	char slotName[NAMEDATALEN];
+	char plugin[NAMEDATALEN];
+	char startLSN[PG_LSN_MAXLENGTH];    /* slot consistent point */
+} TransactionSnapshot;
+
+
 /*
  * pgcopydb relies on pg_dump and pg_restore to implement the pre-data and the
  * post-data section of the operation, and implements the data section
@@ -90,27 +175,64 @@ typedef enum
 	DATA_SECTION_ALL
 } CopyDataSection;
 
-/* all that's needed to drive a single TABLE DATA copy process */
+struct CopyIndexQueue;
+struct CopyVacuumQueue;
+struct CopyThrottle;
+
+/*
+ * All that's needed to drive a single TABLE DATA copy process. There is one
+ * of those per table (or table part) in the main process, so the connection
+ * strings point to the CopyDataSpec ones, and the file paths are computed
+ * when needed.
+ */
 typedef struct CopyTableDataSpec
 {
 	CopyFilePaths *cfPaths;
 	PostgresPaths *pgPaths;
 
-	char source_pguri[MAXCONNINFO];
-	char target_pguri[MAXCONNINFO];
+	char *source_pguri;
+	char *target_pguri;
 
 	CopyDataSection section;
+	bool resume;                /* skip what a previous run has done */
+	bool unchanged;             /* --refresh: the previous run copy is fine */
 
 	SourceTable *sourceTable;
 	SourceIndexArray *indexArray;
-	TableDataProcess *process;
+	SourceIndexArray tableIndexArray;   /* slice of specs->sourceIndexArray */
+	TransactionSnapshot *sourceSnapshot;
+
+	/* --fanout-target connections, owned by the table worker */
+	PGSQL *fanout;
+	int fanoutCount;
+
+	char *relayAddress;         /* --relay host:port, or NULL */
+
+	CopyTableDataPartSpec part;
+	char *orderByColumns;       /* --order-by-pk-smaller-than, or NULL */
+	char *copyQuery;            /* COPY source query, or NULL for the table */
+	char *copyTarget;           /* target table and columns, or NULL */
+	CopyFormat copyFormat;
+	bool copyFreeze;
+	int copyBufferSize;
+	int copyPipelineDepth;
+
+	CopySpoolMode spoolMode;    /* pgcopydb dump data and restore data */
+	SpoolCompression spoolCompression;
 
 	int tableJobs;
 	int indexJobs;
-	Semaphore *indexSemaphore;  /* pointer to the main specs semaphore */
+	struct CopyIndexQueue *indexQueue;  /* pointer to the main specs queue */
+	struct CopyVacuumQueue *vacuumQueue;
+	struct CopyThrottle *throttle;      /* pointer to the main specs area */
+	struct CopyMemoryGrant *memoryGrant;    /* owned by the table worker */
+	Journal *journal;                   /* pointer to the main specs journal */
+	struct ProgressSlot *progress;      /* the worker progress slot */
+
+	bool analyzeOnly;
+	int vacuumParallel;
 
-	TableFilePaths tablePaths;
-	IndexFilePathsArray indexPathsArray;
+	IndexFilePathsArray indexPathsArray;   /* only while creating indexes */
 } CopyTableDataSpec;
 
 
@@ -121,6 +243,368 @@ typedef struct CopyTableDataSpecsArray
 } CopyTableDataSpecsArray;
 
 
+/*
+ * The pre-data section may be restored while the tables are being copied,
+ * see copydb_start_target_prepare_schema(). A sub-process then restores the
+ * pre.dump archive entries in batches, in the archive order, which is a
+ * dependency order, except that the column DEFAULT and ATTACH PARTITION
+ * entries are moved next to the last relation they depend on. A table can
+ * be copied as soon as its TABLE entry and those dependent entries have been
+ * restored.
+ *
+ * Each batch is restored in a single transaction, and the dumpId of its
+ * entries is then appended to the pre.restored file, so that a --resume run
+ * skips them, see copydb_read_pre_data_restored().
+ *
+ * The order array lists the archive entries in restore order. The tables
+ * array maps the oid of each TABLE entry to the position in the restore
+ * order of the last entry that the table waits for, it is sorted by oid and
+ * does not change once the sub-process has been started. The restore
+ * progress lives in shared memory.
+ */
+typedef struct PreDataTable
+{
+	uint32_t oid;
+	int rank;
+} PreDataTable;
+
+typedef struct PreDataProgress
+{
+	Semaphore semaphore;        /* protects the other fields */
+	size_t size;                /* size of the shared memory area */
+	int restoredEntries;        /* entries restored so far, in restore order */
+	bool done;
+	bool failed;
+} PreDataProgress;
+
+typedef struct PreDataRestore
+{
+	bool streaming;             /* false when restored in a single step */
+	pid_t pid;
+	int entryCount;
+	int *order;                 /* malloc'ed area */
+	bool *restored;             /* malloc'ed area, by archive index */
+	int tableCount;
+	PreDataTable *tables;       /* malloc'ed area */
+	PreDataProgress *progress;  /* shared memory area */
+} PreDataRestore;
+
+
+/*
+ * The table workers pull their next COPY job from a queue that lives in
+ * shared memory: the array contains indexes in the tableSpecsArray.
+ */
+typedef struct CopyTableQueue
+{
+	Semaphore semaphore;        /* protects next */
+	size_t size;                /* size of the shared memory area */
+	int count;
+	int next;
+	int array[];
+} CopyTableQueue;
+
+
+/*
+ * A COPY job is a table or a table part in the table queue. The estimated
+ * durations are computed from the source catalogs, see
+ * copydb_estimate_table_job(), and are used to sort the queue and to
+ * simulate the work of the table workers, see copydb_simulate_schedule().
+ */
+typedef struct CopyTableJob
+{
+	int specsIndex;
+	uint32_t oid;
+	int partNumber;
+
+	uint64_t copyMs;            /* COPY of this table part */
+	uint64_t indexMs;           /* CREATE INDEX of the table */
+	uint64_t vacuumMs;          /* VACUUM or ANALYZE of the table */
+	uint64_t finalizeMs;        /* indexes, constraints, vacuum of the table */
+	uint64_t tableMs;           /* COPY of all parts, and then finalize */
+} CopyTableJob;
+
+
+/*
+ * With --max-copy-rate, the table workers and the multiplexed COPY process
+ * all consume from the same token bucket, that lives in shared memory. With
+ * --adaptive-max-lag or --adaptive-max-backends, a monitor sub-process also
+ * adjusts activeWorkers from the source server load, and the table workers
+ * with a higher index wait before fetching their next table.
+ */
+typedef struct CopyThrottle
+{
+	Semaphore semaphore;        /* protects tokens and lastRefill */
+	size_t size;                /* size of the shared memory area */
+
+	uint64_t maxRate;           /* bytes per second, zero for no limit */
+	double tokens;              /* negative when in debt */
+	uint64_t lastRefill;        /* microseconds */
+
+	int maxWorkers;
+	int activeWorkers;
+	bool monitorDone;
+} CopyThrottle;
+
+
+/*
+ * With --copy-memory-budget, the table workers reserve the memory that they
+ * use to buffer COPY rows against a global budget that lives in shared
+ * memory, see memory.c. The grant of a table worker is private to the
+ * worker process, and shared by the threads of its COPY pipeline.
+ */
+typedef struct CopyMemoryBudget
+{
+	Semaphore semaphore;        /* protects everything here, and grants */
+	size_t size;                /* size of the shared memory area */
+	uint64_t budget;            /* --copy-memory-budget */
+	uint64_t inUse;             /* sum of the current reservations */
+	int jobsRunning;            /* holding a CopyMemoryGrant */
+	int jobsWaiting;            /* in copydb_memory_reserve_rows() */
+	uint64_t nextWaitTicket;    /* orders the waiting jobs */
+	int waitSlotCount;          /* one slot per table worker */
+	uint64_t waitTickets[];     /* zero when the slot is free */
+} CopyMemoryBudget;
+
+typedef struct CopyMemoryGrant
+{
+	CopyMemoryBudget *budget;   /* NULL when there's no budget */
+	uint64_t jobBytes;          /* estimate reserved when the job started */
+	uint64_t rowAllowance;      /* part of jobBytes that covers wide rows */
+	uint64_t rowBytes;          /* wide rows currently held by pg_copy() */
+	uint64_t extraBytes;        /* reserved on top of jobBytes */
+} CopyMemoryGrant;
+
+
+/*
+ * The table workers and the index workers publish what they are doing in a
+ * slot of the progress area, a shared memory area that is mapped from the
+ * run/progress file, so that `pgcopydb list progress` can read it from
+ * another process. The COPY statistics are published by pg_copy() every
+ * PROGRESS_UPDATE_FLUSHES buffers.
+ */
+typedef enum
+{
+	PROGRESS_STEP_IDLE = 0,
+	PROGRESS_STEP_COPY,
+	PROGRESS_STEP_CREATE_INDEX,
+	PROGRESS_STEP_CONSTRAINTS
+} ProgressStep;
+
+typedef struct ProgressSlot
+{
+	pid_t pid;                  /* worker process */
+	int backendPid;             /* target connection backend */
+	ProgressStep step;
+	uint32_t oid;               /* table or index oid */
+	int partNumber;
+	int partCount;
+	char nspname[NAMEDATALEN];
+	char relname[NAMEDATALEN];
+	uint64_t startTime;         /* time(NULL) at the start of the step */
+	uint64_t estimatedBytes;    /* on-disk size of the table (part) */
+	uint64_t estimatedRows;     /* reltuples of the table (part) */
+	CopyStats stats;            /* COPY rows and bytes, see pg_copy() */
+
+	/* cumulative counters of the worker, see pgcopydb --metrics-port */
+	uint64_t totalRows;         /* rows of the COPY steps that are done */
+	uint64_t totalBytes;
+	uint64_t waitUs;            /* waiting for a job, a turn, or memory */
+	int copyDone;
+	int indexDone;
+} ProgressSlot;
+
+typedef struct ProgressArea
+{
+	uint32_t magic;
+	size_t size;                /* size of the shared memory area */
+	pid_t pid;                  /* main process */
+	uint64_t startTime;
+	int tableWorkers;           /* the first slots, then the index workers */
+	int indexWorkers;
+	bool closed;                /* the workers are done */
+	uint64_t etaTime;           /* estimated completion time, see eta.c */
+	ProgressSlot slots[];
+} ProgressArea;
+
+
+/*
+ * Once a table has been copied, its indexes are pushed to a global queue
+ * that lives in shared memory, and from which the --index-jobs index workers
+ * pull their next CREATE INDEX job. The index worker that is done with the
+ * last index of a table then creates the table constraints.
+ *
+ * The jobs of a table are queued next to each other, and the first job of a
+ * table tracks how many of them are not done yet. Tables without indexes
+ * are not queued.
+ *
+ * The tableSpecs pointer is valid in all the sub-processes, because they are
+ * forked after the tableSpecsArray has been allocated.
+ */
+typedef struct CopyIndexJob
+{
+	CopyTableDataSpec *tableSpecs;
+	int firstJob;               /* first job of the same table */
+	int jobCount;               /* count of jobs of the same table */
+	int remaining;              /* in the first job: jobs not done yet */
+	bool failed;                /* in the first job: an index failed */
+	SourceIndex index;
+} CopyIndexJob;
+
+/*
+ * With --index-memory-budget, the index workers share a maintenance_work_mem
+ * budget, and each CREATE INDEX is given its own share of it.
+ */
+typedef struct IndexMemoryGrant
+{
+	uint64_t maintenanceWorkMem;    /* bytes, zero when there's no budget */
+	int parallelWorkers;            /* max_parallel_maintenance_workers */
+} IndexMemoryGrant;
+
+typedef struct CopyIndexQueue
+{
+	Semaphore semaphore;        /* protects count, next, closed, remaining */
+	size_t size;                /* size of the shared memory area */
+	int capacity;
+	int count;
+	int next;
+	bool closed;                /* no more jobs are going to be queued */
+
+	int workerCount;            /* count of index workers */
+	int workersRunning;         /* holding an IndexMemoryGrant */
+	uint64_t memoryBudget;      /* --index-memory-budget */
+	uint64_t memoryInUse;       /* sum of the current grants */
+
+	CopyIndexJob array[];
+} CopyIndexQueue;
+
+
+/*
+ * The --vacuum-jobs vacuum workers pull tables from their own queue in
+ * shared memory. A table is queued once its indexes and constraints have
+ * been created, also when using --analyze-only: both VACUUM and ANALYZE
+ * take a lock that conflicts with CREATE INDEX, so they would only wait for
+ * the index builds of the table, or hold them back.
+ */
+typedef struct CopyVacuumQueue
+{
+	Semaphore semaphore;        /* protects count, next, closed */
+	size_t size;                /* size of the shared memory area */
+	int capacity;
+	int count;
+	int next;
+	bool closed;                /* no more tables are going to be queued */
+
+	CopyTableDataSpec *array[];
+} CopyVacuumQueue;
+
+
+/*
+ * A bulk-load profile is a list of Postgres settings that pgcopydb uses on
+ * its target connections, such as synchronous_commit or maintenance_work_mem.
+ * A setting applies to all the target connections, or only to the connections
+ * of a given phase of the data section.
+ *
+ * The COPY, CREATE INDEX and VACUUM connections get their settings as
+ * connection options, and then the constraints settings are SET on the index
+ * worker connection around that step, see bulkload.c.
+ */
+typedef enum
+{
+	BULK_LOAD_PHASE_ALL = 0,
+	BULK_LOAD_PHASE_COPY,
+	BULK_LOAD_PHASE_INDEX,
+	BULK_LOAD_PHASE_CONSTRAINTS,
+	BULK_LOAD_PHASE_VACUUM
+} BulkLoadPhase;
+
+typedef struct BulkLoadSetting
+{
+	BulkLoadPhase phase;
+	char name[NAMEDATALEN];
+	char value[2 * NAMEDATALEN];
+	char effective[2 * NAMEDATALEN];    /* as reported by the target server */
+} BulkLoadSetting;
+
+typedef struct BulkLoadProfile
+{
+	int count;
+	BulkLoadSetting array[MAX_BULK_LOAD_SETTINGS];
+} BulkLoadProfile;
+
+
+/*
+ * The table filters restrict the copy to a subset of the tables of the source
+ * database, and the sampling options copy only a part of the rows of some
+ * tables, see filters.c. Patterns use the fnmatch(3) shell wildcards, and a
+ * table pattern that contains a dot matches schema.table.
+ */
+#define MAX_TABLE_FILTER_PATTERNS 64
+
+/* the catalogs of the objects that we look up in pg_restore --list output */
+#define PG_CLASS_OID 1259
+#define PG_ATTRDEF_OID 2604
+#define PG_CONSTRAINT_OID 2606
+
+typedef struct TableFilterList
+{
+	int count;
+	char array[MAX_TABLE_FILTER_PATTERNS][2 * NAMEDATALEN];
+} TableFilterList;
+
+typedef struct TableSample
+{
+	char pattern[2 * NAMEDATALEN];  /* empty to match all the tables */
+	double percent;
+} TableSample;
+
+typedef struct TableSampleList
+{
+	int count;
+	TableSample array[MAX_TABLE_FILTER_PATTERNS];
+} TableSampleList;
+
+typedef struct TableFilters
+{
+	TableFilterList includeSchema;
+	TableFilterList excludeSchema;
+	TableFilterList includeTable;
+	TableFilterList excludeTable;
+	uint64_t excludeTablesLargerThan;
+	char excludeTablesLargerThanPretty[NAMEDATALEN];
+	TableSampleList tableSample;
+
+	/* computed from the source catalogs, see copydb_prepare_table_filters() */
+	bool prepared;
+	SourceFilteredObjectArray excluded; /* sorted by oid */
+	int tagKeyCount;
+	char **tagKeys;             /* "schema TABLE name " and the like, sorted */
+	int nameKeyCount;
+	char **nameKeys;            /* "schema name ", sorted */
+	int sampledCount;
+	uint32_t *sampledOids;      /* sorted */
+} TableFilters;
+
+
+/*
+ * With pgcopydb copy-cluster, the databases are copied concurrently and their
+ * table, index and vacuum workers share a global budget of jobs: a worker
+ * holds a slot of the budget while running a job. The slots are counting
+ * semaphores that the database sub-processes inherit at fork() time.
+ */
+typedef enum
+{
+	COPY_JOB_BUDGET_TABLE = 0,
+	COPY_JOB_BUDGET_INDEX,
+	COPY_JOB_BUDGET_VACUUM,
+	COPY_JOB_BUDGET_COUNT
+} CopyJobBudgetKind;
+
+typedef struct CopyJobBudget
+{
+	Semaphore slots[COPY_JOB_BUDGET_COUNT];
+} CopyJobBudget;
+
+
 /* all that's needed to start a TABLE DATA copy for a whole database */
 typedef struct CopyDataSpec
 {
@@ -133,16 +617,135 @@ typedef struct CopyDataSpec
 	CopyDataSection section;
 	bool dropIfExists;
 	bool noOwner;
+	bool resume;
+	bool refresh;
+	bool follow;
 
 	int tableJobs;
 	int indexJobs;
-	Semaphore indexSemaphore;
+	int vacuumJobs;
+	bool analyzeOnly;
+	int vacuumParallel;
+	int restoreJobs;
+	int largeObjectJobs;
+	bool stateFiles;
+	bool trace;
+	char metricsHost[BUFSIZE];  /* empty for all the addresses */
+	int metricsPort;
+	int etaInterval;            /* seconds, zero to disable */
+
+	uint64_t splitTablesLargerThan;
+	char splitTablesLargerThanPretty[NAMEDATALEN];
+
+	TransactionSnapshot sourceSnapshot;
+
+	/* --source-replica: table workers COPY from the replicas */
+	int sourceReplicaCount;
+	TransactionSnapshot replicaSnapshots[MAX_SOURCE_REPLICAS];
+
+	/* --fanout-target: table workers COPY to these targets too */
+	int fanoutCount;
+	char fanoutTargets[MAX_FANOUT_TARGETS][MAXCONNINFO];
+
+	/* --relay: table workers get the COPY data from pgcopydb relay server */
+	char relayAddress[BUFSIZE];
+
+	CopyFormat copyFormat;
+	bool copyFreeze;
+	bool copyStrategyAuto;      /* --copy-strategy auto, see strategy.c */
+	int copyBufferSize;
+	char copyBufferSizePretty[NAMEDATALEN];
+	int copyPipelineDepth;
+
+	/* pgcopydb dump data and restore data use files in the data directory */
+	CopySpoolMode spoolMode;
+	SpoolCompression spoolCompression;
+
+	uint64_t multiplexTablesSmallerThan;
+	char multiplexTablesSmallerThanPretty[NAMEDATALEN];
+	int multiplexStreams;
+
+	uint64_t orderByPkSmallerThan;
+	char orderByPkSmallerThanPretty[NAMEDATALEN];
+
+	uint64_t indexMemoryBudget;
+	char indexMemoryBudgetPretty[NAMEDATALEN];
+
+	uint64_t copyMemoryBudget;
+	char copyMemoryBudgetPretty[NAMEDATALEN];
+
+	uint64_t maxCopyRate;
+	char maxCopyRatePretty[NAMEDATALEN];
+	uint64_t adaptiveMaxLag;
+	char adaptiveMaxLagPretty[NAMEDATALEN];
+	int adaptiveMaxBackends;
+
+	BulkLoadProfile bulkLoadProfile;
+	TableFilters filters;
 
 	DumpPaths dumpPaths;
+	PreDataRestore preDataRestore;
+	SourceTableMarkerArray tableMarkerArray;    /* see --refresh */
+	SourceIndexArray sourceIndexArray;  /* sorted by table oid */
+	SourceIndexArray sourcePartitionedIndexArray;   /* see partitions.c */
+	SourceIndexAttachArray sourceIndexAttachArray;  /* sorted by parent oid */
+	SourceForeignKeyArray sourceFkeyArray;  /* sorted by constraint oid */
+	char catalogFingerprint[CATALOG_FINGERPRINT_SIZE]; /* see catalog.c */
 	CopyTableDataSpecsArray tableSpecsArray;
+	CopyTableQueue *tableQueue; /* shared memory area */
+	CopyIndexQueue *indexQueue; /* shared memory area */
+	CopyVacuumQueue *vacuumQueue;   /* shared memory area */
+	CopyThrottle *throttle;     /* shared memory area */
+	CopyMemoryBudget *memoryBudget; /* shared memory area */
+	Journal journal;            /* indexes and constraints done */
+	ProgressArea *progress;     /* shared memory area */
+
+	uint64_t plannedMakespanMs; /* see copydb_schedule_table_queue() */
+	uint64_t plannedCopyMs;
+
+	CopyJobBudget *budget;      /* copy-cluster: shared by all the databases */
 } CopyDataSpec;
 
 
+/* all that's needed to copy all the databases of a cluster */
+typedef struct CopyClusterSpecs
+{
+	CopyFilePaths cfPaths;
+	PostgresPaths pgPaths;
+
+	char source_pguri[MAXCONNINFO];
+	char target_pguri[MAXCONNINFO];
+
+	bool resume;
+	int databaseJobs;
+	int tableJobs;
+	int indexJobs;
+	int vacuumJobs;
+
+	char globalsFilename[MAXPGPATH];    /* /tmp/pgcopydb/schema/globals.sql */
+	char globalsTargetFilename[MAXPGPATH]; /* .../schema/globals.target.sql */
+	char globalsDoneFile[MAXPGPATH];    /* /tmp/pgcopydb/schema/globals.done */
+	char databasesDir[MAXPGPATH];       /* /tmp/pgcopydb/databases */
+
+	SourceDatabaseArray databaseArray;
+	CopyJobBudget budget;
+} CopyClusterSpecs;
+
+/* a database of the cluster, as given to the CopyClusterDatabaseFun */
+typedef struct CopyClusterDatabase
+{
+	SourceDatabase *database;
+	char dir[MAXPGPATH];                /* /tmp/pgcopydb/databases/{oid} */
+	char doneFile[MAXPGPATH];           /* /tmp/pgcopydb/databases/{oid}.done */
+	char source_pguri[MAXCONNINFO];
+	char target_pguri[MAXCONNINFO];
+} CopyClusterDatabase;
+
+/* runs in a database sub-process, and copies the given database */
+typedef bool (CopyClusterDatabaseFun)(CopyClusterSpecs *specs,
+									  CopyClusterDatabase *database);
+
+
 /* specify section of a dump: pre-data, post-data, data, schema */
 typedef enum
 {
@@ -154,24 +757,181 @@ typedef enum
 } PostgresDumpSection;
 
 
+bool copydb_prepare_filepaths(CopyFilePaths *cfPaths, const char *dir);
 bool copydb_init_workdir(CopyFilePaths *cfPaths, char *dir, bool removeDir);
 
 bool copydb_init_specs(CopyDataSpec *specs,
-					   char *source_pguri,
-					   char *target_pguri,
-					   int tableJobs,
-					   int indexJobs,
-					   CopyDataSection section,
-					   bool dropIfExists,
-					   bool noOwner);
+					   CopyDBOptions *options,
+					   CopyDataSection section);
+
+void copydb_table_file_paths(CopyTableDataSpec *tableSpecs,
+							 TableFilePaths *tablePaths);
+void copydb_part_file_paths(CopyTableDataSpec *tableSpecs,
+							TablePartFilePaths *partPaths);
 
 bool copydb_init_table_specs(CopyTableDataSpec *tableSpecs,
 							 CopyDataSpec *specs,
 							 SourceTable *source,
-							 TableDataProcess *process);
+							 int partNumber);
+void copydb_free_table_specs(CopyTableDataSpecsArray *tableSpecsArray);
+
+int copydb_table_part_count(CopyDataSpec *specs, SourceTable *source);
 
 bool copydb_init_indexes_paths(CopyTableDataSpec *tableSpecs);
 
+bool copydb_prepare_snapshot(CopyDataSpec *specs);
+bool copydb_close_snapshot(CopyDataSpec *specs);
+bool copydb_set_snapshot(TransactionSnapshot *snapshot, PGSQL *pgsql);
+void copydb_release_replication_slot(void);
+TransactionSnapshot * copydb_table_data_source(CopyDataSpec *specs,
+											   int workerIndex);
+
+/* throttle.c */
+bool copydb_throttle_init(CopyDataSpec *specs, int workerCount);
+bool copydb_throttle_finish(CopyDataSpec *specs);
+bool copydb_throttle_is_adaptive(CopyDataSpec *specs);
+void copydb_throttle_copy_data(void *context, int len);
+bool copydb_throttle_wait_for_turn(CopyThrottle *throttle, int workerIndex);
+bool copydb_start_throttle_monitor(CopyDataSpec *specs,
+								   TableDataProcess *process);
+
+/* memory.c */
+bool copydb_memory_budget_init(CopyDataSpec *specs, int workerCount);
+bool copydb_memory_budget_finish(CopyDataSpec *specs);
+uint64_t copydb_table_memory_estimate(CopyTableDataSpec *tableSpecs,
+									  uint64_t *rowAllowance);
+bool copydb_memory_reserve_job(CopyMemoryBudget *budget,
+							   CopyTableDataSpec *tableSpecs,
+							   CopyMemoryGrant *grant,
+							   bool *fits);
+void copydb_memory_release_job(CopyMemoryGrant *grant);
+bool copydb_memory_reserve_rows(void *context, uint64_t bytes);
+void copydb_memory_release_rows(void *context, uint64_t bytes);
+
+/* progress.c */
+bool copydb_progress_init(CopyDataSpec *specs);
+bool copydb_progress_finish(CopyDataSpec *specs);
+void copydb_progress_close(CopyDataSpec *specs);
+ProgressSlot * copydb_progress_table_slot(CopyDataSpec *specs, int workerIndex);
+ProgressSlot * copydb_progress_index_slot(CopyDataSpec *specs, int workerIndex);
+void copydb_progress_start_copy(CopyTableDataSpec *tableSpecs, PGSQL *dst);
+void copydb_progress_start_index(CopyTableDataSpec *tableSpecs,
+								 SourceIndex *index,
+								 PGSQL *dst);
+void copydb_progress_start_constraints(CopyTableDataSpec *tableSpecs);
+void copydb_progress_done(CopyTableDataSpec *tableSpecs);
+void copydb_progress_add_wait(ProgressSlot *slot, instr_time startTime);
+bool copydb_progress_read(const char *filename, ProgressArea **area);
+
+/* cluster.c */
+bool copydb_copy_cluster(CopyClusterSpecs *specs, CopyClusterDatabaseFun *fun);
+bool copydb_job_budget_init(CopyJobBudget *budget,
+							int tableJobs,
+							int indexJobs,
+							int vacuumJobs);
+bool copydb_job_budget_finish(CopyJobBudget *budget);
+bool copydb_job_budget_acquire(CopyJobBudget *budget, CopyJobBudgetKind kind);
+void copydb_job_budget_release(CopyJobBudget *budget, CopyJobBudgetKind kind);
+
+/* eta.c */
+bool copydb_start_eta_monitor(CopyDataSpec *specs, TableDataProcess *process);
+
+/* metrics.c */
+bool copydb_start_metrics_server(CopyDataSpec *specs, TableDataProcess *process);
+
+/* spool.c */
+bool copydb_spool_write_table_data(CopyTableDataSpec *tableSpecs,
+								   PGSQL *src,
+								   const char *copySource,
+								   TablePartFilePaths *partPaths,
+								   CopyStats *stats);
+bool copydb_spool_read_table_data(CopyTableDataSpec *tableSpecs,
+								  PGSQL *dst,
+								  CopyArgs *args,
+								  TablePartFilePaths *partPaths,
+								  CopyStats *stats);
+bool copydb_spool_write_catalog(CopyDataSpec *specs,
+								SourceTableArray *tableArray);
+bool copydb_spool_read_catalog(CopyDataSpec *specs,
+							   SourceTableArray *tableArray);
+bool copydb_spool_read_sequences(CopyDataSpec *specs,
+								 SourceSequenceArray *sequenceArray);
+
+/* relay.c */
+bool copydb_relay_copy_table_data(CopyTableDataSpec *tableSpecs,
+								  PGSQL *dst,
+								  CopyArgs *args,
+								  CopyStats *stats);
+
+/* catalog.c */
+bool copydb_catalog_fingerprint(CopyDataSpec *specs, PGSQL *pgsql);
+bool copydb_catalog_read_cache(CopyDataSpec *specs,
+							   SourceTableArray *tableArray,
+							   bool needIndexes,
+							   bool needForeignKeys,
+							   bool *cached);
+bool copydb_catalog_write_cache(CopyDataSpec *specs,
+								SourceTableArray *tableArray,
+								bool hasIndexes,
+								bool hasForeignKeys);
+bool copydb_catalog_read_sequences_cache(CopyDataSpec *specs,
+										 SourceSequenceArray *sequenceArray,
+										 bool *cached);
+bool copydb_catalog_write_sequences_cache(CopyDataSpec *specs,
+										  SourceSequenceArray *sequenceArray);
+JSON_Value * copydb_catalog_tables_to_json(CopyDataSpec *specs,
+										   SourceTableArray *tableArray);
+bool copydb_catalog_tables_from_json(JSON_Array *jsTables,
+									 SourceTableArray *tableArray);
+JSON_Value * copydb_catalog_indexes_to_json(SourceIndexArray *indexArray);
+bool copydb_catalog_indexes_from_json(JSON_Array *jsIndexes,
+									  SourceIndexArray *indexArray);
+
+/* partitions.c */
+bool copydb_fetch_source_partitioned_indexes(CopyDataSpec *specs, PGSQL *pgsql);
+bool copydb_create_partitioned_indexes(CopyDataSpec *specs);
+
+/* filters.c */
+bool copydb_parse_filter_patterns(const char *str, TableFilterList *list);
+bool copydb_parse_table_sample(const char *str, TableSampleList *list);
+bool copydb_init_table_filters(TableFilters *filters, CopyDBOptions *options);
+bool copydb_has_table_filters(TableFilters *filters);
+bool copydb_prepare_table_filters(CopyDataSpec *specs, PGSQL *pgsql);
+bool copydb_filter_source_catalogs(CopyDataSpec *specs,
+								   PGSQL *pgsql,
+								   SourceTableArray *tableArray);
+void copydb_filter_source_sequences(CopyDataSpec *specs,
+									SourceSequenceArray *sequenceArray);
+bool copydb_archive_item_is_filtered_out(CopyDataSpec *specs,
+										 ArchiveContentItem *item);
+bool copydb_table_is_sampled(CopyDataSpec *specs, uint32_t oid);
+char * copydb_table_sample_clause(SourceTable *table, char *clause, size_t size);
+
+/* strategy.c */
+bool copydb_choose_copy_strategies(CopyDataSpec *specs,
+								   SourceTableArray *tableArray);
+char * copydb_copy_strategy_name(CopyDataSpec *specs,
+								 CopyTableDataSpec *tableSpecs,
+								 char *name,
+								 size_t size);
+
+/* refresh.c */
+bool copydb_fetch_table_markers(CopyDataSpec *specs);
+void copydb_set_table_markers(CopyDataSpec *specs, SourceTableArray *tableArray);
+bool copydb_prepare_refresh(CopyDataSpec *specs);
+bool copydb_refresh_foreign_keys(CopyDataSpec *specs);
+
+/* largeobjects.c */
+bool copydb_copy_all_large_objects(CopyDataSpec *specs);
+
+/* fanout.c */
+bool copydb_fanout_prepare_schema(CopyDataSpec *specs);
+bool copydb_fanout_finalize_schema(CopyDataSpec *specs);
+
+/* follow.c */
+bool copydb_validate_slot_name(const char *slotName);
+bool copydb_follow_changes(CopyDataSpec *specs);
+
 bool copydb_dump_source_schema(CopyDataSpec *specs, PostgresDumpSection section);
 bool copydb_target_prepare_schema(CopyDataSpec *specs);
 bool copydb_target_finalize_schema(CopyDataSpec *specs);
@@ -180,15 +940,102 @@ bool copydb_objectid_has_been_processed_already(CopyDataSpec *specs,
 												uint32_t oid);
 
 bool copydb_copy_all_sequences(CopyDataSpec *specs);
+bool copydb_set_all_sequences(CopyDataSpec *specs,
+							  SourceSequenceArray *sequenceArray);
 
 bool copydb_copy_all_table_data(CopyDataSpec *specs);
-bool copydb_start_table_data(CopyTableDataSpec *spec);
-bool copydb_copy_table(CopyTableDataSpec *tableSpecs);
-bool copydb_start_create_indexes(CopyTableDataSpec *tableSpecs);
-bool copydb_create_index(CopyTableDataSpec *tableSpecs, int idx);
-bool copydb_create_constraints(CopyTableDataSpec *tableSpecs);
+bool copydb_check_copy_format(CopyDataSpec *specs);
+bool copydb_copy_table(CopyTableDataSpec *tableSpecs, PGSQL *src, PGSQL *dst);
+bool copydb_open_table_source(CopyTableDataSpec *tableSpecs, PGSQL *src);
+bool copydb_table_uses_freeze(CopyTableDataSpec *tableSpecs);
+char * copydb_copy_options(CopyTableDataSpec *tableSpecs, bool freeze);
+bool copydb_begin_copy_freeze(CopyTableDataSpec *tableSpecs,
+							  PGSQL *dst,
+							  const char *qname,
+							  bool *freeze);
+bool copydb_table_parts_are_all_done(CopyTableDataSpec *tableSpecs,
+									 bool *isLastPart);
+bool copydb_create_index(CopyTableDataSpec *tableSpecs, int idx, PGSQL *dst,
+						 IndexMemoryGrant *grant);
+bool copydb_create_constraints(CopyTableDataSpec *tableSpecs, PGSQL *dst);
+bool copydb_vacuum_table(CopyTableDataSpec *tableSpecs, PGSQL *dst);
+
+bool copydb_table_uses_multiplex(CopyDataSpec *specs,
+								 CopyTableDataSpec *tableSpecs);
+bool copydb_table_is_multiplexed(CopyDataSpec *specs,
+								 CopyTableDataSpec *tableSpecs);
+bool copydb_start_multiplexed_tables(CopyDataSpec *specs,
+									 TableDataProcess *process);
+bool copydb_copy_multiplexed_tables(CopyDataSpec *specs,
+									 TableDataProcess *process);
+
+bool copydb_table_queue_init(CopyDataSpec *specs);
+bool copydb_table_queue_finish(CopyDataSpec *specs);
+bool copydb_table_queue_pop(CopyDataSpec *specs, int *specsIndex,
+							CopyMemoryGrant *grant, bool *found);
+bool copydb_start_table_worker(CopyDataSpec *specs,
+							   TableDataProcess *process,
+							   int workerIndex);
+
+bool copydb_index_queue_init(CopyDataSpec *specs);
+bool copydb_index_queue_close(CopyIndexQueue *queue);
+bool copydb_index_queue_finish(CopyDataSpec *specs);
+bool copydb_index_queue_pop(CopyIndexQueue *queue, int *jobIndex);
+bool copydb_queue_table_indexes(CopyTableDataSpec *tableSpecs);
+bool copydb_start_index_worker(CopyDataSpec *specs,
+							   TableDataProcess *process,
+							   int workerIndex);
+
+bool copydb_vacuum_queue_init(CopyDataSpec *specs);
+bool copydb_vacuum_queue_close(CopyVacuumQueue *queue);
+bool copydb_vacuum_queue_finish(CopyDataSpec *specs);
+bool copydb_vacuum_queue_push(CopyVacuumQueue *queue,
+							  CopyTableDataSpec *tableSpecs);
+bool copydb_vacuum_queue_pop(CopyVacuumQueue *queue, int *jobIndex);
+bool copydb_start_vacuum_worker(CopyDataSpec *specs, TableDataProcess *process);
+
+bool copydb_fetch_source_foreign_keys(CopyDataSpec *specs, PGSQL *pgsql);
+SourceForeignKey * copydb_lookup_foreign_key(CopyDataSpec *specs,
+											 uint32_t oid);
+bool copydb_create_foreign_keys(CopyDataSpec *specs,
+								int *fkeyIndexes,
+								int count);
+
+bool copydb_start_target_prepare_schema(CopyDataSpec *specs);
+bool copydb_finish_target_prepare_schema(CopyDataSpec *specs);
+void copydb_stop_target_prepare_schema(CopyDataSpec *specs);
+bool copydb_pre_data_progress(CopyDataSpec *specs, PreDataProgress *progress);
+bool copydb_pre_data_table_is_restored(CopyDataSpec *specs,
+									   PreDataProgress *progress,
+									   SourceTable *table);
+
+bool copydb_schedule_table_queue(CopyDataSpec *specs, int workerCount);
+void copydb_report_schedule(CopyDataSpec *specs, uint64_t actualMakespanMs);
+void copydb_estimate_table_job(CopyDataSpec *specs,
+							   SourceTable *table,
+							   int partNumber,
+							   int partCount,
+							   CopyTableJob *job);
+void copydb_estimate_table_finalize(CopyDataSpec *specs, CopyTableJob *job);
+int copydb_compare_table_jobs(const void *a, const void *b);
+uint64_t copydb_simulate_schedule(CopyTableJob *jobs, int count,
+								  int workerCount, int *criticalJob);
+
+bool copydb_parse_bulk_load_profile(const char *str, BulkLoadProfile *profile);
+char * copydb_bulk_load_phase_to_string(BulkLoadPhase phase);
+bool copydb_set_target_session(BulkLoadProfile *profile,
+							   BulkLoadPhase phase,
+							   PGSQL *pgsql);
+bool copydb_bulk_load_begin_phase(BulkLoadProfile *profile,
+								  BulkLoadPhase phase,
+								  PGSQL *pgsql);
+bool copydb_bulk_load_end_phase(BulkLoadProfile *profile,
+								BulkLoadPhase phase,
+								PGSQL *pgsql);
+bool copydb_check_bulk_load_profile(CopyDataSpec *specs);
 
 bool copydb_fatal_exit(TableDataProcessArray *subprocessArray);
 bool copydb_wait_for_subprocesses(void);
+bool copydb_wait_for_processes(TableDataProcess *array, int count);
 
 #endif  /* COPYDB_H */
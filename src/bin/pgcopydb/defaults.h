@@ -20,10 +20,130 @@
 #define PGCOPYDB_TARGET_PGURI "PGCOPYDB_TARGET_PGURI"
 #define PGCOPYDB_TARGET_TABLE_JOBS "PGCOPYDB_TARGET_TABLE_JOBS"
 #define PGCOPYDB_TARGET_INDEX_JOBS "PGCOPYDB_TARGET_INDEX_JOBS"
+#define PGCOPYDB_TARGET_VACUUM_JOBS "PGCOPYDB_TARGET_VACUUM_JOBS"
+#define PGCOPYDB_RESTORE_JOBS "PGCOPYDB_RESTORE_JOBS"
+#define PGCOPYDB_ANALYZE_ONLY "PGCOPYDB_ANALYZE_ONLY"
+#define PGCOPYDB_VACUUM_PARALLEL "PGCOPYDB_VACUUM_PARALLEL"
 #define PGCOPYDB_DROP_IF_EXISTS "PGCOPYDB_DROP_IF_EXISTS"
+#define PGCOPYDB_SPLIT_TABLES_LARGER_THAN "PGCOPYDB_SPLIT_TABLES_LARGER_THAN"
+#define PGCOPYDB_SNAPSHOT "PGCOPYDB_SNAPSHOT"
+#define PGCOPYDB_COPY_FORMAT "PGCOPYDB_COPY_FORMAT"
+#define PGCOPYDB_COPY_FREEZE "PGCOPYDB_COPY_FREEZE"
+#define PGCOPYDB_COPY_STRATEGY "PGCOPYDB_COPY_STRATEGY"
+#define PGCOPYDB_COPY_BUFFER_SIZE "PGCOPYDB_COPY_BUFFER_SIZE"
+#define PGCOPYDB_COPY_PIPELINE_DEPTH "PGCOPYDB_COPY_PIPELINE_DEPTH"
+#define PGCOPYDB_MULTIPLEX_TABLES_SMALLER_THAN \
+	"PGCOPYDB_MULTIPLEX_TABLES_SMALLER_THAN"
+#define PGCOPYDB_MULTIPLEX_STREAMS "PGCOPYDB_MULTIPLEX_STREAMS"
+#define PGCOPYDB_ORDER_BY_PK_SMALLER_THAN "PGCOPYDB_ORDER_BY_PK_SMALLER_THAN"
+#define PGCOPYDB_INDEX_MEMORY_BUDGET "PGCOPYDB_INDEX_MEMORY_BUDGET"
+#define PGCOPYDB_BULK_LOAD_PROFILE "PGCOPYDB_BULK_LOAD_PROFILE"
+#define PGCOPYDB_COPY_MEMORY_BUDGET "PGCOPYDB_COPY_MEMORY_BUDGET"
+#define PGCOPYDB_MAX_COPY_RATE "PGCOPYDB_MAX_COPY_RATE"
+#define PGCOPYDB_LARGE_OBJECT_JOBS "PGCOPYDB_LARGE_OBJECT_JOBS"
+#define PGCOPYDB_STATE_FILES "PGCOPYDB_STATE_FILES"
+#define PGCOPYDB_TRACE "PGCOPYDB_TRACE"
+#define PGCOPYDB_METRICS_PORT "PGCOPYDB_METRICS_PORT"
+#define PGCOPYDB_METRICS_LISTEN "PGCOPYDB_METRICS_LISTEN"
+#define PGCOPYDB_ETA_INTERVAL "PGCOPYDB_ETA_INTERVAL"
+#define PGCOPYDB_DATABASE_JOBS "PGCOPYDB_DATABASE_JOBS"
+#define PGCOPYDB_RELAY "PGCOPYDB_RELAY"
+#define PGCOPYDB_RELAY_TOKEN "PGCOPYDB_RELAY_TOKEN"
 
 #define POSTGRES_CONNECT_TIMEOUT "2"
 
+/* default size of the buffer where pg_copy coalesces COPY rows */
+#define DEFAULT_COPY_BUFFER_SIZE (256 * 1024)
+#define DEFAULT_COPY_BUFFER_SIZE_PRETTY "256 kB"
+#define MAX_COPY_BUFFER_SIZE (64 * 1024 * 1024)
+#define MAX_COPY_PIPELINE_DEPTH 1024
+
+/*
+ * Throughput estimates used by the table scheduler to compare tables to one
+ * another, see schedule.c. Only the ratios between them really matter.
+ */
+#define ESTIMATE_COPY_BYTES_PER_MS (64 * 1024)      /* 64 MB/s */
+#define ESTIMATE_TOAST_BYTES_PER_MS (32 * 1024)     /* detoasting is slower */
+#define ESTIMATE_COPY_ROWS_PER_MS 500               /* per-row overhead */
+#define ESTIMATE_INDEX_BYTES_PER_MS (32 * 1024)     /* writing the index */
+#define ESTIMATE_INDEX_ROWS_PER_MS 1000             /* sorting the rows */
+#define ESTIMATE_VACUUM_BYTES_PER_MS (256 * 1024)   /* VACUUM ANALYZE */
+#define ESTIMATE_ANALYZE_MS 1000                    /* ANALYZE samples rows */
+
+/* small tables are copied by a single process using concurrent streams */
+#define DEFAULT_MULTIPLEX_STREAMS 8
+#define MAX_MULTIPLEX_STREAMS 256
+
+/*
+ * With --copy-strategy auto, each table gets its own copy strategy from the
+ * source catalog stats, see strategy.c. The thresholds that are given on the
+ * command line are used instead of these ones.
+ */
+#define STRATEGY_MULTIPLEX_SMALLER_THAN (8 * 1024 * 1024)
+#define STRATEGY_SPLIT_MIN_BYTES ((uint64_t) 1024 * 1024 * 1024)
+#define STRATEGY_ORDER_BY_PK_SMALLER_THAN (256 * 1024 * 1024)
+#define STRATEGY_ORDER_BY_PK_MAX_ROW_WIDTH 2048
+#define STRATEGY_FREEZE_MIN_BYTES (64 * 1024 * 1024)
+
+/*
+ * When using --index-memory-budget, each CREATE INDEX gets a share of the
+ * budget that's sized from the source index, see copydb_index_memory_acquire.
+ * Postgres needs at least 32 MB of maintenance_work_mem per participant in a
+ * parallel index build.
+ */
+#define INDEX_MEMORY_MIN (1024 * 1024)                  /* Postgres minimum */
+#define INDEX_MEMORY_SORT_FACTOR 2                      /* sort vs index size */
+#define INDEX_PARALLEL_BYTES_PER_WORKER (1024 * 1024 * 1024)
+#define INDEX_PARALLEL_MEMORY_PER_WORKER (32 * 1024 * 1024)
+#define INDEX_PARALLEL_MAX_WORKERS 4
+
+/* --bulk-load-profile settings applied to the target connections */
+#define MAX_BULK_LOAD_SETTINGS 32
+
+/* the pre-data section is restored in batches of up to that many tables */
+#define PRE_DATA_BATCH_MAX_TABLES 256
+
+/* --follow decodes changes with wal2json and applies them in batches */
+#define DEFAULT_SLOT_NAME "pgcopydb"
+#define FOLLOW_OUTPUT_PLUGIN "wal2json"
+#define FOLLOW_BATCH_CHANGES 1000
+#define FOLLOW_SLEEP_TIME_MS 1000
+
+/* table workers may COPY from up to that many --source-replica servers */
+#define MAX_SOURCE_REPLICAS 8
+#define REPLICA_WAIT_SLEEP_TIME_MS 1000
+
+/* the same COPY data may be sent to up to that many --fanout-target */
+#define MAX_FANOUT_TARGETS 4
+
+/* --adaptive-max-lag and --adaptive-max-backends sample the source load */
+#define THROTTLE_SAMPLE_INTERVAL_MS 5000
+#define THROTTLE_PAUSE_SLEEP_TIME_MS 100
+
+/* large objects are copied in batches of that many, by --large-object-jobs */
+#define LARGE_OBJECT_BATCH_SIZE 1000
+#define LARGE_OBJECT_BUFFER_SIZE (256 * 1024)
+
+/* pg_copy() publishes its progress every that many COPY buffers */
+#define PROGRESS_UPDATE_FLUSHES 16
+
+/* the metrics server is only reachable locally unless --metrics-listen */
+#define DEFAULT_METRICS_HOST "127.0.0.1"
+
+/* the --metrics-port server checks for the end of the run that often */
+#define METRICS_POLL_TIMEOUT_MS 1000
+#define METRICS_LISTEN_BACKLOG 16
+
+/* the ETA monitor samples the progress area every second, logs less often */
+#define ETA_SAMPLE_INTERVAL_MS 1000
+#define DEFAULT_ETA_INTERVAL 60         /* seconds */
+
+/* pgcopydb copy-cluster copies that many databases at the same time */
+#define DEFAULT_DATABASE_JOBS 4
+
+/* each process fsyncs the state journal every that many records */
+#define JOURNAL_SYNC_BATCH 64
+
 
 /* retry PQping for a maximum of 15 mins, up to 2 secs between attemps */
 #define POSTGRES_PING_RETRY_TIMEOUT 900               /* seconds */
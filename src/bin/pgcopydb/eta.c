@@ -0,0 +1,675 @@
+/*
+ * src/bin/pgcopydb/eta.c
+ *     Estimated completion time of the table data, indexes and post-data
+ *
+ * With --eta-interval, a sub-process samples the progress area and the table,
+ * index and vacuum queues every ETA_SAMPLE_INTERVAL_MS, and logs how long the
+ * remaining work is expected to take every --eta-interval seconds:
+ *
+ *  - COPY: the on-disk size of the tables (parts) that are still queued, and
+ *    of what's left of the tables that are being copied, divided by the live
+ *    COPY throughput of the table workers. The last table to copy can't go
+ *    faster than one worker does, which bounds the estimate.
+ *
+ *  - CREATE INDEX: the size of the source indexes that are not built yet,
+ *    divided by the measured index throughput once the index workers have
+ *    started, or by the ESTIMATE_INDEX_BYTES_PER_MS constant scaled like the
+ *    COPY throughput before that. Indexes are not done before the COPY is.
+ *
+ *  - VACUUM and foreign keys: the ESTIMATE_VACUUM_BYTES_PER_MS constant,
+ *    scaled like the COPY throughput, applied to the tables that are not
+ *    vacuumed yet and to the referencing tables of the foreign keys, which
+ *    are validated by scanning them.
+ *
+ * The estimated completion time is also published in the progress area, for
+ * pgcopydb list progress and the --metrics-port server.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "copydb.h"
+#include "defaults.h"
+#include "log.h"
+#include "signals.h"
+#include "string_utils.h"
+
+
+/* the COPY throughput is an exponential moving average of the samples */
+#define ETA_RATE_SMOOTHING 0.2
+
+/* the scale of the catalog estimates stays within reason */
+#define ETA_MIN_SCALE 0.1
+#define ETA_MAX_SCALE 10.0
+
+typedef struct EtaMonitor
+{
+	instr_time startTime;
+	uint64_t lastSampleMs;
+	uint64_t lastLogMs;
+
+	uint64_t copyTotalBytes;    /* tables (parts) in the table queue */
+	uint64_t copyDoneBytes;     /* at the previous sample */
+	double copyBytesPerMs;      /* all the table workers together */
+	int copyBusyWorkers;
+	bool copyMeasured;
+
+	int indexTotalCount;
+	uint64_t indexTotalBytes;
+	uint64_t indexStartMs;      /* when the first index job was seen */
+	bool indexStarted;
+
+	uint64_t vacuumTotalBytes;
+	uint64_t fkeyBytes;         /* referencing tables of the foreign keys */
+} EtaMonitor;
+
+typedef struct EtaEstimate
+{
+	uint64_t copyRemainingBytes;
+	int copyRemainingJobs;
+	uint64_t copyMs;
+
+	int indexRemaining;
+	uint64_t indexMs;
+
+	uint64_t postDataMs;        /* vacuum and foreign keys */
+	uint64_t totalMs;
+} EtaEstimate;
+
+
+static bool copydb_eta_monitor(CopyDataSpec *specs);
+static void copydb_eta_init(CopyDataSpec *specs, EtaMonitor *monitor);
+static uint64_t copydb_eta_fkey_bytes(CopyDataSpec *specs);
+static int copydb_eta_compare_tables(const void *a, const void *b);
+static void copydb_eta_sample(CopyDataSpec *specs,
+							  EtaMonitor *monitor,
+							  uint64_t nowMs);
+static void copydb_eta_estimate(CopyDataSpec *specs,
+								EtaMonitor *monitor,
+								uint64_t nowMs,
+								EtaEstimate *estimate);
+static void copydb_eta_log(CopyDataSpec *specs,
+						   EtaMonitor *monitor,
+						   EtaEstimate *estimate);
+static uint64_t copydb_eta_job_bytes(CopyTableDataSpec *tableSpecs);
+static uint64_t copydb_eta_elapsed_ms(EtaMonitor *monitor);
+
+
+/*
+ * copydb_start_eta_monitor forks the sub-process that logs the estimated
+ * completion time of the copy, see copydb_eta_monitor(). The sub-process
+ * exits once copydb_progress_close() has been called.
+ */
+bool
+copydb_start_eta_monitor(CopyDataSpec *specs, TableDataProcess *process)
+{
+	if (specs->progress == NULL)
+	{
+		log_error("Failed to start the ETA monitor: "
+				  "the progress area is not available");
+		return false;
+	}
+
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	int fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork the ETA monitor process");
+			return false;
+		}
+
+		case 0:
+		{
+			/* child process runs the command */
+			if (!copydb_eta_monitor(specs))
+			{
+				/* errors have already been logged */
+				exit(EXIT_CODE_INTERNAL_ERROR);
+			}
+
+			exit(EXIT_CODE_QUIT);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			process->pid = fpid;
+			return true;
+		}
+	}
+}
+
+
+/*
+ * copydb_eta_monitor samples the progress of the workers until they are done
+ * or we're asked to stop, and logs the estimated completion time every
+ * --eta-interval seconds.
+ */
+static bool
+copydb_eta_monitor(CopyDataSpec *specs)
+{
+	ProgressArea *progress = specs->progress;
+	EtaMonitor monitor = { 0 };
+
+	(void) copydb_eta_init(specs, &monitor);
+
+	uint64_t intervalMs = (uint64_t) specs->etaInterval * 1000;
+
+	while (!progress->closed)
+	{
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			break;
+		}
+
+		log_flush();
+
+		pg_usleep(ETA_SAMPLE_INTERVAL_MS * 1000);
+
+		uint64_t nowMs = copydb_eta_elapsed_ms(&monitor);
+
+		(void) copydb_eta_sample(specs, &monitor, nowMs);
+
+		if (nowMs - monitor.lastLogMs >= intervalMs && monitor.copyMeasured)
+		{
+			EtaEstimate estimate = { 0 };
+
+			(void) copydb_eta_estimate(specs, &monitor, nowMs, &estimate);
+			(void) copydb_eta_log(specs, &monitor, &estimate);
+
+			progress->etaTime = time(NULL) + estimate.totalMs / 1000;
+			monitor.lastLogMs = nowMs;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_eta_init computes the totals that don't change during the run: the
+ * size of the COPY jobs, of the indexes, of the tables to vacuum, and of the
+ * referencing tables of the foreign keys.
+ */
+static void
+copydb_eta_init(CopyDataSpec *specs, EtaMonitor *monitor)
+{
+	CopyTableDataSpecsArray *tableSpecsArray = &(specs->tableSpecsArray);
+	CopyTableQueue *queue = specs->tableQueue;
+
+	INSTR_TIME_SET_CURRENT(monitor->startTime);
+
+	for (int i = 0; i < queue->count; i++)
+	{
+		CopyTableDataSpec *tableSpecs =
+			&(tableSpecsArray->array[queue->array[i]]);
+
+		monitor->copyTotalBytes += copydb_eta_job_bytes(tableSpecs);
+	}
+
+	/* copy table-data may list the indexes only to COPY in their order */
+	if (specs->section == DATA_SECTION_INDEXES ||
+		specs->section == DATA_SECTION_ALL)
+	{
+		monitor->indexTotalCount = specs->sourceIndexArray.count;
+
+		for (int i = 0; i < specs->sourceIndexArray.count; i++)
+		{
+			SourceIndex *index = &(specs->sourceIndexArray.array[i]);
+
+			monitor->indexTotalBytes +=
+				index->indexBytes > 0 ? index->indexBytes : 0;
+		}
+	}
+
+	/* each table is vacuumed once, count the first part only */
+	if (specs->vacuumJobs > 0 &&
+		(specs->section == DATA_SECTION_VACUUM ||
+		 specs->section == DATA_SECTION_ALL))
+	{
+		for (int i = 0; i < tableSpecsArray->count; i++)
+		{
+			CopyTableDataSpec *tableSpecs = &(tableSpecsArray->array[i]);
+			SourceTable *table = tableSpecs->sourceTable;
+
+			if (tableSpecs->part.partNumber == 0 && table->bytes > 0 &&
+				!tableSpecs->unchanged)
+			{
+				monitor->vacuumTotalBytes += table->bytes;
+			}
+		}
+	}
+
+	monitor->fkeyBytes = copydb_eta_fkey_bytes(specs);
+}
+
+
+/*
+ * copydb_eta_fkey_bytes returns the sum of the on-disk size of the
+ * referencing table of each foreign key: VALIDATE CONSTRAINT scans it.
+ */
+static uint64_t
+copydb_eta_fkey_bytes(CopyDataSpec *specs)
+{
+	CopyTableDataSpecsArray *tableSpecsArray = &(specs->tableSpecsArray);
+	SourceForeignKeyArray *fkeyArray = &(specs->sourceFkeyArray);
+
+	if (fkeyArray->count == 0 || tableSpecsArray->count == 0)
+	{
+		return 0;
+	}
+
+	SourceTable **tables =
+		(SourceTable **) calloc(tableSpecsArray->count, sizeof(SourceTable *));
+
+	if (tables == NULL)
+	{
+		log_warn("Failed to allocate memory, "
+				 "the ETA does not account for the foreign keys");
+		return 0;
+	}
+
+	for (int i = 0; i < tableSpecsArray->count; i++)
+	{
+		tables[i] = tableSpecsArray->array[i].sourceTable;
+	}
+
+	qsort(tables, tableSpecsArray->count, sizeof(SourceTable *),
+		  copydb_eta_compare_tables);
+
+	uint64_t bytes = 0;
+
+	for (int i = 0; i < fkeyArray->count; i++)
+	{
+		SourceForeignKey *fkey = &(fkeyArray->array[i]);
+
+		if (!fkey->isValidated)
+		{
+			continue;
+		}
+
+		SourceTable key = { .oid = fkey->tableOid };
+		SourceTable *keyPtr = &key;
+
+		SourceTable **found =
+			(SourceTable **) bsearch(&keyPtr, tables,
+									 tableSpecsArray->count,
+									 sizeof(SourceTable *),
+									 copydb_eta_compare_tables);
+
+		if (found != NULL && (*found)->bytes > 0)
+		{
+			bytes += (*found)->bytes;
+		}
+	}
+
+	free(tables);
+
+	return bytes;
+}
+
+
+/*
+ * copydb_eta_compare_tables sorts an array of SourceTable pointers by oid.
+ */
+static int
+copydb_eta_compare_tables(const void *a, const void *b)
+{
+	const SourceTable *ta = *(SourceTable *const *) a;
+	const SourceTable *tb = *(SourceTable *const *) b;
+
+	if (ta->oid != tb->oid)
+	{
+		return ta->oid < tb->oid ? -1 : 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * copydb_eta_sample updates the live COPY throughput of the table workers,
+ * from the COPY progress since the previous sample.
+ */
+static void
+copydb_eta_sample(CopyDataSpec *specs, EtaMonitor *monitor, uint64_t nowMs)
+{
+	CopyTableDataSpecsArray *tableSpecsArray = &(specs->tableSpecsArray);
+	CopyTableQueue *queue = specs->tableQueue;
+	ProgressArea *progress = specs->progress;
+
+	int next = queue->next < queue->count ? queue->next : queue->count;
+
+	/* the jobs that the table workers have not fetched yet */
+	uint64_t remainingBytes = 0;
+
+	for (int i = next; i < queue->count; i++)
+	{
+		CopyTableDataSpec *tableSpecs =
+			&(tableSpecsArray->array[queue->array[i]]);
+
+		remainingBytes += copydb_eta_job_bytes(tableSpecs);
+	}
+
+	/* and what's left of the jobs in progress */
+	int busyWorkers = 0;
+
+	for (int i = 0; i < progress->tableWorkers; i++)
+	{
+		ProgressSlot *slot = &(progress->slots[i]);
+
+		if (slot->step != PROGRESS_STEP_COPY)
+		{
+			continue;
+		}
+
+		++busyWorkers;
+
+		/* the rows count is a better measure than COPY bytes when known */
+		double done =
+			slot->estimatedRows > 0
+			? (double) slot->stats.rows / slot->estimatedRows
+			: slot->estimatedBytes > 0
+			? (double) slot->stats.bytes / slot->estimatedBytes
+			: 0.0;
+
+		if (done > 1.0)
+		{
+			done = 1.0;
+		}
+
+		remainingBytes += (uint64_t) (slot->estimatedBytes * (1.0 - done));
+	}
+
+	uint64_t doneBytes = monitor->copyTotalBytes > remainingBytes
+						 ? monitor->copyTotalBytes - remainingBytes
+						 : 0;
+
+	uint64_t durationMs = nowMs - monitor->lastSampleMs;
+
+	if (durationMs > 0 && busyWorkers > 0)
+	{
+		double bytesPerMs = doneBytes > monitor->copyDoneBytes
+							? (double) (doneBytes - monitor->copyDoneBytes) /
+							  durationMs
+							: 0.0;
+
+		if (monitor->copyMeasured)
+		{
+			monitor->copyBytesPerMs =
+				ETA_RATE_SMOOTHING * bytesPerMs +
+				(1.0 - ETA_RATE_SMOOTHING) * monitor->copyBytesPerMs;
+		}
+		else if (bytesPerMs > 0.0)
+		{
+			monitor->copyBytesPerMs = bytesPerMs;
+			monitor->copyMeasured = true;
+		}
+
+		monitor->copyBusyWorkers = busyWorkers;
+	}
+
+	/* once all the tables are copied, the ETA is about the indexes */
+	if (next >= queue->count && busyWorkers == 0)
+	{
+		monitor->copyMeasured = true;
+	}
+
+	if (!monitor->indexStarted && specs->indexQueue->next > 0)
+	{
+		monitor->indexStartMs = nowMs;
+		monitor->indexStarted = true;
+	}
+
+	monitor->copyDoneBytes = doneBytes;
+	monitor->lastSampleMs = nowMs;
+}
+
+
+/*
+ * copydb_eta_estimate computes how long the remaining COPY, CREATE INDEX,
+ * VACUUM and foreign keys steps are expected to take.
+ */
+static void
+copydb_eta_estimate(CopyDataSpec *specs,
+					EtaMonitor *monitor,
+					uint64_t nowMs,
+					EtaEstimate *estimate)
+{
+	CopyTableDataSpecsArray *tableSpecsArray = &(specs->tableSpecsArray);
+	CopyTableQueue *queue = specs->tableQueue;
+	CopyIndexQueue *indexQueue = specs->indexQueue;
+	CopyVacuumQueue *vacuumQueue = specs->vacuumQueue;
+	ProgressArea *progress = specs->progress;
+
+	int next = queue->next < queue->count ? queue->next : queue->count;
+
+	/*
+	 * COPY: all the workers together go at copyBytesPerMs, and a single
+	 * worker goes at its share of it, which bounds the duration of the
+	 * largest job that's left.
+	 */
+	uint64_t largestJobBytes = 0;
+
+	estimate->copyRemainingBytes =
+		monitor->copyTotalBytes - monitor->copyDoneBytes;
+	estimate->copyRemainingJobs = queue->count - next;
+
+	for (int i = next; i < queue->count; i++)
+	{
+		uint64_t bytes =
+			copydb_eta_job_bytes(&(tableSpecsArray->array[queue->array[i]]));
+
+		if (bytes > largestJobBytes)
+		{
+			largestJobBytes = bytes;
+		}
+	}
+
+	for (int i = 0; i < progress->tableWorkers; i++)
+	{
+		if (progress->slots[i].step == PROGRESS_STEP_COPY)
+		{
+			++estimate->copyRemainingJobs;
+		}
+	}
+
+	double copyRate = monitor->copyBytesPerMs;
+	int workers = monitor->copyBusyWorkers > 0 ? monitor->copyBusyWorkers : 1;
+
+	if (copyRate > 0.0)
+	{
+		uint64_t allMs = estimate->copyRemainingBytes / copyRate;
+		uint64_t lastMs = largestJobBytes / (copyRate / workers);
+
+		estimate->copyMs = allMs > lastMs ? allMs : lastMs;
+	}
+
+	/* the catalog estimates are scaled like the live COPY throughput */
+	double scale = 1.0;
+
+	if (copyRate > 0.0 && monitor->copyBusyWorkers > 0)
+	{
+		scale = (double) ESTIMATE_COPY_BYTES_PER_MS / (copyRate / workers);
+
+		scale = scale < ETA_MIN_SCALE ? ETA_MIN_SCALE
+				: scale > ETA_MAX_SCALE ? ETA_MAX_SCALE
+				: scale;
+	}
+
+	/*
+	 * CREATE INDEX: the jobs that the index workers have fetched are
+	 * counted as done, that's close enough with many indexes.
+	 */
+	int indexNext =
+		indexQueue->next < indexQueue->count ? indexQueue->next : indexQueue->count;
+
+	uint64_t indexDoneBytes = 0;
+
+	for (int i = 0; i < indexNext; i++)
+	{
+		int64_t bytes = indexQueue->array[i].index.indexBytes;
+
+		indexDoneBytes += bytes > 0 ? bytes : 0;
+	}
+
+	uint64_t indexRemainingBytes = monitor->indexTotalBytes > indexDoneBytes
+								   ? monitor->indexTotalBytes - indexDoneBytes
+								   : 0;
+
+	estimate->indexRemaining = monitor->indexTotalCount > indexNext
+							   ? monitor->indexTotalCount - indexNext
+							   : 0;
+
+	int indexWorkers = indexQueue->workerCount > 0 ? indexQueue->workerCount : 1;
+	double indexRate =
+		(double) ESTIMATE_INDEX_BYTES_PER_MS * indexWorkers / scale;
+
+	if (monitor->indexStarted && nowMs > monitor->indexStartMs &&
+		indexDoneBytes > 0)
+	{
+		indexRate = (double) indexDoneBytes / (nowMs - monitor->indexStartMs);
+	}
+
+	if (indexQueue->workerCount > 0 && indexRemainingBytes > 0)
+	{
+		estimate->indexMs = indexRemainingBytes / indexRate;
+	}
+
+	/* the indexes of the last table are built once it's copied */
+	if (estimate->indexRemaining > 0 && estimate->indexMs < estimate->copyMs)
+	{
+		estimate->indexMs = estimate->copyMs;
+	}
+
+	/*
+	 * VACUUM runs once the indexes of the table are built, and the foreign
+	 * keys are validated once all the data and indexes are done.
+	 */
+	uint64_t vacuumDoneBytes = 0;
+	int vacuumNext =
+		vacuumQueue->next < vacuumQueue->count
+		? vacuumQueue->next : vacuumQueue->count;
+
+	for (int i = 0; i < vacuumNext; i++)
+	{
+		int64_t bytes = vacuumQueue->array[i]->sourceTable->bytes;
+
+		vacuumDoneBytes += bytes > 0 ? bytes : 0;
+	}
+
+	uint64_t vacuumRemainingBytes =
+		monitor->vacuumTotalBytes > vacuumDoneBytes
+		? monitor->vacuumTotalBytes - vacuumDoneBytes
+		: 0;
+
+	int vacuumJobs = specs->vacuumJobs > 0 ? specs->vacuumJobs : 1;
+	int fkeyJobs = specs->indexJobs > 0 ? specs->indexJobs : 1;
+
+	uint64_t vacuumMs =
+		specs->analyzeOnly
+		? 0
+		: vacuumRemainingBytes * scale / ESTIMATE_VACUUM_BYTES_PER_MS / vacuumJobs;
+
+	uint64_t fkeyMs =
+		monitor->fkeyBytes * scale / ESTIMATE_VACUUM_BYTES_PER_MS / fkeyJobs;
+
+	uint64_t dataMs =
+		estimate->indexMs > estimate->copyMs ? estimate->indexMs : estimate->copyMs;
+
+	/* VACUUM overlaps with the index builds of the other tables */
+	estimate->postDataMs = (vacuumMs > dataMs ? vacuumMs - dataMs : 0) + fkeyMs;
+	estimate->totalMs = dataMs + estimate->postDataMs;
+}
+
+
+/*
+ * copydb_eta_log logs the estimated completion time, and how long each of
+ * the remaining steps is expected to take.
+ */
+static void
+copydb_eta_log(CopyDataSpec *specs, EtaMonitor *monitor, EtaEstimate *estimate)
+{
+	time_t eta = time(NULL) + estimate->totalMs / 1000;
+	struct tm tm = { 0 };
+	char etaString[BUFSIZE] = { 0 };
+
+	if (localtime_r(&eta, &tm) == NULL ||
+		strftime(etaString, sizeof(etaString), "%Y-%m-%d %H:%M:%S", &tm) == 0)
+	{
+		strlcpy(etaString, "unknown", sizeof(etaString));
+	}
+
+	char totalMs[BUFSIZE] = { 0 };
+	char copyMs[BUFSIZE] = { 0 };
+	char indexMs[BUFSIZE] = { 0 };
+	char postDataMs[BUFSIZE] = { 0 };
+	char remaining[BUFSIZE] = { 0 };
+	char total[BUFSIZE] = { 0 };
+
+	(void) IntervalToString(estimate->totalMs, totalMs, sizeof(totalMs));
+	(void) IntervalToString(estimate->copyMs, copyMs, sizeof(copyMs));
+	(void) IntervalToString(estimate->indexMs, indexMs, sizeof(indexMs));
+	(void) IntervalToString(estimate->postDataMs, postDataMs,
+							sizeof(postDataMs));
+
+	(void) pretty_print_bytes(remaining, sizeof(remaining),
+							  estimate->copyRemainingBytes);
+	(void) pretty_print_bytes(total, sizeof(total), monitor->copyTotalBytes);
+
+	log_info("ETA %s, in %s: "
+			 "COPY %s of %s left in %d jobs at %.1f MB/s, %s; "
+			 "CREATE INDEX %d of %d left, %s; "
+			 "VACUUM and foreign keys %s",
+			 etaString,
+			 totalMs,
+			 remaining,
+			 total,
+			 estimate->copyRemainingJobs,
+			 monitor->copyBytesPerMs * 1000.0 / (1024 * 1024),
+			 copyMs,
+			 estimate->indexRemaining,
+			 monitor->indexTotalCount,
+			 indexMs,
+			 postDataMs);
+}
+
+
+/*
+ * copydb_eta_job_bytes returns the on-disk size of the given table part.
+ */
+static uint64_t
+copydb_eta_job_bytes(CopyTableDataSpec *tableSpecs)
+{
+	SourceTable *table = tableSpecs->sourceTable;
+	int partCount = tableSpecs->part.partCount > 0 ? tableSpecs->part.partCount : 1;
+
+	return table->bytes > 0 ? table->bytes / partCount : 0;
+}
+
+
+/*
+ * copydb_eta_elapsed_ms returns the milliseconds elapsed since the monitor
+ * started.
+ */
+static uint64_t
+copydb_eta_elapsed_ms(EtaMonitor *monitor)
+{
+	instr_time duration;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, monitor->startTime);
+
+	return INSTR_TIME_GET_MILLISEC(duration);
+}
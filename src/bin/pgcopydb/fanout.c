@@ -0,0 +1,284 @@
+/*
+ * src/bin/pgcopydb/fanout.c
+ *     Implementation of a CLI to copy a database between two Postgres instances
+ */
+
+#include <errno.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "copydb.h"
+#include "file_utils.h"
+#include "log.h"
+#include "signals.h"
+
+
+typedef enum
+{
+	FANOUT_PHASE_PREPARE_SCHEMA = 0,
+	FANOUT_PHASE_FINALIZE_SCHEMA
+} FanoutPhase;
+
+
+static bool copydb_fanout_start(CopyDataSpec *specs,
+								FanoutPhase phase,
+								TableDataProcess *array);
+static bool copydb_fanout_worker(CopyDataSpec *specs,
+								 int fanoutIndex,
+								 FanoutPhase phase);
+static bool copydb_fanout_init_specs(CopyDataSpec *specs,
+									 int fanoutIndex,
+									 CopyDataSpec *fanoutSpecs);
+
+
+/*
+ * copydb_fanout_prepare_schema restores the whole pre-data section on each
+ * --fanout-target, in parallel, and waits until that's done. The table
+ * workers send their COPY data to the extra targets too, so all the tables
+ * must exist there before the first COPY starts.
+ *
+ * The main target still uses the streaming pre-data restore, see
+ * copydb_start_target_prepare_schema(), which makes progress while we wait.
+ */
+bool
+copydb_fanout_prepare_schema(CopyDataSpec *specs)
+{
+	TableDataProcess array[MAX_FANOUT_TARGETS] = { 0 };
+
+	if (specs->fanoutCount == 0)
+	{
+		return true;
+	}
+
+	log_info("Restoring the pre-data section to %d fan-out targets",
+			 specs->fanoutCount);
+
+	if (!copydb_fanout_start(specs, FANOUT_PHASE_PREPARE_SCHEMA, array))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	return copydb_wait_for_processes(array, specs->fanoutCount);
+}
+
+
+/*
+ * copydb_fanout_finalize_schema copies the large objects, creates the indexes
+ * and constraints, resets the sequences, and restores the post-data section
+ * on each --fanout-target, in parallel, and waits until that's done.
+ *
+ * The tables are not vacuumed on the extra targets.
+ */
+bool
+copydb_fanout_finalize_schema(CopyDataSpec *specs)
+{
+	TableDataProcess array[MAX_FANOUT_TARGETS] = { 0 };
+
+	if (specs->fanoutCount == 0)
+	{
+		return true;
+	}
+
+	log_info("Creating indexes and constraints, resetting sequences, and "
+			 "restoring the post-data section on %d fan-out targets",
+			 specs->fanoutCount);
+
+	if (!copydb_fanout_start(specs, FANOUT_PHASE_FINALIZE_SCHEMA, array))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	return copydb_wait_for_processes(array, specs->fanoutCount);
+}
+
+
+/*
+ * copydb_fanout_start forks a sub-process per --fanout-target that runs the
+ * given phase, and registers the sub-processes in the given array.
+ */
+static bool
+copydb_fanout_start(CopyDataSpec *specs,
+					FanoutPhase phase,
+					TableDataProcess *array)
+{
+	for (int i = 0; i < specs->fanoutCount; i++)
+	{
+		/* Flush stdio channels just before fork, to avoid double-output problems */
+		fflush(stdout);
+		fflush(stderr);
+
+		int fpid = fork();
+
+		switch (fpid)
+		{
+			case -1:
+			{
+				log_error("Failed to fork a fan-out target process: %m");
+
+				/* wait for the sub-processes that we started already */
+				(void) copydb_wait_for_processes(array, i);
+
+				return false;
+			}
+
+			case 0:
+			{
+				/* child process runs the command */
+				if (!copydb_fanout_worker(specs, i, phase))
+				{
+					/* errors have already been logged */
+					exit(EXIT_CODE_INTERNAL_ERROR);
+				}
+
+				exit(EXIT_CODE_QUIT);
+			}
+
+			default:
+			{
+				/* fork succeeded, in parent */
+				array[i].pid = fpid;
+				break;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_fanout_worker runs the given phase for the given --fanout-target,
+ * using the same routines as for the main target, from a CopyDataSpec of its
+ * own.
+ */
+static bool
+copydb_fanout_worker(CopyDataSpec *specs, int fanoutIndex, FanoutPhase phase)
+{
+	CopyDataSpec fanoutSpecs = { 0 };
+
+	if (!copydb_fanout_init_specs(specs, fanoutIndex, &fanoutSpecs))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	switch (phase)
+	{
+		case FANOUT_PHASE_PREPARE_SCHEMA:
+		{
+			return copydb_target_prepare_schema(&fanoutSpecs);
+		}
+
+		case FANOUT_PHASE_FINALIZE_SCHEMA:
+		{
+			/* large objects are not part of the fan-out COPY stream */
+			if (!copydb_copy_all_large_objects(&fanoutSpecs))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+
+			/* re-use the table workers to queue the index jobs */
+			fanoutSpecs.section = DATA_SECTION_INDEXES;
+
+			if (!copydb_copy_all_table_data(&fanoutSpecs))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+
+			fanoutSpecs.section = DATA_SECTION_ALL;
+
+			if (!copydb_copy_all_sequences(&fanoutSpecs))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+
+			return copydb_target_finalize_schema(&fanoutSpecs);
+		}
+
+		default:
+		{
+			log_error("BUG: unknown fan-out phase %d", phase);
+			return false;
+		}
+	}
+}
+
+
+/*
+ * copydb_fanout_init_specs prepares a CopyDataSpec for the given
+ * --fanout-target from the main one. The schema dump files are shared, and
+ * each extra target gets its own work directory, where the index workers
+ * track their progress and where the post.list file is written.
+ */
+static bool
+copydb_fanout_init_specs(CopyDataSpec *specs,
+						 int fanoutIndex,
+						 CopyDataSpec *fanoutSpecs)
+{
+	char dir[MAXPGPATH] = { 0 };
+
+	*fanoutSpecs = *specs;
+
+	strlcpy(fanoutSpecs->target_pguri,
+			specs->fanoutTargets[fanoutIndex],
+			sizeof(fanoutSpecs->target_pguri));
+
+	fanoutSpecs->fanoutCount = 0;
+	fanoutSpecs->sourceReplicaCount = 0;
+
+	sformat(dir, sizeof(dir), "%s/fanout/%d",
+			specs->cfPaths.topdir,
+			fanoutIndex + 1);
+
+	if (!copydb_init_workdir(&(fanoutSpecs->cfPaths), dir, false))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	journal_init(&(fanoutSpecs->journal),
+				 fanoutSpecs->cfPaths.journalfile,
+				 fanoutSpecs->stateFiles ? fanoutSpecs->cfPaths.idxdir : NULL);
+
+	sformat(fanoutSpecs->dumpPaths.listFilename, MAXPGPATH, "%s/%s",
+			fanoutSpecs->cfPaths.schemadir, "post.list");
+
+	sformat(fanoutSpecs->dumpPaths.preListFilename, MAXPGPATH, "%s/%s",
+			fanoutSpecs->cfPaths.schemadir, "pre.list");
+
+	sformat(fanoutSpecs->dumpPaths.preDoneFilename, MAXPGPATH, "%s/%s",
+			fanoutSpecs->cfPaths.schemadir, "pre.done");
+
+	sformat(fanoutSpecs->dumpPaths.preRestoredFilename, MAXPGPATH, "%s/%s",
+			fanoutSpecs->cfPaths.schemadir, "pre.restored");
+
+	/*
+	 * The main process releases the source snapshot as soon as the COPY are
+	 * done, so the catalogs are listed in a transaction of our own.
+	 */
+	fanoutSpecs->sourceSnapshot.state = SNAPSHOT_STATE_SKIPPED;
+
+	PreDataRestore preDataRestore = { 0 };
+	SourceIndexArray sourceIndexArray = { 0 };
+	SourceForeignKeyArray sourceFkeyArray = { 0 };
+	CopyTableDataSpecsArray tableSpecsArray = { 0 };
+
+	fanoutSpecs->preDataRestore = preDataRestore;
+	fanoutSpecs->sourceIndexArray = sourceIndexArray;
+	fanoutSpecs->sourceFkeyArray = sourceFkeyArray;
+	fanoutSpecs->tableSpecsArray = tableSpecsArray;
+	fanoutSpecs->tableQueue = NULL;
+	fanoutSpecs->indexQueue = NULL;
+	fanoutSpecs->vacuumQueue = NULL;
+
+	log_info("[FANOUT %d] Using target \"%s\"",
+			 fanoutIndex + 1,
+			 fanoutSpecs->target_pguri);
+
+	return true;
+}
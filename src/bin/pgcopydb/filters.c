@@ -0,0 +1,1167 @@
+/*
+ * src/bin/pgcopydb/filters.c
+ *     Restrict the copy to a subset of the source tables, and sample rows
+ *
+ * The --include-schema, --exclude-schema, --include-table, --exclude-table
+ * and --exclude-tables-larger-than options select the tables to copy. The
+ * tables that are excluded are listed from the source database, together with
+ * the objects that can't be restored without them, see
+ * schema_list_filtered_objects(). That list is then used to filter both the
+ * table list of the data section, and the pg_restore --use-list files of the
+ * pre-data and post-data sections.
+ *
+ * Some archive entries have no object OID, such as the COMMENT, ACL and
+ * SECURITY LABEL entries, or the SEQUENCE OWNED BY and TABLE ATTACH ones.
+ * Those are matched by name, using the restoreListName of the entry, which
+ * contains the schema name and the tag that pg_dump uses for them: TABLE
+ * name, COLUMN name.column, or the plain name of the object.
+ *
+ * The --table-sample option copies only a part of the rows of some tables,
+ * using COPY (SELECT * FROM table TABLESAMPLE SYSTEM (percent)). The foreign
+ * keys that reference a sampled table are then left NOT VALID on the target.
+ */
+
+#include <ctype.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+
+#include "copydb.h"
+#include "log.h"
+#include "pgsql.h"
+#include "schema.h"
+#include "string_utils.h"
+
+
+static bool copydb_parse_filter_entries(const char *str,
+										const char *option,
+										char entries[][BUFSIZE],
+										int *count);
+static bool copydb_schema_is_included(TableFilters *filters,
+									  const char *nspname);
+static bool copydb_table_matches(TableFilterList *list,
+								 const char *nspname,
+								 const char *relname);
+static bool copydb_table_pattern_matches(const char *pattern,
+										 const char *nspname,
+										 const char *relname);
+static bool copydb_relation_is_included(TableFilters *filters,
+										SourceRelation *relation);
+static double copydb_table_sample_percent(TableFilters *filters,
+										  SourceTable *table);
+static bool copydb_prepare_filter_keys(TableFilters *filters);
+static bool copydb_add_filter_key(char **keys, int *count, const char *key);
+static char * copydb_relkind_tag(char relkind);
+static bool copydb_filter_key_matches(char **keys, int count,
+									  const char *name);
+static bool copydb_object_is_filtered_out(TableFilters *filters,
+										  uint32_t catalogOid,
+										  uint32_t objectOid);
+static int copydb_compare_filtered_object(const void *a, const void *b);
+static int copydb_compare_filter_key(const void *a, const void *b);
+static int copydb_compare_oid(const void *a, const void *b);
+
+
+/*
+ * The desc of the archive entries that have no object OID, and that are
+ * tagged with the kind of object and its name, such as TABLE name.
+ */
+static char *filterTagDescs[] = {
+	"COMMENT",
+	"ACL",
+	"SECURITY LABEL",
+	NULL
+};
+
+/*
+ * The desc of the archive entries that have no object OID, and that are
+ * tagged with the plain name of the relation they apply to.
+ */
+static char *filterNameDescs[] = {
+	"SEQUENCE OWNED BY",
+	"TABLE ATTACH",
+	"INDEX ATTACH",
+	"ROW SECURITY",
+	NULL
+};
+
+
+/*
+ * copydb_parse_filter_patterns parses a comma separated list of patterns, as
+ * given to --include-schema, --exclude-schema, --include-table, or
+ * --exclude-table.
+ */
+bool
+copydb_parse_filter_patterns(const char *str, TableFilterList *list)
+{
+	char entries[MAX_TABLE_FILTER_PATTERNS][BUFSIZE] = { 0 };
+	int count = 0;
+
+	list->count = 0;
+
+	if (!copydb_parse_filter_entries(str, "table filter", entries, &count))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		if (strlen(entries[i]) >= sizeof(list->array[i]))
+		{
+			log_error("Failed to parse table filter \"%s\": "
+					  "patterns are limited to %d bytes",
+					  entries[i],
+					  (int) sizeof(list->array[i]) - 1);
+			return false;
+		}
+
+		strlcpy(list->array[list->count++], entries[i], sizeof(list->array[i]));
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_parse_table_sample parses a comma separated list of table samples,
+ * as given to --table-sample, where each entry is [pattern=]percent. An entry
+ * without a pattern applies to all the tables.
+ */
+bool
+copydb_parse_table_sample(const char *str, TableSampleList *list)
+{
+	char entries[MAX_TABLE_FILTER_PATTERNS][BUFSIZE] = { 0 };
+	int count = 0;
+
+	list->count = 0;
+
+	if (!copydb_parse_filter_entries(str, "table sample", entries, &count))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		TableSample *sample = &(list->array[list->count]);
+		char *entry = entries[i];
+		char *percent = entry;
+		char *sep = strrchr(entry, '=');
+
+		if (sep != NULL)
+		{
+			*sep = '\0';
+			percent = sep + 1;
+
+			if (strlen(entry) >= sizeof(sample->pattern))
+			{
+				log_error("Failed to parse table sample \"%s\": "
+						  "patterns are limited to %d bytes",
+						  entry,
+						  (int) sizeof(sample->pattern) - 1);
+				return false;
+			}
+
+			strlcpy(sample->pattern, entry, sizeof(sample->pattern));
+		}
+		else
+		{
+			sample->pattern[0] = '\0';
+		}
+
+		if (!stringToDouble(percent, &(sample->percent)) ||
+			sample->percent <= 0.0 ||
+			sample->percent > 100.0)
+		{
+			log_error("Failed to parse table sample percentage \"%s\": "
+					  "expected a number greater than 0 and up to 100",
+					  percent);
+			return false;
+		}
+
+		++list->count;
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_parse_filter_entries splits a comma separated list of entries, and
+ * skips empty entries, such as with a trailing comma.
+ */
+static bool
+copydb_parse_filter_entries(const char *str,
+							const char *option,
+							char entries[][BUFSIZE],
+							int *count)
+{
+	char buffer[BUFSIZE] = { 0 };
+
+	*count = 0;
+
+	if (strlcpy(buffer, str, sizeof(buffer)) >= sizeof(buffer))
+	{
+		log_error("Failed to parse %s: string is longer than %d bytes",
+				  option,
+				  BUFSIZE - 1);
+		return false;
+	}
+
+	char *ptr = buffer;
+
+	while (ptr != NULL)
+	{
+		char *next = strchr(ptr, ',');
+
+		if (next != NULL)
+		{
+			*next = '\0';
+			++next;
+		}
+
+		while (isspace((unsigned char) *ptr))
+		{
+			++ptr;
+		}
+
+		/* trim trailing spaces too */
+		int len = strlen(ptr);
+
+		while (len > 0 && isspace((unsigned char) ptr[len - 1]))
+		{
+			ptr[--len] = '\0';
+		}
+
+		if (*ptr != '\0')
+		{
+			if (*count == MAX_TABLE_FILTER_PATTERNS)
+			{
+				log_error("Failed to parse %s: pgcopydb supports up to "
+						  "%d entries",
+						  option,
+						  MAX_TABLE_FILTER_PATTERNS);
+				return false;
+			}
+
+			strlcpy(entries[(*count)++], ptr, BUFSIZE);
+		}
+
+		ptr = next;
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_init_table_filters parses the table filters and sampling options.
+ */
+bool
+copydb_init_table_filters(TableFilters *filters, CopyDBOptions *options)
+{
+	*filters = (TableFilters) { 0 };
+
+	if (!copydb_parse_filter_patterns(options->includeSchema,
+									  &(filters->includeSchema)) ||
+		!copydb_parse_filter_patterns(options->excludeSchema,
+									  &(filters->excludeSchema)) ||
+		!copydb_parse_filter_patterns(options->includeTable,
+									  &(filters->includeTable)) ||
+		!copydb_parse_filter_patterns(options->excludeTable,
+									  &(filters->excludeTable)) ||
+		!copydb_parse_table_sample(options->tableSample,
+								   &(filters->tableSample)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	filters->excludeTablesLargerThan = options->excludeTablesLargerThan;
+
+	strlcpy(filters->excludeTablesLargerThanPretty,
+			options->excludeTablesLargerThanPretty,
+			sizeof(filters->excludeTablesLargerThanPretty));
+
+	return true;
+}
+
+
+/*
+ * copydb_has_table_filters returns true when some tables might be excluded
+ * from the copy.
+ */
+bool
+copydb_has_table_filters(TableFilters *filters)
+{
+	return filters->includeSchema.count > 0 ||
+		   filters->excludeSchema.count > 0 ||
+		   filters->includeTable.count > 0 ||
+		   filters->excludeTable.count > 0 ||
+		   filters->excludeTablesLargerThan > 0;
+}
+
+
+/*
+ * copydb_prepare_table_filters lists the tables that the filters exclude, and
+ * the objects that depend on them, from the source database. This is done
+ * once, before the pre-data section is restored, and our sub-processes
+ * inherit the lists at fork() time.
+ *
+ * When pgsql is NULL, a connection to the source database is opened in the
+ * source snapshot, and closed before returning.
+ */
+bool
+copydb_prepare_table_filters(CopyDataSpec *specs, PGSQL *pgsql)
+{
+	TableFilters *filters = &(specs->filters);
+
+	if (filters->prepared || !copydb_has_table_filters(filters))
+	{
+		return true;
+	}
+
+	PGSQL src = { 0 };
+	PGSQL *source = pgsql;
+
+	if (source == NULL)
+	{
+		source = &src;
+
+		if (!pgsql_init(source, specs->source_pguri, PGSQL_CONN_SOURCE) ||
+			!copydb_set_snapshot(&(specs->sourceSnapshot), source))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	SourceRelationArray relationArray = { 0, NULL };
+
+	if (!schema_list_filter_relations(source, &relationArray))
+	{
+		/* errors have already been logged */
+		if (source == &src)
+		{
+			pgsql_finish(source);
+		}
+		return false;
+	}
+
+	uint32_t *excludedOids =
+		(uint32_t *) calloc(relationArray.count + 1, sizeof(uint32_t));
+	int excludedCount = 0;
+
+	if (excludedOids == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		free(relationArray.array);
+		if (source == &src)
+		{
+			pgsql_finish(source);
+		}
+		return false;
+	}
+
+	for (int i = 0; i < relationArray.count; i++)
+	{
+		SourceRelation *relation = &(relationArray.array[i]);
+
+		if (!copydb_relation_is_included(filters, relation))
+		{
+			log_debug("Excluding table \"%s\".\"%s\"",
+					  relation->nspname,
+					  relation->relname);
+
+			excludedOids[excludedCount++] = relation->oid;
+		}
+	}
+
+	log_info("Table filters exclude %d of the %d tables of \"%s\"",
+			 excludedCount,
+			 relationArray.count,
+			 specs->source_pguri);
+
+	bool success = true;
+
+	if (excludedCount > 0)
+	{
+		success = schema_list_filtered_objects(source,
+											   excludedOids,
+											   excludedCount,
+											   &(filters->excluded));
+	}
+
+	free(excludedOids);
+	free(relationArray.array);
+
+	if (source == &src)
+	{
+		pgsql_finish(source);
+	}
+
+	if (!success)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (filters->excluded.count > 1)
+	{
+		qsort(filters->excluded.array,
+			  filters->excluded.count,
+			  sizeof(SourceFilteredObject),
+			  copydb_compare_filtered_object);
+	}
+
+	if (!copydb_prepare_filter_keys(filters))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("Table filters exclude %d objects from the schema",
+			 filters->excluded.count);
+
+	filters->prepared = true;
+
+	return true;
+}
+
+
+/*
+ * copydb_filter_source_catalogs removes the tables that the filters exclude
+ * from the given table array, and the indexes and foreign keys that depend
+ * on them from the source catalogs. It also sets the sampling percentage of
+ * each table, see --table-sample.
+ */
+bool
+copydb_filter_source_catalogs(CopyDataSpec *specs,
+							  PGSQL *pgsql,
+							  SourceTableArray *tableArray)
+{
+	TableFilters *filters = &(specs->filters);
+
+	if (!copydb_prepare_table_filters(specs, pgsql))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	uint32_t pgClassOid = PG_CLASS_OID;
+	uint32_t pgConstraintOid = PG_CONSTRAINT_OID;
+
+	int tableCount = 0;
+
+	free(filters->sampledOids);
+	filters->sampledOids = NULL;
+	filters->sampledCount = 0;
+
+	for (int i = 0; i < tableArray->count; i++)
+	{
+		SourceTable *table = &(tableArray->array[i]);
+
+		if (copydb_object_is_filtered_out(filters, pgClassOid, table->oid))
+		{
+			continue;
+		}
+
+		table->samplePercent = copydb_table_sample_percent(filters, table);
+
+		if (table->samplePercent > 0.0)
+		{
+			log_info("Table \"%s\".\"%s\" is copied using "
+					 "TABLESAMPLE SYSTEM (%g)",
+					 table->nspname,
+					 table->relname,
+					 table->samplePercent);
+
+			++filters->sampledCount;
+		}
+
+		/* the array is sorted, compact it in place */
+		tableArray->array[tableCount++] = *table;
+	}
+
+	if (tableCount < tableArray->count)
+	{
+		log_info("Copying %d tables out of %d, see the table filters",
+				 tableCount,
+				 tableArray->count);
+	}
+
+	tableArray->count = tableCount;
+
+	if (filters->sampledCount > 0)
+	{
+		filters->sampledOids =
+			(uint32_t *) calloc(filters->sampledCount, sizeof(uint32_t));
+
+		if (filters->sampledOids == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			return false;
+		}
+
+		for (int i = 0, n = 0; i < tableArray->count; i++)
+		{
+			if (tableArray->array[i].samplePercent > 0.0)
+			{
+				filters->sampledOids[n++] = tableArray->array[i].oid;
+			}
+		}
+
+		qsort(filters->sampledOids,
+			  filters->sampledCount,
+			  sizeof(uint32_t),
+			  copydb_compare_oid);
+	}
+
+	if (filters->excluded.count == 0)
+	{
+		return true;
+	}
+
+	/* the other arrays are sorted too, and compacted in place the same way */
+	SourceIndexArray *indexArray = &(specs->sourceIndexArray);
+	int count = 0;
+
+	for (int i = 0; i < indexArray->count; i++)
+	{
+		SourceIndex *index = &(indexArray->array[i]);
+
+		if (!copydb_object_is_filtered_out(filters, pgClassOid, index->indexOid))
+		{
+			indexArray->array[count++] = *index;
+		}
+	}
+
+	indexArray->count = count;
+
+	SourceIndexArray *partArray = &(specs->sourcePartitionedIndexArray);
+	count = 0;
+
+	for (int i = 0; i < partArray->count; i++)
+	{
+		SourceIndex *index = &(partArray->array[i]);
+
+		if (!copydb_object_is_filtered_out(filters, pgClassOid, index->indexOid))
+		{
+			partArray->array[count++] = *index;
+		}
+	}
+
+	partArray->count = count;
+
+	SourceIndexAttachArray *attachArray = &(specs->sourceIndexAttachArray);
+	count = 0;
+
+	for (int i = 0; i < attachArray->count; i++)
+	{
+		SourceIndexAttach *attach = &(attachArray->array[i]);
+
+		if (!copydb_object_is_filtered_out(filters, pgClassOid,
+										   attach->parentOid) &&
+			!copydb_object_is_filtered_out(filters, pgClassOid,
+										   attach->childOid))
+		{
+			attachArray->array[count++] = *attach;
+		}
+	}
+
+	attachArray->count = count;
+
+	SourceForeignKeyArray *fkeyArray = &(specs->sourceFkeyArray);
+	count = 0;
+
+	for (int i = 0; i < fkeyArray->count; i++)
+	{
+		SourceForeignKey *fkey = &(fkeyArray->array[i]);
+
+		if (!copydb_object_is_filtered_out(filters, pgConstraintOid,
+										   fkey->constraintOid))
+		{
+			fkeyArray->array[count++] = *fkey;
+		}
+	}
+
+	fkeyArray->count = count;
+
+	return true;
+}
+
+
+/*
+ * copydb_filter_source_sequences removes the sequences that the filters
+ * exclude, such as the sequences owned by an excluded table, from the given
+ * array.
+ */
+void
+copydb_filter_source_sequences(CopyDataSpec *specs,
+							   SourceSequenceArray *sequenceArray)
+{
+	TableFilters *filters = &(specs->filters);
+
+	if (!filters->prepared || filters->excluded.count == 0)
+	{
+		return;
+	}
+
+	int count = 0;
+
+	for (int i = 0; i < sequenceArray->count; i++)
+	{
+		SourceSequence *seq = &(sequenceArray->array[i]);
+
+		if (!copydb_object_is_filtered_out(filters, PG_CLASS_OID, seq->oid))
+		{
+			sequenceArray->array[count++] = *seq;
+		}
+	}
+
+	if (count < sequenceArray->count)
+	{
+		log_info("Skipping %d sequences that the table filters exclude",
+				 sequenceArray->count - count);
+	}
+
+	sequenceArray->count = count;
+}
+
+
+/*
+ * copydb_archive_item_is_filtered_out returns true when the given pg_restore
+ * archive entry is to be commented out of the --use-list file, because it
+ * creates one of the objects that the table filters exclude, or applies to
+ * one of them.
+ */
+bool
+copydb_archive_item_is_filtered_out(CopyDataSpec *specs,
+									ArchiveContentItem *item)
+{
+	TableFilters *filters = &(specs->filters);
+
+	if (!filters->prepared || filters->excluded.count == 0)
+	{
+		return false;
+	}
+
+	if (item->objectOid != 0)
+	{
+		return copydb_object_is_filtered_out(filters,
+											 item->catalogOid,
+											 item->objectOid);
+	}
+
+	for (int i = 0; filterNameDescs[i] != NULL; i++)
+	{
+		if (streq(item->desc, filterNameDescs[i]))
+		{
+			return copydb_filter_key_matches(filters->nameKeys,
+											 filters->nameKeyCount,
+											 item->restoreListName);
+		}
+	}
+
+	for (int i = 0; filterTagDescs[i] != NULL; i++)
+	{
+		if (!streq(item->desc, filterTagDescs[i]))
+		{
+			continue;
+		}
+
+		if (copydb_filter_key_matches(filters->tagKeys,
+									  filters->tagKeyCount,
+									  item->restoreListName))
+		{
+			return true;
+		}
+
+		/*
+		 * The comments on constraints, triggers, rules and policies are
+		 * tagged "CONSTRAINT name ON table", where the table name is in the
+		 * same schema as the object.
+		 */
+		char *on = NULL;
+
+		for (char *ptr = strstr(item->restoreListName, " ON ");
+			 ptr != NULL;
+			 ptr = strstr(ptr + 1, " ON "))
+		{
+			on = ptr;
+		}
+
+		char *space = strchr(item->restoreListName, ' ');
+
+		if (on == NULL || space == NULL || space >= on)
+		{
+			return false;
+		}
+
+		char name[BUFSIZE] = { 0 };
+
+		sformat(name, sizeof(name), "%.*s TABLE %s",
+				(int) (space - item->restoreListName),
+				item->restoreListName,
+				on + strlen(" ON "));
+
+		return copydb_filter_key_matches(filters->tagKeys,
+										 filters->tagKeyCount,
+										 name);
+	}
+
+	return false;
+}
+
+
+/*
+ * copydb_table_is_sampled returns true when the table with the given oid is
+ * copied using --table-sample.
+ */
+bool
+copydb_table_is_sampled(CopyDataSpec *specs, uint32_t oid)
+{
+	TableFilters *filters = &(specs->filters);
+
+	if (filters->sampledCount == 0)
+	{
+		return false;
+	}
+
+	return bsearch(&oid,
+				   filters->sampledOids,
+				   filters->sampledCount,
+				   sizeof(uint32_t),
+				   copydb_compare_oid) != NULL;
+}
+
+
+/*
+ * copydb_table_sample_clause prepares the TABLESAMPLE clause of the COPY
+ * query of the given table, which is an empty string when the table is not
+ * sampled.
+ */
+char *
+copydb_table_sample_clause(SourceTable *table, char *clause, size_t size)
+{
+	if (table->samplePercent > 0.0)
+	{
+		sformat(clause, size, " TABLESAMPLE SYSTEM (%g)", table->samplePercent);
+	}
+	else
+	{
+		clause[0] = '\0';
+	}
+
+	return clause;
+}
+
+
+/*
+ * copydb_relation_is_included returns true when the table filters select the
+ * given relation.
+ */
+static bool
+copydb_relation_is_included(TableFilters *filters, SourceRelation *relation)
+{
+	if (!copydb_schema_is_included(filters, relation->nspname))
+	{
+		return false;
+	}
+
+	if (filters->includeTable.count > 0 &&
+		!copydb_table_matches(&(filters->includeTable),
+							  relation->nspname,
+							  relation->relname))
+	{
+		return false;
+	}
+
+	if (copydb_table_matches(&(filters->excludeTable),
+							 relation->nspname,
+							 relation->relname))
+	{
+		return false;
+	}
+
+	if (filters->excludeTablesLargerThan > 0 &&
+		relation->bytes > 0 &&
+		(uint64_t) relation->bytes > filters->excludeTablesLargerThan)
+	{
+		log_info("Excluding table \"%s\".\"%s\" which is larger than "
+				 "--exclude-tables-larger-than %s",
+				 relation->nspname,
+				 relation->relname,
+				 filters->excludeTablesLargerThanPretty);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_schema_is_included returns true when the schema filters select the
+ * given schema.
+ */
+static bool
+copydb_schema_is_included(TableFilters *filters, const char *nspname)
+{
+	bool included = filters->includeSchema.count == 0;
+
+	for (int i = 0; !included && i < filters->includeSchema.count; i++)
+	{
+		included = fnmatch(filters->includeSchema.array[i], nspname, 0) == 0;
+	}
+
+	for (int i = 0; included && i < filters->excludeSchema.count; i++)
+	{
+		included = fnmatch(filters->excludeSchema.array[i], nspname, 0) != 0;
+	}
+
+	return included;
+}
+
+
+/*
+ * copydb_table_matches returns true when one of the patterns of the given
+ * list matches the given table.
+ */
+static bool
+copydb_table_matches(TableFilterList *list,
+					 const char *nspname,
+					 const char *relname)
+{
+	for (int i = 0; i < list->count; i++)
+	{
+		if (copydb_table_pattern_matches(list->array[i], nspname, relname))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * copydb_table_pattern_matches returns true when the given pattern matches
+ * the given table: a pattern that contains a dot is matched against the
+ * qualified name schema.table, and otherwise against the table name.
+ */
+static bool
+copydb_table_pattern_matches(const char *pattern,
+							 const char *nspname,
+							 const char *relname)
+{
+	if (strchr(pattern, '.') == NULL)
+	{
+		return fnmatch(pattern, relname, 0) == 0;
+	}
+
+	char qualified[BUFSIZE] = { 0 };
+
+	sformat(qualified, sizeof(qualified), "%s.%s", nspname, relname);
+
+	return fnmatch(pattern, qualified, 0) == 0;
+}
+
+
+/*
+ * copydb_table_sample_percent returns the --table-sample percentage of the
+ * first entry that matches the given table, or zero when the table is copied
+ * as a whole.
+ */
+static double
+copydb_table_sample_percent(TableFilters *filters, SourceTable *table)
+{
+	for (int i = 0; i < filters->tableSample.count; i++)
+	{
+		TableSample *sample = &(filters->tableSample.array[i]);
+
+		if (IS_EMPTY_STRING_BUFFER(sample->pattern) ||
+			copydb_table_pattern_matches(sample->pattern,
+										 table->nspname,
+										 table->relname))
+		{
+			/* sampling 100% of the rows is the same as no sampling */
+			return sample->percent < 100.0 ? sample->percent : 0.0;
+		}
+	}
+
+	return 0.0;
+}
+
+
+/*
+ * copydb_prepare_filter_keys prepares the sorted arrays of names that the
+ * archive entries without an object OID are matched against, one array for
+ * the entries tagged with the kind of object and its name, such as
+ * "TABLE name", and one for the entries tagged with the plain name.
+ */
+static bool
+copydb_prepare_filter_keys(TableFilters *filters)
+{
+	int count = filters->excluded.count;
+
+	/* each relation has up to two tag keys, and one name key */
+	filters->tagKeys = (char **) calloc(2 * count + 1, sizeof(char *));
+	filters->nameKeys = (char **) calloc(count + 1, sizeof(char *));
+
+	if (filters->tagKeys == NULL || filters->nameKeys == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		SourceFilteredObject *object = &(filters->excluded.array[i]);
+		char *tag = copydb_relkind_tag(object->relkind);
+
+		if (object->nspname == NULL || tag == NULL)
+		{
+			continue;
+		}
+
+		char key[BUFSIZE] = { 0 };
+
+		sformat(key, sizeof(key), "%s %s %s ",
+				object->nspname,
+				tag,
+				object->qrelname);
+
+		if (!copydb_add_filter_key(filters->tagKeys,
+								   &(filters->tagKeyCount),
+								   key))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		/* the comments and privileges of the columns of the relation */
+		if (object->relkind != 'S' && object->relkind != 'i' &&
+			object->relkind != 'I')
+		{
+			sformat(key, sizeof(key), "%s COLUMN %s.",
+					object->nspname,
+					object->qrelname);
+
+			if (!copydb_add_filter_key(filters->tagKeys,
+									   &(filters->tagKeyCount),
+									   key))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+		}
+
+		sformat(key, sizeof(key), "%s %s ", object->nspname, object->relname);
+
+		if (!copydb_add_filter_key(filters->nameKeys,
+								   &(filters->nameKeyCount),
+								   key))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	qsort(filters->tagKeys,
+		  filters->tagKeyCount,
+		  sizeof(char *),
+		  copydb_compare_filter_key);
+
+	qsort(filters->nameKeys,
+		  filters->nameKeyCount,
+		  sizeof(char *),
+		  copydb_compare_filter_key);
+
+	return true;
+}
+
+
+/*
+ * copydb_add_filter_key adds a copy of the given key to the given array.
+ */
+static bool
+copydb_add_filter_key(char **keys, int *count, const char *key)
+{
+	char *copy = strdup(key);
+
+	if (copy == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	keys[(*count)++] = copy;
+
+	return true;
+}
+
+
+/*
+ * copydb_relkind_tag returns the kind of object that pg_dump uses in the tag
+ * of the COMMENT, ACL and SECURITY LABEL entries of a relation.
+ */
+static char *
+copydb_relkind_tag(char relkind)
+{
+	switch (relkind)
+	{
+		case 'r':
+		case 'p':
+		{
+			return "TABLE";
+		}
+
+		case 'v':
+		{
+			return "VIEW";
+		}
+
+		case 'm':
+		{
+			return "MATERIALIZED VIEW";
+		}
+
+		case 'S':
+		{
+			return "SEQUENCE";
+		}
+
+		case 'i':
+		case 'I':
+		{
+			return "INDEX";
+		}
+
+		case 'f':
+		{
+			return "FOREIGN TABLE";
+		}
+
+		default:
+		{
+			return NULL;
+		}
+	}
+}
+
+
+/*
+ * copydb_filter_key_matches returns true when one of the sorted keys is a
+ * prefix of the given name. Keys end with a space or a dot, so we look up
+ * each prefix of the name that ends with one of those.
+ */
+static bool
+copydb_filter_key_matches(char **keys, int count, const char *name)
+{
+	char prefix[BUFSIZE] = { 0 };
+	char *key = prefix;
+
+	if (count == 0)
+	{
+		return false;
+	}
+
+	for (int i = 0; name[i] != '\0' && i < BUFSIZE - 2; i++)
+	{
+		prefix[i] = name[i];
+
+		if (name[i] != ' ' && name[i] != '.')
+		{
+			continue;
+		}
+
+		prefix[i + 1] = '\0';
+
+		if (bsearch(&key,
+					keys,
+					count,
+					sizeof(char *),
+					copydb_compare_filter_key) != NULL)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * copydb_object_is_filtered_out returns true when the given object is one
+ * of the objects that the table filters exclude.
+ */
+static bool
+copydb_object_is_filtered_out(TableFilters *filters,
+							  uint32_t catalogOid,
+							  uint32_t objectOid)
+{
+	if (filters->excluded.count == 0)
+	{
+		return false;
+	}
+
+	SourceFilteredObject key = {
+		.catalogOid = catalogOid,
+		.objectOid = objectOid
+	};
+
+	return bsearch(&key,
+				   filters->excluded.array,
+				   filters->excluded.count,
+				   sizeof(SourceFilteredObject),
+				   copydb_compare_filtered_object) != NULL;
+}
+
+
+/*
+ * copydb_compare_filtered_object is a qsort() and bsearch() comparison
+ * function for the filtered objects, by oid and then catalog oid.
+ */
+static int
+copydb_compare_filtered_object(const void *a, const void *b)
+{
+	const SourceFilteredObject *oa = (const SourceFilteredObject *) a;
+	const SourceFilteredObject *ob = (const SourceFilteredObject *) b;
+
+	if (oa->objectOid != ob->objectOid)
+	{
+		return oa->objectOid < ob->objectOid ? -1 : 1;
+	}
+
+	if (oa->catalogOid != ob->catalogOid)
+	{
+		return oa->catalogOid < ob->catalogOid ? -1 : 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * copydb_compare_filter_key is a qsort() comparison function for the arrays
+ * of filter keys.
+ */
+static int
+copydb_compare_filter_key(const void *a, const void *b)
+{
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+
+/*
+ * copydb_compare_oid is a qsort() and bsearch() comparison function for
+ * arrays of oids.
+ */
+static int
+copydb_compare_oid(const void *a, const void *b)
+{
+	uint32_t oidA = *(const uint32_t *) a;
+	uint32_t oidB = *(const uint32_t *) b;
+
+	return oidA < oidB ? -1 : oidA > oidB ? 1 : 0;
+}
@@ -0,0 +1,546 @@
+/*
+ * src/bin/pgcopydb/fkeys.c
+ *     Implementation of a CLI to copy a database between two Postgres instances
+ */
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "copydb.h"
+#include "file_utils.h"
+#include "lock_utils.h"
+#include "log.h"
+#include "pgsql.h"
+#include "pqexpbuffer.h"
+#include "signals.h"
+
+
+/*
+ * The foreign keys are created NOT VALID, which only needs a brief lock, and
+ * then the --index-jobs validation workers pull the constraints to VALIDATE
+ * from a queue in shared memory. The array contains indexes in the
+ * specs->sourceFkeyArray.
+ */
+typedef struct CopyForeignKeyQueue
+{
+	Semaphore semaphore;        /* protects next */
+	size_t size;                /* size of the shared memory area */
+	int count;
+	int next;
+	int array[];
+} CopyForeignKeyQueue;
+
+
+static int copydb_compare_foreign_key_oid(const void *a, const void *b);
+static bool copydb_foreign_key_needs_validation(CopyDataSpec *specs,
+												SourceForeignKey *fkey);
+static bool copydb_add_foreign_key(CopyDataSpec *specs,
+								   SourceForeignKey *fkey,
+								   PGSQL *dst);
+static bool copydb_validate_foreign_keys(CopyDataSpec *specs,
+										 CopyForeignKeyQueue *queue);
+static bool copydb_fkey_queue_pop(CopyForeignKeyQueue *queue, int *fkeyIndex);
+static bool copydb_start_fkey_worker(CopyDataSpec *specs,
+									 CopyForeignKeyQueue *queue);
+static bool copydb_fkey_worker(CopyDataSpec *specs, CopyForeignKeyQueue *queue);
+static bool copydb_journal_fkey_done(CopyDataSpec *specs,
+									 SourceForeignKey *fkey,
+									 const char *sql);
+
+
+/*
+ * copydb_fetch_source_foreign_keys lists all the foreign keys of the source
+ * database in one query, so that copydb_target_finalize_schema() can create
+ * them itself rather than from the post-data archive.
+ */
+bool
+copydb_fetch_source_foreign_keys(CopyDataSpec *specs, PGSQL *pgsql)
+{
+	SourceForeignKeyArray *fkeyArray = &(specs->sourceFkeyArray);
+
+	log_info("Listing foreign keys in \"%s\"", specs->source_pguri);
+
+	if (!schema_list_all_foreign_keys(pgsql, fkeyArray))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* the query sorts by oid already, make sure of it for bsearch() */
+	if (fkeyArray->count > 1)
+	{
+		qsort(fkeyArray->array,
+			  fkeyArray->count,
+			  sizeof(SourceForeignKey),
+			  copydb_compare_foreign_key_oid);
+	}
+
+	log_info("Fetched information for %d foreign keys", fkeyArray->count);
+
+	return true;
+}
+
+
+/*
+ * copydb_lookup_foreign_key returns the source foreign key with the given
+ * constraint oid, or NULL when it's not been listed.
+ */
+SourceForeignKey *
+copydb_lookup_foreign_key(CopyDataSpec *specs, uint32_t oid)
+{
+	SourceForeignKeyArray *fkeyArray = &(specs->sourceFkeyArray);
+
+	if (fkeyArray->count == 0)
+	{
+		return NULL;
+	}
+
+	SourceForeignKey key = { .constraintOid = oid };
+
+	return (SourceForeignKey *) bsearch(&key,
+										fkeyArray->array,
+										fkeyArray->count,
+										sizeof(SourceForeignKey),
+										copydb_compare_foreign_key_oid);
+}
+
+
+/*
+ * copydb_compare_foreign_key_oid is a qsort() and bsearch() comparison
+ * function for foreign keys, by constraint oid.
+ */
+static int
+copydb_compare_foreign_key_oid(const void *a, const void *b)
+{
+	uint32_t oidA = ((const SourceForeignKey *) a)->constraintOid;
+	uint32_t oidB = ((const SourceForeignKey *) b)->constraintOid;
+
+	return oidA < oidB ? -1 : oidA > oidB ? 1 : 0;
+}
+
+
+/*
+ * copydb_create_foreign_keys creates the given foreign keys on the target
+ * database. ALTER TABLE ... ADD FOREIGN KEY scans the referencing table
+ * while holding a SHARE ROW EXCLUSIVE lock on both tables, so each foreign
+ * key is first added with NOT VALID, one after the other, which is quick.
+ *
+ * The constraints are then validated using up to --index-jobs sub-processes:
+ * VALIDATE CONSTRAINT only takes a SHARE UPDATE EXCLUSIVE lock on the
+ * referencing table, and a ROW SHARE lock on the referenced table. Two
+ * constraints of the same table are still validated one after the other, as
+ * that lock conflicts with itself.
+ *
+ * Foreign keys that are NOT VALID on the source database are not validated,
+ * and neither are the ones that reference a table copied with --table-sample,
+ * as the referenced rows might not have been copied.
+ */
+bool
+copydb_create_foreign_keys(CopyDataSpec *specs, int *fkeyIndexes, int count)
+{
+	SourceForeignKeyArray *fkeyArray = &(specs->sourceFkeyArray);
+
+	if (count == 0)
+	{
+		return true;
+	}
+
+	size_t size = sizeof(CopyForeignKeyQueue) + count * sizeof(int);
+
+	void *area = mmap(NULL, size,
+					  PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_ANONYMOUS,
+					  -1, 0);
+
+	if (area == MAP_FAILED)
+	{
+		log_error("Failed to allocate %lld bytes of shared memory for "
+				  "the foreign keys queue: %m",
+				  (long long) size);
+		return false;
+	}
+
+	CopyForeignKeyQueue *queue = (CopyForeignKeyQueue *) area;
+
+	queue->size = size;
+	queue->count = 0;
+	queue->next = 0;
+
+	/* the semaphore initValue defaults to 1: a mutex */
+	queue->semaphore.initValue = 1;
+
+	if (!semaphore_create(&(queue->semaphore)))
+	{
+		log_error("Failed to create the foreign keys queue semaphore");
+		(void) munmap(area, size);
+		return false;
+	}
+
+	PGSQL dst = { 0 };
+
+	bool connected = true;
+	bool success = true;
+
+	if (!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET) ||
+		!copydb_set_target_session(&(specs->bulkLoadProfile),
+								   BULK_LOAD_PHASE_CONSTRAINTS,
+								   &dst) ||
+		!pgsql_open_persistent_connection(&dst))
+	{
+		/* errors have already been logged */
+		connected = false;
+		success = false;
+	}
+
+	log_info("Creating %d foreign keys as NOT VALID", count);
+
+	for (int i = 0; connected && i < count; i++)
+	{
+		SourceForeignKey *fkey = &(fkeyArray->array[fkeyIndexes[i]]);
+
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			success = false;
+			break;
+		}
+
+		if (!copydb_add_foreign_key(specs, fkey, &dst))
+		{
+			/* errors have already been logged */
+			success = false;
+			continue;
+		}
+
+		if (copydb_foreign_key_needs_validation(specs, fkey))
+		{
+			queue->array[queue->count++] = fkeyIndexes[i];
+		}
+	}
+
+	pgsql_finish(&dst);
+
+	if (queue->count > 0 &&
+		!(asked_to_quit || asked_to_stop || asked_to_stop_fast))
+	{
+		if (!copydb_validate_foreign_keys(specs, queue))
+		{
+			/* errors have already been logged */
+			success = false;
+		}
+	}
+
+	if (!semaphore_finish(&(queue->semaphore)))
+	{
+		log_warn("Failed to remove foreign keys queue semaphore %d",
+				 queue->semaphore.semId);
+	}
+
+	if (munmap(area, size) != 0)
+	{
+		log_warn("Failed to release the foreign keys queue shared memory: %m");
+	}
+
+	/* flush the journal records of the NOT VALID foreign keys */
+	if (!journal_sync(&(specs->journal)))
+	{
+		/* errors have already been logged */
+		success = false;
+	}
+
+	return success;
+}
+
+
+/*
+ * copydb_add_foreign_key runs ALTER TABLE ... ADD CONSTRAINT ... NOT VALID
+ * for the given foreign key on the target database.
+ */
+static bool
+copydb_add_foreign_key(CopyDataSpec *specs, SourceForeignKey *fkey, PGSQL *dst)
+{
+	/* constraint definitions are not limited in size */
+	PQExpBuffer sql = createPQExpBuffer();
+
+	/* pg_get_constraintdef() adds NOT VALID itself when needed */
+	appendPQExpBuffer(sql,
+					  "ALTER TABLE \"%s\".\"%s\" ADD CONSTRAINT \"%s\" %s%s",
+					  fkey->tableNamespace,
+					  fkey->tableRelname,
+					  fkey->constraintName,
+					  fkey->constraintDef,
+					  fkey->isValidated ? " NOT VALID" : "");
+
+	if (PQExpBufferBroken(sql))
+	{
+		log_error("Failed to prepare the ALTER TABLE command: out of memory");
+		destroyPQExpBuffer(sql);
+		return false;
+	}
+
+	log_info("%s;", sql->data);
+
+	if (!pgsql_execute(dst, sql->data))
+	{
+		log_error("Failed to create foreign key \"%s\" on \"%s\".\"%s\"",
+				  fkey->constraintName,
+				  fkey->tableNamespace,
+				  fkey->tableRelname);
+		destroyPQExpBuffer(sql);
+		return false;
+	}
+
+	/* foreign keys that are left NOT VALID are done now */
+	if (!copydb_foreign_key_needs_validation(specs, fkey))
+	{
+		if (fkey->isValidated)
+		{
+			log_warn("Foreign key \"%s\" on \"%s\".\"%s\" is left NOT VALID: "
+					 "it references a table copied with --table-sample",
+					 fkey->constraintName,
+					 fkey->tableNamespace,
+					 fkey->tableRelname);
+		}
+
+		(void) copydb_journal_fkey_done(specs, fkey, sql->data);
+	}
+
+	destroyPQExpBuffer(sql);
+
+	return true;
+}
+
+
+/*
+ * copydb_foreign_key_needs_validation returns true when the given foreign key
+ * is to be validated once added NOT VALID on the target database.
+ */
+static bool
+copydb_foreign_key_needs_validation(CopyDataSpec *specs, SourceForeignKey *fkey)
+{
+	return fkey->isValidated &&
+		   !copydb_table_is_sampled(specs, fkey->referencedTableOid);
+}
+
+
+/*
+ * copydb_validate_foreign_keys starts the validation workers and waits until
+ * they are done with the queue.
+ */
+static bool
+copydb_validate_foreign_keys(CopyDataSpec *specs, CopyForeignKeyQueue *queue)
+{
+	int workerCount =
+		queue->count < specs->indexJobs ? queue->count : specs->indexJobs;
+
+	log_info("Validating %d foreign keys using %d processes",
+			 queue->count,
+			 workerCount);
+
+	bool success = true;
+
+	for (int i = 0; i < workerCount; i++)
+	{
+		if (!copydb_start_fkey_worker(specs, queue))
+		{
+			/* errors have already been logged */
+			success = false;
+			break;
+		}
+	}
+
+	if (!copydb_wait_for_subprocesses())
+	{
+		log_error("Some foreign keys could not be validated, "
+				  "see above for details");
+		success = false;
+	}
+
+	return success;
+}
+
+
+/*
+ * copydb_fkey_queue_pop fetches the next foreign key to validate from the
+ * queue. Returns false when the queue is empty.
+ */
+static bool
+copydb_fkey_queue_pop(CopyForeignKeyQueue *queue, int *fkeyIndex)
+{
+	bool found = false;
+
+	if (!semaphore_lock(&(queue->semaphore)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (queue->next < queue->count)
+	{
+		*fkeyIndex = queue->array[queue->next++];
+		found = true;
+	}
+
+	(void) semaphore_unlock(&(queue->semaphore));
+
+	return found;
+}
+
+
+/*
+ * copydb_start_fkey_worker forks a validation worker sub-process, see
+ * copydb_fkey_worker().
+ */
+static bool
+copydb_start_fkey_worker(CopyDataSpec *specs, CopyForeignKeyQueue *queue)
+{
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	int fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork a foreign key validation process");
+			return false;
+		}
+
+		case 0:
+		{
+			/* child process runs the command */
+			if (!copydb_fkey_worker(specs, queue))
+			{
+				/* errors have already been logged */
+				exit(EXIT_CODE_TARGET);
+			}
+
+			exit(EXIT_CODE_QUIT);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			return true;
+		}
+	}
+}
+
+
+/*
+ * copydb_fkey_worker pulls foreign keys from the shared queue and runs
+ * ALTER TABLE ... VALIDATE CONSTRAINT on them one after the other, using a
+ * single connection to the target database.
+ */
+static bool
+copydb_fkey_worker(CopyDataSpec *specs, CopyForeignKeyQueue *queue)
+{
+	SourceForeignKeyArray *fkeyArray = &(specs->sourceFkeyArray);
+
+	PGSQL dst = { 0 };
+
+	bool success = true;
+
+	if (!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET) ||
+		!copydb_set_target_session(&(specs->bulkLoadProfile),
+								   BULK_LOAD_PHASE_CONSTRAINTS,
+								   &dst))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	int fkeyIndex = 0;
+
+	while (copydb_fkey_queue_pop(queue, &fkeyIndex))
+	{
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			success = false;
+			break;
+		}
+
+		SourceForeignKey *fkey = &(fkeyArray->array[fkeyIndex]);
+
+		/* re-open the connection when it's been lost */
+		if (dst.connection != NULL &&
+			PQstatus(dst.connection) != CONNECTION_OK)
+		{
+			pgsql_finish(&dst);
+		}
+
+		if (dst.connection == NULL && !pgsql_open_persistent_connection(&dst))
+		{
+			/* errors have already been logged */
+			success = false;
+			continue;
+		}
+
+		char sql[BUFSIZE] = { 0 };
+
+		sformat(sql, sizeof(sql),
+				"ALTER TABLE \"%s\".\"%s\" VALIDATE CONSTRAINT \"%s\"",
+				fkey->tableNamespace,
+				fkey->tableRelname,
+				fkey->constraintName);
+
+		log_info("%s;", sql);
+
+		if (!pgsql_execute(&dst, sql))
+		{
+			log_error("Failed to validate foreign key \"%s\" on \"%s\".\"%s\"",
+					  fkey->constraintName,
+					  fkey->tableNamespace,
+					  fkey->tableRelname);
+			success = false;
+			continue;
+		}
+
+		(void) copydb_journal_fkey_done(specs, fkey, sql);
+	}
+
+	pgsql_finish(&dst);
+
+	if (!journal_sync(&(specs->journal)))
+	{
+		/* errors have already been logged */
+		success = false;
+	}
+
+	return success;
+}
+
+
+/*
+ * copydb_journal_fkey_done registers the given foreign key in the journal,
+ * see copydb_objectid_has_been_processed_already().
+ */
+static bool
+copydb_journal_fkey_done(CopyDataSpec *specs,
+						 SourceForeignKey *fkey,
+						 const char *sql)
+{
+	JournalEntry entry = {
+		.oid = fkey->constraintOid,
+		.kind = JOURNAL_RECORD_FOREIGN_KEY,
+		.pid = getpid(),
+		.doneTime = time(NULL),
+		.nspname = fkey->tableNamespace,
+		.relname = fkey->constraintName,
+		.command = sql
+	};
+
+	if (!journal_append(&(specs->journal), &entry))
+	{
+		log_warn("Failed to register foreign key \"%s\" in the journal",
+				 fkey->constraintName);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,896 @@
+/*
+ * src/bin/pgcopydb/follow.c
+ *     Implementation of a CLI to copy a database between two Postgres instances
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "copydb.h"
+#include "log.h"
+#include "parson.h"
+#include "pgsql.h"
+#include "pqexpbuffer.h"
+#include "signals.h"
+#include "string_utils.h"
+
+
+/*
+ * With --follow, the changes that happened on the source database after the
+ * snapshot used by the COPY commands are decoded from a logical replication
+ * slot using wal2json (format-version 2), one JSON object per change, and
+ * replayed on the target database as SQL statements.
+ *
+ * We peek at the changes from the slot using the SQL interface, apply a
+ * batch of them in a single transaction on the target database, and only
+ * then advance the slot on the source database. When applying fails, the
+ * slot is not advanced and the changes remain available.
+ */
+typedef struct LogicalChange
+{
+	char lsn[PG_LSN_MAXLENGTH];
+	char *data;                 /* malloc'ed area */
+} LogicalChange;
+
+typedef struct LogicalChangeArray
+{
+	int count;
+	LogicalChange *array;       /* malloc'ed area */
+} LogicalChangeArray;
+
+typedef struct LogicalChangeContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	LogicalChangeArray *changes;
+	bool parsedOk;
+} LogicalChangeContext;
+
+typedef struct AffectedRowsContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	uint64_t rows;
+	bool parsedOk;
+} AffectedRowsContext;
+
+
+static bool copydb_fetch_changes(PGSQL *src,
+								 const char *slotName,
+								 LogicalChangeArray *changes);
+static void parseLogicalChanges(void *ctx, PGresult *result);
+static void copydb_free_changes(LogicalChangeArray *changes);
+static bool copydb_apply_changes(PGSQL *dst, LogicalChangeArray *changes,
+								 uint64_t *appliedCount);
+static void parseAffectedRows(void *ctx, PGresult *result);
+static bool copydb_change_to_sql(PGconn *conn, const char *data,
+								 PQExpBuffer sql, bool *skip,
+								 bool *singleRow);
+static bool copydb_append_qualified_name(PGconn *conn, JSON_Object *change,
+										 PQExpBuffer sql);
+static bool copydb_append_identifier(PGconn *conn, const char *name,
+									 PQExpBuffer sql);
+static bool copydb_append_value(PGconn *conn, JSON_Object *column,
+								PQExpBuffer sql);
+static bool copydb_append_column_list(PGconn *conn, JSON_Array *columns,
+									  const char *separator,
+									  bool names, bool values,
+									  bool match,
+									  PQExpBuffer sql);
+static bool copydb_advance_slot(PGSQL *src, const char *slotName,
+								const char *lsn);
+
+
+/*
+ * copydb_validate_slot_name returns true when the given name is a valid
+ * replication slot name: Postgres only accepts lower case letters, numbers,
+ * and the underscore character there.
+ */
+bool
+copydb_validate_slot_name(const char *slotName)
+{
+	int len = strlen(slotName);
+
+	if (len == 0 || len >= NAMEDATALEN)
+	{
+		return false;
+	}
+
+	for (int i = 0; i < len; i++)
+	{
+		char c = slotName[i];
+
+		if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_'))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_follow_changes applies the changes decoded from the replication
+ * slot created with the snapshot on the target database, until asked to
+ * stop.
+ *
+ * A SIGTERM or a SIGINT is the cutover signal: we then keep applying changes
+ * until the slot has no more of them, drop the slot, and return. Writes on
+ * the source database must have been stopped before, or there is no end to
+ * it. A SIGQUIT stops right away, and keeps the slot around. On errors, the
+ * slot is dropped at exit, see copydb_drop_slot_atexit().
+ */
+bool
+copydb_follow_changes(CopyDataSpec *specs)
+{
+	TransactionSnapshot *snapshot = &(specs->sourceSnapshot);
+
+	PGSQL src = { 0 };
+	PGSQL dst = { 0 };
+
+	if (!pgsql_init(&src, specs->source_pguri, PGSQL_CONN_SOURCE) ||
+		!pgsql_open_persistent_connection(&src))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	int serverVersion = 0;
+
+	if (!pgsql_server_version_num(&src, &serverVersion))
+	{
+		/* errors have already been logged */
+		pgsql_finish(&src);
+		return false;
+	}
+
+	/* pg_replication_slot_advance() appeared in Postgres 11 */
+	if (serverVersion < 110000)
+	{
+		log_error("Option --follow requires Postgres 11 or later on the "
+				  "source database, found server_version_num %d",
+				  serverVersion);
+		pgsql_finish(&src);
+		return false;
+	}
+
+	if (!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET) ||
+		!copydb_set_target_session(&(specs->bulkLoadProfile),
+								   BULK_LOAD_PHASE_ALL,
+								   &dst) ||
+		!pgsql_open_persistent_connection(&dst))
+	{
+		/* errors have already been logged */
+		pgsql_finish(&src);
+		return false;
+	}
+
+	/* do not fire triggers nor check foreign keys again, as subscribers do */
+	if (!pgsql_execute(&dst, "SET session_replication_role TO replica"))
+	{
+		/* errors have already been logged */
+		pgsql_finish(&src);
+		pgsql_finish(&dst);
+		return false;
+	}
+
+	log_info("Applying changes from replication slot \"%s\" from %s, "
+			 "stop writes on the source database and send SIGTERM "
+			 "to cutover",
+			 snapshot->slotName,
+			 snapshot->startLSN);
+
+	bool success = true;
+	bool cutover = false;
+	uint64_t appliedCount = 0;
+	char lastLSN[PG_LSN_MAXLENGTH] = { 0 };
+
+	strlcpy(lastLSN, snapshot->startLSN, sizeof(lastLSN));
+
+	while (true)
+	{
+		if (asked_to_quit)
+		{
+			log_warn("Stopping now, changes have been applied up to %s, "
+					 "replication slot \"%s\" is kept on the source database",
+					 lastLSN,
+					 snapshot->slotName);
+			(void) copydb_release_replication_slot();
+			break;
+		}
+
+		if (!cutover && (asked_to_stop || asked_to_stop_fast))
+		{
+			log_info("Cutover: applying the remaining changes from %s",
+					 lastLSN);
+			cutover = true;
+		}
+
+		LogicalChangeArray changes = { 0 };
+
+		if (!copydb_fetch_changes(&src, snapshot->slotName, &changes))
+		{
+			/* errors have already been logged */
+			success = false;
+			break;
+		}
+
+		if (changes.count == 0)
+		{
+			if (cutover)
+			{
+				break;
+			}
+
+			log_flush();
+
+			pg_usleep(FOLLOW_SLEEP_TIME_MS * 1000);
+			continue;
+		}
+
+		if (!copydb_apply_changes(&dst, &changes, &appliedCount))
+		{
+			log_error("Failed to apply changes from %s", lastLSN);
+			copydb_free_changes(&changes);
+			success = false;
+			break;
+		}
+
+		/* the batch is committed on the target, now advance the slot */
+		char *batchLSN = changes.array[changes.count - 1].lsn;
+
+		if (!copydb_advance_slot(&src, snapshot->slotName, batchLSN))
+		{
+			/* errors have already been logged */
+			copydb_free_changes(&changes);
+			success = false;
+			break;
+		}
+
+		log_debug("Applied %d changes up to %s", changes.count, batchLSN);
+
+		strlcpy(lastLSN, batchLSN, sizeof(lastLSN));
+		copydb_free_changes(&changes);
+	}
+
+	pgsql_finish(&dst);
+
+	if (success && cutover)
+	{
+		log_info("Applied %lld changes up to %s, dropping replication "
+				 "slot \"%s\"",
+				 (long long) appliedCount,
+				 lastLSN,
+				 snapshot->slotName);
+
+		if (!pgsql_drop_replication_slot(&src, snapshot->slotName))
+		{
+			/* errors have already been logged */
+			pgsql_finish(&src);
+			return false;
+		}
+
+		(void) copydb_release_replication_slot();
+	}
+
+	pgsql_finish(&src);
+
+	return success;
+}
+
+
+/*
+ * copydb_fetch_changes peeks at the next batch of changes from the given
+ * logical replication slot. Using upto_nchanges, Postgres still returns
+ * whole transactions, so that the batch always ends with a COMMIT.
+ */
+static bool
+copydb_fetch_changes(PGSQL *src,
+					 const char *slotName,
+					 LogicalChangeArray *changes)
+{
+	LogicalChangeContext context = { { 0 }, changes, false };
+	char batchSize[BUFSIZE] = { 0 };
+
+	char *sql =
+		"select lsn::text, data "
+		"  from pg_logical_slot_peek_changes($1, NULL, $2, "
+		"       'format-version', '2', "
+		"       'include-transaction', 'true', "
+		"       'include-types', 'true', "
+		"       'numeric-data-types-as-string', 'true')";
+
+	sformat(batchSize, sizeof(batchSize), "%d", FOLLOW_BATCH_CHANGES);
+
+	const Oid paramTypes[2] = { TEXTOID, INT4OID };
+	const char *paramValues[2] = { slotName, batchSize };
+
+	if (!pgsql_execute_with_params(src, sql, 2, paramTypes, paramValues,
+								   &context, &parseLogicalChanges))
+	{
+		log_error("Failed to fetch changes from replication slot \"%s\"",
+				  slotName);
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to fetch changes from replication slot \"%s\"",
+				  slotName);
+		copydb_free_changes(changes);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * parseLogicalChanges parses the lsn and data columns of the result of
+ * pg_logical_slot_peek_changes().
+ */
+static void
+parseLogicalChanges(void *ctx, PGresult *result)
+{
+	LogicalChangeContext *context = (LogicalChangeContext *) ctx;
+	LogicalChangeArray *changes = context->changes;
+
+	int nTuples = PQntuples(result);
+
+	if (PQnfields(result) != 2)
+	{
+		log_error("Query returned %d columns, expected 2", PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	changes->count = 0;
+
+	if (nTuples == 0)
+	{
+		context->parsedOk = true;
+		return;
+	}
+
+	changes->array = (LogicalChange *) calloc(nTuples, sizeof(LogicalChange));
+
+	if (changes->array == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		context->parsedOk = false;
+		return;
+	}
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		LogicalChange *change = &(changes->array[rowNumber]);
+
+		strlcpy(change->lsn, PQgetvalue(result, rowNumber, 0),
+				sizeof(change->lsn));
+
+		change->data = strdup(PQgetvalue(result, rowNumber, 1));
+
+		if (change->data == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			context->parsedOk = false;
+			return;
+		}
+
+		++changes->count;
+	}
+
+	context->parsedOk = true;
+}
+
+
+/*
+ * copydb_free_changes frees the memory allocated for the given changes.
+ */
+static void
+copydb_free_changes(LogicalChangeArray *changes)
+{
+	for (int i = 0; i < changes->count; i++)
+	{
+		free(changes->array[i].data);
+	}
+
+	free(changes->array);
+
+	changes->count = 0;
+	changes->array = NULL;
+}
+
+
+/*
+ * copydb_apply_changes applies the given batch of changes to the target
+ * database in a single transaction. The source transactions are applied in
+ * their commit order, so grouping them doesn't change the end result.
+ */
+static bool
+copydb_apply_changes(PGSQL *dst, LogicalChangeArray *changes,
+					 uint64_t *appliedCount)
+{
+	PQExpBuffer sql = createPQExpBuffer();
+	uint64_t count = 0;
+
+	if (sql == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	if (!pgsql_execute(dst, "BEGIN"))
+	{
+		/* errors have already been logged */
+		destroyPQExpBuffer(sql);
+		return false;
+	}
+
+	for (int i = 0; i < changes->count; i++)
+	{
+		LogicalChange *change = &(changes->array[i]);
+		bool skip = false;
+		bool singleRow = false;
+
+		resetPQExpBuffer(sql);
+
+		if (!copydb_change_to_sql(dst->connection, change->data, sql,
+								  &skip, &singleRow))
+		{
+			log_error("Failed to apply change at %s: %s",
+					  change->lsn,
+					  change->data);
+			(void) pgsql_execute(dst, "ROLLBACK");
+			destroyPQExpBuffer(sql);
+			return false;
+		}
+
+		if (skip)
+		{
+			continue;
+		}
+
+		AffectedRowsContext context = { { 0 }, 0, false };
+
+		if (!pgsql_execute_with_params(dst, sql->data, 0, NULL, NULL,
+									   &context, &parseAffectedRows) ||
+			!context.parsedOk)
+		{
+			/* errors have already been logged */
+			log_error("Failed to apply change at %s", change->lsn);
+			(void) pgsql_execute(dst, "ROLLBACK");
+			destroyPQExpBuffer(sql);
+			return false;
+		}
+
+		/* the target has diverged when the replica identity is not found */
+		if (singleRow && context.rows != 1)
+		{
+			log_error("Failed to apply change at %s: %lld rows affected "
+					  "on the target database, expected 1: %s",
+					  change->lsn,
+					  (long long) context.rows,
+					  change->data);
+			(void) pgsql_execute(dst, "ROLLBACK");
+			destroyPQExpBuffer(sql);
+			return false;
+		}
+
+		++count;
+	}
+
+	destroyPQExpBuffer(sql);
+
+	if (!pgsql_execute(dst, "COMMIT"))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	*appliedCount += count;
+
+	return true;
+}
+
+
+/*
+ * parseAffectedRows parses the number of rows that the INSERT, UPDATE, or
+ * DELETE statement has affected.
+ */
+static void
+parseAffectedRows(void *ctx, PGresult *result)
+{
+	AffectedRowsContext *context = (AffectedRowsContext *) ctx;
+	char *value = PQcmdTuples(result);
+
+	/* TRUNCATE has no rows count */
+	if (value == NULL || *value == '\0')
+	{
+		context->rows = 0;
+		context->parsedOk = true;
+		return;
+	}
+
+	if (!stringToUInt64(value, &(context->rows)))
+	{
+		log_error("Failed to parse affected rows count \"%s\"", value);
+		context->parsedOk = false;
+		return;
+	}
+
+	context->parsedOk = true;
+}
+
+
+/*
+ * copydb_change_to_sql builds the SQL statement that applies the given
+ * wal2json change on the target database. BEGIN, COMMIT, and logical
+ * decoding messages have no SQL statement: skip is then set to true. An
+ * UPDATE or a DELETE must affect a single row: singleRow is then set to
+ * true.
+ */
+static bool
+copydb_change_to_sql(PGconn *conn, const char *data, PQExpBuffer sql,
+					 bool *skip, bool *singleRow)
+{
+	JSON_Value *json = json_parse_string(data);
+	JSON_Object *change = json_value_get_object(json);
+
+	if (change == NULL)
+	{
+		log_error("Failed to parse change as a JSON object");
+		json_value_free(json);
+		return false;
+	}
+
+	const char *action = json_object_get_string(change, "action");
+
+	if (action == NULL || strlen(action) != 1)
+	{
+		log_error("Failed to parse change action");
+		json_value_free(json);
+		return false;
+	}
+
+	JSON_Array *columns = json_object_get_array(change, "columns");
+	JSON_Array *identity = json_object_get_array(change, "identity");
+
+	bool success = true;
+
+	*skip = false;
+	*singleRow = action[0] == 'U' || action[0] == 'D';
+
+	switch (action[0])
+	{
+		case 'B':
+		case 'C':
+		case 'M':
+		{
+			*skip = true;
+			break;
+		}
+
+		case 'I':
+		{
+			appendPQExpBufferStr(sql, "INSERT INTO ");
+
+			success = columns != NULL &&
+					  copydb_append_qualified_name(conn, change, sql);
+
+			appendPQExpBufferStr(sql, " (");
+
+			success = success &&
+					  copydb_append_column_list(conn, columns, ", ",
+												true, false, false, sql);
+
+			appendPQExpBufferStr(sql, ") VALUES (");
+
+			success = success &&
+					  copydb_append_column_list(conn, columns, ", ",
+												false, true, false, sql);
+
+			appendPQExpBufferStr(sql, ")");
+			break;
+		}
+
+		case 'U':
+		{
+			if (identity == NULL)
+			{
+				log_error("Failed to apply UPDATE without a replica identity");
+				success = false;
+				break;
+			}
+
+			appendPQExpBufferStr(sql, "UPDATE ");
+
+			success = columns != NULL &&
+					  copydb_append_qualified_name(conn, change, sql);
+
+			appendPQExpBufferStr(sql, " SET ");
+
+			success = success &&
+					  copydb_append_column_list(conn, columns, ", ",
+												true, true, false, sql);
+
+			appendPQExpBufferStr(sql, " WHERE ");
+
+			success = success &&
+					  copydb_append_column_list(conn, identity, " AND ",
+												true, true, true, sql);
+			break;
+		}
+
+		case 'D':
+		{
+			if (identity == NULL)
+			{
+				log_error("Failed to apply DELETE without a replica identity");
+				success = false;
+				break;
+			}
+
+			appendPQExpBufferStr(sql, "DELETE FROM ");
+
+			success = copydb_append_qualified_name(conn, change, sql);
+
+			appendPQExpBufferStr(sql, " WHERE ");
+
+			success = success &&
+					  copydb_append_column_list(conn, identity, " AND ",
+												true, true, true, sql);
+			break;
+		}
+
+		case 'T':
+		{
+			appendPQExpBufferStr(sql, "TRUNCATE ONLY ");
+
+			success = copydb_append_qualified_name(conn, change, sql);
+			break;
+		}
+
+		default:
+		{
+			log_error("Failed to parse change action \"%s\"", action);
+			success = false;
+			break;
+		}
+	}
+
+	json_value_free(json);
+
+	if (PQExpBufferBroken(sql))
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	return success;
+}
+
+
+/*
+ * copydb_append_qualified_name appends the quoted schema and table name of
+ * the given change to the SQL statement.
+ */
+static bool
+copydb_append_qualified_name(PGconn *conn, JSON_Object *change,
+							 PQExpBuffer sql)
+{
+	const char *nspname = json_object_get_string(change, "schema");
+	const char *relname = json_object_get_string(change, "table");
+
+	if (nspname == NULL || relname == NULL)
+	{
+		log_error("Failed to parse change schema and table names");
+		return false;
+	}
+
+	if (!copydb_append_identifier(conn, nspname, sql))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	appendPQExpBufferChar(sql, '.');
+
+	return copydb_append_identifier(conn, relname, sql);
+}
+
+
+/*
+ * copydb_append_identifier appends the given identifier, quoted when needed.
+ */
+static bool
+copydb_append_identifier(PGconn *conn, const char *name, PQExpBuffer sql)
+{
+	char *quoted = PQescapeIdentifier(conn, name, strlen(name));
+
+	if (quoted == NULL)
+	{
+		log_error("Failed to quote identifier \"%s\": %s",
+				  name,
+				  PQerrorMessage(conn));
+		return false;
+	}
+
+	appendPQExpBufferStr(sql, quoted);
+	PQfreemem(quoted);
+
+	return true;
+}
+
+
+/*
+ * copydb_append_column_list appends the given wal2json columns to the SQL
+ * statement, separated by the given separator: either only the names, only
+ * the values, or both as in "name = value".
+ *
+ * With match, the columns are a replica identity to match in a WHERE
+ * clause, where a NULL value has to be matched with IS NULL. This is what
+ * IS NOT DISTINCT FROM does, but then the primary key index would not be
+ * used.
+ */
+static bool
+copydb_append_column_list(PGconn *conn, JSON_Array *columns,
+						  const char *separator,
+						  bool names, bool values,
+						  bool match,
+						  PQExpBuffer sql)
+{
+	int count = json_array_get_count(columns);
+
+	if (count == 0)
+	{
+		log_error("Failed to parse change columns");
+		return false;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		JSON_Object *column = json_array_get_object(columns, i);
+		const char *name = json_object_get_string(column, "name");
+
+		if (name == NULL)
+		{
+			log_error("Failed to parse change column name");
+			return false;
+		}
+
+		if (i > 0)
+		{
+			appendPQExpBufferStr(sql, separator);
+		}
+
+		if (names && !copydb_append_identifier(conn, name, sql))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (match &&
+			json_value_get_type(json_object_get_value(column, "value")) == JSONNull)
+		{
+			appendPQExpBufferStr(sql, " IS NULL");
+			continue;
+		}
+
+		if (names && values)
+		{
+			appendPQExpBufferStr(sql, " = ");
+		}
+
+		if (values && !copydb_append_value(conn, column, sql))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_append_value appends the value of the given wal2json column as a
+ * literal, cast to the column type.
+ */
+static bool
+copydb_append_value(PGconn *conn, JSON_Object *column, PQExpBuffer sql)
+{
+	const char *type = json_object_get_string(column, "type");
+	JSON_Value *value = json_object_get_value(column, "value");
+
+	if (type == NULL || value == NULL)
+	{
+		log_error("Failed to parse change column value and type");
+		return false;
+	}
+
+	char *text = NULL;
+	char *serialized = NULL;
+
+	switch (json_value_get_type(value))
+	{
+		case JSONNull:
+		{
+			appendPQExpBufferStr(sql, "NULL");
+			return true;
+		}
+
+		case JSONString:
+		{
+			text = (char *) json_value_get_string(value);
+			break;
+		}
+
+		case JSONBoolean:
+		{
+			text = json_value_get_boolean(value) ? "true" : "false";
+			break;
+		}
+
+		case JSONNumber:
+		{
+			serialized = json_serialize_to_string(value);
+			text = serialized;
+			break;
+		}
+
+		default:
+		{
+			log_error("Failed to parse change column value of type \"%s\"",
+					  type);
+			return false;
+		}
+	}
+
+	if (text == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	char *literal = PQescapeLiteral(conn, text, strlen(text));
+
+	json_free_serialized_string(serialized);
+
+	if (literal == NULL)
+	{
+		log_error("Failed to quote value: %s", PQerrorMessage(conn));
+		return false;
+	}
+
+	/* the type name comes from format_type() and is safe to use as-is */
+	appendPQExpBuffer(sql, "%s::%s", literal, type);
+	PQfreemem(literal);
+
+	return true;
+}
+
+
+/*
+ * copydb_advance_slot advances the replication slot on the source database
+ * up to the given LSN, once the changes up to there have been committed on
+ * the target database.
+ */
+static bool
+copydb_advance_slot(PGSQL *src, const char *slotName, const char *lsn)
+{
+	char *sql = "select pg_replication_slot_advance($1, $2::pg_lsn)";
+
+	const Oid paramTypes[2] = { TEXTOID, TEXTOID };
+	const char *paramValues[2] = { slotName, lsn };
+
+	if (!pgsql_execute_with_params(src, sql, 2, paramTypes, paramValues,
+								   NULL, NULL))
+	{
+		log_error("Failed to advance replication slot \"%s\" to %s",
+				  slotName, lsn);
+		return false;
+	}
+
+	return true;
+}
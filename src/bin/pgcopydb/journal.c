@@ -0,0 +1,610 @@
+/*
+ * src/bin/pgcopydb/journal.c
+ *   Append-only journal of the objects that have been processed
+ *
+ * Each record is written with a single write(2) call on a file descriptor
+ * opened with O_APPEND, so that processes concurrently appending records to
+ * the journal never interleave their records. The records are only fsync'd
+ * every JOURNAL_SYNC_BATCH records and when a process is done: a record that
+ * is lost in a crash only means that the object is processed again with
+ * --resume.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defaults.h"
+#include "file_utils.h"
+#include "journal.h"
+#include "log.h"
+#include "string_utils.h"
+
+#define JOURNAL_RECORD_MAGIC 0x4A524E4C /* JRNL */
+
+/* the hash table of entries starts with that many slots */
+#define JOURNAL_ENTRIES_INITIAL_SIZE 1024
+
+/*
+ * On-disk record header, followed by the nspname, relname, and command
+ * strings, each terminated by a NUL byte. The length includes the header.
+ */
+typedef struct JournalRecordHeader
+{
+	uint32_t magic;
+	uint32_t length;
+	uint32_t checksum;          /* of the record, with checksum set to zero */
+	uint32_t kind;
+	uint32_t oid;
+	int32_t pid;
+	uint64_t startTime;
+	uint64_t doneTime;
+	uint64_t durationMs;
+} JournalRecordHeader;
+
+
+static bool journal_open(Journal *journal);
+static JournalEntry * journal_find(Journal *journal, uint32_t oid);
+static bool journal_parse_record(char *data, long size, JournalEntry *entry,
+								 uint32_t *length);
+static bool journal_insert(Journal *journal, JournalEntry *entry);
+static bool journal_grow_entries(Journal *journal);
+static bool journal_export_entry(Journal *journal, JournalEntry *entry);
+static uint32_t journal_checksum(const char *data, uint32_t length);
+
+
+/*
+ * journal_init initializes a journal that uses the given filename. When
+ * exportDir is not NULL, each record appended to the journal is also written
+ * as a done file in that directory, see journal_export_entry().
+ */
+void
+journal_init(Journal *journal, const char *filename, const char *exportDir)
+{
+	Journal tmpJournal = { .fd = -1 };
+
+	strlcpy(tmpJournal.filename, filename, sizeof(tmpJournal.filename));
+
+	if (exportDir != NULL)
+	{
+		strlcpy(tmpJournal.exportDir, exportDir, sizeof(tmpJournal.exportDir));
+	}
+
+	*journal = tmpJournal;
+}
+
+
+/*
+ * journal_append appends a record for the given entry to the journal.
+ */
+bool
+journal_append(Journal *journal, JournalEntry *entry)
+{
+	if (!journal_open(journal))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	const char *nspname = entry->nspname ? entry->nspname : "";
+	const char *relname = entry->relname ? entry->relname : "";
+	const char *command = entry->command ? entry->command : "";
+
+	size_t nsplen = strlen(nspname) + 1;
+	size_t rellen = strlen(relname) + 1;
+	size_t cmdlen = strlen(command) + 1;
+	size_t length = sizeof(JournalRecordHeader) + nsplen + rellen + cmdlen;
+
+	char *record = (char *) calloc(1, length);
+
+	if (record == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	JournalRecordHeader header = {
+		.magic = JOURNAL_RECORD_MAGIC,
+		.length = (uint32_t) length,
+		.checksum = 0,
+		.kind = (uint32_t) entry->kind,
+		.oid = entry->oid,
+		.pid = entry->pid,
+		.startTime = entry->startTime,
+		.doneTime = entry->doneTime,
+		.durationMs = entry->durationMs
+	};
+
+	char *ptr = record + sizeof(JournalRecordHeader);
+
+	memcpy(ptr, nspname, nsplen);
+	memcpy(ptr + nsplen, relname, rellen);
+	memcpy(ptr + nsplen + rellen, command, cmdlen);
+
+	memcpy(record, &header, sizeof(JournalRecordHeader));
+	header.checksum = journal_checksum(record, header.length);
+	memcpy(record, &header, sizeof(JournalRecordHeader));
+
+	ssize_t written = write(journal->fd, record, length);
+
+	free(record);
+
+	if (written != (ssize_t) length)
+	{
+		log_error("Failed to append %zu bytes to journal \"%s\": %m",
+				  length,
+				  journal->filename);
+		return false;
+	}
+
+	if (++journal->pending >= JOURNAL_SYNC_BATCH && !journal_sync(journal))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(journal->exportDir))
+	{
+		/* the journal is the reference, failing to export is not an error */
+		(void) journal_export_entry(journal, entry);
+	}
+
+	return true;
+}
+
+
+/*
+ * journal_sync flushes the records that this process has appended to the
+ * journal to disk.
+ */
+bool
+journal_sync(Journal *journal)
+{
+	if (journal->fd == -1 || journal->pid != getpid() || journal->pending == 0)
+	{
+		return true;
+	}
+
+	if (fsync(journal->fd) != 0)
+	{
+		log_error("Failed to fsync journal \"%s\": %m", journal->filename);
+		return false;
+	}
+
+	journal->pending = 0;
+
+	return true;
+}
+
+
+/*
+ * journal_load reads the journal file contents in memory, and indexes the
+ * entries found there by oid. When the same oid has been registered more than
+ * once, the last record wins.
+ *
+ * The file may end with an incomplete record when a process has been
+ * interrupted while writing it. The file is then truncated to the last
+ * complete record, so that the records appended later can be read again.
+ */
+bool
+journal_load(Journal *journal)
+{
+	/* free the previously loaded contents, if any */
+	free(journal->contents);
+	free(journal->entries);
+
+	journal->contents = NULL;
+	journal->entries = NULL;
+	journal->entriesSize = 0;
+	journal->entriesCount = 0;
+
+	if (!file_exists(journal->filename))
+	{
+		return true;
+	}
+
+	char *contents = NULL;
+	long size = 0L;
+
+	if (!read_file(journal->filename, &contents, &size))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	journal->contents = contents;
+
+	long offset = 0L;
+
+	while (offset < size)
+	{
+		JournalEntry entry = { 0 };
+		uint32_t length = 0;
+
+		if (!journal_parse_record(contents + offset,
+								  size - offset,
+								  &entry,
+								  &length))
+		{
+			log_warn("Journal \"%s\" ends with an incomplete record at "
+					 "offset %ld, truncating the last %ld bytes",
+					 journal->filename,
+					 offset,
+					 size - offset);
+
+			if (truncate(journal->filename, offset) != 0)
+			{
+				log_error("Failed to truncate journal \"%s\": %m",
+						  journal->filename);
+				return false;
+			}
+
+			break;
+		}
+
+		if (!journal_insert(journal, &entry))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		offset += length;
+	}
+
+	log_debug("Loaded %u entries from journal \"%s\"",
+			  journal->entriesCount,
+			  journal->filename);
+
+	return true;
+}
+
+
+/*
+ * journal_lookup returns the entry for the given oid, or NULL when the oid
+ * has not been found in the journal at the time of the last journal_load(),
+ * or when its last record is a dropped record.
+ */
+JournalEntry *
+journal_lookup(Journal *journal, uint32_t oid)
+{
+	JournalEntry *entry = journal_find(journal, oid);
+
+	if (entry == NULL || entry->kind == JOURNAL_RECORD_DROPPED)
+	{
+		return NULL;
+	}
+
+	return entry;
+}
+
+
+/*
+ * journal_was_dropped returns true when the last record of the given oid in
+ * the journal is a dropped record: the object existed on the target and has
+ * not been created again since.
+ */
+bool
+journal_was_dropped(Journal *journal, uint32_t oid)
+{
+	JournalEntry *entry = journal_find(journal, oid);
+
+	return entry != NULL && entry->kind == JOURNAL_RECORD_DROPPED;
+}
+
+
+/*
+ * journal_close syncs the pending records, closes the journal file, and
+ * releases the memory used by the loaded entries.
+ */
+void
+journal_close(Journal *journal)
+{
+	(void) journal_sync(journal);
+
+	if (journal->fd != -1 && journal->pid == getpid())
+	{
+		(void) close(journal->fd);
+	}
+
+	free(journal->contents);
+	free(journal->entries);
+
+	journal->fd = -1;
+	journal->pid = 0;
+	journal->pending = 0;
+	journal->contents = NULL;
+	journal->entries = NULL;
+	journal->entriesSize = 0;
+	journal->entriesCount = 0;
+}
+
+
+/*
+ * journal_open opens the journal file for appending, once per process: a
+ * sub-process does not share the pending records count of its parent.
+ */
+static bool
+journal_open(Journal *journal)
+{
+	pid_t pid = getpid();
+
+	if (journal->fd != -1 && journal->pid == pid)
+	{
+		return true;
+	}
+
+	int fd = open(journal->filename, FOPEN_FLAGS_A, 0644);
+
+	if (fd == -1)
+	{
+		log_error("Failed to open journal \"%s\": %m", journal->filename);
+		return false;
+	}
+
+	journal->fd = fd;
+	journal->pid = pid;
+	journal->pending = 0;
+
+	return true;
+}
+
+
+/*
+ * journal_parse_record parses the record found at data into the given entry,
+ * which then points to the strings in data. Returns false when the record is
+ * incomplete or corrupted.
+ */
+static bool
+journal_parse_record(char *data, long size, JournalEntry *entry,
+					 uint32_t *length)
+{
+	JournalRecordHeader header = { 0 };
+
+	if (size < (long) sizeof(JournalRecordHeader))
+	{
+		return false;
+	}
+
+	memcpy(&header, data, sizeof(JournalRecordHeader));
+
+	if (header.magic != JOURNAL_RECORD_MAGIC ||
+		header.length < sizeof(JournalRecordHeader) + 3 ||
+		(long) header.length > size ||
+		data[header.length - 1] != '\0')
+	{
+		return false;
+	}
+
+	uint32_t checksum = header.checksum;
+
+	header.checksum = 0;
+	memcpy(data, &header, sizeof(JournalRecordHeader));
+
+	bool valid = journal_checksum(data, header.length) == checksum;
+
+	header.checksum = checksum;
+	memcpy(data, &header, sizeof(JournalRecordHeader));
+
+	if (!valid)
+	{
+		return false;
+	}
+
+	char *nspname = data + sizeof(JournalRecordHeader);
+	char *end = data + header.length;
+	char *relname = nspname + strnlen(nspname, end - nspname) + 1;
+
+	if (relname >= end)
+	{
+		return false;
+	}
+
+	char *command = relname + strnlen(relname, end - relname) + 1;
+
+	if (command >= end)
+	{
+		return false;
+	}
+
+	entry->oid = header.oid;
+	entry->kind = (JournalRecordKind) header.kind;
+	entry->pid = header.pid;
+	entry->startTime = header.startTime;
+	entry->doneTime = header.doneTime;
+	entry->durationMs = header.durationMs;
+	entry->nspname = nspname;
+	entry->relname = relname;
+	entry->command = command;
+
+	*length = header.length;
+
+	return true;
+}
+
+
+/*
+ * journal_find returns the hash table entry for the given oid, whatever the
+ * kind of its last record, or NULL when the oid is not in the journal.
+ */
+static JournalEntry *
+journal_find(Journal *journal, uint32_t oid)
+{
+	if (journal->entriesSize == 0 || oid == 0)
+	{
+		return NULL;
+	}
+
+	uint32_t mask = journal->entriesSize - 1;
+	uint32_t slot = (oid * 2654435761u) & mask;
+
+	while (journal->entries[slot].oid != 0)
+	{
+		if (journal->entries[slot].oid == oid)
+		{
+			return &(journal->entries[slot]);
+		}
+
+		slot = (slot + 1) & mask;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * journal_insert registers the given entry in the journal hash table.
+ */
+static bool
+journal_insert(Journal *journal, JournalEntry *entry)
+{
+	if (entry->oid == 0)
+	{
+		return true;
+	}
+
+	/* keep the load factor under 1/2 */
+	if ((journal->entriesCount + 1) * 2 > journal->entriesSize)
+	{
+		if (!journal_grow_entries(journal))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	uint32_t mask = journal->entriesSize - 1;
+	uint32_t slot = (entry->oid * 2654435761u) & mask;
+
+	while (journal->entries[slot].oid != 0 &&
+		   journal->entries[slot].oid != entry->oid)
+	{
+		slot = (slot + 1) & mask;
+	}
+
+	if (journal->entries[slot].oid == 0)
+	{
+		++journal->entriesCount;
+	}
+
+	journal->entries[slot] = *entry;
+
+	return true;
+}
+
+
+/*
+ * journal_grow_entries doubles the size of the journal entries hash table.
+ */
+static bool
+journal_grow_entries(Journal *journal)
+{
+	uint32_t size =
+		journal->entriesSize == 0
+		? JOURNAL_ENTRIES_INITIAL_SIZE
+		: journal->entriesSize * 2;
+
+	JournalEntry *entries = (JournalEntry *) calloc(size, sizeof(JournalEntry));
+
+	if (entries == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	uint32_t mask = size - 1;
+
+	for (uint32_t i = 0; i < journal->entriesSize; i++)
+	{
+		JournalEntry *entry = &(journal->entries[i]);
+
+		if (entry->oid == 0)
+		{
+			continue;
+		}
+
+		uint32_t slot = (entry->oid * 2654435761u) & mask;
+
+		while (entries[slot].oid != 0)
+		{
+			slot = (slot + 1) & mask;
+		}
+
+		entries[slot] = *entry;
+	}
+
+	free(journal->entries);
+
+	journal->entries = entries;
+	journal->entriesSize = size;
+
+	return true;
+}
+
+
+/*
+ * journal_export_entry writes the done file of the given entry, using the
+ * same per-object layout as previous pgcopydb releases: the index summary
+ * format of write_index_summary() for indexes, and the SQL command for
+ * constraints and foreign keys. The done file of a dropped object is removed.
+ */
+static bool
+journal_export_entry(Journal *journal, JournalEntry *entry)
+{
+	char doneFile[MAXPGPATH] = { 0 };
+	char contents[2 * BUFSIZE] = { 0 };
+
+	sformat(doneFile, sizeof(doneFile), "%s/%u.done",
+			journal->exportDir,
+			entry->oid);
+
+	if (entry->kind == JOURNAL_RECORD_DROPPED)
+	{
+		return unlink_file(doneFile);
+	}
+
+	if (entry->kind == JOURNAL_RECORD_INDEX)
+	{
+		sformat(contents, sizeof(contents),
+				"%d\n%u\n%s\n%s\n%lld\n%lld\n%lld\n%s\n",
+				entry->pid,
+				entry->oid,
+				entry->nspname,
+				entry->relname,
+				(long long) entry->startTime,
+				(long long) entry->doneTime,
+				(long long) entry->durationMs,
+				entry->command);
+	}
+	else
+	{
+		sformat(contents, sizeof(contents), "%s;\n", entry->command);
+	}
+
+	if (!write_file(contents, strlen(contents), doneFile))
+	{
+		log_warn("Failed to export journal entry to \"%s\"", doneFile);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * journal_checksum implements the FNV-1a hash function on a record.
+ */
+static uint32_t
+journal_checksum(const char *data, uint32_t length)
+{
+	uint32_t hash = 2166136261u;
+
+	for (uint32_t i = 0; i < length; i++)
+	{
+		hash ^= (unsigned char) data[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
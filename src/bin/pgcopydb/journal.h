@@ -0,0 +1,69 @@
+/*
+ * src/bin/pgcopydb/journal.h
+ *   Append-only journal of the objects that have been processed
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "postgres_fe.h"
+
+/*
+ * The journal registers the indexes, constraints, and foreign keys that have
+ * been created on the target, in place of one done file per object. A dropped
+ * record revokes the previous records of the same object, which has been
+ * dropped on the target to be created again, see --refresh.
+ */
+typedef enum
+{
+	JOURNAL_RECORD_UNKNOWN = 0,
+	JOURNAL_RECORD_INDEX,
+	JOURNAL_RECORD_CONSTRAINT,
+	JOURNAL_RECORD_FOREIGN_KEY,
+	JOURNAL_RECORD_DROPPED
+} JournalRecordKind;
+
+/*
+ * A journal entry points to the strings of its record in the journal file
+ * contents, loaded in memory with journal_load().
+ */
+typedef struct JournalEntry
+{
+	uint32_t oid;               /* 0 is an empty slot */
+	JournalRecordKind kind;
+	int pid;
+	uint64_t startTime;         /* time(NULL) at start time */
+	uint64_t doneTime;          /* time(NULL) at done time */
+	uint64_t durationMs;
+	const char *nspname;
+	const char *relname;
+	const char *command;        /* SQL command, without the ending ';' */
+} JournalEntry;
+
+typedef struct Journal
+{
+	char filename[MAXPGPATH];   /* /tmp/pgcopydb/run/state.journal */
+	char exportDir[MAXPGPATH];  /* --state-files: also write done files */
+
+	int fd;                     /* O_APPEND file descriptor, or -1 */
+	pid_t pid;                  /* process that opened fd */
+	int pending;                /* records written since the last fsync */
+
+	char *contents;             /* malloc'ed area, see journal_load() */
+	JournalEntry *entries;      /* open addressing hash table on oid */
+	uint32_t entriesSize;       /* power of two */
+	uint32_t entriesCount;
+} Journal;
+
+void journal_init(Journal *journal, const char *filename, const char *exportDir);
+bool journal_append(Journal *journal, JournalEntry *entry);
+bool journal_sync(Journal *journal);
+bool journal_load(Journal *journal);
+JournalEntry * journal_lookup(Journal *journal, uint32_t oid);
+bool journal_was_dropped(Journal *journal, uint32_t oid);
+void journal_close(Journal *journal);
+
+#endif /* JOURNAL_H */
@@ -0,0 +1,468 @@
+/*
+ * src/bin/pgcopydb/largeobjects.c
+ *     Implementation of a CLI to copy a database between two Postgres instances
+ */
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "copydb.h"
+#include "lock_utils.h"
+#include "log.h"
+#include "pgsql.h"
+#include "schema.h"
+#include "signals.h"
+#include "string_utils.h"
+
+
+/*
+ * The large object workers pull their next batch of large objects from a
+ * queue that lives in shared memory.
+ */
+typedef struct LargeObjectQueue
+{
+	Semaphore semaphore;        /* protects next */
+	size_t size;                /* size of the shared memory area */
+	int count;
+	int next;
+	LargeObjectRange array[];
+} LargeObjectQueue;
+
+
+static LargeObjectQueue * copydb_large_object_queue_init(
+	LargeObjectRangeArray *rangeArray);
+static bool copydb_large_object_queue_finish(LargeObjectQueue *queue);
+static bool copydb_large_object_queue_pop(LargeObjectQueue *queue,
+										  LargeObjectRange *range);
+static bool copydb_start_large_object_worker(CopyDataSpec *specs,
+											 LargeObjectQueue *queue,
+											 TableDataProcess *process);
+static bool copydb_large_object_worker(CopyDataSpec *specs,
+									   LargeObjectQueue *queue);
+static bool copydb_copy_large_object_batch(PGSQL *src,
+										   PGSQL *dst,
+										   LargeObjectRange *range,
+										   char *buffer,
+										   uint64_t *bytes);
+
+
+/*
+ * copydb_copy_all_large_objects copies the contents of the large objects of
+ * the source database, which pg_dump only includes in the data section. The
+ * large objects are split in batches of consecutive OIDs, and a pool of
+ * --large-object-jobs workers copies one batch after the other, each in a
+ * single target transaction.
+ *
+ * The workers read the large objects in the same snapshot as the tables.
+ */
+bool
+copydb_copy_all_large_objects(CopyDataSpec *specs)
+{
+	PGSQL pgsql = { 0 };
+	LargeObjectRangeArray rangeArray = { 0, NULL };
+
+	if (!pgsql_init(&pgsql, specs->source_pguri, PGSQL_CONN_SOURCE))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!copydb_set_snapshot(&(specs->sourceSnapshot), &pgsql))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!schema_list_large_object_ranges(&pgsql,
+										 LARGE_OBJECT_BATCH_SIZE,
+										 &rangeArray))
+	{
+		/* errors have already been logged */
+		pgsql_finish(&pgsql);
+		return false;
+	}
+
+	/* close the read-only transaction and the connection, if any */
+	pgsql_finish(&pgsql);
+
+	if (rangeArray.count == 0)
+	{
+		log_info("No large objects to copy");
+		free(rangeArray.array);
+		return true;
+	}
+
+	int64_t largeObjectCount = 0;
+
+	for (int i = 0; i < rangeArray.count; i++)
+	{
+		largeObjectCount += rangeArray.array[i].count;
+	}
+
+	int workerCount =
+		rangeArray.count < specs->largeObjectJobs
+		? rangeArray.count
+		: specs->largeObjectJobs;
+
+	log_info("Copying %lld large objects in %d batches using %d workers",
+			 (long long) largeObjectCount,
+			 rangeArray.count,
+			 workerCount);
+
+	LargeObjectQueue *queue = copydb_large_object_queue_init(&rangeArray);
+
+	free(rangeArray.array);
+
+	if (queue == NULL)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	TableDataProcessArray processArray = { 0, NULL };
+
+	processArray.array =
+		(TableDataProcess *) calloc(workerCount, sizeof(TableDataProcess));
+
+	if (processArray.array == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		(void) copydb_large_object_queue_finish(queue);
+		return false;
+	}
+
+	for (int workerIndex = 0; workerIndex < workerCount; workerIndex++)
+	{
+		TableDataProcess *process =
+			&(processArray.array[processArray.count++]);
+
+		if (!copydb_start_large_object_worker(specs, queue, process))
+		{
+			log_fatal("Failed to start large object worker %d, "
+					  "see above for details",
+					  workerIndex);
+
+			(void) copydb_fatal_exit(&processArray);
+			(void) copydb_large_object_queue_finish(queue);
+			free(processArray.array);
+			return false;
+		}
+
+		log_debug("[%d] is large object worker %d", process->pid, workerIndex);
+	}
+
+	bool success =
+		copydb_wait_for_processes(processArray.array, processArray.count);
+
+	free(processArray.array);
+
+	if (!copydb_large_object_queue_finish(queue))
+	{
+		log_warn("Failed to release the large object queue, "
+				 "see above for details");
+	}
+
+	return success;
+}
+
+
+/*
+ * copydb_large_object_queue_init allocates the queue of large object batches
+ * in shared memory, and fills it in with the given ranges.
+ */
+static LargeObjectQueue *
+copydb_large_object_queue_init(LargeObjectRangeArray *rangeArray)
+{
+	size_t size =
+		sizeof(LargeObjectQueue) + rangeArray->count * sizeof(LargeObjectRange);
+
+	void *area = mmap(NULL, size,
+					  PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_ANONYMOUS,
+					  -1, 0);
+
+	if (area == MAP_FAILED)
+	{
+		log_error("Failed to allocate %lld bytes of shared memory for "
+				  "the large object queue: %m",
+				  (long long) size);
+		return NULL;
+	}
+
+	LargeObjectQueue *queue = (LargeObjectQueue *) area;
+
+	queue->size = size;
+	queue->count = rangeArray->count;
+	queue->next = 0;
+
+	for (int i = 0; i < rangeArray->count; i++)
+	{
+		queue->array[i] = rangeArray->array[i];
+	}
+
+	/* the semaphore initValue defaults to 1: a mutex */
+	queue->semaphore.initValue = 1;
+
+	if (!semaphore_create(&(queue->semaphore)))
+	{
+		log_error("Failed to create the large object queue semaphore");
+		(void) munmap(area, size);
+		return NULL;
+	}
+
+	return queue;
+}
+
+
+/*
+ * copydb_large_object_queue_finish removes the large object queue semaphore
+ * and releases the shared memory area.
+ */
+static bool
+copydb_large_object_queue_finish(LargeObjectQueue *queue)
+{
+	bool success = true;
+
+	if (!semaphore_finish(&(queue->semaphore)))
+	{
+		log_warn("Failed to remove large object queue semaphore %d",
+				 queue->semaphore.semId);
+		success = false;
+	}
+
+	if (munmap((void *) queue, queue->size) != 0)
+	{
+		log_warn("Failed to release the large object queue shared memory: %m");
+		success = false;
+	}
+
+	return success;
+}
+
+
+/*
+ * copydb_large_object_queue_pop fetches the next batch of large objects from
+ * the queue. Returns false when the queue is empty.
+ */
+static bool
+copydb_large_object_queue_pop(LargeObjectQueue *queue, LargeObjectRange *range)
+{
+	bool found = false;
+
+	if (!semaphore_lock(&(queue->semaphore)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (queue->next < queue->count)
+	{
+		*range = queue->array[queue->next++];
+		found = true;
+	}
+
+	(void) semaphore_unlock(&(queue->semaphore));
+
+	return found;
+}
+
+
+/*
+ * copydb_start_large_object_worker forks a large object worker sub-process,
+ * see copydb_large_object_worker(), and registers it in the given process
+ * slot.
+ */
+static bool
+copydb_start_large_object_worker(CopyDataSpec *specs,
+								 LargeObjectQueue *queue,
+								 TableDataProcess *process)
+{
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	int fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork a large object worker process");
+			return false;
+		}
+
+		case 0:
+		{
+			/* child process runs the command */
+			if (!copydb_large_object_worker(specs, queue))
+			{
+				/* errors have already been logged */
+				exit(EXIT_CODE_INTERNAL_ERROR);
+			}
+
+			exit(EXIT_CODE_QUIT);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			process->pid = fpid;
+
+			return true;
+		}
+	}
+}
+
+
+/*
+ * copydb_large_object_worker implements a large object worker: it pulls
+ * batches of large objects from the shared queue and copies them one after
+ * the other, until the queue is empty.
+ *
+ * The source connection stays in the same transaction for all the batches,
+ * using the main process snapshot when there is one, and each batch is
+ * copied in its own target transaction. When a batch fails, the worker
+ * stops, and the other workers go on with the rest of the queue.
+ */
+static bool
+copydb_large_object_worker(CopyDataSpec *specs, LargeObjectQueue *queue)
+{
+	PGSQL src = { 0 };
+	PGSQL dst = { 0 };
+
+	(void) trace_set_process_name("large object worker");
+
+	if (!pgsql_init(&src, specs->source_pguri, PGSQL_CONN_SOURCE) ||
+		!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET) ||
+		!copydb_set_target_session(&(specs->bulkLoadProfile),
+								   BULK_LOAD_PHASE_COPY,
+								   &dst))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!copydb_set_snapshot(&(specs->sourceSnapshot), &src))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* the large object functions need a transaction on the source too */
+	if (src.connection == NULL && !pgsql_begin(&src))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pgsql_open_persistent_connection(&dst))
+	{
+		/* errors have already been logged */
+		pgsql_finish(&src);
+		return false;
+	}
+
+	char *buffer = (char *) malloc(LARGE_OBJECT_BUFFER_SIZE);
+
+	if (buffer == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		pgsql_finish(&src);
+		pgsql_finish(&dst);
+		return false;
+	}
+
+	bool success = true;
+	int64_t count = 0;
+	uint64_t bytes = 0;
+
+	LargeObjectRange range = { 0 };
+
+	while (copydb_large_object_queue_pop(queue, &range))
+	{
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			success = false;
+			break;
+		}
+
+		if (!copydb_copy_large_object_batch(&src, &dst, &range, buffer, &bytes))
+		{
+			log_error("Failed to copy large objects %u to %u, "
+					  "see above for details",
+					  range.min,
+					  range.max);
+			success = false;
+			break;
+		}
+
+		count += range.count;
+	}
+
+	char bytesPretty[BUFSIZE] = { 0 };
+
+	(void) pretty_print_bytes(bytesPretty, sizeof(bytesPretty), bytes);
+
+	log_info("Copied %lld large objects (%s)", (long long) count, bytesPretty);
+
+	free(buffer);
+
+	/* the source connection is in a read-only transaction, fine */
+	pgsql_finish(&src);
+	pgsql_finish(&dst);
+
+	return success;
+}
+
+
+/*
+ * copydb_copy_large_object_batch copies the large objects in the given range
+ * in a single target transaction. The large objects that the pre-data
+ * section did not restore are created first.
+ */
+static bool
+copydb_copy_large_object_batch(PGSQL *src,
+							   PGSQL *dst,
+							   LargeObjectRange *range,
+							   char *buffer,
+							   uint64_t *bytes)
+{
+	LargeObjectArray loArray = { 0, NULL };
+
+	if (!schema_list_large_objects(src, range, &loArray))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pgsql_execute(dst, "BEGIN"))
+	{
+		/* errors have already been logged */
+		free(loArray.array);
+		return false;
+	}
+
+	bool success = schema_create_large_objects(dst, &loArray);
+
+	for (int i = 0; success && i < loArray.count; i++)
+	{
+		success = pgsql_copy_large_object(src, dst,
+										  loArray.array[i],
+										  buffer,
+										  LARGE_OBJECT_BUFFER_SIZE,
+										  bytes);
+	}
+
+	free(loArray.array);
+
+	if (!success)
+	{
+		(void) pgsql_execute(dst, "ROLLBACK");
+		return false;
+	}
+
+	return pgsql_execute(dst, "COMMIT");
+}
@@ -168,15 +168,21 @@ set_logger()
 	 */
 	log_use_colors(isatty(fileno(stderr)));
 
-	/* initialize the semaphore used for locking log output */
+	/*
+	 * The log semaphore is shared with our sub-processes, and registered in
+	 * our pidfile. The logging facility does not need to take it, though:
+	 * each process writes whole lines with a single write(2) call, and
+	 * batches its TRACE and DEBUG lines, see log_set_buffered().
+	 */
 	if (!semaphore_init(&log_semaphore))
 	{
 		exit(EXIT_CODE_INTERNAL_ERROR);
 	}
 
-	/* set our logging facility to use our semaphore as a lock mechanism */
-	(void) log_set_udata(&log_semaphore);
-	(void) log_set_lock(&semaphore_log_lock_function);
+	(void) log_set_buffered(true);
+
+	/* write the buffered log lines at exit, in sub-processes too */
+	atexit(log_flush);
 }
 
 
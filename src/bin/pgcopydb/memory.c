@@ -0,0 +1,501 @@
+/*
+ * src/bin/pgcopydb/memory.c
+ *     Share a global COPY memory budget between the table workers
+ *
+ * PQgetCopyData() hands over a whole row at a time, so that a table with
+ * very wide rows (large bytea or text values) needs at least that much memory
+ * in libpq buffers, and then pg_copy() copies the rows into its own buffers,
+ * which grow to the row size, once per slot of its ring of buffers when using
+ * --copy-pipeline-depth.
+ *
+ * With --copy-memory-budget, each table job reserves its estimated footprint
+ * against the budget before it starts, see copydb_memory_reserve_job(): the
+ * table queue then skips the jobs that don't fit, so that tables with wide
+ * rows run with fewer concurrent peers. In pipelined mode, pg_copy() also
+ * reserves the rows that are larger than its estimate before copying them
+ * into its ring of buffers, see copydb_memory_reserve_rows().
+ *
+ * A job that waits for row memory keeps its own reservation meanwhile, so
+ * when all the running jobs are waiting none of them can make progress: the
+ * job that has been waiting the longest then reserves over the budget.
+ */
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "copydb.h"
+#include "lock_utils.h"
+#include "log.h"
+#include "signals.h"
+#include "string_utils.h"
+
+
+static bool copydb_memory_wait_enter(CopyMemoryBudget *budget,
+									 int *slot,
+									 uint64_t *ticket);
+static void copydb_memory_wait_leave(CopyMemoryBudget *budget, int slot);
+static bool copydb_memory_wait_is_oldest(CopyMemoryBudget *budget,
+										 uint64_t ticket);
+
+
+/*
+ * copydb_memory_budget_init allocates the COPY memory budget area in shared
+ * memory, when using --copy-memory-budget.
+ */
+bool
+copydb_memory_budget_init(CopyDataSpec *specs, int workerCount)
+{
+	specs->memoryBudget = NULL;
+
+	if (specs->copyMemoryBudget == 0)
+	{
+		return true;
+	}
+
+	size_t size = sizeof(CopyMemoryBudget) + workerCount * sizeof(uint64_t);
+
+	void *area = mmap(NULL, size,
+					  PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_ANONYMOUS,
+					  -1, 0);
+
+	if (area == MAP_FAILED)
+	{
+		log_error("Failed to allocate %lld bytes of shared memory for "
+				  "the COPY memory budget: %m",
+				  (long long) size);
+		return false;
+	}
+
+	CopyMemoryBudget *budget = (CopyMemoryBudget *) area;
+
+	budget->size = size;
+	budget->budget = specs->copyMemoryBudget;
+	budget->inUse = 0;
+	budget->jobsRunning = 0;
+	budget->jobsWaiting = 0;
+	budget->nextWaitTicket = 1;
+	budget->waitSlotCount = workerCount;
+
+	for (int i = 0; i < workerCount; i++)
+	{
+		budget->waitTickets[i] = 0;
+	}
+
+	/* the semaphore initValue defaults to 1: a mutex */
+	budget->semaphore.initValue = 1;
+
+	if (!semaphore_create(&(budget->semaphore)))
+	{
+		log_error("Failed to create the COPY memory budget semaphore");
+		(void) munmap(area, size);
+		return false;
+	}
+
+	log_info("Sharing %s of COPY memory between %d table workers",
+			 specs->copyMemoryBudgetPretty,
+			 workerCount);
+
+	specs->memoryBudget = budget;
+
+	return true;
+}
+
+
+/*
+ * copydb_memory_budget_finish removes the COPY memory budget semaphore and
+ * releases the shared memory area.
+ */
+bool
+copydb_memory_budget_finish(CopyDataSpec *specs)
+{
+	CopyMemoryBudget *budget = specs->memoryBudget;
+	bool success = true;
+
+	if (budget == NULL)
+	{
+		return true;
+	}
+
+	if (!semaphore_finish(&(budget->semaphore)))
+	{
+		log_warn("Failed to remove COPY memory budget semaphore %d",
+				 budget->semaphore.semId);
+		success = false;
+	}
+
+	if (munmap((void *) budget, budget->size) != 0)
+	{
+		log_warn("Failed to release the COPY memory budget shared memory: %m");
+		success = false;
+	}
+
+	specs->memoryBudget = NULL;
+
+	return success;
+}
+
+
+/*
+ * copydb_table_memory_estimate returns how much memory the COPY of the given
+ * table is expected to use, and sets rowAllowance to the part of it that
+ * covers the ring slots growing to the size of the table rows.
+ *
+ * The average row size is computed from the source catalogs, TOAST included.
+ * The row being processed is held twice in libpq: in its input buffer and in
+ * the copy that PQgetCopyData() returns. Then, in lockstep mode, rows that
+ * are larger than the COPY buffer are sent directly, and in pipelined mode
+ * each slot of the ring grows to the size of such a row.
+ */
+uint64_t
+copydb_table_memory_estimate(CopyTableDataSpec *tableSpecs,
+							 uint64_t *rowAllowance)
+{
+	SourceTable *table = tableSpecs->sourceTable;
+
+	uint64_t bufferSize = tableSpecs->copyBufferSize;
+	int depth = tableSpecs->copyPipelineDepth;
+	uint64_t slots = depth > 0 ? depth : 1;
+
+	uint64_t rowBytes =
+		table->reltuples > 0 && table->bytes > 0
+		? table->bytes / table->reltuples
+		: 0;
+
+	*rowAllowance =
+		depth > 0 && rowBytes > bufferSize
+		? slots * (rowBytes - bufferSize)
+		: 0;
+
+	return slots * bufferSize + 2 * rowBytes + *rowAllowance;
+}
+
+
+/*
+ * copydb_memory_reserve_job reserves the estimated memory of the given table
+ * job against the budget, when it fits. This is called from the table queue
+ * with the queue semaphore held, so it does not wait: fits is set to false
+ * and the queue then tries its next job.
+ *
+ * A job always fits when no other job holds a reservation, so that the
+ * tables that are estimated to need more than the whole budget are still
+ * copied, one at a time.
+ */
+bool
+copydb_memory_reserve_job(CopyMemoryBudget *budget,
+						  CopyTableDataSpec *tableSpecs,
+						  CopyMemoryGrant *grant,
+						  bool *fits)
+{
+	*grant = (CopyMemoryGrant) { 0 };
+	*fits = true;
+
+	if (budget == NULL)
+	{
+		return true;
+	}
+
+	uint64_t rowAllowance = 0;
+	uint64_t estimate = copydb_table_memory_estimate(tableSpecs, &rowAllowance);
+
+	if (!semaphore_lock(&(budget->semaphore)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	*fits =
+		budget->jobsRunning == 0 ||
+		budget->inUse + estimate <= budget->budget;
+
+	if (*fits)
+	{
+		budget->inUse += estimate;
+		++budget->jobsRunning;
+	}
+
+	(void) semaphore_unlock(&(budget->semaphore));
+
+	if (*fits)
+	{
+		grant->budget = budget;
+		grant->jobBytes = estimate;
+		grant->rowAllowance = rowAllowance;
+
+		if (estimate > budget->budget)
+		{
+			char pretty[BUFSIZE] = { 0 };
+
+			(void) pretty_print_bytes(pretty, sizeof(pretty), estimate);
+
+			log_warn("Table \"%s\".\"%s\" needs an estimated %s of COPY "
+					 "memory, more than the --copy-memory-budget: "
+					 "copying it without concurrent table jobs",
+					 tableSpecs->sourceTable->nspname,
+					 tableSpecs->sourceTable->relname,
+					 pretty);
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_memory_release_job releases the memory reserved by a table job,
+ * including the rows that pg_copy() reserved on top of the job estimate.
+ */
+void
+copydb_memory_release_job(CopyMemoryGrant *grant)
+{
+	CopyMemoryBudget *budget = grant->budget;
+
+	if (budget == NULL)
+	{
+		return;
+	}
+
+	if (!semaphore_lock(&(budget->semaphore)))
+	{
+		/* errors have already been logged */
+		return;
+	}
+
+	uint64_t reserved = grant->jobBytes + grant->extraBytes;
+
+	budget->inUse = budget->inUse > reserved ? budget->inUse - reserved : 0;
+	--budget->jobsRunning;
+
+	(void) semaphore_unlock(&(budget->semaphore));
+
+	*grant = (CopyMemoryGrant) { 0 };
+}
+
+
+/*
+ * copydb_memory_reserve_rows implements the pg_copy() reserveMemory callback:
+ * it is called by the pipeline reader thread before a slot of the ring of
+ * buffers grows to hold a wide row. The part of the job estimate that covers
+ * wide rows is used first, and then we wait until the budget has enough room
+ * left for the rest. Returns false when interrupted.
+ *
+ * When all the running jobs are waiting here, the memory that they wait for
+ * is never going to be released: the job that has been waiting the longest
+ * then reserves its rows over the budget, and the others keep waiting.
+ *
+ * The pipeline writer thread releases the rows concurrently, so the grant is
+ * only ever updated with the budget semaphore held.
+ */
+bool
+copydb_memory_reserve_rows(void *context, uint64_t bytes)
+{
+	CopyMemoryGrant *grant = (CopyMemoryGrant *) context;
+	CopyMemoryBudget *budget = grant->budget;
+
+	if (budget == NULL)
+	{
+		return true;
+	}
+
+	bool waited = false;
+	int slot = -1;
+	uint64_t ticket = 0;
+
+	for (;;)
+	{
+		if (!semaphore_lock(&(budget->semaphore)))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		uint64_t held = grant->rowBytes + bytes;
+		uint64_t needed =
+			held > grant->rowAllowance ? held - grant->rowAllowance : 0;
+		uint64_t delta =
+			needed > grant->extraBytes ? needed - grant->extraBytes : 0;
+
+		/* when no other job holds memory, waiting would not help */
+		bool alone = budget->inUse == grant->jobBytes + grant->extraBytes;
+
+		/* when all the running jobs wait, none of them releases memory */
+		bool stuck =
+			waited &&
+			budget->jobsWaiting >= budget->jobsRunning &&
+			copydb_memory_wait_is_oldest(budget, ticket);
+
+		bool reserved =
+			delta == 0 || alone || stuck ||
+			budget->inUse + delta <= budget->budget;
+
+		if (reserved)
+		{
+			grant->rowBytes = held;
+			grant->extraBytes += delta;
+			budget->inUse += delta;
+
+			if (waited)
+			{
+				copydb_memory_wait_leave(budget, slot);
+			}
+		}
+		else if (!waited)
+		{
+			if (!copydb_memory_wait_enter(budget, &slot, &ticket))
+			{
+				(void) semaphore_unlock(&(budget->semaphore));
+				return false;
+			}
+		}
+
+		(void) semaphore_unlock(&(budget->semaphore));
+
+		if (reserved)
+		{
+			if (stuck && delta > 0)
+			{
+				log_warn("All table jobs are waiting for COPY memory, "
+						 "reserving %lld bytes over the --copy-memory-budget",
+						 (long long) delta);
+			}
+			break;
+		}
+
+		if (!waited)
+		{
+			log_debug("Waiting for %lld bytes of the COPY memory budget",
+					  (long long) delta);
+			waited = true;
+		}
+
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			if (semaphore_lock(&(budget->semaphore)))
+			{
+				copydb_memory_wait_leave(budget, slot);
+				(void) semaphore_unlock(&(budget->semaphore));
+			}
+			return false;
+		}
+
+		log_flush();
+
+		/* wait until some other table job releases its memory */
+		pg_usleep(100 * 1000); /* 100 ms */
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_memory_wait_enter registers a job waiting for row memory, with a
+ * ticket that orders it after the jobs that are waiting already. Must be
+ * called with the budget semaphore held.
+ */
+static bool
+copydb_memory_wait_enter(CopyMemoryBudget *budget, int *slot, uint64_t *ticket)
+{
+	for (int i = 0; i < budget->waitSlotCount; i++)
+	{
+		if (budget->waitTickets[i] == 0)
+		{
+			*slot = i;
+			*ticket = budget->nextWaitTicket++;
+
+			budget->waitTickets[i] = *ticket;
+			++budget->jobsWaiting;
+
+			return true;
+		}
+	}
+
+	log_error("BUG: failed to find a free COPY memory wait slot "
+			  "out of %d slots, with %d jobs running",
+			  budget->waitSlotCount,
+			  budget->jobsRunning);
+
+	return false;
+}
+
+
+/*
+ * copydb_memory_wait_leave unregisters a job that was waiting for row
+ * memory. Must be called with the budget semaphore held.
+ */
+static void
+copydb_memory_wait_leave(CopyMemoryBudget *budget, int slot)
+{
+	if (slot < 0 || slot >= budget->waitSlotCount)
+	{
+		return;
+	}
+
+	budget->waitTickets[slot] = 0;
+	--budget->jobsWaiting;
+}
+
+
+/*
+ * copydb_memory_wait_is_oldest returns true when no other job has been
+ * waiting for row memory longer than the job with the given ticket. Must be
+ * called with the budget semaphore held.
+ */
+static bool
+copydb_memory_wait_is_oldest(CopyMemoryBudget *budget, uint64_t ticket)
+{
+	for (int i = 0; i < budget->waitSlotCount; i++)
+	{
+		uint64_t other = budget->waitTickets[i];
+
+		if (other != 0 && other < ticket)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_memory_release_rows implements the pg_copy() releaseMemory callback:
+ * it is called by the pipeline writer thread once a wide row has been sent
+ * and its slot has been shrunk back to the COPY buffer size.
+ */
+void
+copydb_memory_release_rows(void *context, uint64_t bytes)
+{
+	CopyMemoryGrant *grant = (CopyMemoryGrant *) context;
+	CopyMemoryBudget *budget = grant->budget;
+
+	if (budget == NULL)
+	{
+		return;
+	}
+
+	if (!semaphore_lock(&(budget->semaphore)))
+	{
+		/* errors have already been logged */
+		return;
+	}
+
+	grant->rowBytes = grant->rowBytes > bytes ? grant->rowBytes - bytes : 0;
+
+	uint64_t needed =
+		grant->rowBytes > grant->rowAllowance
+		? grant->rowBytes - grant->rowAllowance
+		: 0;
+
+	if (grant->extraBytes > needed)
+	{
+		uint64_t delta = grant->extraBytes - needed;
+
+		grant->extraBytes = needed;
+		budget->inUse = budget->inUse > delta ? budget->inUse - delta : 0;
+	}
+
+	(void) semaphore_unlock(&(budget->semaphore));
+}
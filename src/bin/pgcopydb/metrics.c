@@ -0,0 +1,594 @@
+/*
+ * src/bin/pgcopydb/metrics.c
+ *     Prometheus metrics endpoint for the table and index workers progress
+ *
+ * With --metrics-port or --metrics-listen, a sub-process serves the metrics
+ * in the Prometheus text exposition format over HTTP, at /metrics. The
+ * endpoint is not authenticated and only listens on localhost by default. The metrics are computed
+ * from the progress area, where the workers publish their counters, and from
+ * the table and index queues, all of them shared memory areas that the
+ * sub-process inherits from the main process.
+ *
+ * Rates such as bytes/s and rows/s are left to the monitoring system: use
+ * rate(pgcopydb_copy_bytes_total[1m]) in PromQL, for instance.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "copydb.h"
+#include "log.h"
+#include "pqexpbuffer.h"
+#include "signals.h"
+#include "string_utils.h"
+
+
+/*
+ * The workers update their cumulative counters and the counters of their
+ * current step without any locking, so a scrape might see a table twice or
+ * not at all while a worker is finishing it. We keep the previous values
+ * around so that the counters we serve never go backwards.
+ */
+typedef struct MetricsCounters
+{
+	uint64_t rows;
+	uint64_t bytes;
+} MetricsCounters;
+
+
+static bool copydb_metrics_listen(const char *host, int port, int *listenFd);
+static bool copydb_metrics_server(CopyDataSpec *specs, int listenFd);
+static void copydb_metrics_serve(CopyDataSpec *specs,
+								 MetricsCounters *counters,
+								 int clientFd);
+static void copydb_metrics_collect(CopyDataSpec *specs,
+								   MetricsCounters *counters,
+								   PQExpBuffer out);
+static void copydb_metrics_workers(ProgressArea *progress, PQExpBuffer out);
+static const char * copydb_metrics_worker_labels(ProgressArea *progress,
+												 int slotIndex);
+static void copydb_metrics_respond(int clientFd,
+								   const char *status,
+								   const char *body,
+								   size_t size);
+
+
+/*
+ * copydb_start_metrics_server opens the metrics server listening socket and
+ * forks the sub-process that serves the metrics, see copydb_metrics_server().
+ * The sub-process exits once copydb_progress_close() has been called.
+ */
+bool
+copydb_start_metrics_server(CopyDataSpec *specs, TableDataProcess *process)
+{
+	int listenFd = -1;
+
+	if (specs->progress == NULL)
+	{
+		log_error("Failed to start the metrics server: "
+				  "the progress area is not available");
+		return false;
+	}
+
+	/* bind in the main process, so that errors are reported right away */
+	if (!copydb_metrics_listen(specs->metricsHost,
+							   specs->metricsPort,
+							   &listenFd))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	int fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork the metrics server process");
+			close(listenFd);
+			return false;
+		}
+
+		case 0:
+		{
+			/* child process runs the command */
+			bool success = copydb_metrics_server(specs, listenFd);
+
+			close(listenFd);
+
+			if (!success)
+			{
+				/* errors have already been logged */
+				exit(EXIT_CODE_INTERNAL_ERROR);
+			}
+
+			exit(EXIT_CODE_QUIT);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			process->pid = fpid;
+
+			close(listenFd);
+
+			log_info("Serving metrics at http://%s:%d/metrics",
+					 IS_EMPTY_STRING_BUFFER(specs->metricsHost)
+					 ? "0.0.0.0"
+					 : specs->metricsHost,
+					 specs->metricsPort);
+
+			return true;
+		}
+	}
+}
+
+
+/*
+ * copydb_metrics_listen opens a TCP socket that listens on the given host and
+ * port, or on all the addresses of the host when the host is empty.
+ */
+static bool
+copydb_metrics_listen(const char *host, int port, int *listenFd)
+{
+	char service[NAMEDATALEN] = { 0 };
+
+	sformat(service, sizeof(service), "%d", port);
+
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE
+	};
+	struct addrinfo *addrs = NULL;
+
+	int err = getaddrinfo(IS_EMPTY_STRING_BUFFER(host) ? NULL : host,
+						  service, &hints, &addrs);
+
+	if (err != 0)
+	{
+		log_error("Failed to resolve metrics address \"%s:%d\": %s",
+				  host, port, gai_strerror(err));
+		return false;
+	}
+
+	int fd = -1;
+
+	for (struct addrinfo *addr = addrs; addr != NULL; addr = addr->ai_next)
+	{
+		fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+
+		if (fd == -1)
+		{
+			continue;
+		}
+
+		int on = 1;
+
+		(void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		if (bind(fd, addr->ai_addr, addr->ai_addrlen) == 0 &&
+			listen(fd, METRICS_LISTEN_BACKLOG) == 0)
+		{
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(addrs);
+
+	if (fd == -1)
+	{
+		log_error("Failed to listen for metrics at \"%s:%d\": %m",
+				  host, port);
+		return false;
+	}
+
+	*listenFd = fd;
+
+	return true;
+}
+
+
+/*
+ * copydb_metrics_server accepts HTTP connections and answers them one at a
+ * time, until the workers are done or we're asked to stop. A scrape only
+ * reads shared memory and is quick enough that a single process does.
+ */
+static bool
+copydb_metrics_server(CopyDataSpec *specs, int listenFd)
+{
+	ProgressArea *progress = specs->progress;
+	MetricsCounters counters = { 0 };
+
+	/* a scraper that goes away must not kill us */
+	pqsignal(SIGPIPE, SIG_IGN);
+
+	while (!progress->closed)
+	{
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			break;
+		}
+
+		struct pollfd pfd = { .fd = listenFd, .events = POLLIN };
+
+		int ret = poll(&pfd, 1, METRICS_POLL_TIMEOUT_MS);
+
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			log_error("Failed to poll the metrics server socket: %m");
+			return false;
+		}
+
+		if (ret == 0)
+		{
+			continue;
+		}
+
+		int clientFd = accept(listenFd, NULL, NULL);
+
+		if (clientFd == -1)
+		{
+			log_debug("Failed to accept a metrics connection: %m");
+			continue;
+		}
+
+		(void) copydb_metrics_serve(specs, &counters, clientFd);
+
+		close(clientFd);
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_metrics_serve reads an HTTP request from the given client and
+ * sends the metrics when the request is GET /metrics, or an error.
+ */
+static void
+copydb_metrics_serve(CopyDataSpec *specs,
+					 MetricsCounters *counters,
+					 int clientFd)
+{
+	char request[BUFSIZE] = { 0 };
+	size_t done = 0;
+
+	/* a stuck client must not block the next scrapes for long */
+	struct timeval timeout = { .tv_sec = METRICS_POLL_TIMEOUT_MS / 1000 };
+
+	(void) setsockopt(clientFd, SOL_SOCKET, SO_RCVTIMEO,
+					  &timeout, sizeof(timeout));
+
+	/* we only need the request line, stop at the end of the headers */
+	while (done < sizeof(request) - 1 && strstr(request, "\r\n\r\n") == NULL)
+	{
+		ssize_t bytes = read(clientFd, request + done, sizeof(request) - 1 - done);
+
+		if (bytes <= 0)
+		{
+			if (bytes == -1 && errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+
+		done += bytes;
+		request[done] = '\0';
+	}
+
+	if (strncmp(request, "GET ", 4) != 0)
+	{
+		const char *body = "method not allowed\n";
+
+		copydb_metrics_respond(clientFd, "405 Method Not Allowed",
+							   body, strlen(body));
+		return;
+	}
+
+	if (strncmp(request, "GET /metrics ", 13) != 0 &&
+		strncmp(request, "GET /metrics?", 13) != 0)
+	{
+		const char *body = "see /metrics\n";
+
+		copydb_metrics_respond(clientFd, "404 Not Found", body, strlen(body));
+		return;
+	}
+
+	PQExpBuffer out = createPQExpBuffer();
+
+	(void) copydb_metrics_collect(specs, counters, out);
+
+	if (PQExpBufferBroken(out))
+	{
+		log_error("Failed to prepare the metrics: out of memory");
+		destroyPQExpBuffer(out);
+
+		const char *body = "out of memory\n";
+
+		copydb_metrics_respond(clientFd, "500 Internal Server Error",
+							   body, strlen(body));
+		return;
+	}
+
+	copydb_metrics_respond(clientFd, "200 OK", out->data, out->len);
+
+	destroyPQExpBuffer(out);
+}
+
+
+/*
+ * copydb_metrics_collect appends the metrics to the given buffer, in the
+ * Prometheus text exposition format.
+ */
+static void
+copydb_metrics_collect(CopyDataSpec *specs,
+					   MetricsCounters *counters,
+					   PQExpBuffer out)
+{
+	ProgressArea *progress = specs->progress;
+	CopyTableQueue *tableQueue = specs->tableQueue;
+	CopyIndexQueue *indexQueue = specs->indexQueue;
+
+	uint64_t rows = 0;
+	uint64_t bytes = 0;
+
+	int copyDone = 0;
+	int copyRunning = 0;
+	int indexDone = 0;
+	int indexRunning = 0;
+
+	int slotCount = progress->tableWorkers + progress->indexWorkers;
+
+	for (int i = 0; i < slotCount; i++)
+	{
+		ProgressSlot *slot = &(progress->slots[i]);
+
+		rows += slot->totalRows;
+		bytes += slot->totalBytes;
+		copyDone += slot->copyDone;
+		indexDone += slot->indexDone;
+
+		switch (slot->step)
+		{
+			case PROGRESS_STEP_COPY:
+			{
+				rows += slot->stats.rows;
+				bytes += slot->stats.bytes;
+				++copyRunning;
+				break;
+			}
+
+			case PROGRESS_STEP_CREATE_INDEX:
+			{
+				++indexRunning;
+				break;
+			}
+
+			default:
+			{
+				break;
+			}
+		}
+	}
+
+	counters->rows = rows > counters->rows ? rows : counters->rows;
+	counters->bytes = bytes > counters->bytes ? bytes : counters->bytes;
+
+	int copyQueued =
+		tableQueue != NULL ? tableQueue->count - tableQueue->next : 0;
+
+	int indexQueued =
+		indexQueue != NULL ? indexQueue->count - indexQueue->next : 0;
+
+	appendPQExpBuffer(out,
+					  "# HELP pgcopydb_start_time_seconds "
+					  "Start time of the workers since the Unix epoch.\n"
+					  "# TYPE pgcopydb_start_time_seconds gauge\n"
+					  "pgcopydb_start_time_seconds %lld\n",
+					  (long long) progress->startTime);
+
+	/* the ETA monitor publishes its estimate every --eta-interval */
+	if (progress->etaTime > 0)
+	{
+		appendPQExpBuffer(out,
+						  "# HELP pgcopydb_estimated_completion_time_seconds "
+						  "Estimated completion time since the Unix epoch.\n"
+						  "# TYPE pgcopydb_estimated_completion_time_seconds "
+						  "gauge\n"
+						  "pgcopydb_estimated_completion_time_seconds %lld\n",
+						  (long long) progress->etaTime);
+	}
+
+	appendPQExpBuffer(out,
+					  "# HELP pgcopydb_copy_rows_total "
+					  "Rows copied by the table workers.\n"
+					  "# TYPE pgcopydb_copy_rows_total counter\n"
+					  "pgcopydb_copy_rows_total %lld\n",
+					  (long long) counters->rows);
+
+	appendPQExpBuffer(out,
+					  "# HELP pgcopydb_copy_bytes_total "
+					  "Bytes of COPY data sent by the table workers.\n"
+					  "# TYPE pgcopydb_copy_bytes_total counter\n"
+					  "pgcopydb_copy_bytes_total %lld\n",
+					  (long long) counters->bytes);
+
+	appendPQExpBuffer(out,
+					  "# HELP pgcopydb_table_jobs "
+					  "COPY jobs of the table workers, one per table part.\n"
+					  "# TYPE pgcopydb_table_jobs gauge\n"
+					  "pgcopydb_table_jobs{state=\"done\"} %d\n"
+					  "pgcopydb_table_jobs{state=\"running\"} %d\n"
+					  "pgcopydb_table_jobs{state=\"queued\"} %d\n",
+					  copyDone,
+					  copyRunning,
+					  copyQueued > 0 ? copyQueued : 0);
+
+	appendPQExpBuffer(out,
+					  "# HELP pgcopydb_index_jobs "
+					  "CREATE INDEX jobs of the index workers.\n"
+					  "# TYPE pgcopydb_index_jobs gauge\n"
+					  "pgcopydb_index_jobs{state=\"done\"} %d\n"
+					  "pgcopydb_index_jobs{state=\"running\"} %d\n"
+					  "pgcopydb_index_jobs{state=\"queued\"} %d\n",
+					  indexDone,
+					  indexRunning,
+					  indexQueued > 0 ? indexQueued : 0);
+
+	(void) copydb_metrics_workers(progress, out);
+}
+
+
+/*
+ * copydb_metrics_workers appends the per-worker metrics. The step duration
+ * is what to alert on to find stalled workers, and the wait time shows the
+ * workers that are starved of work, of their turn with --adaptive-max-lag and
+ * --adaptive-max-backends, or of index memory.
+ */
+static void
+copydb_metrics_workers(ProgressArea *progress, PQExpBuffer out)
+{
+	int slotCount = progress->tableWorkers + progress->indexWorkers;
+	uint64_t now = time(NULL);
+
+	appendPQExpBuffer(out,
+					  "# HELP pgcopydb_worker_busy "
+					  "Whether the worker is running a step now.\n"
+					  "# TYPE pgcopydb_worker_busy gauge\n");
+
+	for (int i = 0; i < slotCount; i++)
+	{
+		ProgressSlot *slot = &(progress->slots[i]);
+
+		appendPQExpBuffer(out,
+						  "pgcopydb_worker_busy%s %d\n",
+						  copydb_metrics_worker_labels(progress, i),
+						  slot->step != PROGRESS_STEP_IDLE ? 1 : 0);
+	}
+
+	appendPQExpBuffer(out,
+					  "# HELP pgcopydb_worker_step_seconds "
+					  "Time spent in the current step of the worker.\n"
+					  "# TYPE pgcopydb_worker_step_seconds gauge\n");
+
+	for (int i = 0; i < slotCount; i++)
+	{
+		ProgressSlot *slot = &(progress->slots[i]);
+
+		uint64_t elapsed =
+			slot->step != PROGRESS_STEP_IDLE && now > slot->startTime
+			? now - slot->startTime
+			: 0;
+
+		appendPQExpBuffer(out,
+						  "pgcopydb_worker_step_seconds%s %lld\n",
+						  copydb_metrics_worker_labels(progress, i),
+						  (long long) elapsed);
+	}
+
+	appendPQExpBuffer(out,
+					  "# HELP pgcopydb_worker_wait_seconds_total "
+					  "Time the worker spent waiting rather than working.\n"
+					  "# TYPE pgcopydb_worker_wait_seconds_total counter\n");
+
+	for (int i = 0; i < slotCount; i++)
+	{
+		ProgressSlot *slot = &(progress->slots[i]);
+
+		appendPQExpBuffer(out,
+						  "pgcopydb_worker_wait_seconds_total%s %.3f\n",
+						  copydb_metrics_worker_labels(progress, i),
+						  (double) slot->waitUs / 1000000.0);
+	}
+}
+
+
+/*
+ * copydb_metrics_worker_labels returns the labels of the given slot, such
+ * as {kind="index",worker="2"}, in a static buffer.
+ */
+static const char *
+copydb_metrics_worker_labels(ProgressArea *progress, int slotIndex)
+{
+	static char labels[BUFSIZE] = { 0 };
+
+	bool isTable = slotIndex < progress->tableWorkers;
+
+	sformat(labels, sizeof(labels), "{kind=\"%s\",worker=\"%d\"}",
+			isTable ? "table" : "index",
+			isTable ? slotIndex : slotIndex - progress->tableWorkers);
+
+	return labels;
+}
+
+
+/*
+ * copydb_metrics_respond sends an HTTP response with the given status and
+ * body to the client. Errors are ignored, the scraper is going to retry.
+ */
+static void
+copydb_metrics_respond(int clientFd,
+					   const char *status,
+					   const char *body,
+					   size_t size)
+{
+	char header[BUFSIZE] = { 0 };
+
+	int len = sformat(header, sizeof(header),
+					  "HTTP/1.1 %s\r\n"
+					  "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+					  "Content-Length: %lld\r\n"
+					  "Connection: close\r\n"
+					  "\r\n",
+					  status,
+					  (long long) size);
+
+	const char *parts[] = { header, body };
+	size_t sizes[] = { len, size };
+
+	for (int p = 0; p < 2; p++)
+	{
+		size_t done = 0;
+
+		while (done < sizes[p])
+		{
+			ssize_t bytes = write(clientFd, parts[p] + done, sizes[p] - done);
+
+			if (bytes <= 0)
+			{
+				if (bytes == -1 && errno == EINTR)
+				{
+					continue;
+				}
+
+				log_debug("Failed to send metrics: %m");
+				return;
+			}
+
+			done += bytes;
+		}
+	}
+}
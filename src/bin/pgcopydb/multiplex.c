@@ -0,0 +1,716 @@
+/*
+ * src/bin/pgcopydb/multiplex.c
+ *     Implementation of a CLI to copy a database between two Postgres instances
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "copydb.h"
+#include "file_utils.h"
+#include "log.h"
+#include "pgsql.h"
+#include "signals.h"
+#include "string_utils.h"
+#include "summary.h"
+
+
+/*
+ * Small tables are copied from a single sub-process, using several COPY
+ * streams at the same time. Each stream has its own pair of connections,
+ * which are kept open from one table to the next.
+ */
+typedef struct MultiplexStream
+{
+	PGSQL src;
+	PGSQL dst;
+	CopyStream stream;
+	TransactionSnapshot *source;    /* see copydb_table_data_source() */
+
+	CopyTableDataSpec *tableSpecs;  /* NULL when the stream is idle */
+	CopyTableSummary summary;
+	char qname[BUFSIZE];
+	const char *copySource;         /* qname, or the table copyQuery */
+	bool freeze;                    /* COPY FREEZE, COMMIT when done */
+} MultiplexStream;
+
+
+/* the list of small tables to copy, and where we are at */
+typedef struct MultiplexQueue
+{
+	CopyTableDataSpec **array;  /* malloc'ed area */
+	int count;
+	int next;
+
+	int errors;
+} MultiplexQueue;
+
+
+static bool copydb_multiplex_start_next(CopyDataSpec *specs,
+										MultiplexStream *mstream,
+										MultiplexQueue *queue);
+static bool copydb_multiplex_start_table(MultiplexStream *mstream,
+										 CopyTableDataSpec *tableSpecs);
+static bool copydb_multiplex_finish_table(CopyDataSpec *specs,
+										  MultiplexStream *mstream,
+										  MultiplexQueue *queue);
+static void copydb_multiplex_close_stream(MultiplexStream *mstream);
+
+
+/*
+ * copydb_table_uses_multiplex returns true when the given table is small
+ * enough to be copied by the multiplexed COPY process rather than by its own
+ * sub-process: when it is smaller than --multiplex-tables-smaller-than, or
+ * when --copy-strategy auto chose to multiplex it.
+ */
+bool
+copydb_table_uses_multiplex(CopyDataSpec *specs, CopyTableDataSpec *tableSpecs)
+{
+	SourceTable *table = tableSpecs->sourceTable;
+
+	if (!table->strategy.chosen && specs->multiplexTablesSmallerThan == 0)
+	{
+		return false;
+	}
+
+	if (specs->section != DATA_SECTION_TABLE_DATA &&
+		specs->section != DATA_SECTION_ALL)
+	{
+		return false;
+	}
+
+	/* the multiplexed streams only COPY to the main target */
+	if (specs->fanoutCount > 0)
+	{
+		return false;
+	}
+
+	/* pgcopydb dump data and restore data use a file per table */
+	if (specs->spoolMode != COPY_SPOOL_NONE)
+	{
+		return false;
+	}
+
+	/* with --relay, the small tables also get their data from the relay */
+	if (!IS_EMPTY_STRING_BUFFER(specs->relayAddress))
+	{
+		return false;
+	}
+
+	/* tables that have been split in parts are never small */
+	if (tableSpecs->part.partCount > 1)
+	{
+		return false;
+	}
+
+	if (table->strategy.chosen)
+	{
+		return table->strategy.multiplex;
+	}
+
+	return table->bytes < specs->multiplexTablesSmallerThan;
+}
+
+
+/*
+ * copydb_table_is_multiplexed returns true when the given table is to be
+ * copied by the multiplexed COPY process in this run, see
+ * copydb_table_uses_multiplex().
+ */
+bool
+copydb_table_is_multiplexed(CopyDataSpec *specs, CopyTableDataSpec *tableSpecs)
+{
+	if (!copydb_table_uses_multiplex(specs, tableSpecs))
+	{
+		return false;
+	}
+
+	/* with --refresh, the unchanged tables are not copied at all */
+	if (tableSpecs->unchanged)
+	{
+		return false;
+	}
+
+	/* the table workers skip the COPY and queue the indexes, see --resume */
+	if (tableSpecs->resume)
+	{
+		TablePartFilePaths partPaths = { 0 };
+
+		(void) copydb_part_file_paths(tableSpecs, &partPaths);
+
+		if (file_exists(partPaths.doneFile))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_start_multiplexed_tables forks a sub-process that copies all the
+ * small tables, see copydb_copy_multiplexed_tables().
+ *
+ * The given process slot is then used to track the sub-process, which
+ * creates its doneFile as soon as all the tables have been copied, before
+ * waiting for the indexes and constraints of those tables to be created.
+ */
+bool
+copydb_start_multiplexed_tables(CopyDataSpec *specs, TableDataProcess *process)
+{
+	process->oid = 0;
+	process->partNumber = 0;
+
+	sformat(process->lockFile, sizeof(process->lockFile), "%s/multiplex",
+			specs->cfPaths.rundir);
+
+	sformat(process->doneFile, sizeof(process->doneFile), "%s/multiplex.done",
+			specs->cfPaths.tbldir);
+
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	int fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork a process for copying small tables");
+			return false;
+		}
+
+		case 0:
+		{
+			/* child process runs the command */
+			(void) trace_set_process_name("multiplexed COPY");
+
+			if (!copydb_copy_multiplexed_tables(specs, process))
+			{
+				/* errors have already been logged */
+				exit(EXIT_CODE_INTERNAL_ERROR);
+			}
+
+			exit(EXIT_CODE_QUIT);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			process->pid = fpid;
+
+			return true;
+		}
+	}
+}
+
+
+/*
+ * copydb_copy_multiplexed_tables implements the sub-process that copies all
+ * the tables that are smaller than --multiplex-tables-smaller-than, using up
+ * to --multiplex-streams concurrent COPY operations driven from a single
+ * poll() loop.
+ *
+ * As soon as a stream is done with a table, it moves on to the next small
+ * table, re-using the same connections. For an ALL section copy, the
+ * indexes of the tables that have been copied are then queued for the index
+ * workers, as for the other tables.
+ */
+bool
+copydb_copy_multiplexed_tables(CopyDataSpec *specs, TableDataProcess *process)
+{
+	CopyTableDataSpecsArray *tableSpecsArray = &(specs->tableSpecsArray);
+
+	char pidstr[BUFSIZE] = { 0 };
+
+	sformat(pidstr, sizeof(pidstr), "%d\n", getpid());
+
+	if (!write_file(pidstr, strlen(pidstr), process->lockFile))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	MultiplexQueue queue = { 0 };
+
+	queue.array = (CopyTableDataSpec **)
+				  calloc(tableSpecsArray->count, sizeof(CopyTableDataSpec *));
+
+	if (queue.array == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	for (int i = 0; i < tableSpecsArray->count; i++)
+	{
+		CopyTableDataSpec *tableSpecs = &(tableSpecsArray->array[i]);
+
+		if (copydb_table_is_multiplexed(specs, tableSpecs))
+		{
+			/* we're in a sub-process, our table specs are a private copy */
+			tableSpecs->throttle = specs->throttle;
+
+			queue.array[queue.count++] = tableSpecs;
+		}
+	}
+
+	if (queue.count == 0 || specs->multiplexStreams < 1)
+	{
+		log_error("BUG: copydb_copy_multiplexed_tables called with %d tables "
+				  "and %d streams",
+				  queue.count,
+				  specs->multiplexStreams);
+		free(queue.array);
+		return false;
+	}
+
+	size_t streamCount =
+		(size_t) (queue.count < specs->multiplexStreams
+				  ? queue.count
+				  : specs->multiplexStreams);
+
+	if (specs->copyStrategyAuto)
+	{
+		log_info("Copying %d small tables using %zu concurrent streams",
+				 queue.count,
+				 streamCount);
+	}
+	else
+	{
+		log_info("Copying %d tables smaller than %s using %zu concurrent streams",
+				 queue.count,
+				 specs->multiplexTablesSmallerThanPretty,
+				 streamCount);
+	}
+
+	MultiplexStream *streams =
+		(MultiplexStream *) calloc(streamCount, sizeof(MultiplexStream));
+
+	struct pollfd *fds =
+		(struct pollfd *) calloc(2 * streamCount, sizeof(struct pollfd));
+
+	if (streams == NULL || fds == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	for (size_t i = 0; i < streamCount; i++)
+	{
+		MultiplexStream *mstream = &(streams[i]);
+
+		mstream->source = copydb_table_data_source(specs, (int) i);
+
+		if (!pgsql_init(&(mstream->src),
+						mstream->source->pguri,
+						PGSQL_CONN_SOURCE) ||
+			!pgsql_init(&(mstream->dst), specs->target_pguri, PGSQL_CONN_TARGET) ||
+			!copydb_set_target_session(&(specs->bulkLoadProfile),
+									   BULK_LOAD_PHASE_COPY,
+									   &(mstream->dst)))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		mstream->stream.src = &(mstream->src);
+		mstream->stream.dst = &(mstream->dst);
+		mstream->stream.buffer.size = specs->copyBufferSize;
+
+		if (specs->copyBufferSize > 0)
+		{
+			mstream->stream.buffer.data = (char *) malloc(specs->copyBufferSize);
+
+			if (mstream->stream.buffer.data == NULL)
+			{
+				log_fatal(ALLOCATION_FAILED_ERROR);
+				return false;
+			}
+		}
+
+		(void) copydb_multiplex_start_next(specs, mstream, &queue);
+	}
+
+	bool allCopied = false;
+
+	for (;;)
+	{
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			log_error("Interrupted while copying small tables");
+			++queue.errors;
+			break;
+		}
+
+		/* idle streams wait for their next table to be created */
+		for (size_t i = 0; i < streamCount && queue.next < queue.count; i++)
+		{
+			if (streams[i].tableSpecs == NULL)
+			{
+				(void) copydb_multiplex_start_next(specs, &(streams[i]), &queue);
+			}
+		}
+
+		int nfds = 0;
+
+		for (size_t i = 0; i < streamCount; i++)
+		{
+			MultiplexStream *mstream = &(streams[i]);
+
+			if (mstream->tableSpecs == NULL)
+			{
+				continue;
+			}
+
+			fds[nfds].fd = PQsocket(mstream->src.connection);
+			fds[nfds].events = mstream->stream.srcEvents;
+			fds[nfds].revents = 0;
+			++nfds;
+
+			fds[nfds].fd = PQsocket(mstream->dst.connection);
+			fds[nfds].events = mstream->stream.dstEvents;
+			fds[nfds].revents = 0;
+			++nfds;
+		}
+
+		if (nfds == 0 && queue.next < queue.count)
+		{
+			log_flush();
+
+			/* the pre-data section is still being restored */
+			pg_usleep(100 * 1000); /* 100 ms */
+			continue;
+		}
+
+		if (nfds == 0)
+		{
+			/* signal our parent process that we are done with COPY */
+			allCopied = true;
+
+			if (!write_file(pidstr, strlen(pidstr), process->doneFile))
+			{
+				/* errors have already been logged */
+				++queue.errors;
+			}
+
+			(void) unlink_file(process->lockFile);
+			break;
+		}
+
+		/*
+		 * Streams that wait for nothing in particular are stepped again after
+		 * a short timeout anyway.
+		 */
+		if (poll(fds, nfds, 100) == -1 && errno != EINTR)
+		{
+			log_error("Failed to poll the COPY streams: %m");
+			++queue.errors;
+			break;
+		}
+
+		for (size_t i = 0; i < streamCount; i++)
+		{
+			MultiplexStream *mstream = &(streams[i]);
+
+			if (mstream->tableSpecs == NULL)
+			{
+				continue;
+			}
+
+			if (!pg_copy_stream_step(&(mstream->stream)))
+			{
+				log_error("Failed to copy table %s, see above for details",
+						  mstream->qname);
+
+				++queue.errors;
+
+				/* the connections are not usable anymore */
+				(void) copydb_multiplex_close_stream(mstream);
+				mstream->tableSpecs = NULL;
+
+				(void) copydb_multiplex_start_next(specs, mstream, &queue);
+			}
+			else if (mstream->stream.state == COPY_STREAM_DONE)
+			{
+				if (!copydb_multiplex_finish_table(specs, mstream, &queue))
+				{
+					++queue.errors;
+				}
+
+				mstream->tableSpecs = NULL;
+
+				(void) copydb_multiplex_start_next(specs, mstream, &queue);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < streamCount; i++)
+	{
+		(void) copydb_multiplex_close_stream(&(streams[i]));
+		free(streams[i].stream.buffer.data);
+	}
+
+	free(streams);
+	free(fds);
+
+	/* when interrupted, still release our parent's process slot */
+	if (!allCopied)
+	{
+		(void) write_file(pidstr, strlen(pidstr), process->doneFile);
+		(void) unlink_file(process->lockFile);
+	}
+
+	free(queue.array);
+
+	return queue.errors == 0;
+}
+
+
+/*
+ * copydb_multiplex_start_next starts copying the next small table on the
+ * given stream, skipping tables that fail to start. Returns false when there
+ * is no table left to copy, leaving the stream idle.
+ *
+ * While the pre-data section is being restored, the next table is the first
+ * one in the queue that has been created on the target database already, as
+ * in copydb_table_queue_pop(). When none is ready yet the function returns
+ * false and keeps the stream connections open.
+ */
+static bool
+copydb_multiplex_start_next(CopyDataSpec *specs,
+							MultiplexStream *mstream,
+							MultiplexQueue *queue)
+{
+	while (queue->next < queue->count)
+	{
+		PreDataProgress progress = { 0 };
+
+		if (!copydb_pre_data_progress(specs, &progress) || progress.failed)
+		{
+			log_error("Failed to restore the pre-data section, "
+					  "skipping %d small tables",
+					  queue->count - queue->next);
+
+			++queue->errors;
+			queue->next = queue->count;
+			break;
+		}
+
+		int ready = -1;
+
+		for (int i = queue->next; i < queue->count; i++)
+		{
+			SourceTable *table = queue->array[i]->sourceTable;
+
+			if (copydb_pre_data_table_is_restored(specs, &progress, table))
+			{
+				ready = i;
+				break;
+			}
+		}
+
+		if (ready == -1)
+		{
+			return false;
+		}
+
+		CopyTableDataSpec *tableSpecs = queue->array[ready];
+
+		/* keep the skipped tables in the queue order */
+		memmove(&(queue->array[queue->next + 1]),
+				&(queue->array[queue->next]),
+				(ready - queue->next) * sizeof(CopyTableDataSpec *));
+
+		queue->array[queue->next++] = tableSpecs;
+
+		if (copydb_multiplex_start_table(mstream, tableSpecs))
+		{
+			return true;
+		}
+
+		log_error("Failed to start copying table %s, see above for details",
+				  mstream->qname);
+
+		++queue->errors;
+
+		(void) copydb_multiplex_close_stream(mstream);
+		mstream->tableSpecs = NULL;
+	}
+
+	/* no more tables to copy, close the connections now */
+	(void) copydb_multiplex_close_stream(mstream);
+
+	return false;
+}
+
+
+/*
+ * copydb_multiplex_start_table writes the table lockFile and starts the COPY
+ * of the given table on the given stream, opening the stream connections
+ * when needed. The source connection imports the main process snapshot once,
+ * then all the tables copied on that stream are read in the same transaction.
+ */
+static bool
+copydb_multiplex_start_table(MultiplexStream *mstream,
+							 CopyTableDataSpec *tableSpecs)
+{
+	CopyStream *stream = &(mstream->stream);
+
+	mstream->tableSpecs = tableSpecs;
+
+	sformat(mstream->qname, sizeof(mstream->qname), "\"%s\".\"%s\"",
+			tableSpecs->sourceTable->nspname,
+			tableSpecs->sourceTable->relname);
+
+	/* a sample, or an ordering, see copydb_prepare_copy_query() */
+	mstream->copySource =
+		tableSpecs->copyQuery != NULL ? tableSpecs->copyQuery : mstream->qname;
+
+	CopyTableSummary summary = {
+		.pid = getpid(),
+		.table = tableSpecs->sourceTable,
+	};
+
+	mstream->freeze = copydb_table_uses_freeze(tableSpecs);
+
+	sformat(summary.command, sizeof(summary.command), "COPY %s%s;",
+			mstream->qname,
+			copydb_copy_options(tableSpecs, mstream->freeze));
+
+	mstream->summary = summary;
+
+	TablePartFilePaths partPaths = { 0 };
+
+	(void) copydb_part_file_paths(tableSpecs, &partPaths);
+
+	if (!open_table_summary(&(mstream->summary), partPaths.lockFile))
+	{
+		log_info("Failed to create the lock file at \"%s\"",
+				 partPaths.lockFile);
+		return false;
+	}
+
+	if (mstream->src.connection == NULL)
+	{
+		if (!copydb_set_snapshot(mstream->source, &(mstream->src)))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		/* when not using a snapshot, each COPY is its own transaction */
+		if (mstream->src.connection == NULL &&
+			!pgsql_open_persistent_connection(&(mstream->src)))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	if (mstream->dst.connection == NULL &&
+		!pgsql_open_persistent_connection(&(mstream->dst)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("%s", mstream->summary.command);
+
+	/* TRUNCATE is run in blocking mode, before the COPY stream starts */
+	if (!copydb_begin_copy_freeze(tableSpecs,
+								  &(mstream->dst),
+								  mstream->qname,
+								  &(mstream->freeze)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	CopyArgs args = {
+		.srcQname = mstream->copySource,
+		.dstQname =
+			tableSpecs->copyTarget != NULL
+			? tableSpecs->copyTarget
+			: mstream->qname,
+		.format = tableSpecs->copyFormat,
+		.freeze = mstream->freeze,
+		.bufferSize = tableSpecs->copyBufferSize,
+		.pipelineDepth = 0,
+		.throttle = &copydb_throttle_copy_data,
+		.throttleContext = tableSpecs->throttle
+	};
+
+	stream->args = args;
+	stream->stats = (CopyStats) { 0 };
+
+	return pg_copy_stream_start(stream);
+}
+
+
+/*
+ * copydb_multiplex_finish_table writes the table doneFile once its COPY is
+ * done, and queues the table indexes for the index workers.
+ */
+static bool
+copydb_multiplex_finish_table(CopyDataSpec *specs,
+							  MultiplexStream *mstream,
+							  MultiplexQueue *queue)
+{
+	CopyTableDataSpec *tableSpecs = mstream->tableSpecs;
+
+	mstream->summary.copyStats = mstream->stream.stats;
+
+	if (mstream->freeze && !pgsql_execute(&(mstream->dst), "COMMIT"))
+	{
+		log_error("Failed to commit the COPY FREEZE of table %s",
+				  mstream->qname);
+		return false;
+	}
+
+	TablePartFilePaths partPaths = { 0 };
+
+	(void) copydb_part_file_paths(tableSpecs, &partPaths);
+
+	if (!finish_table_summary(&(mstream->summary), partPaths.doneFile))
+	{
+		log_info("Failed to create the summary file at \"%s\"",
+				 partPaths.doneFile);
+		return false;
+	}
+
+	/* also remove the lockFile, we don't need it anymore */
+	if (!unlink_file(partPaths.lockFile))
+	{
+		/* just continue, this is not a show-stopper */
+		log_warn("Failed to remove the lockFile \"%s\"",
+				 partPaths.lockFile);
+	}
+
+	/* the index workers take it from here */
+	if (!copydb_queue_table_indexes(tableSpecs))
+	{
+		log_error("Failed to queue the indexes of table %s, "
+				  "see above for details",
+				  mstream->qname);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_multiplex_close_stream closes the stream connections. The source
+ * connection might be in a read-only transaction, which we don't mind.
+ */
+static void
+copydb_multiplex_close_stream(MultiplexStream *mstream)
+{
+	pgsql_finish(&(mstream->src));
+	pgsql_finish(&(mstream->dst));
+}
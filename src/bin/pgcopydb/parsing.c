@@ -17,9 +17,11 @@
 #include "log.h"
 #include "parsing.h"
 #include "file_utils.h"
+#include "pqexpbuffer.h"
 #include "string_utils.h"
 
 static bool parse_bool_with_len(const char *value, size_t len, bool *result);
+static void appendConnStrVal(PQExpBuffer buffer, const char *value);
 
 #define RE_MATCH_COUNT 10
 
@@ -609,3 +611,92 @@ parse_and_scrub_connection_string(const char *pguri, char *scrubbedPguri)
 
 	return true;
 }
+
+
+/*
+ * build_connection_string_for_dbname takes a Postgres connection string, in
+ * either the URI or the keyword/value form, and writes in target the
+ * keyword/value form of the same connection string with the dbname replaced
+ * by the given one. The target parameter should point to a memory area that
+ * has been allocated by the caller and has at least MAXCONNINFO bytes.
+ */
+bool
+build_connection_string_for_dbname(const char *pguri,
+								   const char *dbname,
+								   char *target)
+{
+	char *errmsg;
+	PQconninfoOption *conninfo, *option;
+
+	conninfo = PQconninfoParse(pguri, &errmsg);
+	if (conninfo == NULL)
+	{
+		log_error("Failed to parse pguri: %s", errmsg);
+
+		PQfreemem(errmsg);
+		return false;
+	}
+
+	PQExpBuffer buffer = createPQExpBuffer();
+
+	if (buffer == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		PQconninfoFree(conninfo);
+		return false;
+	}
+
+	for (option = conninfo; option->keyword != NULL; option++)
+	{
+		if (strcmp(option->keyword, "dbname") == 0 ||
+			option->val == NULL ||
+			IS_EMPTY_STRING_BUFFER(option->val))
+		{
+			continue;
+		}
+
+		appendPQExpBuffer(buffer, "%s=", option->keyword);
+		appendConnStrVal(buffer, option->val);
+		appendPQExpBufferChar(buffer, ' ');
+	}
+
+	appendPQExpBufferStr(buffer, "dbname=");
+	appendConnStrVal(buffer, dbname);
+
+	PQconninfoFree(conninfo);
+
+	if (PQExpBufferBroken(buffer) || buffer->len >= MAXCONNINFO)
+	{
+		log_error("Failed to build the connection string for database \"%s\"",
+				  dbname);
+		destroyPQExpBuffer(buffer);
+		return false;
+	}
+
+	strlcpy(target, buffer->data, MAXCONNINFO);
+	destroyPQExpBuffer(buffer);
+
+	return true;
+}
+
+
+/*
+ * appendConnStrVal appends the given value to the buffer, quoted as a libpq
+ * connection string value: single quotes and backslashes are escaped.
+ */
+static void
+appendConnStrVal(PQExpBuffer buffer, const char *value)
+{
+	appendPQExpBufferChar(buffer, '\'');
+
+	for (const char *ptr = value; *ptr != '\0'; ptr++)
+	{
+		if (*ptr == '\'' || *ptr == '\\')
+		{
+			appendPQExpBufferChar(buffer, '\\');
+		}
+		appendPQExpBufferChar(buffer, *ptr);
+	}
+
+	appendPQExpBufferChar(buffer, '\'');
+}
@@ -79,4 +79,8 @@ bool buildPostgresURIfromPieces(URIParams *uriParams, char *pguri);
 
 bool parse_and_scrub_connection_string(const char *pguri, char *scrubbedPguri);
 
+bool build_connection_string_for_dbname(const char *pguri,
+										const char *dbname,
+										char *target);
+
 #endif /* PARSING_H */
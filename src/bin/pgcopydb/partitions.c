@@ -0,0 +1,403 @@
+/*
+ * src/bin/pgcopydb/partitions.c
+ *     Create the indexes of partitioned tables from the indexes of their
+ *     partitions
+ *
+ * The partitions of a partitioned table are ordinary tables, each copied by
+ * the table workers, and each partition index is built by the --index-jobs
+ * index workers as soon as the COPY of that partition is done. Once all the
+ * indexes are built, the index of the partitioned table is created with
+ * CREATE INDEX ... ON ONLY, which does not recurse to the partitions, and
+ * then the partition indexes are attached to it with ALTER INDEX ... ATTACH
+ * PARTITION. Both commands only update the catalogs, and the partitioned
+ * index becomes valid once all its partitions indexes have been attached.
+ *
+ * The partitioned indexes and constraints are registered in the journal, so
+ * that pg_restore skips them in the post-data section.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "copydb.h"
+#include "defaults.h"
+#include "journal.h"
+#include "log.h"
+#include "pgsql.h"
+#include "pqexpbuffer.h"
+#include "schema.h"
+#include "string_utils.h"
+
+
+static bool copydb_create_partitioned_index(CopyDataSpec *specs,
+											SourceIndex *index,
+											PGSQL *dst);
+static bool copydb_attach_partition_indexes(CopyDataSpec *specs,
+											SourceIndex *index,
+											PGSQL *dst);
+static bool copydb_partitioned_index_in_section(CopyDataSpec *specs,
+												SourceIndex *index);
+
+
+/*
+ * copydb_fetch_source_partitioned_indexes lists the indexes of the
+ * partitioned tables of the source database, and the indexes that are
+ * attached to them.
+ */
+bool
+copydb_fetch_source_partitioned_indexes(CopyDataSpec *specs, PGSQL *pgsql)
+{
+	SourceIndexArray *indexArray = &(specs->sourcePartitionedIndexArray);
+	SourceIndexAttachArray *attachArray = &(specs->sourceIndexAttachArray);
+
+	if (!schema_list_partitioned_indexes(pgsql, indexArray) ||
+		!schema_list_index_attachments(pgsql, attachArray))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (indexArray->count > 0)
+	{
+		log_info("Fetched information for %d partitioned indexes, "
+				 "with %d partition indexes attached",
+				 indexArray->count,
+				 attachArray->count);
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_create_partitioned_indexes creates the indexes and constraints of
+ * the partitioned tables on the target database, and attaches the partition
+ * indexes to them. With pgcopydb copy indexes only the indexes that do not
+ * implement a constraint are processed, and with pgcopydb copy constraints
+ * only the ones that do.
+ */
+bool
+copydb_create_partitioned_indexes(CopyDataSpec *specs)
+{
+	SourceIndexArray *indexArray = &(specs->sourcePartitionedIndexArray);
+
+	if (indexArray->count == 0)
+	{
+		return true;
+	}
+
+	if (!journal_load(&(specs->journal)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	PGSQL dst = { 0 };
+
+	if (!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("Creating %d indexes of partitioned tables", indexArray->count);
+
+	for (int i = 0; i < indexArray->count; i++)
+	{
+		SourceIndex *index = &(indexArray->array[i]);
+
+		if (!copydb_partitioned_index_in_section(specs, index))
+		{
+			continue;
+		}
+
+		if (!copydb_create_partitioned_index(specs, index, &dst))
+		{
+			/* errors have already been logged */
+			pgsql_finish(&dst);
+			return false;
+		}
+	}
+
+	/* the attach step looks up the indexes we just created */
+	if (!journal_sync(&(specs->journal)) || !journal_load(&(specs->journal)))
+	{
+		/* errors have already been logged */
+		pgsql_finish(&dst);
+		return false;
+	}
+
+	for (int i = 0; i < indexArray->count; i++)
+	{
+		SourceIndex *index = &(indexArray->array[i]);
+
+		if (!copydb_partitioned_index_in_section(specs, index))
+		{
+			continue;
+		}
+
+		if (!copydb_attach_partition_indexes(specs, index, &dst))
+		{
+			/* errors have already been logged */
+			pgsql_finish(&dst);
+			return false;
+		}
+	}
+
+	pgsql_finish(&dst);
+
+	return true;
+}
+
+
+/*
+ * copydb_create_partitioned_index creates the given index of a partitioned
+ * table, or adds the constraint that it implements, on that table only.
+ */
+static bool
+copydb_create_partitioned_index(CopyDataSpec *specs,
+								SourceIndex *index,
+								PGSQL *dst)
+{
+	bool isConstraint =
+		index->constraintOid > 0 &&
+		!IS_EMPTY_STRING_BUFFER(index->constraintName);
+
+	uint32_t oid = isConstraint ? index->constraintOid : index->indexOid;
+
+	if (journal_lookup(&(specs->journal), oid) != NULL)
+	{
+		log_info("Skipping %s \"%s\".\"%s\", done in a previous run",
+				 isConstraint ? "constraint" : "index",
+				 index->indexNamespace,
+				 isConstraint ? index->constraintName : index->indexRelname);
+		return true;
+	}
+
+	/* index and constraint definitions are not limited in size */
+	PQExpBuffer command = createPQExpBuffer();
+
+	if (isConstraint)
+	{
+		appendPQExpBuffer(command,
+						  "ALTER TABLE ONLY \"%s\".\"%s\" "
+						  "ADD CONSTRAINT \"%s\" %s",
+						  index->tableNamespace,
+						  index->tableRelname,
+						  index->constraintName,
+						  index->constraintDef);
+	}
+	else
+	{
+		/* pg_get_indexdef() uses ON ONLY for partitioned tables already */
+		appendPQExpBufferStr(command, index->indexDef);
+	}
+
+	if (PQExpBufferBroken(command))
+	{
+		log_error("Failed to prepare the partitioned index command: "
+				  "out of memory");
+		destroyPQExpBuffer(command);
+		return false;
+	}
+
+	log_info("%s;", command->data);
+
+	time_t startTime = time(NULL);
+
+	if (!pgsql_execute(dst, command->data))
+	{
+		/* errors have already been logged */
+		destroyPQExpBuffer(command);
+		return false;
+	}
+
+	/* the constraint index is named after the constraint */
+	if (isConstraint && !streq(index->constraintName, index->indexRelname))
+	{
+		char sql[BUFSIZE] = { 0 };
+
+		sformat(sql, sizeof(sql),
+				"ALTER INDEX \"%s\".\"%s\" RENAME TO \"%s\"",
+				index->indexNamespace,
+				index->constraintName,
+				index->indexRelname);
+
+		log_info("%s;", sql);
+
+		if (!pgsql_execute(dst, sql))
+		{
+			/* errors have already been logged */
+			destroyPQExpBuffer(command);
+			return false;
+		}
+	}
+
+	JournalEntry entry = {
+		.oid = index->indexOid,
+		.kind = JOURNAL_RECORD_INDEX,
+		.pid = getpid(),
+		.startTime = startTime,
+		.doneTime = time(NULL),
+		.nspname = index->indexNamespace,
+		.relname = index->indexRelname,
+		.command = command->data
+	};
+
+	bool success = journal_append(&(specs->journal), &entry);
+
+	if (success && isConstraint)
+	{
+		entry.oid = index->constraintOid;
+		entry.kind = JOURNAL_RECORD_CONSTRAINT;
+		entry.nspname = index->tableNamespace;
+		entry.relname = index->constraintName;
+
+		success = journal_append(&(specs->journal), &entry);
+	}
+
+	destroyPQExpBuffer(command);
+
+	if (!success)
+	{
+		log_error("Failed to register partitioned index \"%s\".\"%s\" "
+				  "in the journal",
+				  index->indexNamespace,
+				  index->indexRelname);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_attach_partition_indexes attaches the indexes of the partitions to
+ * the given index of their partitioned table. Attaching an index that is
+ * attached already does nothing, so that this is safe to run again. The
+ * partition indexes that have not been created by pgcopydb, such as the ones
+ * of a partition that has been filtered out, are left to pg_restore.
+ */
+static bool
+copydb_attach_partition_indexes(CopyDataSpec *specs,
+								SourceIndex *index,
+								PGSQL *dst)
+{
+	SourceIndexAttachArray *attachArray = &(specs->sourceIndexAttachArray);
+
+	int attachedCount = 0;
+	int missingCount = 0;
+
+	if (attachArray->count == 0)
+	{
+		return true;
+	}
+
+	/* the ATTACH PARTITION commands are sent as a single batch */
+	char **commands = (char **) calloc(attachArray->count, sizeof(char *));
+	char *buffer = (char *) calloc(attachArray->count, BUFSIZE);
+
+	if (commands == NULL || buffer == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		free(commands);
+		free(buffer);
+		return false;
+	}
+
+	/* the array is sorted by parent oid, a linear scan is good enough here */
+	for (int i = 0; i < attachArray->count; i++)
+	{
+		SourceIndexAttach *attach = &(attachArray->array[i]);
+
+		if (attach->parentOid != index->indexOid)
+		{
+			continue;
+		}
+
+		if (journal_lookup(&(specs->journal), attach->childOid) == NULL)
+		{
+			log_debug("Skipping partition index \"%s\".\"%s\": not created yet",
+					  attach->childNamespace,
+					  attach->childRelname);
+			++missingCount;
+			continue;
+		}
+
+		char *sql = buffer + (size_t) attachedCount * BUFSIZE;
+
+		sformat(sql, BUFSIZE,
+				"ALTER INDEX \"%s\".\"%s\" ATTACH PARTITION \"%s\".\"%s\"",
+				attach->parentNamespace,
+				attach->parentRelname,
+				attach->childNamespace,
+				attach->childRelname);
+
+		commands[attachedCount++] = sql;
+	}
+
+	bool success =
+		pgsql_execute_batch(dst, (const char **) commands, attachedCount);
+
+	free(commands);
+	free(buffer);
+
+	if (!success)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("Attached %d partition indexes to \"%s\".\"%s\"",
+			 attachedCount,
+			 index->indexNamespace,
+			 index->indexRelname);
+
+	if (missingCount > 0)
+	{
+		log_warn("Index \"%s\".\"%s\" is not valid yet: %d of its partition "
+				 "indexes have not been created",
+				 index->indexNamespace,
+				 index->indexRelname,
+				 missingCount);
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_partitioned_index_in_section returns true when the given
+ * partitioned index is to be processed in the current data section.
+ */
+static bool
+copydb_partitioned_index_in_section(CopyDataSpec *specs, SourceIndex *index)
+{
+	bool isConstraint =
+		index->constraintOid > 0 &&
+		!IS_EMPTY_STRING_BUFFER(index->constraintName);
+
+	switch (specs->section)
+	{
+		case DATA_SECTION_ALL:
+		{
+			return true;
+		}
+
+		case DATA_SECTION_INDEXES:
+		{
+			return !isConstraint;
+		}
+
+		case DATA_SECTION_CONSTRAINTS:
+		{
+			return isConstraint;
+		}
+
+		default:
+		{
+			return false;
+		}
+	}
+}
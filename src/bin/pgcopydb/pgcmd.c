@@ -22,6 +22,7 @@
 #include "pgcmd.h"
 #include "signals.h"
 #include "string_utils.h"
+#include "trace.h"
 
 #define RUN_PROGRAM_IMPLEMENTATION
 #include "runprogram.h"
@@ -110,6 +111,7 @@ void
 set_postgres_commands(PostgresPaths *pgPaths)
 {
 	path_in_same_directory(pgPaths->psql, "pg_dump", pgPaths->pg_dump);
+	path_in_same_directory(pgPaths->psql, "pg_dumpall", pgPaths->pg_dumpall);
 	path_in_same_directory(pgPaths->psql, "pg_restore", pgPaths->pg_restore);
 }
 
@@ -332,10 +334,12 @@ set_psql_from_pg_config(PostgresPaths *pgPaths)
 
 /*
  * Call pg_dump and get the given section of the dump into the target file.
+ * When a snapshot is given (not NULL), pg_dump uses it with --snapshot.
  */
 bool
 pg_dump_db(PostgresPaths *pgPaths,
 		   const char *pguri,
+		   const char *snapshot,
 		   const char *section,
 		   const char *filename)
 {
@@ -350,6 +354,13 @@ pg_dump_db(PostgresPaths *pgPaths,
 	args[argsIndex++] = "-Fc";
 	args[argsIndex++] = "--section";
 	args[argsIndex++] = (char *) section;
+
+	if (snapshot != NULL)
+	{
+		args[argsIndex++] = "--snapshot";
+		args[argsIndex++] = (char *) snapshot;
+	}
+
 	args[argsIndex++] = "--file";
 	args[argsIndex++] = (char *) filename;
 	args[argsIndex++] = (char *) pguri;
@@ -377,8 +388,14 @@ pg_dump_db(PostgresPaths *pgPaths,
 		log_info("%s", command);
 	}
 
+	TraceEvent event = { 0 };
+
+	trace_begin(&event, "schema", "pg_dump --section %s", section);
+
 	(void) execute_subprogram(&program);
 
+	trace_end(&event);
+
 	if (program.returnCode != 0)
 	{
 		log_error("Failed to run pg_dump: exit code %d", program.returnCode);
@@ -394,7 +411,10 @@ pg_dump_db(PostgresPaths *pgPaths,
 
 /*
  * Call pg_restore from the given filename and restores it to the target
- * database connection.
+ * database connection. When jobs is greater than one, pg_restore --jobs
+ * restores the archive using that many concurrent connections. With
+ * singleTransaction, either all the objects are restored or none of them,
+ * which is not compatible with using more than one job.
  */
 bool
 pg_restore_db(PostgresPaths *pgPaths,
@@ -402,7 +422,9 @@ pg_restore_db(PostgresPaths *pgPaths,
 			  const char *dumpFilename,
 			  const char *listFilename,
 			  bool dropIfExists,
-			  bool noOwner)
+			  bool noOwner,
+			  bool singleTransaction,
+			  int jobs)
 {
 	char *args[16];
 	int argsIndex = 0;
@@ -426,12 +448,25 @@ pg_restore_db(PostgresPaths *pgPaths,
 		args[argsIndex++] = "--no-owner";
 	}
 
+	if (singleTransaction)
+	{
+		args[argsIndex++] = "--single-transaction";
+	}
+
 	if (listFilename != NULL)
 	{
 		args[argsIndex++] = "--use-list";
 		args[argsIndex++] = (char *) listFilename;
 	}
 
+	IntString jobsString = intToString(jobs);
+
+	if (jobs > 1 && !singleTransaction)
+	{
+		args[argsIndex++] = "--jobs";
+		args[argsIndex++] = jobsString.strValue;
+	}
+
 	args[argsIndex++] = (char *) dumpFilename;
 
 	args[argsIndex] = NULL;
@@ -457,8 +492,15 @@ pg_restore_db(PostgresPaths *pgPaths,
 		log_info("%s", command);
 	}
 
+	TraceEvent event = { 0 };
+
+	trace_begin(&event, "schema", "pg_restore %s",
+				listFilename != NULL ? listFilename : dumpFilename);
+
 	(void) execute_subprogram(&program);
 
+	trace_end(&event);
+
 	if (program.returnCode != 0)
 	{
 		log_error("Failed to run pg_restore: exit code %d", program.returnCode);
@@ -475,11 +517,52 @@ pg_restore_db(PostgresPaths *pgPaths,
 /*
  * pg_restore_list runs the command pg_restore -f- -l on the given custom
  * format dump file and returns an array of pg_dump archive objects.
+ *
+ * When tocFilename is not NULL, the pg_restore --list output is kept in that
+ * file, with a first comment line that registers the size and modification
+ * time of the dump file. The next calls parse the file rather than running
+ * pg_restore again, as long as the dump file has not changed.
  */
 bool
 pg_restore_list(PostgresPaths *pgPaths, const char *filename,
-				ArchiveContentArray *archive)
+				const char *tocFilename, ArchiveContentArray *archive)
 {
+	char tocHeader[BUFSIZE] = { 0 };
+
+	if (tocFilename != NULL)
+	{
+		struct stat st = { 0 };
+
+		if (stat(filename, &st) == 0)
+		{
+			sformat(tocHeader, sizeof(tocHeader),
+					"; pgcopydb archive %lld bytes modified at %lld\n",
+					(long long) st.st_size,
+					(long long) st.st_mtime);
+		}
+	}
+
+	if (!IS_EMPTY_STRING_BUFFER(tocHeader) && file_exists(tocFilename))
+	{
+		char *contents = NULL;
+		long fileSize = 0L;
+
+		if (read_file(tocFilename, &contents, &fileSize) &&
+			strncmp(contents, tocHeader, strlen(tocHeader)) == 0)
+		{
+			log_debug("Reading the archive list of \"%s\" from \"%s\"",
+					  filename,
+					  tocFilename);
+
+			bool success = parse_archive_list(contents, archive);
+
+			free(contents);
+			return success;
+		}
+
+		free(contents);
+	}
+
 	Program prog =
 		run_program(pgPaths->pg_restore, "-f-", "-l", filename, NULL);
 
@@ -491,6 +574,24 @@ pg_restore_list(PostgresPaths *pgPaths, const char *filename,
 		return false;
 	}
 
+	/* failing to write the cache is not an error, we have the list */
+	if (!IS_EMPTY_STRING_BUFFER(tocHeader))
+	{
+		PQExpBuffer toc = createPQExpBuffer();
+
+		appendPQExpBufferStr(toc, tocHeader);
+		appendPQExpBufferStr(toc, prog.stdOut);
+
+		if (PQExpBufferBroken(toc) ||
+			!write_file(toc->data, toc->len, tocFilename))
+		{
+			log_warn("Failed to write the archive list to \"%s\"",
+					 tocFilename);
+		}
+
+		destroyPQExpBuffer(toc);
+	}
+
 	if (!parse_archive_list(prog.stdOut, archive))
 	{
 		/* errors have already been logged */
@@ -503,6 +604,186 @@ pg_restore_list(PostgresPaths *pgPaths, const char *filename,
 }
 
 
+/*
+ * pg_dumpall_globals runs pg_dumpall --globals-only on the given source
+ * connection string, and writes the roles and tablespaces SQL script to the
+ * given filename.
+ */
+bool
+pg_dumpall_globals(PostgresPaths *pgPaths,
+				   const char *pguri,
+				   const char *filename)
+{
+	char *args[16];
+	int argsIndex = 0;
+
+	char command[BUFSIZE] = { 0 };
+
+	setenv("PGCONNECT_TIMEOUT", POSTGRES_CONNECT_TIMEOUT, 1);
+
+	args[argsIndex++] = (char *) pgPaths->pg_dumpall;
+	args[argsIndex++] = "--globals-only";
+	args[argsIndex++] = "--file";
+	args[argsIndex++] = (char *) filename;
+	args[argsIndex++] = "--dbname";
+	args[argsIndex++] = (char *) pguri;
+
+	args[argsIndex] = NULL;
+
+	Program program = { 0 };
+
+	(void) initialize_program(&program, args, false);
+	program.processBuffer = &processBufferCallback;
+
+	(void) snprintf_program_command_line(&program, command, BUFSIZE);
+
+	log_info("%s", command);
+
+	(void) execute_subprogram(&program);
+
+	if (program.returnCode != 0)
+	{
+		log_error("Failed to run pg_dumpall: exit code %d", program.returnCode);
+		free_program(&program);
+
+		return false;
+	}
+
+	free_program(&program);
+	return true;
+}
+
+
+/*
+ * psql_run_file runs the SQL script in the given filename with psql on the
+ * given connection string, and stops at the first error. The script is not
+ * run in a single transaction, as a pg_dumpall script contains CREATE
+ * TABLESPACE commands.
+ */
+bool
+psql_run_file(PostgresPaths *pgPaths,
+			  const char *pguri,
+			  const char *filename)
+{
+	char *args[16];
+	int argsIndex = 0;
+
+	char command[BUFSIZE] = { 0 };
+
+	setenv("PGCONNECT_TIMEOUT", POSTGRES_CONNECT_TIMEOUT, 1);
+
+	args[argsIndex++] = (char *) pgPaths->psql;
+	args[argsIndex++] = "--no-psqlrc";
+	args[argsIndex++] = "--quiet";
+	args[argsIndex++] = "--set";
+	args[argsIndex++] = "ON_ERROR_STOP=1";
+	args[argsIndex++] = "--file";
+	args[argsIndex++] = (char *) filename;
+	args[argsIndex++] = "--dbname";
+	args[argsIndex++] = (char *) pguri;
+
+	args[argsIndex] = NULL;
+
+	Program program = { 0 };
+
+	(void) initialize_program(&program, args, false);
+	program.processBuffer = &processBufferCallback;
+
+	(void) snprintf_program_command_line(&program, command, BUFSIZE);
+
+	log_info("%s", command);
+
+	(void) execute_subprogram(&program);
+
+	if (program.returnCode != 0)
+	{
+		log_error("Failed to run psql: exit code %d", program.returnCode);
+		free_program(&program);
+
+		return false;
+	}
+
+	free_program(&program);
+	return true;
+}
+
+
+/*
+ * The desc of some archive entries is made of several words, and we can't
+ * tell where it ends from the line contents alone: the schema name and the
+ * object name follow. Longest descs first, so that a desc that is a prefix
+ * of another one does not match first.
+ */
+static char *archiveMultiWordDescs[] = {
+	"PUBLICATION TABLES IN SCHEMA",
+	"TEXT SEARCH CONFIGURATION",
+	"TEXT SEARCH DICTIONARY",
+	"MATERIALIZED VIEW DATA",
+	"TEXT SEARCH TEMPLATE",
+	"FOREIGN DATA WRAPPER",
+	"PROCEDURAL LANGUAGE",
+	"DATABASE PROPERTIES",
+	"TEXT SEARCH PARSER",
+	"SEQUENCE OWNED BY",
+	"PUBLICATION TABLE",
+	"MATERIALIZED VIEW",
+	"CHECK CONSTRAINT",
+	"OPERATOR FAMILY",
+	"OPERATOR CLASS",
+	"SECURITY LABEL",
+	"FOREIGN SERVER",
+	"ACCESS METHOD",
+	"FOREIGN TABLE",
+	"EVENT TRIGGER",
+	"BLOB METADATA",
+	"FK CONSTRAINT",
+	"TABLE ATTACH",
+	"INDEX ATTACH",
+	"SEQUENCE SET",
+	"USER MAPPING",
+	"LARGE OBJECT",
+	"ROW SECURITY",
+	"DEFAULT ACL",
+	"SHELL TYPE",
+	"TABLE DATA",
+	NULL
+};
+
+
+/*
+ * parse_archive_item_desc copies the desc of an archive entry from the given
+ * pg_restore --list line contents, where the desc is followed by the schema
+ * name, the object name, and the owner.
+ */
+static void
+parse_archive_item_desc(const char *ptr, char *desc, size_t size)
+{
+	for (int i = 0; archiveMultiWordDescs[i] != NULL; i++)
+	{
+		char *candidate = archiveMultiWordDescs[i];
+		size_t len = strlen(candidate);
+
+		if (strncmp(ptr, candidate, len) == 0 &&
+			(ptr[len] == ' ' || ptr[len] == '\0'))
+		{
+			strlcpy(desc, candidate, size);
+			return;
+		}
+	}
+
+	/* single word desc */
+	size_t len = strcspn(ptr, " ");
+
+	if (len >= size)
+	{
+		len = size - 1;
+	}
+
+	memcpy(desc, ptr, len);
+	desc[len] = '\0';
+}
+
+
 /*
  * parse_archive_list parses a archive content list as obtained with the
  * pg_restore --list option.
@@ -515,7 +796,9 @@ pg_restore_list(PostgresPaths *pgPaths, const char *filename,
  *          te->desc, sanitized_schema, sanitized_name,
  *          sanitized_owner);
  *
- * We only parse the dumpId, catalogOid, and objectOid.
+ * We parse the dumpId, catalogOid, objectOid, and the desc, and keep the
+ * rest of the line as the restoreListName, which the table filters use to
+ * match the entries that have no object OID, such as COMMENT or ACL.
  */
 bool
 parse_archive_list(char *list, ArchiveContentArray *contents)
@@ -592,6 +875,20 @@ parse_archive_list(char *list, ArchiveContentArray *contents)
 			return false;
 		}
 
+		/* skip " " */
+		ptr = sep + 1;
+		parse_archive_item_desc(ptr, item->desc, sizeof(item->desc));
+
+		/* the schema name, the object name, and the owner follow the desc */
+		ptr += strlen(item->desc);
+
+		if (*ptr == ' ')
+		{
+			++ptr;
+		}
+
+		strlcpy(item->restoreListName, ptr, sizeof(item->restoreListName));
+
 		++contents->count;
 	}
 
@@ -24,6 +24,7 @@ typedef struct PostgresPaths
 	char psql[MAXPGPATH];
 	char pg_config[MAXPGPATH];
 	char pg_dump[MAXPGPATH];
+	char pg_dumpall[MAXPGPATH];
 	char pg_restore[MAXPGPATH];
 	char pg_version[PG_VERSION_STRING_MAX];
 } PostgresPaths;
@@ -51,6 +52,8 @@ typedef struct ArchiveContentItem
 	int dumpId;
 	uint32_t catalogOid;
 	uint32_t objectOid;
+	char desc[NAMEDATALEN];     /* TABLE, FK CONSTRAINT, ACL, etc */
+	char restoreListName[4 * NAMEDATALEN];  /* schema, name, and owner */
 } ArchiveContentItem;
 
 
@@ -71,6 +74,7 @@ bool set_psql_from_pg_config(PostgresPaths *pgPaths);
 
 bool pg_dump_db(PostgresPaths *pgPaths,
 				const char *pguri,
+				const char *snapshot,
 				const char *section,
 				const char *filename);
 
@@ -79,10 +83,20 @@ bool pg_restore_db(PostgresPaths *pgPaths,
 				   const char *dumpFilename,
 				   const char *listFilename,
 				   bool dropIfExists,
-				   bool noOwner);
+				   bool noOwner,
+				   bool singleTransaction,
+				   int jobs);
 
 bool pg_restore_list(PostgresPaths *pgPaths, const char *filename,
-					 ArchiveContentArray *archive);
+					 const char *tocFilename, ArchiveContentArray *archive);
+
+bool pg_dumpall_globals(PostgresPaths *pgPaths,
+						const char *pguri,
+						const char *filename);
+
+bool psql_run_file(PostgresPaths *pgPaths,
+				   const char *pguri,
+				   const char *filename);
 
 bool parse_archive_list(char *list, ArchiveContentArray *archive);
 
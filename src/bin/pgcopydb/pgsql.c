@@ -2,6 +2,7 @@
  * src/bin/pg_autoctl/pgsql.c
  *	 API for sending SQL commands to a PostgreSQL server
  */
+#include <poll.h>
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
@@ -9,6 +10,7 @@
 #include "postgres.h"
 #include "postgres_fe.h"
 #include "libpq-fe.h"
+#include "libpq/libpq-fs.h"
 #include "pqexpbuffer.h"
 #include "portability/instr_time.h"
 
@@ -38,15 +40,54 @@ static char * ConnectionTypeToString(ConnectionType connectionType);
 static void log_connection_error(PGconn *connection, int logLevel);
 static void pgAutoCtlDefaultNoticeProcessor(void *arg, const char *message);
 static PGconn * pgsql_open_connection(PGSQL *pgsql);
+static void pgsql_connection_options(const char *connectionString,
+									 PQExpBuffer options);
 static bool pgsql_retry_open_connection(PGSQL *pgsql);
 static bool is_response_ok(PGresult *result);
+static void pgsql_log_batch_error(PGSQL *pgsql, PGresult *result,
+								  const char *sql);
 static bool clear_results(PGSQL *pgsql);
 static void pgsql_handle_notifications(PGSQL *pgsql);
 
+static PQExpBuffer pg_copy_query(CopyArgs *args, ExecStatusType status);
 static bool pg_copy_send_query(PGSQL *pgsql,
-							   const char *qname,
+							   CopyArgs *args,
 							   ExecStatusType status);
+static bool pg_copy_data(PGSQL *src, PGSQL *dst,
+						 CopyArgs *args, CopyStats *stats,
+						 bool *failedOnSrc, bool *failedOnDst);
+static bool pg_copy_data_pipeline(PGSQL *src, PGSQL *dst,
+								  CopyArgs *args, CopyStats *stats,
+								  bool *failedOnSrc, bool *failedOnDst);
+static void * pg_copy_pipeline_reader(void *arg);
+static CopyBuffer * pg_copy_pipeline_acquire(CopyPipeline *pipeline);
+static void pg_copy_pipeline_publish(CopyPipeline *pipeline);
+static void pg_copy_pipeline_set_failed_on_src(CopyPipeline *pipeline);
+static void pg_copy_pipeline_free(CopyPipeline *pipeline);
+static bool pg_copy_buffer_append(PGSQL *dst,
+								  CopyArgs *args,
+								  CopyBuffer *buffer,
+								  const char *data,
+								  int len,
+								  CopyStats *stats);
+static bool pg_copy_buffer_flush(PGSQL *dst,
+								 CopyArgs *args,
+								 CopyBuffer *buffer,
+								 CopyStats *stats);
+static void pg_copy_publish_progress(CopyArgs *args, CopyStats *stats,
+									 bool force);
+static bool pg_copy_put_data(PGSQL *dst, CopyArgs *args,
+							 const char *data, int len,
+							 CopyStats *stats);
+static uint64_t pg_copy_elapsed_us(instr_time start);
+static bool pg_copy_end(PGSQL *dst, CopyArgs *args, bool failedOnSrc);
+static void pg_copy_finish_targets(PGSQL *dst, CopyArgs *args);
 static void pgcopy_log_error(PGSQL *pgsql, PGresult *res, const char *context);
+static bool pg_copy_stream_copy_rows(CopyStream *stream);
+static int pg_copy_stream_flush(CopyStream *stream, PGSQL *pgsql);
+static int pg_copy_stream_command_result(CopyStream *stream, PGSQL *pgsql);
+static bool pg_copy_stream_failed(CopyStream *stream, PGSQL *pgsql,
+								  PGresult *res, const char *context);
 
 static void getSequenceValue(void *ctx, PGresult *result);
 
@@ -140,6 +181,8 @@ pgsql_init(PGSQL *pgsql, char *url, ConnectionType connectionType)
 {
 	pgsql->connectionType = connectionType;
 	pgsql->connection = NULL;
+	pgsql->sessionOptions[0] = '\0';
+	pgsql->replication = false;
 
 	/* set our default retry policy for interactive commands */
 	(void) pgsql_set_interactive_retry_policy(&(pgsql->retryPolicy));
@@ -443,6 +486,110 @@ log_connection_error(PGconn *connection, int logLevel)
 }
 
 
+/*
+ * pgsql_connectdb calls PQconnectdbParams: the connection string is expanded
+ * as the dbname parameter, and our options are added to it. The
+ * fallback_application_name is used unless the connection string, or the
+ * PGAPPNAME environment variable, sets an application_name.
+ *
+ * The options keyword replaces the options of the connection string, or of
+ * the PGOPTIONS environment variable, so our session options are appended to
+ * those rather than given alone.
+ */
+static PGconn *
+pgsql_connectdb(PGSQL *pgsql)
+{
+	const char *keywords[5] = { "dbname", "fallback_application_name", NULL };
+	const char *values[5] = {
+		pgsql->connectionString, PGCOPYDB_APPLICATION_NAME, NULL
+	};
+	int count = 2;
+
+	PQExpBuffer options = createPQExpBuffer();
+
+	if (!IS_EMPTY_STRING_BUFFER(pgsql->sessionOptions))
+	{
+		(void) pgsql_connection_options(pgsql->connectionString, options);
+
+		if (options->len > 0)
+		{
+			appendPQExpBufferChar(options, ' ');
+		}
+
+		appendPQExpBufferStr(options, pgsql->sessionOptions);
+
+		if (PQExpBufferBroken(options))
+		{
+			log_error("Failed to prepare the connection options: out of memory");
+			destroyPQExpBuffer(options);
+			return NULL;
+		}
+
+		keywords[count] = "options";
+		values[count] = options->data;
+		++count;
+	}
+
+	if (pgsql->replication)
+	{
+		keywords[count] = "replication";
+		values[count] = "database";
+		++count;
+	}
+
+	PGconn *connection = PQconnectdbParams(keywords, values, 1);
+
+	destroyPQExpBuffer(options);
+
+	return connection;
+}
+
+
+/*
+ * pgsql_connection_options appends to the given buffer the options of the
+ * given connection string, or otherwise of the PGOPTIONS environment
+ * variable, as libpq would use them.
+ */
+static void
+pgsql_connection_options(const char *connectionString, PQExpBuffer options)
+{
+	char *errmsg = NULL;
+	PQconninfoOption *conninfo = PQconninfoParse(connectionString, &errmsg);
+
+	/* PQconnectdbParams() then reports the error */
+	if (conninfo == NULL)
+	{
+		if (errmsg != NULL)
+		{
+			PQfreemem(errmsg);
+		}
+		return;
+	}
+
+	for (PQconninfoOption *option = conninfo; option->keyword != NULL; option++)
+	{
+		if (streq(option->keyword, "options") &&
+			option->val != NULL &&
+			!IS_EMPTY_STRING_BUFFER(option->val))
+		{
+			appendPQExpBufferStr(options, option->val);
+		}
+	}
+
+	PQconninfoFree(conninfo);
+
+	if (options->len == 0)
+	{
+		char *pgoptions = getenv("PGOPTIONS");
+
+		if (pgoptions != NULL)
+		{
+			appendPQExpBufferStr(options, pgoptions);
+		}
+	}
+}
+
+
 /*
  * pgsql_open_connection opens a PostgreSQL connection, given a PGSQL client
  * instance. If a connection is already open in the client (it's not NULL),
@@ -481,7 +628,7 @@ pgsql_open_connection(PGSQL *pgsql)
 	INSTR_TIME_SET_ZERO(pgsql->retryPolicy.connectTime);
 
 	/* Make a connection to the database */
-	pgsql->connection = PQconnectdb(pgsql->connectionString);
+	pgsql->connection = pgsql_connectdb(pgsql);
 
 	/* Check to see that the backend connection was successfully made */
 	if (PQstatus(pgsql->connection) != CONNECTION_OK)
@@ -602,6 +749,8 @@ pgsql_retry_open_connection(PGSQL *pgsql)
 		int sleep =
 			pgsql_compute_connection_retry_sleep_time(&(pgsql->retryPolicy));
 
+		log_flush();
+
 		/* we have milliseconds, pg_usleep() wants microseconds */
 		(void) pg_usleep(sleep * 1000);
 
@@ -630,7 +779,7 @@ pgsql_retry_open_connection(PGSQL *pgsql)
 				 * PQping does not check authentication, so we might still fail
 				 * to connect to the server.
 				 */
-				pgsql->connection = PQconnectdb(pgsql->connectionString);
+				pgsql->connection = pgsql_connectdb(pgsql);
 
 				if (PQstatus(pgsql->connection) == CONNECTION_OK)
 				{
@@ -826,6 +975,27 @@ pgAutoCtlDebugNoticeProcessor(void *arg, const char *message)
 }
 
 
+/*
+ * pgsql_open_persistent_connection opens a connection that remains open after
+ * each query, until pgsql_finish() is called, without opening a transaction:
+ * each statement is then committed on its own, as usual.
+ */
+bool
+pgsql_open_persistent_connection(PGSQL *pgsql)
+{
+	pgsql->connectionStatementType = PGSQL_CONNECTION_MULTI_STATEMENT;
+
+	if (pgsql_open_connection(pgsql) == NULL)
+	{
+		/* errors have already been logged */
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	return true;
+}
+
+
 /*
  * pgsql_begin is responsible for opening a mutli statement connection and
  * opening a transaction block by issuing a 'BEGIN' query.
@@ -929,6 +1099,282 @@ pgsql_commit(PGSQL *pgsql)
 }
 
 
+/*
+ * pgsql_set_transaction is responsible for issuing a SET TRANSACTION command
+ * with the given isolation level and READ ONLY and DEFERRABLE properties,
+ * within a transaction block opened with pgsql_begin() already.
+ */
+bool
+pgsql_set_transaction(PGSQL *pgsql,
+					  IsolationLevel level,
+					  bool readOnly,
+					  bool deferrable)
+{
+	char sql[BUFSIZE] = { 0 };
+
+	if (pgsql->connectionStatementType != PGSQL_CONNECTION_MULTI_STATEMENT ||
+		pgsql->connection == NULL)
+	{
+		log_error("BUG: call to pgsql_set_transaction without holding an open "
+				  "multi statement connection");
+		return false;
+	}
+
+	char *isolationLevel = NULL;
+
+	switch (level)
+	{
+		case ISOLATION_SERIALIZABLE:
+		{
+			isolationLevel = "SERIALIZABLE";
+			break;
+		}
+
+		case ISOLATION_REPEATABLE_READ:
+		{
+			isolationLevel = "REPEATABLE READ";
+			break;
+		}
+
+		case ISOLATION_READ_COMMITTED:
+		{
+			isolationLevel = "READ COMMITTED";
+			break;
+		}
+
+		case ISOLATION_READ_UNCOMMITTED:
+		{
+			isolationLevel = "READ UNCOMMITTED";
+			break;
+		}
+	}
+
+	if (isolationLevel == NULL)
+	{
+		log_error("BUG: pgsql_set_transaction: unknown isolation level %d",
+				  level);
+		return false;
+	}
+
+	sformat(sql, sizeof(sql),
+			"SET TRANSACTION ISOLATION LEVEL %s, %s, %s",
+			isolationLevel,
+			readOnly ? "READ ONLY" : "READ WRITE",
+			deferrable ? "DEFERRABLE" : "NOT DEFERRABLE");
+
+	if (!pgsql_execute(pgsql, sql))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * pgsql_export_snapshot calls pg_export_snapshot() and copies the snapshot
+ * identifier in the given pre-allocated string buffer. The snapshot remains
+ * valid as long as the current transaction is not finished, so it makes
+ * sense to call this function only within a transaction block opened with
+ * pgsql_begin().
+ */
+bool
+pgsql_export_snapshot(PGSQL *pgsql, char *snapshot, size_t size)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+
+	char *sql = "select pg_catalog.pg_export_snapshot()";
+
+	if (pgsql->connectionStatementType != PGSQL_CONNECTION_MULTI_STATEMENT ||
+		pgsql->connection == NULL)
+	{
+		log_error("BUG: call to pgsql_export_snapshot without holding an open "
+				  "multi statement connection");
+		return false;
+	}
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to export snapshot");
+		return false;
+	}
+
+	if (!context.parsedOk || context.strVal == NULL)
+	{
+		log_error("Failed to export snapshot");
+		return false;
+	}
+
+	strlcpy(snapshot, context.strVal, size);
+	free(context.strVal);
+
+	return true;
+}
+
+
+/*
+ * pgsql_set_snapshot calls SET TRANSACTION SNAPSHOT with the given snapshot
+ * identifier, as obtained from pg_export_snapshot() in another session. This
+ * must be done at the very beginning of a REPEATABLE READ (or SERIALIZABLE)
+ * transaction, before any query is run.
+ */
+bool
+pgsql_set_snapshot(PGSQL *pgsql, const char *snapshot)
+{
+	char sql[BUFSIZE] = { 0 };
+
+	if (pgsql->connectionStatementType != PGSQL_CONNECTION_MULTI_STATEMENT ||
+		pgsql->connection == NULL)
+	{
+		log_error("BUG: call to pgsql_set_snapshot without holding an open "
+				  "multi statement connection");
+		return false;
+	}
+
+	char *escapedSnapshot =
+		PQescapeLiteral(pgsql->connection, snapshot, strlen(snapshot));
+
+	if (escapedSnapshot == NULL)
+	{
+		log_error("Failed to set snapshot \"%s\": %s",
+				  snapshot,
+				  PQerrorMessage(pgsql->connection));
+		return false;
+	}
+
+	sformat(sql, sizeof(sql), "SET TRANSACTION SNAPSHOT %s", escapedSnapshot);
+	PQfreemem(escapedSnapshot);
+
+	if (!pgsql_execute(pgsql, sql))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	return true;
+}
+
+
+/* context used when parsing CREATE_REPLICATION_SLOT results */
+typedef struct ReplicationSlotContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	bool parsedOk;
+	char lsn[PG_LSN_MAXLENGTH];
+	char snapshot[BUFSIZE];
+} ReplicationSlotContext;
+
+
+/*
+ * parseReplicationSlot parses the result of the CREATE_REPLICATION_SLOT
+ * replication command, which columns are slot_name, consistent_point,
+ * snapshot_name, and output_plugin.
+ */
+static void
+parseReplicationSlot(void *ctx, PGresult *result)
+{
+	ReplicationSlotContext *context = (ReplicationSlotContext *) ctx;
+
+	if (PQnfields(result) != 4 || PQntuples(result) != 1)
+	{
+		log_error("Query returned %d rows with %d columns, expected 1 row "
+				  "with 4 columns",
+				  PQntuples(result), PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	strlcpy(context->lsn, PQgetvalue(result, 0, 1), sizeof(context->lsn));
+
+	strlcpy(context->snapshot,
+			PQgetvalue(result, 0, 2),
+			sizeof(context->snapshot));
+
+	context->parsedOk = true;
+}
+
+
+/*
+ * pgsql_create_logical_replication_slot creates a logical replication slot
+ * using the given output plugin, and exports the snapshot that matches the
+ * slot consistent point: changes decoded from the slot are exactly those that
+ * are not visible in that snapshot.
+ *
+ * This must be done on a replication connection, and the exported snapshot
+ * remains valid only until the next command is sent on that connection, or
+ * until it's closed.
+ */
+bool
+pgsql_create_logical_replication_slot(PGSQL *pgsql,
+									  const char *slotName,
+									  const char *plugin,
+									  char *lsn, size_t lsnSize,
+									  char *snapshot, size_t snapshotSize)
+{
+	ReplicationSlotContext context = { 0 };
+	char sql[BUFSIZE] = { 0 };
+
+	if (!pgsql->replication ||
+		pgsql->connectionStatementType != PGSQL_CONNECTION_MULTI_STATEMENT)
+	{
+		log_error("BUG: call to pgsql_create_logical_replication_slot "
+				  "without a persistent replication connection");
+		return false;
+	}
+
+	/* replication commands don't support the extended query protocol */
+	sformat(sql, sizeof(sql),
+			"CREATE_REPLICATION_SLOT \"%s\" LOGICAL %s EXPORT_SNAPSHOT",
+			slotName,
+			plugin);
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseReplicationSlot))
+	{
+		log_error("Failed to create logical replication slot \"%s\"",
+				  slotName);
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to create logical replication slot \"%s\"",
+				  slotName);
+		return false;
+	}
+
+	strlcpy(lsn, context.lsn, lsnSize);
+	strlcpy(snapshot, context.snapshot, snapshotSize);
+
+	return true;
+}
+
+
+/*
+ * pgsql_drop_replication_slot drops the given replication slot, using a
+ * normal SQL connection.
+ */
+bool
+pgsql_drop_replication_slot(PGSQL *pgsql, const char *slotName)
+{
+	char *sql = "select pg_drop_replication_slot($1)";
+
+	const Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { slotName };
+
+	if (!pgsql_execute_with_params(pgsql, sql, 1, paramTypes, paramValues,
+								   NULL, NULL))
+	{
+		log_error("Failed to drop replication slot \"%s\"", slotName);
+		return false;
+	}
+
+	return true;
+}
+
+
 /*
  * pgsql_execute opens a connection, runs a given SQL command, and closes
  * the connection again.
@@ -1083,27 +1529,215 @@ pgsql_execute_with_params(PGSQL *pgsql, const char *sql, int paramCount,
 
 
 /*
- * is_response_ok returns whether the query result is a correct response
- * (not an error or failure).
+ * pgsql_execute_batch runs the given SQL commands on the same connection, in
+ * as few network round trips as possible. The commands run in a single
+ * implicit transaction: either all of them succeed or none of them has any
+ * effect, and the commands that cannot run in a transaction block, such as
+ * VACUUM, must not be given here.
+ *
+ * With a libpq that supports pipeline mode (Postgres 14 and later), the
+ * commands are all sent before reading any result. Otherwise they are sent
+ * as one multi-statement query string.
  */
-static bool
-is_response_ok(PGresult *result)
+bool
+pgsql_execute_batch(PGSQL *pgsql, const char **commands, int count)
 {
-	ExecStatusType resultStatus = PQresultStatus(result);
-
-	return resultStatus == PGRES_SINGLE_TUPLE || resultStatus == PGRES_TUPLES_OK ||
-		   resultStatus == PGRES_COMMAND_OK;
-}
+	if (count == 0)
+	{
+		return true;
+	}
 
+	if (count == 1)
+	{
+		return pgsql_execute(pgsql, commands[0]);
+	}
 
-/*
- * clear_results consumes results on a connection until NULL is returned.
- * If an error is returned it returns false.
- */
-static bool
-clear_results(PGSQL *pgsql)
-{
-	PGconn *connection = pgsql->connection;
+	PGconn *connection = pgsql_open_connection(pgsql);
+
+	if (connection == NULL)
+	{
+		return false;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		log_debug("%s;", commands[i]);
+	}
+
+	bool success = true;
+
+#ifdef LIBPQ_HAS_PIPELINING
+	if (!PQenterPipelineMode(connection))
+	{
+		log_error("Failed to enter pipeline mode: %s",
+				  PQerrorMessage(connection));
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	int sentCount = 0;
+
+	for (; sentCount < count; sentCount++)
+	{
+		if (!PQsendQueryParams(connection, commands[sentCount],
+							   0, NULL, NULL, NULL, NULL, 0))
+		{
+			log_error("Failed to send SQL query: %s",
+					  PQerrorMessage(connection));
+			log_error("SQL query: %s", commands[sentCount]);
+			success = false;
+			break;
+		}
+	}
+
+	if (!PQpipelineSync(connection))
+	{
+		log_error("Failed to send pipeline sync: %s",
+				  PQerrorMessage(connection));
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	/* each command's results are followed by a NULL result */
+	for (int i = 0; i < sentCount; i++)
+	{
+		PGresult *result = NULL;
+
+		while ((result = PQgetResult(connection)) != NULL)
+		{
+			(void) pgsql_handle_notifications(pgsql);
+
+			if (PQresultStatus(result) == PGRES_FATAL_ERROR)
+			{
+				(void) pgsql_log_batch_error(pgsql, result, commands[i]);
+				success = false;
+			}
+
+			PQclear(result);
+		}
+	}
+
+	/* now consume the PGRES_PIPELINE_SYNC result */
+	PGresult *syncResult = PQgetResult(connection);
+
+	if (PQresultStatus(syncResult) != PGRES_PIPELINE_SYNC)
+	{
+		log_error("Failed to sync the pipeline: %s",
+				  PQerrorMessage(connection));
+		PQclear(syncResult);
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	PQclear(syncResult);
+
+	if (!PQexitPipelineMode(connection))
+	{
+		log_error("Failed to exit pipeline mode: %s",
+				  PQerrorMessage(connection));
+		pgsql_finish(pgsql);
+		return false;
+	}
+#else
+
+	/* a multi-statement query string also runs in a single transaction */
+	PQExpBuffer sql = createPQExpBuffer();
+
+	for (int i = 0; i < count; i++)
+	{
+		appendPQExpBuffer(sql, "%s%s", i > 0 ? ";\n" : "", commands[i]);
+	}
+
+	if (PQExpBufferBroken(sql))
+	{
+		log_error("Failed to prepare a batch of %d SQL commands: "
+				  "out of memory",
+				  count);
+		destroyPQExpBuffer(sql);
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	PGresult *result = PQexec(connection, sql->data);
+
+	if (!is_response_ok(result))
+	{
+		(void) pgsql_log_batch_error(pgsql, result, sql->data);
+		success = false;
+	}
+
+	PQclear(result);
+	destroyPQExpBuffer(sql);
+
+	if (!clear_results(pgsql))
+	{
+		/* errors have already been logged, and the connection is closed */
+		return false;
+	}
+#endif
+
+	if (pgsql->connectionStatementType == PGSQL_CONNECTION_SINGLE_STATEMENT)
+	{
+		pgsql_finish(pgsql);
+	}
+
+	return success;
+}
+
+
+/*
+ * pgsql_log_batch_error logs the error message of a failed command from
+ * pgsql_execute_batch, one line at a time, and tracks connection failures.
+ */
+static void
+pgsql_log_batch_error(PGSQL *pgsql, PGresult *result, const char *sql)
+{
+	char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
+	char *message = PQresultErrorMessage(result);
+	char *errorLines[BUFSIZE];
+	int lineCount = splitLines(message, errorLines, BUFSIZE);
+
+	char *prefix =
+		pgsql->connectionType == PGSQL_CONN_SOURCE ? "[SOURCE]" : "[TARGET]";
+
+	for (int lineNumber = 0; lineNumber < lineCount; lineNumber++)
+	{
+		log_error("%s %s", prefix, errorLines[lineNumber]);
+	}
+
+	log_error("SQL query: %s", sql);
+
+	/* if we get a connection exception, track that */
+	if (sqlstate &&
+		strncmp(sqlstate, STR_ERRCODE_CLASS_CONNECTION_EXCEPTION, 2) == 0)
+	{
+		pgsql->status = PG_CONNECTION_BAD;
+	}
+}
+
+
+/*
+ * is_response_ok returns whether the query result is a correct response
+ * (not an error or failure).
+ */
+static bool
+is_response_ok(PGresult *result)
+{
+	ExecStatusType resultStatus = PQresultStatus(result);
+
+	return resultStatus == PGRES_SINGLE_TUPLE || resultStatus == PGRES_TUPLES_OK ||
+		   resultStatus == PGRES_COMMAND_OK;
+}
+
+
+/*
+ * clear_results consumes results on a connection until NULL is returned.
+ * If an error is returned it returns false.
+ */
+static bool
+clear_results(PGSQL *pgsql)
+{
+	PGconn *connection = pgsql->connection;
 
 	/*
 	 * Per Postgres documentation: You should, however, remember to check
@@ -1295,14 +1929,95 @@ validate_connection_string(const char *connectionString)
 }
 
 
+/*
+ * pgsql_server_version_num fetches the server_version_num setting of the
+ * given Postgres connection, such as 140005 for Postgres 14.5.
+ */
+bool
+pgsql_server_version_num(PGSQL *pgsql, int *version)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_INT, false };
+
+	char *sql = "select current_setting('server_version_num')::int";
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to get server_version_num");
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to get server_version_num");
+		return false;
+	}
+
+	*version = context.intVal;
+
+	return true;
+}
+
+
+/*
+ * copy_format_from_string parses a COPY format name.
+ */
+bool
+copy_format_from_string(const char *str, CopyFormat *format)
+{
+	if (strcmp(str, "text") == 0)
+	{
+		*format = COPY_FORMAT_TEXT;
+		return true;
+	}
+	else if (strcmp(str, "binary") == 0)
+	{
+		*format = COPY_FORMAT_BINARY;
+		return true;
+	}
+
+	return false;
+}
+
+
+/*
+ * CopyFormatToString returns the COPY format name, as used in the COPY
+ * command FORMAT option.
+ */
+char *
+CopyFormatToString(CopyFormat format)
+{
+	switch (format)
+	{
+		case COPY_FORMAT_TEXT:
+		{
+			return "text";
+		}
+
+		case COPY_FORMAT_BINARY:
+		{
+			return "binary";
+		}
+	}
+
+	return "unknown";
+}
+
+
 /*
  * pg_copy implements a COPY operation from a source Postgres instance (src) to
  * a target Postgres instance (dst), for the data found in the table referenced
- * by the qualified identifier name srcQname on the source, into the table
- * referenced by the qualified identifier name dstQname on the target.
+ * by the qualified identifier name args->srcQname on the source, into the
+ * table referenced by the qualified identifier name args->dstQname on the
+ * target, using the COPY format args->format on both sides.
+ *
+ * When args->fanoutCount is positive, the same data is also sent to each of
+ * the args->fanout target connections, so that the source table is read
+ * only once for all the targets. When any of the targets fails, all the
+ * target connections are closed, and the COPY fails on all of them.
  */
 bool
-pg_copy(PGSQL *src, PGSQL *dst, const char *srcQname, const char *dstQname)
+pg_copy(PGSQL *src, PGSQL *dst, CopyArgs *args, CopyStats *stats)
 {
 	PGconn *srcConn = pgsql_open_connection(src);
 
@@ -1319,159 +2034,1634 @@ pg_copy(PGSQL *src, PGSQL *dst, const char *srcQname, const char *dstQname)
 		return false;
 	}
 
+	for (int i = 0; i < args->fanoutCount; i++)
+	{
+		if (pgsql_open_connection(&(args->fanout[i])) == NULL)
+		{
+			pgsql_finish(src);
+			pg_copy_finish_targets(dst, args);
+			return false;
+		}
+	}
+
 	/* SRC: COPY schema.table TO STDOUT */
-	if (!pg_copy_send_query(src, srcQname, PGRES_COPY_OUT))
+	if (!pg_copy_send_query(src, args, PGRES_COPY_OUT))
 	{
 		pgsql_finish(src);
-		pgsql_finish(dst);
+		pg_copy_finish_targets(dst, args);
 
 		return false;
 	}
 
 	/* DST: COPY schema.table FROM STDIN */
-	if (!pg_copy_send_query(dst, dstQname, PGRES_COPY_IN))
+	bool started = pg_copy_send_query(dst, args, PGRES_COPY_IN);
+
+	for (int i = 0; started && i < args->fanoutCount; i++)
+	{
+		started = pg_copy_send_query(&(args->fanout[i]), args, PGRES_COPY_IN);
+	}
+
+	if (!started)
 	{
 		pgsql_finish(src);
-		pgsql_finish(dst);
+		pg_copy_finish_targets(dst, args);
 
 		return false;
 	}
 
-	/* now implement the copy loop */
-	char *copybuf;
+	/* now implement the copy loop, either in lockstep or pipelined */
 	bool failedOnSrc = false;
 	bool failedOnDst = false;
 
-	for (;;)
-	{
-		int bufsize = PQgetCopyData(srcConn, &copybuf, 0);
-
-		/*
-		 * A result of -2 indicates that an error occurred.
-		 */
-		if (bufsize == -2)
-		{
-			failedOnSrc = true;
+	bool success =
+		args->pipelineDepth > 0
+		? pg_copy_data_pipeline(src, dst, args, stats,
+								&failedOnSrc, &failedOnDst)
+		: pg_copy_data(src, dst, args, stats,
+					   &failedOnSrc, &failedOnDst);
 
-			pgcopy_log_error(src, NULL, "Failed to fetch data from source");
-			break;
-		}
+	if (!success)
+	{
+		/* errors have already been logged */
+		pgsql_finish(src);
+		pg_copy_finish_targets(dst, args);
 
-		/*
-		 * PQgetCopyData returns -1 to indicate that the COPY is done. Call
-		 * PQgetResult to obtain the final result status of the COPY command.
-		 */
-		else if (bufsize == -1)
-		{
-			PGresult *res = PQgetResult(srcConn);
+		return false;
+	}
 
-			if (PQresultStatus(res) != PGRES_COMMAND_OK)
-			{
-				failedOnSrc = true;
+	pg_copy_publish_progress(args, stats, true);
 
-				pgcopy_log_error(src, res, "Failed to fetch data from source");
-				break;
-			}
+	/*
+	 * The COPY loop is over now.
+	 *
+	 * Time to send end-of-data indication to the servers during COPY_IN state.
+	 */
+	if (!failedOnDst)
+	{
+		instr_time start;
 
-			/* we're done here */
-			clear_results(src);
-			pgsql_finish(src);
+		INSTR_TIME_SET_CURRENT(start);
 
-			/* make sure to pass through and send this last COPY buffer */
-		}
+		/* the target might still have to process data that we sent */
+		failedOnDst = !pg_copy_end(dst, args, failedOnSrc);
 
-		/*
-		 * We got a COPY buffer from the source database, send it over as-is to
-		 * the target database, which speaks the same COPY protocol, after all.
-		 */
-		if (copybuf)
+		for (int i = 0; i < args->fanoutCount; i++)
 		{
-			int ret = PQputCopyData(dstConn, copybuf, bufsize);
-			PQfreemem(copybuf);
-
-			if (ret == -1)
+			if (!pg_copy_end(&(args->fanout[i]), args, failedOnSrc))
 			{
 				failedOnDst = true;
-
-				pgcopy_log_error(dst, NULL, "Failed to copy data to target");
-
-				clear_results(src);
-				pgsql_finish(src);
-
-				break;
 			}
 		}
 
-		/* when we've reached the end of COPY from the source, stop here */
-		if (bufsize == -1)
-		{
-			break;
-		}
+		stats->dstWaitUs += pg_copy_elapsed_us(start);
 	}
 
-	/*
-	 * The COPY loop is over now.
-	 *
-	 * Time to send end-of-data indication to the server during COPY_IN state.
-	 */
-	if (!failedOnDst)
+	/* don't let some of the targets COMMIT when another one failed */
+	if (failedOnDst && args->fanoutCount > 0)
 	{
-		char *errormsg =
-			failedOnSrc ? "Failed to get data from source" : NULL;
+		pg_copy_finish_targets(dst, args);
+	}
 
-		int res = PQputCopyEnd(dstConn, errormsg);
+	return !failedOnSrc && !failedOnDst;
+}
 
-		if (res > 0)
-		{
-			PGresult *res = PQgetResult(dstConn);
 
-			if (PQresultStatus(res) != PGRES_COMMAND_OK)
+/*
+ * pg_copy_read runs COPY ... TO STDOUT on the source connection and fetches
+ * all the COPY data, without sending it anywhere, so that we know how fast
+ * the source alone can go, see pgcopydb bench read.
+ */
+bool
+pg_copy_read(PGSQL *src, CopyArgs *args, CopyStats *stats)
+{
+	return pg_copy_to_rows(src, args, NULL, NULL, stats);
+}
+
+
+/*
+ * pg_copy_to_rows runs COPY ... TO STDOUT on the source connection and calls
+ * the given row callback with each buffer of COPY data, when not NULL. This
+ * is used to write the COPY data to a file, see pgcopydb dump data.
+ */
+bool
+pg_copy_to_rows(PGSQL *src, CopyArgs *args,
+				CopyRowCB row, void *context,
+				CopyStats *stats)
+{
+	PGconn *srcConn = pgsql_open_connection(src);
+
+	if (srcConn == NULL)
+	{
+		return false;
+	}
+
+	/* SRC: COPY schema.table TO STDOUT */
+	if (!pg_copy_send_query(src, args, PGRES_COPY_OUT))
+	{
+		pgsql_finish(src);
+		return false;
+	}
+
+	char *copybuf;
+
+	for (;;)
+	{
+		instr_time start;
+
+		INSTR_TIME_SET_CURRENT(start);
+
+		int bufsize = PQgetCopyData(srcConn, &copybuf, 0);
+
+		stats->srcWaitUs += pg_copy_elapsed_us(start);
+
+		if (bufsize == -2)
+		{
+			pgcopy_log_error(src, NULL, "Failed to fetch data from source");
+			return false;
+		}
+		else if (bufsize == -1)
+		{
+			PGresult *res = PQgetResult(srcConn);
+
+			if (PQresultStatus(res) != PGRES_COMMAND_OK)
+			{
+				pgcopy_log_error(src, res, "Failed to fetch data from source");
+				return false;
+			}
+
+			PQclear(res);
+			clear_results(src);
+			break;
+		}
+
+		++stats->rows;
+		stats->bytes += bufsize;
+
+		if (row != NULL && !(*row)(context, copybuf, bufsize))
+		{
+			log_error("Failed to process COPY data from source");
+			PQfreemem(copybuf);
+			pgsql_finish(src);
+			return false;
+		}
+
+		PQfreemem(copybuf);
+
+		if (args->throttle != NULL)
+		{
+			(*args->throttle)(args->throttleContext, bufsize);
+		}
+
+		/* there are no flushes here, publish every few buffers instead */
+		if (stats->rows % PROGRESS_UPDATE_FLUSHES == 0)
+		{
+			pg_copy_publish_progress(args, stats, true);
+		}
+
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			log_error("COPY from source interrupted");
+			pgsql_finish(src);
+			return false;
+		}
+	}
+
+	pg_copy_publish_progress(args, stats, true);
+
+	if (!args->keepConnections)
+	{
+		pgsql_finish(src);
+	}
+
+	return true;
+}
+
+
+/*
+ * pg_copy_from_rows runs COPY ... FROM STDIN on the target connection, and
+ * sends the rows that the nextRow callback returns, coalesced in a buffer of
+ * args->bufferSize bytes as in pg_copy(). This is used to send data that we
+ * generate rather than fetch from a source, see pgcopydb bench write.
+ */
+bool
+pg_copy_from_rows(PGSQL *dst, CopyArgs *args,
+				  CopyNextRowCB nextRow, void *context,
+				  CopyStats *stats)
+{
+	if (pgsql_open_connection(dst) == NULL)
+	{
+		return false;
+	}
+
+	/* DST: COPY schema.table FROM STDIN */
+	if (!pg_copy_send_query(dst, args, PGRES_COPY_IN))
+	{
+		pgsql_finish(dst);
+		return false;
+	}
+
+	CopyBuffer buffer = {
+		.data = NULL,
+		.size = args->bufferSize,
+		.len = 0
+	};
+
+	if (buffer.size > 0)
+	{
+		buffer.data = (char *) malloc(buffer.size * sizeof(char));
+
+		if (buffer.data == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			pgsql_finish(dst);
+			return false;
+		}
+	}
+
+	bool failed = false;
+	const char *row = NULL;
+	int len = 0;
+
+	while ((*nextRow)(context, &row, &len))
+	{
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			log_error("COPY to target interrupted");
+			failed = true;
+			break;
+		}
+
+		if (!pg_copy_buffer_append(dst, args, &buffer, row, len, stats))
+		{
+			pgcopy_log_error(dst, NULL, "Failed to copy data to target");
+			free(buffer.data);
+			return false;
+		}
+	}
+
+	if (!failed && !pg_copy_buffer_flush(dst, args, &buffer, stats))
+	{
+		pgcopy_log_error(dst, NULL, "Failed to copy data to target");
+		free(buffer.data);
+		return false;
+	}
+
+	free(buffer.data);
+
+	pg_copy_publish_progress(args, stats, true);
+
+	instr_time start;
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	/* an interrupted COPY is ended with an error, the target aborts it */
+	bool success = pg_copy_end(dst, args, failed);
+
+	stats->dstWaitUs += pg_copy_elapsed_us(start);
+
+	return success && !failed;
+}
+
+
+/*
+ * pg_copy_end sends the end-of-data indication to the given target
+ * connection, and checks the result of the COPY command there. When the
+ * source failed, the COPY is ended with an error message instead, so that the
+ * target server aborts it.
+ */
+static bool
+pg_copy_end(PGSQL *dst, CopyArgs *args, bool failedOnSrc)
+{
+	PGconn *dstConn = dst->connection;
+	bool success = true;
+
+	char *errormsg = failedOnSrc ? "Failed to get data from source" : NULL;
+
+	int res = PQputCopyEnd(dstConn, errormsg);
+
+	if (res > 0)
+	{
+		PGresult *res = PQgetResult(dstConn);
+
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		{
+			success = false;
+			pgcopy_log_error(dst, res, "Failed to copy data to target");
+		}
+		else
+		{
+			PQclear(res);
+		}
+	}
+	else
+	{
+		success = false;
+		log_error("Failed to send end-of-data to the target: %s",
+				  PQerrorMessage(dstConn));
+	}
+
+	if (dst->connection != NULL)
+	{
+		clear_results(dst);
+	}
+
+	if (!args->keepConnections || failedOnSrc || !success)
+	{
+		pgsql_finish(dst);
+	}
+
+	return success;
+}
+
+
+/*
+ * pg_copy_finish_targets closes the target connection and all the fanout
+ * target connections.
+ */
+static void
+pg_copy_finish_targets(PGSQL *dst, CopyArgs *args)
+{
+	pgsql_finish(dst);
+
+	for (int i = 0; i < args->fanoutCount; i++)
+	{
+		pgsql_finish(&(args->fanout[i]));
+	}
+}
+
+
+/*
+ * pg_copy_data implements the COPY loop: it fetches COPY rows from the
+ * source and sends them to the target, in lockstep, from a single thread.
+ *
+ * Returns false when it could not even start the COPY loop, and otherwise
+ * sets failedOnSrc and failedOnDst to track errors during the COPY loop.
+ */
+static bool
+pg_copy_data(PGSQL *src, PGSQL *dst, CopyArgs *args, CopyStats *stats,
+			 bool *failedOnSrc, bool *failedOnDst)
+{
+	PGconn *srcConn = src->connection;
+
+	/* prepare the buffer where we coalesce COPY rows before sending them */
+	CopyBuffer buffer = {
+		.data = NULL,
+		.size = args->bufferSize,
+		.len = 0
+	};
+
+	if (buffer.size > 0)
+	{
+		buffer.data = (char *) malloc(buffer.size * sizeof(char));
+
+		if (buffer.data == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			return false;
+		}
+	}
+
+	char *copybuf;
+
+	for (;;)
+	{
+		instr_time start;
+
+		INSTR_TIME_SET_CURRENT(start);
+
+		int bufsize = PQgetCopyData(srcConn, &copybuf, 0);
+
+		stats->srcWaitUs += pg_copy_elapsed_us(start);
+
+		/*
+		 * A result of -2 indicates that an error occurred.
+		 */
+		if (bufsize == -2)
+		{
+			*failedOnSrc = true;
+
+			pgcopy_log_error(src, NULL, "Failed to fetch data from source");
+			break;
+		}
+
+		/*
+		 * PQgetCopyData returns -1 to indicate that the COPY is done. Call
+		 * PQgetResult to obtain the final result status of the COPY command.
+		 */
+		else if (bufsize == -1)
+		{
+			PGresult *res = PQgetResult(srcConn);
+
+			if (PQresultStatus(res) != PGRES_COMMAND_OK)
+			{
+				*failedOnSrc = true;
+
+				pgcopy_log_error(src, res, "Failed to fetch data from source");
+				break;
+			}
+
+			/* we're done here */
+			PQclear(res);
+			clear_results(src);
+
+			if (!args->keepConnections)
+			{
+				pgsql_finish(src);
+			}
+
+			/* make sure to pass through and send this last COPY buffer */
+		}
+
+		/*
+		 * We got a COPY buffer from the source database, send it over as-is to
+		 * the target database, which speaks the same COPY protocol, after all.
+		 */
+		if (copybuf)
+		{
+			bool success = pg_copy_buffer_append(dst, args, &buffer,
+												 copybuf, bufsize,
+												 stats);
+			PQfreemem(copybuf);
+
+			if (!success)
+			{
+				*failedOnDst = true;
+
+				pgcopy_log_error(dst, NULL, "Failed to copy data to target");
+
+				clear_results(src);
+				pgsql_finish(src);
+
+				break;
+			}
+		}
+
+		/* when we've reached the end of COPY from the source, stop here */
+		if (bufsize == -1)
+		{
+			/* send the rows we still have in our buffer now */
+			if (!pg_copy_buffer_flush(dst, args, &buffer, stats))
+			{
+				*failedOnDst = true;
+
+				pgcopy_log_error(dst, NULL, "Failed to copy data to target");
+			}
+
+			break;
+		}
+	}
+
+	free(buffer.data);
+
+	return true;
+}
+
+
+/*
+ * pg_copy_data_pipeline implements the COPY loop using two threads: a reader
+ * thread fetches COPY rows from the source and fills-in a ring of buffers,
+ * and the current thread is the writer that drains the ring of buffers to
+ * the target.
+ *
+ * This way when the target is slow to accept data (checkpoints, WAL fsync,
+ * etc) we continue fetching data from the source until the ring is full, and
+ * the other way round, when the source is slow to send data, we continue
+ * sending the data that we already have to the target.
+ *
+ * The libpq connections are not shared between the threads: only the reader
+ * thread uses the source connection until it's done, and only the writer
+ * uses the target connection.
+ */
+static bool
+pg_copy_data_pipeline(PGSQL *src, PGSQL *dst, CopyArgs *args, CopyStats *stats,
+					  bool *failedOnSrc, bool *failedOnDst)
+{
+	CopyPipeline pipeline = {
+		.src = src,
+		.args = args,
+		.bufferSize = args->bufferSize,
+		.depth = args->pipelineDepth,
+		.stats = stats
+	};
+
+	pipeline.ring =
+		(CopyBuffer *) calloc(pipeline.depth, sizeof(CopyBuffer));
+
+	if (pipeline.ring == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	for (int i = 0; i < pipeline.depth; i++)
+	{
+		CopyBuffer *slot = &(pipeline.ring[i]);
+
+		slot->size = args->bufferSize;
+
+		if (slot->size > 0)
+		{
+			slot->data = (char *) malloc(slot->size * sizeof(char));
+
+			if (slot->data == NULL)
+			{
+				log_error(ALLOCATION_FAILED_ERROR);
+				pg_copy_pipeline_free(&pipeline);
+				return false;
+			}
+		}
+	}
+
+	if (pthread_mutex_init(&(pipeline.lock), NULL) != 0 ||
+		pthread_cond_init(&(pipeline.notEmpty), NULL) != 0 ||
+		pthread_cond_init(&(pipeline.notFull), NULL) != 0)
+	{
+		log_error("Failed to initialize the COPY pipeline: %m");
+		pg_copy_pipeline_free(&pipeline);
+		return false;
+	}
+
+	pthread_t reader;
+
+	if (pthread_create(&reader, NULL, pg_copy_pipeline_reader, &pipeline) != 0)
+	{
+		log_error("Failed to start the COPY pipeline reader thread: %m");
+		pg_copy_pipeline_free(&pipeline);
+		return false;
+	}
+
+	/* now the current thread is the writer */
+	for (;;)
+	{
+		pthread_mutex_lock(&(pipeline.lock));
+
+		while (pipeline.count == 0 &&
+			   !pipeline.readerDone &&
+			   !pipeline.failedOnSrc)
+		{
+			pthread_cond_wait(&(pipeline.notEmpty), &(pipeline.lock));
+		}
+
+		/* when the source failed, don't send partial data to the target */
+		if (pipeline.failedOnSrc || pipeline.count == 0)
+		{
+			pthread_mutex_unlock(&(pipeline.lock));
+			break;
+		}
+
+		CopyBuffer *slot = &(pipeline.ring[pipeline.tail]);
+
+		pthread_mutex_unlock(&(pipeline.lock));
+
+		/* the reader never touches a filled slot, no need to hold the lock */
+		++stats->flushes;
+		pg_copy_publish_progress(args, stats, false);
+
+		if (!pg_copy_put_data(dst, args, slot->data, slot->len, stats))
+		{
+			pgcopy_log_error(dst, NULL, "Failed to copy data to target");
+
+			pthread_mutex_lock(&(pipeline.lock));
+			pipeline.failedOnDst = true;
+			pthread_cond_signal(&(pipeline.notFull));
+			pthread_mutex_unlock(&(pipeline.lock));
+
+			break;
+		}
+
+		/* with a memory budget, shrink the slots that grew for a wide row */
+		if (args->releaseMemory != NULL &&
+			slot->size > pipeline.bufferSize &&
+			pipeline.bufferSize > 0)
+		{
+			char *data =
+				(char *) realloc(slot->data, pipeline.bufferSize * sizeof(char));
+
+			if (data != NULL)
+			{
+				uint64_t growth = slot->size - pipeline.bufferSize;
+
+				slot->data = data;
+				slot->size = pipeline.bufferSize;
+
+				(*args->releaseMemory)(args->memoryContext, growth);
+			}
+		}
+
+		pthread_mutex_lock(&(pipeline.lock));
+
+		slot->len = 0;
+		pipeline.tail = (pipeline.tail + 1) % pipeline.depth;
+		--pipeline.count;
+
+		pthread_cond_signal(&(pipeline.notFull));
+		pthread_mutex_unlock(&(pipeline.lock));
+	}
+
+	if (pthread_join(reader, NULL) != 0)
+	{
+		log_error("Failed to join the COPY pipeline reader thread: %m");
+		pipeline.failedOnSrc = true;
+	}
+
+	/* the reader thread is done with the source connection now */
+	if (src->connection != NULL)
+	{
+		clear_results(src);
+	}
+
+	if (!args->keepConnections || pipeline.failedOnSrc || pipeline.failedOnDst)
+	{
+		pgsql_finish(src);
+	}
+
+	*failedOnSrc = pipeline.failedOnSrc;
+	*failedOnDst = pipeline.failedOnDst;
+
+	pthread_cond_destroy(&(pipeline.notFull));
+	pthread_cond_destroy(&(pipeline.notEmpty));
+	pthread_mutex_destroy(&(pipeline.lock));
+
+	pg_copy_pipeline_free(&pipeline);
+
+	return true;
+}
+
+
+/*
+ * pg_copy_pipeline_reader is the reader thread of the COPY pipeline. It
+ * fetches COPY rows from the source connection and appends them to the
+ * current slot of the ring of buffers, and publishes the slot for the writer
+ * when the next row doesn't fit in.
+ */
+static void *
+pg_copy_pipeline_reader(void *arg)
+{
+	CopyPipeline *pipeline = (CopyPipeline *) arg;
+	PGconn *srcConn = pipeline->src->connection;
+	CopyStats *stats = pipeline->stats;
+
+	CopyBuffer *slot = pg_copy_pipeline_acquire(pipeline);
+	char *copybuf;
+
+	while (slot != NULL)
+	{
+		instr_time start;
+
+		INSTR_TIME_SET_CURRENT(start);
+
+		int bufsize = PQgetCopyData(srcConn, &copybuf, 0);
+
+		stats->srcWaitUs += pg_copy_elapsed_us(start);
+
+		/*
+		 * A result of -2 indicates that an error occurred.
+		 */
+		if (bufsize == -2)
+		{
+			pgcopy_log_error(pipeline->src, NULL,
+							 "Failed to fetch data from source");
+			pg_copy_pipeline_set_failed_on_src(pipeline);
+			return NULL;
+		}
+
+		/*
+		 * PQgetCopyData returns -1 to indicate that the COPY is done. Call
+		 * PQgetResult to obtain the final result status of the COPY command.
+		 */
+		else if (bufsize == -1)
+		{
+			PGresult *res = PQgetResult(srcConn);
+
+			if (PQresultStatus(res) != PGRES_COMMAND_OK)
+			{
+				pgcopy_log_error(pipeline->src, res,
+								 "Failed to fetch data from source");
+				pg_copy_pipeline_set_failed_on_src(pipeline);
+				return NULL;
+			}
+
+			PQclear(res);
+			break;
+		}
+
+		++stats->rows;
+		stats->bytes += bufsize;
+
+		/* publish the current slot when the new row doesn't fit in */
+		if (slot->len > 0 && slot->len + bufsize > pipeline->bufferSize)
+		{
+			pg_copy_pipeline_publish(pipeline);
+			slot = pg_copy_pipeline_acquire(pipeline);
+
+			if (slot == NULL)
+			{
+				/* the writer failed */
+				PQfreemem(copybuf);
+				break;
+			}
+		}
+
+		/* rows that are larger than our buffers make the slot grow */
+		if (slot->len + bufsize > slot->size)
+		{
+			CopyArgs *args = pipeline->args;
+			uint64_t growth = bufsize - slot->size;
+
+			/* with a memory budget, wait until the growth fits in */
+			if (args->reserveMemory != NULL &&
+				!(*args->reserveMemory)(args->memoryContext, growth))
+			{
+				log_error("Failed to reserve %lld bytes of COPY memory",
+						  (long long) growth);
+				PQfreemem(copybuf);
+				pg_copy_pipeline_set_failed_on_src(pipeline);
+				return NULL;
+			}
+
+			char *data = (char *) realloc(slot->data, bufsize * sizeof(char));
+
+			if (data == NULL)
+			{
+				log_error(ALLOCATION_FAILED_ERROR);
+				PQfreemem(copybuf);
+				pg_copy_pipeline_set_failed_on_src(pipeline);
+				return NULL;
+			}
+
+			slot->data = data;
+			slot->size = bufsize;
+		}
+
+		memcpy(slot->data + slot->len, copybuf, bufsize);
+		slot->len += bufsize;
+
+		PQfreemem(copybuf);
+	}
+
+	/* publish the last slot, and then signal that the reader is done */
+	pthread_mutex_lock(&(pipeline->lock));
+
+	if (slot != NULL && slot->len > 0)
+	{
+		pipeline->head = (pipeline->head + 1) % pipeline->depth;
+		++pipeline->count;
+	}
+
+	pipeline->readerDone = true;
+
+	pthread_cond_signal(&(pipeline->notEmpty));
+	pthread_mutex_unlock(&(pipeline->lock));
+
+	return NULL;
+}
+
+
+/*
+ * pg_copy_pipeline_acquire waits until a slot is free in the ring of buffers
+ * and returns it, or returns NULL when the writer failed.
+ */
+static CopyBuffer *
+pg_copy_pipeline_acquire(CopyPipeline *pipeline)
+{
+	CopyBuffer *slot = NULL;
+
+	pthread_mutex_lock(&(pipeline->lock));
+
+	while (pipeline->count == pipeline->depth && !pipeline->failedOnDst)
+	{
+		pthread_cond_wait(&(pipeline->notFull), &(pipeline->lock));
+	}
+
+	if (!pipeline->failedOnDst)
+	{
+		slot = &(pipeline->ring[pipeline->head]);
+		slot->len = 0;
+	}
+
+	pthread_mutex_unlock(&(pipeline->lock));
+
+	return slot;
+}
+
+
+/*
+ * pg_copy_pipeline_publish hands over the current slot to the writer.
+ */
+static void
+pg_copy_pipeline_publish(CopyPipeline *pipeline)
+{
+	pthread_mutex_lock(&(pipeline->lock));
+
+	pipeline->head = (pipeline->head + 1) % pipeline->depth;
+	++pipeline->count;
+
+	pthread_cond_signal(&(pipeline->notEmpty));
+	pthread_mutex_unlock(&(pipeline->lock));
+}
+
+
+/*
+ * pg_copy_pipeline_set_failed_on_src signals the writer that the reader
+ * failed.
+ */
+static void
+pg_copy_pipeline_set_failed_on_src(CopyPipeline *pipeline)
+{
+	pthread_mutex_lock(&(pipeline->lock));
+
+	pipeline->failedOnSrc = true;
+
+	pthread_cond_signal(&(pipeline->notEmpty));
+	pthread_mutex_unlock(&(pipeline->lock));
+}
+
+
+/*
+ * pg_copy_pipeline_free frees the memory allocated for the ring of buffers.
+ */
+static void
+pg_copy_pipeline_free(CopyPipeline *pipeline)
+{
+	for (int i = 0; i < pipeline->depth; i++)
+	{
+		free(pipeline->ring[i].data);
+	}
+
+	free(pipeline->ring);
+}
+
+
+/*
+ * pg_copy_buffer_append adds a COPY row to the given buffer, flushing the
+ * buffer contents to the target connection first when the new row does not
+ * fit. Rows that are larger than the buffer itself are sent directly.
+ */
+static bool
+pg_copy_buffer_append(PGSQL *dst,
+					  CopyArgs *args,
+					  CopyBuffer *buffer,
+					  const char *data,
+					  int len,
+					  CopyStats *stats)
+{
+	++stats->rows;
+	stats->bytes += len;
+
+	if (buffer->len + len > buffer->size)
+	{
+		if (!pg_copy_buffer_flush(dst, args, buffer, stats))
+		{
+			return false;
+		}
+
+		/* don't bother copying the data around when it's too large anyway */
+		if (len > buffer->size)
+		{
+			++stats->flushes;
+			pg_copy_publish_progress(args, stats, false);
+			return pg_copy_put_data(dst, args, data, len, stats);
+		}
+	}
+
+	memcpy(buffer->data + buffer->len, data, len);
+	buffer->len += len;
+
+	return true;
+}
+
+
+/*
+ * pg_copy_buffer_flush sends the buffer contents to the target connection,
+ * and empties the buffer.
+ */
+static bool
+pg_copy_buffer_flush(PGSQL *dst,
+					 CopyArgs *args,
+					 CopyBuffer *buffer,
+					 CopyStats *stats)
+{
+	if (buffer->len == 0)
+	{
+		return true;
+	}
+
+	++stats->flushes;
+	pg_copy_publish_progress(args, stats, false);
+
+	bool success = pg_copy_put_data(dst, args, buffer->data, buffer->len, stats);
+
+	buffer->len = 0;
+
+	return success;
+}
+
+
+/*
+ * pg_copy_publish_progress copies the COPY statistics to the progress area
+ * of the caller every PROGRESS_UPDATE_FLUSHES buffers, or now when force is
+ * true. The reader of the progress area might see a torn update, which is
+ * fine for progress reporting.
+ */
+static void
+pg_copy_publish_progress(CopyArgs *args, CopyStats *stats, bool force)
+{
+	if (args->progress == NULL)
+	{
+		return;
+	}
+
+	if (force || stats->flushes % PROGRESS_UPDATE_FLUSHES == 0)
+	{
+		*(args->progress) = *stats;
+	}
+}
+
+
+/*
+ * pg_copy_elapsed_us returns how many microseconds have elapsed since start.
+ */
+static uint64_t
+pg_copy_elapsed_us(instr_time start)
+{
+	instr_time duration;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	return INSTR_TIME_GET_MICROSEC(duration);
+}
+
+
+/*
+ * pg_copy_put_data sends the given COPY data to the target connection, and
+ * then to each of the fanout target connections.
+ */
+static bool
+pg_copy_put_data(PGSQL *dst, CopyArgs *args, const char *data, int len,
+				 CopyStats *stats)
+{
+	instr_time start;
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	if ((uint64_t) len > stats->peakBufferSize)
+	{
+		stats->peakBufferSize = len;
+	}
+
+	if (PQputCopyData(dst->connection, data, len) != 1)
+	{
+		return false;
+	}
+
+	for (int i = 0; i < args->fanoutCount; i++)
+	{
+		PGSQL *fanout = &(args->fanout[i]);
+
+		if (PQputCopyData(fanout->connection, data, len) != 1)
+		{
+			pgcopy_log_error(fanout, NULL, "Failed to copy data to target");
+			return false;
+		}
+	}
+
+	/* the throttle sleeps are not time blocked on the target */
+	stats->dstWaitUs += pg_copy_elapsed_us(start);
+
+	if (args->throttle != NULL)
+	{
+		(*args->throttle)(args->throttleContext, len);
+	}
+
+	return true;
+}
+
+
+/*
+ * pg_copy_query prepares the SQL query that opens a COPY protocol from or to a
+ * Postgres instance. The source may be a query that lists all the columns of
+ * a wide table, so the query is not limited in size: the caller destroys the
+ * returned buffer.
+ */
+static PQExpBuffer
+pg_copy_query(CopyArgs *args, ExecStatusType status)
+{
+	PQExpBuffer sql = createPQExpBuffer();
+
+	/* the text format is the default, keep the COPY command simple then */
+	char *options =
+		args->format == COPY_FORMAT_BINARY ? " with (format binary)" : "";
+
+	if (status == PGRES_COPY_OUT)
+	{
+		appendPQExpBuffer(sql, "copy %s to stdout%s", args->srcQname, options);
+	}
+	else if (args->freeze)
+	{
+		appendPQExpBuffer(sql, "copy %s from stdin%s",
+						  args->dstQname,
+						  args->format == COPY_FORMAT_BINARY
+						  ? " with (format binary, freeze)"
+						  : " with (freeze)");
+	}
+	else
+	{
+		appendPQExpBuffer(sql, "copy %s from stdin%s", args->dstQname, options);
+	}
+
+	return sql;
+}
+
+
+/*
+ * pg_copy_send_query sends the SQL query that opens a COPY protocol from or to
+ * a Postgres instance, and checks that the server's result is as expected.
+ */
+static bool
+pg_copy_send_query(PGSQL *pgsql, CopyArgs *args, ExecStatusType status)
+{
+	if (status != PGRES_COPY_OUT && status != PGRES_COPY_IN)
+	{
+		log_error("BUG: pg_copy_send_query: unknown ExecStatusType %d", status);
+		return false;
+	}
+
+	PQExpBuffer sql = pg_copy_query(args, status);
+
+	if (PQExpBufferBroken(sql))
+	{
+		log_error("Failed to prepare the COPY query: out of memory");
+		destroyPQExpBuffer(sql);
+		return false;
+	}
+
+	PGresult *res = PQexec(pgsql->connection, sql->data);
+
+	if (PQresultStatus(res) != status)
+	{
+		pgcopy_log_error(pgsql, res, sql->data);
+		destroyPQExpBuffer(sql);
+
+		return false;
+	}
+
+	destroyPQExpBuffer(sql);
+
+	return true;
+}
+
+
+/*
+ * pg_copy_stream_start starts a COPY operation from the source connection to
+ * the target connection of the given stream, without waiting for the servers
+ * to answer. Both connections are expected to be open already, and are
+ * switched to non-blocking mode.
+ *
+ * The caller then polls the sockets of both connections for the events
+ * registered in stream->srcEvents and stream->dstEvents, and calls
+ * pg_copy_stream_step() each time, until the stream state is either
+ * COPY_STREAM_DONE or COPY_STREAM_FAILED.
+ */
+bool
+pg_copy_stream_start(CopyStream *stream)
+{
+	PGconn *srcConn = stream->src->connection;
+	PGconn *dstConn = stream->dst->connection;
+
+	stream->state = COPY_STREAM_STARTING;
+	stream->srcStarted = false;
+	stream->dstStarted = false;
+	stream->srcCopyDone = false;
+	stream->srcDone = false;
+	stream->endSent = false;
+	stream->dstGotResult = false;
+	stream->srcGotResult = false;
+	stream->pendingRow = NULL;
+	stream->pendingLen = 0;
+	stream->buffer.len = 0;
+
+	if (srcConn == NULL || dstConn == NULL)
+	{
+		log_error("BUG: pg_copy_stream_start called without connections");
+		stream->state = COPY_STREAM_FAILED;
+		return false;
+	}
+
+	if (PQsetnonblocking(srcConn, 1) != 0 || PQsetnonblocking(dstConn, 1) != 0)
+	{
+		log_error("Failed to set connections to non-blocking mode");
+		stream->state = COPY_STREAM_FAILED;
+		return false;
+	}
+
+	PQExpBuffer srcSql = pg_copy_query(&(stream->args), PGRES_COPY_OUT);
+	PQExpBuffer dstSql = pg_copy_query(&(stream->args), PGRES_COPY_IN);
+
+	if (PQExpBufferBroken(srcSql) || PQExpBufferBroken(dstSql))
+	{
+		log_error("Failed to prepare the COPY queries: out of memory");
+		destroyPQExpBuffer(srcSql);
+		destroyPQExpBuffer(dstSql);
+		stream->state = COPY_STREAM_FAILED;
+		return false;
+	}
+
+	bool sent = PQsendQuery(srcConn, srcSql->data) == 1;
+
+	if (!sent)
+	{
+		(void) pg_copy_stream_failed(stream, stream->src, NULL, srcSql->data);
+	}
+	else
+	{
+		sent = PQsendQuery(dstConn, dstSql->data) == 1;
+
+		if (!sent)
+		{
+			(void) pg_copy_stream_failed(stream, stream->dst, NULL, dstSql->data);
+		}
+	}
+
+	destroyPQExpBuffer(srcSql);
+	destroyPQExpBuffer(dstSql);
+
+	if (!sent)
+	{
+		return false;
+	}
+
+	return pg_copy_stream_step(stream);
+}
+
+
+/*
+ * pg_copy_stream_step makes as much progress as possible on the given stream
+ * without blocking, and registers the socket events that the stream waits for
+ * in stream->srcEvents and stream->dstEvents.
+ *
+ * Returns false when the stream has failed, in which case the caller is
+ * expected to close both connections.
+ */
+bool
+pg_copy_stream_step(CopyStream *stream)
+{
+	PGconn *srcConn = stream->src->connection;
+	PGconn *dstConn = stream->dst->connection;
+
+	stream->srcEvents = 0;
+	stream->dstEvents = 0;
+
+	if (stream->state == COPY_STREAM_DONE)
+	{
+		return true;
+	}
+
+	if (stream->state != COPY_STREAM_STARTING &&
+		stream->state != COPY_STREAM_COPYING &&
+		stream->state != COPY_STREAM_ENDING)
+	{
+		return false;
+	}
+
+	/* send any data that libpq has buffered already */
+	if (pg_copy_stream_flush(stream, stream->src) < 0 ||
+		pg_copy_stream_flush(stream, stream->dst) < 0)
+	{
+		return false;
+	}
+
+	if (!PQconsumeInput(srcConn))
+	{
+		return pg_copy_stream_failed(stream, stream->src, NULL,
+									 "Failed to get data from source");
+	}
+
+	if (!PQconsumeInput(dstConn))
+	{
+		return pg_copy_stream_failed(stream, stream->dst, NULL,
+									 "Failed to copy data to target");
+	}
+
+	if (stream->state == COPY_STREAM_STARTING)
+	{
+		if (!stream->srcStarted)
+		{
+			if (PQisBusy(srcConn))
+			{
+				stream->srcEvents |= POLLIN;
+			}
+			else
 			{
-				pgcopy_log_error(dst, res, "Failed to copy data to target");
+				PGresult *res = PQgetResult(srcConn);
+
+				if (PQresultStatus(res) != PGRES_COPY_OUT)
+				{
+					return pg_copy_stream_failed(stream, stream->src, res,
+												 "Failed to COPY from source");
+				}
+
+				PQclear(res);
+				stream->srcStarted = true;
 			}
 		}
 
-		clear_results(dst);
-		pgsql_finish(dst);
+		if (!stream->dstStarted)
+		{
+			if (PQisBusy(dstConn))
+			{
+				stream->dstEvents |= POLLIN;
+			}
+			else
+			{
+				PGresult *res = PQgetResult(dstConn);
+
+				if (PQresultStatus(res) != PGRES_COPY_IN)
+				{
+					return pg_copy_stream_failed(stream, stream->dst, res,
+												 "Failed to COPY to target");
+				}
+
+				PQclear(res);
+				stream->dstStarted = true;
+			}
+		}
+
+		if (!stream->srcStarted || !stream->dstStarted)
+		{
+			return true;
+		}
+
+		stream->state = COPY_STREAM_COPYING;
 	}
 
-	return !failedOnSrc && !failedOnDst;
+	if (stream->state == COPY_STREAM_COPYING)
+	{
+		if (!pg_copy_stream_copy_rows(stream))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (stream->state == COPY_STREAM_COPYING)
+		{
+			return true;
+		}
+	}
+
+	/* COPY_STREAM_ENDING: send end-of-data and wait for the COPY result */
+	if (!stream->endSent)
+	{
+		int ret = PQputCopyEnd(dstConn, NULL);
+
+		if (ret == -1)
+		{
+			return pg_copy_stream_failed(stream, stream->dst, NULL,
+										 "Failed to copy data to target");
+		}
+		else if (ret == 0)
+		{
+			stream->dstEvents |= POLLOUT;
+			return true;
+		}
+
+		stream->endSent = true;
+	}
+
+	int flushed = pg_copy_stream_flush(stream, stream->dst);
+
+	if (flushed < 0)
+	{
+		return false;
+	}
+	else if (flushed == 0)
+	{
+		return true;
+	}
+
+	int done = pg_copy_stream_command_result(stream, stream->dst);
+
+	if (done < 0)
+	{
+		return false;
+	}
+	else if (done == 1)
+	{
+		stream->state = COPY_STREAM_DONE;
+	}
+
+	return true;
 }
 
 
 /*
- * pg_copy_send_query prepares the SQL query that opens a COPY protocol from or
- * to a Postgres instance, and checks that the server's result is as expected.
+ * pg_copy_stream_copy_rows fetches COPY rows from the source connection and
+ * appends them to the stream buffer, which is sent to the target connection
+ * when full, until either connection would block.
+ *
+ * When the source has sent all its rows, and those have all been queued on
+ * the target connection, the stream state is set to COPY_STREAM_ENDING.
  */
 static bool
-pg_copy_send_query(PGSQL *pgsql, const char *qname, ExecStatusType status)
+pg_copy_stream_copy_rows(CopyStream *stream)
 {
-	char sql[BUFSIZE] = { 0 };
+	PGconn *srcConn = stream->src->connection;
+	PGconn *dstConn = stream->dst->connection;
 
-	if (status == PGRES_COPY_OUT)
+	CopyBuffer *buffer = &(stream->buffer);
+	CopyStats *stats = &(stream->stats);
+
+	for (;;)
+	{
+		/* libpq has data pending already: wait until the target reads it */
+		if (stream->dstEvents & POLLOUT)
+		{
+			return true;
+		}
+
+		/* first, append the row we fetched last time, if any */
+		if (stream->pendingRow != NULL)
+		{
+			int len = stream->pendingLen;
+
+			if (buffer->len > 0 && buffer->len + len > buffer->size)
+			{
+				int ret = PQputCopyData(dstConn, buffer->data, buffer->len);
+
+				if (ret == -1)
+				{
+					return pg_copy_stream_failed(stream, stream->dst, NULL,
+												 "Failed to copy data to target");
+				}
+				else if (ret == 0)
+				{
+					stream->dstEvents |= POLLOUT;
+					return true;
+				}
+
+				if (stream->args.throttle != NULL)
+				{
+					(*stream->args.throttle)(stream->args.throttleContext,
+											 buffer->len);
+				}
+
+				++stats->flushes;
+				pg_copy_publish_progress(&(stream->args), stats, false);
+				buffer->len = 0;
+			}
+
+			/* don't bother copying the data around when it's too large */
+			if (len > buffer->size)
+			{
+				int ret = PQputCopyData(dstConn, stream->pendingRow, len);
+
+				if (ret == -1)
+				{
+					return pg_copy_stream_failed(stream, stream->dst, NULL,
+												 "Failed to copy data to target");
+				}
+				else if (ret == 0)
+				{
+					stream->dstEvents |= POLLOUT;
+					return true;
+				}
+
+				if (stream->args.throttle != NULL)
+				{
+					(*stream->args.throttle)(stream->args.throttleContext, len);
+				}
+
+				++stats->flushes;
+				pg_copy_publish_progress(&(stream->args), stats, false);
+			}
+			else
+			{
+				memcpy(buffer->data + buffer->len, stream->pendingRow, len);
+				buffer->len += len;
+			}
+
+			PQfreemem(stream->pendingRow);
+			stream->pendingRow = NULL;
+			stream->pendingLen = 0;
+
+			if (pg_copy_stream_flush(stream, stream->dst) < 0)
+			{
+				return false;
+			}
+
+			continue;
+		}
+
+		if (stream->srcCopyDone)
+		{
+			break;
+		}
+
+		char *copybuf = NULL;
+		int bufsize = PQgetCopyData(srcConn, &copybuf, 1);
+
+		if (bufsize > 0)
+		{
+			++stats->rows;
+			stats->bytes += bufsize;
+
+			stream->pendingRow = copybuf;
+			stream->pendingLen = bufsize;
+		}
+		else if (bufsize == 0)
+		{
+			/* no complete row available yet */
+			stream->srcEvents |= POLLIN;
+			return true;
+		}
+		else if (bufsize == -1)
+		{
+			stream->srcCopyDone = true;
+		}
+		else
+		{
+			return pg_copy_stream_failed(stream, stream->src, NULL,
+										 "Failed to get data from source");
+		}
+	}
+
+	/* the source COPY is done, fetch its result */
+	if (!stream->srcDone)
+	{
+		int done = pg_copy_stream_command_result(stream, stream->src);
+
+		if (done < 0)
+		{
+			return false;
+		}
+		else if (done == 0)
+		{
+			return true;
+		}
+
+		stream->srcDone = true;
+	}
+
+	/* send what remains in our buffer */
+	if (buffer->len > 0)
+	{
+		int ret = PQputCopyData(dstConn, buffer->data, buffer->len);
+
+		if (ret == -1)
+		{
+			return pg_copy_stream_failed(stream, stream->dst, NULL,
+										 "Failed to copy data to target");
+		}
+		else if (ret == 0)
+		{
+			stream->dstEvents |= POLLOUT;
+			return true;
+		}
+
+		if (stream->args.throttle != NULL)
+		{
+			(*stream->args.throttle)(stream->args.throttleContext, buffer->len);
+		}
+
+		++stats->flushes;
+		pg_copy_publish_progress(&(stream->args), stats, false);
+		buffer->len = 0;
+	}
+
+	stream->state = COPY_STREAM_ENDING;
+
+	return true;
+}
+
+
+/*
+ * pg_copy_stream_flush tries to send the data that libpq has buffered on the
+ * given connection. When some data remains to be sent, it registers interest
+ * in the socket being writable again.
+ *
+ * Returns -1 on error, 0 when data remains to be sent, 1 otherwise.
+ */
+static int
+pg_copy_stream_flush(CopyStream *stream, PGSQL *pgsql)
+{
+	int ret = PQflush(pgsql->connection);
+
+	if (ret == -1)
+	{
+		(void) pg_copy_stream_failed(stream, pgsql, NULL,
+									 "Failed to send data");
+		return -1;
+	}
+	else if (ret == 1)
+	{
+		if (pgsql == stream->src)
+		{
+			stream->srcEvents |= POLLOUT;
+		}
+		else
+		{
+			stream->dstEvents |= POLLOUT;
+		}
+
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/*
+ * pg_copy_stream_command_result fetches the results of a COPY command once
+ * its data has been sent or received, without blocking.
+ *
+ * Returns -1 on error, 0 when we need to wait for more input, and 1 once the
+ * command result has been received and the connection is ready for the next
+ * query.
+ */
+static int
+pg_copy_stream_command_result(CopyStream *stream, PGSQL *pgsql)
+{
+	PGconn *conn = pgsql->connection;
+	bool *gotResult =
+		pgsql == stream->src ? &(stream->srcGotResult) : &(stream->dstGotResult);
+
+	while (!PQisBusy(conn))
 	{
-		sformat(sql, sizeof(sql), "copy %s to stdout", qname);
+		PGresult *res = PQgetResult(conn);
+
+		if (res == NULL)
+		{
+			if (!*gotResult)
+			{
+				(void) pg_copy_stream_failed(stream, pgsql, NULL,
+											 "Failed to get COPY result");
+				return -1;
+			}
+
+			return 1;
+		}
+
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		{
+			(void) pg_copy_stream_failed(stream, pgsql, res, "COPY failed");
+			return -1;
+		}
+
+		PQclear(res);
+		*gotResult = true;
 	}
-	else if (status == PGRES_COPY_IN)
+
+	if (pgsql == stream->src)
 	{
-		sformat(sql, sizeof(sql), "copy %s from stdin", qname);
+		stream->srcEvents |= POLLIN;
 	}
 	else
 	{
-		log_error("BUG: pg_copy_send_query: unknown ExecStatusType %d", status);
-		return false;
+		stream->dstEvents |= POLLIN;
+	}
+
+	return 0;
+}
+
+
+/*
+ * pg_copy_stream_failed logs the error message from the given connection and
+ * marks the stream as failed. Unlike pgcopy_log_error() we don't consume the
+ * remaining results here, as that would block: the caller closes the
+ * connections instead.
+ */
+static bool
+pg_copy_stream_failed(CopyStream *stream, PGSQL *pgsql,
+					  PGresult *res, const char *context)
+{
+	char *message = PQerrorMessage(pgsql->connection);
+	char *errorLines[BUFSIZE] = { 0 };
+	int lineCount = splitLines(message, errorLines, BUFSIZE);
+
+	for (int lineNumber = 0; lineNumber < lineCount; lineNumber++)
+	{
+		log_error("%s", errorLines[lineNumber]);
 	}
 
-	PGresult *res = PQexec(pgsql->connection, sql);
+	log_error("Context: %s", context);
 
-	if (PQresultStatus(res) != status)
+	if (res != NULL)
 	{
-		pgcopy_log_error(pgsql, res, sql);
+		PQclear(res);
+	}
 
-		return false;
+	if (stream->pendingRow != NULL)
+	{
+		PQfreemem(stream->pendingRow);
+		stream->pendingRow = NULL;
+		stream->pendingLen = 0;
 	}
 
-	return true;
+	stream->state = COPY_STREAM_FAILED;
+
+	return false;
 }
 
 
@@ -1518,6 +3708,87 @@ typedef struct SourceSequenceContext
 } SourceSequenceContext;
 
 
+/*
+ * pgsql_copy_large_object copies the contents of the large object with the
+ * given OID from the source connection to the target connection, using the
+ * libpq large object functions, reading and writing chunks of at most
+ * bufferSize bytes. The target large object must exist already, and is
+ * truncated first, so that copying it again is fine.
+ *
+ * Both connections are expected to be in a transaction, which is aborted
+ * when this function fails.
+ */
+bool
+pgsql_copy_large_object(PGSQL *src, PGSQL *dst, uint32_t oid,
+						char *buffer, int bufferSize,
+						uint64_t *bytes)
+{
+	PGconn *srcConn = src->connection;
+	PGconn *dstConn = dst->connection;
+
+	bool success = true;
+
+	int srcfd = lo_open(srcConn, (Oid) oid, INV_READ);
+
+	if (srcfd < 0)
+	{
+		log_error("Failed to open large object %u on the source: %s",
+				  oid, PQerrorMessage(srcConn));
+		return false;
+	}
+
+	int dstfd = lo_open(dstConn, (Oid) oid, INV_WRITE);
+
+	if (dstfd < 0)
+	{
+		log_error("Failed to open large object %u on the target: %s",
+				  oid, PQerrorMessage(dstConn));
+		(void) lo_close(srcConn, srcfd);
+		return false;
+	}
+
+	if (lo_truncate(dstConn, dstfd, 0) < 0)
+	{
+		log_error("Failed to truncate large object %u on the target: %s",
+				  oid, PQerrorMessage(dstConn));
+		success = false;
+	}
+
+	while (success)
+	{
+		int len = lo_read(srcConn, srcfd, buffer, bufferSize);
+
+		if (len < 0)
+		{
+			log_error("Failed to read large object %u on the source: %s",
+					  oid, PQerrorMessage(srcConn));
+			success = false;
+			break;
+		}
+
+		if (len == 0)
+		{
+			break;
+		}
+
+		if (lo_write(dstConn, dstfd, buffer, len) != len)
+		{
+			log_error("Failed to write large object %u on the target: %s",
+					  oid, PQerrorMessage(dstConn));
+			success = false;
+			break;
+		}
+
+		*bytes += len;
+	}
+
+	(void) lo_close(srcConn, srcfd);
+	(void) lo_close(dstConn, dstfd);
+
+	return success;
+}
+
+
 /*
  * pgsql_get_sequence queries the Postgres catalog object for the sequence to
  * get the last_value and is_called columns.
@@ -8,6 +8,7 @@
 
 
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 
 #include "postgres.h"
@@ -29,13 +30,26 @@
 #define INT4OID 23
 #define INT8OID 20
 #define TEXTOID 25
+#define OIDOID 26
 #define LSNOID 3220
 
+/*
+ * A pg_lsn value is printed as two 32 bits hexadecimal numbers separated by a
+ * slash, which fits in 17 chars plus the terminating NUL byte.
+ */
+#define PG_LSN_MAXLENGTH 18
+
 /*
  * Maximum connection info length as used in walreceiver.h
  */
 #define MAXCONNINFO 1024
 
+/*
+ * The application_name of our connections, unless the connection string sets
+ * another one, so that the source server load sampling can skip them.
+ */
+#define PGCOPYDB_APPLICATION_NAME "pgcopydb"
+
 
 /*
  * pg_stat_replication.sync_state is one if:
@@ -119,6 +133,17 @@ typedef enum
 	PG_CONNECTION_BAD
 } PGConnStatus;
 
+/*
+ * Transaction isolation levels, as in the SET TRANSACTION command.
+ */
+typedef enum
+{
+	ISOLATION_SERIALIZABLE = 0,
+	ISOLATION_REPEATABLE_READ,
+	ISOLATION_READ_COMMITTED,
+	ISOLATION_READ_UNCOMMITTED,
+} IsolationLevel;
+
 /* notification processing */
 typedef bool (*ProcessNotificationFunction)(int notificationGroupId,
 											int64_t notificationNodeId,
@@ -129,6 +154,8 @@ typedef struct PGSQL
 	ConnectionType connectionType;
 	ConnectionStatementType connectionStatementType;
 	char connectionString[MAXCONNINFO];
+	char sessionOptions[BUFSIZE];   /* libpq options, "-c name=value ..." */
+	bool replication;           /* replication=database connection */
 	PGconn *connection;
 	ConnectionRetryPolicy retryPolicy;
 	PGConnStatus status;
@@ -198,16 +225,30 @@ int pgsql_compute_connection_retry_sleep_time(ConnectionRetryPolicy *retryPolicy
 bool pgsql_retry_policy_expired(ConnectionRetryPolicy *retryPolicy);
 
 void pgsql_finish(PGSQL *pgsql);
+bool pgsql_open_persistent_connection(PGSQL *pgsql);
 void parseSingleValueResult(void *ctx, PGresult *result);
 void fetchedRows(void *ctx, PGresult *result);
 
 bool pgsql_begin(PGSQL *pgsql);
 bool pgsql_commit(PGSQL *pgsql);
 bool pgsql_rollback(PGSQL *pgsql);
+bool pgsql_set_transaction(PGSQL *pgsql,
+						   IsolationLevel level,
+						   bool readOnly,
+						   bool deferrable);
+bool pgsql_export_snapshot(PGSQL *pgsql, char *snapshot, size_t size);
+bool pgsql_set_snapshot(PGSQL *pgsql, const char *snapshot);
+bool pgsql_create_logical_replication_slot(PGSQL *pgsql,
+										   const char *slotName,
+										   const char *plugin,
+										   char *lsn, size_t lsnSize,
+										   char *snapshot, size_t snapshotSize);
+bool pgsql_drop_replication_slot(PGSQL *pgsql, const char *slotName);
 bool pgsql_execute(PGSQL *pgsql, const char *sql);
 bool pgsql_execute_with_params(PGSQL *pgsql, const char *sql, int paramCount,
 							   const Oid *paramTypes, const char **paramValues,
 							   void *parseContext, ParsePostgresResultCB *parseFun);
+bool pgsql_execute_batch(PGSQL *pgsql, const char **commands, int count);
 
 void pgAutoCtlDebugNoticeProcessor(void *arg, const char *message);
 
@@ -215,8 +256,172 @@ bool hostname_from_uri(const char *pguri,
 					   char *hostname, int maxHostLength, int *port);
 bool validate_connection_string(const char *connectionString);
 
-bool pg_copy(PGSQL *src, PGSQL *dst,
-			 const char *srcQname, const char *dstQname);
+/*
+ * COPY supports the text, csv, and binary formats. The binary format is
+ * faster, but it is less portable across Postgres major versions and data
+ * types, see the COPY documentation.
+ */
+typedef enum
+{
+	COPY_FORMAT_TEXT = 0,
+	COPY_FORMAT_BINARY
+} CopyFormat;
+
+/* called with the size of the data sent by each PQputCopyData() */
+typedef void (*CopyThrottleCB)(void *context, int len);
+
+/*
+ * In pipelined mode, called before a slot of the ring of buffers grows to
+ * hold a row that is larger than the buffer size, and once the slot has been
+ * sent and shrunk again. The reserve callback may wait, and returns false to
+ * cancel the COPY.
+ */
+typedef bool (*CopyReserveMemoryCB)(void *context, uint64_t bytes);
+typedef void (*CopyReleaseMemoryCB)(void *context, uint64_t bytes);
+
+/* the pg_copy arguments */
+typedef struct CopyArgs
+{
+	const char *srcQname;       /* table name or (query) on the source */
+	const char *dstQname;       /* table name on the target */
+	CopyFormat format;
+	bool freeze;                /* COPY FREEZE, see copydb_begin_copy_freeze */
+	int bufferSize;             /* coalesce COPY rows up to this size */
+	int pipelineDepth;          /* ring of buffers size, 0 for lockstep */
+	bool keepConnections;       /* don't close connections when done */
+	PGSQL *fanout;              /* more targets that get the same data */
+	int fanoutCount;
+	CopyThrottleCB throttle;    /* NULL when not throttling */
+	void *throttleContext;
+	CopyReserveMemoryCB reserveMemory;  /* NULL when there's no budget */
+	CopyReleaseMemoryCB releaseMemory;
+	void *memoryContext;
+	struct CopyStats *progress; /* published copy of the stats, or NULL */
+} CopyArgs;
+
+/*
+ * Rows received from the source database are appended to a buffer, and the
+ * buffer is sent to the target database when full, so that we call
+ * PQputCopyData() on large chunks of data rather than once per row.
+ */
+typedef struct CopyBuffer
+{
+	char *data;                 /* malloc'ed area */
+	int size;
+	int len;
+} CopyBuffer;
+
+/* the pg_copy statistics */
+typedef struct CopyStats
+{
+	uint64_t rows;              /* count of PQgetCopyData() buffers */
+	uint64_t bytes;             /* sum of PQgetCopyData() buffers sizes */
+	uint64_t flushes;           /* count of PQputCopyData() calls */
+	uint64_t srcWaitUs;         /* time blocked in PQgetCopyData() */
+	uint64_t dstWaitUs;         /* time blocked in PQputCopyData() */
+	uint64_t peakBufferSize;    /* largest PQputCopyData() buffer */
+} CopyStats;
+
+/*
+ * In pipelined mode, a reader thread fills-in slots of a ring of buffers with
+ * COPY rows from the source, and the writer sends filled slots to the target.
+ * The reader owns the slot at head, the writer owns the slot at tail, and
+ * count is the number of filled slots.
+ */
+typedef struct CopyPipeline
+{
+	PGSQL *src;
+	CopyArgs *args;
+	CopyStats *stats;           /* rows and bytes by the reader thread */
+
+	CopyBuffer *ring;           /* malloc'ed area */
+	int bufferSize;             /* publish slots when reaching this size */
+	int depth;
+	int head;
+	int tail;
+	int count;
+
+	bool readerDone;
+	bool failedOnSrc;
+	bool failedOnDst;
+
+	pthread_mutex_t lock;
+	pthread_cond_t notEmpty;
+	pthread_cond_t notFull;
+} CopyPipeline;
+
+/*
+ * A COPY stream implements pg_copy() with non-blocking connections, so that
+ * a single process can drive several COPY operations at once, see
+ * pg_copy_stream_start() and pg_copy_stream_step().
+ */
+typedef enum
+{
+	COPY_STREAM_INIT = 0,
+	COPY_STREAM_STARTING,
+	COPY_STREAM_COPYING,
+	COPY_STREAM_ENDING,
+	COPY_STREAM_DONE,
+	COPY_STREAM_FAILED
+} CopyStreamState;
+
+typedef struct CopyStream
+{
+	PGSQL *src;
+	PGSQL *dst;
+	CopyArgs args;
+	CopyStats stats;
+	CopyBuffer buffer;          /* malloc'ed area, owned by the caller */
+
+	CopyStreamState state;
+	bool srcStarted;            /* got PGRES_COPY_OUT */
+	bool dstStarted;            /* got PGRES_COPY_IN */
+	bool srcCopyDone;           /* PQgetCopyData() returned -1 */
+	bool srcGotResult;
+	bool srcDone;               /* source is ready for the next query */
+	bool endSent;               /* PQputCopyEnd() has been queued */
+	bool dstGotResult;
+
+	char *pendingRow;           /* row fetched but not yet buffered */
+	int pendingLen;
+
+	short srcEvents;            /* poll() events we are waiting for */
+	short dstEvents;
+} CopyStream;
+
+bool pg_copy_stream_start(CopyStream *stream);
+bool pg_copy_stream_step(CopyStream *stream);
+
+bool pgsql_server_version_num(PGSQL *pgsql, int *version);
+
+bool copy_format_from_string(const char *str, CopyFormat *format);
+char * CopyFormatToString(CopyFormat format);
+
+bool pg_copy(PGSQL *src, PGSQL *dst, CopyArgs *args, CopyStats *stats);
+
+/*
+ * pg_copy_from_rows calls this function to get the next COPY row to send,
+ * until it returns false.
+ */
+typedef bool (*CopyNextRowCB)(void *context, const char **row, int *len);
+
+/*
+ * pg_copy_to_rows calls this function with each COPY row that it fetches,
+ * and stops when it returns false.
+ */
+typedef bool (*CopyRowCB)(void *context, const char *row, int len);
+
+bool pg_copy_read(PGSQL *src, CopyArgs *args, CopyStats *stats);
+bool pg_copy_to_rows(PGSQL *src, CopyArgs *args,
+					 CopyRowCB row, void *context,
+					 CopyStats *stats);
+bool pg_copy_from_rows(PGSQL *dst, CopyArgs *args,
+					   CopyNextRowCB nextRow, void *context,
+					   CopyStats *stats);
+
+bool pgsql_copy_large_object(PGSQL *src, PGSQL *dst, uint32_t oid,
+							 char *buffer, int bufferSize,
+							 uint64_t *bytes);
 
 bool pgsql_get_sequence(PGSQL *pgsql, const char *nspname, const char *relname,
 						int64_t *lastValue,
@@ -0,0 +1,854 @@
+/*
+ * src/bin/pgcopydb/plan.c
+ *     Simulate the schedule of a copy and recommend the count of jobs
+ *
+ * pgcopydb plan fetches the list of tables and indexes from the source
+ * database, and then runs the table scheduler of pgcopydb copy-db, see
+ * copydb_schedule_table_queue(), with an increasing count of table jobs and
+ * several --split-tables-larger-than thresholds. It recommends the smallest
+ * count of jobs that is within PLAN_GOOD_ENOUGH_PCT of the best makespan,
+ * because more jobs than that only add load on the target.
+ *
+ * Without --bench, COPY is assumed to scale linearly with the count of jobs.
+ * With --bench, pgcopydb bench copy is run first with each count of jobs,
+ * and the measured throughput of one job replaces the ESTIMATE_COPY_*
+ * constants, so that the simulation accounts for a target or a network that
+ * saturates.
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "cli_common.h"
+#include "copydb.h"
+#include "defaults.h"
+#include "log.h"
+#include "parson.h"
+#include "plan.h"
+#include "schema.h"
+#include "string_utils.h"
+
+
+/* the counts of jobs that we simulate, up to --max-jobs */
+static int planJobCounts[] = {
+	1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256
+};
+
+typedef struct PlanTableOid
+{
+	uint32_t oid;
+	int tableIndex;
+} PlanTableOid;
+
+typedef struct PlanContext
+{
+	PlanResult *result;
+	CopyDataSpec *specs;        /* malloc'ed, only the scheduler fields */
+
+	uint64_t *longestIndexMs;   /* per table, malloc'ed area */
+	uint64_t indexWorkMs;       /* all the indexes, one at a time */
+
+	CopyTableJob *jobs;         /* malloc'ed area */
+	int jobsCapacity;
+} PlanContext;
+
+
+static bool plan_fetch_catalogs(PlanSpecs *specs, PlanResult *result);
+static bool plan_estimate_indexes(PlanContext *context);
+static int plan_compare_table_oids(const void *a, const void *b);
+static bool plan_calibrate(PlanSpecs *specs, PlanResult *result, int *jobs);
+static bool plan_simulate(PlanContext *context,
+						  int tableJobs,
+						  int indexJobs,
+						  uint64_t splitTablesLargerThan,
+						  double copyScale,
+						  PlanCandidate *candidate);
+static double plan_copy_scale(PlanResult *result, int candidateIndex);
+static bool plan_is_good_enough(uint64_t makespanMs, uint64_t bestMs);
+static void plan_print_json(PlanSpecs *specs, PlanResult *result);
+static void plan_json_candidate(PlanResult *result,
+								PlanCandidate *candidate,
+								JSON_Object *jsObj);
+
+
+/*
+ * plan_run fetches the source catalogs, optionally runs a short benchmark,
+ * and simulates the schedule of the copy with each candidate count of table
+ * jobs and split threshold, and then with each candidate count of index
+ * jobs.
+ */
+bool
+plan_run(PlanSpecs *specs, PlanResult *result)
+{
+	PlanContext context = { .result = result };
+
+	if (!plan_fetch_catalogs(specs, result))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	int jobs[PLAN_MAX_CANDIDATES] = { 0 };
+	int count = 0;
+
+	for (int i = 0; i < PLAN_MAX_CANDIDATES; i++)
+	{
+		if (planJobCounts[i] <= specs->maxJobs)
+		{
+			jobs[count++] = planJobCounts[i];
+		}
+	}
+
+	/* always simulate --max-jobs itself, there's room left for it */
+	if (jobs[count - 1] != specs->maxJobs)
+	{
+		jobs[count++] = specs->maxJobs;
+	}
+
+	result->candidateCount = count;
+
+	if (specs->bench)
+	{
+		if (!plan_calibrate(specs, result, jobs))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	context.specs = (CopyDataSpec *) calloc(1, sizeof(CopyDataSpec));
+
+	if (context.specs == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	context.specs->section = DATA_SECTION_ALL;
+
+	if (!plan_estimate_indexes(&context))
+	{
+		/* errors have already been logged */
+		free(context.specs);
+		return false;
+	}
+
+	/* the largest table gives the largest split threshold worth trying */
+	uint64_t largestTableBytes = 0;
+
+	for (int i = 0; i < result->tableArray.count; i++)
+	{
+		SourceTable *table = &(result->tableArray.array[i]);
+
+		if (table->bytes > 0 && (uint64_t) table->bytes > largestTableBytes)
+		{
+			largestTableBytes = table->bytes;
+		}
+	}
+
+	bool success = true;
+	PlanCandidate *best = NULL;
+
+	/*
+	 * First, find the best split threshold for each count of table jobs, with
+	 * the same count of index jobs. We start without splitting tables, and
+	 * then only split when that gains more than 1% of the makespan, because
+	 * each part costs a scan of the table on the source.
+	 */
+	for (int i = 0; i < count && success; i++)
+	{
+		PlanCandidate *candidate = &(result->candidates[i]);
+		double scale = plan_copy_scale(result, i);
+
+		if (!plan_simulate(&context, jobs[i], jobs[i], 0, scale, candidate))
+		{
+			success = false;
+			break;
+		}
+
+		for (uint64_t split = PLAN_MIN_SPLIT_SIZE;
+			 split < largestTableBytes;
+			 split *= 2)
+		{
+			PlanCandidate splitCandidate = { 0 };
+
+			if (!plan_simulate(&context, jobs[i], jobs[i], split, scale,
+							   &splitCandidate))
+			{
+				success = false;
+				break;
+			}
+
+			if (splitCandidate.makespanMs * 100 < candidate->makespanMs * 99)
+			{
+				*candidate = splitCandidate;
+			}
+		}
+
+		if (best == NULL || candidate->makespanMs < best->makespanMs)
+		{
+			best = candidate;
+		}
+	}
+
+	/* recommend the smallest count of table jobs that is good enough */
+	int recommendedIndex = 0;
+
+	for (int i = 0; i < count && success; i++)
+	{
+		if (plan_is_good_enough(result->candidates[i].makespanMs,
+								best->makespanMs))
+		{
+			recommendedIndex = i;
+			break;
+		}
+	}
+
+	/*
+	 * Then, with that count of table jobs and that split threshold, find the
+	 * smallest count of index jobs that is good enough.
+	 */
+	PlanCandidate *tableCandidate = &(result->candidates[recommendedIndex]);
+	PlanCandidate *bestIndex = NULL;
+
+	result->indexCandidateCount = count;
+
+	for (int i = 0; i < count && success; i++)
+	{
+		PlanCandidate *candidate = &(result->indexCandidates[i]);
+
+		if (!plan_simulate(&context,
+						   tableCandidate->tableJobs,
+						   jobs[i],
+						   tableCandidate->splitTablesLargerThan,
+						   plan_copy_scale(result, recommendedIndex),
+						   candidate))
+		{
+			success = false;
+			break;
+		}
+
+		if (bestIndex == NULL || candidate->makespanMs < bestIndex->makespanMs)
+		{
+			bestIndex = candidate;
+		}
+	}
+
+	for (int i = 0; i < count && success; i++)
+	{
+		if (plan_is_good_enough(result->indexCandidates[i].makespanMs,
+								bestIndex->makespanMs))
+		{
+			result->recommended = result->indexCandidates[i];
+			break;
+		}
+	}
+
+	free(context.jobs);
+	free(context.longestIndexMs);
+	free(context.specs);
+
+	return success;
+}
+
+
+/*
+ * plan_fetch_catalogs fetches the list of tables and indexes of the source
+ * database, with their sizes.
+ */
+static bool
+plan_fetch_catalogs(PlanSpecs *specs, PlanResult *result)
+{
+	PGSQL pgsql = { 0 };
+
+	log_info("Fetching tables and indexes in \"%s\"", specs->source_pguri);
+
+	if (!pgsql_init(&pgsql, specs->source_pguri, PGSQL_CONN_SOURCE))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!schema_list_ordinary_tables(&pgsql, &(result->tableArray)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!schema_list_all_indexes(&pgsql, &(result->indexArray)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int i = 0; i < result->tableArray.count; i++)
+	{
+		SourceTable *table = &(result->tableArray.array[i]);
+
+		result->tableBytes += table->bytes > 0 ? table->bytes : 0;
+	}
+
+	for (int i = 0; i < result->indexArray.count; i++)
+	{
+		SourceIndex *index = &(result->indexArray.array[i]);
+
+		result->indexBytes += index->indexBytes > 0 ? index->indexBytes : 0;
+	}
+
+	log_info("Fetched information for %d tables and %d indexes",
+			 result->tableArray.count,
+			 result->indexArray.count);
+
+	if (result->tableArray.count == 0)
+	{
+		log_error("Failed to find any table to copy in the source database");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * plan_estimate_indexes computes the duration of the longest CREATE INDEX of
+ * each table: the indexes of a table are built in parallel, so the table is
+ * not done before its largest index is. It also computes the duration of all
+ * the indexes when built one at a time, which divided by the count of index
+ * jobs is a lower bound of the makespan.
+ */
+static bool
+plan_estimate_indexes(PlanContext *context)
+{
+	PlanResult *result = context->result;
+	SourceTableArray *tableArray = &(result->tableArray);
+	SourceIndexArray *indexArray = &(result->indexArray);
+
+	context->longestIndexMs =
+		(uint64_t *) calloc(tableArray->count, sizeof(uint64_t));
+
+	PlanTableOid *oids =
+		(PlanTableOid *) calloc(tableArray->count, sizeof(PlanTableOid));
+
+	if (context->longestIndexMs == NULL || oids == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		free(oids);
+		return false;
+	}
+
+	for (int i = 0; i < tableArray->count; i++)
+	{
+		oids[i].oid = tableArray->array[i].oid;
+		oids[i].tableIndex = i;
+	}
+
+	qsort(oids, tableArray->count, sizeof(PlanTableOid),
+		  plan_compare_table_oids);
+
+	context->indexWorkMs = 0;
+
+	for (int i = 0; i < indexArray->count; i++)
+	{
+		SourceIndex *index = &(indexArray->array[i]);
+		PlanTableOid key = { .oid = index->tableOid };
+
+		PlanTableOid *found =
+			(PlanTableOid *) bsearch(&key, oids,
+									 tableArray->count,
+									 sizeof(PlanTableOid),
+									 plan_compare_table_oids);
+
+		if (found == NULL)
+		{
+			continue;
+		}
+
+		SourceTable *table = &(tableArray->array[found->tableIndex]);
+
+		uint64_t indexBytes = index->indexBytes > 0 ? index->indexBytes : 0;
+		uint64_t reltuples = table->reltuples > 0 ? table->reltuples : 0;
+
+		uint64_t indexMs = indexBytes / ESTIMATE_INDEX_BYTES_PER_MS +
+						   reltuples / ESTIMATE_INDEX_ROWS_PER_MS;
+
+		context->indexWorkMs += indexMs;
+
+		if (indexMs > context->longestIndexMs[found->tableIndex])
+		{
+			context->longestIndexMs[found->tableIndex] = indexMs;
+		}
+	}
+
+	free(oids);
+
+	return true;
+}
+
+
+/*
+ * plan_compare_table_oids sorts tables by oid, for bsearch().
+ */
+static int
+plan_compare_table_oids(const void *a, const void *b)
+{
+	const PlanTableOid *ta = (const PlanTableOid *) a;
+	const PlanTableOid *tb = (const PlanTableOid *) b;
+
+	if (ta->oid != tb->oid)
+	{
+		return ta->oid < tb->oid ? -1 : 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * plan_calibrate runs pgcopydb bench copy with each count of jobs, and
+ * registers the throughput of one job at each step. The generated rows have
+ * the average row size of the source tables.
+ */
+static bool
+plan_calibrate(PlanSpecs *specs, PlanResult *result, int *jobs)
+{
+	BenchSpecs benchSpecs = {
+		.mode = BENCH_MODE_COPY,
+		.stepCount = result->candidateCount,
+		.rows = specs->benchRows,
+		.rowSize = BENCH_DEFAULT_ROW_SIZE,
+		.copyBufferSize = DEFAULT_COPY_BUFFER_SIZE
+	};
+
+	strlcpy(benchSpecs.source_pguri, specs->source_pguri, MAXCONNINFO);
+	strlcpy(benchSpecs.target_pguri, specs->target_pguri, MAXCONNINFO);
+
+	for (int i = 0; i < result->candidateCount; i++)
+	{
+		benchSpecs.jobs[i] = jobs[i];
+	}
+
+	uint64_t reltuples = 0;
+
+	for (int i = 0; i < result->tableArray.count; i++)
+	{
+		SourceTable *table = &(result->tableArray.array[i]);
+
+		reltuples += table->reltuples > 0 ? table->reltuples : 0;
+	}
+
+	if (reltuples > 0)
+	{
+		uint64_t rowSize = result->tableBytes / reltuples;
+
+		benchSpecs.rowSize =
+			rowSize < 1 ? 1
+			: rowSize > BENCH_MAX_ROW_SIZE ? BENCH_MAX_ROW_SIZE
+			: (int) rowSize;
+	}
+
+	log_info("Calibrating the estimates with pgcopydb bench copy, "
+			 "%lld rows of %d bytes per job",
+			 (long long) benchSpecs.rows,
+			 benchSpecs.rowSize);
+
+	BenchResult benchResults[BENCH_MAX_STEPS] = { 0 };
+
+	if (!bench_run(&benchSpecs, benchResults))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int i = 0; i < result->candidateCount; i++)
+	{
+		BenchResult *benchResult = &(benchResults[i]);
+		double ms = (double) benchResult->durationUs / 1000.0;
+
+		if (ms > 0.0 && benchResult->jobs > 0)
+		{
+			result->benchBytesPerMs[i] =
+				(double) benchResult->stats.bytes / ms / benchResult->jobs;
+		}
+
+		log_debug("Bench copy with %d jobs: %.0f bytes/ms per job",
+				  benchResult->jobs,
+				  result->benchBytesPerMs[i]);
+	}
+
+	result->calibrated = true;
+
+	return true;
+}
+
+
+/*
+ * plan_copy_scale returns the factor to apply to the COPY estimates of the
+ * scheduler for the given candidate count of jobs, from the bench results.
+ */
+static double
+plan_copy_scale(PlanResult *result, int candidateIndex)
+{
+	if (!result->calibrated || result->benchBytesPerMs[candidateIndex] <= 0.0)
+	{
+		return 1.0;
+	}
+
+	return (double) ESTIMATE_COPY_BYTES_PER_MS /
+		   result->benchBytesPerMs[candidateIndex];
+}
+
+
+/*
+ * plan_simulate builds the table queue that pgcopydb copy-db would build with
+ * the given options, and simulates its schedule.
+ */
+static bool
+plan_simulate(PlanContext *context,
+			  int tableJobs,
+			  int indexJobs,
+			  uint64_t splitTablesLargerThan,
+			  double copyScale,
+			  PlanCandidate *candidate)
+{
+	PlanResult *result = context->result;
+	SourceTableArray *tableArray = &(result->tableArray);
+	CopyDataSpec *specs = context->specs;
+
+	specs->tableJobs = tableJobs;
+	specs->indexJobs = indexJobs;
+	specs->splitTablesLargerThan = splitTablesLargerThan;
+
+	int count = 0;
+
+	for (int i = 0; i < tableArray->count; i++)
+	{
+		count += copydb_table_part_count(specs, &(tableArray->array[i]));
+	}
+
+	if (count > context->jobsCapacity)
+	{
+		CopyTableJob *jobs =
+			(CopyTableJob *) realloc(context->jobs,
+									 count * sizeof(CopyTableJob));
+
+		if (jobs == NULL)
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			return false;
+		}
+
+		context->jobs = jobs;
+		context->jobsCapacity = count;
+	}
+
+	int jobIndex = 0;
+
+	for (int i = 0; i < tableArray->count; i++)
+	{
+		SourceTable *table = &(tableArray->array[i]);
+		int partCount = copydb_table_part_count(specs, table);
+
+		for (int partNumber = 0; partNumber < partCount; partNumber++)
+		{
+			CopyTableJob *job = &(context->jobs[jobIndex++]);
+
+			(void) copydb_estimate_table_job(specs,
+											 table,
+											 partNumber,
+											 partCount,
+											 job);
+
+			/* the specsIndex of the job is the index in the tableArray */
+			job->specsIndex = i;
+
+			uint64_t tableCopyMs = (job->tableMs - job->finalizeMs) * copyScale;
+
+			job->copyMs = job->copyMs * copyScale;
+
+			/* the table is not done before its longest index is */
+			if (context->longestIndexMs[i] > job->indexMs)
+			{
+				job->indexMs = context->longestIndexMs[i];
+			}
+
+			job->finalizeMs = 0;
+			job->tableMs = tableCopyMs;
+
+			(void) copydb_estimate_table_finalize(specs, job);
+		}
+	}
+
+	qsort(context->jobs, count, sizeof(CopyTableJob),
+		  copydb_compare_table_jobs);
+
+	int criticalJob = 0;
+
+	uint64_t makespanMs =
+		copydb_simulate_schedule(context->jobs, count, tableJobs, &criticalJob);
+
+	/* the index workers can't build more than indexJobs indexes at a time */
+	uint64_t indexBoundMs = context->indexWorkMs / (indexJobs > 0 ? indexJobs : 1);
+
+	CopyTableJob *critical = &(context->jobs[criticalJob]);
+	SourceTable *criticalTable = &(tableArray->array[critical->specsIndex]);
+
+	*candidate = (PlanCandidate) {
+		.tableJobs = tableJobs,
+		.indexJobs = indexJobs,
+		.splitTablesLargerThan = splitTablesLargerThan,
+		.copyJobCount = count,
+		.makespanMs = makespanMs > indexBoundMs ? makespanMs : indexBoundMs,
+		.criticalTable = critical->specsIndex,
+		.criticalPartCount = copydb_table_part_count(specs, criticalTable),
+		.criticalCopyMs = critical->tableMs - critical->finalizeMs,
+		.criticalIndexMs = critical->indexMs,
+		.criticalVacuumMs = critical->vacuumMs
+	};
+
+	return true;
+}
+
+
+/*
+ * plan_is_good_enough returns true when the given makespan is within
+ * PLAN_GOOD_ENOUGH_PCT of the best one.
+ */
+static bool
+plan_is_good_enough(uint64_t makespanMs, uint64_t bestMs)
+{
+	return makespanMs * 100 <= bestMs * (100 + PLAN_GOOD_ENOUGH_PCT);
+}
+
+
+/*
+ * plan_print_results prints the simulated makespan for each count of table
+ * jobs, and then the recommended options and the critical path.
+ */
+void
+plan_print_results(PlanSpecs *specs, PlanResult *result)
+{
+	if (outputJSON)
+	{
+		(void) plan_print_json(specs, result);
+		return;
+	}
+
+	char tableBytes[BUFSIZE] = { 0 };
+	char indexBytes[BUFSIZE] = { 0 };
+
+	(void) pretty_print_bytes(tableBytes, sizeof(tableBytes), result->tableBytes);
+	(void) pretty_print_bytes(indexBytes, sizeof(indexBytes), result->indexBytes);
+
+	fformat(stdout, "\n");
+	fformat(stdout, "Planning the copy of %d tables (%s) and %d indexes (%s)\n",
+			result->tableArray.count,
+			tableBytes,
+			result->indexArray.count,
+			indexBytes);
+
+	if (result->calibrated)
+	{
+		fformat(stdout,
+				"COPY throughput measured with pgcopydb bench copy\n");
+	}
+	else
+	{
+		fformat(stdout,
+				"COPY throughput estimated at %.1f MB/s per job, "
+				"use --bench to measure it\n",
+				(double) ESTIMATE_COPY_BYTES_PER_MS * 1000.0 / (1024 * 1024));
+	}
+
+	fformat(stdout, "\n");
+
+	fformat(stdout, "%10s | %10s | %10s | %10s | %10s | %7s\n",
+			"table-jobs", "MB/s/job", "split", "COPY jobs", "makespan",
+			"speedup");
+
+	fformat(stdout, "%10s-+-%10s-+-%10s-+-%10s-+-%10s-+-%7s\n",
+			"----------", "----------", "----------", "----------",
+			"----------", "-------");
+
+	for (int i = 0; i < result->candidateCount; i++)
+	{
+		PlanCandidate *candidate = &(result->candidates[i]);
+
+		char throughput[BUFSIZE] = { 0 };
+		char split[BUFSIZE] = { 0 };
+		char makespan[BUFSIZE] = { 0 };
+		char speedup[BUFSIZE] = { 0 };
+
+		sformat(throughput, sizeof(throughput), "%.1f",
+				result->calibrated
+				? result->benchBytesPerMs[i] * 1000.0 / (1024 * 1024)
+				: (double) ESTIMATE_COPY_BYTES_PER_MS * 1000.0 / (1024 * 1024));
+
+		if (candidate->splitTablesLargerThan > 0)
+		{
+			(void) pretty_print_bytes(split, sizeof(split),
+									  candidate->splitTablesLargerThan);
+		}
+		else
+		{
+			strlcpy(split, "-", sizeof(split));
+		}
+
+		(void) IntervalToString(candidate->makespanMs, makespan, BUFSIZE);
+
+		if (candidate->makespanMs > 0)
+		{
+			sformat(speedup, sizeof(speedup), "%.2fx",
+					(double) result->candidates[0].makespanMs /
+					candidate->makespanMs);
+		}
+		else
+		{
+			strlcpy(speedup, "-", sizeof(speedup));
+		}
+
+		fformat(stdout, "%10d | %10s | %10s | %10d | %10s | %7s\n",
+				candidate->tableJobs,
+				throughput,
+				split,
+				candidate->copyJobCount,
+				makespan,
+				speedup);
+	}
+
+	PlanCandidate *recommended = &(result->recommended);
+	SourceTable *critical =
+		&(result->tableArray.array[recommended->criticalTable]);
+
+	char makespan[BUFSIZE] = { 0 };
+	char copyMs[BUFSIZE] = { 0 };
+	char indexMs[BUFSIZE] = { 0 };
+	char vacuumMs[BUFSIZE] = { 0 };
+
+	(void) IntervalToString(recommended->makespanMs, makespan, BUFSIZE);
+	(void) IntervalToString(recommended->criticalCopyMs, copyMs, BUFSIZE);
+	(void) IntervalToString(recommended->criticalIndexMs, indexMs, BUFSIZE);
+	(void) IntervalToString(recommended->criticalVacuumMs, vacuumMs, BUFSIZE);
+
+	fformat(stdout, "\n");
+
+	if (recommended->splitTablesLargerThan > 0)
+	{
+		char split[BUFSIZE] = { 0 };
+
+		(void) pretty_print_bytes(split, sizeof(split),
+								  recommended->splitTablesLargerThan);
+
+		fformat(stdout,
+				"Recommended: --table-jobs %d --index-jobs %d "
+				"--split-tables-larger-than \"%s\"\n",
+				recommended->tableJobs,
+				recommended->indexJobs,
+				split);
+	}
+	else
+	{
+		fformat(stdout, "Recommended: --table-jobs %d --index-jobs %d\n",
+				recommended->tableJobs,
+				recommended->indexJobs);
+	}
+
+	fformat(stdout, "Predicted makespan: %s\n", makespan);
+
+	fformat(stdout,
+			"Critical path: \"%s\".\"%s\" in %d part%s, "
+			"COPY %s, CREATE INDEX %s, VACUUM %s\n",
+			critical->nspname,
+			critical->relname,
+			recommended->criticalPartCount,
+			recommended->criticalPartCount > 1 ? "s" : "",
+			copyMs,
+			indexMs,
+			vacuumMs);
+
+	fformat(stdout, "\n");
+}
+
+
+/*
+ * plan_print_json prints the results as a JSON object.
+ */
+static void
+plan_print_json(PlanSpecs *specs, PlanResult *result)
+{
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *jsObj = json_value_get_object(js);
+
+	json_object_set_number(jsObj, "tables", (double) result->tableArray.count);
+	json_object_set_number(jsObj, "table-bytes", (double) result->tableBytes);
+	json_object_set_number(jsObj, "indexes", (double) result->indexArray.count);
+	json_object_set_number(jsObj, "index-bytes", (double) result->indexBytes);
+	json_object_set_boolean(jsObj, "calibrated", result->calibrated);
+
+	JSON_Value *jsCandidates = json_value_init_array();
+	JSON_Array *jsCandidatesArray = json_value_get_array(jsCandidates);
+
+	for (int i = 0; i < result->candidateCount; i++)
+	{
+		JSON_Value *jsCandidate = json_value_init_object();
+		JSON_Object *jsCandidateObj = json_value_get_object(jsCandidate);
+
+		(void) plan_json_candidate(result,
+								   &(result->candidates[i]),
+								   jsCandidateObj);
+
+		if (result->calibrated)
+		{
+			json_object_set_number(jsCandidateObj, "bench-bytes-per-ms",
+								   result->benchBytesPerMs[i]);
+		}
+
+		json_array_append_value(jsCandidatesArray, jsCandidate);
+	}
+
+	json_object_set_value(jsObj, "candidates", jsCandidates);
+
+	JSON_Value *jsRecommended = json_value_init_object();
+
+	(void) plan_json_candidate(result,
+							   &(result->recommended),
+							   json_value_get_object(jsRecommended));
+
+	json_object_set_value(jsObj, "recommended", jsRecommended);
+
+	(void) cli_pprint_json(js);
+}
+
+
+/*
+ * plan_json_candidate adds the given candidate to the JSON object.
+ */
+static void
+plan_json_candidate(PlanResult *result,
+					PlanCandidate *candidate,
+					JSON_Object *jsObj)
+{
+	SourceTable *critical =
+		&(result->tableArray.array[candidate->criticalTable]);
+
+	json_object_set_number(jsObj, "table-jobs", (double) candidate->tableJobs);
+	json_object_set_number(jsObj, "index-jobs", (double) candidate->indexJobs);
+	json_object_set_number(jsObj, "split-tables-larger-than",
+						   (double) candidate->splitTablesLargerThan);
+	json_object_set_number(jsObj, "copy-jobs",
+						   (double) candidate->copyJobCount);
+	json_object_set_number(jsObj, "makespan-ms",
+						   (double) candidate->makespanMs);
+
+	json_object_dotset_string(jsObj, "critical-path.nspname", critical->nspname);
+	json_object_dotset_string(jsObj, "critical-path.relname", critical->relname);
+	json_object_dotset_number(jsObj, "critical-path.parts",
+							  (double) candidate->criticalPartCount);
+	json_object_dotset_number(jsObj, "critical-path.copy-ms",
+							  (double) candidate->criticalCopyMs);
+	json_object_dotset_number(jsObj, "critical-path.index-ms",
+							  (double) candidate->criticalIndexMs);
+	json_object_dotset_number(jsObj, "critical-path.vacuum-ms",
+							  (double) candidate->criticalVacuumMs);
+}
@@ -0,0 +1,89 @@
+/*
+ * src/bin/pgcopydb/plan.h
+ *     Simulate the schedule of a copy and recommend the count of jobs
+ */
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pgsql.h"
+#include "schema.h"
+
+/* the counts of jobs that we simulate, up to --max-jobs */
+#define PLAN_MAX_CANDIDATES 16
+#define PLAN_DEFAULT_MAX_JOBS 16
+#define PLAN_MAX_JOBS 256
+
+/* --split-tables-larger-than candidates are powers of two, from 64 MB */
+#define PLAN_MIN_SPLIT_SIZE (64 * 1024 * 1024)
+
+/*
+ * We recommend the smallest count of jobs that is within that percentage of
+ * the best makespan: more jobs than that only add load on the target.
+ */
+#define PLAN_GOOD_ENOUGH_PCT 5
+
+/* pgcopydb plan --bench copies that many rows with each job */
+#define PLAN_DEFAULT_BENCH_ROWS 100000
+
+typedef struct PlanSpecs
+{
+	char source_pguri[MAXCONNINFO];
+	char target_pguri[MAXCONNINFO];
+
+	int maxJobs;
+
+	bool bench;                 /* calibrate the estimates with bench copy */
+	uint64_t benchRows;
+} PlanSpecs;
+
+/*
+ * A PlanCandidate is a simulated schedule for a given count of table jobs,
+ * index jobs, and split threshold.
+ */
+typedef struct PlanCandidate
+{
+	int tableJobs;
+	int indexJobs;
+	uint64_t splitTablesLargerThan;     /* zero when tables are not split */
+
+	int copyJobCount;           /* tables and table parts in the queue */
+	uint64_t makespanMs;
+
+	/* the table that finishes last, and its estimates */
+	int criticalTable;          /* index in the tableArray */
+	int criticalPartCount;
+	uint64_t criticalCopyMs;    /* all the parts */
+	uint64_t criticalIndexMs;
+	uint64_t criticalVacuumMs;
+} PlanCandidate;
+
+typedef struct PlanResult
+{
+	SourceTableArray tableArray;
+	SourceIndexArray indexArray;
+
+	uint64_t tableBytes;
+	uint64_t indexBytes;
+
+	/* with --bench, the COPY throughput of one job for each count of jobs */
+	bool calibrated;
+	double benchBytesPerMs[PLAN_MAX_CANDIDATES];
+
+	/* the best split threshold for each count of table jobs */
+	int candidateCount;
+	PlanCandidate candidates[PLAN_MAX_CANDIDATES];
+
+	/* the best index jobs for the recommended count of table jobs */
+	int indexCandidateCount;
+	PlanCandidate indexCandidates[PLAN_MAX_CANDIDATES];
+
+	PlanCandidate recommended;
+} PlanResult;
+
+bool plan_run(PlanSpecs *specs, PlanResult *result);
+void plan_print_results(PlanSpecs *specs, PlanResult *result);
+
+#endif /* PLAN_H */
@@ -0,0 +1,1363 @@
+/*
+ * src/bin/pgcopydb/predata.c
+ *     Implementation of a CLI to copy a database between two Postgres instances
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "copydb.h"
+#include "file_utils.h"
+#include "lock_utils.h"
+#include "log.h"
+#include "pgcmd.h"
+#include "pqexpbuffer.h"
+#include "signals.h"
+#include "string_utils.h"
+
+
+/*
+ * A column DEFAULT or an ATTACH PARTITION archive entry is restored right
+ * after its anchor, the last relation that it depends on, and the table that
+ * it belongs to waits until it has been restored.
+ */
+typedef struct PreDataMove
+{
+	int anchor;                 /* archive index of the last dependency */
+	int index;                  /* archive index of the moved entry */
+	uint32_t tableOid;          /* table that waits for the moved entry */
+} PreDataMove;
+
+
+static bool copydb_pre_data_is_table(ArchiveContentItem *item);
+static int copydb_compare_pre_data_table_oid(const void *a, const void *b);
+static int copydb_compare_pre_data_relation(const void *a, const void *b);
+static int copydb_compare_pre_data_move(const void *a, const void *b);
+static int copydb_compare_archive_item_name(const void *a, const void *b);
+static int copydb_compare_dump_id(const void *a, const void *b);
+static bool copydb_prepare_pre_data_order(CopyDataSpec *specs,
+										  ArchiveContentArray *contents);
+static bool copydb_fetch_pre_data_dependencies(CopyDataSpec *specs,
+											   SourcePreDataDependencyArray *
+											   depArray);
+static int copydb_pre_data_relation_index(PreDataTable *relations,
+										  int relationCount,
+										  uint32_t oid);
+static bool copydb_pre_data_find_move(ArchiveContentArray *contents,
+									  int index,
+									  SourcePreDataDependencyArray *depArray,
+									  PreDataTable *relations,
+									  int relationCount,
+									  ArchiveContentItem **tableItems,
+									  int tableItemCount,
+									  PreDataMove *move);
+static bool copydb_start_pre_data_process(CopyDataSpec *specs,
+										  ArchiveContentArray *contents);
+static void copydb_wait_pre_data_process(PreDataRestore *preDataRestore,
+										 bool terminate);
+static void copydb_release_pre_data_restore(PreDataRestore *preDataRestore);
+static bool copydb_pre_data_worker(CopyDataSpec *specs,
+								   ArchiveContentArray *contents);
+static bool copydb_read_pre_data_restored(CopyDataSpec *specs,
+										  ArchiveContentArray *contents);
+static bool copydb_pre_data_restore_step(CopyDataSpec *specs,
+										 ArchiveContentArray *contents,
+										 int first, int last);
+static bool copydb_pre_data_restore_batch(CopyDataSpec *specs,
+										  ArchiveContentArray *contents,
+										  int first, int last);
+static bool copydb_pre_data_set_progress(PreDataProgress *progress,
+										 int restoredEntries,
+										 bool done,
+										 bool failed);
+static void copydb_write_pre_data_done_file(CopyDataSpec *specs);
+
+
+/*
+ * copydb_start_target_prepare_schema restores the pre.dump file into the
+ * target database, in batches of tables, from a sub-process. The function
+ * returns as soon as the first batch has been restored, and the tables can
+ * then be copied as soon as their own batch has been restored, see
+ * copydb_pre_data_table_is_restored() and copydb_prepare_pre_data_order().
+ *
+ * When using --drop-if-exists, the whole pre-data section is restored in a
+ * single pg_restore run before returning, as the pg_restore --clean option
+ * drops the objects of the archive in the reverse dependency order.
+ *
+ * Once the whole section has been restored, the pre.done file is created so
+ * that a --resume run skips that step.
+ */
+bool
+copydb_start_target_prepare_schema(CopyDataSpec *specs)
+{
+	PreDataRestore *preDataRestore = &(specs->preDataRestore);
+
+	preDataRestore->streaming = false;
+	preDataRestore->pid = 0;
+
+	/* our sub-processes inherit the list of objects to filter out */
+	if (!copydb_prepare_table_filters(specs, NULL))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (specs->dropIfExists)
+	{
+		if (!copydb_target_prepare_schema(specs))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		(void) copydb_write_pre_data_done_file(specs);
+
+		return true;
+	}
+
+	if (!file_exists(specs->dumpPaths.preFilename))
+	{
+		log_fatal("File \"%s\" does not exists", specs->dumpPaths.preFilename);
+		return false;
+	}
+
+	ArchiveContentArray contents = { 0 };
+
+	if (!pg_restore_list(&(specs->pgPaths),
+						 specs->dumpPaths.preFilename,
+						 specs->dumpPaths.preTocFilename,
+						 &contents))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	int tableCount = 0;
+
+	for (int i = 0; i < contents.count; i++)
+	{
+		if (copydb_pre_data_is_table(&(contents.array[i])))
+		{
+			++tableCount;
+		}
+	}
+
+	/* without tables to wait for, keep it simple */
+	if (tableCount == 0)
+	{
+		free(contents.array);
+
+		if (!copydb_target_prepare_schema(specs))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		(void) copydb_write_pre_data_done_file(specs);
+
+		return true;
+	}
+
+	if (!copydb_prepare_pre_data_order(specs, &contents))
+	{
+		/* errors have already been logged */
+		free(contents.array);
+		return false;
+	}
+
+	size_t size = sizeof(PreDataProgress);
+
+	void *area = mmap(NULL, size,
+					  PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_ANONYMOUS,
+					  -1, 0);
+
+	if (area == MAP_FAILED)
+	{
+		log_error("Failed to allocate %lld bytes of shared memory for "
+				  "the pre-data restore progress: %m",
+				  (long long) size);
+		free(contents.array);
+		(void) copydb_release_pre_data_restore(preDataRestore);
+		return false;
+	}
+
+	PreDataProgress *progress = (PreDataProgress *) area;
+
+	progress->size = size;
+	progress->restoredEntries = 0;
+	progress->done = false;
+	progress->failed = false;
+
+	/* the semaphore initValue defaults to 1: a mutex */
+	progress->semaphore.initValue = 1;
+
+	if (!semaphore_create(&(progress->semaphore)))
+	{
+		log_error("Failed to create the pre-data restore semaphore");
+		(void) munmap(area, size);
+		free(contents.array);
+		(void) copydb_release_pre_data_restore(preDataRestore);
+		return false;
+	}
+
+	preDataRestore->progress = progress;
+	preDataRestore->streaming = true;
+
+	if (!copydb_start_pre_data_process(specs, &contents))
+	{
+		/* errors have already been logged */
+		free(contents.array);
+		preDataRestore->streaming = false;
+		(void) copydb_finish_target_prepare_schema(specs);
+		return false;
+	}
+
+	free(contents.array);
+
+	log_info("Restoring the pre-data section in batches, "
+			 "%d tables are going to be created",
+			 tableCount);
+
+	/* wait until the first batch has been restored */
+	for (;;)
+	{
+		PreDataProgress current = { 0 };
+
+		if (!copydb_pre_data_progress(specs, &current))
+		{
+			/* errors have already been logged */
+			(void) copydb_stop_target_prepare_schema(specs);
+			return false;
+		}
+
+		if (current.failed)
+		{
+			(void) copydb_finish_target_prepare_schema(specs);
+			return false;
+		}
+
+		if (current.done || current.restoredEntries > 0)
+		{
+			break;
+		}
+
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			(void) copydb_stop_target_prepare_schema(specs);
+			return false;
+		}
+
+		log_flush();
+
+		pg_usleep(100 * 1000); /* 100 ms */
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_finish_target_prepare_schema waits until the pre-data restore
+ * sub-process is done, and releases the shared memory area that tracks its
+ * progress. Returns false when the pre-data section failed to restore.
+ */
+bool
+copydb_finish_target_prepare_schema(CopyDataSpec *specs)
+{
+	PreDataRestore *preDataRestore = &(specs->preDataRestore);
+	PreDataProgress *progress = preDataRestore->progress;
+
+	bool success = true;
+	bool terminate = false;
+
+	if (progress == NULL)
+	{
+		return true;
+	}
+
+	while (preDataRestore->streaming)
+	{
+		PreDataProgress current = { 0 };
+
+		if (!copydb_pre_data_progress(specs, &current))
+		{
+			/* errors have already been logged */
+			success = false;
+			terminate = true;
+			break;
+		}
+
+		if (current.done)
+		{
+			success = !current.failed;
+			break;
+		}
+
+		/* the sub-process might have been terminated by a signal */
+		int status = 0;
+		pid_t pid = waitpid(preDataRestore->pid, &status, WNOHANG);
+
+		if (pid == preDataRestore->pid || (pid == -1 && errno == ECHILD))
+		{
+			preDataRestore->pid = 0;
+
+			/* re-read the progress, it might have been done just now */
+			if (copydb_pre_data_progress(specs, &current) && current.done)
+			{
+				success = !current.failed;
+			}
+			else
+			{
+				log_error("The pre-data restore sub-process %d exited "
+						  "before it was done",
+						  preDataRestore->pid);
+				success = false;
+			}
+			break;
+		}
+
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			success = false;
+			terminate = true;
+			break;
+		}
+
+		log_flush();
+
+		pg_usleep(100 * 1000); /* 100 ms */
+	}
+
+	(void) copydb_wait_pre_data_process(preDataRestore, terminate);
+	(void) copydb_release_pre_data_restore(preDataRestore);
+
+	return success;
+}
+
+
+/*
+ * copydb_stop_target_prepare_schema terminates the pre-data restore
+ * sub-process, waits until it has exited, and releases its resources. It is
+ * called on the error paths once the sub-process has been started, so that
+ * it neither outlives us nor leaks its semaphore.
+ */
+void
+copydb_stop_target_prepare_schema(CopyDataSpec *specs)
+{
+	PreDataRestore *preDataRestore = &(specs->preDataRestore);
+
+	if (preDataRestore->progress == NULL)
+	{
+		return;
+	}
+
+	(void) copydb_wait_pre_data_process(preDataRestore, true);
+	(void) copydb_release_pre_data_restore(preDataRestore);
+}
+
+
+/*
+ * copydb_wait_pre_data_process waits until the pre-data restore sub-process
+ * has exited, after having sent it a SIGTERM when asked to terminate it. The
+ * sub-process then exits once its current pg_restore run is done.
+ */
+static void
+copydb_wait_pre_data_process(PreDataRestore *preDataRestore, bool terminate)
+{
+	pid_t pid = preDataRestore->pid;
+
+	if (pid <= 0)
+	{
+		return;
+	}
+
+	if (terminate && kill(pid, SIGTERM) != 0 && errno != ESRCH)
+	{
+		log_warn("Failed to signal the pre-data restore sub-process %d: %m",
+				 pid);
+	}
+
+	int status = 0;
+
+	log_flush();
+
+	/* ECHILD: copydb_wait_for_subprocesses() might have reaped it already */
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+	{
+		continue;
+	}
+
+	preDataRestore->pid = 0;
+}
+
+
+/*
+ * copydb_release_pre_data_restore removes the semaphore, releases the shared
+ * memory area, and frees the restore order and the tables arrays.
+ */
+static void
+copydb_release_pre_data_restore(PreDataRestore *preDataRestore)
+{
+	PreDataProgress *progress = preDataRestore->progress;
+
+	if (progress != NULL)
+	{
+		if (!semaphore_finish(&(progress->semaphore)))
+		{
+			log_warn("Failed to remove pre-data restore semaphore %d",
+					 progress->semaphore.semId);
+		}
+
+		if (munmap((void *) progress, progress->size) != 0)
+		{
+			log_warn("Failed to release the pre-data restore shared memory: %m");
+		}
+	}
+
+	free(preDataRestore->order);
+	free(preDataRestore->restored);
+	free(preDataRestore->tables);
+
+	preDataRestore->streaming = false;
+	preDataRestore->entryCount = 0;
+	preDataRestore->order = NULL;
+	preDataRestore->restored = NULL;
+	preDataRestore->tableCount = 0;
+	preDataRestore->tables = NULL;
+	preDataRestore->progress = NULL;
+}
+
+
+/*
+ * copydb_pre_data_progress copies the current pre-data restore progress into
+ * the given structure. When the pre-data section is not being restored in
+ * batches then it is done already.
+ */
+bool
+copydb_pre_data_progress(CopyDataSpec *specs, PreDataProgress *progress)
+{
+	PreDataRestore *preDataRestore = &(specs->preDataRestore);
+
+	if (!preDataRestore->streaming)
+	{
+		progress->restoredEntries = preDataRestore->entryCount;
+		progress->done = true;
+		progress->failed = false;
+
+		return true;
+	}
+
+	PreDataProgress *shared = preDataRestore->progress;
+
+	if (!semaphore_lock(&(shared->semaphore)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	progress->restoredEntries = shared->restoredEntries;
+	progress->done = shared->done;
+	progress->failed = shared->failed;
+
+	(void) semaphore_unlock(&(shared->semaphore));
+
+	return true;
+}
+
+
+/*
+ * copydb_pre_data_table_is_restored returns true when the given table has
+ * been created on the target database already, given the pre-data restore
+ * progress. Tables that are not found in the pre.dump archive have to wait
+ * until the whole pre-data section has been restored.
+ */
+bool
+copydb_pre_data_table_is_restored(CopyDataSpec *specs,
+								  PreDataProgress *progress,
+								  SourceTable *table)
+{
+	PreDataRestore *preDataRestore = &(specs->preDataRestore);
+
+	if (progress->done)
+	{
+		return true;
+	}
+
+	PreDataTable key = { .oid = table->oid };
+
+	PreDataTable *entry =
+		(PreDataTable *) bsearch(&key,
+								 preDataRestore->tables,
+								 preDataRestore->tableCount,
+								 sizeof(PreDataTable),
+								 copydb_compare_pre_data_table_oid);
+
+	return entry != NULL && entry->rank < progress->restoredEntries;
+}
+
+
+/*
+ * copydb_pre_data_is_table returns true when the given archive entry creates
+ * a table, as opposed to a view or a sequence, which are found in pg_class
+ * too.
+ */
+static bool
+copydb_pre_data_is_table(ArchiveContentItem *item)
+{
+	return item->catalogOid == PG_CLASS_OID && streq(item->desc, "TABLE");
+}
+
+
+/*
+ * copydb_compare_pre_data_table_oid is a qsort and bsearch comparison
+ * function for PreDataTable entries, by oid.
+ */
+static int
+copydb_compare_pre_data_table_oid(const void *a, const void *b)
+{
+	uint32_t oidA = ((PreDataTable *) a)->oid;
+	uint32_t oidB = ((PreDataTable *) b)->oid;
+
+	return oidA < oidB ? -1 : oidA > oidB ? 1 : 0;
+}
+
+
+/*
+ * copydb_compare_pre_data_relation is a qsort comparison function for
+ * PreDataTable entries, by oid and then archive index.
+ */
+static int
+copydb_compare_pre_data_relation(const void *a, const void *b)
+{
+	int cmp = copydb_compare_pre_data_table_oid(a, b);
+
+	if (cmp != 0)
+	{
+		return cmp;
+	}
+
+	int rankA = ((PreDataTable *) a)->rank;
+	int rankB = ((PreDataTable *) b)->rank;
+
+	return rankA < rankB ? -1 : rankA > rankB ? 1 : 0;
+}
+
+
+/*
+ * copydb_compare_pre_data_move is a qsort comparison function for
+ * PreDataMove entries, by anchor and then archive index.
+ */
+static int
+copydb_compare_pre_data_move(const void *a, const void *b)
+{
+	PreDataMove *moveA = (PreDataMove *) a;
+	PreDataMove *moveB = (PreDataMove *) b;
+
+	if (moveA->anchor != moveB->anchor)
+	{
+		return moveA->anchor < moveB->anchor ? -1 : 1;
+	}
+
+	return moveA->index < moveB->index ? -1 : moveA->index > moveB->index ? 1 : 0;
+}
+
+
+/*
+ * copydb_compare_archive_item_name is a qsort and bsearch comparison
+ * function for pointers to archive entries, by restore list name.
+ */
+static int
+copydb_compare_archive_item_name(const void *a, const void *b)
+{
+	ArchiveContentItem *itemA = *(ArchiveContentItem **) a;
+	ArchiveContentItem *itemB = *(ArchiveContentItem **) b;
+
+	return strcmp(itemA->restoreListName, itemB->restoreListName);
+}
+
+
+/*
+ * copydb_compare_dump_id is a qsort and bsearch comparison function for
+ * archive dumpIds.
+ */
+static int
+copydb_compare_dump_id(const void *a, const void *b)
+{
+	int dumpIdA = *(int *) a;
+	int dumpIdB = *(int *) b;
+
+	return dumpIdA < dumpIdB ? -1 : dumpIdA > dumpIdB ? 1 : 0;
+}
+
+
+/*
+ * copydb_prepare_pre_data_order computes the restore order of the pre.dump
+ * archive entries, and for each table the position in that order of the
+ * last entry that its COPY has to wait for.
+ *
+ * pg_dump sorts the column DEFAULT and the ATTACH PARTITION entries after
+ * all the TABLE entries. Restored in the archive order, they would run while
+ * the tables are being copied: ALTER TABLE then waits behind the COPY for
+ * its ACCESS EXCLUSIVE lock, and ATTACH PARTITION scans the rows that have
+ * just been copied to validate the partition constraint. Instead, those
+ * entries are restored right after the last relation that they depend on,
+ * and the table they belong to is only released to the COPY once they have
+ * been restored.
+ */
+static bool
+copydb_prepare_pre_data_order(CopyDataSpec *specs, ArchiveContentArray *contents)
+{
+	PreDataRestore *preDataRestore = &(specs->preDataRestore);
+	SourcePreDataDependencyArray depArray = { 0, NULL };
+
+	if (!copydb_fetch_pre_data_dependencies(specs, &depArray))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	int count = contents->count;
+
+	PreDataTable *relations =
+		(PreDataTable *) calloc(count + 1, sizeof(PreDataTable));
+
+	ArchiveContentItem **tableItems =
+		(ArchiveContentItem **) calloc(count + 1, sizeof(ArchiveContentItem *));
+
+	PreDataMove *moves = (PreDataMove *) calloc(count + 1, sizeof(PreDataMove));
+	bool *moved = (bool *) calloc(count + 1, sizeof(bool));
+	int *position = (int *) calloc(count + 1, sizeof(int));
+	int *order = (int *) calloc(count + 1, sizeof(int));
+
+	if (relations == NULL || tableItems == NULL || moves == NULL ||
+		moved == NULL || position == NULL || order == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		free(depArray.array);
+		free(relations);
+		free(tableItems);
+		free(moves);
+		free(moved);
+		free(position);
+		free(order);
+		return false;
+	}
+
+	int relationCount = 0;
+	int tableItemCount = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		ArchiveContentItem *item = &(contents->array[i]);
+
+		if (item->catalogOid == PG_CLASS_OID)
+		{
+			relations[relationCount].oid = item->objectOid;
+			relations[relationCount].rank = i;
+			++relationCount;
+		}
+
+		if (copydb_pre_data_is_table(item))
+		{
+			tableItems[tableItemCount++] = item;
+		}
+	}
+
+	qsort(relations, relationCount, sizeof(PreDataTable),
+		  copydb_compare_pre_data_relation);
+
+	qsort(tableItems, tableItemCount, sizeof(ArchiveContentItem *),
+		  copydb_compare_archive_item_name);
+
+	int moveCount = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		PreDataMove *move = &(moves[moveCount]);
+
+		if (copydb_pre_data_find_move(contents, i, &depArray,
+									  relations, relationCount,
+									  tableItems, tableItemCount,
+									  move))
+		{
+			moved[i] = true;
+			++moveCount;
+		}
+	}
+
+	qsort(moves, moveCount, sizeof(PreDataMove), copydb_compare_pre_data_move);
+
+	/* the moved entries follow their anchor, which is never moved itself */
+	for (int i = 0, p = 0, m = 0; i < count; i++)
+	{
+		if (moved[i])
+		{
+			continue;
+		}
+
+		order[p] = i;
+		position[i] = p++;
+
+		for (; m < moveCount && moves[m].anchor == i; m++)
+		{
+			order[p] = moves[m].index;
+			position[moves[m].index] = p++;
+		}
+	}
+
+	preDataRestore->tableCount = tableItemCount;
+	preDataRestore->tables =
+		(PreDataTable *) calloc(tableItemCount + 1, sizeof(PreDataTable));
+
+	if (preDataRestore->tables == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		free(depArray.array);
+		free(relations);
+		free(tableItems);
+		free(moves);
+		free(moved);
+		free(position);
+		free(order);
+		return false;
+	}
+
+	for (int i = 0, rank = 0; i < count; i++)
+	{
+		if (copydb_pre_data_is_table(&(contents->array[i])))
+		{
+			preDataRestore->tables[rank].oid = contents->array[i].objectOid;
+			preDataRestore->tables[rank].rank = position[i];
+			++rank;
+		}
+	}
+
+	qsort(preDataRestore->tables,
+		  preDataRestore->tableCount,
+		  sizeof(PreDataTable),
+		  copydb_compare_pre_data_table_oid);
+
+	/* a table also waits for its DEFAULT and ATTACH PARTITION entries */
+	for (int m = 0; m < moveCount; m++)
+	{
+		PreDataTable key = { .oid = moves[m].tableOid };
+
+		PreDataTable *table =
+			(PreDataTable *) bsearch(&key,
+									 preDataRestore->tables,
+									 preDataRestore->tableCount,
+									 sizeof(PreDataTable),
+									 copydb_compare_pre_data_table_oid);
+
+		if (table != NULL && table->rank < position[moves[m].index])
+		{
+			table->rank = position[moves[m].index];
+		}
+	}
+
+	log_debug("Restoring %d DEFAULT and ATTACH PARTITION pre-data entries "
+			  "along with their tables",
+			  moveCount);
+
+	preDataRestore->entryCount = count;
+	preDataRestore->order = order;
+
+	free(depArray.array);
+	free(relations);
+	free(tableItems);
+	free(moves);
+	free(moved);
+	free(position);
+
+	return true;
+}
+
+
+/*
+ * copydb_fetch_pre_data_dependencies lists the relations that the DEFAULT
+ * and ATTACH PARTITION entries depend on, in the source snapshot.
+ */
+static bool
+copydb_fetch_pre_data_dependencies(CopyDataSpec *specs,
+								   SourcePreDataDependencyArray *depArray)
+{
+	PGSQL src = { 0 };
+
+	if (!pgsql_init(&src, specs->source_pguri, PGSQL_CONN_SOURCE) ||
+		!copydb_set_snapshot(&(specs->sourceSnapshot), &src))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	bool success = schema_list_pre_data_dependencies(&src, depArray);
+
+	/* close the read-only transaction and the connection */
+	pgsql_finish(&src);
+
+	return success;
+}
+
+
+/*
+ * copydb_pre_data_relation_index returns the archive index of the last entry
+ * that creates the relation with the given oid, or -1 when the relation is
+ * not part of the archive.
+ */
+static int
+copydb_pre_data_relation_index(PreDataTable *relations,
+							   int relationCount,
+							   uint32_t oid)
+{
+	PreDataTable key = { .oid = oid };
+
+	PreDataTable *relation =
+		(PreDataTable *) bsearch(&key,
+								 relations,
+								 relationCount,
+								 sizeof(PreDataTable),
+								 copydb_compare_pre_data_table_oid);
+
+	if (relation == NULL)
+	{
+		return -1;
+	}
+
+	PreDataTable *last = relations + relationCount - 1;
+
+	while (relation < last && (relation + 1)->oid == oid)
+	{
+		++relation;
+	}
+
+	return relation->rank;
+}
+
+
+/*
+ * copydb_pre_data_find_move returns true when the archive entry at the given
+ * index is a DEFAULT or an ATTACH PARTITION entry that can be restored right
+ * after its anchor, and then fills-in the move. An ATTACH PARTITION entry has
+ * no oid, its restore list name is the one of the partition TABLE entry.
+ */
+static bool
+copydb_pre_data_find_move(ArchiveContentArray *contents,
+						  int index,
+						  SourcePreDataDependencyArray *depArray,
+						  PreDataTable *relations,
+						  int relationCount,
+						  ArchiveContentItem **tableItems,
+						  int tableItemCount,
+						  PreDataMove *move)
+{
+	ArchiveContentItem *item = &(contents->array[index]);
+
+	uint32_t objectOid = 0;
+	uint32_t tableOid = 0;
+
+	if (item->catalogOid == PG_ATTRDEF_OID && streq(item->desc, "DEFAULT"))
+	{
+		objectOid = item->objectOid;
+	}
+	else if (streq(item->desc, "TABLE ATTACH"))
+	{
+		ArchiveContentItem **partition =
+			(ArchiveContentItem **) bsearch(&item,
+											tableItems,
+											tableItemCount,
+											sizeof(ArchiveContentItem *),
+											copydb_compare_archive_item_name);
+
+		if (partition == NULL)
+		{
+			return false;
+		}
+
+		tableOid = (*partition)->objectOid;
+	}
+	else
+	{
+		return false;
+	}
+
+	/* the dependencies are sorted by objectOid, tableOid, refOid */
+	int first = 0;
+	int last = depArray->count;
+
+	while (first < last)
+	{
+		int middle = first + (last - first) / 2;
+		SourcePreDataDependency *dep = &(depArray->array[middle]);
+
+		if (dep->objectOid < objectOid ||
+			(dep->objectOid == objectOid && dep->tableOid < tableOid))
+		{
+			first = middle + 1;
+		}
+		else
+		{
+			last = middle;
+		}
+	}
+
+	int anchor = -1;
+
+	for (int d = first; d < depArray->count; d++)
+	{
+		SourcePreDataDependency *dep = &(depArray->array[d]);
+
+		if (dep->objectOid != objectOid ||
+			(tableOid != 0 && dep->tableOid != tableOid))
+		{
+			break;
+		}
+
+		/* a DEFAULT entry belongs to the table of its column */
+		if (tableOid == 0)
+		{
+			tableOid = dep->tableOid;
+		}
+
+		int tableIndex =
+			copydb_pre_data_relation_index(relations, relationCount,
+										   dep->tableOid);
+		int refIndex =
+			copydb_pre_data_relation_index(relations, relationCount,
+										   dep->refOid);
+
+		anchor = tableIndex > anchor ? tableIndex : anchor;
+		anchor = refIndex > anchor ? refIndex : anchor;
+	}
+
+	/* pg_dump sorts dependencies first, keep the entry in place otherwise */
+	if (tableOid == 0 || anchor < 0 || anchor >= index)
+	{
+		return false;
+	}
+
+	move->anchor = anchor;
+	move->index = index;
+	move->tableOid = tableOid;
+
+	return true;
+}
+
+
+/*
+ * copydb_start_pre_data_process forks the pre-data restore sub-process, see
+ * copydb_pre_data_worker().
+ */
+static bool
+copydb_start_pre_data_process(CopyDataSpec *specs,
+							  ArchiveContentArray *contents)
+{
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	int fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork the pre-data restore process");
+			return false;
+		}
+
+		case 0:
+		{
+			/* child process runs the command */
+			if (!copydb_pre_data_worker(specs, contents))
+			{
+				/* errors have already been logged */
+				exit(EXIT_CODE_TARGET);
+			}
+
+			exit(EXIT_CODE_QUIT);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			specs->preDataRestore.pid = fpid;
+
+			return true;
+		}
+	}
+}
+
+
+/*
+ * copydb_pre_data_worker restores the pre.dump archive entries in the order
+ * computed by copydb_prepare_pre_data_order(). Each batch stops right before
+ * the TABLE entry that starts the next batch, so that the DEFAULT and ATTACH
+ * PARTITION entries moved after a table are restored with it, and the
+ * batches grow from a single table up to PRE_DATA_BATCH_MAX_TABLES tables:
+ * the first tables are available for COPY early, and the pg_restore runs are
+ * few.
+ */
+static bool
+copydb_pre_data_worker(CopyDataSpec *specs, ArchiveContentArray *contents)
+{
+	PreDataRestore *preDataRestore = &(specs->preDataRestore);
+
+	int batchSize = 1;
+	int batchTables = 0;
+	int first = 0;
+
+	if (!copydb_read_pre_data_restored(specs, contents))
+	{
+		/* errors have already been logged */
+		(void) copydb_pre_data_set_progress(preDataRestore->progress, 0,
+											true, true);
+		return false;
+	}
+
+	for (int p = 0; p < preDataRestore->entryCount; p++)
+	{
+		int index = preDataRestore->order[p];
+
+		if (!copydb_pre_data_is_table(&(contents->array[index])))
+		{
+			continue;
+		}
+
+		if (batchTables == batchSize)
+		{
+			if (!copydb_pre_data_restore_step(specs, contents, first, p - 1))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+
+			first = p;
+			batchTables = 0;
+
+			if (batchSize < PRE_DATA_BATCH_MAX_TABLES)
+			{
+				batchSize *= 2;
+			}
+		}
+
+		++batchTables;
+	}
+
+	/* the last batch also contains the entries that follow the last table */
+	return copydb_pre_data_restore_step(specs,
+										contents,
+										first,
+										preDataRestore->entryCount - 1);
+}
+
+
+/*
+ * copydb_read_pre_data_restored allocates the restored array, and when using
+ * --resume marks the entries that a previous run has restored, as found in
+ * the pre.restored file. Each batch is registered on a line of its own, and
+ * a line that has not been completely written is ignored.
+ */
+static bool
+copydb_read_pre_data_restored(CopyDataSpec *specs,
+							  ArchiveContentArray *contents)
+{
+	PreDataRestore *preDataRestore = &(specs->preDataRestore);
+	char *filename = specs->dumpPaths.preRestoredFilename;
+
+	preDataRestore->restored =
+		(bool *) calloc(contents->count + 1, sizeof(bool));
+
+	if (preDataRestore->restored == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	if (!specs->resume || !file_exists(filename))
+	{
+		return true;
+	}
+
+	char *data = NULL;
+	long size = 0;
+
+	if (!read_file(filename, &data, &size))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* ignore the last line when it does not end with a newline */
+	char *end = strrchr(data, '\n');
+
+	if (end == NULL)
+	{
+		free(data);
+		return true;
+	}
+
+	*end = '\0';
+
+	int *dumpIds = (int *) calloc(size / 2 + 1, sizeof(int));
+	int dumpIdCount = 0;
+
+	if (dumpIds == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		free(data);
+		return false;
+	}
+
+	char *saveptr = NULL;
+
+	for (char *token = strtok_r(data, " \n", &saveptr);
+		 token != NULL;
+		 token = strtok_r(NULL, " \n", &saveptr))
+	{
+		if (!stringToInt(token, &(dumpIds[dumpIdCount])))
+		{
+			log_error("Failed to parse dumpId \"%s\" in file \"%s\"",
+					  token, filename);
+			free(dumpIds);
+			free(data);
+			return false;
+		}
+
+		++dumpIdCount;
+	}
+
+	qsort(dumpIds, dumpIdCount, sizeof(int), copydb_compare_dump_id);
+
+	int restoredCount = 0;
+
+	for (int i = 0; i < contents->count; i++)
+	{
+		if (bsearch(&(contents->array[i].dumpId),
+					dumpIds,
+					dumpIdCount,
+					sizeof(int),
+					copydb_compare_dump_id) != NULL)
+		{
+			preDataRestore->restored[i] = true;
+			++restoredCount;
+		}
+	}
+
+	log_info("Resuming the pre-data restore, skipping %d entries "
+			 "restored by a previous run",
+			 restoredCount);
+
+	free(dumpIds);
+	free(data);
+
+	return true;
+}
+
+
+/*
+ * copydb_pre_data_restore_step restores the entries from first to last
+ * (included) in restore order, and then publishes the progress.
+ */
+static bool
+copydb_pre_data_restore_step(CopyDataSpec *specs,
+							 ArchiveContentArray *contents,
+							 int first, int last)
+{
+	PreDataRestore *preDataRestore = &(specs->preDataRestore);
+	PreDataProgress *progress = preDataRestore->progress;
+
+	bool isLast = last == (preDataRestore->entryCount - 1);
+
+	if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+	{
+		(void) copydb_pre_data_set_progress(progress, first, true, true);
+		return false;
+	}
+
+	if (!copydb_pre_data_restore_batch(specs, contents, first, last))
+	{
+		/* errors have already been logged */
+		(void) copydb_pre_data_set_progress(progress, first, true, true);
+		return false;
+	}
+
+	if (isLast)
+	{
+		(void) copydb_write_pre_data_done_file(specs);
+	}
+
+	if (!copydb_pre_data_set_progress(progress, last + 1, isLast, false))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_debug("Restored pre-data entries %d to %d of %d",
+			  first + 1, last + 1, preDataRestore->entryCount);
+
+	return true;
+}
+
+
+/*
+ * copydb_pre_data_restore_batch restores the entries from first to last
+ * (included) in restore order using pg_restore --use-list, which restores
+ * the entries in the order of the list file when using a single job.
+ *
+ * The batch is restored in a single transaction, and then registered in the
+ * pre.restored file. The entries that a previous run has restored are
+ * commented out, and the batch is skipped when none are left.
+ */
+static bool
+copydb_pre_data_restore_batch(CopyDataSpec *specs,
+							  ArchiveContentArray *contents,
+							  int first, int last)
+{
+	PreDataRestore *preDataRestore = &(specs->preDataRestore);
+
+	PQExpBuffer listContents = createPQExpBuffer();
+	PQExpBuffer dumpIds = createPQExpBuffer();
+
+	if (listContents == NULL || dumpIds == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		destroyPQExpBuffer(listContents);
+		destroyPQExpBuffer(dumpIds);
+		return false;
+	}
+
+	int entryCount = 0;
+
+	for (int p = first; p <= last; p++)
+	{
+		int index = preDataRestore->order[p];
+		ArchiveContentItem *item = &(contents->array[index]);
+
+		bool skip =
+			preDataRestore->restored[index] ||
+			copydb_archive_item_is_filtered_out(specs, item);
+
+		/* commenting is done by prepending ";" as prefix to the line */
+		appendPQExpBuffer(listContents, "%s%d; %u %u\n",
+						  skip ? ";" : "",
+						  item->dumpId,
+						  item->catalogOid,
+						  item->objectOid);
+
+		if (!skip)
+		{
+			appendPQExpBuffer(dumpIds, "%s%d",
+							  entryCount == 0 ? "" : " ",
+							  item->dumpId);
+			++entryCount;
+		}
+	}
+
+	appendPQExpBufferStr(dumpIds, "\n");
+
+	/* memory allocation could have failed while building string */
+	if (PQExpBufferBroken(listContents) || PQExpBufferBroken(dumpIds))
+	{
+		log_error("Failed to create pg_restore list file: out of memory");
+		destroyPQExpBuffer(listContents);
+		destroyPQExpBuffer(dumpIds);
+		return false;
+	}
+
+	if (entryCount == 0)
+	{
+		log_debug("Skipping pre-data entries %d to %d, "
+				  "restored by a previous run",
+				  first + 1, last + 1);
+		destroyPQExpBuffer(listContents);
+		destroyPQExpBuffer(dumpIds);
+		return true;
+	}
+
+	if (!write_file(listContents->data,
+					listContents->len,
+					specs->dumpPaths.preListFilename))
+	{
+		/* errors have already been logged */
+		destroyPQExpBuffer(listContents);
+		destroyPQExpBuffer(dumpIds);
+		return false;
+	}
+
+	destroyPQExpBuffer(listContents);
+
+	if (!pg_restore_db(&(specs->pgPaths),
+					   specs->target_pguri,
+					   specs->dumpPaths.preFilename,
+					   specs->dumpPaths.preListFilename,
+					   false,
+					   specs->noOwner,
+					   true,
+					   1))
+	{
+		/* errors have already been logged */
+		destroyPQExpBuffer(dumpIds);
+		return false;
+	}
+
+	/* a single write of a single line, see copydb_read_pre_data_restored */
+	if (!append_to_file(dumpIds->data,
+						dumpIds->len,
+						specs->dumpPaths.preRestoredFilename))
+	{
+		log_warn("Failed to register the restored pre-data entries in \"%s\"",
+				 specs->dumpPaths.preRestoredFilename);
+	}
+
+	destroyPQExpBuffer(dumpIds);
+
+	return true;
+}
+
+
+/*
+ * copydb_pre_data_set_progress updates the pre-data restore progress in
+ * shared memory.
+ */
+static bool
+copydb_pre_data_set_progress(PreDataProgress *progress,
+							 int restoredEntries,
+							 bool done,
+							 bool failed)
+{
+	if (!semaphore_lock(&(progress->semaphore)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	progress->restoredEntries = restoredEntries;
+	progress->done = done;
+	progress->failed = failed;
+
+	(void) semaphore_unlock(&(progress->semaphore));
+
+	return true;
+}
+
+
+/*
+ * copydb_write_pre_data_done_file creates the pre.done file, so that a next
+ * pgcopydb run with --resume knows that the pre-data section has been
+ * restored already.
+ */
+static void
+copydb_write_pre_data_done_file(CopyDataSpec *specs)
+{
+	if (!write_file("", 0, specs->dumpPaths.preDoneFilename))
+	{
+		log_warn("Failed to create the pre-data done file \"%s\"",
+				 specs->dumpPaths.preDoneFilename);
+	}
+}
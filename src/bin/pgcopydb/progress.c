@@ -0,0 +1,475 @@
+/*
+ * src/bin/pgcopydb/progress.c
+ *     Shared memory progress counters of the table and index workers
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "copydb.h"
+#include "file_utils.h"
+#include "log.h"
+#include "pgsql.h"
+
+/* "PGCP" */
+#define PROGRESS_MAGIC 0x50474350
+
+
+static ProgressSlot * copydb_progress_slot(CopyDataSpec *specs, int slotIndex);
+static void copydb_progress_start(ProgressSlot *slot,
+								  ProgressStep step,
+								  PGSQL *dst,
+								  uint32_t oid,
+								  const char *nspname,
+								  const char *relname);
+
+
+/*
+ * copydb_progress_init maps the progress area from the run/progress file,
+ * with a slot per table worker and per index worker. The area is mapped
+ * MAP_SHARED from a file rather than anonymous memory so that another
+ * process, such as pgcopydb list progress, can read it.
+ *
+ * Each slot is only ever written to by the worker that owns it, so the area
+ * doesn't need a semaphore: readers might see a torn update, which is fine
+ * for progress reporting.
+ */
+bool
+copydb_progress_init(CopyDataSpec *specs)
+{
+	const char *filename = specs->cfPaths.progressfile;
+
+	specs->progress = NULL;
+
+	int count = specs->tableJobs + specs->indexJobs;
+	size_t size = sizeof(ProgressArea) + count * sizeof(ProgressSlot);
+
+	int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+	if (fd == -1)
+	{
+		log_error("Failed to create progress file \"%s\": %m", filename);
+		return false;
+	}
+
+	if (ftruncate(fd, size) != 0)
+	{
+		log_error("Failed to resize progress file \"%s\" to %lld bytes: %m",
+				  filename,
+				  (long long) size);
+		close(fd);
+		return false;
+	}
+
+	void *area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	/* the mapping stays valid after the file descriptor is closed */
+	close(fd);
+
+	if (area == MAP_FAILED)
+	{
+		log_error("Failed to map %lld bytes of progress file \"%s\": %m",
+				  (long long) size,
+				  filename);
+		(void) unlink_file((char *) filename);
+		return false;
+	}
+
+	ProgressArea *progress = (ProgressArea *) area;
+
+	memset(progress, 0, size);
+
+	progress->size = size;
+	progress->pid = getpid();
+	progress->startTime = time(NULL);
+	progress->tableWorkers = specs->tableJobs;
+	progress->indexWorkers = specs->indexJobs;
+
+	/* readers check the magic last, once the header is complete */
+	progress->magic = PROGRESS_MAGIC;
+
+	specs->progress = progress;
+
+	return true;
+}
+
+
+/*
+ * copydb_progress_finish releases the progress area and removes the
+ * run/progress file, the workers are done.
+ */
+bool
+copydb_progress_finish(CopyDataSpec *specs)
+{
+	ProgressArea *progress = specs->progress;
+	bool success = true;
+
+	if (progress == NULL)
+	{
+		return true;
+	}
+
+	if (munmap((void *) progress, progress->size) != 0)
+	{
+		log_warn("Failed to release the progress shared memory: %m");
+		success = false;
+	}
+
+	if (!unlink_file(specs->cfPaths.progressfile))
+	{
+		/* errors have already been logged */
+		success = false;
+	}
+
+	specs->progress = NULL;
+
+	return success;
+}
+
+
+/*
+ * copydb_progress_close registers that the workers are done, so that the
+ * metrics server exits.
+ */
+void
+copydb_progress_close(CopyDataSpec *specs)
+{
+	if (specs->progress != NULL)
+	{
+		specs->progress->closed = true;
+	}
+}
+
+
+/*
+ * copydb_progress_table_slot returns the progress slot of the given table
+ * worker, or NULL when there is no progress area.
+ */
+ProgressSlot *
+copydb_progress_table_slot(CopyDataSpec *specs, int workerIndex)
+{
+	if (specs->progress == NULL ||
+		workerIndex >= specs->progress->tableWorkers)
+	{
+		return NULL;
+	}
+
+	return copydb_progress_slot(specs, workerIndex);
+}
+
+
+/*
+ * copydb_progress_index_slot returns the progress slot of the given index
+ * worker, or NULL when there is no progress area.
+ */
+ProgressSlot *
+copydb_progress_index_slot(CopyDataSpec *specs, int workerIndex)
+{
+	if (specs->progress == NULL ||
+		workerIndex >= specs->progress->indexWorkers)
+	{
+		return NULL;
+	}
+
+	return copydb_progress_slot(specs, specs->progress->tableWorkers + workerIndex);
+}
+
+
+/*
+ * copydb_progress_start_copy registers that the table worker is now copying
+ * the given table (part). Then pg_copy() publishes the COPY statistics of the
+ * table in the slot, see the CopyArgs progress field.
+ */
+void
+copydb_progress_start_copy(CopyTableDataSpec *tableSpecs, PGSQL *dst)
+{
+	ProgressSlot *slot = tableSpecs->progress;
+
+	if (slot == NULL)
+	{
+		return;
+	}
+
+	SourceTable *table = tableSpecs->sourceTable;
+	int partCount = tableSpecs->part.partCount > 0 ? tableSpecs->part.partCount : 1;
+
+	slot->partNumber = tableSpecs->part.partNumber;
+	slot->partCount = tableSpecs->part.partCount;
+	slot->estimatedBytes = table->bytes > 0 ? table->bytes / partCount : 0;
+	slot->estimatedRows = table->reltuples > 0 ? table->reltuples / partCount : 0;
+
+	copydb_progress_start(slot,
+						  PROGRESS_STEP_COPY,
+						  dst,
+						  table->oid,
+						  table->nspname,
+						  table->relname);
+}
+
+
+/*
+ * copydb_progress_start_index registers that the index worker is now
+ * building the given index. The CREATE INDEX progress itself is found in
+ * pg_stat_progress_create_index from the backendPid of the slot.
+ */
+void
+copydb_progress_start_index(CopyTableDataSpec *tableSpecs,
+							SourceIndex *index,
+							PGSQL *dst)
+{
+	ProgressSlot *slot = tableSpecs->progress;
+
+	if (slot == NULL)
+	{
+		return;
+	}
+
+	slot->partNumber = 0;
+	slot->partCount = 0;
+	slot->estimatedBytes = 0;
+	slot->estimatedRows = 0;
+
+	copydb_progress_start(slot,
+						  PROGRESS_STEP_CREATE_INDEX,
+						  dst,
+						  index->indexOid,
+						  index->indexNamespace,
+						  index->indexRelname);
+}
+
+
+/*
+ * copydb_progress_start_constraints registers that the index worker is now
+ * creating the constraints of the given table.
+ */
+void
+copydb_progress_start_constraints(CopyTableDataSpec *tableSpecs)
+{
+	ProgressSlot *slot = tableSpecs->progress;
+
+	if (slot == NULL)
+	{
+		return;
+	}
+
+	SourceTable *table = tableSpecs->sourceTable;
+
+	slot->partNumber = 0;
+	slot->partCount = 0;
+	slot->estimatedBytes = 0;
+	slot->estimatedRows = 0;
+
+	copydb_progress_start(slot,
+						  PROGRESS_STEP_CONSTRAINTS,
+						  NULL,
+						  table->oid,
+						  table->nspname,
+						  table->relname);
+}
+
+
+/*
+ * copydb_progress_done registers that the worker is done with its current
+ * step, and is now idle. The COPY statistics of the step are added to the
+ * cumulative counters of the slot.
+ */
+void
+copydb_progress_done(CopyTableDataSpec *tableSpecs)
+{
+	ProgressSlot *slot = tableSpecs->progress;
+
+	if (slot == NULL)
+	{
+		return;
+	}
+
+	switch (slot->step)
+	{
+		case PROGRESS_STEP_COPY:
+		{
+			slot->totalRows += slot->stats.rows;
+			slot->totalBytes += slot->stats.bytes;
+			++slot->copyDone;
+			break;
+		}
+
+		case PROGRESS_STEP_CREATE_INDEX:
+		{
+			++slot->indexDone;
+			break;
+		}
+
+		default:
+		{
+			break;
+		}
+	}
+
+	/* the step is reset last, see copydb_metrics_collect() */
+	slot->step = PROGRESS_STEP_IDLE;
+}
+
+
+/*
+ * copydb_progress_add_wait adds the time elapsed since startTime to the wait
+ * time of the given slot.
+ */
+void
+copydb_progress_add_wait(ProgressSlot *slot, instr_time startTime)
+{
+	if (slot == NULL)
+	{
+		return;
+	}
+
+	instr_time duration;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, startTime);
+
+	slot->waitUs += INSTR_TIME_GET_MICROSEC(duration);
+}
+
+
+/*
+ * copydb_progress_read reads the progress area from the given file, in a
+ * malloc'ed area that the caller must free.
+ */
+bool
+copydb_progress_read(const char *filename, ProgressArea **area)
+{
+	int fd = open(filename, O_RDONLY);
+
+	if (fd == -1)
+	{
+		if (errno == ENOENT)
+		{
+			log_error("Progress file \"%s\" does not exist, "
+					  "is pgcopydb copying data now?",
+					  filename);
+		}
+		else
+		{
+			log_error("Failed to open progress file \"%s\": %m", filename);
+		}
+		return false;
+	}
+
+	struct stat st;
+
+	if (fstat(fd, &st) != 0)
+	{
+		log_error("Failed to stat progress file \"%s\": %m", filename);
+		close(fd);
+		return false;
+	}
+
+	size_t size = st.st_size;
+
+	if (size < sizeof(ProgressArea))
+	{
+		log_error("Progress file \"%s\" is too small: %lld bytes",
+				  filename,
+				  (long long) size);
+		close(fd);
+		return false;
+	}
+
+	ProgressArea *progress = (ProgressArea *) malloc(size);
+
+	if (progress == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		close(fd);
+		return false;
+	}
+
+	size_t done = 0;
+
+	while (done < size)
+	{
+		ssize_t bytes = read(fd, ((char *) progress) + done, size - done);
+
+		if (bytes <= 0)
+		{
+			if (bytes == -1 && errno == EINTR)
+			{
+				continue;
+			}
+
+			log_error("Failed to read progress file \"%s\": %m", filename);
+			free(progress);
+			close(fd);
+			return false;
+		}
+
+		done += bytes;
+	}
+
+	close(fd);
+
+	int count = progress->tableWorkers + progress->indexWorkers;
+
+	if (progress->magic != PROGRESS_MAGIC ||
+		progress->size != size ||
+		count < 0 ||
+		size != sizeof(ProgressArea) + count * sizeof(ProgressSlot))
+	{
+		log_error("Failed to parse progress file \"%s\"", filename);
+		free(progress);
+		return false;
+	}
+
+	*area = progress;
+
+	return true;
+}
+
+
+/*
+ * copydb_progress_slot returns the given slot of the progress area.
+ */
+static ProgressSlot *
+copydb_progress_slot(CopyDataSpec *specs, int slotIndex)
+{
+	ProgressSlot *slot = &(specs->progress->slots[slotIndex]);
+
+	slot->pid = getpid();
+
+	return slot;
+}
+
+
+/*
+ * copydb_progress_start fills-in the given progress slot for a new step.
+ */
+static void
+copydb_progress_start(ProgressSlot *slot,
+					  ProgressStep step,
+					  PGSQL *dst,
+					  uint32_t oid,
+					  const char *nspname,
+					  const char *relname)
+{
+	if (dst != NULL && dst->connection != NULL)
+	{
+		slot->backendPid = PQbackendPID(dst->connection);
+	}
+
+	slot->oid = oid;
+	slot->startTime = time(NULL);
+
+	strlcpy(slot->nspname, nspname, sizeof(slot->nspname));
+	strlcpy(slot->relname, relname, sizeof(slot->relname));
+
+	slot->stats.rows = 0;
+	slot->stats.bytes = 0;
+	slot->stats.flushes = 0;
+
+	/* the step is set last, readers skip idle slots */
+	slot->step = step;
+}
@@ -0,0 +1,701 @@
+/*
+ * src/bin/pgcopydb/refresh.c
+ *     Copy again only the tables that changed since a previous run
+ *
+ * Each run registers a change marker per table in the table doneFile: the
+ * table relfilenode and its cumulative count of inserted, updated, and
+ * deleted rows as found in pg_stat_user_tables. The markers are read before
+ * the snapshot is exported, so that a change that the COPY does not see
+ * always moves the marker after it has been read.
+ *
+ * The counters are only reliable from Postgres 15 on, where they are kept in
+ * shared memory: before that they are sent over UDP to the statistics
+ * collector, which may drop them. --refresh then requires Postgres 15.
+ *
+ * With pgcopydb copy data --refresh, the tables which marker is the same as
+ * in their doneFile are left alone, with their indexes. The other tables are
+ * truncated on the target and copied again, after their indexes and the
+ * foreign keys that involve them have been dropped, and then the indexes are
+ * built again by the index workers, and the foreign keys added again once
+ * all the tables have been copied.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "copydb.h"
+#include "defaults.h"
+#include "file_utils.h"
+#include "journal.h"
+#include "log.h"
+#include "pgsql.h"
+#include "schema.h"
+#include "string_utils.h"
+#include "summary.h"
+
+
+static int copydb_compare_marker_oid(const void *a, const void *b);
+static int copydb_compare_oid(const void *a, const void *b);
+static bool copydb_table_has_changed(CopyTableDataSpec *tableSpecs,
+									 bool *done,
+									 bool *changed);
+static bool copydb_refresh_drop_foreign_keys(CopyDataSpec *specs,
+											 PGSQL *dst,
+											 uint32_t *changedOids,
+											 int changedCount);
+static bool copydb_refresh_table(CopyDataSpec *specs,
+								 CopyTableDataSpec *tableSpecs,
+								 PGSQL *dst);
+static bool copydb_journal_dropped(CopyDataSpec *specs,
+								   uint32_t oid,
+								   const char *nspname,
+								   const char *relname,
+								   const char *sql);
+
+
+/*
+ * copydb_fetch_table_markers reads the change marker of each table of the
+ * source database, before the snapshot is exported. When using --snapshot,
+ * the markers would be more recent than the snapshot, so they are not used:
+ * the tables are then all copied again by the next --refresh run. The same
+ * goes for sources before Postgres 15, where the counters are not reliable.
+ */
+bool
+copydb_fetch_table_markers(CopyDataSpec *specs)
+{
+	SourceTableMarkerArray *markerArray = &(specs->tableMarkerArray);
+	PGSQL pgsql = { 0 };
+
+	if (specs->sourceSnapshot.state == SNAPSHOT_STATE_SET)
+	{
+		log_debug("Skipping tables change markers: --snapshot is in use");
+		return true;
+	}
+
+	int version = 0;
+
+	if (!pgsql_init(&pgsql, specs->source_pguri, PGSQL_CONN_SOURCE) ||
+		!pgsql_server_version_num(&pgsql, &version))
+	{
+		if (specs->refresh)
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		log_warn("Failed to fetch the tables change markers, "
+				 "the next --refresh run is going to copy all tables again");
+		return true;
+	}
+
+	/*
+	 * Before Postgres 15 the statistics collector receives the counters over
+	 * UDP, and drops them when under pressure: a table could then change
+	 * without its marker moving, and --refresh would skip it.
+	 */
+	if (version < 150000)
+	{
+		if (specs->refresh)
+		{
+			log_fatal("Option --refresh requires Postgres 15 or later on the "
+					  "source, found server_version_num %d", version);
+			log_fatal("Before Postgres 15 the table statistics counters "
+					  "might be lost, and changed tables could be skipped");
+			return false;
+		}
+
+		log_debug("Skipping tables change markers: source server version %d "
+				  "is before Postgres 15", version);
+		return true;
+	}
+
+	if (!schema_list_table_markers(&pgsql, markerArray))
+	{
+		if (specs->refresh)
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		log_warn("Failed to fetch the tables change markers, "
+				 "the next --refresh run is going to copy all tables again");
+		return true;
+	}
+
+	if (markerArray->count == 0 && specs->refresh)
+	{
+		log_warn("The source database has no table statistics, "
+				 "is track_counts off? All tables are copied again");
+	}
+
+	log_debug("Fetched change markers for %d tables", markerArray->count);
+
+	return true;
+}
+
+
+/*
+ * copydb_set_table_markers attaches its change marker to each table of the
+ * given array, when we have one.
+ */
+void
+copydb_set_table_markers(CopyDataSpec *specs, SourceTableArray *tableArray)
+{
+	SourceTableMarkerArray *markerArray = &(specs->tableMarkerArray);
+
+	for (int i = 0; i < tableArray->count; i++)
+	{
+		SourceTable *table = &(tableArray->array[i]);
+		SourceTableMarker key = { .oid = table->oid };
+
+		SourceTableMarker *marker =
+			markerArray->count == 0
+			? NULL
+			: (SourceTableMarker *) bsearch(&key,
+											markerArray->array,
+											markerArray->count,
+											sizeof(SourceTableMarker),
+											copydb_compare_marker_oid);
+
+		table->changeMarker = marker != NULL ? marker->marker : NULL;
+	}
+}
+
+
+/*
+ * copydb_prepare_refresh compares the change marker of each table with the
+ * one registered in its doneFile by the previous run. Unchanged tables are
+ * skipped entirely, and changed tables are prepared to be copied again. The
+ * tables without a doneFile are handled by copydb_prepare_resume() already.
+ */
+bool
+copydb_prepare_refresh(CopyDataSpec *specs)
+{
+	CopyTableDataSpecsArray *tableSpecsArray = &(specs->tableSpecsArray);
+
+	int unchangedCount = 0;
+	int changedCount = 0;
+
+	uint32_t *changedOids =
+		(uint32_t *) calloc(tableSpecsArray->count + 1, sizeof(uint32_t));
+
+	CopyTableDataSpec **changedSpecs =
+		(CopyTableDataSpec **) calloc(tableSpecsArray->count + 1,
+									  sizeof(CopyTableDataSpec *));
+
+	if (changedOids == NULL || changedSpecs == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		free(changedOids);
+		free(changedSpecs);
+		return false;
+	}
+
+	/* the parts of a split table are next to each other in the array */
+	for (int i = 0; i < tableSpecsArray->count; i++)
+	{
+		CopyTableDataSpec *tableSpecs = &(tableSpecsArray->array[i]);
+		int partCount = tableSpecs->part.partCount;
+
+		if (tableSpecs->part.partNumber != 0)
+		{
+			continue;
+		}
+
+		bool done = false;
+		bool changed = false;
+
+		if (!copydb_table_has_changed(tableSpecs, &done, &changed))
+		{
+			/* errors have already been logged */
+			free(changedOids);
+			free(changedSpecs);
+			return false;
+		}
+
+		if (!done)
+		{
+			continue;
+		}
+
+		if (changed)
+		{
+			changedOids[changedCount] = tableSpecs->sourceTable->oid;
+			changedSpecs[changedCount] = tableSpecs;
+			++changedCount;
+			continue;
+		}
+
+		for (int p = 0; p < partCount && (i + p) < tableSpecsArray->count; p++)
+		{
+			tableSpecsArray->array[i + p].unchanged = true;
+		}
+
+		/* create again the table doneFile that copydb_prepare_resume removed */
+		if (partCount > 1)
+		{
+			bool isLastPart = false;
+
+			if (!copydb_table_parts_are_all_done(tableSpecs, &isLastPart))
+			{
+				/* errors have already been logged */
+				free(changedOids);
+				free(changedSpecs);
+				return false;
+			}
+		}
+
+		++unchangedCount;
+	}
+
+	log_info("Refreshing a previous run: %d tables have not changed, "
+			 "%d tables have changed and are copied again",
+			 unchangedCount,
+			 changedCount);
+
+	if (changedCount == 0)
+	{
+		free(changedOids);
+		free(changedSpecs);
+		return true;
+	}
+
+	qsort(changedOids, changedCount, sizeof(uint32_t), copydb_compare_oid);
+
+	PGSQL dst = { 0 };
+
+	if (!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET))
+	{
+		/* errors have already been logged */
+		free(changedOids);
+		free(changedSpecs);
+		return false;
+	}
+
+	/* the journal has been loaded by copydb_prepare_resume() */
+	bool success =
+		copydb_refresh_drop_foreign_keys(specs, &dst, changedOids, changedCount);
+
+	for (int i = 0; success && i < changedCount; i++)
+	{
+		success = copydb_refresh_table(specs, changedSpecs[i], &dst);
+	}
+
+	free(changedOids);
+	free(changedSpecs);
+
+	if (!journal_sync(&(specs->journal)))
+	{
+		/* errors have already been logged */
+		success = false;
+	}
+
+	/* the index workers look-up the dropped objects in the journal */
+	if (!journal_load(&(specs->journal)))
+	{
+		/* errors have already been logged */
+		success = false;
+	}
+
+	return success;
+}
+
+
+/*
+ * copydb_refresh_foreign_keys adds again the foreign keys that have been
+ * dropped by copydb_prepare_refresh(), in this run or in an interrupted
+ * previous run, once all the tables have been copied and their indexes
+ * built.
+ */
+bool
+copydb_refresh_foreign_keys(CopyDataSpec *specs)
+{
+	SourceForeignKeyArray *fkeyArray = &(specs->sourceFkeyArray);
+
+	if (fkeyArray->count == 0)
+	{
+		return true;
+	}
+
+	if (!journal_load(&(specs->journal)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	int *fkeyIndexes = (int *) calloc(fkeyArray->count, sizeof(int));
+	int fkeyCount = 0;
+
+	if (fkeyIndexes == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	for (int i = 0; i < fkeyArray->count; i++)
+	{
+		SourceForeignKey *fkey = &(fkeyArray->array[i]);
+
+		if (journal_was_dropped(&(specs->journal), fkey->constraintOid))
+		{
+			fkeyIndexes[fkeyCount++] = i;
+		}
+	}
+
+	bool success = copydb_create_foreign_keys(specs, fkeyIndexes, fkeyCount);
+
+	free(fkeyIndexes);
+
+	return success;
+}
+
+
+/*
+ * copydb_table_has_changed reads the doneFile of each part of the table left
+ * by a previous run, if any, and compares the change marker found there with
+ * the current one. A table without a marker on either side is considered
+ * changed. The parts doneFiles are used rather than the table doneFile,
+ * which copydb_prepare_resume() removes for split tables.
+ */
+static bool
+copydb_table_has_changed(CopyTableDataSpec *tableSpecs,
+						 bool *done,
+						 bool *changed)
+{
+	SourceTable *table = tableSpecs->sourceTable;
+	int partCount = tableSpecs->part.partCount;
+
+	*done = true;
+	*changed = table->changeMarker == NULL;
+
+	for (int p = 0; p < partCount; p++)
+	{
+		/* tableSpecs is the first part, the other parts follow it */
+		TablePartFilePaths partPaths = { 0 };
+
+		(void) copydb_part_file_paths(tableSpecs + p, &partPaths);
+
+		if (!file_exists(partPaths.doneFile))
+		{
+			*done = false;
+			*changed = false;
+			return true;
+		}
+
+		/* read_table_summary writes into the SourceTable, use a copy */
+		SourceTable doneTable = { 0 };
+		CopyTableSummary summary = { .table = &doneTable };
+
+		if (!read_table_summary(&summary, partPaths.doneFile))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (table->changeMarker == NULL ||
+			IS_EMPTY_STRING_BUFFER(summary.changeMarker) ||
+			!streq(table->changeMarker, summary.changeMarker))
+		{
+			log_debug("Table \"%s\".\"%s\" part %d/%d has changed: "
+					  "marker \"%s\", previous run marker \"%s\"",
+					  table->nspname,
+					  table->relname,
+					  p + 1,
+					  partCount,
+					  table->changeMarker ? table->changeMarker : "",
+					  summary.changeMarker);
+
+			*changed = true;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_refresh_drop_foreign_keys drops the foreign keys of the changed
+ * tables, and the foreign keys that reference them, so that they can be
+ * truncated. The foreign keys are registered as dropped in the journal, see
+ * copydb_refresh_foreign_keys().
+ */
+static bool
+copydb_refresh_drop_foreign_keys(CopyDataSpec *specs,
+								 PGSQL *dst,
+								 uint32_t *changedOids,
+								 int changedCount)
+{
+	SourceForeignKeyArray *fkeyArray = &(specs->sourceFkeyArray);
+
+	if (fkeyArray->count == 0)
+	{
+		return true;
+	}
+
+	/* the DROP CONSTRAINT commands are sent as a single batch */
+	SourceForeignKey **fkeys =
+		(SourceForeignKey **) calloc(fkeyArray->count,
+									 sizeof(SourceForeignKey *));
+	char **commands = (char **) calloc(fkeyArray->count, sizeof(char *));
+	char *buffer = (char *) calloc(fkeyArray->count, BUFSIZE);
+
+	if (fkeys == NULL || commands == NULL || buffer == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		free(fkeys);
+		free(commands);
+		free(buffer);
+		return false;
+	}
+
+	int dropCount = 0;
+
+	for (int i = 0; i < fkeyArray->count; i++)
+	{
+		SourceForeignKey *fkey = &(fkeyArray->array[i]);
+
+		bool involved =
+			bsearch(&(fkey->tableOid), changedOids, changedCount,
+					sizeof(uint32_t), copydb_compare_oid) != NULL ||
+			bsearch(&(fkey->referencedTableOid), changedOids, changedCount,
+					sizeof(uint32_t), copydb_compare_oid) != NULL;
+
+		if (!involved)
+		{
+			continue;
+		}
+
+		char *sql = buffer + (size_t) dropCount * BUFSIZE;
+
+		sformat(sql, BUFSIZE,
+				"ALTER TABLE ONLY \"%s\".\"%s\" DROP CONSTRAINT IF EXISTS \"%s\"",
+				fkey->tableNamespace,
+				fkey->tableRelname,
+				fkey->constraintName);
+
+		log_info("%s;", sql);
+
+		fkeys[dropCount] = fkey;
+		commands[dropCount] = sql;
+		++dropCount;
+	}
+
+	bool success =
+		pgsql_execute_batch(dst, (const char **) commands, dropCount);
+
+	for (int i = 0; success && i < dropCount; i++)
+	{
+		success = copydb_journal_dropped(specs,
+										 fkeys[i]->constraintOid,
+										 fkeys[i]->tableNamespace,
+										 fkeys[i]->constraintName,
+										 commands[i]);
+	}
+
+	free(fkeys);
+	free(commands);
+	free(buffer);
+
+	/* errors have already been logged */
+	return success;
+}
+
+
+/*
+ * copydb_refresh_table drops the indexes and constraints of a changed table
+ * on the target, truncates it, and removes its doneFiles, so that the table
+ * workers copy it again and the index workers build its indexes again.
+ */
+static bool
+copydb_refresh_table(CopyDataSpec *specs,
+					 CopyTableDataSpec *tableSpecs,
+					 PGSQL *dst)
+{
+	CopyTableDataSpecsArray *tableSpecsArray = &(specs->tableSpecsArray);
+	SourceTable *table = tableSpecs->sourceTable;
+	SourceIndexArray *indexArray = &(tableSpecs->tableIndexArray);
+
+	/* the DROP commands and the TRUNCATE are sent as a single batch */
+	int commandCount = indexArray->count + 1;
+	char **commands = (char **) calloc(commandCount, sizeof(char *));
+	char *buffer = (char *) calloc(commandCount, BUFSIZE);
+
+	if (commands == NULL || buffer == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		free(commands);
+		free(buffer);
+		return false;
+	}
+
+	for (int i = 0; i < commandCount; i++)
+	{
+		commands[i] = buffer + (size_t) i * BUFSIZE;
+	}
+
+	/* COPY into a table without indexes, then build them in parallel */
+	for (int i = 0; i < indexArray->count; i++)
+	{
+		SourceIndex *index = &(indexArray->array[i]);
+		bool isConstraint = !IS_EMPTY_STRING_BUFFER(index->constraintName);
+
+		if (isConstraint)
+		{
+			sformat(commands[i], BUFSIZE,
+					"ALTER TABLE ONLY \"%s\".\"%s\" "
+					"DROP CONSTRAINT IF EXISTS \"%s\"",
+					table->nspname,
+					table->relname,
+					index->constraintName);
+		}
+		else
+		{
+			sformat(commands[i], BUFSIZE,
+					"DROP INDEX IF EXISTS \"%s\".\"%s\"",
+					index->indexNamespace,
+					index->indexRelname);
+		}
+
+		log_info("%s;", commands[i]);
+	}
+
+	sformat(commands[indexArray->count], BUFSIZE,
+			"TRUNCATE ONLY \"%s\".\"%s\"",
+			table->nspname,
+			table->relname);
+
+	log_info("%s;", commands[indexArray->count]);
+
+	if (!pgsql_execute_batch(dst, (const char **) commands, commandCount))
+	{
+		/* errors have already been logged */
+		free(commands);
+		free(buffer);
+		return false;
+	}
+
+	for (int i = 0; i < indexArray->count; i++)
+	{
+		SourceIndex *index = &(indexArray->array[i]);
+		bool isConstraint = !IS_EMPTY_STRING_BUFFER(index->constraintName);
+
+		if (!copydb_journal_dropped(specs,
+									index->indexOid,
+									index->indexNamespace,
+									index->indexRelname,
+									commands[i]) ||
+			(isConstraint &&
+			 !copydb_journal_dropped(specs,
+									 index->constraintOid,
+									 table->nspname,
+									 index->constraintName,
+									 commands[i])))
+		{
+			/* errors have already been logged */
+			free(commands);
+			free(buffer);
+			return false;
+		}
+	}
+
+	free(commands);
+	free(buffer);
+
+	/* the doneFiles go last, an interrupted refresh resumes from here */
+	int first = tableSpecs - tableSpecsArray->array;
+	int partCount = tableSpecs->part.partCount;
+
+	for (int p = 0; p < partCount && (first + p) < tableSpecsArray->count; p++)
+	{
+		TablePartFilePaths partPaths = { 0 };
+
+		(void) copydb_part_file_paths(&(tableSpecsArray->array[first + p]),
+									  &partPaths);
+
+		if (!unlink_file(partPaths.doneFile))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	TableFilePaths tablePaths = { 0 };
+
+	(void) copydb_table_file_paths(tableSpecs, &tablePaths);
+
+	if (!unlink_file(tablePaths.doneFile))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_journal_dropped registers in the journal that the given object has
+ * been dropped on the target, revoking its previous records.
+ */
+static bool
+copydb_journal_dropped(CopyDataSpec *specs,
+					   uint32_t oid,
+					   const char *nspname,
+					   const char *relname,
+					   const char *sql)
+{
+	JournalEntry entry = {
+		.oid = oid,
+		.kind = JOURNAL_RECORD_DROPPED,
+		.pid = getpid(),
+		.doneTime = time(NULL),
+		.nspname = nspname,
+		.relname = relname,
+		.command = sql
+	};
+
+	if (oid == 0)
+	{
+		return true;
+	}
+
+	if (!journal_append(&(specs->journal), &entry))
+	{
+		log_error("Failed to register dropped object \"%s\".\"%s\" "
+				  "in the journal",
+				  nspname,
+				  relname);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_compare_marker_oid is a bsearch() comparison function for table
+ * change markers, by table oid.
+ */
+static int
+copydb_compare_marker_oid(const void *a, const void *b)
+{
+	uint32_t oidA = ((const SourceTableMarker *) a)->oid;
+	uint32_t oidB = ((const SourceTableMarker *) b)->oid;
+
+	return oidA < oidB ? -1 : oidA > oidB ? 1 : 0;
+}
+
+
+/*
+ * copydb_compare_oid is a qsort() and bsearch() comparison function for an
+ * array of oids.
+ */
+static int
+copydb_compare_oid(const void *a, const void *b)
+{
+	uint32_t oidA = *((const uint32_t *) a);
+	uint32_t oidB = *((const uint32_t *) b);
+
+	return oidA < oidB ? -1 : oidA > oidB ? 1 : 0;
+}
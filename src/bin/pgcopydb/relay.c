@@ -0,0 +1,1422 @@
+/*
+ * src/bin/pgcopydb/relay.c
+ *     Compressed transport of COPY data between two pgcopydb processes
+ *
+ * When the source and the target databases are far apart, the COPY data
+ * crosses the slow link uncompressed with libpq. With --relay, the table
+ * workers next to the target database connect to a pgcopydb relay server
+ * running next to the source database instead: the relay server runs the
+ * COPY ... TO STDOUT on the source, and sends the data in compressed blocks
+ * over a TCP connection, which the table worker decompresses and sends to
+ * COPY ... FROM STDIN on the target.
+ *
+ * Each table worker opens a single relay connection and keeps it open, so
+ * the COPY streams of all the tables are multiplexed over --table-jobs long
+ * lived connections. The catalog queries and the snapshot still go through
+ * the --source connection, only the table data goes through the relay.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <lz4.h>
+
+#include "copydb.h"
+#include "env_utils.h"
+#include "log.h"
+#include "relay.h"
+#include "signals.h"
+#include "string_utils.h"
+
+
+/*
+ * A relay server connection runs the COPY of each request in a read-only
+ * transaction. Requests that use the same snapshot share a transaction, as
+ * the table workers do with their source connection.
+ */
+typedef struct RelaySession
+{
+	RelayServerSpecs *specs;
+	int fd;
+	PGSQL src;
+	bool inTransaction;
+	char snapshot[BUFSIZE];
+
+	RelayFrame frame;
+	char *block;                /* malloc'ed area of RELAY_BLOCK_SIZE */
+	uint32_t blockLen;
+	char *compressed;           /* malloc'ed area of RELAY_MAX_FRAME_SIZE */
+	bool broken;                /* the client connection failed */
+} RelaySession;
+
+/*
+ * Each table worker process has its own relay client connection, opened the
+ * first time the worker copies a table and kept open until the process
+ * exits.
+ */
+typedef struct RelayClient
+{
+	bool connected;
+	int fd;
+	SpoolCompression compression;
+
+	RelayFrame frame;
+	char *block;                /* malloc'ed area of RELAY_BLOCK_SIZE */
+} RelayClient;
+
+/* the state of a COPY stream read from the relay by a table worker */
+typedef struct RelayReader
+{
+	RelayClient *client;
+	bool done;                  /* complete or error frame received */
+	bool failed;
+	uint64_t rows;
+	uint64_t bytes;
+	uint64_t wireBytes;
+} RelayReader;
+
+static RelayClient relayClient = { 0 };
+
+
+static bool relay_listen(RelayServerSpecs *specs, int *listenFd);
+static bool relay_serve(RelayServerSpecs *specs, int fd);
+static bool relay_serve_hello(RelaySession *session);
+static bool relay_serve_copy(RelaySession *session);
+static bool relay_serve_begin(RelaySession *session, const char *snapshot);
+static bool relay_send_row(void *context, const char *row, int len);
+static bool relay_send_block(RelaySession *session);
+static void relay_session_reset(RelaySession *session);
+static bool relay_token_matches(const char *expected, const char *token);
+
+static bool relay_client_connect(const char *address);
+static void relay_client_close(void);
+static bool relay_next_block(void *context, const char **data, int *len);
+
+static bool relay_frame_init(RelayFrame *frame);
+static bool relay_send_frame(int fd, RelayFrameType type,
+							 const char *data, uint32_t len, uint32_t rawLen);
+static bool relay_recv_frame(int fd, RelayFrame *frame, bool *eof);
+static bool relay_write_all(int fd, const char *buf, size_t len);
+static bool relay_read_all(int fd, char *buf, size_t len, bool *eof);
+
+static bool relay_compress(SpoolCompression compression,
+						   const char *data, uint32_t len,
+						   char *frame, uint32_t *frameLen);
+static bool relay_decompress(SpoolCompression compression,
+							 RelayFrame *frame, char *block);
+
+
+/*
+ * relay_parse_address splits a host:port address in its host and port
+ * parts. The host part is optional, ":5433" listens on all the addresses.
+ */
+bool
+relay_parse_address(const char *address,
+					char *host, size_t hostSize,
+					char *port, size_t portSize)
+{
+	const char *colon = strrchr(address, ':');
+
+	if (colon == NULL || colon[1] == '\0')
+	{
+		log_error("Failed to parse address \"%s\": expected host:port",
+				  address);
+		return false;
+	}
+
+	size_t hostLen = colon - address;
+
+	if (hostLen >= hostSize || strlen(colon + 1) >= portSize)
+	{
+		log_error("Failed to parse address \"%s\": too long", address);
+		return false;
+	}
+
+	strlcpy(host, address, hostLen + 1);
+	strlcpy(port, colon + 1, portSize);
+
+	return true;
+}
+
+
+/*
+ * relay_server implements pgcopydb relay server: it accepts connections from
+ * the table workers of a pgcopydb process next to the target database, and
+ * forks a sub-process for each of them, until asked to stop.
+ */
+bool
+relay_server(RelayServerSpecs *specs)
+{
+	int listenFd = -1;
+
+	if (!relay_listen(specs, &listenFd))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	log_info("Relaying COPY data from \"%s\" at %s using %s compression",
+			 specs->source_pguri,
+			 specs->listen,
+			 spool_compression_to_string(specs->compression));
+
+	/* a client that goes away must not kill us */
+	pqsignal(SIGPIPE, SIG_IGN);
+
+	int connections = 0;
+
+	while (!(asked_to_quit || asked_to_stop || asked_to_stop_fast))
+	{
+		/* reap the sub-processes of the connections that are done */
+		int status = 0;
+		pid_t pid;
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		{
+			--connections;
+			log_debug("Relay connection process %d exited with code %d, "
+					  "%d connections still open",
+					  pid,
+					  WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+					  connections);
+		}
+
+		struct pollfd pfd = { .fd = listenFd, .events = POLLIN };
+
+		int ret = poll(&pfd, 1, RELAY_POLL_TIMEOUT_MS);
+
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			log_error("Failed to poll the relay server socket: %m");
+			close(listenFd);
+			return false;
+		}
+
+		if (ret == 0)
+		{
+			continue;
+		}
+
+		int clientFd = accept(listenFd, NULL, NULL);
+
+		if (clientFd == -1)
+		{
+			log_debug("Failed to accept a relay connection: %m");
+			continue;
+		}
+
+		if (connections >= specs->maxConnections)
+		{
+			log_warn("Refusing a relay connection: %d connections are open, "
+					 "see --max-connections",
+					 connections);
+			close(clientFd);
+			continue;
+		}
+
+		/* flush stdio channels just before fork, to avoid double-output */
+		fflush(stdout);
+		fflush(stderr);
+
+		int fpid = fork();
+
+		switch (fpid)
+		{
+			case -1:
+			{
+				log_error("Failed to fork a relay connection process: %m");
+				close(clientFd);
+				break;
+			}
+
+			case 0:
+			{
+				/* child process serves the connection */
+				close(listenFd);
+
+				bool success = relay_serve(specs, clientFd);
+
+				close(clientFd);
+
+				exit(success ? EXIT_CODE_QUIT : EXIT_CODE_INTERNAL_ERROR);
+			}
+
+			default:
+			{
+				/* fork succeeded, in parent */
+				close(clientFd);
+				++connections;
+
+				log_info("Accepted relay connection %d, "
+						 "%d connections now open",
+						 fpid,
+						 connections);
+				break;
+			}
+		}
+	}
+
+	close(listenFd);
+
+	/* the connection processes got the same signal, wait for them */
+	while (wait(NULL) > 0)
+	{ }
+
+	return true;
+}
+
+
+/*
+ * relay_listen opens the TCP socket that the relay server listens to.
+ */
+static bool
+relay_listen(RelayServerSpecs *specs, int *listenFd)
+{
+	char host[BUFSIZE] = { 0 };
+	char port[NAMEDATALEN] = { 0 };
+
+	if (!relay_parse_address(specs->listen,
+							 host, sizeof(host),
+							 port, sizeof(port)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE
+	};
+	struct addrinfo *addrs = NULL;
+
+	int err = getaddrinfo(IS_EMPTY_STRING_BUFFER(host) ? NULL : host,
+						  port, &hints, &addrs);
+
+	if (err != 0)
+	{
+		log_error("Failed to resolve relay address \"%s\": %s",
+				  specs->listen,
+				  gai_strerror(err));
+		return false;
+	}
+
+	int fd = -1;
+
+	for (struct addrinfo *addr = addrs; addr != NULL; addr = addr->ai_next)
+	{
+		fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+
+		if (fd == -1)
+		{
+			continue;
+		}
+
+		int on = 1;
+
+		(void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		if (bind(fd, addr->ai_addr, addr->ai_addrlen) == 0 &&
+			listen(fd, RELAY_LISTEN_BACKLOG) == 0)
+		{
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(addrs);
+
+	if (fd == -1)
+	{
+		log_error("Failed to listen for relay connections at \"%s\": %m",
+				  specs->listen);
+		return false;
+	}
+
+	*listenFd = fd;
+
+	return true;
+}
+
+
+/*
+ * relay_serve serves the requests of a relay client connection, one COPY
+ * stream after the other, until the client closes the connection.
+ */
+static bool
+relay_serve(RelayServerSpecs *specs, int fd)
+{
+	RelaySession session = {
+		.specs = specs,
+		.fd = fd,
+		.inTransaction = false,
+		.snapshot = { 0 },
+		.blockLen = 0,
+		.broken = false
+	};
+
+	int on = 1;
+
+	(void) setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+
+	/* authenticate the client before allocating anything on its behalf */
+	if (!relay_serve_hello(&session))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	session.block = (char *) malloc(RELAY_BLOCK_SIZE * sizeof(char));
+	session.compressed = (char *) malloc(RELAY_MAX_FRAME_SIZE * sizeof(char));
+
+	if (session.block == NULL ||
+		session.compressed == NULL ||
+		!relay_frame_init(&(session.frame)))
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	if (!pgsql_init(&(session.src), specs->source_pguri, PGSQL_CONN_SOURCE))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	const char *compression =
+		spool_compression_to_string(specs->compression);
+
+	if (!relay_send_frame(fd, RELAY_FRAME_READY,
+						  compression, strlen(compression) + 1, 0))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	bool success = true;
+
+	for (;;)
+	{
+		bool eof = false;
+
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			break;
+		}
+
+		if (!relay_recv_frame(fd, &(session.frame), &eof))
+		{
+			/* the client is gone: not our problem, just stop here */
+			if (!eof)
+			{
+				success = false;
+			}
+			break;
+		}
+
+		if (session.frame.type != RELAY_FRAME_REQUEST)
+		{
+			log_error("Received unexpected relay frame '%c'",
+					  session.frame.type);
+			success = false;
+			break;
+		}
+
+		if (!relay_serve_copy(&session))
+		{
+			/* errors have already been logged */
+			success = false;
+			break;
+		}
+	}
+
+	relay_session_reset(&session);
+
+	return success;
+}
+
+
+/*
+ * relay_serve_hello checks the protocol version and the token that the
+ * client sends first. The hello frame is read in a small area, and must
+ * arrive within RELAY_HELLO_TIMEOUT_MS, so that a client that does not
+ * authenticate neither gets the large frame areas allocated nor keeps the
+ * connection slot for long. relay_serve() then answers with a ready frame.
+ */
+static bool
+relay_serve_hello(RelaySession *session)
+{
+	char hello[RELAY_HELLO_MAX_SIZE] = { 0 };
+	RelayFrame helloFrame = { .size = sizeof(hello), .data = hello };
+	RelayFrame *frame = &helloFrame;
+	bool eof = false;
+
+	struct timeval timeout = {
+		.tv_sec = RELAY_HELLO_TIMEOUT_MS / 1000,
+		.tv_usec = (RELAY_HELLO_TIMEOUT_MS % 1000) * 1000
+	};
+
+	(void) setsockopt(session->fd, SOL_SOCKET, SO_RCVTIMEO,
+					  &timeout, sizeof(timeout));
+
+	if (!relay_recv_frame(session->fd, frame, &eof))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* the COPY requests of an authenticated client have no time limit */
+	struct timeval noTimeout = { 0 };
+
+	(void) setsockopt(session->fd, SOL_SOCKET, SO_RCVTIMEO,
+					  &noTimeout, sizeof(noTimeout));
+
+	/* the hello frame payload is: protocol \0 token \0 */
+	const char *protocol = frame->data;
+	const char *protocolEnd = memchr(frame->data, '\0', frame->len);
+
+	const char *token = protocolEnd == NULL ? NULL : protocolEnd + 1;
+	const char *tokenEnd =
+		token == NULL
+		? NULL
+		: memchr(token, '\0', frame->len - (token - frame->data));
+
+	if (frame->type != RELAY_FRAME_HELLO ||
+		tokenEnd == NULL ||
+		strcmp(protocol, RELAY_PROTOCOL) != 0)
+	{
+		const char *message = "Failed to parse relay hello: "
+							  "expected protocol " RELAY_PROTOCOL;
+
+		log_error("%s", message);
+		(void) relay_send_frame(session->fd, RELAY_FRAME_ERROR,
+								message, strlen(message), 0);
+		return false;
+	}
+
+	if (!relay_token_matches(session->specs->token, token))
+	{
+		const char *message = "Relay authentication failed: "
+							  "PGCOPYDB_RELAY_TOKEN does not match";
+
+		log_error("%s", message);
+		(void) relay_send_frame(session->fd, RELAY_FRAME_ERROR,
+								message, strlen(message), 0);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * relay_serve_copy runs the COPY ... TO STDOUT of a request frame on the
+ * source database, and sends the data to the client in compressed blocks,
+ * followed by either a complete frame or an error frame.
+ */
+static bool
+relay_serve_copy(RelaySession *session)
+{
+	RelayFrame *frame = &(session->frame);
+
+	/* the request frame payload is: format \0 snapshot \0 query \0 */
+	char *fields[3] = { 0 };
+	char *ptr = frame->data;
+	char *end = frame->data + frame->len;
+
+	for (int i = 0; i < 3; i++)
+	{
+		char *fieldEnd = ptr < end ? memchr(ptr, '\0', end - ptr) : NULL;
+
+		if (fieldEnd == NULL)
+		{
+			log_error("Failed to parse relay request frame");
+			return false;
+		}
+
+		fields[i] = ptr;
+		ptr = fieldEnd + 1;
+	}
+
+	/* the query might list many columns, it stays in the frame area */
+	const char *query = fields[2];
+	char snapshot[BUFSIZE] = { 0 };
+	CopyFormat format = COPY_FORMAT_TEXT;
+
+	strlcpy(snapshot, fields[1], sizeof(snapshot));
+
+	if (!copy_format_from_string(fields[0], &format))
+	{
+		log_error("Failed to parse relay request COPY format \"%s\"",
+				  fields[0]);
+		return false;
+	}
+
+	log_info("COPY %s", query);
+
+	if (!relay_serve_begin(session, snapshot))
+	{
+		const char *message = "Failed to open a transaction on the source";
+
+		relay_session_reset(session);
+
+		return relay_send_frame(session->fd, RELAY_FRAME_ERROR,
+								message, strlen(message), 0);
+	}
+
+	CopyArgs args = {
+		.srcQname = query,
+		.dstQname = NULL,
+		.format = format,
+		.keepConnections = true
+	};
+
+	CopyStats stats = { 0 };
+
+	session->blockLen = 0;
+
+	bool copied =
+		pg_copy_to_rows(&(session->src), &args, &relay_send_row, session, &stats);
+
+	if (session->broken)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!copied)
+	{
+		char message[BUFSIZE] = { 0 };
+
+		sformat(message, sizeof(message),
+				"Failed to COPY %s on the source, see relay logs for details",
+				query);
+
+		relay_session_reset(session);
+
+		return relay_send_frame(session->fd, RELAY_FRAME_ERROR,
+								message, strlen(message), 0);
+	}
+
+	if (!relay_send_block(session))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* without a snapshot, each COPY is its own transaction */
+	if (IS_EMPTY_STRING_BUFFER(snapshot))
+	{
+		if (!pgsql_commit(&(session->src)))
+		{
+			/* errors have already been logged */
+			relay_session_reset(session);
+		}
+
+		session->inTransaction = false;
+	}
+
+	char complete[BUFSIZE] = { 0 };
+
+	sformat(complete, sizeof(complete), "%" PRIu64 " %" PRIu64,
+			stats.rows,
+			stats.bytes);
+
+	return relay_send_frame(session->fd, RELAY_FRAME_COMPLETE,
+							complete, strlen(complete) + 1, 0);
+}
+
+
+/*
+ * relay_serve_begin opens the read-only transaction of a request, in the
+ * given snapshot when it is not empty. A transaction that already uses the
+ * same snapshot is re-used.
+ */
+static bool
+relay_serve_begin(RelaySession *session, const char *snapshot)
+{
+	PGSQL *src = &(session->src);
+	bool useSnapshot = !IS_EMPTY_STRING_BUFFER(snapshot);
+
+	if (session->inTransaction)
+	{
+		if (useSnapshot && strcmp(session->snapshot, snapshot) == 0)
+		{
+			return true;
+		}
+
+		if (!pgsql_commit(src))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		session->inTransaction = false;
+	}
+
+	if (!pgsql_begin(src))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	IsolationLevel level =
+		useSnapshot ? ISOLATION_REPEATABLE_READ : ISOLATION_READ_COMMITTED;
+
+	if (!pgsql_set_transaction(src, level, true, false))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (useSnapshot && !pgsql_set_snapshot(src, snapshot))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	session->inTransaction = true;
+	strlcpy(session->snapshot, snapshot, sizeof(session->snapshot));
+
+	return true;
+}
+
+
+/*
+ * relay_send_row is a CopyRowCB: it appends the COPY data to the current
+ * block, and sends the block when it is full. The block boundaries do not
+ * follow the row boundaries, COPY ... FROM STDIN does not need them to.
+ */
+static bool
+relay_send_row(void *context, const char *row, int len)
+{
+	RelaySession *session = (RelaySession *) context;
+
+	while (len > 0)
+	{
+		uint32_t room = RELAY_BLOCK_SIZE - session->blockLen;
+		uint32_t count = (uint32_t) len < room ? (uint32_t) len : room;
+
+		memcpy(session->block + session->blockLen, row, count);
+
+		session->blockLen += count;
+		row += count;
+		len -= count;
+
+		if (session->blockLen == RELAY_BLOCK_SIZE && !relay_send_block(session))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * relay_send_block compresses the current block and sends it in a data
+ * frame.
+ */
+static bool
+relay_send_block(RelaySession *session)
+{
+	if (session->blockLen == 0)
+	{
+		return true;
+	}
+
+	uint32_t frameLen = 0;
+
+	if (!relay_compress(session->specs->compression,
+						session->block, session->blockLen,
+						session->compressed, &frameLen))
+	{
+		/* errors have already been logged */
+		session->broken = true;
+		return false;
+	}
+
+	if (!relay_send_frame(session->fd, RELAY_FRAME_DATA,
+						  session->compressed, frameLen, session->blockLen))
+	{
+		/* errors have already been logged */
+		session->broken = true;
+		return false;
+	}
+
+	session->blockLen = 0;
+
+	return true;
+}
+
+
+/*
+ * relay_session_reset closes the source connection of a session, which ends
+ * its read-only transaction, and the next request then opens a new one.
+ */
+static void
+relay_session_reset(RelaySession *session)
+{
+	pgsql_finish(&(session->src));
+
+	session->inTransaction = false;
+	session->snapshot[0] = '\0';
+}
+
+
+/*
+ * relay_token_matches compares the expected token and the one sent by the
+ * client, in a time that does not depend on where they differ.
+ */
+static bool
+relay_token_matches(const char *expected, const char *token)
+{
+	size_t expectedLen = strlen(expected);
+	size_t tokenLen = strlen(token);
+	unsigned char diff = expectedLen == tokenLen ? 0 : 1;
+
+	for (size_t i = 0; i < expectedLen; i++)
+	{
+		unsigned char c = i < tokenLen ? token[i] : 0;
+
+		diff |= expected[i] ^ c;
+	}
+
+	return diff == 0;
+}
+
+
+/*
+ * copydb_relay_copy_table_data sends a request for the COPY of the given
+ * table (or table part) to the relay server, and sends the decompressed
+ * data to COPY ... FROM STDIN on the target connection.
+ */
+bool
+copydb_relay_copy_table_data(CopyTableDataSpec *tableSpecs,
+							 PGSQL *dst,
+							 CopyArgs *args,
+							 CopyStats *stats)
+{
+	RelayClient *client = &relayClient;
+
+	if (!client->connected && !relay_client_connect(tableSpecs->relayAddress))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	TransactionSnapshot *snapshot = tableSpecs->sourceSnapshot;
+	bool useSnapshot =
+		snapshot->state == SNAPSHOT_STATE_EXPORTED ||
+		snapshot->state == SNAPSHOT_STATE_SET;
+
+	const char *format = CopyFormatToString(args->format);
+	const char *snapshotId = useSnapshot ? snapshot->snapshot : "";
+
+	/* the frame area is not in use until we read the answer */
+	char *request = client->frame.data;
+	size_t formatLen = strlen(format) + 1;
+	size_t snapshotLen = strlen(snapshotId) + 1;
+	size_t queryLen = strlen(args->srcQname) + 1;
+
+	if (formatLen + snapshotLen + queryLen > client->frame.size)
+	{
+		log_error("Failed to prepare relay request for %s: too long",
+				  args->srcQname);
+		return false;
+	}
+
+	memcpy(request, format, formatLen);
+	memcpy(request + formatLen, snapshotId, snapshotLen);
+	memcpy(request + formatLen + snapshotLen, args->srcQname, queryLen);
+
+	if (!relay_send_frame(client->fd, RELAY_FRAME_REQUEST,
+						  request, formatLen + snapshotLen + queryLen, 0))
+	{
+		/* errors have already been logged */
+		relay_client_close();
+		return false;
+	}
+
+	RelayReader reader = {
+		.client = client,
+		.done = false,
+		.failed = false
+	};
+
+	bool copied = pg_copy_from_rows(dst, args, &relay_next_block, &reader, stats);
+
+	/* the stream is out of sync when we stopped reading it early */
+	if (!reader.done)
+	{
+		relay_client_close();
+	}
+
+	if (copied && (reader.failed || !reader.done))
+	{
+		log_error("Failed to relay COPY data for table \"%s\".\"%s\" "
+				  "part %d/%d, see above for details",
+				  tableSpecs->sourceTable->nspname,
+				  tableSpecs->sourceTable->relname,
+				  tableSpecs->part.partNumber + 1,
+				  tableSpecs->part.partCount);
+
+		(void) pgsql_execute(dst, "ROLLBACK");
+
+		return false;
+	}
+
+	if (!copied)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* pg_copy_from_rows counted blocks, the relay server counted rows */
+	stats->rows = reader.rows;
+
+	char bytesPretty[BUFSIZE] = { 0 };
+	char wirePretty[BUFSIZE] = { 0 };
+
+	pretty_print_bytes(bytesPretty, sizeof(bytesPretty), reader.bytes);
+	pretty_print_bytes(wirePretty, sizeof(wirePretty), reader.wireBytes);
+
+	log_debug("Relayed %s of COPY data for \"%s\".\"%s\" as %s",
+			  bytesPretty,
+			  tableSpecs->sourceTable->nspname,
+			  tableSpecs->sourceTable->relname,
+			  wirePretty);
+
+	return true;
+}
+
+
+/*
+ * relay_client_connect opens the relay connection of this table worker, and
+ * sends the hello frame.
+ */
+static bool
+relay_client_connect(const char *address)
+{
+	RelayClient *client = &relayClient;
+
+	char host[BUFSIZE] = { 0 };
+	char port[NAMEDATALEN] = { 0 };
+	char token[BUFSIZE] = { 0 };
+
+	if (!relay_parse_address(address, host, sizeof(host), port, sizeof(port)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (env_exists(PGCOPYDB_RELAY_TOKEN) &&
+		!get_env_copy(PGCOPYDB_RELAY_TOKEN, token, sizeof(token)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (client->block == NULL)
+	{
+		client->block = (char *) malloc(RELAY_BLOCK_SIZE * sizeof(char));
+
+		if (client->block == NULL || !relay_frame_init(&(client->frame)))
+		{
+			log_error(ALLOCATION_FAILED_ERROR);
+			return false;
+		}
+	}
+
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM
+	};
+	struct addrinfo *addrs = NULL;
+
+	int err = getaddrinfo(host, port, &hints, &addrs);
+
+	if (err != 0)
+	{
+		log_error("Failed to resolve relay address \"%s\": %s",
+				  address,
+				  gai_strerror(err));
+		return false;
+	}
+
+	int fd = -1;
+
+	for (struct addrinfo *addr = addrs; addr != NULL; addr = addr->ai_next)
+	{
+		fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+
+		if (fd == -1)
+		{
+			continue;
+		}
+
+		if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0)
+		{
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(addrs);
+
+	if (fd == -1)
+	{
+		log_error("Failed to connect to relay server at \"%s\": %m", address);
+		return false;
+	}
+
+	int on = 1;
+
+	(void) setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+
+	/* a relay server that goes away must not kill us */
+	pqsignal(SIGPIPE, SIG_IGN);
+
+	client->fd = fd;
+	client->connected = true;
+
+	/* the hello frame payload is: protocol \0 token \0 */
+	char hello[BUFSIZE + NAMEDATALEN] = { 0 };
+	size_t protocolLen = strlen(RELAY_PROTOCOL) + 1;
+	size_t tokenLen = strlen(token) + 1;
+
+	memcpy(hello, RELAY_PROTOCOL, protocolLen);
+	memcpy(hello + protocolLen, token, tokenLen);
+
+	bool eof = false;
+	RelayFrame *frame = &(client->frame);
+
+	if (!relay_send_frame(fd, RELAY_FRAME_HELLO,
+						  hello, protocolLen + tokenLen, 0) ||
+		!relay_recv_frame(fd, frame, &eof))
+	{
+		/* errors have already been logged */
+		relay_client_close();
+		return false;
+	}
+
+	if (frame->type == RELAY_FRAME_ERROR)
+	{
+		log_error("Relay server at \"%s\" refused the connection: %.*s",
+				  address,
+				  (int) frame->len,
+				  frame->data);
+		relay_client_close();
+		return false;
+	}
+
+	if (frame->type != RELAY_FRAME_READY ||
+		memchr(frame->data, '\0', frame->len) == NULL ||
+		!spool_compression_from_string(frame->data, &(client->compression)))
+	{
+		log_error("Failed to parse relay server answer at \"%s\"", address);
+		relay_client_close();
+		return false;
+	}
+
+	log_info("Connected to relay server at \"%s\" using %s compression",
+			 address,
+			 spool_compression_to_string(client->compression));
+
+	return true;
+}
+
+
+/*
+ * relay_client_close closes the relay connection, the next table opens a new
+ * one.
+ */
+static void
+relay_client_close(void)
+{
+	RelayClient *client = &relayClient;
+
+	if (client->connected)
+	{
+		close(client->fd);
+	}
+
+	client->connected = false;
+	client->fd = -1;
+}
+
+
+/*
+ * relay_next_block is a CopyNextRowCB: it returns the next decompressed
+ * block of COPY data received from the relay server, and false once the
+ * server has sent the end of the stream, or when the stream failed.
+ */
+static bool
+relay_next_block(void *context, const char **data, int *len)
+{
+	RelayReader *reader = (RelayReader *) context;
+	RelayClient *client = reader->client;
+	RelayFrame *frame = &(client->frame);
+	bool eof = false;
+
+	if (reader->done)
+	{
+		return false;
+	}
+
+	if (!relay_recv_frame(client->fd, frame, &eof))
+	{
+		if (eof)
+		{
+			log_error("Relay server closed the connection unexpectedly");
+		}
+
+		reader->failed = true;
+		return false;
+	}
+
+	switch (frame->type)
+	{
+		case RELAY_FRAME_DATA:
+		{
+			if (!relay_decompress(client->compression, frame, client->block))
+			{
+				/* errors have already been logged */
+				reader->failed = true;
+				return false;
+			}
+
+			reader->bytes += frame->rawLen;
+			reader->wireBytes += RELAY_FRAME_HEADER_SIZE + frame->len;
+
+			*data = client->block;
+			*len = (int) frame->rawLen;
+
+			return true;
+		}
+
+		case RELAY_FRAME_COMPLETE:
+		{
+			reader->done = true;
+
+			if (memchr(frame->data, '\0', frame->len) == NULL ||
+				sscanf(frame->data, "%" SCNu64 " %" SCNu64,
+					   &(reader->rows), &(reader->bytes)) != 2)
+			{
+				log_error("Failed to parse relay complete frame");
+				reader->failed = true;
+			}
+
+			return false;
+		}
+
+		case RELAY_FRAME_ERROR:
+		{
+			log_error("Relay server: %.*s", (int) frame->len, frame->data);
+
+			reader->done = true;
+			reader->failed = true;
+
+			return false;
+		}
+
+		default:
+		{
+			log_error("Received unexpected relay frame '%c'", frame->type);
+			reader->failed = true;
+			return false;
+		}
+	}
+}
+
+
+/*
+ * relay_frame_init allocates the data area of a frame.
+ */
+static bool
+relay_frame_init(RelayFrame *frame)
+{
+	frame->size = RELAY_MAX_FRAME_SIZE;
+	frame->data = (char *) malloc(RELAY_MAX_FRAME_SIZE * sizeof(char));
+
+	return frame->data != NULL;
+}
+
+
+/*
+ * relay_send_frame writes a frame header and its data to the given socket.
+ */
+static bool
+relay_send_frame(int fd, RelayFrameType type,
+				 const char *data, uint32_t len, uint32_t rawLen)
+{
+	unsigned char header[RELAY_FRAME_HEADER_SIZE] = { 0 };
+
+	header[0] = (unsigned char) type;
+
+	for (int i = 0; i < 4; i++)
+	{
+		header[1 + i] = (len >> (24 - 8 * i)) & 0xFF;
+		header[5 + i] = (rawLen >> (24 - 8 * i)) & 0xFF;
+	}
+
+	if (!relay_write_all(fd, (char *) header, sizeof(header)) ||
+		!relay_write_all(fd, data, len))
+	{
+		log_error("Failed to send relay frame: %m");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * relay_recv_frame reads the next frame from the given socket. When the
+ * connection is closed before the frame header, eof is set to true.
+ */
+static bool
+relay_recv_frame(int fd, RelayFrame *frame, bool *eof)
+{
+	unsigned char header[RELAY_FRAME_HEADER_SIZE] = { 0 };
+
+	*eof = false;
+
+	if (!relay_read_all(fd, (char *) header, sizeof(header), eof))
+	{
+		/* SO_RCVTIMEO is set while waiting for the hello frame */
+		if (!*eof && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			log_error("Failed to receive relay frame: timed out");
+		}
+		else if (!*eof)
+		{
+			log_error("Failed to receive relay frame: %m");
+		}
+		return false;
+	}
+
+	frame->type = (RelayFrameType) header[0];
+	frame->len = 0;
+	frame->rawLen = 0;
+
+	for (int i = 0; i < 4; i++)
+	{
+		frame->len = (frame->len << 8) | header[1 + i];
+		frame->rawLen = (frame->rawLen << 8) | header[5 + i];
+	}
+
+	if (frame->len > frame->size || frame->rawLen > RELAY_BLOCK_SIZE)
+	{
+		log_error("Received relay frame '%c' of %u bytes (%u uncompressed), "
+				  "larger than the maximum",
+				  frame->type,
+				  frame->len,
+				  frame->rawLen);
+		return false;
+	}
+
+	bool dataEof = false;
+
+	if (!relay_read_all(fd, frame->data, frame->len, &dataEof))
+	{
+		log_error("Failed to receive relay frame: %s",
+				  dataEof ? "connection closed" : strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * relay_write_all writes the whole buffer to the given socket.
+ */
+static bool
+relay_write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t count = send(fd, buf, len, 0);
+
+		if (count == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+
+		buf += count;
+		len -= count;
+	}
+
+	return true;
+}
+
+
+/*
+ * relay_read_all fills-in the whole buffer from the given socket. When the
+ * connection is closed first, eof is set to true.
+ */
+static bool
+relay_read_all(int fd, char *buf, size_t len, bool *eof)
+{
+	while (len > 0)
+	{
+		ssize_t count = recv(fd, buf, len, 0);
+
+		if (count == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+
+		if (count == 0)
+		{
+			*eof = true;
+			return false;
+		}
+
+		buf += count;
+		len -= count;
+	}
+
+	return true;
+}
+
+
+/*
+ * relay_compress compresses a block of COPY data in the given frame buffer,
+ * of RELAY_MAX_FRAME_SIZE bytes.
+ */
+static bool
+relay_compress(SpoolCompression compression,
+			   const char *data, uint32_t len,
+			   char *frame, uint32_t *frameLen)
+{
+	switch (compression)
+	{
+		case SPOOL_COMPRESSION_NONE:
+		{
+			memcpy(frame, data, len);
+			*frameLen = len;
+			return true;
+		}
+
+		case SPOOL_COMPRESSION_LZ4:
+		{
+			int count = LZ4_compress_default(data, frame, (int) len,
+											 RELAY_MAX_FRAME_SIZE);
+
+			if (count <= 0)
+			{
+				log_error("Failed to compress COPY data with lz4");
+				return false;
+			}
+
+			*frameLen = (uint32_t) count;
+			return true;
+		}
+
+		case SPOOL_COMPRESSION_ZSTD:
+		{
+			size_t count = ZSTD_compress(frame, RELAY_MAX_FRAME_SIZE,
+										 data, len,
+										 SPOOL_ZSTD_LEVEL);
+
+			if (ZSTD_isError(count))
+			{
+				log_error("Failed to compress COPY data with zstd: %s",
+						  ZSTD_getErrorName(count));
+				return false;
+			}
+
+			*frameLen = (uint32_t) count;
+			return true;
+		}
+	}
+
+	log_error("BUG: relay_compress called with compression %d", compression);
+	return false;
+}
+
+
+/*
+ * relay_decompress decompresses a data frame in the given block, of
+ * RELAY_BLOCK_SIZE bytes.
+ */
+static bool
+relay_decompress(SpoolCompression compression, RelayFrame *frame, char *block)
+{
+	switch (compression)
+	{
+		case SPOOL_COMPRESSION_NONE:
+		{
+			if (frame->len != frame->rawLen)
+			{
+				break;
+			}
+
+			memcpy(block, frame->data, frame->len);
+			return true;
+		}
+
+		case SPOOL_COMPRESSION_LZ4:
+		{
+			int count = LZ4_decompress_safe(frame->data, block,
+											(int) frame->len,
+											RELAY_BLOCK_SIZE);
+
+			if (count < 0 || (uint32_t) count != frame->rawLen)
+			{
+				break;
+			}
+
+			return true;
+		}
+
+		case SPOOL_COMPRESSION_ZSTD:
+		{
+			size_t count = ZSTD_decompress(block, RELAY_BLOCK_SIZE,
+										   frame->data, frame->len);
+
+			if (ZSTD_isError(count) || count != frame->rawLen)
+			{
+				break;
+			}
+
+			return true;
+		}
+	}
+
+	log_error("Failed to decompress relay data frame of %u bytes "
+			  "(%u uncompressed) using %s",
+			  frame->len,
+			  frame->rawLen,
+			  spool_compression_to_string(compression));
+
+	return false;
+}
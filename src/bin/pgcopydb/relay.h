@@ -0,0 +1,77 @@
+/*
+ * src/bin/pgcopydb/relay.h
+ *     Compressed transport of COPY data between two pgcopydb processes
+ */
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pgsql.h"
+#include "spool.h"
+
+/* sent in the hello frame, bump when the frames change */
+#define RELAY_PROTOCOL "pgcopydb-relay-1"
+
+/* the COPY data is compressed in blocks of that size */
+#define RELAY_BLOCK_SIZE (256 * 1024)
+
+/* type (1 byte), length (4 bytes), uncompressed length (4 bytes) */
+#define RELAY_FRAME_HEADER_SIZE 9
+
+/* larger frames are a protocol error, a block compresses to less than that */
+#define RELAY_MAX_FRAME_SIZE (2 * RELAY_BLOCK_SIZE)
+
+/* the hello frame is read before allocating the large frame areas */
+#define RELAY_HELLO_MAX_SIZE (2 * BUFSIZE)
+#define RELAY_HELLO_TIMEOUT_MS 10000
+
+#define RELAY_LISTEN_BACKLOG 64
+#define RELAY_POLL_TIMEOUT_MS 1000
+#define RELAY_MAX_CONNECTIONS 64
+
+/*
+ * The relay frames. The client sends a hello frame once, and then a request
+ * frame per table (or table part) to COPY. The server answers the hello frame
+ * with a ready frame, and each request with data frames followed by either a
+ * complete or an error frame. A connection then carries the COPY streams of
+ * all the tables that a table worker processes, one after the other.
+ */
+typedef enum
+{
+	RELAY_FRAME_HELLO = 'H',    /* protocol, token */
+	RELAY_FRAME_READY = 'R',    /* compression method */
+	RELAY_FRAME_REQUEST = 'Q',  /* copy format, snapshot, table or query */
+	RELAY_FRAME_DATA = 'D',     /* a compressed block of COPY data */
+	RELAY_FRAME_COMPLETE = 'C', /* rows and bytes, as text */
+	RELAY_FRAME_ERROR = 'E'     /* error message */
+} RelayFrameType;
+
+typedef struct RelayFrame
+{
+	RelayFrameType type;
+	uint32_t len;
+	uint32_t rawLen;            /* uncompressed length of a data frame */
+	uint32_t size;              /* allocated size of the data area */
+	char *data;                 /* area of RELAY_MAX_FRAME_SIZE, usually */
+} RelayFrame;
+
+/* pgcopydb relay server runs next to the source database */
+typedef struct RelayServerSpecs
+{
+	char source_pguri[MAXCONNINFO];
+	char listen[BUFSIZE];       /* host:port */
+	char token[BUFSIZE];        /* PGCOPYDB_RELAY_TOKEN */
+	SpoolCompression compression;
+	int maxConnections;
+	bool trustedNetwork;        /* the data is sent unencrypted */
+} RelayServerSpecs;
+
+bool relay_parse_address(const char *address,
+						 char *host, size_t hostSize,
+						 char *port, size_t portSize);
+
+bool relay_server(RelayServerSpecs *specs);
+
+#endif /* RELAY_H */
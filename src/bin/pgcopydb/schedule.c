@@ -0,0 +1,353 @@
+/*
+ * src/bin/pgcopydb/schedule.c
+ *     Implementation of a CLI to copy a database between two Postgres instances
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "copydb.h"
+#include "defaults.h"
+#include "file_utils.h"
+#include "log.h"
+#include "string_utils.h"
+#include "summary.h"
+
+
+/*
+ * copydb_schedule_table_queue sorts the table queue using the Longest
+ * Processing Time first rule: the tables that are expected to take the most
+ * time to copy and then index are started first, so that the workers don't
+ * get a large table with many indexes at the very end of the run.
+ *
+ * The parts of a split table are kept next to each other in the queue, so
+ * that idle workers pick the remaining parts of a table that's in progress
+ * before they start with another table: the whole table is then done sooner,
+ * and its indexes can be built in the meantime.
+ *
+ * The planned makespan is computed by simulating the work of the given
+ * count of workers on the sorted queue.
+ */
+bool
+copydb_schedule_table_queue(CopyDataSpec *specs, int workerCount)
+{
+	CopyTableDataSpecsArray *tableSpecsArray = &(specs->tableSpecsArray);
+	CopyTableQueue *queue = specs->tableQueue;
+
+	if (queue->count == 0)
+	{
+		return true;
+	}
+
+	CopyTableJob *jobs =
+		(CopyTableJob *) calloc(queue->count, sizeof(CopyTableJob));
+
+	if (jobs == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	for (int i = 0; i < queue->count; i++)
+	{
+		CopyTableDataSpec *tableSpecs =
+			&(tableSpecsArray->array[queue->array[i]]);
+
+		jobs[i].specsIndex = queue->array[i];
+
+		(void) copydb_estimate_table_job(specs,
+										 tableSpecs->sourceTable,
+										 tableSpecs->part.partNumber,
+										 tableSpecs->part.partCount,
+										 &(jobs[i]));
+	}
+
+	qsort(jobs, queue->count, sizeof(CopyTableJob), copydb_compare_table_jobs);
+
+	specs->plannedCopyMs = 0;
+
+	for (int i = 0; i < queue->count; i++)
+	{
+		queue->array[i] = jobs[i].specsIndex;
+		specs->plannedCopyMs += jobs[i].copyMs;
+	}
+
+	specs->plannedMakespanMs =
+		copydb_simulate_schedule(jobs, queue->count, workerCount, NULL);
+
+	char makespan[BUFSIZE] = { 0 };
+
+	(void) IntervalToString(specs->plannedMakespanMs, makespan, BUFSIZE);
+
+	log_info("Scheduled %d COPY jobs on %d table workers, "
+			 "planned makespan is %s",
+			 queue->count,
+			 workerCount,
+			 makespan);
+
+	for (int i = 0; i < queue->count; i++)
+	{
+		CopyTableDataSpec *tableSpecs =
+			&(tableSpecsArray->array[jobs[i].specsIndex]);
+
+		log_debug("Job %d: \"%s\".\"%s\" part %d/%d, "
+				  "estimated COPY %lld ms, then %lld ms for indexes and vacuum",
+				  i,
+				  tableSpecs->sourceTable->nspname,
+				  tableSpecs->sourceTable->relname,
+				  tableSpecs->part.partNumber + 1,
+				  tableSpecs->part.partCount,
+				  (long long) jobs[i].copyMs,
+				  (long long) jobs[i].finalizeMs);
+	}
+
+	free(jobs);
+
+	return true;
+}
+
+
+/*
+ * copydb_report_schedule logs the planned and the actual makespan of the
+ * table data step, and the sum of the planned and actual COPY durations, so
+ * that the estimates can be compared to reality.
+ */
+void
+copydb_report_schedule(CopyDataSpec *specs, uint64_t actualMakespanMs)
+{
+	CopyTableDataSpecsArray *tableSpecsArray = &(specs->tableSpecsArray);
+
+	uint64_t actualCopyMs = 0;
+
+	for (int i = 0; i < tableSpecsArray->count; i++)
+	{
+		CopyTableDataSpec *tableSpecs = &(tableSpecsArray->array[i]);
+		TablePartFilePaths partPaths = { 0 };
+
+		(void) copydb_part_file_paths(tableSpecs, &partPaths);
+
+		if (copydb_table_is_multiplexed(specs, tableSpecs) ||
+			!file_exists(partPaths.doneFile))
+		{
+			continue;
+		}
+
+		/* read_table_summary writes into the SourceTable, use a copy */
+		SourceTable table = { 0 };
+		CopyTableSummary summary = { .table = &table };
+
+		if (read_table_summary(&summary, partPaths.doneFile))
+		{
+			actualCopyMs += summary.durationMs;
+		}
+	}
+
+	char plannedMakespan[BUFSIZE] = { 0 };
+	char actualMakespan[BUFSIZE] = { 0 };
+	char plannedCopy[BUFSIZE] = { 0 };
+	char actualCopy[BUFSIZE] = { 0 };
+
+	(void) IntervalToString(specs->plannedMakespanMs, plannedMakespan, BUFSIZE);
+	(void) IntervalToString(actualMakespanMs, actualMakespan, BUFSIZE);
+	(void) IntervalToString(specs->plannedCopyMs, plannedCopy, BUFSIZE);
+	(void) IntervalToString(actualCopyMs, actualCopy, BUFSIZE);
+
+	log_info("Table data makespan: planned %s, actual %s; "
+			 "cumulative COPY duration: planned %s, actual %s",
+			 plannedMakespan,
+			 actualMakespan,
+			 plannedCopy,
+			 actualCopy);
+}
+
+
+/*
+ * copydb_estimate_table_job estimates how long it takes to COPY the given
+ * table (or table part), and then to create its indexes and run VACUUM on
+ * it. The estimates use the source catalogs and the throughput constants
+ * from defaults.h, and are only meant to compare tables to one another.
+ */
+void
+copydb_estimate_table_job(CopyDataSpec *specs,
+						  SourceTable *table,
+						  int partNumber,
+						  int partCount,
+						  CopyTableJob *job)
+{
+	uint64_t toastBytes = table->toastBytes > 0 ? table->toastBytes : 0;
+	uint64_t heapBytes = table->bytes > (int64_t) toastBytes
+						 ? table->bytes - toastBytes
+						 : 0;
+	uint64_t reltuples = table->reltuples > 0 ? table->reltuples : 0;
+	uint64_t indexBytes = table->indexBytes > 0 ? table->indexBytes : 0;
+	int indexCount = table->indexCount > 0 ? table->indexCount : 0;
+
+	job->oid = table->oid;
+	job->partNumber = partNumber;
+
+	uint64_t copyMs = 0;
+
+	job->indexMs = 0;
+	job->vacuumMs = 0;
+
+	if (specs->section == DATA_SECTION_TABLE_DATA ||
+		specs->section == DATA_SECTION_ALL)
+	{
+		copyMs = heapBytes / ESTIMATE_COPY_BYTES_PER_MS +
+				 toastBytes / ESTIMATE_TOAST_BYTES_PER_MS +
+				 reltuples / ESTIMATE_COPY_ROWS_PER_MS;
+	}
+
+	if ((specs->section == DATA_SECTION_INDEXES ||
+		 specs->section == DATA_SECTION_ALL) &&
+		indexCount > 0)
+	{
+		/* indexes of the same table are built in parallel */
+		int parallel =
+			indexCount < specs->indexJobs ? indexCount : specs->indexJobs;
+
+		job->indexMs = (indexBytes / ESTIMATE_INDEX_BYTES_PER_MS +
+						indexCount * reltuples / ESTIMATE_INDEX_ROWS_PER_MS) /
+					   (parallel > 0 ? parallel : 1);
+	}
+
+	if (specs->section == DATA_SECTION_VACUUM ||
+		specs->section == DATA_SECTION_ALL)
+	{
+		job->vacuumMs = specs->analyzeOnly
+						? ESTIMATE_ANALYZE_MS
+						: table->bytes / ESTIMATE_VACUUM_BYTES_PER_MS;
+	}
+
+	if (partCount < 1)
+	{
+		partCount = 1;
+	}
+
+	job->copyMs = copyMs / partCount;
+
+	/* finalizeMs and tableMs are then computed from the COPY of all parts */
+	job->finalizeMs = 0;
+	job->tableMs = copyMs;
+
+	(void) copydb_estimate_table_finalize(specs, job);
+}
+
+
+/*
+ * copydb_estimate_table_finalize computes the duration of the steps that
+ * happen once all the parts of a table have been copied, from the index and
+ * vacuum estimates of the job, and updates the total table cost. It can be
+ * called again when the index or vacuum estimates have been changed.
+ */
+void
+copydb_estimate_table_finalize(CopyDataSpec *specs, CopyTableJob *job)
+{
+	uint64_t copyMs = job->tableMs > job->finalizeMs
+					  ? job->tableMs - job->finalizeMs
+					  : 0;
+
+	/* VACUUM or ANALYZE runs once the index builds are done */
+	job->finalizeMs = job->indexMs + job->vacuumMs;
+
+	job->tableMs = copyMs + job->finalizeMs;
+}
+
+
+/*
+ * copydb_compare_table_jobs sorts jobs by decreasing total table cost, and
+ * then keeps the parts of the same table together, in order.
+ */
+int
+copydb_compare_table_jobs(const void *a, const void *b)
+{
+	const CopyTableJob *ja = (const CopyTableJob *) a;
+	const CopyTableJob *jb = (const CopyTableJob *) b;
+
+	if (ja->tableMs != jb->tableMs)
+	{
+		return ja->tableMs > jb->tableMs ? -1 : 1;
+	}
+
+	if (ja->oid != jb->oid)
+	{
+		return ja->oid < jb->oid ? -1 : 1;
+	}
+
+	return ja->partNumber - jb->partNumber;
+}
+
+
+/*
+ * copydb_simulate_schedule computes the makespan of the given sorted list of
+ * jobs when each worker pulls the next job as soon as it's done, as the table
+ * workers do. Indexes and vacuum run in their own sub-processes once all the
+ * parts of a table have been copied, so they don't keep the worker busy, but
+ * they do count in the makespan.
+ *
+ * When criticalJob is not NULL, it is set to the index of the last job of the
+ * table that finishes last: that table is the critical path of the run.
+ */
+uint64_t
+copydb_simulate_schedule(CopyTableJob *jobs, int count, int workerCount,
+						 int *criticalJob)
+{
+	if (workerCount < 1)
+	{
+		workerCount = 1;
+	}
+
+	uint64_t *workers = (uint64_t *) calloc(workerCount, sizeof(uint64_t));
+
+	if (workers == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return 0;
+	}
+
+	uint64_t makespan = 0;
+	uint64_t tableCopyDone = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		/* the next job goes to the first worker that's available */
+		int w = 0;
+
+		for (int j = 1; j < workerCount; j++)
+		{
+			if (workers[j] < workers[w])
+			{
+				w = j;
+			}
+		}
+
+		workers[w] += jobs[i].copyMs;
+
+		if (workers[w] > tableCopyDone)
+		{
+			tableCopyDone = workers[w];
+		}
+
+		/* when this is the last part of the table, add the finalize step */
+		if (i == count - 1 || jobs[i + 1].oid != jobs[i].oid)
+		{
+			uint64_t tableDone = tableCopyDone + jobs[i].finalizeMs;
+
+			if (tableDone > makespan)
+			{
+				makespan = tableDone;
+
+				if (criticalJob != NULL)
+				{
+					*criticalJob = i;
+				}
+			}
+
+			tableCopyDone = 0;
+		}
+	}
+
+	free(workers);
+
+	return makespan;
+}
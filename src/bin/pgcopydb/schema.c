@@ -9,16 +9,25 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "defaults.h"
 #include "env_utils.h"
 #include "log.h"
 #include "parsing.h"
 #include "pgsql.h"
+#include "pqexpbuffer.h"
 #include "schema.h"
 #include "signals.h"
 #include "string_utils.h"
 
 
+/*
+ * The names and definitions of the catalog objects are variable-length
+ * strings that live in the catalog arena for the whole process lifetime, and
+ * that our sub-processes inherit at fork() time.
+ */
+static Arena catalogArena = { 0 };
+
 /* Context used when fetching all the table definitions */
 typedef struct SourceTableArrayContext
 {
@@ -27,6 +36,38 @@ typedef struct SourceTableArrayContext
 	bool parsedOk;
 } SourceTableArrayContext;
 
+/* Context used when fetching the change markers of the tables */
+typedef struct SourceTableMarkerArrayContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	SourceTableMarkerArray *markerArray;
+	bool parsedOk;
+} SourceTableMarkerArrayContext;
+
+/* Context used when fetching the relations to apply the table filters to */
+typedef struct SourceRelationArrayContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	SourceRelationArray *relationArray;
+	bool parsedOk;
+} SourceRelationArrayContext;
+
+/* Context used when fetching the objects that the table filters exclude */
+typedef struct SourceFilteredObjectArrayContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	SourceFilteredObjectArray *objectArray;
+	bool parsedOk;
+} SourceFilteredObjectArrayContext;
+
+/* Context used when fetching all the databases of the cluster */
+typedef struct SourceDatabaseArrayContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	SourceDatabaseArray *databaseArray;
+	bool parsedOk;
+} SourceDatabaseArrayContext;
+
 /* Context used when fetching all the sequence definitions */
 typedef struct SourceSequenceArrayContext
 {
@@ -43,24 +84,149 @@ typedef struct SourceIndexArrayContext
 	bool parsedOk;
 } SourceIndexArrayContext;
 
+/* Context used when fetching the partitioned indexes attachments */
+typedef struct SourceIndexAttachArrayContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	SourceIndexAttachArray *attachArray;
+	bool parsedOk;
+} SourceIndexAttachArrayContext;
+
+/* Context used when fetching the pre-data dependencies */
+typedef struct SourcePreDataDependencyArrayContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	SourcePreDataDependencyArray *depArray;
+	bool parsedOk;
+} SourcePreDataDependencyArrayContext;
+
+/* Context used when fetching all the foreign keys definitions */
+typedef struct SourceForeignKeyArrayContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	SourceForeignKeyArray *fkeyArray;
+	bool parsedOk;
+} SourceForeignKeyArrayContext;
+
+/* Context used when fetching the large object ranges */
+typedef struct LargeObjectRangeArrayContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	LargeObjectRangeArray *rangeArray;
+	bool parsedOk;
+} LargeObjectRangeArrayContext;
+
+/* Context used when fetching the large object OIDs of a range */
+typedef struct LargeObjectArrayContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	LargeObjectArray *loArray;
+	bool parsedOk;
+} LargeObjectArrayContext;
+
+/* Context used when fetching the CREATE INDEX progress */
+typedef struct IndexProgressArrayContext
+{
+	char sqlstate[SQLSTATE_LENGTH];
+	IndexProgressArray *progressArray;
+	bool parsedOk;
+} IndexProgressArrayContext;
+
 static void getTableArray(void *ctx, PGresult *result);
 
 static bool parseCurrentSourceTable(PGresult *result,
 									int rowNumber,
 									SourceTable *table);
 
+static void getTableMarkerArray(void *ctx, PGresult *result);
+
+static void getRelationArray(void *ctx, PGresult *result);
+static void getFilteredObjectArray(void *ctx, PGresult *result);
+
+static bool parseCurrentFilteredObject(PGresult *result,
+									   int rowNumber,
+									   SourceFilteredObject *object);
+
+static void getDatabaseArray(void *ctx, PGresult *result);
+
+static bool parseCurrentSourceDatabase(PGresult *result,
+									   int rowNumber,
+									   SourceDatabase *database);
+
 static void getSequenceArray(void *ctx, PGresult *result);
 
 static bool parseCurrentSourceSequence(PGresult *result,
 									   int rowNumber,
 									   SourceSequence *table);
 
+static void getSequenceValueArray(void *ctx, PGresult *result);
+
+static bool parseCurrentSequenceValue(PGresult *result,
+									  int rowNumber,
+									  SourceSequence *seq);
+
+static void appendArrayTextElement(PQExpBuffer buffer, const char *str);
+
+static void getLargeObjectRangeArray(void *ctx, PGresult *result);
+static void getLargeObjectArray(void *ctx, PGresult *result);
+static void getIndexProgressArray(void *ctx, PGresult *result);
+
 static void getIndexArray(void *ctx, PGresult *result);
 
 static bool parseCurrentSourceIndex(PGresult *result,
 									int rowNumber,
 									SourceIndex *index);
 
+static void getIndexAttachArray(void *ctx, PGresult *result);
+
+static bool parseCurrentSourceIndexAttach(PGresult *result,
+										  int rowNumber,
+										  SourceIndexAttach *attach);
+
+static void getPreDataDependencyArray(void *ctx, PGresult *result);
+
+static void getForeignKeyArray(void *ctx, PGresult *result);
+
+static bool parseCurrentSourceForeignKey(PGresult *result,
+										 int rowNumber,
+										 SourceForeignKey *fkey);
+
+
+/*
+ * schema_catalog_intern sets dest to the catalog arena copy of the given
+ * name, which is shared by all the catalog objects that use the same name.
+ */
+bool
+schema_catalog_intern(const char *str, char **dest)
+{
+	*dest = arena_intern(&catalogArena, str);
+
+	return *dest != NULL;
+}
+
+
+/*
+ * schema_catalog_strdup sets dest to a catalog arena copy of the given
+ * string, such as an index definition, which is not expected to repeat.
+ */
+bool
+schema_catalog_strdup(const char *str, char **dest)
+{
+	*dest = arena_strdup(&catalogArena, str);
+
+	return *dest != NULL;
+}
+
+
+/*
+ * schema_catalog_bytes returns how much memory the catalog arena uses.
+ */
+uint64_t
+schema_catalog_bytes(void)
+{
+	return catalogArena.bytes;
+}
+
 
 /*
  * schema_list_ordinary_tables grabs the list of tables from the given source
@@ -72,20 +238,110 @@ schema_list_ordinary_tables(PGSQL *pgsql, SourceTableArray *tableArray)
 {
 	SourceTableArrayContext context = { { 0 }, tableArray, false };
 
-	char *sql =
+	int version = 0;
+
+	if (!pgsql_server_version_num(pgsql, &version))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* stored generated columns appeared in Postgres 12 */
+	char *generated = version >= 120000 ? "a.attgenerated <> ''" : "false";
+
+	char *sqlFormat =
 		"  select c.oid, n.nspname, c.relname, c.reltuples::bigint, "
 		"         pg_table_size(c.oid) as bytes, "
-		"         pg_size_pretty(pg_table_size(c.oid)) "
+		"         pg_size_pretty(pg_table_size(c.oid)), "
+		"         pg_relation_size(c.oid) "
+		"         / current_setting('block_size')::bigint as relpages, "
+		"         exists( "
+		"          select 1 "
+		"            from pg_catalog.pg_attribute a "
+		"                 join pg_catalog.pg_type d on d.oid = a.atttypid "
+		"                 join pg_catalog.pg_type t "
+		"                   on t.oid = case when d.typtype = 'd' "
+		"                                   then d.typbasetype "
+		"                                   else d.oid "
+		"                               end "
+		"           where a.attrelid = c.oid "
+		"             and a.attnum > 0 and not a.attisdropped "
+		"             and (t.typsend::oid = 0 "
+		"                  or t.typreceive::oid = 0 "
+		"                  or t.typtype = 'c' "
+		"                  or (t.typlen = -1 and t.typelem >= 16384)) "
+		"         ) as binary_unsafe, "
+		"         (select count(*) "
+		"            from pg_catalog.pg_index i "
+		"           where i.indrelid = c.oid) as index_count, "
+		"         (select coalesce(sum(pg_relation_size(i.indexrelid)), 0) "
+		"            from pg_catalog.pg_index i "
+		"           where i.indrelid = c.oid) as index_bytes, "
+		"         case when c.reltoastrelid = 0 then 0 "
+		"              else pg_table_size(c.reltoastrelid) "
+		"          end as toast_bytes, "
+		"         (select count(*) "
+		"            from pg_catalog.pg_attribute a "
+		"           where a.attrelid = c.oid "
+		"             and a.attnum > 0 and not a.attisdropped "
+		"         ) as column_count, "
+		"         (select count(*) "
+		"            from pg_catalog.pg_attribute a "
+		"                 join pg_catalog.pg_type d on d.oid = a.atttypid "
+		"                 join pg_catalog.pg_type t "
+		"                   on t.oid = case when d.typtype = 'd' "
+		"                                   then d.typbasetype "
+		"                                   else d.oid "
+		"                               end "
+		"           where a.attrelid = c.oid "
+		"             and a.attnum > 0 and not a.attisdropped "
+		"             and (t.typlen > 0 or t.oid in (17, 1700)) "
+		"         ) as binary_column_count, "
+		"         exists( "
+		"          select 1 "
+		"            from pg_catalog.pg_inherits h "
+		"                 join pg_catalog.pg_class p on p.oid = h.inhparent "
+		"           where h.inhrelid = c.oid and p.relkind = 'p' "
+		"         ) as is_partition, "
+		"         case when exists( "
+		"                select 1 "
+		"                  from pg_catalog.pg_attribute a "
+		"                 where a.attrelid = c.oid "
+		"                   and a.attnum > 0 and not a.attisdropped "
+		"                   and %s) "
+		"              then (select string_agg(pg_catalog.quote_ident(a.attname), "
+		"                                      ', ' order by a.attnum) "
+		"                      from pg_catalog.pg_attribute a "
+		"                     where a.attrelid = c.oid "
+		"                       and a.attnum > 0 and not a.attisdropped "
+		"                       and not (%s)) "
+		"          end as copy_columns "
 		"    from pg_catalog.pg_class c join pg_catalog.pg_namespace n "
 		"      on c.relnamespace = n.oid "
 		"   where c.relkind = 'r' and c.relpersistence = 'p' "
 		"     and n.nspname !~ '^pg_' and n.nspname <> 'information_schema' "
 		"order by bytes desc, n.nspname, c.relname";
 
+	PQExpBuffer sql = createPQExpBuffer();
+
+	appendPQExpBuffer(sql, sqlFormat, generated, generated);
+
+	if (PQExpBufferBroken(sql))
+	{
+		log_error("Failed to prepare the list of tables query: out of memory");
+		destroyPQExpBuffer(sql);
+		return false;
+	}
+
 	log_trace("schema_list_ordinary_tables");
 
-	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
-								   &context, &getTableArray))
+	bool success =
+		pgsql_execute_with_params(pgsql, sql->data, 0, NULL, NULL,
+								  &context, &getTableArray);
+
+	destroyPQExpBuffer(sql);
+
+	if (!success)
 	{
 		log_error("Failed to retrieve current state from the monitor");
 		return false;
@@ -101,6 +357,256 @@ schema_list_ordinary_tables(PGSQL *pgsql, SourceTableArray *tableArray)
 }
 
 
+/*
+ * schema_list_table_markers grabs the change marker of each ordinary table
+ * of the given source Postgres instance, sorted by oid. The marker changes
+ * when rows are inserted, updated, or deleted in the table, or when the table
+ * is rewritten, see pgcopydb copy data --refresh.
+ *
+ * The statistics counters are only maintained when track_counts is on, and
+ * otherwise the array is empty.
+ */
+bool
+schema_list_table_markers(PGSQL *pgsql, SourceTableMarkerArray *markerArray)
+{
+	SourceTableMarkerArrayContext context = { { 0 }, markerArray, false };
+
+	char *sql =
+		"  select s.relid, "
+		"         format('%s:%s:%s:%s', "
+		"                c.relfilenode, s.n_tup_ins, s.n_tup_upd, s.n_tup_del) "
+		"    from pg_catalog.pg_stat_user_tables s "
+		"         join pg_catalog.pg_class c on c.oid = s.relid "
+		"   where c.relkind = 'r' and c.relpersistence = 'p' "
+		"     and current_setting('track_counts')::bool "
+		"order by s.relid";
+
+	log_trace("schema_list_table_markers");
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &getTableMarkerArray))
+	{
+		log_error("Failed to retrieve the tables change markers");
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the tables change markers");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * schema_list_filter_relations grabs the list of the ordinary and partitioned
+ * tables of the given source Postgres instance, with only what the table
+ * filters need: the names, and the size of the ordinary tables.
+ */
+bool
+schema_list_filter_relations(PGSQL *pgsql, SourceRelationArray *relationArray)
+{
+	SourceRelationArrayContext context = { { 0 }, relationArray, false };
+
+	char *sql =
+		"  select c.oid, c.relkind, n.nspname, c.relname, "
+		"         case when c.relkind = 'r' then pg_table_size(c.oid) "
+		"              else 0 "
+		"          end as bytes "
+		"    from pg_catalog.pg_class c join pg_catalog.pg_namespace n "
+		"      on c.relnamespace = n.oid "
+		"   where c.relkind in ('r', 'p') and c.relpersistence = 'p' "
+		"     and n.nspname !~ '^pg_' and n.nspname <> 'information_schema' "
+		"order by n.nspname, c.relname";
+
+	log_trace("schema_list_filter_relations");
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &getRelationArray))
+	{
+		log_error("Failed to list the tables to apply the filters to");
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the tables to apply the filters to");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * schema_list_filtered_objects lists the given tables, and the objects of the
+ * source database that can't be restored without them, sorted by oid.
+ *
+ * The objects that depend on a table are found in pg_depend, recursively:
+ * the auto and internal dependencies cover the indexes, the constraints, the
+ * triggers, the rules, the policies, the column defaults, the owned sequences
+ * and the partitions, and the normal dependencies of pg_constraint and
+ * pg_rewrite entries cover the foreign keys that reference the table and the
+ * views that use it. The rule of a view depends on the view itself, so we
+ * follow that link backwards.
+ */
+bool
+schema_list_filtered_objects(PGSQL *pgsql,
+							 uint32_t *tableOids,
+							 int tableCount,
+							 SourceFilteredObjectArray *objectArray)
+{
+	SourceFilteredObjectArrayContext context = { { 0 }, objectArray, false };
+
+	char *sql =
+		"with recursive filtered(classid, objid) as "
+		"( "
+		"  select 'pg_catalog.pg_class'::pg_catalog.regclass::pg_catalog.oid, "
+		"         t.oid "
+		"    from unnest($1::pg_catalog.oid[]) as t(oid) "
+		" "
+		"   union "
+		" "
+		"  select d.classid, d.objid "
+		"    from filtered f, "
+		"         lateral ( "
+		"           select dep.classid, dep.objid "
+		"             from pg_catalog.pg_depend dep "
+		"            where dep.refclassid = f.classid "
+		"              and dep.refobjid = f.objid "
+		"              and (dep.deptype in ('a', 'i') "
+		"                   or (dep.deptype = 'n' "
+		"                       and dep.classid in "
+		"                           ('pg_catalog.pg_constraint'::pg_catalog.regclass, "
+		"                            'pg_catalog.pg_rewrite'::pg_catalog.regclass))) "
+		" "
+		"            union all "
+		" "
+		"           select 'pg_catalog.pg_class'::pg_catalog.regclass::pg_catalog.oid, "
+		"                  r.ev_class "
+		"             from pg_catalog.pg_rewrite r "
+		"                  join pg_catalog.pg_class v on v.oid = r.ev_class "
+		"            where f.classid = 'pg_catalog.pg_rewrite'::pg_catalog.regclass "
+		"              and r.oid = f.objid "
+		"              and v.relkind in ('v', 'm') "
+		"         ) as d "
+		") "
+		"   select f.classid, f.objid, c.relkind, n.nspname, c.relname, "
+		"          quote_ident(c.relname) "
+		"     from filtered f "
+		"          left join pg_catalog.pg_class c "
+		"            on f.classid = 'pg_catalog.pg_class'::pg_catalog.regclass "
+		"           and c.oid = f.objid "
+		"          left join pg_catalog.pg_namespace n on n.oid = c.relnamespace "
+		" order by f.objid, f.classid";
+
+	PQExpBuffer oids = createPQExpBuffer();
+
+	appendPQExpBufferChar(oids, '{');
+
+	for (int i = 0; i < tableCount; i++)
+	{
+		appendPQExpBuffer(oids, "%s%u", i == 0 ? "" : ",", tableOids[i]);
+	}
+
+	appendPQExpBufferChar(oids, '}');
+
+	if (PQExpBufferBroken(oids))
+	{
+		log_error("Failed to create the array of table OIDs: out of memory");
+		destroyPQExpBuffer(oids);
+		return false;
+	}
+
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { oids->data };
+
+	log_trace("schema_list_filtered_objects: %d tables", tableCount);
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &getFilteredObjectArray))
+	{
+		log_error("Failed to list the objects that depend on %d tables",
+				  tableCount);
+		destroyPQExpBuffer(oids);
+		return false;
+	}
+
+	destroyPQExpBuffer(oids);
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the objects that depend on %d tables",
+				  tableCount);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * schema_catalog_fingerprint computes a fingerprint of the source catalogs,
+ * which changes with any DDL: creating, altering, renaming or dropping a
+ * relation, a constraint, or a schema writes a new version of a row in
+ * pg_class, pg_constraint, or pg_namespace, with a new xmin, and TRUNCATE
+ * or a table rewrite changes the relfilenode. VACUUM and ANALYZE update the
+ * statistics in pg_class in place, so they leave the fingerprint alone.
+ *
+ * Reading the three catalogs is much cheaper than the catalog queries of
+ * schema_list_ordinary_tables() and friends, which compute relation sizes.
+ */
+bool
+schema_catalog_fingerprint(PGSQL *pgsql, char *fingerprint, size_t size)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+
+	char *sql =
+		"with objects(kind, oid, version) as "
+		"( "
+		"  select 'c', c.oid, format('%s.%s', c.xmin, c.relfilenode) "
+		"    from pg_catalog.pg_class c "
+		"   union all "
+		"  select 'k', k.oid, k.xmin::text "
+		"    from pg_catalog.pg_constraint k "
+		"   union all "
+		"  select 'n', n.oid, n.xmin::text "
+		"    from pg_catalog.pg_namespace n "
+		") "
+		"select format('%s-%s-%s', "
+		"              current_setting('server_version_num'), "
+		"              (select oid from pg_catalog.pg_database "
+		"                where datname = current_database()), "
+		"              md5(string_agg(format('%s%s:%s', kind, oid, version), "
+		"                             ',' order by kind, oid))) "
+		"  from objects";
+
+	log_trace("schema_catalog_fingerprint");
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to compute the source catalogs fingerprint");
+		return false;
+	}
+
+	if (!context.parsedOk || context.strVal == NULL)
+	{
+		log_error("Failed to parse the source catalogs fingerprint");
+		return false;
+	}
+
+	strlcpy(fingerprint, context.strVal, size);
+	free(context.strVal);
+
+	return true;
+}
+
+
 /*
  * schema_list_sequences grabs the list of sequences from the given source
  * Postgres instance and allocates a SourceSequence array with the result of
@@ -138,6 +644,45 @@ schema_list_sequences(PGSQL *pgsql, SourceSequenceArray *seqArray)
 }
 
 
+/*
+ * schema_list_databases grabs the list of the databases of the source cluster
+ * that we can connect to, apart from the templates, largest first.
+ */
+bool
+schema_list_databases(PGSQL *pgsql, SourceDatabaseArray *databaseArray)
+{
+	SourceDatabaseArrayContext context = { { 0 }, databaseArray, false };
+
+	char *sql =
+		"  select d.oid, d.datname, pg_get_userbyid(d.datdba), "
+		"         pg_encoding_to_char(d.encoding), d.datcollate, d.datctype, "
+		"         case when has_database_privilege(d.oid, 'CONNECT') "
+		"              then pg_database_size(d.oid) "
+		"              else 0 "
+		"          end as bytes "
+		"    from pg_catalog.pg_database d "
+		"   where d.datallowconn and not d.datistemplate "
+		"order by bytes desc, d.datname";
+
+	log_trace("schema_list_databases");
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &getDatabaseArray))
+	{
+		log_error("Failed to list the databases of the source cluster");
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the databases of the source cluster");
+		return false;
+	}
+
+	return true;
+}
+
+
 /*
  * schema_get_sequence_value fetches sequence metadata last_value and
  * is_called for the given sequence.
@@ -192,54 +737,291 @@ schema_set_sequence_value(PGSQL *pgsql, SourceSequence *seq)
 
 
 /*
- * schema_list_all_indexes grabs the list of indexes from the given source
- * Postgres instance and allocates a SourceIndex array with the result of the
- * query.
+ * schema_get_all_sequence_values fetches last_value and is_called for all the
+ * sequences in the given array in a single query, which saves a network round
+ * trip per sequence: the query is a UNION ALL of a select from each sequence
+ * relation. pg_sequence_last_value() can't be used here, it returns NULL when
+ * is_called is false, and then the last_value that setval() has set is lost.
+ *
+ * The identifiers are escaped with the connection, so the caller must have
+ * opened it already, as in a transaction that pgsql_begin() started.
  */
 bool
-schema_list_all_indexes(PGSQL *pgsql, SourceIndexArray *indexArray)
+schema_get_all_sequence_values(PGSQL *pgsql, SourceSequenceArray *seqArray)
 {
-	SourceIndexArrayContext context = { { 0 }, indexArray, false };
-
-	char *sql =
-		"   select i.oid, n.nspname, i.relname,"
-		"          r.oid, rn.nspname, r.relname,"
-		"          indisprimary,"
-		"          indisunique,"
-		"          (select string_agg(attname, ',')"
-		"             from pg_attribute"
-		"            where attrelid = r.oid"
-		"              and array[attnum::integer] <@ indkey::integer[]"
-		"          ) as cols,"
-		"          pg_get_indexdef(indexrelid),"
-		"          c.oid,"
-		"          c.conname,"
-		"          pg_get_constraintdef(c.oid)"
-		"     from pg_index x"
-		"          join pg_class i ON i.oid = x.indexrelid"
-		"          join pg_class r ON r.oid = x.indrelid"
-		"          join pg_namespace n ON n.oid = i.relnamespace"
-		"          join pg_namespace rn ON rn.oid = r.relnamespace"
-		"          left join pg_depend d "
-		"                 on d.classid = 'pg_class'::regclass"
-		"                and d.objid = i.oid"
-		"                and d.refclassid = 'pg_constraint'::regclass"
-		"                and d.deptype = 'i'"
-		"          left join pg_constraint c ON c.oid = d.refobjid"
-		"    where r.relkind = 'r' and r.relpersistence = 'p' "
-		"      and n.nspname !~ '^pg_' and n.nspname <> 'information_schema'"
-		" order by n.nspname, r.relname";
+	SourceSequenceArrayContext context = { { 0 }, seqArray, false };
 
-	log_trace("schema_list_all_indexes");
+	if (seqArray->count == 0)
+	{
+		return true;
+	}
 
-	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
-								   &context, &getIndexArray))
+	if (pgsql->connection == NULL)
 	{
-		log_error("Failed to retrieve current state from the monitor");
+		log_error("BUG: schema_get_all_sequence_values called without "
+				  "an open connection");
 		return false;
 	}
 
-	if (!context.parsedOk)
+	/* a query with many sequences doesn't fit in BUFSIZE */
+	PQExpBuffer sql = createPQExpBuffer();
+
+	appendPQExpBufferStr(sql, "select oid, last_value, is_called from (");
+
+	for (int i = 0; i < seqArray->count; i++)
+	{
+		SourceSequence *seq = &(seqArray->array[i]);
+
+		char *nspname =
+			PQescapeIdentifier(pgsql->connection,
+							   seq->nspname,
+							   strlen(seq->nspname));
+
+		char *relname =
+			PQescapeIdentifier(pgsql->connection,
+							   seq->relname,
+							   strlen(seq->relname));
+
+		if (nspname == NULL || relname == NULL)
+		{
+			log_error("Failed to get values from sequence \"%s\".\"%s\": %s",
+					  seq->nspname,
+					  seq->relname,
+					  PQerrorMessage(pgsql->connection));
+
+			PQfreemem(nspname);
+			PQfreemem(relname);
+			destroyPQExpBuffer(sql);
+			return false;
+		}
+
+		/* keep the result in the order of the array, see below */
+		appendPQExpBuffer(sql,
+						  "%s select %u::pg_catalog.oid as oid, %d as n, "
+						  "last_value, is_called from %s.%s",
+						  i == 0 ? "" : " union all",
+						  seq->oid,
+						  i,
+						  nspname,
+						  relname);
+
+		PQfreemem(nspname);
+		PQfreemem(relname);
+	}
+
+	appendPQExpBufferStr(sql, ") as s order by n");
+
+	if (PQExpBufferBroken(sql))
+	{
+		log_error("Failed to create the sequence values query: out of memory");
+		destroyPQExpBuffer(sql);
+		return false;
+	}
+
+	log_trace("schema_get_all_sequence_values");
+
+	/*
+	 * The result is ordered the same as the given array, so that we don't
+	 * need to search for each sequence in the array when parsing the result.
+	 */
+	if (!pgsql_execute_with_params(pgsql, sql->data, 0, NULL, NULL,
+								   &context, &getSequenceValueArray))
+	{
+		log_error("Failed to retrieve the values of %d sequences",
+				  seqArray->count);
+		destroyPQExpBuffer(sql);
+		return false;
+	}
+
+	destroyPQExpBuffer(sql);
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the values of %d sequences",
+				  seqArray->count);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * schema_set_all_sequence_values calls pg_catalog.setval() on all the fetched
+ * sequences of the given array in a single statement, passing the sequence
+ * names and values as arrays that are unnest()ed on the server.
+ */
+bool
+schema_set_all_sequence_values(PGSQL *pgsql, SourceSequenceArray *seqArray)
+{
+	SingleValueResultContext parseContext = { { 0 }, PGSQL_RESULT_BIGINT, false };
+
+	char *sql =
+		"select count(pg_catalog.setval(format('%I.%I', s.nspname, s.relname), "
+		"                               s.last_value, s.is_called)) "
+		"  from unnest($1::text[], $2::text[], $3::bigint[], $4::bool[]) "
+		"    as s(nspname, relname, last_value, is_called)";
+
+	PQExpBuffer nspnames = createPQExpBuffer();
+	PQExpBuffer relnames = createPQExpBuffer();
+	PQExpBuffer lastValues = createPQExpBuffer();
+	PQExpBuffer isCalled = createPQExpBuffer();
+
+	int count = 0;
+
+	appendPQExpBufferChar(nspnames, '{');
+	appendPQExpBufferChar(relnames, '{');
+	appendPQExpBufferChar(lastValues, '{');
+	appendPQExpBufferChar(isCalled, '{');
+
+	for (int i = 0; i < seqArray->count; i++)
+	{
+		SourceSequence *seq = &(seqArray->array[i]);
+
+		if (!seq->fetched)
+		{
+			continue;
+		}
+
+		char *sep = count == 0 ? "" : ",";
+
+		appendPQExpBufferStr(nspnames, sep);
+		appendArrayTextElement(nspnames, seq->nspname);
+
+		appendPQExpBufferStr(relnames, sep);
+		appendArrayTextElement(relnames, seq->relname);
+
+		appendPQExpBuffer(lastValues, "%s%lld", sep, (long long) seq->lastValue);
+		appendPQExpBuffer(isCalled, "%s%c", sep, seq->isCalled ? 't' : 'f');
+
+		++count;
+	}
+
+	appendPQExpBufferChar(nspnames, '}');
+	appendPQExpBufferChar(relnames, '}');
+	appendPQExpBufferChar(lastValues, '}');
+	appendPQExpBufferChar(isCalled, '}');
+
+	bool success = true;
+
+	if (PQExpBufferBroken(nspnames) ||
+		PQExpBufferBroken(relnames) ||
+		PQExpBufferBroken(lastValues) ||
+		PQExpBufferBroken(isCalled))
+	{
+		log_error("Failed to create the arrays of sequence values: "
+				  "out of memory");
+		success = false;
+	}
+	else if (count > 0)
+	{
+		int paramCount = 4;
+		Oid paramTypes[4] = { TEXTOID, TEXTOID, TEXTOID, TEXTOID };
+		const char *paramValues[4] = {
+			nspnames->data, relnames->data, lastValues->data, isCalled->data
+		};
+
+		log_trace("schema_set_all_sequence_values: %d sequences", count);
+
+		if (!pgsql_execute_with_params(pgsql, sql,
+									   paramCount, paramTypes, paramValues,
+									   &parseContext, &parseSingleValueResult) ||
+			!parseContext.parsedOk)
+		{
+			log_error("Failed to set the last value of %d sequences", count);
+			success = false;
+		}
+	}
+
+	destroyPQExpBuffer(nspnames);
+	destroyPQExpBuffer(relnames);
+	destroyPQExpBuffer(lastValues);
+	destroyPQExpBuffer(isCalled);
+
+	return success;
+}
+
+
+/*
+ * schema_list_all_indexes grabs the list of indexes from the given source
+ * Postgres instance and allocates a SourceIndex array with the result of the
+ * query.
+ */
+bool
+schema_list_all_indexes(PGSQL *pgsql, SourceIndexArray *indexArray)
+{
+	SourceIndexArrayContext context = { { 0 }, indexArray, false };
+
+	int version = 0;
+
+	if (!pgsql_server_version_num(pgsql, &version))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* INCLUDE columns appeared in Postgres 11, they are not index keys */
+	char *keyAtts = version >= 110000 ? "x.indnkeyatts" : "x.indnatts";
+
+	char *sqlFormat =
+		"   select i.oid, n.nspname, i.relname,"
+		"          r.oid, rn.nspname, r.relname,"
+		"          indisprimary,"
+		"          indisunique,"
+		"          (select string_agg(quote_ident(a.attname), ',' order by k.n)"
+		"             from unnest(x.indkey::integer[])"
+		"                  with ordinality as k(attnum, n)"
+		"                  join pg_attribute a"
+		"                    on a.attrelid = r.oid"
+		"                   and a.attnum = k.attnum"
+		"            where k.n <= %s"
+		"          ) as cols,"
+		"          pg_get_indexdef(indexrelid),"
+		"          c.oid,"
+		"          c.conname,"
+		"          pg_get_constraintdef(c.oid),"
+		"          pg_relation_size(indexrelid) as bytes"
+		"     from pg_index x"
+		"          join pg_class i ON i.oid = x.indexrelid"
+		"          join pg_class r ON r.oid = x.indrelid"
+		"          join pg_namespace n ON n.oid = i.relnamespace"
+		"          join pg_namespace rn ON rn.oid = r.relnamespace"
+		"          left join pg_depend d "
+		"                 on d.classid = 'pg_class'::regclass"
+		"                and d.objid = i.oid"
+		"                and d.refclassid = 'pg_constraint'::regclass"
+		"                and d.deptype = 'i'"
+		"          left join pg_constraint c ON c.oid = d.refobjid"
+		"    where r.relkind = 'r' and r.relpersistence = 'p' "
+		"      and n.nspname !~ '^pg_' and n.nspname <> 'information_schema'"
+		" order by n.nspname, r.relname";
+
+	PQExpBuffer sql = createPQExpBuffer();
+
+	appendPQExpBuffer(sql, sqlFormat, keyAtts);
+
+	if (PQExpBufferBroken(sql))
+	{
+		log_error("Failed to prepare the indexes query: out of memory");
+		destroyPQExpBuffer(sql);
+		return false;
+	}
+
+	log_trace("schema_list_all_indexes");
+
+	bool success =
+		pgsql_execute_with_params(pgsql, sql->data, 0, NULL, NULL,
+								  &context, &getIndexArray);
+
+	destroyPQExpBuffer(sql);
+
+	if (!success)
+	{
+		log_error("Failed to retrieve current state from the monitor");
+		return false;
+	}
+
+	if (!context.parsedOk)
 	{
 		log_error("Failed to parse current state from the monitor");
 		return false;
@@ -262,20 +1044,35 @@ schema_list_table_indexes(PGSQL *pgsql,
 {
 	SourceIndexArrayContext context = { { 0 }, indexArray, false };
 
-	char *sql =
+	int version = 0;
+
+	if (!pgsql_server_version_num(pgsql, &version))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* INCLUDE columns appeared in Postgres 11, they are not index keys */
+	char *keyAtts = version >= 110000 ? "x.indnkeyatts" : "x.indnatts";
+
+	char *sqlFormat =
 		"   select i.oid, n.nspname, i.relname,"
 		"          r.oid, rn.nspname, r.relname,"
 		"          indisprimary,"
 		"          indisunique,"
-		"          (select string_agg(attname, ',')"
-		"             from pg_attribute"
-		"            where attrelid = r.oid"
-		"              and array[attnum::integer] <@ indkey::integer[]"
+		"          (select string_agg(quote_ident(a.attname), ',' order by k.n)"
+		"             from unnest(x.indkey::integer[])"
+		"                  with ordinality as k(attnum, n)"
+		"                  join pg_attribute a"
+		"                    on a.attrelid = r.oid"
+		"                   and a.attnum = k.attnum"
+		"            where k.n <= %s"
 		"          ) as cols,"
 		"          pg_get_indexdef(indexrelid),"
 		"          c.oid,"
 		"          c.conname,"
-		"          pg_get_constraintdef(c.oid)"
+		"          pg_get_constraintdef(c.oid),"
+		"          pg_relation_size(indexrelid) as bytes"
 		"     from pg_index x"
 		"          join pg_class i ON i.oid = x.indexrelid"
 		"          join pg_class r ON r.oid = x.indrelid"
@@ -296,23 +1093,1280 @@ schema_list_table_indexes(PGSQL *pgsql,
 	Oid paramTypes[2] = { TEXTOID, TEXTOID };
 	const char *paramValues[2] = { schemaName, tableName };
 
-	log_trace("schema_list_table_indexes");
+	PQExpBuffer sql = createPQExpBuffer();
+
+	appendPQExpBuffer(sql, sqlFormat, keyAtts);
+
+	if (PQExpBufferBroken(sql))
+	{
+		log_error("Failed to prepare the table indexes query: out of memory");
+		destroyPQExpBuffer(sql);
+		return false;
+	}
+
+	log_trace("schema_list_table_indexes");
+
+	bool success =
+		pgsql_execute_with_params(pgsql, sql->data,
+								  paramCount, paramTypes, paramValues,
+								  &context, &getIndexArray);
+
+	destroyPQExpBuffer(sql);
+
+	if (!success)
+	{
+		log_error("Failed to retrieve current state from the monitor");
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse current state from the monitor");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * schema_list_partitioned_indexes grabs the list of the indexes of the
+ * partitioned tables of the given source Postgres instance. The definition
+ * that pg_get_indexdef() returns for those uses CREATE INDEX ... ON ONLY, so
+ * that the index is created on the partitioned table alone, and the indexes
+ * of the partitions are then attached to it, see
+ * schema_list_index_attachments().
+ */
+bool
+schema_list_partitioned_indexes(PGSQL *pgsql, SourceIndexArray *indexArray)
+{
+	SourceIndexArrayContext context = { { 0 }, indexArray, false };
+
+	int version = 0;
+
+	if (!pgsql_server_version_num(pgsql, &version))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* INCLUDE columns appeared in Postgres 11, they are not index keys */
+	char *keyAtts = version >= 110000 ? "x.indnkeyatts" : "x.indnatts";
+
+	char *sqlFormat =
+		"   select i.oid, n.nspname, i.relname,"
+		"          r.oid, rn.nspname, r.relname,"
+		"          indisprimary,"
+		"          indisunique,"
+		"          (select string_agg(quote_ident(a.attname), ',' order by k.n)"
+		"             from unnest(x.indkey::integer[])"
+		"                  with ordinality as k(attnum, n)"
+		"                  join pg_attribute a"
+		"                    on a.attrelid = r.oid"
+		"                   and a.attnum = k.attnum"
+		"            where k.n <= %s"
+		"          ) as cols,"
+		"          pg_get_indexdef(indexrelid),"
+		"          c.oid,"
+		"          c.conname,"
+		"          pg_get_constraintdef(c.oid),"
+		"          0 as bytes"
+		"     from pg_index x"
+		"          join pg_class i ON i.oid = x.indexrelid"
+		"          join pg_class r ON r.oid = x.indrelid"
+		"          join pg_namespace n ON n.oid = i.relnamespace"
+		"          join pg_namespace rn ON rn.oid = r.relnamespace"
+		"          left join pg_depend d "
+		"                 on d.classid = 'pg_class'::regclass"
+		"                and d.objid = i.oid"
+		"                and d.refclassid = 'pg_constraint'::regclass"
+		"                and d.deptype = 'i'"
+		"          left join pg_constraint c ON c.oid = d.refobjid"
+		"    where r.relkind = 'p' and r.relpersistence = 'p' "
+		"      and n.nspname !~ '^pg_' and n.nspname <> 'information_schema'"
+		" order by i.oid";
+
+	PQExpBuffer sql = createPQExpBuffer();
+
+	appendPQExpBuffer(sql, sqlFormat, keyAtts);
+
+	if (PQExpBufferBroken(sql))
+	{
+		log_error("Failed to prepare the partitioned indexes query: out of memory");
+		destroyPQExpBuffer(sql);
+		return false;
+	}
+
+	log_trace("schema_list_partitioned_indexes");
+
+	bool success =
+		pgsql_execute_with_params(pgsql, sql->data, 0, NULL, NULL,
+								  &context, &getIndexArray);
+
+	destroyPQExpBuffer(sql);
+
+	if (!success)
+	{
+		log_error("Failed to retrieve the list of partitioned indexes");
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the list of partitioned indexes");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * schema_list_index_attachments grabs the list of the indexes that are
+ * attached to the index of a partitioned table, sorted by parent index oid.
+ */
+bool
+schema_list_index_attachments(PGSQL *pgsql, SourceIndexAttachArray *attachArray)
+{
+	SourceIndexAttachArrayContext context = { { 0 }, attachArray, false };
+
+	char *sql =
+		"   select pi.oid, pn.nspname, pi.relname,"
+		"          ci.oid, cn.nspname, ci.relname"
+		"     from pg_inherits inh"
+		"          join pg_class pi ON pi.oid = inh.inhparent"
+		"          join pg_namespace pn ON pn.oid = pi.relnamespace"
+		"          join pg_class ci ON ci.oid = inh.inhrelid"
+		"          join pg_namespace cn ON cn.oid = ci.relnamespace"
+		"    where pi.relkind = 'I' and pi.relpersistence = 'p' "
+		"      and pn.nspname !~ '^pg_' and pn.nspname <> 'information_schema'"
+		" order by pi.oid, ci.oid";
+
+	log_trace("schema_list_index_attachments");
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &getIndexAttachArray))
+	{
+		log_error("Failed to retrieve the list of partition indexes");
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the list of partition indexes");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * schema_list_pre_data_dependencies lists the relations that the column
+ * DEFAULT and the ATTACH PARTITION archive entries depend on, sorted by
+ * pg_attrdef oid, the ATTACH PARTITION dependencies coming first with a zero
+ * objectOid.
+ */
+bool
+schema_list_pre_data_dependencies(PGSQL *pgsql,
+								  SourcePreDataDependencyArray *depArray)
+{
+	SourcePreDataDependencyArrayContext context = { { 0 }, depArray, false };
+
+	int version = 0;
+
+	if (!pgsql_server_version_num(pgsql, &version))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* declarative partitioning appeared in Postgres 10 */
+	char *isPartition = version >= 100000 ? "c.relispartition" : "false";
+
+	char *sqlFormat =
+		"   select d.oid, d.adrelid, dep.refobjid"
+		"     from pg_attrdef d"
+		"          join pg_class r ON r.oid = d.adrelid"
+		"          join pg_namespace n ON n.oid = r.relnamespace"
+		"          join pg_depend dep"
+		"            ON dep.classid = 'pg_catalog.pg_attrdef'::regclass"
+		"           and dep.objid = d.oid"
+		"           and dep.refclassid = 'pg_catalog.pg_class'::regclass"
+		"    where n.nspname !~ '^pg_' and n.nspname <> 'information_schema'"
+		" union all"
+		"   select 0, inh.inhrelid, inh.inhparent"
+		"     from pg_inherits inh"
+		"          join pg_class c ON c.oid = inh.inhrelid"
+		"          join pg_namespace n ON n.oid = c.relnamespace"
+		"    where %s and c.relkind in ('r', 'p')"
+		"      and n.nspname !~ '^pg_' and n.nspname <> 'information_schema'"
+		" order by 1, 2, 3";
+
+	PQExpBuffer sql = createPQExpBuffer();
+
+	appendPQExpBuffer(sql, sqlFormat, isPartition);
+
+	if (PQExpBufferBroken(sql))
+	{
+		log_error("Failed to prepare the pre-data dependencies query: "
+				  "out of memory");
+		destroyPQExpBuffer(sql);
+		return false;
+	}
+
+	log_trace("schema_list_pre_data_dependencies");
+
+	bool success =
+		pgsql_execute_with_params(pgsql, sql->data, 0, NULL, NULL,
+								  &context, &getPreDataDependencyArray);
+
+	destroyPQExpBuffer(sql);
+
+	if (!success)
+	{
+		log_error("Failed to retrieve the list of pre-data dependencies");
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the list of pre-data dependencies");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * schema_list_all_foreign_keys grabs the list of foreign key constraints of
+ * the ordinary tables from the given source Postgres instance and allocates
+ * a SourceForeignKey array with the result of the query, sorted by
+ * constraint oid.
+ */
+bool
+schema_list_all_foreign_keys(PGSQL *pgsql, SourceForeignKeyArray *fkeyArray)
+{
+	SourceForeignKeyArrayContext context = { { 0 }, fkeyArray, false };
+
+	char *sql =
+		"   select c.oid, c.conname, r.oid, n.nspname, r.relname,"
+		"          c.convalidated,"
+		"          pg_get_constraintdef(c.oid), c.confrelid"
+		"     from pg_constraint c"
+		"          join pg_class r ON r.oid = c.conrelid"
+		"          join pg_namespace n ON n.oid = r.relnamespace"
+		"    where c.contype = 'f' and r.relkind = 'r'"
+		"      and n.nspname !~ '^pg_' and n.nspname <> 'information_schema'"
+		" order by c.oid";
+
+	log_trace("schema_list_all_foreign_keys");
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &getForeignKeyArray))
+	{
+		log_error("Failed to retrieve the list of foreign keys");
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the list of foreign keys");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * schema_list_large_object_ranges splits the large objects of the source
+ * database in ranges of consecutive OIDs, each containing batchSize large
+ * objects, except for the last one.
+ */
+bool
+schema_list_large_object_ranges(PGSQL *pgsql,
+								int batchSize,
+								LargeObjectRangeArray *rangeArray)
+{
+	LargeObjectRangeArrayContext context = { { 0 }, rangeArray, false };
+
+	char *sql =
+		"  select min(oid), max(oid), count(*) "
+		"    from (select oid, "
+		"                 (row_number() over (order by oid) - 1) / $1 as batch "
+		"            from pg_catalog.pg_largeobject_metadata) as lo "
+		"group by batch "
+		"order by batch";
+
+	IntString batchSizeString = intToString(batchSize);
+
+	int paramCount = 1;
+	Oid paramTypes[1] = { INT8OID };
+	const char *paramValues[1] = { batchSizeString.strValue };
+
+	log_trace("schema_list_large_object_ranges");
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &getLargeObjectRangeArray))
+	{
+		log_error("Failed to list large objects");
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the list of large objects");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * schema_list_large_objects fetches the OIDs of the large objects in the
+ * given range.
+ */
+bool
+schema_list_large_objects(PGSQL *pgsql,
+						  LargeObjectRange *range,
+						  LargeObjectArray *loArray)
+{
+	LargeObjectArrayContext context = { { 0 }, loArray, false };
+
+	char *sql =
+		"  select oid "
+		"    from pg_catalog.pg_largeobject_metadata "
+		"   where oid between $1 and $2 "
+		"order by oid";
+
+	IntString minString = intToString(range->min);
+	IntString maxString = intToString(range->max);
+
+	int paramCount = 2;
+	Oid paramTypes[2] = { OIDOID, OIDOID };
+	const char *paramValues[2] = { minString.strValue, maxString.strValue };
+
+	log_trace("schema_list_large_objects %u-%u", range->min, range->max);
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &getLargeObjectArray))
+	{
+		log_error("Failed to list large objects %u to %u",
+				  range->min, range->max);
+		return false;
+	}
+
+	if (!context.parsedOk)
+	{
+		log_error("Failed to parse the list of large objects");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * schema_create_large_objects creates the given large objects on the target
+ * database, unless they exist already: the pre-data section usually
+ * restores the large objects, without their contents.
+ */
+bool
+schema_create_large_objects(PGSQL *pgsql, LargeObjectArray *loArray)
+{
+	PQExpBuffer oids = createPQExpBuffer();
+
+	if (oids == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	appendPQExpBufferChar(oids, '{');
+
+	for (int i = 0; i < loArray->count; i++)
+	{
+		appendPQExpBuffer(oids, "%s%u", i == 0 ? "" : ",", loArray->array[i]);
+	}
+
+	appendPQExpBufferChar(oids, '}');
+
+	if (PQExpBufferBroken(oids))
+	{
+		log_error("Failed to create large objects: out of memory");
+		destroyPQExpBuffer(oids);
+		return false;
+	}
+
+	char *sql =
+		"select pg_catalog.lo_create(lo.oid) "
+		"  from unnest($1::pg_catalog.oid[]) as lo(oid) "
+		" where not exists "
+		"       (select 1 "
+		"          from pg_catalog.pg_largeobject_metadata m "
+		"         where m.oid = lo.oid)";
+
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { oids->data };
+
+	bool success =
+		pgsql_execute_with_params(pgsql, sql,
+								  paramCount, paramTypes, paramValues,
+								  NULL, NULL);
+
+	destroyPQExpBuffer(oids);
+
+	return success;
+}
+
+
+/*
+ * getTableArray loops over the SQL result for the tables array query and
+ * allocates an array of tables then populates it with the query result.
+ */
+static void
+getTableArray(void *ctx, PGresult *result)
+{
+	SourceTableArrayContext *context = (SourceTableArrayContext *) ctx;
+	int nTuples = PQntuples(result);
+
+	log_trace("getTableArray: %d", nTuples);
+
+	if (PQnfields(result) != 15)
+	{
+		log_error("Query returned %d columns, expected 15", PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	/* we're not supposed to re-cycle arrays here */
+	if (context->tableArray->array != NULL)
+	{
+		/* issue a warning but let's try anyway */
+		log_warn("BUG? context's array is not null in getTableArray");
+
+		free(context->tableArray->array);
+		context->tableArray->array = NULL;
+	}
+
+	context->tableArray->count = nTuples;
+	context->tableArray->array =
+		(SourceTable *) malloc(nTuples * sizeof(SourceTable));
+
+	if (context->tableArray->array == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return;
+	}
+
+	bool parsedOk = true;
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		SourceTable *table = &(context->tableArray->array[rowNumber]);
+
+		parsedOk = parsedOk &&
+				   parseCurrentSourceTable(result, rowNumber, table);
+	}
+
+	if (!parsedOk)
+	{
+		free(context->tableArray->array);
+		context->tableArray->array = NULL;
+	}
+
+	context->parsedOk = parsedOk;
+}
+
+
+/*
+ * parseCurrentSourceTable parses a single row of the table listing query
+ * result.
+ */
+static bool
+parseCurrentSourceTable(PGresult *result, int rowNumber, SourceTable *table)
+{
+	int errors = 0;
+
+	/* 1. c.oid */
+	char *value = PQgetvalue(result, rowNumber, 0);
+
+	if (!stringToUInt32(value, &(table->oid)) || table->oid == 0)
+	{
+		log_error("Invalid OID \"%s\"", value);
+		++errors;
+	}
+
+	/* 2. n.nspname */
+	value = PQgetvalue(result, rowNumber, 1);
+
+	if (!schema_catalog_intern(value, &(table->nspname)))
+	{
+		/* errors have already been logged */
+		++errors;
+	}
+
+	/* 3. c.relname */
+	value = PQgetvalue(result, rowNumber, 2);
+
+	if (!schema_catalog_intern(value, &(table->relname)))
+	{
+		/* errors have already been logged */
+		++errors;
+	}
+
+	/* 4. c.reltuples::bigint */
+	value = PQgetvalue(result, rowNumber, 3);
+
+	if (!stringToInt64(value, &(table->reltuples)))
+	{
+		log_error("Invalid reltuples::bigint \"%s\"", value);
+		++errors;
+	}
+
+	/* 5. pg_table_size(c.oid) as bytes */
+	value = PQgetvalue(result, rowNumber, 4);
+
+	if (!stringToInt64(value, &(table->bytes)))
+	{
+		log_error("Invalid reltuples::bigint \"%s\"", value);
+		++errors;
+	}
+
+	/* 6. pg_size_pretty(c.oid) */
+	value = PQgetvalue(result, rowNumber, 5);
+
+	if (!schema_catalog_intern(value, &(table->bytesPretty)))
+	{
+		/* errors have already been logged */
+		++errors;
+	}
+
+	/* 7. relpages, computed from pg_relation_size(c.oid) */
+	value = PQgetvalue(result, rowNumber, 6);
+
+	if (!stringToInt64(value, &(table->relpages)))
+	{
+		log_error("Invalid relpages \"%s\"", value);
+		++errors;
+	}
+
+	/* 8. binary_unsafe, see COPY binary format */
+	value = PQgetvalue(result, rowNumber, 7);
+	table->binaryUnsafe = strcmp(value, "t") == 0;
+
+	/* 9. index_count */
+	value = PQgetvalue(result, rowNumber, 8);
+
+	if (!stringToInt(value, &(table->indexCount)))
+	{
+		log_error("Invalid index count \"%s\"", value);
+		++errors;
+	}
+
+	/* 10. index_bytes */
+	value = PQgetvalue(result, rowNumber, 9);
+
+	if (!stringToInt64(value, &(table->indexBytes)))
+	{
+		log_error("Invalid index bytes \"%s\"", value);
+		++errors;
+	}
+
+	/* 11. toast_bytes */
+	value = PQgetvalue(result, rowNumber, 10);
+
+	if (!stringToInt64(value, &(table->toastBytes)))
+	{
+		log_error("Invalid toast bytes \"%s\"", value);
+		++errors;
+	}
+
+	/* 12. column_count */
+	value = PQgetvalue(result, rowNumber, 11);
+
+	if (!stringToInt(value, &(table->columnCount)))
+	{
+		log_error("Invalid column count \"%s\"", value);
+		++errors;
+	}
+
+	/* 13. binary_column_count */
+	value = PQgetvalue(result, rowNumber, 12);
+
+	if (!stringToInt(value, &(table->binaryColumnCount)))
+	{
+		log_error("Invalid binary column count \"%s\"", value);
+		++errors;
+	}
+
+	/* 14. is_partition */
+	value = PQgetvalue(result, rowNumber, 13);
+	table->isPartition = strcmp(value, "t") == 0;
+
+	/* 15. copy_columns, only listed when some columns are generated */
+	if (PQgetisnull(result, rowNumber, 14))
+	{
+		table->copyColumns = NULL;
+	}
+	else
+	{
+		value = PQgetvalue(result, rowNumber, 14);
+
+		if (!schema_catalog_strdup(value, &(table->copyColumns)))
+		{
+			/* errors have already been logged */
+			++errors;
+		}
+	}
+
+	/* see --table-sample, set when applying the table filters */
+	table->samplePercent = 0.0;
+
+	/* see --copy-strategy auto, set once all the tables are known */
+	table->strategy = (TableCopyStrategy) { 0 };
+
+	return errors == 0;
+}
+
+
+/*
+ * getTableMarkerArray loops over the SQL result for the tables change markers
+ * query and allocates an array of markers then populates it with the query
+ * result.
+ */
+static void
+getTableMarkerArray(void *ctx, PGresult *result)
+{
+	SourceTableMarkerArrayContext *context =
+		(SourceTableMarkerArrayContext *) ctx;
+	int nTuples = PQntuples(result);
+
+	log_trace("getTableMarkerArray: %d", nTuples);
+
+	if (PQnfields(result) != 2)
+	{
+		log_error("Query returned %d columns, expected 2", PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	/* we're not supposed to re-cycle arrays here */
+	if (context->markerArray->array != NULL)
+	{
+		/* issue a warning but let's try anyway */
+		log_warn("BUG? context's array is not null in getTableMarkerArray");
+
+		free(context->markerArray->array);
+		context->markerArray->array = NULL;
+	}
+
+	context->markerArray->count = nTuples;
+	context->markerArray->array =
+		(SourceTableMarker *) calloc(nTuples + 1, sizeof(SourceTableMarker));
+
+	if (context->markerArray->array == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return;
+	}
+
+	bool parsedOk = true;
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		SourceTableMarker *marker = &(context->markerArray->array[rowNumber]);
+		char *value = PQgetvalue(result, rowNumber, 0);
+
+		if (!stringToUInt32(value, &(marker->oid)) || marker->oid == 0)
+		{
+			log_error("Invalid OID \"%s\"", value);
+			parsedOk = false;
+			break;
+		}
+
+		strlcpy(marker->marker,
+				PQgetvalue(result, rowNumber, 1),
+				sizeof(marker->marker));
+	}
+
+	if (!parsedOk)
+	{
+		free(context->markerArray->array);
+		context->markerArray->array = NULL;
+		context->markerArray->count = 0;
+	}
+
+	context->parsedOk = parsedOk;
+}
+
+
+/*
+ * getRelationArray loops over the SQL result for the table filters relations
+ * query and allocates an array of relations then populates it with the query
+ * result.
+ */
+static void
+getRelationArray(void *ctx, PGresult *result)
+{
+	SourceRelationArrayContext *context = (SourceRelationArrayContext *) ctx;
+	int nTuples = PQntuples(result);
+
+	log_trace("getRelationArray: %d", nTuples);
+
+	if (PQnfields(result) != 5)
+	{
+		log_error("Query returned %d columns, expected 5", PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	/* we're not supposed to re-cycle arrays here */
+	if (context->relationArray->array != NULL)
+	{
+		/* issue a warning but let's try anyway */
+		log_warn("BUG? context's array is not null in getRelationArray");
+
+		free(context->relationArray->array);
+		context->relationArray->array = NULL;
+	}
+
+	context->relationArray->count = nTuples;
+	context->relationArray->array =
+		(SourceRelation *) calloc(nTuples + 1, sizeof(SourceRelation));
+
+	if (context->relationArray->array == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return;
+	}
+
+	bool parsedOk = true;
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		SourceRelation *relation = &(context->relationArray->array[rowNumber]);
+
+		/* 1. c.oid */
+		char *value = PQgetvalue(result, rowNumber, 0);
+
+		if (!stringToUInt32(value, &(relation->oid)) || relation->oid == 0)
+		{
+			log_error("Invalid OID \"%s\"", value);
+			parsedOk = false;
+			break;
+		}
+
+		/* 2. c.relkind */
+		relation->relkind = *PQgetvalue(result, rowNumber, 1);
+
+		/* 3. n.nspname and 4. c.relname */
+		if (!schema_catalog_intern(PQgetvalue(result, rowNumber, 2),
+								   &(relation->nspname)) ||
+			!schema_catalog_intern(PQgetvalue(result, rowNumber, 3),
+								   &(relation->relname)))
+		{
+			/* errors have already been logged */
+			parsedOk = false;
+			break;
+		}
+
+		/* 5. bytes */
+		value = PQgetvalue(result, rowNumber, 4);
+
+		if (!stringToInt64(value, &(relation->bytes)))
+		{
+			log_error("Invalid table size \"%s\"", value);
+			parsedOk = false;
+			break;
+		}
+	}
+
+	if (!parsedOk)
+	{
+		free(context->relationArray->array);
+		context->relationArray->array = NULL;
+		context->relationArray->count = 0;
+	}
+
+	context->parsedOk = parsedOk;
+}
+
+
+/*
+ * getFilteredObjectArray loops over the SQL result for the filtered objects
+ * query and allocates an array of objects then populates it with the query
+ * result.
+ */
+static void
+getFilteredObjectArray(void *ctx, PGresult *result)
+{
+	SourceFilteredObjectArrayContext *context =
+		(SourceFilteredObjectArrayContext *) ctx;
+	int nTuples = PQntuples(result);
+
+	log_trace("getFilteredObjectArray: %d", nTuples);
+
+	if (PQnfields(result) != 6)
+	{
+		log_error("Query returned %d columns, expected 6", PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	/* we're not supposed to re-cycle arrays here */
+	if (context->objectArray->array != NULL)
+	{
+		/* issue a warning but let's try anyway */
+		log_warn("BUG? context's array is not null in getFilteredObjectArray");
+
+		free(context->objectArray->array);
+		context->objectArray->array = NULL;
+	}
+
+	context->objectArray->count = nTuples;
+	context->objectArray->array =
+		(SourceFilteredObject *) calloc(nTuples + 1,
+										sizeof(SourceFilteredObject));
+
+	if (context->objectArray->array == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return;
+	}
+
+	bool parsedOk = true;
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		SourceFilteredObject *object =
+			&(context->objectArray->array[rowNumber]);
+
+		parsedOk = parsedOk &&
+				   parseCurrentFilteredObject(result, rowNumber, object);
+	}
+
+	if (!parsedOk)
+	{
+		free(context->objectArray->array);
+		context->objectArray->array = NULL;
+		context->objectArray->count = 0;
+	}
+
+	context->parsedOk = parsedOk;
+}
+
+
+/*
+ * parseCurrentFilteredObject parses a single row of the filtered objects
+ * query result.
+ */
+static bool
+parseCurrentFilteredObject(PGresult *result, int rowNumber,
+						   SourceFilteredObject *object)
+{
+	int errors = 0;
+
+	/* 1. f.classid */
+	char *value = PQgetvalue(result, rowNumber, 0);
+
+	if (!stringToUInt32(value, &(object->catalogOid)))
+	{
+		log_error("Invalid catalog OID \"%s\"", value);
+		++errors;
+	}
+
+	/* 2. f.objid */
+	value = PQgetvalue(result, rowNumber, 1);
+
+	if (!stringToUInt32(value, &(object->objectOid)))
+	{
+		log_error("Invalid OID \"%s\"", value);
+		++errors;
+	}
+
+	/* the names are NULL when the object is not a relation */
+	if (PQgetisnull(result, rowNumber, 2))
+	{
+		return errors == 0;
+	}
+
+	/* 3. c.relkind */
+	object->relkind = *PQgetvalue(result, rowNumber, 2);
+
+	/* 4. n.nspname, 5. c.relname, 6. quote_ident(c.relname) */
+	if (!schema_catalog_intern(PQgetvalue(result, rowNumber, 3),
+							   &(object->nspname)) ||
+		!schema_catalog_intern(PQgetvalue(result, rowNumber, 4),
+							   &(object->relname)) ||
+		!schema_catalog_intern(PQgetvalue(result, rowNumber, 5),
+							   &(object->qrelname)))
+	{
+		/* errors have already been logged */
+		++errors;
+	}
+
+	return errors == 0;
+}
+
+
+/*
+ * getSequenceArray loops over the SQL result for the sequence array query and
+ * allocates an array of tables then populates it with the query result.
+ */
+static void
+getSequenceArray(void *ctx, PGresult *result)
+{
+	SourceSequenceArrayContext *context = (SourceSequenceArrayContext *) ctx;
+	int nTuples = PQntuples(result);
+
+	log_trace("getSequenceArray: %d", nTuples);
+
+	if (PQnfields(result) != 3)
+	{
+		log_error("Query returned %d columns, expected 3", PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	/* we're not supposed to re-cycle arrays here */
+	if (context->sequenceArray->array != NULL)
+	{
+		/* issue a warning but let's try anyway */
+		log_warn("BUG? context's array is not null in getSequenceArray");
+
+		free(context->sequenceArray->array);
+		context->sequenceArray->array = NULL;
+	}
+
+	context->sequenceArray->count = nTuples;
+	context->sequenceArray->array =
+		(SourceSequence *) malloc(nTuples * sizeof(SourceSequence));
+
+	if (context->sequenceArray->array == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return;
+	}
+
+	bool parsedOk = true;
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		SourceSequence *sequence = &(context->sequenceArray->array[rowNumber]);
+
+		parsedOk = parsedOk &&
+				   parseCurrentSourceSequence(result, rowNumber, sequence);
+	}
+
+	if (!parsedOk)
+	{
+		free(context->sequenceArray->array);
+		context->sequenceArray->array = NULL;
+	}
+
+	context->parsedOk = parsedOk;
+}
+
+
+/*
+ * getDatabaseArray loops over the SQL result for the database array query and
+ * allocates an array of databases then populates it with the query result.
+ */
+static void
+getDatabaseArray(void *ctx, PGresult *result)
+{
+	SourceDatabaseArrayContext *context = (SourceDatabaseArrayContext *) ctx;
+	int nTuples = PQntuples(result);
+
+	log_trace("getDatabaseArray: %d", nTuples);
+
+	if (PQnfields(result) != 7)
+	{
+		log_error("Query returned %d columns, expected 7", PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	/* we're not supposed to re-cycle arrays here */
+	if (context->databaseArray->array != NULL)
+	{
+		/* issue a warning but let's try anyway */
+		log_warn("BUG? context's array is not null in getDatabaseArray");
+
+		free(context->databaseArray->array);
+		context->databaseArray->array = NULL;
+	}
+
+	context->databaseArray->count = nTuples;
+	context->databaseArray->array =
+		(SourceDatabase *) calloc(nTuples, sizeof(SourceDatabase));
+
+	if (nTuples > 0 && context->databaseArray->array == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return;
+	}
+
+	bool parsedOk = true;
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		SourceDatabase *database = &(context->databaseArray->array[rowNumber]);
+
+		parsedOk = parsedOk &&
+				   parseCurrentSourceDatabase(result, rowNumber, database);
+	}
+
+	if (!parsedOk)
+	{
+		free(context->databaseArray->array);
+		context->databaseArray->array = NULL;
+	}
+
+	context->parsedOk = parsedOk;
+}
+
+
+/*
+ * parseCurrentSourceDatabase parses a single row of the database listing
+ * query result.
+ */
+static bool
+parseCurrentSourceDatabase(PGresult *result,
+						   int rowNumber,
+						   SourceDatabase *database)
+{
+	int errors = 0;
+
+	/* 1. d.oid */
+	char *value = PQgetvalue(result, rowNumber, 0);
+
+	if (!stringToUInt32(value, &(database->oid)) || database->oid == 0)
+	{
+		log_error("Invalid OID \"%s\"", value);
+		++errors;
+	}
+
+	/* 2. d.datname, 3. owner, 4. encoding, 5. datcollate, 6. datctype */
+	struct
+	{
+		char *dest;
+		const char *name;
+	}
+	names[] = {
+		{ database->datname, "Database name" },
+		{ database->owner, "Database owner name" },
+		{ database->encoding, "Database encoding" },
+		{ database->collate, "Database collation" },
+		{ database->ctype, "Database character type" }
+	};
+
+	for (int i = 0; i < 5; i++)
+	{
+		value = PQgetvalue(result, rowNumber, i + 1);
+		int length = strlcpy(names[i].dest, value, NAMEDATALEN);
+
+		if (length >= NAMEDATALEN)
+		{
+			log_error("%s \"%s\" is %d bytes long, "
+					  "the maximum expected is %d (NAMEDATALEN - 1)",
+					  names[i].name, value, length, NAMEDATALEN - 1);
+			++errors;
+		}
+	}
+
+	/* 7. bytes */
+	value = PQgetvalue(result, rowNumber, 6);
+
+	if (!stringToInt64(value, &(database->bytes)))
+	{
+		log_error("Invalid database size \"%s\"", value);
+		++errors;
+	}
+
+	return errors == 0;
+}
+
+
+/*
+ * parseCurrentSourceSequence parses a single row of the table listing query
+ * result.
+ */
+static bool
+parseCurrentSourceSequence(PGresult *result, int rowNumber, SourceSequence *seq)
+{
+	int errors = 0;
+
+	/* 1. c.oid */
+	char *value = PQgetvalue(result, rowNumber, 0);
+
+	if (!stringToUInt32(value, &(seq->oid)) || seq->oid == 0)
+	{
+		log_error("Invalid OID \"%s\"", value);
+		++errors;
+	}
+
+	/* values are fetched later, see schema_get_all_sequence_values() */
+	seq->lastValue = 0;
+	seq->isCalled = false;
+	seq->fetched = false;
+
+	/* 2. n.nspname */
+	value = PQgetvalue(result, rowNumber, 1);
+	int length = strlcpy(seq->nspname, value, NAMEDATALEN);
+
+	if (length >= NAMEDATALEN)
+	{
+		log_error("Schema name \"%s\" is %d bytes long, "
+				  "the maximum expected is %d (NAMEDATALEN - 1)",
+				  value, length, NAMEDATALEN - 1);
+		++errors;
+	}
+
+	/* 3. c.relname */
+	value = PQgetvalue(result, rowNumber, 2);
+	length = strlcpy(seq->relname, value, NAMEDATALEN);
+
+	if (length >= NAMEDATALEN)
+	{
+		log_error("Sequence name \"%s\" is %d bytes long, "
+				  "the maximum expected is %d (NAMEDATALEN - 1)",
+				  value, length, NAMEDATALEN - 1);
+		++errors;
+	}
+
+	return errors == 0;
+}
+
+
+/*
+ * getSequenceValueArray loops over the SQL result for the sequence values
+ * query, which returns a row per sequence in the same order as the sequence
+ * array, and populates the array entries with the query result.
+ */
+static void
+getSequenceValueArray(void *ctx, PGresult *result)
+{
+	SourceSequenceArrayContext *context = (SourceSequenceArrayContext *) ctx;
+	int nTuples = PQntuples(result);
+
+	log_trace("getSequenceValueArray: %d", nTuples);
+
+	if (PQnfields(result) != 3)
+	{
+		log_error("Query returned %d columns, expected 3", PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	if (nTuples != context->sequenceArray->count)
+	{
+		log_error("Query returned %d rows, expected %d",
+				  nTuples,
+				  context->sequenceArray->count);
+		context->parsedOk = false;
+		return;
+	}
+
+	bool parsedOk = true;
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		SourceSequence *seq = &(context->sequenceArray->array[rowNumber]);
+
+		parsedOk = parsedOk &&
+				   parseCurrentSequenceValue(result, rowNumber, seq);
+	}
+
+	context->parsedOk = parsedOk;
+}
+
+
+/*
+ * parseCurrentSequenceValue parses a single row of the sequence values query
+ * result. A sequence relation always has a last_value and is_called, a NULL
+ * is still reported with a warning and the sequence is then skipped.
+ */
+static bool
+parseCurrentSequenceValue(PGresult *result, int rowNumber, SourceSequence *seq)
+{
+	int errors = 0;
+	uint32_t oid = 0;
+
+	/* 1. s.oid */
+	char *value = PQgetvalue(result, rowNumber, 0);
 
-	if (!pgsql_execute_with_params(pgsql, sql,
-								   paramCount, paramTypes, paramValues,
-								   &context, &getIndexArray))
+	if (!stringToUInt32(value, &oid) || oid != seq->oid)
 	{
-		log_error("Failed to retrieve current state from the monitor");
+		log_error("Invalid OID \"%s\", expected %u", value, seq->oid);
 		return false;
 	}
 
-	if (!context.parsedOk)
+	if (PQgetisnull(result, rowNumber, 1) || PQgetisnull(result, rowNumber, 2))
 	{
-		log_error("Failed to parse current state from the monitor");
-		return false;
+		log_warn("Failed to get sequence values for \"%s\".\"%s\"",
+				 seq->nspname,
+				 seq->relname);
+
+		seq->fetched = false;
+		return true;
 	}
 
-	return true;
+	/* 2. last_value */
+	value = PQgetvalue(result, rowNumber, 1);
+
+	if (!stringToInt64(value, &(seq->lastValue)))
+	{
+		log_error("Invalid sequence last_value \"%s\"", value);
+		++errors;
+	}
+
+	/* 3. is_called */
+	value = PQgetvalue(result, rowNumber, 2);
+
+	if ((*value != 't') && (*value != 'f'))
+	{
+		log_error("Invalid is_called value \"%s\"", value);
+		++errors;
+	}
+	else
+	{
+		seq->isCalled = (*value) == 't';
+	}
+
+	seq->fetched = errors == 0;
+
+	return errors == 0;
+}
+
+
+/*
+ * appendArrayTextElement appends the given string to a Postgres array literal
+ * as a double-quoted element, escaping double-quotes and backslashes.
+ */
+static void
+appendArrayTextElement(PQExpBuffer buffer, const char *str)
+{
+	appendPQExpBufferChar(buffer, '"');
+
+	for (const char *ptr = str; *ptr != '\0'; ptr++)
+	{
+		if (*ptr == '"' || *ptr == '\\')
+		{
+			appendPQExpBufferChar(buffer, '\\');
+		}
+
+		appendPQExpBufferChar(buffer, *ptr);
+	}
+
+	appendPQExpBufferChar(buffer, '"');
 }
 
 
@@ -321,35 +2375,35 @@ schema_list_table_indexes(PGSQL *pgsql,
  * allocates an array of tables then populates it with the query result.
  */
 static void
-getTableArray(void *ctx, PGresult *result)
+getIndexArray(void *ctx, PGresult *result)
 {
-	SourceTableArrayContext *context = (SourceTableArrayContext *) ctx;
+	SourceIndexArrayContext *context = (SourceIndexArrayContext *) ctx;
 	int nTuples = PQntuples(result);
 
-	log_trace("getTableArray: %d", nTuples);
+	log_trace("getIndexArray: %d", nTuples);
 
-	if (PQnfields(result) != 6)
+	if (PQnfields(result) != 14)
 	{
-		log_error("Query returned %d columns, expected 6", PQnfields(result));
+		log_error("Query returned %d columns, expected 14", PQnfields(result));
 		context->parsedOk = false;
 		return;
 	}
 
 	/* we're not supposed to re-cycle arrays here */
-	if (context->tableArray->array != NULL)
+	if (context->indexArray->array != NULL)
 	{
 		/* issue a warning but let's try anyway */
-		log_warn("BUG? context's array is not null in getTableArray");
+		log_warn("BUG? context's array is not null in getIndexArray");
 
-		free(context->tableArray->array);
-		context->tableArray->array = NULL;
+		free(context->indexArray->array);
+		context->indexArray->array = NULL;
 	}
 
-	context->tableArray->count = nTuples;
-	context->tableArray->array =
-		(SourceTable *) malloc(nTuples * sizeof(SourceTable));
+	context->indexArray->count = nTuples;
+	context->indexArray->array =
+		(SourceIndex *) malloc(nTuples * sizeof(SourceIndex));
 
-	if (context->tableArray->array == NULL)
+	if (context->indexArray->array == NULL)
 	{
 		log_fatal(ALLOCATION_FAILED_ERROR);
 		return;
@@ -359,16 +2413,16 @@ getTableArray(void *ctx, PGresult *result)
 
 	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
 	{
-		SourceTable *table = &(context->tableArray->array[rowNumber]);
+		SourceIndex *index = &(context->indexArray->array[rowNumber]);
 
 		parsedOk = parsedOk &&
-				   parseCurrentSourceTable(result, rowNumber, table);
+				   parseCurrentSourceIndex(result, rowNumber, index);
 	}
 
 	if (!parsedOk)
 	{
-		free(context->tableArray->array);
-		context->tableArray->array = NULL;
+		free(context->indexArray->array);
+		context->indexArray->array = NULL;
 	}
 
 	context->parsedOk = parsedOk;
@@ -376,74 +2430,151 @@ getTableArray(void *ctx, PGresult *result)
 
 
 /*
- * parseCurrentSourceTable parses a single row of the table listing query
- * result.
+ * getTableArray loops over the SQL result for the tables array query and
+ * allocates an array of tables then populates it with the query result.
  */
 static bool
-parseCurrentSourceTable(PGresult *result, int rowNumber, SourceTable *table)
+parseCurrentSourceIndex(PGresult *result, int rowNumber, SourceIndex *index)
 {
 	int errors = 0;
 
-	/* 1. c.oid */
+	/* 1. i.oid */
 	char *value = PQgetvalue(result, rowNumber, 0);
 
-	if (!stringToUInt32(value, &(table->oid)) || table->oid == 0)
+	if (!stringToUInt32(value, &(index->indexOid)) || index->indexOid == 0)
 	{
-		log_error("Invalid OID \"%s\"", value);
+		log_error("Invalid index OID \"%s\"", value);
 		++errors;
 	}
 
 	/* 2. n.nspname */
 	value = PQgetvalue(result, rowNumber, 1);
-	int length = strlcpy(table->nspname, value, NAMEDATALEN);
 
-	if (length >= NAMEDATALEN)
+	if (!schema_catalog_intern(value, &(index->indexNamespace)))
 	{
-		log_error("Schema name \"%s\" is %d bytes long, "
-				  "the maximum expected is %d (NAMEDATALEN - 1)",
-				  value, length, NAMEDATALEN - 1);
+		/* errors have already been logged */
 		++errors;
 	}
 
-	/* 3. c.relname */
+	/* 3. i.relname */
 	value = PQgetvalue(result, rowNumber, 2);
-	length = strlcpy(table->relname, value, NAMEDATALEN);
 
-	if (length >= NAMEDATALEN)
+	if (!schema_catalog_intern(value, &(index->indexRelname)))
 	{
-		log_error("Table name \"%s\" is %d bytes long, "
-				  "the maximum expected is %d (NAMEDATALEN - 1)",
-				  value, length, NAMEDATALEN - 1);
+		/* errors have already been logged */
 		++errors;
 	}
 
-	/* 4. c.reltuples::bigint */
+	/* 4. r.oid */
 	value = PQgetvalue(result, rowNumber, 3);
 
-	if (!stringToInt64(value, &(table->reltuples)))
+	if (!stringToUInt32(value, &(index->tableOid)) || index->tableOid == 0)
 	{
-		log_error("Invalid reltuples::bigint \"%s\"", value);
+		log_error("Invalid OID \"%s\"", value);
 		++errors;
 	}
 
-	/* 5. pg_table_size(c.oid) as bytes */
+	/* 5. rn.nspname */
 	value = PQgetvalue(result, rowNumber, 4);
 
-	if (!stringToInt64(value, &(table->bytes)))
+	if (!schema_catalog_intern(value, &(index->tableNamespace)))
 	{
-		log_error("Invalid reltuples::bigint \"%s\"", value);
+		/* errors have already been logged */
 		++errors;
 	}
 
-	/* 6. pg_size_pretty(c.oid) */
+	/* 6. r.relname */
 	value = PQgetvalue(result, rowNumber, 5);
-	length = strlcpy(table->bytesPretty, value, NAMEDATALEN);
 
-	if (length >= NAMEDATALEN)
+	if (!schema_catalog_intern(value, &(index->tableRelname)))
 	{
-		log_error("Pretty printed byte size \"%s\" is %d bytes long, "
-				  "the maximum expected is %d (NAMEDATALEN - 1)",
-				  value, length, NAMEDATALEN - 1);
+		/* errors have already been logged */
+		++errors;
+	}
+
+	/* 7. indisprimary */
+	value = PQgetvalue(result, rowNumber, 6);
+	if (value == NULL || ((*value != 't') && (*value != 'f')))
+	{
+		log_error("Invalid indisprimary value \"%s\"", value);
+		++errors;
+	}
+	else
+	{
+		index->isPrimary = (*value) == 't';
+	}
+
+	/* 8. indisunique */
+	value = PQgetvalue(result, rowNumber, 7);
+	if (value == NULL || ((*value != 't') && (*value != 'f')))
+	{
+		log_error("Invalid indisunique value \"%s\"", value);
+		++errors;
+	}
+	else
+	{
+		index->isUnique = (*value) == 't';
+	}
+
+	/* 9. cols */
+	value = PQgetvalue(result, rowNumber, 8);
+
+	if (!schema_catalog_strdup(value, &(index->indexColumns)))
+	{
+		/* errors have already been logged */
+		++errors;
+	}
+
+	/* 10. pg_get_indexdef() */
+	value = PQgetvalue(result, rowNumber, 9);
+
+	if (!schema_catalog_strdup(value, &(index->indexDef)))
+	{
+		/* errors have already been logged */
+		++errors;
+	}
+
+	/* 11. c.oid */
+	if (PQgetisnull(result, rowNumber, 10))
+	{
+		index->constraintOid = 0;
+	}
+	else
+	{
+		value = PQgetvalue(result, rowNumber, 10);
+
+		if (!stringToUInt32(value, &(index->constraintOid)) ||
+			index->constraintOid == 0)
+		{
+			log_error("Invalid OID \"%s\"", value);
+			++errors;
+		}
+	}
+
+	/* 12. conname, an empty string when NULL */
+	value = PQgetvalue(result, rowNumber, 11);
+
+	if (!schema_catalog_intern(value, &(index->constraintName)))
+	{
+		/* errors have already been logged */
+		++errors;
+	}
+
+	/* 13. pg_get_constraintdef, an empty string when NULL */
+	value = PQgetvalue(result, rowNumber, 12);
+
+	if (!schema_catalog_strdup(value, &(index->constraintDef)))
+	{
+		/* errors have already been logged */
+		++errors;
+	}
+
+	/* 14. pg_relation_size(indexrelid) as bytes */
+	value = PQgetvalue(result, rowNumber, 13);
+
+	if (!stringToInt64(value, &(index->indexBytes)))
+	{
+		log_error("Invalid index bytes \"%s\"", value);
 		++errors;
 	}
 
@@ -452,39 +2583,31 @@ parseCurrentSourceTable(PGresult *result, int rowNumber, SourceTable *table)
 
 
 /*
- * getSequenceArray loops over the SQL result for the sequence array query and
- * allocates an array of tables then populates it with the query result.
+ * getIndexAttachArray loops over the SQL result for the index attachments
+ * query and allocates an array of attachments then populates it with the
+ * query result.
  */
 static void
-getSequenceArray(void *ctx, PGresult *result)
+getIndexAttachArray(void *ctx, PGresult *result)
 {
-	SourceSequenceArrayContext *context = (SourceSequenceArrayContext *) ctx;
+	SourceIndexAttachArrayContext *context =
+		(SourceIndexAttachArrayContext *) ctx;
 	int nTuples = PQntuples(result);
 
-	log_trace("getSequenceArray: %d", nTuples);
+	log_trace("getIndexAttachArray: %d", nTuples);
 
-	if (PQnfields(result) != 3)
+	if (PQnfields(result) != 6)
 	{
-		log_error("Query returned %d columns, expected 3", PQnfields(result));
+		log_error("Query returned %d columns, expected 6", PQnfields(result));
 		context->parsedOk = false;
 		return;
 	}
 
-	/* we're not supposed to re-cycle arrays here */
-	if (context->sequenceArray->array != NULL)
-	{
-		/* issue a warning but let's try anyway */
-		log_warn("BUG? context's array is not null in getSequenceArray");
-
-		free(context->sequenceArray->array);
-		context->sequenceArray->array = NULL;
-	}
-
-	context->sequenceArray->count = nTuples;
-	context->sequenceArray->array =
-		(SourceSequence *) malloc(nTuples * sizeof(SourceSequence));
+	context->attachArray->count = nTuples;
+	context->attachArray->array =
+		(SourceIndexAttach *) calloc(nTuples + 1, sizeof(SourceIndexAttach));
 
-	if (context->sequenceArray->array == NULL)
+	if (context->attachArray->array == NULL)
 	{
 		log_fatal(ALLOCATION_FAILED_ERROR);
 		return;
@@ -494,102 +2617,187 @@ getSequenceArray(void *ctx, PGresult *result)
 
 	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
 	{
-		SourceSequence *sequence = &(context->sequenceArray->array[rowNumber]);
+		SourceIndexAttach *attach = &(context->attachArray->array[rowNumber]);
 
 		parsedOk = parsedOk &&
-				   parseCurrentSourceSequence(result, rowNumber, sequence);
+				   parseCurrentSourceIndexAttach(result, rowNumber, attach);
+	}
+
+	if (!parsedOk)
+	{
+		free(context->attachArray->array);
+		context->attachArray->array = NULL;
+	}
+
+	context->parsedOk = parsedOk;
+}
+
+
+/*
+ * parseCurrentSourceIndexAttach parses a single row of the index attachments
+ * listing query result.
+ */
+static bool
+parseCurrentSourceIndexAttach(PGresult *result, int rowNumber,
+							  SourceIndexAttach *attach)
+{
+	int errors = 0;
+
+	/* 1. pi.oid */
+	char *value = PQgetvalue(result, rowNumber, 0);
+
+	if (!stringToUInt32(value, &(attach->parentOid)) || attach->parentOid == 0)
+	{
+		log_error("Invalid OID \"%s\"", value);
+		++errors;
+	}
+
+	/* 2. pn.nspname */
+	value = PQgetvalue(result, rowNumber, 1);
+
+	if (!schema_catalog_intern(value, &(attach->parentNamespace)))
+	{
+		/* errors have already been logged */
+		++errors;
+	}
+
+	/* 3. pi.relname */
+	value = PQgetvalue(result, rowNumber, 2);
+
+	if (!schema_catalog_intern(value, &(attach->parentRelname)))
+	{
+		/* errors have already been logged */
+		++errors;
+	}
+
+	/* 4. ci.oid */
+	value = PQgetvalue(result, rowNumber, 3);
+
+	if (!stringToUInt32(value, &(attach->childOid)) || attach->childOid == 0)
+	{
+		log_error("Invalid OID \"%s\"", value);
+		++errors;
+	}
+
+	/* 5. cn.nspname */
+	value = PQgetvalue(result, rowNumber, 4);
+
+	if (!schema_catalog_intern(value, &(attach->childNamespace)))
+	{
+		/* errors have already been logged */
+		++errors;
 	}
 
-	if (!parsedOk)
+	/* 6. ci.relname */
+	value = PQgetvalue(result, rowNumber, 5);
+
+	if (!schema_catalog_intern(value, &(attach->childRelname)))
 	{
-		free(context->sequenceArray->array);
-		context->sequenceArray->array = NULL;
+		/* errors have already been logged */
+		++errors;
 	}
 
-	context->parsedOk = parsedOk;
+	return errors == 0;
 }
 
 
 /*
- * parseCurrentSourceSequence parses a single row of the table listing query
- * result.
+ * getPreDataDependencyArray loops over the SQL result for the pre-data
+ * dependencies query and allocates an array of dependencies then populates
+ * it with the query result.
  */
-static bool
-parseCurrentSourceSequence(PGresult *result, int rowNumber, SourceSequence *seq)
+static void
+getPreDataDependencyArray(void *ctx, PGresult *result)
 {
-	int errors = 0;
+	SourcePreDataDependencyArrayContext *context =
+		(SourcePreDataDependencyArrayContext *) ctx;
+	int nTuples = PQntuples(result);
 
-	/* 1. c.oid */
-	char *value = PQgetvalue(result, rowNumber, 0);
+	log_trace("getPreDataDependencyArray: %d", nTuples);
 
-	if (!stringToUInt32(value, &(seq->oid)) || seq->oid == 0)
+	if (PQnfields(result) != 3)
 	{
-		log_error("Invalid OID \"%s\"", value);
-		++errors;
+		log_error("Query returned %d columns, expected 3", PQnfields(result));
+		context->parsedOk = false;
+		return;
 	}
 
-	/* 2. n.nspname */
-	value = PQgetvalue(result, rowNumber, 1);
-	int length = strlcpy(seq->nspname, value, NAMEDATALEN);
+	context->depArray->count = nTuples;
+	context->depArray->array =
+		(SourcePreDataDependency *) calloc(nTuples + 1,
+										   sizeof(SourcePreDataDependency));
 
-	if (length >= NAMEDATALEN)
+	if (context->depArray->array == NULL)
 	{
-		log_error("Schema name \"%s\" is %d bytes long, "
-				  "the maximum expected is %d (NAMEDATALEN - 1)",
-				  value, length, NAMEDATALEN - 1);
-		++errors;
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return;
 	}
 
-	/* 3. c.relname */
-	value = PQgetvalue(result, rowNumber, 2);
-	length = strlcpy(seq->relname, value, NAMEDATALEN);
+	bool parsedOk = true;
 
-	if (length >= NAMEDATALEN)
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
 	{
-		log_error("Sequence name \"%s\" is %d bytes long, "
-				  "the maximum expected is %d (NAMEDATALEN - 1)",
-				  value, length, NAMEDATALEN - 1);
-		++errors;
+		SourcePreDataDependency *dep = &(context->depArray->array[rowNumber]);
+
+		uint32_t *oids[] = { &(dep->objectOid), &(dep->tableOid), &(dep->refOid) };
+
+		for (int fieldNumber = 0; fieldNumber < 3; fieldNumber++)
+		{
+			char *value = PQgetvalue(result, rowNumber, fieldNumber);
+
+			if (!stringToUInt32(value, oids[fieldNumber]))
+			{
+				log_error("Invalid OID \"%s\"", value);
+				parsedOk = false;
+			}
+		}
 	}
 
-	return errors == 0;
+	if (!parsedOk)
+	{
+		free(context->depArray->array);
+		context->depArray->array = NULL;
+	}
+
+	context->parsedOk = parsedOk;
 }
 
 
 /*
- * getTableArray loops over the SQL result for the tables array query and
- * allocates an array of tables then populates it with the query result.
+ * getForeignKeyArray loops over the SQL result for the foreign keys array
+ * query and allocates an array of foreign keys then populates it with the
+ * query result.
  */
 static void
-getIndexArray(void *ctx, PGresult *result)
+getForeignKeyArray(void *ctx, PGresult *result)
 {
-	SourceIndexArrayContext *context = (SourceIndexArrayContext *) ctx;
+	SourceForeignKeyArrayContext *context = (SourceForeignKeyArrayContext *) ctx;
 	int nTuples = PQntuples(result);
 
-	log_trace("getIndexArray: %d", nTuples);
+	log_trace("getForeignKeyArray: %d", nTuples);
 
-	if (PQnfields(result) != 13)
+	if (PQnfields(result) != 8)
 	{
-		log_error("Query returned %d columns, expected 13", PQnfields(result));
+		log_error("Query returned %d columns, expected 8", PQnfields(result));
 		context->parsedOk = false;
 		return;
 	}
 
 	/* we're not supposed to re-cycle arrays here */
-	if (context->indexArray->array != NULL)
+	if (context->fkeyArray->array != NULL)
 	{
 		/* issue a warning but let's try anyway */
-		log_warn("BUG? context's array is not null in getIndexArray");
+		log_warn("BUG? context's array is not null in getForeignKeyArray");
 
-		free(context->indexArray->array);
-		context->indexArray->array = NULL;
+		free(context->fkeyArray->array);
+		context->fkeyArray->array = NULL;
 	}
 
-	context->indexArray->count = nTuples;
-	context->indexArray->array =
-		(SourceIndex *) malloc(nTuples * sizeof(SourceIndex));
+	context->fkeyArray->count = nTuples;
+	context->fkeyArray->array =
+		(SourceForeignKey *) malloc(nTuples * sizeof(SourceForeignKey));
 
-	if (context->indexArray->array == NULL)
+	if (context->fkeyArray->array == NULL)
 	{
 		log_fatal(ALLOCATION_FAILED_ERROR);
 		return;
@@ -599,16 +2807,16 @@ getIndexArray(void *ctx, PGresult *result)
 
 	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
 	{
-		SourceIndex *index = &(context->indexArray->array[rowNumber]);
+		SourceForeignKey *fkey = &(context->fkeyArray->array[rowNumber]);
 
 		parsedOk = parsedOk &&
-				   parseCurrentSourceIndex(result, rowNumber, index);
+				   parseCurrentSourceForeignKey(result, rowNumber, fkey);
 	}
 
 	if (!parsedOk)
 	{
-		free(context->indexArray->array);
-		context->indexArray->array = NULL;
+		free(context->fkeyArray->array);
+		context->fkeyArray->array = NULL;
 	}
 
 	context->parsedOk = parsedOk;
@@ -616,174 +2824,333 @@ getIndexArray(void *ctx, PGresult *result)
 
 
 /*
- * getTableArray loops over the SQL result for the tables array query and
- * allocates an array of tables then populates it with the query result.
+ * parseCurrentSourceForeignKey parses a single row of the foreign keys
+ * listing query result.
  */
 static bool
-parseCurrentSourceIndex(PGresult *result, int rowNumber, SourceIndex *index)
+parseCurrentSourceForeignKey(PGresult *result, int rowNumber,
+							 SourceForeignKey *fkey)
 {
 	int errors = 0;
 
-	/* 1. i.oid */
+	/* 1. c.oid */
 	char *value = PQgetvalue(result, rowNumber, 0);
 
-	if (!stringToUInt32(value, &(index->indexOid)) || index->indexOid == 0)
+	if (!stringToUInt32(value, &(fkey->constraintOid)) ||
+		fkey->constraintOid == 0)
 	{
-		log_error("Invalid index OID \"%s\"", value);
+		log_error("Invalid constraint OID \"%s\"", value);
 		++errors;
 	}
 
-	/* 2. n.nspname */
+	/* 2. c.conname */
 	value = PQgetvalue(result, rowNumber, 1);
-	int length = strlcpy(index->indexNamespace, value, NAMEDATALEN);
 
-	if (length >= NAMEDATALEN)
+	if (!schema_catalog_intern(value, &(fkey->constraintName)))
 	{
-		log_error("Schema name \"%s\" is %d bytes long, "
-				  "the maximum expected is %d (NAMEDATALEN - 1)",
-				  value, length, NAMEDATALEN - 1);
+		/* errors have already been logged */
 		++errors;
 	}
 
-	/* 3. i.relname */
+	/* 3. r.oid */
 	value = PQgetvalue(result, rowNumber, 2);
-	length = strlcpy(index->indexRelname, value, NAMEDATALEN);
 
-	if (length >= NAMEDATALEN)
+	if (!stringToUInt32(value, &(fkey->tableOid)) || fkey->tableOid == 0)
 	{
-		log_error("Index name \"%s\" is %d bytes long, "
-				  "the maximum expected is %d (NAMEDATALEN - 1)",
-				  value, length, NAMEDATALEN - 1);
+		log_error("Invalid OID \"%s\"", value);
 		++errors;
 	}
 
-	/* 4. r.oid */
+	/* 4. n.nspname */
 	value = PQgetvalue(result, rowNumber, 3);
 
-	if (!stringToUInt32(value, &(index->tableOid)) || index->tableOid == 0)
+	if (!schema_catalog_intern(value, &(fkey->tableNamespace)))
 	{
-		log_error("Invalid OID \"%s\"", value);
+		/* errors have already been logged */
 		++errors;
 	}
 
-	/* 5. rn.nspname */
+	/* 5. r.relname */
 	value = PQgetvalue(result, rowNumber, 4);
-	length = strlcpy(index->tableNamespace, value, NAMEDATALEN);
 
-	if (length >= NAMEDATALEN)
+	if (!schema_catalog_intern(value, &(fkey->tableRelname)))
 	{
-		log_error("Schema name \"%s\" is %d bytes long, "
-				  "the maximum expected is %d (NAMEDATALEN - 1)",
-				  value, length, NAMEDATALEN - 1);
+		/* errors have already been logged */
 		++errors;
 	}
 
-	/* 6. r.relname */
+	/* 6. c.convalidated */
 	value = PQgetvalue(result, rowNumber, 5);
-	length = strlcpy(index->tableRelname, value, NAMEDATALEN);
-
-	if (length >= NAMEDATALEN)
+	if (value == NULL || ((*value != 't') && (*value != 'f')))
 	{
-		log_error("Index name \"%s\" is %d bytes long, "
-				  "the maximum expected is %d (NAMEDATALEN - 1)",
-				  value, length, NAMEDATALEN - 1);
+		log_error("Invalid convalidated value \"%s\"", value);
 		++errors;
 	}
+	else
+	{
+		fkey->isValidated = (*value) == 't';
+	}
 
-	/* 7. indisprimary */
+	/* 7. pg_get_constraintdef */
 	value = PQgetvalue(result, rowNumber, 6);
-	if (value == NULL || ((*value != 't') && (*value != 'f')))
+
+	if (!schema_catalog_strdup(value, &(fkey->constraintDef)))
 	{
-		log_error("Invalid indisprimary value \"%s\"", value);
+		/* errors have already been logged */
 		++errors;
 	}
-	else
-	{
-		index->isPrimary = (*value) == 't';
-	}
 
-	/* 8. indisunique */
+	/* 8. c.confrelid */
 	value = PQgetvalue(result, rowNumber, 7);
-	if (value == NULL || ((*value != 't') && (*value != 'f')))
+
+	if (!stringToUInt32(value, &(fkey->referencedTableOid)))
 	{
-		log_error("Invalid indisunique value \"%s\"", value);
+		log_error("Invalid referenced table OID \"%s\"", value);
 		++errors;
 	}
-	else
+
+	return errors == 0;
+}
+
+
+/*
+ * schema_list_index_progress fetches the progress of the CREATE INDEX
+ * commands that are running on the server, using the view
+ * pg_stat_progress_create_index that exists in Postgres 12 and later.
+ */
+bool
+schema_list_index_progress(PGSQL *pgsql, IndexProgressArray *progressArray)
+{
+	IndexProgressArrayContext context = { { 0 }, progressArray, false };
+
+	char *sql =
+		"  select pid, index_relid, phase, "
+		"         blocks_total, blocks_done, tuples_total, tuples_done "
+		"    from pg_catalog.pg_stat_progress_create_index "
+		"order by pid";
+
+	log_trace("schema_list_index_progress");
+
+	if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+								   &context, &getIndexProgressArray))
 	{
-		index->isUnique = (*value) == 't';
+		log_error("Failed to list the CREATE INDEX progress");
+		return false;
 	}
 
-	/* 9. cols */
-	value = PQgetvalue(result, rowNumber, 8);
-	length = strlcpy(index->indexColumns, value, BUFSIZE);
-
-	if (length >= BUFSIZE)
+	if (!context.parsedOk)
 	{
-		log_error("Index name \"%s\" is %d bytes long, "
-				  "the maximum expected is %d (BUFSIZE - 1)",
-				  value, length, BUFSIZE - 1);
-		++errors;
+		log_error("Failed to parse the CREATE INDEX progress");
+		return false;
 	}
 
-	/* 10. pg_get_indexdef() */
-	value = PQgetvalue(result, rowNumber, 9);
-	length = strlcpy(index->indexDef, value, BUFSIZE);
+	return true;
+}
 
-	if (length >= BUFSIZE)
+
+/*
+ * getLargeObjectRangeArray loops over the SQL result for the large object
+ * ranges query and allocates an array of ranges then populates it with the
+ * query result.
+ */
+static void
+getLargeObjectRangeArray(void *ctx, PGresult *result)
+{
+	LargeObjectRangeArrayContext *context = (LargeObjectRangeArrayContext *) ctx;
+	int nTuples = PQntuples(result);
+
+	log_trace("getLargeObjectRangeArray: %d", nTuples);
+
+	if (PQnfields(result) != 3)
 	{
-		log_error("Index name \"%s\" is %d bytes long, "
-				  "the maximum expected is %d (BUFSIZE - 1)",
-				  value, length, BUFSIZE - 1);
-		++errors;
+		log_error("Query returned %d columns, expected 3", PQnfields(result));
+		context->parsedOk = false;
+		return;
 	}
 
-	/* 11. c.oid */
-	if (PQgetisnull(result, rowNumber, 10))
+	context->rangeArray->count = nTuples;
+	context->rangeArray->array =
+		(LargeObjectRange *) calloc(nTuples + 1, sizeof(LargeObjectRange));
+
+	if (context->rangeArray->array == NULL)
 	{
-		index->constraintOid = 0;
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return;
 	}
-	else
+
+	int errors = 0;
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
 	{
-		value = PQgetvalue(result, rowNumber, 10);
+		LargeObjectRange *range = &(context->rangeArray->array[rowNumber]);
 
-		if (!stringToUInt32(value, &(index->constraintOid)) ||
-			index->constraintOid == 0)
+		char *value = PQgetvalue(result, rowNumber, 0);
+
+		if (!stringToUInt32(value, &(range->min)))
+		{
+			log_error("Invalid OID \"%s\"", value);
+			++errors;
+		}
+
+		value = PQgetvalue(result, rowNumber, 1);
+
+		if (!stringToUInt32(value, &(range->max)))
 		{
 			log_error("Invalid OID \"%s\"", value);
 			++errors;
 		}
+
+		value = PQgetvalue(result, rowNumber, 2);
+
+		if (!stringToInt(value, &(range->count)))
+		{
+			log_error("Invalid large object count \"%s\"", value);
+			++errors;
+		}
 	}
 
-	/* 12. conname */
-	if (!PQgetisnull(result, rowNumber, 11))
+	if (errors > 0)
 	{
-		value = PQgetvalue(result, rowNumber, 11);
-		length = strlcpy(index->constraintName, value, NAMEDATALEN);
+		free(context->rangeArray->array);
+		context->rangeArray->array = NULL;
+	}
 
-		if (length >= NAMEDATALEN)
+	context->parsedOk = errors == 0;
+}
+
+
+/*
+ * getIndexProgressArray loops over the SQL result for the CREATE INDEX
+ * progress query and allocates an array of progress entries then populates
+ * it with the query result.
+ */
+static void
+getIndexProgressArray(void *ctx, PGresult *result)
+{
+	IndexProgressArrayContext *context = (IndexProgressArrayContext *) ctx;
+	int nTuples = PQntuples(result);
+
+	log_trace("getIndexProgressArray: %d", nTuples);
+
+	if (PQnfields(result) != 7)
+	{
+		log_error("Query returned %d columns, expected 7", PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
+
+	context->progressArray->count = nTuples;
+	context->progressArray->array =
+		(IndexProgress *) calloc(nTuples + 1, sizeof(IndexProgress));
+
+	if (context->progressArray->array == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return;
+	}
+
+	int errors = 0;
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		IndexProgress *progress = &(context->progressArray->array[rowNumber]);
+
+		char *value = PQgetvalue(result, rowNumber, 0);
+
+		if (!stringToInt(value, &(progress->pid)))
 		{
-			log_error("Index name \"%s\" is %d bytes long, "
-					  "the maximum expected is %d (NAMEDATALEN - 1)",
-					  value, length, NAMEDATALEN - 1);
+			log_error("Invalid pid \"%s\"", value);
+			++errors;
+		}
+
+		value = PQgetvalue(result, rowNumber, 1);
+
+		if (!stringToUInt32(value, &(progress->indexOid)))
+		{
+			log_error("Invalid OID \"%s\"", value);
 			++errors;
 		}
+
+		value = PQgetvalue(result, rowNumber, 2);
+		strlcpy(progress->phase, value, sizeof(progress->phase));
+
+		int64_t *counters[] = {
+			&(progress->blocksTotal),
+			&(progress->blocksDone),
+			&(progress->tuplesTotal),
+			&(progress->tuplesDone)
+		};
+
+		for (int i = 0; i < 4; i++)
+		{
+			value = PQgetvalue(result, rowNumber, 3 + i);
+
+			if (!stringToInt64(value, counters[i]))
+			{
+				log_error("Invalid CREATE INDEX progress counter \"%s\"",
+						  value);
+				++errors;
+			}
+		}
 	}
 
-	/* 13. pg_get_constraintdef */
-	if (!PQgetisnull(result, rowNumber, 12))
+	if (errors > 0)
 	{
-		value = PQgetvalue(result, rowNumber, 12);
-		length = strlcpy(index->constraintDef, value, BUFSIZE);
+		free(context->progressArray->array);
+		context->progressArray->array = NULL;
+	}
+
+	context->parsedOk = errors == 0;
+}
+
+
+/*
+ * getLargeObjectArray loops over the SQL result for the large objects query
+ * and allocates an array of OIDs then populates it with the query result.
+ */
+static void
+getLargeObjectArray(void *ctx, PGresult *result)
+{
+	LargeObjectArrayContext *context = (LargeObjectArrayContext *) ctx;
+	int nTuples = PQntuples(result);
+
+	log_trace("getLargeObjectArray: %d", nTuples);
+
+	if (PQnfields(result) != 1)
+	{
+		log_error("Query returned %d columns, expected 1", PQnfields(result));
+		context->parsedOk = false;
+		return;
+	}
 
-		if (length >= BUFSIZE)
+	context->loArray->count = nTuples;
+	context->loArray->array =
+		(uint32_t *) calloc(nTuples + 1, sizeof(uint32_t));
+
+	if (context->loArray->array == NULL)
+	{
+		log_fatal(ALLOCATION_FAILED_ERROR);
+		return;
+	}
+
+	int errors = 0;
+
+	for (int rowNumber = 0; rowNumber < nTuples; rowNumber++)
+	{
+		char *value = PQgetvalue(result, rowNumber, 0);
+
+		if (!stringToUInt32(value, &(context->loArray->array[rowNumber])))
 		{
-			log_error("Index name \"%s\" is %d bytes long, "
-					  "the maximum expected is %d (BUFSIZE - 1)",
-					  value, length, BUFSIZE - 1);
+			log_error("Invalid OID \"%s\"", value);
 			++errors;
 		}
 	}
 
-	return errors == 0;
+	if (errors > 0)
+	{
+		free(context->loArray->array);
+		context->loArray->array = NULL;
+	}
+
+	context->parsedOk = errors == 0;
 }
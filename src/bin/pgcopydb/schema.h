@@ -13,15 +13,46 @@
 /*
  * SourceTable caches the information we need about all the ordinary tables
  * found in the source database.
+ *
+ * The names are interned in the catalog arena, see schema_catalog_intern(),
+ * which keeps the structure small even with a great many tables.
  */
+/*
+ * TableCopyStrategy is the copy strategy of a table as chosen from the source
+ * catalog stats with --copy-strategy auto, see strategy.c. When chosen is
+ * false, the command line options apply to the table.
+ */
+typedef struct TableCopyStrategy
+{
+	bool chosen;
+	CopyFormat copyFormat;
+	uint64_t splitTablesLargerThan; /* 0 when the table is not split */
+	bool multiplex;
+	bool orderByPk;
+	bool freeze;
+} TableCopyStrategy;
+
+
 typedef struct SourceTable
 {
 	uint32_t oid;
-	char nspname[NAMEDATALEN];
-	char relname[NAMEDATALEN];
+	bool binaryUnsafe;          /* has columns not fit for COPY binary */
+	int indexCount;             /* how many indexes on the source table */
+	char *nspname;
+	char *relname;
+	char *bytesPretty;          /* pg_size_pretty */
 	int64_t reltuples;
 	int64_t bytes;
-	char bytesPretty[NAMEDATALEN]; /* pg_size_pretty */
+	int64_t relpages;           /* main fork size in blocks */
+	int64_t indexBytes;         /* sum of the source indexes sizes */
+	int64_t toastBytes;         /* TOAST table size, included in bytes */
+	char *changeMarker;         /* see schema_list_table_markers(), or NULL */
+	int columnCount;
+	int binaryColumnCount;      /* fixed width, bytea, and numeric columns */
+	bool isPartition;
+	char *copyColumns;          /* non-generated columns, or NULL */
+	double samplePercent;       /* see --table-sample, 0 to copy all rows */
+	TableCopyStrategy strategy; /* see --copy-strategy auto */
 } SourceTable;
 
 
@@ -32,6 +63,73 @@ typedef struct SourceTableArray
 } SourceTableArray;
 
 
+/*
+ * SourceRelation is an ordinary or partitioned table of the source database,
+ * as listed to apply the table filters to, see filters.c.
+ */
+typedef struct SourceRelation
+{
+	uint32_t oid;
+	char relkind;
+	char *nspname;
+	char *relname;
+	int64_t bytes;              /* zero for partitioned tables */
+} SourceRelation;
+
+
+typedef struct SourceRelationArray
+{
+	int count;
+	SourceRelation *array;      /* malloc'ed area */
+} SourceRelationArray;
+
+
+/*
+ * SourceFilteredObject is an object of the source database that the table
+ * filters exclude: either a table, or an object that can't be restored
+ * without that table, such as its indexes, constraints, triggers, owned
+ * sequences, partitions, the foreign keys that reference it, or the views
+ * that use it. The names are only known for relations.
+ */
+typedef struct SourceFilteredObject
+{
+	uint32_t catalogOid;
+	uint32_t objectOid;
+	char relkind;               /* '\0' when not a relation */
+	char *nspname;              /* NULL when not a relation */
+	char *relname;
+	char *qrelname;             /* quote_ident(relname), as pg_dump tags it */
+} SourceFilteredObject;
+
+
+typedef struct SourceFilteredObjectArray
+{
+	int count;
+	SourceFilteredObject *array;    /* malloc'ed area, sorted by oid */
+} SourceFilteredObjectArray;
+
+
+/*
+ * SourceTableMarker registers the change marker of a table at the time the
+ * source snapshot is exported: its relfilenode and its cumulative count of
+ * inserted, updated, and deleted rows, see pgcopydb copy data --refresh.
+ */
+#define TABLE_CHANGE_MARKER_SIZE 128
+
+typedef struct SourceTableMarker
+{
+	uint32_t oid;
+	char marker[TABLE_CHANGE_MARKER_SIZE];
+} SourceTableMarker;
+
+
+typedef struct SourceTableMarkerArray
+{
+	int count;
+	SourceTableMarker *array;   /* malloc'ed area, sorted by oid */
+} SourceTableMarkerArray;
+
+
 /*
  * SourceSequence caches the information we need about all the sequences found
  * in the source database.
@@ -43,6 +141,7 @@ typedef struct SourceSequence
 	char relname[NAMEDATALEN];
 	int64_t lastValue;
 	bool isCalled;
+	bool fetched;               /* lastValue and isCalled are known */
 } SourceSequence;
 
 
@@ -55,22 +154,28 @@ typedef struct SourceSequenceArray
 /*
  * SourceIndex caches the information we need about all the indexes attached to
  * the ordinary tables found in the source database.
+ *
+ * The names and definitions are allocated in the catalog arena, so that long
+ * expression index definitions are kept as a whole. The constraint name and
+ * definition are empty strings when the index does not implement a
+ * constraint.
  */
 typedef struct SourceIndex
 {
 	uint32_t indexOid;
-	char indexNamespace[NAMEDATALEN];
-	char indexRelname[NAMEDATALEN];
 	uint32_t tableOid;
-	char tableNamespace[NAMEDATALEN];
-	char tableRelname[NAMEDATALEN];
+	uint32_t constraintOid;
 	bool isPrimary;
 	bool isUnique;
-	char indexColumns[BUFSIZE];
-	char indexDef[BUFSIZE];
-	uint32_t constraintOid;
-	char constraintName[NAMEDATALEN];
-	char constraintDef[BUFSIZE];
+	char *indexNamespace;
+	char *indexRelname;
+	char *tableNamespace;
+	char *tableRelname;
+	char *indexColumns;         /* quoted key columns, without INCLUDE ones */
+	char *indexDef;
+	char *constraintName;
+	char *constraintDef;
+	int64_t indexBytes;
 } SourceIndex;
 
 
@@ -81,13 +186,175 @@ typedef struct SourceIndexArray
 } SourceIndexArray;
 
 
+/*
+ * SourceIndexAttach registers that an index is attached to an index of a
+ * partitioned table, as found in pg_inherits. The child index is either the
+ * index of a partition, or the index of a partitioned table in a multi-level
+ * partition hierarchy.
+ */
+typedef struct SourceIndexAttach
+{
+	uint32_t parentOid;
+	uint32_t childOid;
+	char *parentNamespace;
+	char *parentRelname;
+	char *childNamespace;
+	char *childRelname;
+} SourceIndexAttach;
+
+
+typedef struct SourceIndexAttachArray
+{
+	int count;
+	SourceIndexAttach *array;   /* malloc'ed area, sorted by parent oid */
+} SourceIndexAttachArray;
+
+
+/*
+ * SourcePreDataDependency registers that a pre-data archive entry that
+ * pg_dump sorts after all the TABLE entries depends on a relation: a column
+ * DEFAULT depends on its table and on the sequences that it uses, and the
+ * ATTACH PARTITION of a partition depends on the partition and its parent.
+ */
+typedef struct SourcePreDataDependency
+{
+	uint32_t objectOid;         /* pg_attrdef oid, or 0 for ATTACH PARTITION */
+	uint32_t tableOid;          /* table of the DEFAULT, or the partition */
+	uint32_t refOid;            /* relation that must be restored first */
+} SourcePreDataDependency;
+
+
+typedef struct SourcePreDataDependencyArray
+{
+	int count;
+	SourcePreDataDependency *array; /* malloc'ed area, sorted by objectOid */
+} SourcePreDataDependencyArray;
+
+
+/*
+ * SourceForeignKey caches the information we need about the foreign key
+ * constraints of the ordinary tables found in the source database.
+ */
+typedef struct SourceForeignKey
+{
+	uint32_t constraintOid;
+	uint32_t tableOid;
+	uint32_t referencedTableOid;
+	bool isValidated;           /* false when NOT VALID on the source */
+	char *constraintName;
+	char *tableNamespace;
+	char *tableRelname;
+	char *constraintDef;
+} SourceForeignKey;
+
+
+typedef struct SourceForeignKeyArray
+{
+	int count;
+	SourceForeignKey *array;    /* malloc'ed area */
+} SourceForeignKeyArray;
+
+
+/*
+ * SourceDatabase caches the information we need to create the databases of
+ * the source cluster on the target, see pgcopydb copy-cluster.
+ */
+typedef struct SourceDatabase
+{
+	uint32_t oid;
+	char datname[NAMEDATALEN];
+	char owner[NAMEDATALEN];
+	char encoding[NAMEDATALEN];
+	char collate[NAMEDATALEN];
+	char ctype[NAMEDATALEN];
+	int64_t bytes;
+} SourceDatabase;
+
+
+typedef struct SourceDatabaseArray
+{
+	int count;
+	SourceDatabase *array;      /* malloc'ed area */
+} SourceDatabaseArray;
+
+
+/*
+ * Large objects are copied in batches of consecutive OIDs, see
+ * schema_list_large_object_ranges().
+ */
+typedef struct LargeObjectRange
+{
+	uint32_t min;
+	uint32_t max;
+	int count;
+} LargeObjectRange;
+
+typedef struct LargeObjectRangeArray
+{
+	int count;
+	LargeObjectRange *array;    /* malloc'ed area */
+} LargeObjectRangeArray;
+
+typedef struct LargeObjectArray
+{
+	int count;
+	uint32_t *array;            /* malloc'ed area */
+} LargeObjectArray;
+
+/*
+ * The CREATE INDEX progress of the target server backends, as found in
+ * pg_stat_progress_create_index (Postgres 12 and later).
+ */
+typedef struct IndexProgress
+{
+	int pid;
+	uint32_t indexOid;
+	char phase[NAMEDATALEN];
+	int64_t blocksTotal;
+	int64_t blocksDone;
+	int64_t tuplesTotal;
+	int64_t tuplesDone;
+} IndexProgress;
+
+typedef struct IndexProgressArray
+{
+	int count;
+	IndexProgress *array;       /* malloc'ed area */
+} IndexProgressArray;
+
+
+
+bool schema_catalog_intern(const char *str, char **dest);
+bool schema_catalog_strdup(const char *str, char **dest);
+uint64_t schema_catalog_bytes(void);
+
 bool schema_list_ordinary_tables(PGSQL *pgsql, SourceTableArray *tableArray);
 
+bool schema_list_table_markers(PGSQL *pgsql, SourceTableMarkerArray *markerArray);
+
+bool schema_list_filter_relations(PGSQL *pgsql,
+								  SourceRelationArray *relationArray);
+bool schema_list_filtered_objects(PGSQL *pgsql,
+								  uint32_t *tableOids,
+								  int tableCount,
+								  SourceFilteredObjectArray *objectArray);
+
+#define CATALOG_FINGERPRINT_SIZE 64
+
+bool schema_catalog_fingerprint(PGSQL *pgsql, char *fingerprint, size_t size);
+
+bool schema_list_databases(PGSQL *pgsql, SourceDatabaseArray *databaseArray);
+
 bool schema_list_sequences(PGSQL *pgsql, SourceSequenceArray *seqArray);
 
 bool schema_get_sequence_value(PGSQL *pgsql, SourceSequence *seq);
 bool schema_set_sequence_value(PGSQL *pgsql, SourceSequence *seq);
 
+bool schema_get_all_sequence_values(PGSQL *pgsql,
+									SourceSequenceArray *seqArray);
+bool schema_set_all_sequence_values(PGSQL *pgsql,
+									SourceSequenceArray *seqArray);
+
 bool schema_list_all_indexes(PGSQL *pgsql, SourceIndexArray *indexArray);
 
 bool schema_list_table_indexes(PGSQL *pgsql,
@@ -95,4 +362,26 @@ bool schema_list_table_indexes(PGSQL *pgsql,
 							   const char *tableName,
 							   SourceIndexArray *indexArray);
 
+bool schema_list_partitioned_indexes(PGSQL *pgsql, SourceIndexArray *indexArray);
+bool schema_list_index_attachments(PGSQL *pgsql,
+								   SourceIndexAttachArray *attachArray);
+
+bool schema_list_pre_data_dependencies(PGSQL *pgsql,
+									  SourcePreDataDependencyArray *depArray);
+
+bool schema_list_all_foreign_keys(PGSQL *pgsql,
+								  SourceForeignKeyArray *fkeyArray);
+
+bool schema_list_large_object_ranges(PGSQL *pgsql,
+									 int batchSize,
+									 LargeObjectRangeArray *rangeArray);
+
+bool schema_list_large_objects(PGSQL *pgsql,
+							   LargeObjectRange *range,
+							   LargeObjectArray *loArray);
+
+bool schema_create_large_objects(PGSQL *pgsql, LargeObjectArray *loArray);
+
+bool schema_list_index_progress(PGSQL *pgsql, IndexProgressArray *progressArray);
+
 #endif /* SCHEMA_H */
@@ -0,0 +1,547 @@
+/*
+ * src/bin/pgcopydb/snapshot.c
+ *     Implementation of a CLI to copy a database between two Postgres instances
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "copydb.h"
+#include "log.h"
+#include "pgsql.h"
+#include "signals.h"
+#include "string_utils.h"
+
+
+static bool copydb_export_snapshot(TransactionSnapshot *snapshot);
+static bool copydb_create_slot_snapshot(TransactionSnapshot *snapshot);
+static bool copydb_close_transaction_snapshot(TransactionSnapshot *snapshot);
+static bool copydb_prepare_replica_snapshots(CopyDataSpec *specs);
+static bool copydb_wait_for_replica(TransactionSnapshot *replica,
+									int replicaIndex,
+									const char *lsn);
+static void copydb_drop_slot_atexit(void);
+
+
+/*
+ * The replication slot created for --follow is only useful to the run that
+ * created it: --follow is not compatible with --resume. Unless the slot is
+ * handed over with copydb_release_replication_slot(), the process that
+ * created it drops it at exit, so that a failed or interrupted run neither
+ * retains WAL on the source database nor prevents the next run from
+ * creating the slot again.
+ */
+static char slotCleanupName[NAMEDATALEN] = { 0 };
+static char slotCleanupPguri[MAXCONNINFO] = { 0 };
+static pid_t slotCleanupPid = 0;
+
+
+/*
+ * copydb_prepare_snapshot connects to the source database and exports a
+ * snapshot that all the sub-processes then re-use, so that the whole copy is
+ * consistent: the pg_dump commands and each table COPY see the same data.
+ *
+ * The transaction that exported the snapshot must be kept open for as long
+ * as other sessions want to import it, so the connection remains open until
+ * copydb_close_snapshot() is called.
+ *
+ * When using --snapshot we skip exporting our own snapshot and re-use the
+ * given one, and when using --not-consistent we do nothing. When using
+ * --follow the snapshot is exported by creating a logical replication slot.
+ *
+ * When using --source-replica, a snapshot is also exported on each replica,
+ * see copydb_prepare_replica_snapshots().
+ *
+ * The change marker of each table is read first, see --refresh.
+ */
+bool
+copydb_prepare_snapshot(CopyDataSpec *specs)
+{
+	/* the tables change markers must not be older than the snapshot */
+	if (!copydb_fetch_table_markers(specs))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!copydb_export_snapshot(&(specs->sourceSnapshot)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (specs->sourceReplicaCount > 0)
+	{
+		return copydb_prepare_replica_snapshots(specs);
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_export_snapshot exports a snapshot on the server that the given
+ * snapshot structure points to, depending on its current state.
+ */
+static bool
+copydb_export_snapshot(TransactionSnapshot *snapshot)
+{
+	switch (snapshot->state)
+	{
+		case SNAPSHOT_STATE_SKIPPED:
+		{
+			log_info("Skipping snapshot export: --not-consistent is in use");
+			return true;
+		}
+
+		case SNAPSHOT_STATE_SET:
+		{
+			log_info("Using snapshot \"%s\" on the source database",
+					 snapshot->snapshot);
+			return true;
+		}
+
+		case SNAPSHOT_STATE_EXPORTED:
+		{
+			log_error("BUG: copydb_prepare_snapshot called twice");
+			return false;
+		}
+
+		default:
+		{
+			/* SNAPSHOT_STATE_UNKNOWN and SNAPSHOT_STATE_CLOSED: export now */
+			break;
+		}
+	}
+
+	PGSQL *pgsql = &(snapshot->pgsql);
+
+	if (!pgsql_init(pgsql, snapshot->pguri, snapshot->connectionType))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (snapshot->createSlot)
+	{
+		return copydb_create_slot_snapshot(snapshot);
+	}
+
+	if (!pgsql_begin(pgsql))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pgsql_set_transaction(pgsql, ISOLATION_REPEATABLE_READ, true, false))
+	{
+		/* errors have already been logged */
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	if (!pgsql_export_snapshot(pgsql,
+							   snapshot->snapshot,
+							   sizeof(snapshot->snapshot)))
+	{
+		/* errors have already been logged */
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	snapshot->state = SNAPSHOT_STATE_EXPORTED;
+
+	log_info("Exported snapshot \"%s\" from the source database",
+			 snapshot->snapshot);
+
+	return true;
+}
+
+
+/*
+ * copydb_create_slot_snapshot creates the logical replication slot used by
+ * --follow, and uses the snapshot exported at slot creation time. That
+ * snapshot is only valid as long as the replication connection is kept idle,
+ * which we do until copydb_close_snapshot() is called.
+ */
+static bool
+copydb_create_slot_snapshot(TransactionSnapshot *snapshot)
+{
+	PGSQL *pgsql = &(snapshot->pgsql);
+
+	pgsql->replication = true;
+
+	if (!pgsql_open_persistent_connection(pgsql))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pgsql_create_logical_replication_slot(pgsql,
+											   snapshot->slotName,
+											   snapshot->plugin,
+											   snapshot->startLSN,
+											   sizeof(snapshot->startLSN),
+											   snapshot->snapshot,
+											   sizeof(snapshot->snapshot)))
+	{
+		/* errors have already been logged */
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	snapshot->state = SNAPSHOT_STATE_EXPORTED;
+
+	log_info("Created logical replication slot \"%s\" with plugin \"%s\" "
+			 "at %s, and exported snapshot \"%s\"",
+			 snapshot->slotName,
+			 snapshot->plugin,
+			 snapshot->startLSN,
+			 snapshot->snapshot);
+
+	strlcpy(slotCleanupPguri, snapshot->pguri, sizeof(slotCleanupPguri));
+	strlcpy(slotCleanupName, snapshot->slotName, sizeof(slotCleanupName));
+
+	/* register the clean-up function only once */
+	if (slotCleanupPid == 0)
+	{
+		atexit(copydb_drop_slot_atexit);
+	}
+
+	slotCleanupPid = getpid();
+
+	return true;
+}
+
+
+/*
+ * copydb_release_replication_slot hands over the replication slot created
+ * for --follow, which has either been dropped already or is to be kept:
+ * it's not dropped at exit anymore.
+ */
+void
+copydb_release_replication_slot(void)
+{
+	slotCleanupName[0] = '\0';
+}
+
+
+/*
+ * copydb_drop_slot_atexit drops the replication slot created for --follow
+ * when it has not been released, and only in the process that created it:
+ * our sub-processes inherit the atexit(3) registry.
+ */
+static void
+copydb_drop_slot_atexit(void)
+{
+	if (slotCleanupPid != getpid() || slotCleanupName[0] == '\0')
+	{
+		return;
+	}
+
+	log_warn("Dropping replication slot \"%s\" on the source database, "
+			 "the copy is not complete",
+			 slotCleanupName);
+
+	PGSQL pgsql = { 0 };
+
+	/* the replication connection that created the slot doesn't hold it */
+	if (!pgsql_init(&pgsql, slotCleanupPguri, PGSQL_CONN_SOURCE) ||
+		!pgsql_drop_replication_slot(&pgsql, slotCleanupName))
+	{
+		log_error("Failed to drop replication slot \"%s\", "
+				  "use pg_drop_replication_slot() to drop it",
+				  slotCleanupName);
+	}
+
+	slotCleanupName[0] = '\0';
+}
+
+
+/*
+ * copydb_prepare_replica_snapshots waits until every --source-replica server
+ * has replayed the WAL up to the current LSN of the source database, and
+ * then exports a snapshot on each of them for the table workers to use.
+ *
+ * A snapshot can't be imported on another server, so the replicas snapshots
+ * are not the same as the source database snapshot. They see at least the
+ * data that the source snapshot sees, and exactly that data when the source
+ * database doesn't receive writes during the copy.
+ *
+ * Each replica has then replayed up to a different LSN, so its snapshot is
+ * not the same as the other replicas snapshots either: using more than one
+ * replica requires --not-consistent, where no snapshot is exported at all.
+ */
+static bool
+copydb_prepare_replica_snapshots(CopyDataSpec *specs)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_STRING, false };
+	PGSQL pgsql = { 0 };
+
+	char *sql =
+		"select case when pg_is_in_recovery() "
+		"            then pg_last_wal_replay_lsn() "
+		"            else pg_current_wal_lsn() "
+		"        end::text";
+
+	if (!pgsql_init(&pgsql, specs->source_pguri, PGSQL_CONN_SOURCE))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	/* the LSN is fetched after the source snapshot has been exported */
+	if (!pgsql_execute_with_params(&pgsql, sql, 0, NULL, NULL,
+								   &context, &parseSingleValueResult))
+	{
+		log_error("Failed to fetch the current LSN of the source database");
+		return false;
+	}
+
+	if (!context.parsedOk || context.strVal == NULL)
+	{
+		log_error("Failed to fetch the current LSN of the source database");
+		return false;
+	}
+
+	char lsn[PG_LSN_MAXLENGTH] = { 0 };
+
+	strlcpy(lsn, context.strVal, sizeof(lsn));
+	free(context.strVal);
+
+	log_info("Waiting for %d source replicas to replay up to %s",
+			 specs->sourceReplicaCount,
+			 lsn);
+
+	for (int i = 0; i < specs->sourceReplicaCount; i++)
+	{
+		TransactionSnapshot *replica = &(specs->replicaSnapshots[i]);
+
+		if (!copydb_wait_for_replica(replica, i, lsn))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (replica->state == SNAPSHOT_STATE_SKIPPED)
+		{
+			continue;
+		}
+
+		if (!copydb_export_snapshot(replica))
+		{
+			log_error("Failed to export a snapshot on source replica %d", i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_wait_for_replica waits until the given replica has replayed the WAL
+ * up to the given LSN.
+ */
+static bool
+copydb_wait_for_replica(TransactionSnapshot *replica,
+						int replicaIndex,
+						const char *lsn)
+{
+	PGSQL pgsql = { 0 };
+
+	char *sql =
+		"select case when not pg_is_in_recovery() then 'primary' "
+		"            when pg_last_wal_replay_lsn() >= $1::pg_lsn then 'ready' "
+		"            else 'waiting' "
+		"        end";
+
+	const Oid paramTypes[1] = { LSNOID };
+	const char *paramValues[1] = { lsn };
+
+	if (!pgsql_init(&pgsql, replica->pguri, PGSQL_CONN_SOURCE) ||
+		!pgsql_open_persistent_connection(&pgsql))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	bool ready = false;
+
+	while (!ready)
+	{
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			pgsql_finish(&pgsql);
+			return false;
+		}
+
+		SingleValueResultContext context =
+		{ { 0 }, PGSQL_RESULT_STRING, false };
+
+		if (!pgsql_execute_with_params(&pgsql, sql, 1, paramTypes, paramValues,
+									   &context, &parseSingleValueResult) ||
+			!context.parsedOk ||
+			context.strVal == NULL)
+		{
+			log_error("Failed to fetch the replay LSN of source replica %d",
+					  replicaIndex);
+			pgsql_finish(&pgsql);
+			return false;
+		}
+
+		bool isPrimary = strcmp(context.strVal, "primary") == 0;
+
+		ready = strcmp(context.strVal, "ready") == 0;
+		free(context.strVal);
+
+		if (isPrimary)
+		{
+			log_error("Source replica %d is not in recovery: "
+					  "--source-replica expects a standby server",
+					  replicaIndex);
+			pgsql_finish(&pgsql);
+			return false;
+		}
+
+		if (!ready)
+		{
+			log_flush();
+
+			pg_usleep(REPLICA_WAIT_SLEEP_TIME_MS * 1000);
+		}
+	}
+
+	pgsql_finish(&pgsql);
+
+	log_info("Source replica %d has replayed up to %s", replicaIndex, lsn);
+
+	return true;
+}
+
+
+/*
+ * copydb_table_data_source returns the snapshot, and the connection string,
+ * that the given table worker (or multiplexed stream) uses to COPY data
+ * from. Without --source-replica, that's the source database. Otherwise the
+ * workers are spread evenly across the replicas, and the source database is
+ * only used for the schema: as the workers pull tables from a shared queue,
+ * the replicas that copy faster also copy more tables.
+ *
+ * With a single replica, all the tables and table parts are read in the same
+ * snapshot. With more than one, --not-consistent is in use.
+ */
+TransactionSnapshot *
+copydb_table_data_source(CopyDataSpec *specs, int workerIndex)
+{
+	if (specs->sourceReplicaCount == 0)
+	{
+		return &(specs->sourceSnapshot);
+	}
+
+	return &(specs->replicaSnapshots[workerIndex % specs->sourceReplicaCount]);
+}
+
+
+/*
+ * copydb_close_snapshot closes the transaction that exported the snapshot on
+ * the source database, if we own one, and then the transactions that
+ * exported the snapshots on the --source-replica servers. Once a snapshot is
+ * closed, no new session can import it anymore.
+ */
+bool
+copydb_close_snapshot(CopyDataSpec *specs)
+{
+	bool success = copydb_close_transaction_snapshot(&(specs->sourceSnapshot));
+
+	for (int i = 0; i < specs->sourceReplicaCount; i++)
+	{
+		TransactionSnapshot *replica = &(specs->replicaSnapshots[i]);
+
+		success = copydb_close_transaction_snapshot(replica) && success;
+	}
+
+	return success;
+}
+
+
+/*
+ * copydb_close_transaction_snapshot closes the given snapshot, if we own it.
+ */
+static bool
+copydb_close_transaction_snapshot(TransactionSnapshot *snapshot)
+{
+	if (snapshot->state != SNAPSHOT_STATE_EXPORTED)
+	{
+		return true;
+	}
+
+	log_debug("Closing snapshot \"%s\" on the source database",
+			  snapshot->snapshot);
+
+	if (snapshot->createSlot)
+	{
+		/* the replication slot remains, only the snapshot goes away */
+		(void) pgsql_finish(&(snapshot->pgsql));
+	}
+	else if (!pgsql_commit(&(snapshot->pgsql)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	snapshot->state = SNAPSHOT_STATE_CLOSED;
+
+	return true;
+}
+
+
+/*
+ * copydb_set_snapshot opens a transaction on the given connection to the
+ * source database and imports the snapshot from the main process, so that
+ * the queries that follow see the same data as every other sub-process.
+ *
+ * The snapshot connection is inherited as-is in our sub-processes: it must
+ * never be used, nor closed, from any sub-process. Closing it from a child
+ * process would terminate the session owned by the main process.
+ *
+ * The caller is expected to finish the transaction when done, either with
+ * pgsql_commit(), or by closing the connection with pgsql_finish().
+ */
+bool
+copydb_set_snapshot(TransactionSnapshot *snapshot, PGSQL *pgsql)
+{
+	if (snapshot->state != SNAPSHOT_STATE_EXPORTED &&
+		snapshot->state != SNAPSHOT_STATE_SET)
+	{
+		/* --not-consistent, or the snapshot is closed already */
+		return true;
+	}
+
+	if (!pgsql_begin(pgsql))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!pgsql_set_transaction(pgsql, ISOLATION_REPEATABLE_READ, true, false))
+	{
+		/* errors have already been logged */
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	if (!pgsql_set_snapshot(pgsql, snapshot->snapshot))
+	{
+		/* errors have already been logged */
+		pgsql_finish(pgsql);
+		return false;
+	}
+
+	log_debug("Using snapshot \"%s\" on the source database",
+			  snapshot->snapshot);
+
+	return true;
+}
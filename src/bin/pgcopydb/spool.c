@@ -0,0 +1,1222 @@
+/*
+ * src/bin/pgcopydb/spool.c
+ *     Write the COPY data of each table to compressed files, and read them
+ *     back, see pgcopydb dump data and pgcopydb restore data.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "parson.h"
+
+#include "copydb.h"
+#include "file_utils.h"
+#include "log.h"
+#include "schema.h"
+#include "signals.h"
+#include "spool.h"
+#include "string_utils.h"
+
+
+static bool spool_flush_block(SpoolFile *spool, bool end);
+static bool spool_write_frame(SpoolFile *spool, const char *frame, size_t len);
+static bool spool_decompress(SpoolFile *spool, size_t *produced);
+
+static JSON_Value * copydb_spool_parse_catalog(CopyDataSpec *specs);
+static bool copydb_spool_check_server_version(CopyDataSpec *specs,
+											  int sourceVersion);
+
+
+/*
+ * spool_compression_from_string parses a --compression method name.
+ */
+bool
+spool_compression_from_string(const char *str, SpoolCompression *compression)
+{
+	if (strcmp(str, "none") == 0)
+	{
+		*compression = SPOOL_COMPRESSION_NONE;
+		return true;
+	}
+	else if (strcmp(str, "lz4") == 0)
+	{
+		*compression = SPOOL_COMPRESSION_LZ4;
+		return true;
+	}
+	else if (strcmp(str, "zstd") == 0)
+	{
+		*compression = SPOOL_COMPRESSION_ZSTD;
+		return true;
+	}
+
+	return false;
+}
+
+
+/*
+ * spool_compression_to_string returns the --compression method name.
+ */
+char *
+spool_compression_to_string(SpoolCompression compression)
+{
+	switch (compression)
+	{
+		case SPOOL_COMPRESSION_NONE:
+		{
+			return "none";
+		}
+
+		case SPOOL_COMPRESSION_LZ4:
+		{
+			return "lz4";
+		}
+
+		case SPOOL_COMPRESSION_ZSTD:
+		{
+			return "zstd";
+		}
+	}
+
+	return "unknown";
+}
+
+
+/*
+ * spool_compression_suffix returns the file name suffix of the compression
+ * method, as used by the lz4 and zstd command line tools.
+ */
+char *
+spool_compression_suffix(SpoolCompression compression)
+{
+	switch (compression)
+	{
+		case SPOOL_COMPRESSION_NONE:
+		{
+			return "";
+		}
+
+		case SPOOL_COMPRESSION_LZ4:
+		{
+			return ".lz4";
+		}
+
+		case SPOOL_COMPRESSION_ZSTD:
+		{
+			return ".zst";
+		}
+	}
+
+	return "";
+}
+
+
+/*
+ * spool_open_write creates the given file and prepares the compression
+ * context. The files use the standard lz4 and zstd frame formats, so that
+ * they can also be read with the lz4 and zstd command line tools.
+ */
+bool
+spool_open_write(SpoolFile *spool,
+				 const char *filename,
+				 SpoolCompression compression)
+{
+	SpoolFile tmpSpool = {
+		.compression = compression,
+		.writing = true,
+		.dataSize = SPOOL_BLOCK_SIZE
+	};
+
+	*spool = tmpSpool;
+
+	strlcpy(spool->filename, filename, sizeof(spool->filename));
+
+	spool->file = fopen_with_umask(filename, "wb", FOPEN_FLAGS_W, 0644);
+
+	if (spool->file == NULL)
+	{
+		log_error("Failed to create file \"%s\": %m", filename);
+		return false;
+	}
+
+	LZ4F_preferences_t lz4Prefs = { 0 };
+
+	lz4Prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+
+	switch (compression)
+	{
+		case SPOOL_COMPRESSION_NONE:
+		{
+			break;
+		}
+
+		case SPOOL_COMPRESSION_LZ4:
+		{
+			LZ4F_errorCode_t error =
+				LZ4F_createCompressionContext(&(spool->lz4Compress), LZ4F_VERSION);
+
+			if (LZ4F_isError(error))
+			{
+				log_error("Failed to prepare lz4 compression: %s",
+						  LZ4F_getErrorName(error));
+				spool_close(spool);
+				return false;
+			}
+
+			spool->frameSize =
+				LZ4F_compressBound(SPOOL_BLOCK_SIZE, &lz4Prefs) +
+				LZ4F_HEADER_SIZE_MAX;
+			break;
+		}
+
+		case SPOOL_COMPRESSION_ZSTD:
+		{
+			spool->zstdCompress = ZSTD_createCCtx();
+
+			if (spool->zstdCompress == NULL)
+			{
+				log_error("Failed to prepare zstd compression");
+				spool_close(spool);
+				return false;
+			}
+
+			size_t error =
+				ZSTD_CCtx_setParameter(spool->zstdCompress,
+									   ZSTD_c_compressionLevel,
+									   SPOOL_ZSTD_LEVEL);
+
+			if (ZSTD_isError(error))
+			{
+				log_error("Failed to prepare zstd compression: %s",
+						  ZSTD_getErrorName(error));
+				spool_close(spool);
+				return false;
+			}
+
+			spool->frameSize = ZSTD_CStreamOutSize();
+			break;
+		}
+	}
+
+	spool->data = (char *) malloc(spool->dataSize * sizeof(char));
+
+	if (spool->frameSize > 0)
+	{
+		spool->frame = (char *) malloc(spool->frameSize * sizeof(char));
+	}
+
+	if (spool->data == NULL || (spool->frameSize > 0 && spool->frame == NULL))
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		spool_close(spool);
+		return false;
+	}
+
+	/* the lz4 frame header goes first */
+	if (compression == SPOOL_COMPRESSION_LZ4)
+	{
+		size_t len = LZ4F_compressBegin(spool->lz4Compress,
+										spool->frame,
+										spool->frameSize,
+										&lz4Prefs);
+
+		if (LZ4F_isError(len))
+		{
+			log_error("Failed to compress data with lz4: %s",
+					  LZ4F_getErrorName(len));
+			spool_close(spool);
+			return false;
+		}
+
+		if (!spool_write_frame(spool, spool->frame, len))
+		{
+			/* errors have already been logged */
+			spool_close(spool);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * spool_write is a CopyRowCB: it appends the given COPY data to the spool
+ * data buffer, and compresses the buffer to the file each time it is full.
+ */
+bool
+spool_write(void *context, const char *data, int len)
+{
+	SpoolFile *spool = (SpoolFile *) context;
+	size_t pos = 0;
+
+	while (pos < (size_t) len)
+	{
+		size_t avail = spool->dataSize - spool->dataLen;
+		size_t count = Min(avail, (size_t) len - pos);
+
+		memcpy(spool->data + spool->dataLen, data + pos, count);
+
+		spool->dataLen += count;
+		pos += count;
+
+		if (spool->dataLen == spool->dataSize && !spool_flush_block(spool, false))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	spool->bytes += len;
+
+	return true;
+}
+
+
+/*
+ * spool_close_write compresses the data that is still buffered, ends the
+ * compression frame, and closes the file.
+ */
+bool
+spool_close_write(SpoolFile *spool)
+{
+	bool success = spool_flush_block(spool, true);
+
+	if (success)
+	{
+		int error = fclose(spool->file);
+
+		spool->file = NULL;
+
+		if (error != 0)
+		{
+			log_error("Failed to write file \"%s\": %m", spool->filename);
+			success = false;
+		}
+	}
+
+	spool_close(spool);
+
+	return success;
+}
+
+
+/*
+ * spool_flush_block compresses the data buffer to the file, and when end is
+ * true also writes the end of the compression frame.
+ */
+static bool
+spool_flush_block(SpoolFile *spool, bool end)
+{
+	switch (spool->compression)
+	{
+		case SPOOL_COMPRESSION_NONE:
+		{
+			if (!spool_write_frame(spool, spool->data, spool->dataLen))
+			{
+				/* errors have already been logged */
+				return false;
+			}
+			break;
+		}
+
+		case SPOOL_COMPRESSION_LZ4:
+		{
+			if (spool->dataLen > 0)
+			{
+				size_t len = LZ4F_compressUpdate(spool->lz4Compress,
+												 spool->frame,
+												 spool->frameSize,
+												 spool->data,
+												 spool->dataLen,
+												 NULL);
+
+				if (LZ4F_isError(len))
+				{
+					log_error("Failed to compress data with lz4: %s",
+							  LZ4F_getErrorName(len));
+					return false;
+				}
+
+				if (!spool_write_frame(spool, spool->frame, len))
+				{
+					/* errors have already been logged */
+					return false;
+				}
+			}
+
+			if (end)
+			{
+				size_t len = LZ4F_compressEnd(spool->lz4Compress,
+											  spool->frame,
+											  spool->frameSize,
+											  NULL);
+
+				if (LZ4F_isError(len))
+				{
+					log_error("Failed to compress data with lz4: %s",
+							  LZ4F_getErrorName(len));
+					return false;
+				}
+
+				if (!spool_write_frame(spool, spool->frame, len))
+				{
+					/* errors have already been logged */
+					return false;
+				}
+			}
+			break;
+		}
+
+		case SPOOL_COMPRESSION_ZSTD:
+		{
+			ZSTD_inBuffer input = { spool->data, spool->dataLen, 0 };
+			ZSTD_EndDirective mode = end ? ZSTD_e_end : ZSTD_e_continue;
+			bool done = false;
+
+			/* with ZSTD_e_end, zero means that the frame has been flushed */
+			while (!done)
+			{
+				ZSTD_outBuffer output = { spool->frame, spool->frameSize, 0 };
+
+				size_t remaining =
+					ZSTD_compressStream2(spool->zstdCompress,
+										 &output,
+										 &input,
+										 mode);
+
+				if (ZSTD_isError(remaining))
+				{
+					log_error("Failed to compress data with zstd: %s",
+							  ZSTD_getErrorName(remaining));
+					return false;
+				}
+
+				if (!spool_write_frame(spool, spool->frame, output.pos))
+				{
+					/* errors have already been logged */
+					return false;
+				}
+
+				done = end ? remaining == 0 : input.pos == input.size;
+			}
+			break;
+		}
+	}
+
+	spool->dataLen = 0;
+
+	return true;
+}
+
+
+/*
+ * spool_write_frame writes the given compressed data to the spool file.
+ */
+static bool
+spool_write_frame(SpoolFile *spool, const char *frame, size_t len)
+{
+	if (len == 0)
+	{
+		return true;
+	}
+
+	if (fwrite(frame, sizeof(char), len, spool->file) != len)
+	{
+		log_error("Failed to write file \"%s\": %m", spool->filename);
+		return false;
+	}
+
+	spool->fileBytes += len;
+
+	return true;
+}
+
+
+/*
+ * spool_open_read opens the given file and prepares the decompression
+ * context.
+ */
+bool
+spool_open_read(SpoolFile *spool,
+				const char *filename,
+				SpoolCompression compression)
+{
+	SpoolFile tmpSpool = {
+		.compression = compression,
+		.writing = false,
+		.dataSize = SPOOL_BLOCK_SIZE
+	};
+
+	*spool = tmpSpool;
+
+	strlcpy(spool->filename, filename, sizeof(spool->filename));
+
+	spool->file = fopen_read_only(filename);
+
+	if (spool->file == NULL)
+	{
+		log_error("Failed to open file \"%s\": %m", filename);
+		return false;
+	}
+
+	switch (compression)
+	{
+		case SPOOL_COMPRESSION_NONE:
+		{
+			break;
+		}
+
+		case SPOOL_COMPRESSION_LZ4:
+		{
+			LZ4F_errorCode_t error =
+				LZ4F_createDecompressionContext(&(spool->lz4Decompress),
+												LZ4F_VERSION);
+
+			if (LZ4F_isError(error))
+			{
+				log_error("Failed to prepare lz4 decompression: %s",
+						  LZ4F_getErrorName(error));
+				spool_close(spool);
+				return false;
+			}
+
+			spool->frameSize = SPOOL_BLOCK_SIZE;
+			break;
+		}
+
+		case SPOOL_COMPRESSION_ZSTD:
+		{
+			spool->zstdDecompress = ZSTD_createDCtx();
+
+			if (spool->zstdDecompress == NULL)
+			{
+				log_error("Failed to prepare zstd decompression");
+				spool_close(spool);
+				return false;
+			}
+
+			spool->frameSize = ZSTD_DStreamInSize();
+			spool->dataSize = ZSTD_DStreamOutSize();
+			break;
+		}
+	}
+
+	spool->data = (char *) malloc(spool->dataSize * sizeof(char));
+
+	if (spool->frameSize > 0)
+	{
+		spool->frame = (char *) malloc(spool->frameSize * sizeof(char));
+	}
+
+	if (spool->data == NULL || (spool->frameSize > 0 && spool->frame == NULL))
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		spool_close(spool);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * spool_read is a CopyNextRowCB: it returns the next block of uncompressed
+ * data from the spool file, which does not need to end on a row boundary for
+ * COPY ... FROM STDIN. At the end of the file, or when the file can't be
+ * read, it returns false: the caller then checks spool->failed.
+ *
+ * A compressed file that ends in the middle of a frame has been truncated,
+ * for instance by a pgcopydb dump data command that was interrupted, and is
+ * reported as a failure.
+ */
+bool
+spool_read(void *context, const char **data, int *len)
+{
+	SpoolFile *spool = (SpoolFile *) context;
+
+	if (spool->eof || spool->failed)
+	{
+		return false;
+	}
+
+	/* without compression, read the file in blocks */
+	if (spool->compression == SPOOL_COMPRESSION_NONE)
+	{
+		size_t count =
+			fread(spool->data, sizeof(char), spool->dataSize, spool->file);
+
+		if (count == 0)
+		{
+			if (ferror(spool->file))
+			{
+				log_error("Failed to read file \"%s\": %m", spool->filename);
+				spool->failed = true;
+				return false;
+			}
+
+			spool->eof = true;
+			return false;
+		}
+
+		spool->fileBytes += count;
+		spool->bytes += count;
+
+		*data = spool->data;
+		*len = (int) count;
+
+		return true;
+	}
+
+	for (;;)
+	{
+		/*
+		 * The decompression context might still have data to give when the
+		 * previous call filled the whole data buffer, even with no input.
+		 */
+		bool pending = spool->dataLen == spool->dataSize;
+
+		if (spool->framePos == spool->frameLen && !pending)
+		{
+			size_t count =
+				fread(spool->frame, sizeof(char), spool->frameSize, spool->file);
+
+			if (count == 0)
+			{
+				if (ferror(spool->file))
+				{
+					log_error("Failed to read file \"%s\": %m", spool->filename);
+					spool->failed = true;
+					return false;
+				}
+
+				if (spool->frameHint != 0)
+				{
+					log_error("Failed to read file \"%s\": "
+							  "the file ends in the middle of a %s frame",
+							  spool->filename,
+							  spool_compression_to_string(spool->compression));
+					spool->failed = true;
+					return false;
+				}
+
+				spool->eof = true;
+				return false;
+			}
+
+			spool->fileBytes += count;
+			spool->frameLen = count;
+			spool->framePos = 0;
+		}
+
+		size_t produced = 0;
+
+		if (!spool_decompress(spool, &produced))
+		{
+			/* errors have already been logged */
+			spool->failed = true;
+			return false;
+		}
+
+		spool->dataLen = produced;
+
+		if (produced > 0)
+		{
+			spool->bytes += produced;
+
+			*data = spool->data;
+			*len = (int) produced;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * spool_decompress decompresses as much of the frame buffer as fits in the
+ * data buffer, and sets produced to the count of bytes in the data buffer.
+ */
+static bool
+spool_decompress(SpoolFile *spool, size_t *produced)
+{
+	switch (spool->compression)
+	{
+		case SPOOL_COMPRESSION_NONE:
+		{
+			log_error("BUG: spool_decompress called without compression");
+			return false;
+		}
+
+		case SPOOL_COMPRESSION_LZ4:
+		{
+			size_t dstSize = spool->dataSize;
+			size_t srcSize = spool->frameLen - spool->framePos;
+
+			size_t hint = LZ4F_decompress(spool->lz4Decompress,
+										  spool->data,
+										  &dstSize,
+										  spool->frame + spool->framePos,
+										  &srcSize,
+										  NULL);
+
+			if (LZ4F_isError(hint))
+			{
+				log_error("Failed to decompress file \"%s\" with lz4: %s",
+						  spool->filename,
+						  LZ4F_getErrorName(hint));
+				return false;
+			}
+
+			spool->framePos += srcSize;
+			spool->frameHint = hint;
+			*produced = dstSize;
+
+			return true;
+		}
+
+		case SPOOL_COMPRESSION_ZSTD:
+		{
+			ZSTD_inBuffer input = {
+				spool->frame, spool->frameLen, spool->framePos
+			};
+			ZSTD_outBuffer output = { spool->data, spool->dataSize, 0 };
+
+			size_t hint =
+				ZSTD_decompressStream(spool->zstdDecompress, &output, &input);
+
+			if (ZSTD_isError(hint))
+			{
+				log_error("Failed to decompress file \"%s\" with zstd: %s",
+						  spool->filename,
+						  ZSTD_getErrorName(hint));
+				return false;
+			}
+
+			spool->framePos = input.pos;
+			spool->frameHint = hint;
+			*produced = output.pos;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * spool_close releases the compression contexts and buffers of the spool
+ * file, and closes the file when it's still open.
+ */
+void
+spool_close(SpoolFile *spool)
+{
+	if (spool->file != NULL)
+	{
+		(void) fclose(spool->file);
+		spool->file = NULL;
+	}
+
+	if (spool->lz4Compress != NULL)
+	{
+		(void) LZ4F_freeCompressionContext(spool->lz4Compress);
+		spool->lz4Compress = NULL;
+	}
+
+	if (spool->lz4Decompress != NULL)
+	{
+		(void) LZ4F_freeDecompressionContext(spool->lz4Decompress);
+		spool->lz4Decompress = NULL;
+	}
+
+	if (spool->zstdCompress != NULL)
+	{
+		(void) ZSTD_freeCCtx(spool->zstdCompress);
+		spool->zstdCompress = NULL;
+	}
+
+	if (spool->zstdDecompress != NULL)
+	{
+		(void) ZSTD_freeDCtx(spool->zstdDecompress);
+		spool->zstdDecompress = NULL;
+	}
+
+	free(spool->data);
+	free(spool->frame);
+
+	spool->data = NULL;
+	spool->frame = NULL;
+}
+
+
+/*
+ * copydb_spool_write_table_data runs COPY ... TO STDOUT for the table (or
+ * table part) on the source connection and writes the COPY data to the part
+ * spool file. The file is removed when the COPY fails, so that a file found
+ * in the data directory is always complete.
+ */
+bool
+copydb_spool_write_table_data(CopyTableDataSpec *tableSpecs,
+							  PGSQL *src,
+							  const char *copySource,
+							  TablePartFilePaths *partPaths,
+							  CopyStats *stats)
+{
+	SpoolFile spool = { 0 };
+
+	if (!copydb_open_table_source(tableSpecs, src))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!spool_open_write(&spool, partPaths->spoolFile,
+						  tableSpecs->spoolCompression))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	CopyArgs args = {
+		.srcQname = copySource,
+		.dstQname = NULL,
+		.format = tableSpecs->copyFormat,
+		.freeze = false,
+		.bufferSize = tableSpecs->copyBufferSize,
+		.pipelineDepth = 0,
+		.keepConnections = true,
+		.fanout = NULL,
+		.fanoutCount = 0,
+		.throttle = &copydb_throttle_copy_data,
+		.throttleContext = tableSpecs->throttle,
+		.progress =
+			tableSpecs->progress == NULL
+			? NULL
+			: &(tableSpecs->progress->stats)
+	};
+
+	(void) copydb_progress_start_copy(tableSpecs, NULL);
+
+	TraceEvent event = { 0 };
+
+	trace_begin(&event, "copy", "COPY %s.%s %d/%d TO FILE",
+				tableSpecs->sourceTable->nspname,
+				tableSpecs->sourceTable->relname,
+				tableSpecs->part.partNumber + 1,
+				tableSpecs->part.partCount > 0
+				? tableSpecs->part.partCount
+				: 1);
+
+	bool copied = pg_copy_to_rows(src, &args, &spool_write, &spool, stats);
+	bool closed = copied && spool_close_write(&spool);
+
+	trace_end(&event);
+	(void) copydb_progress_done(tableSpecs);
+
+	if (!copied || !closed)
+	{
+		/* errors have already been logged */
+		spool_close(&spool);
+		(void) unlink_file(partPaths->spoolFile);
+		return false;
+	}
+
+	char bytesPretty[BUFSIZE] = { 0 };
+	char fileBytesPretty[BUFSIZE] = { 0 };
+
+	(void) pretty_print_bytes(bytesPretty, sizeof(bytesPretty), spool.bytes);
+	(void) pretty_print_bytes(fileBytesPretty, sizeof(fileBytesPretty),
+							  spool.fileBytes);
+
+	log_debug("Wrote %s of COPY data to \"%s\" in %s",
+			  bytesPretty,
+			  partPaths->spoolFile,
+			  fileBytesPretty);
+
+	return true;
+}
+
+
+/*
+ * copydb_spool_read_table_data runs COPY ... FROM STDIN for the table (or
+ * table part) on the target connection and sends the contents of the part
+ * spool file. The caller has opened the COPY transaction, which is rolled
+ * back here when the file can't be read completely.
+ */
+bool
+copydb_spool_read_table_data(CopyTableDataSpec *tableSpecs,
+							 PGSQL *dst,
+							 CopyArgs *args,
+							 TablePartFilePaths *partPaths,
+							 CopyStats *stats)
+{
+	SpoolFile spool = { 0 };
+
+	if (!spool_open_read(&spool, partPaths->spoolFile,
+						 tableSpecs->spoolCompression))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	bool copied = pg_copy_from_rows(dst, args, &spool_read, &spool, stats);
+	bool failed = spool.failed;
+
+	spool_close(&spool);
+
+	if (copied && failed)
+	{
+		log_error("Failed to restore table \"%s\".\"%s\" part %d/%d from "
+				  "file \"%s\", see above for details",
+				  tableSpecs->sourceTable->nspname,
+				  tableSpecs->sourceTable->relname,
+				  tableSpecs->part.partNumber + 1,
+				  tableSpecs->part.partCount,
+				  partPaths->spoolFile);
+
+		(void) pgsql_execute(dst, "ROLLBACK");
+	}
+
+	return copied && !failed;
+}
+
+
+/*
+ * copydb_spool_write_catalog writes the list of tables, indexes, and
+ * sequences of the source database in the data directory, once all the
+ * table data has been written there. pgcopydb restore data then reads the
+ * catalog rather than connecting to the source database, and the catalog
+ * file is the marker of a complete data dump.
+ *
+ * The sequences values are fetched now, after the COPY, as pgcopydb copy db
+ * does too.
+ */
+bool
+copydb_spool_write_catalog(CopyDataSpec *specs, SourceTableArray *tableArray)
+{
+	PGSQL src = { 0 };
+	int serverVersion = 0;
+	SourceSequenceArray sequenceArray = { 0, NULL };
+
+	if (!pgsql_init(&src, specs->source_pguri, PGSQL_CONN_SOURCE) ||
+		!pgsql_server_version_num(&src, &serverVersion) ||
+		!schema_list_sequences(&src, &sequenceArray))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (sequenceArray.count > 0)
+	{
+		if (!pgsql_begin(&src))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (!schema_get_all_sequence_values(&src, &sequenceArray))
+		{
+			/* errors have already been logged */
+			(void) pgsql_rollback(&src);
+			return false;
+		}
+
+		if (!pgsql_commit(&src))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *root = json_value_get_object(js);
+
+	json_object_set_string(root, "pgcopydb", PGCOPYDB_VERSION);
+	json_object_set_number(root, "server-version", (double) serverVersion);
+	json_object_set_string(root, "format", CopyFormatToString(specs->copyFormat));
+	json_object_set_string(root, "compression",
+						   spool_compression_to_string(specs->spoolCompression));
+	json_object_set_number(root, "split-tables-larger-than",
+						   (double) specs->splitTablesLargerThan);
+
+	json_object_set_value(root, "tables",
+						  copydb_catalog_tables_to_json(specs, tableArray));
+
+	json_object_set_value(root, "indexes",
+						  copydb_catalog_indexes_to_json(
+							  &(specs->sourceIndexArray)));
+
+	JSON_Value *jsSequences = json_value_init_array();
+	JSON_Array *jsSequenceArray = json_value_get_array(jsSequences);
+
+	for (int i = 0; i < sequenceArray.count; i++)
+	{
+		SourceSequence *seq = &(sequenceArray.array[i]);
+
+		if (!seq->fetched)
+		{
+			/* a warning has already been logged */
+			continue;
+		}
+
+		JSON_Value *jsSeq = json_value_init_object();
+		JSON_Object *jsSeqObj = json_value_get_object(jsSeq);
+
+		/* a JSON number is a double, that can't hold all the bigint values */
+		char lastValue[BUFSIZE] = { 0 };
+
+		sformat(lastValue, sizeof(lastValue), "%lld", (long long) seq->lastValue);
+
+		json_object_set_number(jsSeqObj, "oid", (double) seq->oid);
+		json_object_set_string(jsSeqObj, "schema", seq->nspname);
+		json_object_set_string(jsSeqObj, "name", seq->relname);
+		json_object_set_string(jsSeqObj, "last-value", lastValue);
+		json_object_set_boolean(jsSeqObj, "is-called", seq->isCalled);
+
+		json_array_append_value(jsSequenceArray, jsSeq);
+	}
+
+	json_object_set_value(root, "sequences", jsSequences);
+
+	char *serialized = json_serialize_to_string_pretty(js);
+
+	bool success =
+		serialized != NULL &&
+		write_file(serialized, strlen(serialized), specs->cfPaths.catalogfile);
+
+	if (success)
+	{
+		log_info("Wrote the list of %d tables, %d indexes, and %d sequences "
+				 "to \"%s\"",
+				 tableArray->count,
+				 specs->sourceIndexArray.count,
+				 sequenceArray.count,
+				 specs->cfPaths.catalogfile);
+	}
+
+	json_free_serialized_string(serialized);
+	json_value_free(js);
+	free(sequenceArray.array);
+
+	return success;
+}
+
+
+/*
+ * copydb_spool_read_catalog reads the list of tables and indexes that
+ * pgcopydb dump data has written, and the COPY format, compression method,
+ * and --split-tables-larger-than setting that were used to write the spool
+ * files, so that the table parts are the same.
+ *
+ * The indexes are sorted by table oid already in the catalog.
+ */
+bool
+copydb_spool_read_catalog(CopyDataSpec *specs, SourceTableArray *tableArray)
+{
+	JSON_Value *js = copydb_spool_parse_catalog(specs);
+	JSON_Object *root = json_value_get_object(js);
+
+	if (root == NULL)
+	{
+		/* errors have already been logged */
+		json_value_free(js);
+		return false;
+	}
+
+	const char *format = json_object_get_string(root, "format");
+	const char *compression = json_object_get_string(root, "compression");
+
+	if (format == NULL ||
+		compression == NULL ||
+		!copy_format_from_string(format, &(specs->copyFormat)) ||
+		!spool_compression_from_string(compression, &(specs->spoolCompression)))
+	{
+		log_error("Failed to parse the COPY format and the compression "
+				  "method in \"%s\"",
+				  specs->cfPaths.catalogfile);
+		json_value_free(js);
+		return false;
+	}
+
+	specs->splitTablesLargerThan =
+		(uint64_t) json_object_get_number(root, "split-tables-larger-than");
+
+	(void) pretty_print_bytes(specs->splitTablesLargerThanPretty,
+							  sizeof(specs->splitTablesLargerThanPretty),
+							  specs->splitTablesLargerThan);
+
+	/* COPY binary needs the same major version on both sides */
+	int serverVersion = (int) json_object_get_number(root, "server-version");
+
+	if (specs->copyFormat == COPY_FORMAT_BINARY &&
+		!copydb_spool_check_server_version(specs, serverVersion))
+	{
+		/* errors have already been logged */
+		json_value_free(js);
+		return false;
+	}
+
+	JSON_Array *jsTables = json_object_get_array(root, "tables");
+	JSON_Array *jsIndexes = json_object_get_array(root, "indexes");
+
+	SourceIndexArray *indexArray = &(specs->sourceIndexArray);
+
+	if (!copydb_catalog_tables_from_json(jsTables, tableArray) ||
+		!copydb_catalog_indexes_from_json(jsIndexes, indexArray))
+	{
+		log_error("Failed to parse the list of tables and indexes in \"%s\"",
+				  specs->cfPaths.catalogfile);
+		json_value_free(js);
+		return false;
+	}
+
+	json_value_free(js);
+
+	log_info("Read the list of %d tables and %d indexes from \"%s\", "
+			 "written with COPY format %s and compression %s",
+			 tableArray->count,
+			 indexArray->count,
+			 specs->cfPaths.catalogfile,
+			 CopyFormatToString(specs->copyFormat),
+			 spool_compression_to_string(specs->spoolCompression));
+
+	return true;
+}
+
+
+/*
+ * copydb_spool_read_sequences reads the sequences values that pgcopydb dump
+ * data has written in the catalog.
+ */
+bool
+copydb_spool_read_sequences(CopyDataSpec *specs,
+							SourceSequenceArray *sequenceArray)
+{
+	JSON_Value *js = copydb_spool_parse_catalog(specs);
+	JSON_Object *root = json_value_get_object(js);
+
+	if (root == NULL)
+	{
+		/* errors have already been logged */
+		json_value_free(js);
+		return false;
+	}
+
+	JSON_Array *jsSequences = json_object_get_array(root, "sequences");
+	int count = jsSequences == NULL ? 0 : json_array_get_count(jsSequences);
+
+	sequenceArray->count = count;
+	sequenceArray->array =
+		(SourceSequence *) calloc(count + 1, sizeof(SourceSequence));
+
+	if (sequenceArray->array == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		json_value_free(js);
+		return false;
+	}
+
+	int errors = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		JSON_Object *jsSeq = json_array_get_object(jsSequences, i);
+		SourceSequence *seq = &(sequenceArray->array[i]);
+
+		const char *nspname = json_object_get_string(jsSeq, "schema");
+		const char *relname = json_object_get_string(jsSeq, "name");
+		const char *lastValue = json_object_get_string(jsSeq, "last-value");
+
+		if (nspname == NULL || relname == NULL || lastValue == NULL ||
+			!stringToInt64(lastValue, &(seq->lastValue)))
+		{
+			++errors;
+			continue;
+		}
+
+		seq->oid = (uint32_t) json_object_get_number(jsSeq, "oid");
+		strlcpy(seq->nspname, nspname, sizeof(seq->nspname));
+		strlcpy(seq->relname, relname, sizeof(seq->relname));
+		seq->isCalled = json_object_get_boolean(jsSeq, "is-called") == 1;
+		seq->fetched = true;
+	}
+
+	json_value_free(js);
+
+	if (errors > 0)
+	{
+		log_error("Failed to parse the list of sequences in \"%s\"",
+				  specs->cfPaths.catalogfile);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_spool_parse_catalog parses the catalog file of the data directory.
+ */
+static JSON_Value *
+copydb_spool_parse_catalog(CopyDataSpec *specs)
+{
+	if (!file_exists(specs->cfPaths.catalogfile))
+	{
+		log_error("File \"%s\" does not exist, "
+				  "pgcopydb dump data has not completed in \"%s\"",
+				  specs->cfPaths.catalogfile,
+				  specs->cfPaths.topdir);
+		return NULL;
+	}
+
+	JSON_Value *js = json_parse_file(specs->cfPaths.catalogfile);
+
+	if (js == NULL)
+	{
+		log_error("Failed to parse JSON file \"%s\"",
+				  specs->cfPaths.catalogfile);
+		return NULL;
+	}
+
+	return js;
+}
+
+
+/*
+ * copydb_spool_check_server_version checks that the target server has the
+ * same major version as the source server that the data was dumped from,
+ * which COPY binary format requires, see copydb_check_copy_format().
+ */
+static bool
+copydb_spool_check_server_version(CopyDataSpec *specs, int sourceVersion)
+{
+	PGSQL dst = { 0 };
+	int targetVersion = 0;
+
+	if (!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET) ||
+		!pgsql_server_version_num(&dst, &targetVersion))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	int srcMajor =
+		sourceVersion >= 100000 ? sourceVersion / 10000 : sourceVersion / 100;
+	int dstMajor =
+		targetVersion >= 100000 ? targetVersion / 10000 : targetVersion / 100;
+
+	if (srcMajor != dstMajor)
+	{
+		log_error("Failed to restore COPY binary format data: the data was "
+				  "dumped from server version %d and target server version "
+				  "is %d, COPY binary format requires the same major version",
+				  sourceVersion,
+				  targetVersion);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,96 @@
+/*
+ * src/bin/pgcopydb/spool.h
+ *   Compressed files of COPY data, see pgcopydb dump data
+ */
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <lz4frame.h>
+#include <zstd.h>
+
+#include "postgres_fe.h"
+
+/* the spool files are compressed and decompressed in blocks of that size */
+#define SPOOL_BLOCK_SIZE (256 * 1024)
+
+/* zstd level 1 compresses text COPY data well at several hundred MB/s */
+#define SPOOL_ZSTD_LEVEL 1
+
+/* the list of tables, indexes, and sequences of a data dump */
+#define SPOOL_CATALOG_FILENAME "tables.json"
+
+/*
+ * pgcopydb dump data writes the COPY data of each table (or table part) to
+ * a file in the data directory, and pgcopydb restore data sends the file
+ * contents back to COPY ... FROM STDIN.
+ */
+typedef enum
+{
+	COPY_SPOOL_NONE = 0,
+	COPY_SPOOL_WRITE,           /* pgcopydb dump data */
+	COPY_SPOOL_READ             /* pgcopydb restore data */
+} CopySpoolMode;
+
+typedef enum
+{
+	SPOOL_COMPRESSION_NONE = 0,
+	SPOOL_COMPRESSION_LZ4,
+	SPOOL_COMPRESSION_ZSTD
+} SpoolCompression;
+
+/*
+ * A SpoolFile is opened either for writing or for reading. The uncompressed
+ * data goes through the data buffer, and the compressed data through the
+ * frame buffer, one block at a time.
+ */
+typedef struct SpoolFile
+{
+	char filename[MAXPGPATH];
+	SpoolCompression compression;
+	bool writing;
+	bool eof;
+	bool failed;                /* a read failed, the data is not complete */
+
+	FILE *file;
+
+	LZ4F_cctx *lz4Compress;
+	LZ4F_dctx *lz4Decompress;
+	ZSTD_CCtx *zstdCompress;
+	ZSTD_DCtx *zstdDecompress;
+	size_t frameHint;           /* non-zero while a frame is not complete */
+
+	char *data;                 /* malloc'ed area, uncompressed data */
+	size_t dataSize;
+	size_t dataLen;
+
+	char *frame;                /* malloc'ed area, compressed data */
+	size_t frameSize;
+	size_t frameLen;
+	size_t framePos;
+
+	uint64_t bytes;             /* uncompressed bytes */
+	uint64_t fileBytes;         /* bytes in the file */
+} SpoolFile;
+
+bool spool_compression_from_string(const char *str,
+								   SpoolCompression *compression);
+char * spool_compression_to_string(SpoolCompression compression);
+char * spool_compression_suffix(SpoolCompression compression);
+
+bool spool_open_write(SpoolFile *spool,
+					  const char *filename,
+					  SpoolCompression compression);
+bool spool_write(void *context, const char *data, int len);
+bool spool_close_write(SpoolFile *spool);
+
+bool spool_open_read(SpoolFile *spool,
+					 const char *filename,
+					 SpoolCompression compression);
+bool spool_read(void *context, const char **data, int *len);
+void spool_close(SpoolFile *spool);
+
+#endif /* SPOOL_H */
@@ -0,0 +1,336 @@
+/*
+ * src/bin/pgcopydb/strategy.c
+ *     Choose the copy strategy of each table from the source catalog stats
+ *
+ * The copy of a table can use the COPY text or binary format, be split in
+ * ctid ranges, be one of the small tables of the multiplexed COPY process,
+ * sort its rows in primary key order, and use COPY FREEZE. With the manual
+ * --copy-strategy, the command line options apply to all the tables alike.
+ *
+ * With --copy-strategy auto, each table is classified from the stats that
+ * schema_list_ordinary_tables() fetched, once all the tables are known:
+ *
+ *  - COPY binary is used when the source and target servers share the same
+ *    major version and most of the columns of the table are fixed width,
+ *    bytea, or numeric columns, which are cheaper to send in binary,
+ *
+ *  - tables that are larger than their share of the whole copy (and than
+ *    STRATEGY_SPLIT_MIN_BYTES) are split, as they would otherwise be the
+ *    long tail of the copy. Partitions already divide a table, so they are
+ *    only split when twice as large,
+ *
+ *  - tables smaller than STRATEGY_MULTIPLEX_SMALLER_THAN are multiplexed
+ *    when they outnumber the table workers,
+ *
+ *  - the other tables with indexes and narrow rows that are smaller than
+ *    STRATEGY_ORDER_BY_PK_SMALLER_THAN are copied in primary key order,
+ *
+ *  - tables larger than STRATEGY_FREEZE_MIN_BYTES that are copied in a
+ *    single part use COPY FREEZE, which saves the target from setting hint
+ *    bits and freezing the rows later. Smaller tables are not worth the
+ *    TRUNCATE.
+ *
+ * The thresholds given on the command line replace the built-in ones. The
+ * strategy of each table, and the throughput of each strategy, are then
+ * reported in the summary so that the heuristics can be checked against
+ * real runs.
+ */
+
+#include <stdlib.h>
+
+#include "copydb.h"
+#include "defaults.h"
+#include "log.h"
+#include "pgsql.h"
+#include "schema.h"
+#include "string_utils.h"
+
+
+typedef struct CopyStrategyContext
+{
+	bool binaryAllowed;
+	bool multiplexSmallTables;
+	uint64_t multiplexThreshold;
+	uint64_t splitThreshold;
+	uint64_t orderByPkThreshold;
+} CopyStrategyContext;
+
+
+static bool copydb_strategy_binary_allowed(CopyDataSpec *specs, bool *allowed);
+static void copydb_choose_table_strategy(CopyDataSpec *specs,
+										 CopyStrategyContext *context,
+										 SourceTable *table);
+
+
+/*
+ * copydb_choose_copy_strategies sets the copy strategy of each table of the
+ * given array, when using --copy-strategy auto.
+ */
+bool
+copydb_choose_copy_strategies(CopyDataSpec *specs, SourceTableArray *tableArray)
+{
+	if (!specs->copyStrategyAuto)
+	{
+		return true;
+	}
+
+	/* pgcopydb dump data and restore data must agree on the files layout */
+	if (specs->spoolMode != COPY_SPOOL_NONE)
+	{
+		log_warn("Ignoring --copy-strategy auto with the data spool, "
+				 "using the command line options for all the tables");
+		return true;
+	}
+
+	CopyStrategyContext context = { 0 };
+
+	if (!copydb_strategy_binary_allowed(specs, &(context.binaryAllowed)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	context.multiplexThreshold =
+		specs->multiplexTablesSmallerThan > 0
+		? specs->multiplexTablesSmallerThan
+		: STRATEGY_MULTIPLEX_SMALLER_THAN;
+
+	context.orderByPkThreshold =
+		specs->orderByPkSmallerThan > 0
+		? specs->orderByPkSmallerThan
+		: STRATEGY_ORDER_BY_PK_SMALLER_THAN;
+
+	uint64_t totalBytes = 0;
+	int smallCount = 0;
+
+	for (int i = 0; i < tableArray->count; i++)
+	{
+		SourceTable *table = &(tableArray->array[i]);
+		uint64_t bytes = table->bytes > 0 ? table->bytes : 0;
+
+		totalBytes += bytes;
+
+		if (bytes < context.multiplexThreshold)
+		{
+			++smallCount;
+		}
+	}
+
+	/* a few small tables keep the table workers busy just fine */
+	context.multiplexSmallTables = smallCount > specs->tableJobs;
+
+	/* a table that is larger than its share would be the long tail */
+	if (specs->splitTablesLargerThan > 0)
+	{
+		context.splitThreshold = specs->splitTablesLargerThan;
+	}
+	else
+	{
+		int jobs = specs->tableJobs > 0 ? specs->tableJobs : 1;
+		uint64_t share = totalBytes / jobs;
+
+		context.splitThreshold =
+			share > STRATEGY_SPLIT_MIN_BYTES ? share : STRATEGY_SPLIT_MIN_BYTES;
+	}
+
+	int binaryCount = 0;
+	int splitCount = 0;
+	int multiplexCount = 0;
+	int orderByPkCount = 0;
+	int freezeCount = 0;
+
+	for (int i = 0; i < tableArray->count; i++)
+	{
+		SourceTable *table = &(tableArray->array[i]);
+		TableCopyStrategy *strategy = &(table->strategy);
+
+		(void) copydb_choose_table_strategy(specs, &context, table);
+
+		binaryCount += strategy->copyFormat == COPY_FORMAT_BINARY ? 1 : 0;
+		splitCount += strategy->splitTablesLargerThan > 0 ? 1 : 0;
+		multiplexCount += strategy->multiplex ? 1 : 0;
+		orderByPkCount += strategy->orderByPk ? 1 : 0;
+		freezeCount += strategy->freeze ? 1 : 0;
+	}
+
+	char splitPretty[BUFSIZE] = { 0 };
+
+	(void) pretty_print_bytes(splitPretty,
+							  sizeof(splitPretty),
+							  context.splitThreshold);
+
+	log_info("Chose the copy strategy of %d tables: "
+			 "%d in binary format, %d split in parts of %s, "
+			 "%d multiplexed, %d in primary key order, %d with COPY FREEZE",
+			 tableArray->count,
+			 binaryCount,
+			 splitCount,
+			 splitPretty,
+			 multiplexCount,
+			 orderByPkCount,
+			 freezeCount);
+
+	return true;
+}
+
+
+/*
+ * copydb_choose_table_strategy classifies the given table, see the rules at
+ * the top of this file.
+ */
+static void
+copydb_choose_table_strategy(CopyDataSpec *specs,
+							 CopyStrategyContext *context,
+							 SourceTable *table)
+{
+	TableCopyStrategy *strategy = &(table->strategy);
+
+	uint64_t bytes = table->bytes > 0 ? table->bytes : 0;
+	uint64_t rowWidth =
+		table->reltuples > 0 ? bytes / (uint64_t) table->reltuples : 0;
+
+	*strategy = (TableCopyStrategy) {
+		.chosen = true,
+		.copyFormat = COPY_FORMAT_TEXT,
+		.splitTablesLargerThan = 0,
+		.multiplex = false,
+		.orderByPk = false,
+		.freeze = false
+	};
+
+	/* COPY binary is not supported for some column data types */
+	if (context->binaryAllowed && !table->binaryUnsafe)
+	{
+		bool binaryColumns =
+			table->columnCount > 0 &&
+			2 * table->binaryColumnCount >= table->columnCount;
+
+		if (specs->copyFormat == COPY_FORMAT_BINARY || binaryColumns)
+		{
+			strategy->copyFormat = COPY_FORMAT_BINARY;
+		}
+	}
+
+	/* a sample of the rows is not split, see --table-sample */
+	uint64_t splitTrigger =
+		table->isPartition ? 2 * context->splitThreshold : context->splitThreshold;
+
+	if (table->samplePercent == 0.0 && bytes > splitTrigger)
+	{
+		strategy->splitTablesLargerThan = context->splitThreshold;
+	}
+
+	bool split = copydb_table_part_count(specs, table) > 1;
+
+	if (split)
+	{
+		return;
+	}
+
+	if (context->multiplexSmallTables && bytes < context->multiplexThreshold)
+	{
+		strategy->multiplex = true;
+	}
+	else if (table->indexCount > 0 &&
+			 bytes < context->orderByPkThreshold &&
+			 rowWidth <= STRATEGY_ORDER_BY_PK_MAX_ROW_WIDTH)
+	{
+		strategy->orderByPk = true;
+	}
+
+	/* COPY FREEZE is not compatible with --fanout-target */
+	if (specs->fanoutCount == 0 &&
+		(specs->copyFreeze || bytes >= STRATEGY_FREEZE_MIN_BYTES))
+	{
+		strategy->freeze = true;
+	}
+}
+
+
+/*
+ * copydb_strategy_binary_allowed sets allowed to true when the tables can be
+ * copied using the COPY binary format, which requires the same major version
+ * on the source and target servers.
+ */
+static bool
+copydb_strategy_binary_allowed(CopyDataSpec *specs, bool *allowed)
+{
+	*allowed = false;
+
+	/* --copy-format binary has been checked already */
+	if (specs->copyFormat == COPY_FORMAT_BINARY)
+	{
+		*allowed = true;
+		return true;
+	}
+
+	/* the relay server and the fanout targets are not checked here */
+	if (specs->fanoutCount > 0 || !IS_EMPTY_STRING_BUFFER(specs->relayAddress))
+	{
+		return true;
+	}
+
+	PGSQL src = { 0 };
+	PGSQL dst = { 0 };
+
+	int srcVersion = 0;
+	int dstVersion = 0;
+
+	if (!pgsql_init(&src, specs->source_pguri, PGSQL_CONN_SOURCE) ||
+		!pgsql_server_version_num(&src, &srcVersion))
+	{
+		/* errors have already been logged */
+		pgsql_finish(&src);
+		return false;
+	}
+
+	pgsql_finish(&src);
+
+	if (!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET) ||
+		!pgsql_server_version_num(&dst, &dstVersion))
+	{
+		/* errors have already been logged */
+		pgsql_finish(&dst);
+		return false;
+	}
+
+	pgsql_finish(&dst);
+
+	/* before Postgres 10 the major version is made of two numbers */
+	int srcMajor = srcVersion >= 100000 ? srcVersion / 10000 : srcVersion / 100;
+	int dstMajor = dstVersion >= 100000 ? dstVersion / 10000 : dstVersion / 100;
+
+	*allowed = srcMajor == dstMajor;
+
+	if (!*allowed)
+	{
+		log_info("Using COPY text format for all the tables: source server "
+				 "version is %d and target server version is %d",
+				 srcVersion,
+				 dstVersion);
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_copy_strategy_name prepares the name of the copy strategy that is
+ * used for the given table, such as "binary+split" or "text+multiplex", as
+ * reported in the summary.
+ */
+char *
+copydb_copy_strategy_name(CopyDataSpec *specs,
+						  CopyTableDataSpec *tableSpecs,
+						  char *name,
+						  size_t size)
+{
+	sformat(name, size, "%s%s%s%s%s",
+			CopyFormatToString(tableSpecs->copyFormat),
+			tableSpecs->part.partCount > 1 ? "+split" : "",
+			copydb_table_uses_multiplex(specs, tableSpecs) ? "+multiplex" : "",
+			tableSpecs->orderByColumns != NULL ? "+pk" : "",
+			copydb_table_uses_freeze(tableSpecs) ? "+freeze" : "");
+
+	return name;
+}
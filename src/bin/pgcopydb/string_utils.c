@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 #include "postgres_fe.h"
 #include "pqexpbuffer.h"
@@ -498,6 +499,106 @@ IntervalToString(uint64_t millisecs, char *buffer, size_t size)
 }
 
 
+/*
+ * pretty_print_bytes pretty prints bytes in a human readable form. Given
+ * 17179869184 it places the string "16 GB" in the given buffer.
+ */
+void
+pretty_print_bytes(char *buffer, size_t size, uint64_t bytes)
+{
+	const char *suffixes[7] = {
+		"B",                    /* Bytes */
+		"kB",                   /* Kilo */
+		"MB",                   /* Mega */
+		"GB",                   /* Giga */
+		"TB",                   /* Tera */
+		"PB",                   /* Peta */
+		"EB"                    /* Exa */
+	};
+
+	int sIndex = 0;
+	long double count = bytes;
+
+	while (count >= 10240 && sIndex < 6)
+	{
+		sIndex++;
+		count /= 1024;
+	}
+
+	/* forget about having more precision, Postgres wants integers here */
+	sformat(buffer, size, "%d %s", (int) count, suffixes[sIndex]);
+}
+
+
+/*
+ * parse_pretty_printed_bytes parses a value such as "10 GB" or "256MB" or
+ * "1073741824" into a number of bytes. The units follow the Postgres
+ * pg_size_pretty() conventions, where 1 kB is 1024 bytes.
+ */
+bool
+parse_pretty_printed_bytes(const char *value, uint64_t *result)
+{
+	const char *suffixes[7] = { "B", "kB", "MB", "GB", "TB", "PB", "EB" };
+
+	char *endptr = NULL;
+
+	if (value == NULL || result == NULL)
+	{
+		return false;
+	}
+
+	errno = 0;
+	unsigned long long count = strtoull(value, &endptr, 10);
+
+	if (endptr == value || errno != 0 || *value == '-')
+	{
+		log_error("Failed to parse size \"%s\"", value);
+		return false;
+	}
+
+	/* skip spaces between the number and the unit, as in "10 GB" */
+	while (*endptr == ' ')
+	{
+		++endptr;
+	}
+
+	/* no unit means bytes */
+	if (*endptr == '\0')
+	{
+		*result = (uint64_t) count;
+		return true;
+	}
+
+	uint64_t multiplier = 1;
+
+	for (int sIndex = 0; sIndex < 7; sIndex++)
+	{
+		if (strcasecmp(endptr, suffixes[sIndex]) == 0)
+		{
+			/* protect against overflow */
+			if (count > (UINT64_MAX / multiplier))
+			{
+				log_error("Failed to parse size \"%s\": value is too large",
+						  value);
+				return false;
+			}
+
+			*result = (uint64_t) count * multiplier;
+			return true;
+		}
+
+		multiplier *= 1024;
+	}
+
+	log_error("Failed to parse size unit \"%s\" in \"%s\", "
+			  "expected one of B, kB, MB, GB, TB, PB, EB",
+			  endptr,
+			  value);
+
+	return false;
+}
+
+
 /*
  * splitLines prepares a multi-line error message in a way that calling code
  * can loop around one line at a time and call log_error() or log_warn() on
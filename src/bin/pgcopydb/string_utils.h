@@ -39,6 +39,9 @@ bool stringToUInt32(const char *str, uint32_t *number);
 bool stringToDouble(const char *str, double *number);
 bool IntervalToString(uint64_t millisecs, char *buffer, size_t size);
 
+void pretty_print_bytes(char *buffer, size_t size, uint64_t bytes);
+bool parse_pretty_printed_bytes(const char *value, uint64_t *result);
+
 int splitLines(char *errorMessage, char **linesArray, int size);
 void processBufferCallback(const char *buffer, bool error);
 
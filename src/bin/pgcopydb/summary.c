@@ -20,9 +20,28 @@
 static void summary_prepare_toplevel_durations(Summary *summary);
 static void print_toplevel_summary(Summary *summary, int tableJobs, int indexJobs);
 static void print_summary_table(SummaryTable *summary);
+static void print_bulk_load_profile(BulkLoadProfile *profile);
 static bool prepare_summary_table(Summary *summary, CopyDataSpec *specs);
 static void prepare_summary_table_headers(SummaryTable *summary);
 static void prepareLineSeparator(char dashes[], int size);
+static void summary_prepare_throughput(CopyTableSummary *tableSummary,
+									   SummaryTableEntry *entry);
+static void summary_add_table_json(Summary *summary,
+								   CopyTableDataSpec *tableSpecs,
+								   CopyTableSummary *tableSummary,
+								   SummaryTableEntry *entry,
+								   SourceIndexArray *indexArray,
+								   Journal *journal);
+static void summary_add_strategy_json(Summary *summary,
+									  SummaryTableEntry *entry,
+									  CopyTableSummary *tableSummary);
+static void summary_add_phase_json(JSON_Array *jsPhases,
+								   const char *name,
+								   const char *connection,
+								   uint64_t wallClockMs,
+								   int64_t workersMs,
+								   int concurrency);
+static bool write_summary_json(Summary *summary, CopyDataSpec *specs);
 
 
 /*
@@ -30,6 +49,10 @@ static void prepareLineSeparator(char dashes[], int size);
  * given table. The summary file contains identification information and
  * duration information and can be used both as a lock file and as a resource
  * file to display what's happening.
+ *
+ * The parts of a split table read each other's doneFile, so the file is
+ * written under a temporary name and then renamed in place: readers never
+ * see an empty or partially written summary.
  */
 bool
 write_table_summary(CopyTableSummary *summary, char *filename)
@@ -37,7 +60,8 @@ write_table_summary(CopyTableSummary *summary, char *filename)
 	char contents[BUFSIZE] = { 0 };
 
 	sformat(contents, BUFSIZE,
-			"%d\n%u\n%s\n%s\n%lld\n%lld\n%lld\n%s\n",
+			"%d\n%u\n%s\n%s\n%lld\n%lld\n%lld\n%lld\n%lld\n%lld\n"
+			"%lld\n%lld\n%lld\n%s\n%s\n",
 			summary->pid,
 			summary->table->oid,
 			summary->table->nspname,
@@ -45,10 +69,35 @@ write_table_summary(CopyTableSummary *summary, char *filename)
 			(long long) summary->startTime,
 			(long long) summary->doneTime,
 			(long long) summary->durationMs,
-			summary->command);
+			(long long) summary->copyStats.rows,
+			(long long) summary->copyStats.bytes,
+			(long long) summary->copyStats.flushes,
+			(long long) summary->copyStats.srcWaitUs,
+			(long long) summary->copyStats.dstWaitUs,
+			(long long) summary->copyStats.peakBufferSize,
+			summary->command,
+			summary->changeMarker);
+
+	char tmpfilename[MAXPGPATH] = { 0 };
+
+	sformat(tmpfilename, sizeof(tmpfilename), "%s.%d", filename, getpid());
 
 	/* write the summary to the doneFile */
-	return write_file(contents, strlen(contents), filename);
+	if (!write_file(contents, strlen(contents), tmpfilename))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (rename(tmpfilename, filename) != 0)
+	{
+		log_error("Failed to rename \"%s\" to \"%s\": %m",
+				  tmpfilename,
+				  filename);
+		return false;
+	}
+
+	return true;
 }
 
 
@@ -112,8 +161,12 @@ read_table_summary(CopyTableSummary *summary, const char *filename)
 		return false;
 	}
 
-	strlcpy(table->nspname, fileLines[2], sizeof(table->nspname));
-	strlcpy(table->relname, fileLines[3], sizeof(table->relname));
+	if (!schema_catalog_intern(fileLines[2], &(table->nspname)) ||
+		!schema_catalog_intern(fileLines[3], &(table->relname)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
 
 	if (!stringToUInt64(fileLines[4], &(summary->startTime)))
 	{
@@ -133,8 +186,51 @@ read_table_summary(CopyTableSummary *summary, const char *filename)
 		return false;
 	}
 
-	/* last summary line in the file is the SQL command */
-	strlcpy(summary->command, fileLines[7], sizeof(summary->command));
+	if (!stringToUInt64(fileLines[7], &(summary->copyStats.rows)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!stringToUInt64(fileLines[8], &(summary->copyStats.bytes)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!stringToUInt64(fileLines[9], &(summary->copyStats.flushes)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!stringToUInt64(fileLines[10], &(summary->copyStats.srcWaitUs)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!stringToUInt64(fileLines[11], &(summary->copyStats.dstWaitUs)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!stringToUInt64(fileLines[12], &(summary->copyStats.peakBufferSize)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	strlcpy(summary->command, fileLines[13], sizeof(summary->command));
+
+	/* the change marker line is missing in files from older versions */
+	if (lineCount > COPY_TABLE_SUMMARY_LINES)
+	{
+		strlcpy(summary->changeMarker,
+				fileLines[14],
+				sizeof(summary->changeMarker));
+	}
 
 	/* we can't provide instr_time readers */
 	summary->startTimeInstr = (instr_time) {
@@ -149,8 +245,9 @@ read_table_summary(CopyTableSummary *summary, const char *filename)
 
 
 /*
- * open_table_summary initializes the time elements of a table summary and
- * writes the summary in the given filename. Typically, the lockFile.
+ * open_table_summary initializes the time elements and the change marker of a
+ * table summary and writes the summary in the given filename. Typically, the
+ * lockFile.
  */
 bool
 open_table_summary(CopyTableSummary *summary, char *filename)
@@ -167,6 +264,15 @@ open_table_summary(CopyTableSummary *summary, char *filename)
 
 	INSTR_TIME_SET_CURRENT(summary->startTimeInstr);
 
+	/* the COPY reads the table as of the marker fetched with the snapshot */
+	if (IS_EMPTY_STRING_BUFFER(summary->changeMarker) &&
+		summary->table->changeMarker != NULL)
+	{
+		strlcpy(summary->changeMarker,
+				summary->table->changeMarker,
+				sizeof(summary->changeMarker));
+	}
+
 	return write_table_summary(summary, filename);
 }
 
@@ -327,13 +433,13 @@ read_index_summary(CopyIndexSummary *summary, const char *filename)
 	char *fileLines[BUFSIZE] = { 0 };
 	int lineCount = splitLines(fileContents, fileLines, BUFSIZE);
 
-	if (lineCount < COPY_TABLE_SUMMARY_LINES)
+	if (lineCount < COPY_INDEX_SUMMARY_LINES)
 	{
 		log_error("Failed to parse summary file \"%s\" which contains only "
 				  "%d lines, at least %d lines are expected",
 				  filename,
 				  lineCount,
-				  COPY_TABLE_SUMMARY_LINES);
+				  COPY_INDEX_SUMMARY_LINES);
 
 		free(fileContents);
 
@@ -361,8 +467,12 @@ read_index_summary(CopyIndexSummary *summary, const char *filename)
 		return false;
 	}
 
-	strlcpy(index->indexNamespace, fileLines[2], sizeof(index->indexNamespace));
-	strlcpy(index->indexRelname, fileLines[3], sizeof(index->indexRelname));
+	if (!schema_catalog_intern(fileLines[2], &(index->indexNamespace)) ||
+		!schema_catalog_intern(fileLines[3], &(index->indexRelname)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
 
 	if (!stringToUInt64(fileLines[4], &(summary->startTime)))
 	{
@@ -399,7 +509,8 @@ read_index_summary(CopyIndexSummary *summary, const char *filename)
 
 /*
  * open_index_summary initializes the time elements of an index summary and
- * writes the summary in the given filename. Typically, the lockFile.
+ * writes the summary in the given filename. Typically, the lockFile. When
+ * filename is NULL, only the time elements are initialized.
  */
 bool
 open_index_summary(CopyIndexSummary *summary, char *filename)
@@ -416,13 +527,18 @@ open_index_summary(CopyIndexSummary *summary, char *filename)
 
 	INSTR_TIME_SET_CURRENT(summary->startTimeInstr);
 
+	if (filename == NULL)
+	{
+		return true;
+	}
+
 	return write_index_summary(summary, filename);
 }
 
 
 /*
  * finish_index_summary sets the duration of the summary fields and writes the
- * summary in the given filename. Typically, the doneFile.
+ * summary in the given filename, unless filename is NULL.
  */
 bool
 finish_index_summary(CopyIndexSummary *summary, char *filename)
@@ -434,6 +550,11 @@ finish_index_summary(CopyIndexSummary *summary, char *filename)
 
 	summary->durationMs = INSTR_TIME_GET_MILLISEC(summary->durationInstr);
 
+	if (filename == NULL)
+	{
+		return true;
+	}
+
 	return write_index_summary(summary, filename);
 }
 
@@ -471,6 +592,16 @@ print_summary(Summary *summary, CopyDataSpec *specs)
 	(void) summary_prepare_toplevel_durations(summary);
 	(void) print_toplevel_summary(summary, specs->tableJobs, specs->indexJobs);
 
+	/* the same information for machines, a failure here is not fatal */
+	if (!write_summary_json(summary, specs))
+	{
+		log_warn("Failed to write the JSON report to \"%s\"",
+				 specs->cfPaths.summaryfile);
+	}
+
+	/* and the effective values of the --bulk-load-profile settings */
+	(void) print_bulk_load_profile(&(specs->bulkLoadProfile));
+
 	return true;
 }
 
@@ -658,9 +789,48 @@ print_toplevel_summary(Summary *summary, int tableJobs, int indexJobs)
 }
 
 
+/*
+ * print_bulk_load_profile prints the settings that have been used on the
+ * target connections, with the value that the target server reported for
+ * each of them, see copydb_check_bulk_load_profile().
+ */
+static void
+print_bulk_load_profile(BulkLoadProfile *profile)
+{
+	char *d12s = "------------";
+	char *d35s = "-----------------------------------";
+	char *d20s = "--------------------";
+
+	if (profile->count == 0 ||
+		IS_EMPTY_STRING_BUFFER(profile->array[0].effective))
+	{
+		return;
+	}
+
+	fformat(stdout, " %12s   %35s  %20s  %20s\n",
+			"Phase", "Target Session Setting", "Requested", "Effective");
+
+	fformat(stdout, " %12s   %35s  %20s  %20s\n", d12s, d35s, d20s, d20s);
+
+	for (int i = 0; i < profile->count; i++)
+	{
+		BulkLoadSetting *setting = &(profile->array[i]);
+
+		fformat(stdout, " %12s   %35s  %20s  %20s\n",
+				copydb_bulk_load_phase_to_string(setting->phase),
+				setting->name,
+				setting->value,
+				setting->effective);
+	}
+
+	fformat(stdout, "\n");
+}
+
+
 /*
  * prepare_summary_table prepares the summar table array with the durations
- * read from disk in the doneFile for each oid that has been processed.
+ * read from disk in the doneFile for each table that has been processed, and
+ * in the journal for each index.
  */
 static bool
 prepare_summary_table(Summary *summary, CopyDataSpec *specs)
@@ -671,10 +841,20 @@ prepare_summary_table(Summary *summary, CopyDataSpec *specs)
 
 	int count = tableSpecsArray->count;
 
-	summaryTable->count = count;
+	/* the index durations are registered in the journal */
+	if (!journal_load(&(specs->journal)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	summaryTable->count = 0;
 	summaryTable->array =
 		(SummaryTableEntry *) malloc(count * sizeof(SummaryTableEntry));
 
+	summary->tables = json_value_init_array();
+	summary->strategies = json_value_init_object();
+
 	if (summaryTable->array == NULL)
 	{
 		log_error(ALLOCATION_FAILED_ERROR);
@@ -685,8 +865,17 @@ prepare_summary_table(Summary *summary, CopyDataSpec *specs)
 	{
 		CopyTableDataSpec *tableSpecs = &(tableSpecsArray->array[tableIndex]);
 		SourceTable *table = tableSpecs->sourceTable;
+		TableFilePaths tablePaths = { 0 };
 
-		SummaryTableEntry *entry = &(summaryTable->array[tableIndex]);
+		/* split tables have one entry per part, the doneFile is shared */
+		if (tableSpecs->part.partNumber > 0)
+		{
+			continue;
+		}
+
+		(void) copydb_table_file_paths(tableSpecs, &tablePaths);
+
+		SummaryTableEntry *entry = &(summaryTable->array[summaryTable->count++]);
 
 		/* prepare some of the information we already have */
 		IntString oidString = intToString(table->oid);
@@ -698,7 +887,7 @@ prepare_summary_table(Summary *summary, CopyDataSpec *specs)
 		/* the specs doesn't contain timing information */
 		CopyTableSummary tableSummary = { .table = table };
 
-		if (!read_table_summary(&tableSummary, tableSpecs->tablePaths.doneFile))
+		if (!read_table_summary(&tableSummary, tablePaths.doneFile))
 		{
 			/* errors have already been logged */
 			return false;
@@ -710,13 +899,24 @@ prepare_summary_table(Summary *summary, CopyDataSpec *specs)
 								entry->tableMs,
 								sizeof(entry->tableMs));
 
+		IntString flushesString = intToString(tableSummary.copyStats.flushes);
+
+		strlcpy(entry->flushes, flushesString.strValue, sizeof(entry->flushes));
+
+		(void) summary_prepare_throughput(&tableSummary, entry);
+
+		(void) copydb_copy_strategy_name(specs,
+										 tableSpecs,
+										 entry->strategy,
+										 sizeof(entry->strategy));
+
 		/* read the index oid list from the table oid */
 		uint64_t indexingDurationMs = 0;
 
 		SourceIndexArray indexArray = { 0 };
 
 		if (!read_table_index_file(&indexArray,
-								   tableSpecs->tablePaths.idxListFile))
+								   tablePaths.idxListFile))
 		{
 			/* errors have already been logged */
 			return false;
@@ -726,26 +926,15 @@ prepare_summary_table(Summary *summary, CopyDataSpec *specs)
 		for (int i = 0; i < indexArray.count; i++)
 		{
 			SourceIndex *index = &(indexArray.array[i]);
-			CopyIndexSummary indexSummary = { .index = index };
-			char indexDoneFile[MAXPGPATH] = { 0 };
-
-			/* build the indexDoneFile for the target index */
-			sformat(indexDoneFile, sizeof(indexDoneFile), "%s/%u.done",
-					specs->cfPaths.idxdir,
-					index->indexOid);
+			JournalEntry *indexEntry =
+				journal_lookup(&(specs->journal), index->indexOid);
 
-			/* when a table has no indexes, the file doesn't exists */
-			if (file_exists(indexDoneFile))
+			/* the index might not have been built in this run */
+			if (indexEntry != NULL)
 			{
-				if (!read_index_summary(&indexSummary, indexDoneFile))
-				{
-					/* errors have already been logged */
-					return false;
-				}
-
 				/* accumulate total duration of creating all the indexes */
-				timings->indexDurationMs += indexSummary.durationMs;
-				indexingDurationMs += indexSummary.durationMs;
+				timings->indexDurationMs += indexEntry->durationMs;
+				indexingDurationMs += indexEntry->durationMs;
 			}
 		}
 
@@ -758,12 +947,413 @@ prepare_summary_table(Summary *summary, CopyDataSpec *specs)
 		(void) IntervalToString(indexingDurationMs,
 								entry->indexMs,
 								sizeof(entry->indexMs));
+
+		(void) summary_add_table_json(summary,
+									  tableSpecs,
+									  &tableSummary,
+									  entry,
+									  &indexArray,
+									  &(specs->journal));
 	}
 
 	return true;
 }
 
 
+/*
+ * summary_add_table_json adds the timings of the given table and of its
+ * indexes to the JSON array of tables of the summary.json report, and tracks
+ * the earliest start time and latest done time of the COPY and CREATE INDEX
+ * phases.
+ */
+static void
+summary_add_table_json(Summary *summary,
+					   CopyTableDataSpec *tableSpecs,
+					   CopyTableSummary *tableSummary,
+					   SummaryTableEntry *entry,
+					   SourceIndexArray *indexArray,
+					   Journal *journal)
+{
+	TopLevelTimings *timings = &(summary->timings);
+	SourceTable *table = tableSpecs->sourceTable;
+	CopyStats *stats = &(tableSummary->copyStats);
+
+	if (tableSummary->startTime > 0 &&
+		(timings->copyStartTime == 0 ||
+		 tableSummary->startTime < timings->copyStartTime))
+	{
+		timings->copyStartTime = tableSummary->startTime;
+	}
+
+	if (tableSummary->doneTime > timings->copyDoneTime)
+	{
+		timings->copyDoneTime = tableSummary->doneTime;
+	}
+
+	JSON_Value *jsTable = json_value_init_object();
+	JSON_Object *jsTableObj = json_value_get_object(jsTable);
+
+	json_object_set_number(jsTableObj, "oid", (double) table->oid);
+	json_object_set_string(jsTableObj, "schema", table->nspname);
+	json_object_set_string(jsTableObj, "name", table->relname);
+	json_object_set_number(jsTableObj, "bytes", (double) table->bytes);
+	json_object_set_number(jsTableObj, "parts",
+						   (double) (tableSpecs->part.partCount > 0
+									 ? tableSpecs->part.partCount
+									 : 1));
+
+	JSON_Value *jsCopy = json_value_init_object();
+	JSON_Object *jsCopyObj = json_value_get_object(jsCopy);
+
+	json_object_set_number(jsCopyObj, "start-time",
+						   (double) tableSummary->startTime);
+	json_object_set_number(jsCopyObj, "done-time",
+						   (double) tableSummary->doneTime);
+	json_object_set_number(jsCopyObj, "duration-ms",
+						   (double) tableSummary->durationMs);
+	json_object_set_number(jsCopyObj, "rows", (double) stats->rows);
+	json_object_set_number(jsCopyObj, "bytes", (double) stats->bytes);
+	json_object_set_number(jsCopyObj, "flushes", (double) stats->flushes);
+	json_object_set_number(jsCopyObj, "source-wait-ms",
+						   (double) stats->srcWaitUs / 1000);
+	json_object_set_number(jsCopyObj, "target-wait-ms",
+						   (double) stats->dstWaitUs / 1000);
+	json_object_set_number(jsCopyObj, "peak-buffer-size",
+						   (double) stats->peakBufferSize);
+
+	if (tableSummary->durationMs > 0)
+	{
+		json_object_set_number(jsCopyObj, "throughput-bytes-per-sec",
+							   (double) stats->bytes * 1000 /
+							   tableSummary->durationMs);
+	}
+	else
+	{
+		json_object_set_null(jsCopyObj, "throughput-bytes-per-sec");
+	}
+
+	json_object_set_string(jsCopyObj, "bound", entry->bound);
+
+	json_object_set_value(jsTableObj, "copy", jsCopy);
+
+	JSON_Value *jsStrategy = json_value_init_object();
+	JSON_Object *jsStrategyObj = json_value_get_object(jsStrategy);
+
+	json_object_set_string(jsStrategyObj, "name", entry->strategy);
+	json_object_set_string(jsStrategyObj, "chosen",
+						   table->strategy.chosen ? "auto" : "manual");
+
+	json_object_set_value(jsTableObj, "strategy", jsStrategy);
+
+	(void) summary_add_strategy_json(summary, entry, tableSummary);
+
+	JSON_Value *jsIndexes = json_value_init_array();
+	JSON_Array *jsIndexArray = json_value_get_array(jsIndexes);
+
+	for (int i = 0; i < indexArray->count; i++)
+	{
+		SourceIndex *index = &(indexArray->array[i]);
+		JournalEntry *indexEntry = journal_lookup(journal, index->indexOid);
+
+		JSON_Value *jsIndex = json_value_init_object();
+		JSON_Object *jsIndexObj = json_value_get_object(jsIndex);
+
+		json_object_set_number(jsIndexObj, "oid", (double) index->indexOid);
+		json_object_set_string(jsIndexObj, "schema", index->indexNamespace);
+		json_object_set_string(jsIndexObj, "name", index->indexRelname);
+
+		/* the index might not have been built in this run */
+		if (indexEntry != NULL)
+		{
+			json_object_set_number(jsIndexObj, "start-time",
+								   (double) indexEntry->startTime);
+			json_object_set_number(jsIndexObj, "done-time",
+								   (double) indexEntry->doneTime);
+			json_object_set_number(jsIndexObj, "duration-ms",
+								   (double) indexEntry->durationMs);
+
+			if (indexEntry->startTime > 0 &&
+				(timings->indexStartTime == 0 ||
+				 indexEntry->startTime < timings->indexStartTime))
+			{
+				timings->indexStartTime = indexEntry->startTime;
+			}
+
+			if (indexEntry->doneTime > timings->indexDoneTime)
+			{
+				timings->indexDoneTime = indexEntry->doneTime;
+			}
+		}
+		else
+		{
+			json_object_set_null(jsIndexObj, "duration-ms");
+		}
+
+		json_array_append_value(jsIndexArray, jsIndex);
+	}
+
+	json_object_set_value(jsTableObj, "indexes", jsIndexes);
+
+	json_array_append_value(json_value_get_array(summary->tables), jsTable);
+}
+
+
+/*
+ * summary_add_strategy_json accumulates the COPY of the given table into the
+ * totals of its copy strategy, so that the throughput of each strategy can be
+ * compared in the summary.json report.
+ */
+static void
+summary_add_strategy_json(Summary *summary,
+						  SummaryTableEntry *entry,
+						  CopyTableSummary *tableSummary)
+{
+	JSON_Object *jsStrategies = json_value_get_object(summary->strategies);
+	JSON_Object *jsStrategyObj =
+		json_object_get_object(jsStrategies, entry->strategy);
+
+	if (jsStrategyObj == NULL)
+	{
+		JSON_Value *jsStrategy = json_value_init_object();
+
+		json_object_set_value(jsStrategies, entry->strategy, jsStrategy);
+		jsStrategyObj = json_value_get_object(jsStrategy);
+	}
+
+	double tables = json_object_get_number(jsStrategyObj, "tables");
+	double bytes = json_object_get_number(jsStrategyObj, "bytes");
+	double durationMs = json_object_get_number(jsStrategyObj, "duration-ms");
+
+	json_object_set_number(jsStrategyObj, "tables", tables + 1);
+	json_object_set_number(jsStrategyObj, "bytes",
+						   bytes + (double) tableSummary->copyStats.bytes);
+	json_object_set_number(jsStrategyObj, "duration-ms",
+						   durationMs + (double) tableSummary->durationMs);
+}
+
+
+/*
+ * write_summary_json writes the summary.json report of the run: the job
+ * counts, the wall clock duration of each phase and when relevant the sum
+ * of the durations of the workers in that phase, and the per-table and
+ * per-index timings. The report is meant to track performance across runs.
+ */
+static bool
+write_summary_json(Summary *summary, CopyDataSpec *specs)
+{
+	TopLevelTimings *timings = &(summary->timings);
+
+	JSON_Value *js = json_value_init_object();
+	JSON_Object *root = json_value_get_object(js);
+
+	json_object_set_string(root, "pgcopydb", PGCOPYDB_VERSION);
+	json_object_set_number(root, "pid", (double) getpid());
+	json_object_set_number(root, "done-time", (double) time(NULL));
+
+	JSON_Value *jsJobs = json_value_init_object();
+	JSON_Object *jsJobsObj = json_value_get_object(jsJobs);
+
+	json_object_set_number(jsJobsObj, "table-jobs", specs->tableJobs);
+	json_object_set_number(jsJobsObj, "index-jobs", specs->indexJobs);
+	json_object_set_number(jsJobsObj, "vacuum-jobs", specs->vacuumJobs);
+	json_object_set_number(jsJobsObj, "restore-jobs", specs->restoreJobs);
+	json_object_set_number(jsJobsObj, "large-objects-jobs",
+						   specs->largeObjectJobs);
+	json_object_set_number(jsJobsObj, "multiplex-streams",
+						   specs->multiplexStreams);
+
+	json_object_set_value(root, "jobs", jsJobs);
+
+	/* the phase bounds are time(NULL) values, in seconds */
+	uint64_t copyWallClockMs =
+		timings->copyDoneTime > timings->copyStartTime
+		? (timings->copyDoneTime - timings->copyStartTime) * 1000
+		: 0;
+
+	uint64_t indexWallClockMs =
+		timings->indexDoneTime > timings->indexStartTime
+		? (timings->indexDoneTime - timings->indexStartTime) * 1000
+		: 0;
+
+	JSON_Value *jsPhases = json_value_init_array();
+	JSON_Array *jsPhaseArray = json_value_get_array(jsPhases);
+
+	instr_time duration;
+
+	duration = timings->beforePrepareSchema;
+	INSTR_TIME_SUBTRACT(duration, timings->beforeSchemaDump);
+
+	summary_add_phase_json(jsPhaseArray, "dump-schema", "source",
+						   INSTR_TIME_MS(duration), -1, 1);
+
+	duration = timings->afterPrepareSchema;
+	INSTR_TIME_SUBTRACT(duration, timings->beforePrepareSchema);
+
+	summary_add_phase_json(jsPhaseArray, "prepare-schema", "target",
+						   INSTR_TIME_MS(duration), -1, 1);
+
+	summary_add_phase_json(jsPhaseArray, "data-and-indexes", "both",
+						   timings->dataAndIndexesDurationMs, -1,
+						   specs->tableJobs + specs->indexJobs);
+
+	summary_add_phase_json(jsPhaseArray, "copy", "both",
+						   copyWallClockMs, timings->tableDurationMs,
+						   specs->tableJobs);
+
+	summary_add_phase_json(jsPhaseArray, "create-index", "target",
+						   indexWallClockMs, timings->indexDurationMs,
+						   specs->indexJobs);
+
+	duration = timings->afterFinalizeSchema;
+	INSTR_TIME_SUBTRACT(duration, timings->beforeFinalizeSchema);
+
+	summary_add_phase_json(jsPhaseArray, "finalize-schema", "target",
+						   INSTR_TIME_MS(duration), -1, 1);
+
+	summary_add_phase_json(jsPhaseArray, "total", "both",
+						   timings->totalDurationMs, -1,
+						   specs->tableJobs + specs->indexJobs);
+
+	json_object_set_value(root, "phases", jsPhases);
+
+	/* hand over the tables array, when we have one */
+	if (summary->tables == NULL)
+	{
+		summary->tables = json_value_init_array();
+	}
+
+	json_object_set_value(root, "tables", summary->tables);
+	summary->tables = NULL;
+
+	/* and the totals per copy strategy, with their throughput */
+	if (summary->strategies == NULL)
+	{
+		summary->strategies = json_value_init_object();
+	}
+
+	JSON_Object *jsStrategies = json_value_get_object(summary->strategies);
+
+	for (size_t i = 0; i < json_object_get_count(jsStrategies); i++)
+	{
+		JSON_Object *jsStrategyObj =
+			json_value_get_object(json_object_get_value_at(jsStrategies, i));
+
+		double bytes = json_object_get_number(jsStrategyObj, "bytes");
+		double durationMs = json_object_get_number(jsStrategyObj, "duration-ms");
+
+		if (durationMs > 0)
+		{
+			json_object_set_number(jsStrategyObj, "throughput-bytes-per-sec",
+								   bytes * 1000 / durationMs);
+		}
+		else
+		{
+			json_object_set_null(jsStrategyObj, "throughput-bytes-per-sec");
+		}
+	}
+
+	json_object_set_value(root, "strategies", summary->strategies);
+	summary->strategies = NULL;
+
+	char *serialized = json_serialize_to_string_pretty(js);
+
+	bool success =
+		serialized != NULL &&
+		write_file(serialized, strlen(serialized), specs->cfPaths.summaryfile);
+
+	if (success)
+	{
+		log_info("Wrote the JSON report to \"%s\"", specs->cfPaths.summaryfile);
+	}
+
+	json_free_serialized_string(serialized);
+	json_value_free(js);
+
+	return success;
+}
+
+
+/*
+ * summary_add_phase_json adds a phase to the JSON array of phases of the
+ * summary.json report. The workers duration is the sum of the durations of
+ * the workers of a parallel phase, and is omitted (null) otherwise.
+ */
+static void
+summary_add_phase_json(JSON_Array *jsPhases,
+					   const char *name,
+					   const char *connection,
+					   uint64_t wallClockMs,
+					   int64_t workersMs,
+					   int concurrency)
+{
+	JSON_Value *jsPhase = json_value_init_object();
+	JSON_Object *jsPhaseObj = json_value_get_object(jsPhase);
+
+	json_object_set_string(jsPhaseObj, "name", name);
+	json_object_set_string(jsPhaseObj, "connection", connection);
+	json_object_set_number(jsPhaseObj, "wall-clock-ms", (double) wallClockMs);
+
+	if (workersMs >= 0)
+	{
+		json_object_set_number(jsPhaseObj, "workers-ms", (double) workersMs);
+	}
+	else
+	{
+		json_object_set_null(jsPhaseObj, "workers-ms");
+	}
+
+	json_object_set_number(jsPhaseObj, "concurrency", concurrency);
+
+	json_array_append_value(jsPhases, jsPhase);
+}
+
+
+/*
+ * summary_prepare_throughput computes the COPY throughput of a table, and
+ * whether the COPY was bound by the source or the target, from the time
+ * pg_copy() was blocked reading from the source and writing to the target.
+ * One side is said to be the bottleneck when it has been waited on for at
+ * least twice as long as the other side.
+ */
+static void
+summary_prepare_throughput(CopyTableSummary *tableSummary,
+						   SummaryTableEntry *entry)
+{
+	CopyStats *stats = &(tableSummary->copyStats);
+
+	if (tableSummary->durationMs > 0)
+	{
+		double mbps =
+			((double) stats->bytes / (1024 * 1024)) /
+			((double) tableSummary->durationMs / 1000);
+
+		sformat(entry->throughput, sizeof(entry->throughput), "%.1f", mbps);
+	}
+	else
+	{
+		strlcpy(entry->throughput, "-", sizeof(entry->throughput));
+	}
+
+	if (stats->srcWaitUs == 0 && stats->dstWaitUs == 0)
+	{
+		/* tables copied by the multiplexed COPY are not instrumented */
+		strlcpy(entry->bound, "-", sizeof(entry->bound));
+	}
+	else if (stats->srcWaitUs >= 2 * stats->dstWaitUs)
+	{
+		strlcpy(entry->bound, "source", sizeof(entry->bound));
+	}
+	else if (stats->dstWaitUs >= 2 * stats->srcWaitUs)
+	{
+		strlcpy(entry->bound, "target", sizeof(entry->bound));
+	}
+	else
+	{
+		strlcpy(entry->bound, "both", sizeof(entry->bound));
+	}
+}
+
+
 /*
  * print_summary_table loops over a fully prepared summary table and prints
  * each element. It also prints the headers.
@@ -775,19 +1365,27 @@ print_summary_table(SummaryTable *summary)
 
 	fformat(stdout, "\n");
 
-	fformat(stdout, "%*s | %*s | %*s | %*s | %*s | %*s\n",
+	fformat(stdout, "%*s | %*s | %*s | %*s | %*s | %*s | %*s | %*s | %*s | %*s\n",
 			headers->maxOidSize, "OID",
 			headers->maxNspnameSize, "Schema",
 			headers->maxRelnameSize, "Name",
 			headers->maxTableMsSize, "copy duration",
+			headers->maxFlushesSize, "flushes",
+			headers->maxThroughputSize, "MB/s",
+			headers->maxBoundSize, "bound",
+			headers->maxStrategySize, "strategy",
 			headers->maxIndexCountSize, "indexes",
 			headers->maxIndexMsSize, "create index duration");
 
-	fformat(stdout, "%s-+-%s-+-%s-+-%s-+-%s-+-%s\n",
+	fformat(stdout, "%s-+-%s-+-%s-+-%s-+-%s-+-%s-+-%s-+-%s-+-%s-+-%s\n",
 			headers->oidSeparator,
 			headers->nspnameSeparator,
 			headers->relnameSeparator,
 			headers->tableMsSeparator,
+			headers->flushesSeparator,
+			headers->throughputSeparator,
+			headers->boundSeparator,
+			headers->strategySeparator,
 			headers->indexCountSeparator,
 			headers->indexMsSeparator);
 
@@ -795,11 +1393,15 @@ print_summary_table(SummaryTable *summary)
 	{
 		SummaryTableEntry *entry = &(summary->array[i]);
 
-		fformat(stdout, "%*s | %*s | %*s | %*s | %*s | %*s\n",
+		fformat(stdout, "%*s | %*s | %*s | %*s | %*s | %*s | %*s | %*s | %*s | %*s\n",
 				headers->maxOidSize, entry->oid,
 				headers->maxNspnameSize, entry->nspname,
 				headers->maxRelnameSize, entry->relname,
 				headers->maxTableMsSize, entry->tableMs,
+				headers->maxFlushesSize, entry->flushes,
+				headers->maxThroughputSize, entry->throughput,
+				headers->maxBoundSize, entry->bound,
+				headers->maxStrategySize, entry->strategy,
 				headers->maxIndexCountSize, entry->indexCount,
 				headers->maxIndexMsSize, entry->indexMs);
 	}
@@ -823,6 +1425,10 @@ prepare_summary_table_headers(SummaryTable *summary)
 	headers->maxNspnameSize = 6;    /* "schema" */
 	headers->maxRelnameSize = 4;    /* "name" */
 	headers->maxTableMsSize = 13;   /* "copy duration" */
+	headers->maxFlushesSize = 7;    /* "flushes" */
+	headers->maxThroughputSize = 4; /* "MB/s" */
+	headers->maxBoundSize = 5;      /* "bound" */
+	headers->maxStrategySize = 8;   /* "strategy" */
 	headers->maxIndexCountSize = 7; /* "indexes" */
 	headers->maxIndexMsSize = 21;   /* "create index duration" */
 
@@ -860,6 +1466,34 @@ prepare_summary_table_headers(SummaryTable *summary)
 			headers->maxTableMsSize = len;
 		}
 
+		len = strlen(entry->flushes);
+
+		if (headers->maxFlushesSize < len)
+		{
+			headers->maxFlushesSize = len;
+		}
+
+		len = strlen(entry->throughput);
+
+		if (headers->maxThroughputSize < len)
+		{
+			headers->maxThroughputSize = len;
+		}
+
+		len = strlen(entry->bound);
+
+		if (headers->maxBoundSize < len)
+		{
+			headers->maxBoundSize = len;
+		}
+
+		len = strlen(entry->strategy);
+
+		if (headers->maxStrategySize < len)
+		{
+			headers->maxStrategySize = len;
+		}
+
 		len = strlen(entry->indexCount);
 
 		if (headers->maxIndexCountSize < len)
@@ -880,6 +1514,10 @@ prepare_summary_table_headers(SummaryTable *summary)
 	prepareLineSeparator(headers->nspnameSeparator, headers->maxNspnameSize);
 	prepareLineSeparator(headers->relnameSeparator, headers->maxRelnameSize);
 	prepareLineSeparator(headers->tableMsSeparator, headers->maxTableMsSize);
+	prepareLineSeparator(headers->flushesSeparator, headers->maxFlushesSize);
+	prepareLineSeparator(headers->throughputSeparator, headers->maxThroughputSize);
+	prepareLineSeparator(headers->boundSeparator, headers->maxBoundSize);
+	prepareLineSeparator(headers->strategySeparator, headers->maxStrategySize);
 	prepareLineSeparator(headers->indexCountSeparator, headers->maxIndexCountSize);
 	prepareLineSeparator(headers->indexMsSeparator, headers->maxIndexMsSize);
 }
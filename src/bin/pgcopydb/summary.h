@@ -16,10 +16,11 @@
 #include "pqexpbuffer.h"
 #include "portability/instr_time.h"
 
+#include "parson.h"
 #include "string_utils.h"
 #include "schema.h"
 
-#define COPY_TABLE_SUMMARY_LINES 8
+#define COPY_TABLE_SUMMARY_LINES 14
 
 typedef struct CopyTableSummary
 {
@@ -30,7 +31,9 @@ typedef struct CopyTableSummary
 	uint64_t durationMs;        /* instr_time duration in milliseconds */
 	instr_time startTimeInstr;  /* internal instr_time tracker */
 	instr_time durationInstr;   /* internal instr_time tracker */
+	CopyStats copyStats;        /* rows, bytes, flushes, wait times */
 	char command[BUFSIZE];      /* SQL command */
+	char changeMarker[TABLE_CHANGE_MARKER_SIZE];    /* see --refresh */
 } CopyTableSummary;
 
 
@@ -60,6 +63,10 @@ typedef struct SummaryTableHeaders
 	int maxNspnameSize;
 	int maxRelnameSize;
 	int maxTableMsSize;
+	int maxFlushesSize;
+	int maxThroughputSize;
+	int maxBoundSize;
+	int maxStrategySize;
 	int maxIndexCountSize;
 	int maxIndexMsSize;
 
@@ -67,6 +74,10 @@ typedef struct SummaryTableHeaders
 	char nspnameSeparator[NAMEDATALEN];
 	char relnameSeparator[NAMEDATALEN];
 	char tableMsSeparator[NAMEDATALEN];
+	char flushesSeparator[NAMEDATALEN];
+	char throughputSeparator[NAMEDATALEN];
+	char boundSeparator[NAMEDATALEN];
+	char strategySeparator[NAMEDATALEN];
 	char indexCountSeparator[NAMEDATALEN];
 	char indexMsSeparator[NAMEDATALEN];
 } SummaryTableHeaders;
@@ -80,6 +91,10 @@ typedef struct SummaryTableEntry
 	char nspname[NAMEDATALEN];
 	char relname[NAMEDATALEN];
 	char tableMs[INTERVAL_MAXLEN];
+	char flushes[INTSTRING_MAX_DIGITS];
+	char throughput[INTSTRING_MAX_DIGITS];
+	char bound[NAMEDATALEN];
+	char strategy[NAMEDATALEN];
 	char indexCount[INTSTRING_MAX_DIGITS];
 	char indexMs[INTERVAL_MAXLEN];
 } SummaryTableEntry;
@@ -128,6 +143,12 @@ typedef struct TopLevelTimings
 	uint64_t tableDurationMs;   /* sum of COPY (TABLE DATA) durations */
 	uint64_t indexDurationMs;   /* sum of CREATE INDEX durations */
 
+	/* time(NULL) bounds of the COPY and CREATE INDEX phases */
+	uint64_t copyStartTime;
+	uint64_t copyDoneTime;
+	uint64_t indexStartTime;
+	uint64_t indexDoneTime;
+
 	char totalCopyDataMs[INTSTRING_MAX_DIGITS];
 	char totalCreateIndexMs[INTSTRING_MAX_DIGITS];
 } TopLevelTimings;
@@ -137,6 +158,8 @@ typedef struct Summary
 {
 	TopLevelTimings timings;
 	SummaryTable table;
+	JSON_Value *tables;         /* JSON array for the summary.json report */
+	JSON_Value *strategies;     /* JSON object, totals per copy strategy */
 } Summary;
 
 
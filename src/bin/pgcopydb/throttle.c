@@ -0,0 +1,538 @@
+/*
+ * src/bin/pgcopydb/throttle.c
+ *     Implementation of a CLI to copy a database between two Postgres instances
+ */
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "copydb.h"
+#include "lock_utils.h"
+#include "log.h"
+#include "pgsql.h"
+#include "signals.h"
+
+
+static bool copydb_throttle_monitor(CopyDataSpec *specs);
+static bool copydb_throttle_sample_source(PGSQL *pgsql,
+										  bool *sampleLag,
+										  uint64_t *lag,
+										  int *backends);
+static bool copydb_throttle_count_backends(PGSQL *pgsql, int *backends);
+static void copydb_throttle_sleep(uint64_t microseconds);
+
+
+/*
+ * copydb_throttle_init allocates the throttle area in shared memory, when
+ * either --max-copy-rate or the adaptive mode is used. The area is shared by
+ * the table workers and the multiplexed COPY process, which all consume
+ * from the same token bucket, see copydb_throttle_copy_data().
+ */
+bool
+copydb_throttle_init(CopyDataSpec *specs, int workerCount)
+{
+	specs->throttle = NULL;
+
+	if (specs->maxCopyRate == 0 && !copydb_throttle_is_adaptive(specs))
+	{
+		return true;
+	}
+
+	size_t size = sizeof(CopyThrottle);
+
+	void *area = mmap(NULL, size,
+					  PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_ANONYMOUS,
+					  -1, 0);
+
+	if (area == MAP_FAILED)
+	{
+		log_error("Failed to allocate %lld bytes of shared memory for "
+				  "the COPY throttle: %m",
+				  (long long) size);
+		return false;
+	}
+
+	CopyThrottle *throttle = (CopyThrottle *) area;
+
+	instr_time now;
+	INSTR_TIME_SET_CURRENT(now);
+
+	throttle->size = size;
+	throttle->maxRate = specs->maxCopyRate;
+	throttle->tokens = 0;
+	throttle->lastRefill = INSTR_TIME_GET_MICROSEC(now);
+
+	throttle->maxWorkers = workerCount;
+	throttle->activeWorkers = workerCount;
+
+	/* the semaphore initValue defaults to 1: a mutex */
+	throttle->semaphore.initValue = 1;
+
+	if (!semaphore_create(&(throttle->semaphore)))
+	{
+		log_error("Failed to create the COPY throttle semaphore");
+		(void) munmap(area, size);
+		return false;
+	}
+
+	if (specs->maxCopyRate > 0)
+	{
+		log_info("Limiting COPY to %s per second", specs->maxCopyRatePretty);
+	}
+
+	specs->throttle = throttle;
+
+	return true;
+}
+
+
+/*
+ * copydb_throttle_finish removes the throttle semaphore and releases the
+ * shared memory area.
+ */
+bool
+copydb_throttle_finish(CopyDataSpec *specs)
+{
+	CopyThrottle *throttle = specs->throttle;
+	bool success = true;
+
+	if (throttle == NULL)
+	{
+		return true;
+	}
+
+	if (!semaphore_finish(&(throttle->semaphore)))
+	{
+		log_warn("Failed to remove COPY throttle semaphore %d",
+				 throttle->semaphore.semId);
+		success = false;
+	}
+
+	if (munmap((void *) throttle, throttle->size) != 0)
+	{
+		log_warn("Failed to release the COPY throttle shared memory: %m");
+		success = false;
+	}
+
+	specs->throttle = NULL;
+
+	return success;
+}
+
+
+/*
+ * copydb_throttle_is_adaptive returns true when the number of running table
+ * workers is adjusted to the source server load during the copy.
+ */
+bool
+copydb_throttle_is_adaptive(CopyDataSpec *specs)
+{
+	return specs->adaptiveMaxLag > 0 || specs->adaptiveMaxBackends > 0;
+}
+
+
+/*
+ * copydb_throttle_copy_data implements the pg_copy() throttle callback: it
+ * consumes len bytes from the shared token bucket, and sleeps until the
+ * bucket has been refilled enough to pay for them.
+ *
+ * The tokens count goes negative when several processes consume faster than
+ * the --max-copy-rate allows: each process then sleeps until its own bytes
+ * are paid for, which keeps the global rate at the limit.
+ */
+void
+copydb_throttle_copy_data(void *context, int len)
+{
+	CopyThrottle *throttle = (CopyThrottle *) context;
+
+	if (throttle == NULL || throttle->maxRate == 0)
+	{
+		return;
+	}
+
+	instr_time now;
+	INSTR_TIME_SET_CURRENT(now);
+
+	uint64_t nowUs = INSTR_TIME_GET_MICROSEC(now);
+	double rate = (double) throttle->maxRate;
+
+	if (!semaphore_lock(&(throttle->semaphore)))
+	{
+		/* errors have already been logged */
+		return;
+	}
+
+	/* refill the bucket, allowing for bursts of up to one second */
+	if (nowUs > throttle->lastRefill)
+	{
+		double elapsed = (double) (nowUs - throttle->lastRefill) / 1000000.0;
+
+		throttle->tokens += elapsed * rate;
+
+		if (throttle->tokens > rate)
+		{
+			throttle->tokens = rate;
+		}
+
+		throttle->lastRefill = nowUs;
+	}
+
+	throttle->tokens -= len;
+
+	double debt = throttle->tokens < 0 ? -throttle->tokens : 0;
+
+	(void) semaphore_unlock(&(throttle->semaphore));
+
+	if (debt > 0)
+	{
+		(void) copydb_throttle_sleep((uint64_t) (debt * 1000000.0 / rate));
+	}
+}
+
+
+/*
+ * copydb_throttle_wait_for_turn is called by the table workers before they
+ * fetch their next table: in adaptive mode, the workers whose index is not
+ * lower than the current count of active workers wait until the source
+ * server load allows them to run again. Returns false when interrupted.
+ */
+bool
+copydb_throttle_wait_for_turn(CopyThrottle *throttle, int workerIndex)
+{
+	bool paused = false;
+	TraceEvent event = { 0 };
+
+	if (throttle == NULL)
+	{
+		return true;
+	}
+
+	while (workerIndex >= throttle->activeWorkers)
+	{
+		/* the monitor is done once the table queue is empty */
+		if (throttle->monitorDone)
+		{
+			break;
+		}
+
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			return false;
+		}
+
+		if (!paused)
+		{
+			log_debug("Table worker %d is paused, %d workers are active",
+					  workerIndex,
+					  throttle->activeWorkers);
+			paused = true;
+
+			trace_begin(&event, "wait", "adaptive pause");
+		}
+
+		log_flush();
+
+		pg_usleep(THROTTLE_PAUSE_SLEEP_TIME_MS * 1000);
+	}
+
+	if (paused)
+	{
+		trace_end(&event);
+		log_debug("Table worker %d resumes", workerIndex);
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_start_throttle_monitor forks the sub-process that samples the
+ * source server load and adjusts the count of active table workers, see
+ * copydb_throttle_monitor().
+ */
+bool
+copydb_start_throttle_monitor(CopyDataSpec *specs, TableDataProcess *process)
+{
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	int fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork the COPY throttle monitor process");
+			return false;
+		}
+
+		case 0:
+		{
+			/* child process runs the command */
+			bool success = copydb_throttle_monitor(specs);
+
+			/* let the paused workers finish up in any case */
+			specs->throttle->monitorDone = true;
+
+			if (!success)
+			{
+				/* errors have already been logged */
+				exit(EXIT_CODE_INTERNAL_ERROR);
+			}
+
+			exit(EXIT_CODE_QUIT);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			process->pid = fpid;
+
+			return true;
+		}
+	}
+}
+
+
+/*
+ * copydb_throttle_monitor samples the replication lag of the source standby
+ * servers and the count of active backends on the source server every few
+ * seconds. When either is over its --adaptive-max-lag or
+ * --adaptive-max-backends limit, one table worker is paused, and when both
+ * are well under their limit, one paused worker is resumed.
+ *
+ * With --source-replica the table workers read from the standby servers, so
+ * the active backends are also counted there, and the busiest server is
+ * compared to the --adaptive-max-backends limit.
+ *
+ * Paused workers finish the table they are copying, and only then wait
+ * before fetching the next one. The monitor exits once all the tables have
+ * been fetched from the queue.
+ */
+static bool
+copydb_throttle_monitor(CopyDataSpec *specs)
+{
+	CopyThrottle *throttle = specs->throttle;
+	CopyTableQueue *queue = specs->tableQueue;
+
+	PGSQL pgsql = { 0 };
+	PGSQL replicas[MAX_SOURCE_REPLICAS] = { 0 };
+
+	if (!pgsql_init(&pgsql, specs->source_pguri, PGSQL_CONN_SOURCE))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int i = 0; i < specs->sourceReplicaCount; i++)
+	{
+		if (!pgsql_init(&(replicas[i]),
+						specs->replicaSnapshots[i].pguri,
+						PGSQL_CONN_SOURCE))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	bool success = true;
+
+	bool sampleLag = specs->adaptiveMaxLag > 0;
+
+	while (queue->next < queue->count)
+	{
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			break;
+		}
+
+		uint64_t lag = 0;
+		int backends = 0;
+
+		if (!copydb_throttle_sample_source(&pgsql, &sampleLag, &lag, &backends))
+		{
+			/* errors have already been logged */
+			success = false;
+			break;
+		}
+
+		for (int i = 0; i < specs->sourceReplicaCount; i++)
+		{
+			int replicaBackends = 0;
+
+			if (!copydb_throttle_count_backends(&(replicas[i]),
+												&replicaBackends))
+			{
+				/* errors have already been logged */
+				success = false;
+				break;
+			}
+
+			if (replicaBackends > backends)
+			{
+				backends = replicaBackends;
+			}
+		}
+
+		if (!success)
+		{
+			break;
+		}
+
+		bool overloaded =
+			(sampleLag && lag > specs->adaptiveMaxLag) ||
+			(specs->adaptiveMaxBackends > 0 &&
+			 backends > specs->adaptiveMaxBackends);
+
+		bool relaxed =
+			(!sampleLag || lag < specs->adaptiveMaxLag / 2) &&
+			(specs->adaptiveMaxBackends == 0 ||
+			 backends < specs->adaptiveMaxBackends);
+
+		int activeWorkers = throttle->activeWorkers;
+
+		if (overloaded && activeWorkers > 1)
+		{
+			--activeWorkers;
+		}
+		else if (relaxed && activeWorkers < throttle->maxWorkers)
+		{
+			++activeWorkers;
+		}
+
+		if (activeWorkers != throttle->activeWorkers)
+		{
+			log_info("Source replication lag is %lld bytes and %d backends "
+					 "are active: scaling table workers from %d to %d",
+					 (long long) lag,
+					 backends,
+					 throttle->activeWorkers,
+					 activeWorkers);
+
+			throttle->activeWorkers = activeWorkers;
+		}
+
+		(void) copydb_throttle_sleep(THROTTLE_SAMPLE_INTERVAL_MS * 1000);
+	}
+
+	pgsql_finish(&pgsql);
+
+	for (int i = 0; i < specs->sourceReplicaCount; i++)
+	{
+		pgsql_finish(&(replicas[i]));
+	}
+
+	return success;
+}
+
+
+/*
+ * copydb_throttle_sample_source fetches the replication lag of the slowest
+ * standby server, in bytes, and the count of active backends on the source
+ * server, see copydb_throttle_count_backends().
+ *
+ * When the source server is itself a standby, the replication lag can't be
+ * computed: sampleLag is then set to false, and only the count of active
+ * backends is used from then on.
+ */
+static bool
+copydb_throttle_sample_source(PGSQL *pgsql,
+							  bool *sampleLag,
+							  uint64_t *lag,
+							  int *backends)
+{
+	if (*sampleLag)
+	{
+		SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BIGINT, false };
+
+		char *sql =
+			"select coalesce(max(pg_wal_lsn_diff(pg_current_wal_lsn(), "
+			"replay_lsn)), 0)::bigint "
+			"from pg_stat_replication";
+
+		if (!pgsql_execute_with_params(pgsql, sql, 0, NULL, NULL,
+									   &context, &parseSingleValueResult) ||
+			!context.parsedOk)
+		{
+			log_warn("Failed to fetch the source replication lag, "
+					 "using only the count of active backends from now on");
+			*sampleLag = false;
+		}
+		else
+		{
+			*lag = context.bigint;
+		}
+	}
+
+	return copydb_throttle_count_backends(pgsql, backends);
+}
+
+
+/*
+ * copydb_throttle_count_backends fetches the count of active backends on the
+ * given server. The pgcopydb connections, including the COPY connections of
+ * the table workers, are not counted: they use the application_name
+ * "pgcopydb", see pgsql_connectdb().
+ */
+static bool
+copydb_throttle_count_backends(PGSQL *pgsql, int *backends)
+{
+	SingleValueResultContext context = { { 0 }, PGSQL_RESULT_BIGINT, false };
+
+	char *sql =
+		"select count(*) "
+		"from pg_stat_activity "
+		"where state = 'active' "
+		"and backend_type = 'client backend' "
+		"and application_name <> $1";
+
+	int paramCount = 1;
+	Oid paramTypes[1] = { TEXTOID };
+	const char *paramValues[1] = { PGCOPYDB_APPLICATION_NAME };
+
+	if (!pgsql_execute_with_params(pgsql, sql,
+								   paramCount, paramTypes, paramValues,
+								   &context, &parseSingleValueResult) ||
+		!context.parsedOk)
+	{
+		log_error("Failed to fetch the count of active backends "
+				  "on the source server");
+		return false;
+	}
+
+	*backends = (int) context.bigint;
+
+	return true;
+}
+
+
+/*
+ * copydb_throttle_sleep sleeps for the given duration, in small steps so as
+ * not to block user's interrupt (C-c and the like).
+ */
+static void
+copydb_throttle_sleep(uint64_t microseconds)
+{
+	uint64_t step = THROTTLE_PAUSE_SLEEP_TIME_MS * 1000;
+
+	while (microseconds > 0)
+	{
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			return;
+		}
+
+		uint64_t duration = microseconds < step ? microseconds : step;
+
+		log_flush();
+
+		pg_usleep((long) duration);
+
+		microseconds -= duration;
+	}
+}
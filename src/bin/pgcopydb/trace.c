@@ -0,0 +1,253 @@
+/*
+ * src/bin/pgcopydb/trace.c
+ *   Timeline of the worker processes activity, in the Chrome trace format
+ *
+ * The trace file is a JSON array of trace_event objects, as documented in
+ * the "Trace Event Format" of the Chrome tracing tools, and can be loaded in
+ * chrome://tracing or https://ui.perfetto.dev. The array is never closed: the
+ * format allows for that, so that a trace is still usable after a crash.
+ *
+ * Each event is written with a single write(2) call on a file descriptor
+ * opened with O_APPEND and shared by all the sub-processes, as for the
+ * journal, so that events written concurrently are never interleaved. All
+ * the sub-processes are shown as threads of the main pgcopydb process.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defaults.h"
+#include "file_utils.h"
+#include "log.h"
+#include "string_utils.h"
+#include "trace.h"
+
+/* the trace file is shared by all the processes of a pgcopydb run */
+static int traceFd = -1;
+static pid_t tracePid = 0;
+static char traceFilename[MAXPGPATH] = { 0 };
+
+
+static uint64_t trace_now_us(void);
+static void trace_write(const char *buffer, size_t size);
+static void trace_escape(const char *str, char *dest, size_t size);
+
+
+/*
+ * trace_init opens the trace file at the given filename, truncating it, and
+ * registers the calling process as the main process of the trace. Calling
+ * trace_init again with the same filename is a no-op.
+ */
+bool
+trace_init(const char *filename)
+{
+	if (traceFd != -1 && streq(filename, traceFilename))
+	{
+		return true;
+	}
+
+	trace_finish();
+
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+
+	if (fd == -1)
+	{
+		log_error("Failed to open trace file \"%s\": %m", filename);
+		return false;
+	}
+
+	traceFd = fd;
+	tracePid = getpid();
+	strlcpy(traceFilename, filename, sizeof(traceFilename));
+
+	trace_write("[\n", 2);
+	trace_set_process_name("pgcopydb main");
+
+	log_info("Writing a trace of the workers activity to \"%s\"", filename);
+
+	return true;
+}
+
+
+/*
+ * trace_enabled returns true when a trace file is being written.
+ */
+bool
+trace_enabled(void)
+{
+	return traceFd != -1;
+}
+
+
+/*
+ * trace_set_process_name writes a metadata event that names the calling
+ * process in the trace, such as "table worker 2".
+ */
+void
+trace_set_process_name(const char *name)
+{
+	if (traceFd == -1)
+	{
+		return;
+	}
+
+	/* leave room in the buffer for the rest of the event */
+	char escaped[BUFSIZE / 2] = { 0 };
+	char buffer[BUFSIZE] = { 0 };
+
+	trace_escape(name, escaped, sizeof(escaped));
+
+	int len = sformat(buffer, sizeof(buffer),
+					  "{\"name\":\"thread_name\",\"ph\":\"M\","
+					  "\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+					  tracePid,
+					  getpid(),
+					  escaped);
+
+	trace_write(buffer, len);
+}
+
+
+/*
+ * trace_begin registers the start time of the given event.
+ */
+void
+trace_begin(TraceEvent *event, const char *category, const char *fmt, ...)
+{
+	if (traceFd == -1)
+	{
+		event->startUs = 0;
+		return;
+	}
+
+	va_list args;
+
+	va_start(args, fmt);
+	pg_vsnprintf(event->name, sizeof(event->name), fmt, args);
+	va_end(args);
+
+	event->category = category;
+	event->startUs = trace_now_us();
+}
+
+
+/*
+ * trace_end writes the given event to the trace file, with its duration.
+ */
+void
+trace_end(TraceEvent *event)
+{
+	if (traceFd == -1 || event->startUs == 0)
+	{
+		return;
+	}
+
+	uint64_t durationUs = trace_now_us() - event->startUs;
+
+	/* leave room in the buffer for the rest of the event */
+	char escaped[BUFSIZE / 2] = { 0 };
+	char buffer[BUFSIZE] = { 0 };
+
+	trace_escape(event->name, escaped, sizeof(escaped));
+
+	int len = sformat(buffer, sizeof(buffer),
+					  "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+					  "\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d},\n",
+					  escaped,
+					  event->category,
+					  (unsigned long long) event->startUs,
+					  (unsigned long long) durationUs,
+					  tracePid,
+					  getpid());
+
+	trace_write(buffer, len);
+
+	event->startUs = 0;
+}
+
+
+/*
+ * trace_finish closes the trace file.
+ */
+void
+trace_finish(void)
+{
+	if (traceFd == -1)
+	{
+		return;
+	}
+
+	if (close(traceFd) != 0)
+	{
+		log_warn("Failed to close trace file \"%s\": %m", traceFilename);
+	}
+
+	traceFd = -1;
+}
+
+
+/*
+ * trace_now_us returns the current time in microseconds. The wall clock is
+ * used so that the timestamps of all the processes compare.
+ */
+static uint64_t
+trace_now_us(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/*
+ * trace_write writes the given buffer to the trace file. A trace is not
+ * worth failing the copy for, and losing an event is fine: we only warn.
+ */
+static void
+trace_write(const char *buffer, size_t size)
+{
+	ssize_t written = write(traceFd, buffer, size);
+
+	if (written != (ssize_t) size)
+	{
+		log_warn("Failed to write to trace file \"%s\": %m", traceFilename);
+	}
+}
+
+
+/*
+ * trace_escape copies str to dest, escaping the characters that can't be
+ * used as-is in a JSON string.
+ */
+static void
+trace_escape(const char *str, char *dest, size_t size)
+{
+	size_t j = 0;
+
+	for (const char *p = str; *p != '\0' && j + 7 < size; p++)
+	{
+		unsigned char c = (unsigned char) *p;
+
+		if (c == '"' || c == '\\')
+		{
+			dest[j++] = '\\';
+			dest[j++] = c;
+		}
+		else if (c < 0x20)
+		{
+			j += sformat(dest + j, size - j, "\\u%04x", c);
+		}
+		else
+		{
+			dest[j++] = c;
+		}
+	}
+
+	dest[j] = '\0';
+}
@@ -0,0 +1,33 @@
+/*
+ * src/bin/pgcopydb/trace.h
+ *   Timeline of the worker processes activity, in the Chrome trace format
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "postgres_fe.h"
+
+/*
+ * A trace event is recorded with trace_begin() and written to the trace file
+ * with trace_end(), as a Chrome trace_event "complete" event. When tracing
+ * is disabled, both functions return right away.
+ */
+typedef struct TraceEvent
+{
+	uint64_t startUs;           /* 0 when tracing is disabled */
+	const char *category;
+	char name[NAMEDATALEN * 3];
+} TraceEvent;
+
+bool trace_init(const char *filename);
+bool trace_enabled(void);
+void trace_set_process_name(const char *name);
+void trace_begin(TraceEvent *event, const char *category, const char *fmt, ...)
+__attribute__((format(printf, 3, 4)));
+void trace_end(TraceEvent *event);
+void trace_finish(void);
+
+#endif /* TRACE_H */
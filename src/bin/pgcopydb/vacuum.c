@@ -0,0 +1,341 @@
+/*
+ * src/bin/pgcopydb/vacuum.c
+ *     Implementation of a CLI to copy a database between two Postgres instances
+ */
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "copydb.h"
+#include "lock_utils.h"
+#include "log.h"
+#include "pgsql.h"
+#include "signals.h"
+
+
+static bool copydb_vacuum_worker(CopyDataSpec *specs);
+
+
+/*
+ * copydb_vacuum_queue_init allocates the queue of VACUUM jobs in shared
+ * memory, with room for each table once: the parts of a split table are
+ * queued once, by the process that copies the last part.
+ */
+bool
+copydb_vacuum_queue_init(CopyDataSpec *specs)
+{
+	CopyTableDataSpecsArray *tableSpecsArray = &(specs->tableSpecsArray);
+
+	int capacity = 0;
+
+	for (int i = 0; i < tableSpecsArray->count; i++)
+	{
+		if (tableSpecsArray->array[i].part.partNumber == 0)
+		{
+			++capacity;
+		}
+	}
+
+	size_t size =
+		sizeof(CopyVacuumQueue) + capacity * sizeof(CopyTableDataSpec *);
+
+	void *area = mmap(NULL, size,
+					  PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_ANONYMOUS,
+					  -1, 0);
+
+	if (area == MAP_FAILED)
+	{
+		log_error("Failed to allocate %lld bytes of shared memory for "
+				  "the vacuum queue: %m",
+				  (long long) size);
+		return false;
+	}
+
+	CopyVacuumQueue *queue = (CopyVacuumQueue *) area;
+
+	queue->size = size;
+	queue->capacity = capacity;
+	queue->count = 0;
+	queue->next = 0;
+	queue->closed = false;
+
+	/* the semaphore initValue defaults to 1: a mutex */
+	queue->semaphore.initValue = 1;
+
+	if (!semaphore_create(&(queue->semaphore)))
+	{
+		log_error("Failed to create the vacuum queue semaphore");
+		(void) munmap(area, size);
+		return false;
+	}
+
+	for (int i = 0; i < tableSpecsArray->count; i++)
+	{
+		tableSpecsArray->array[i].vacuumQueue = queue;
+	}
+
+	specs->vacuumQueue = queue;
+
+	return true;
+}
+
+
+/*
+ * copydb_vacuum_queue_close marks the vacuum queue as closed: no more tables
+ * are going to be pushed to it, and the vacuum workers exit once it's empty.
+ */
+bool
+copydb_vacuum_queue_close(CopyVacuumQueue *queue)
+{
+	if (!semaphore_lock(&(queue->semaphore)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	queue->closed = true;
+
+	(void) semaphore_unlock(&(queue->semaphore));
+
+	return true;
+}
+
+
+/*
+ * copydb_vacuum_queue_finish removes the vacuum queue semaphore and releases
+ * the shared memory area.
+ */
+bool
+copydb_vacuum_queue_finish(CopyDataSpec *specs)
+{
+	CopyVacuumQueue *queue = specs->vacuumQueue;
+	bool success = true;
+
+	if (queue == NULL)
+	{
+		return true;
+	}
+
+	if (!semaphore_finish(&(queue->semaphore)))
+	{
+		log_warn("Failed to remove vacuum queue semaphore %d",
+				 queue->semaphore.semId);
+		success = false;
+	}
+
+	if (munmap((void *) queue, queue->size) != 0)
+	{
+		log_warn("Failed to release the vacuum queue shared memory: %m");
+		success = false;
+	}
+
+	specs->vacuumQueue = NULL;
+
+	return success;
+}
+
+
+/*
+ * copydb_vacuum_queue_push pushes a table to the vacuum queue.
+ */
+bool
+copydb_vacuum_queue_push(CopyVacuumQueue *queue, CopyTableDataSpec *tableSpecs)
+{
+	if (!semaphore_lock(&(queue->semaphore)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (queue->count == queue->capacity)
+	{
+		(void) semaphore_unlock(&(queue->semaphore));
+
+		log_error("Failed to queue table \"%s\".\"%s\" for VACUUM: "
+				  "the vacuum queue is full, with %d tables",
+				  tableSpecs->sourceTable->nspname,
+				  tableSpecs->sourceTable->relname,
+				  queue->capacity);
+		return false;
+	}
+
+	queue->array[queue->count++] = tableSpecs;
+
+	(void) semaphore_unlock(&(queue->semaphore));
+
+	return true;
+}
+
+
+/*
+ * copydb_vacuum_queue_pop fetches the next table from the vacuum queue. When
+ * the queue is empty the function waits until a table is pushed, and returns
+ * false when the queue has been closed, or when we're asked to quit. See
+ * copydb_index_queue_pop() for why we poll here.
+ */
+bool
+copydb_vacuum_queue_pop(CopyVacuumQueue *queue, int *jobIndex)
+{
+	for (;;)
+	{
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			return false;
+		}
+
+		bool found = false;
+		bool closed = false;
+
+		if (!semaphore_lock(&(queue->semaphore)))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (queue->next < queue->count)
+		{
+			*jobIndex = queue->next++;
+			found = true;
+		}
+
+		closed = queue->closed;
+
+		(void) semaphore_unlock(&(queue->semaphore));
+
+		if (found)
+		{
+			return true;
+		}
+
+		if (closed)
+		{
+			return false;
+		}
+
+		log_flush();
+
+		pg_usleep(100 * 1000); /* 100 ms */
+	}
+}
+
+
+/*
+ * copydb_start_vacuum_worker forks a vacuum worker sub-process, see
+ * copydb_vacuum_worker(), and registers it in the given process slot.
+ */
+bool
+copydb_start_vacuum_worker(CopyDataSpec *specs, TableDataProcess *process)
+{
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	int fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork a vacuum worker process");
+			return false;
+		}
+
+		case 0:
+		{
+			/* child process runs the command */
+			if (!copydb_vacuum_worker(specs))
+			{
+				/* errors have already been logged */
+				exit(EXIT_CODE_INTERNAL_ERROR);
+			}
+
+			exit(EXIT_CODE_QUIT);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			process->pid = fpid;
+
+			return true;
+		}
+	}
+}
+
+
+/*
+ * copydb_vacuum_worker implements a vacuum worker: it pulls tables from the
+ * shared vacuum queue and runs VACUUM ANALYZE (or ANALYZE) on them one after
+ * the other, until the queue is closed and empty, using a single connection
+ * to the target database.
+ */
+static bool
+copydb_vacuum_worker(CopyDataSpec *specs)
+{
+	CopyVacuumQueue *queue = specs->vacuumQueue;
+
+	PGSQL dst = { 0 };
+
+	bool success = true;
+
+	(void) trace_set_process_name("vacuum worker");
+
+	if (!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET) ||
+		!copydb_set_target_session(&(specs->bulkLoadProfile),
+								   BULK_LOAD_PHASE_VACUUM,
+								   &dst))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	int jobIndex = 0;
+
+	while (copydb_vacuum_queue_pop(queue, &jobIndex))
+	{
+		CopyTableDataSpec *tableSpecs = queue->array[jobIndex];
+
+		/* with copy-cluster, wait for a vacuum job slot of the whole cluster */
+		if (!copydb_job_budget_acquire(specs->budget, COPY_JOB_BUDGET_VACUUM))
+		{
+			/* errors have already been logged */
+			success = false;
+			break;
+		}
+
+		/* re-open the connection when it's been lost */
+		if (dst.connection != NULL &&
+			PQstatus(dst.connection) != CONNECTION_OK)
+		{
+			pgsql_finish(&dst);
+		}
+
+		if (dst.connection == NULL && !pgsql_open_persistent_connection(&dst))
+		{
+			/* errors have already been logged */
+			copydb_job_budget_release(specs->budget, COPY_JOB_BUDGET_VACUUM);
+			success = false;
+			continue;
+		}
+
+		if (!copydb_vacuum_table(tableSpecs, &dst))
+		{
+			/* errors have already been logged */
+			success = false;
+		}
+
+		copydb_job_budget_release(specs->budget, COPY_JOB_BUDGET_VACUUM);
+	}
+
+	if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+	{
+		success = false;
+	}
+
+	pgsql_finish(&dst);
+
+	return success;
+}
@@ -0,0 +1,1335 @@
+/*
+ * src/bin/pgcopydb/workers.c
+ *     Implementation of a CLI to copy a database between two Postgres instances
+ */
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "copydb.h"
+#include "file_utils.h"
+#include "lock_utils.h"
+#include "log.h"
+#include "pgsql.h"
+#include "signals.h"
+#include "string_utils.h"
+#include "summary.h"
+
+
+static bool copydb_table_worker(CopyDataSpec *specs, int workerIndex);
+static bool copydb_index_queue_push(CopyIndexQueue *queue,
+									CopyTableDataSpec *tableSpecs,
+									SourceIndexArray *indexArray);
+static bool copydb_index_queue_job_done(CopyIndexQueue *queue,
+										int jobIndex,
+										bool success,
+										bool *isLastJob,
+										bool *tableFailed);
+static bool copydb_index_worker(CopyDataSpec *specs, int workerIndex);
+static bool copydb_index_worker_run_job(CopyIndexQueue *queue,
+										int jobIndex,
+										PGSQL *dst);
+static bool copydb_index_worker_finalize_table(CopyIndexQueue *queue,
+											   int jobIndex,
+											   BulkLoadProfile *profile,
+											   PGSQL *dst);
+static bool copydb_index_worker_prepare_table(CopyIndexQueue *queue,
+											  int jobIndex,
+											  SourceIndexArray *indexArray);
+static void copydb_index_worker_release_table(CopyIndexQueue *queue,
+											  int jobIndex,
+											  SourceIndexArray *indexArray);
+static bool copydb_index_memory_acquire(CopyIndexQueue *queue,
+										SourceIndex *index,
+										IndexMemoryGrant *grant);
+static void copydb_index_memory_release(CopyIndexQueue *queue,
+										IndexMemoryGrant *grant);
+
+
+/*
+ * copydb_table_queue_init allocates the queue of COPY jobs in shared memory,
+ * so that all the table workers see the same queue, and fills it in with the
+ * tables (and table parts) that are not handled by the multiplexed COPY
+ * process. Tables are queued in the order of the tableSpecsArray.
+ *
+ * The queue is protected by a semaphore that is used as a mutex.
+ */
+bool
+copydb_table_queue_init(CopyDataSpec *specs)
+{
+	CopyTableDataSpecsArray *tableSpecsArray = &(specs->tableSpecsArray);
+
+	size_t size =
+		sizeof(CopyTableQueue) + tableSpecsArray->count * sizeof(int);
+
+	void *area = mmap(NULL, size,
+					  PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_ANONYMOUS,
+					  -1, 0);
+
+	if (area == MAP_FAILED)
+	{
+		log_error("Failed to allocate %lld bytes of shared memory for "
+				  "the table queue: %m",
+				  (long long) size);
+		return false;
+	}
+
+	CopyTableQueue *queue = (CopyTableQueue *) area;
+
+	queue->size = size;
+	queue->count = 0;
+	queue->next = 0;
+
+	for (int i = 0; i < tableSpecsArray->count; i++)
+	{
+		CopyTableDataSpec *tableSpecs = &(tableSpecsArray->array[i]);
+
+		/* with --refresh, the unchanged tables are left alone */
+		if (tableSpecs->unchanged)
+		{
+			continue;
+		}
+
+		if (!copydb_table_is_multiplexed(specs, tableSpecs))
+		{
+			queue->array[queue->count++] = i;
+		}
+	}
+
+	/* the semaphore initValue defaults to 1: a mutex */
+	queue->semaphore.initValue = 1;
+
+	if (!semaphore_create(&(queue->semaphore)))
+	{
+		log_error("Failed to create the table queue semaphore");
+		(void) munmap(area, size);
+		return false;
+	}
+
+	specs->tableQueue = queue;
+
+	return true;
+}
+
+
+/*
+ * copydb_table_queue_finish removes the table queue semaphore and releases
+ * the shared memory area.
+ */
+bool
+copydb_table_queue_finish(CopyDataSpec *specs)
+{
+	CopyTableQueue *queue = specs->tableQueue;
+	bool success = true;
+
+	if (queue == NULL)
+	{
+		return true;
+	}
+
+	if (!semaphore_finish(&(queue->semaphore)))
+	{
+		log_warn("Failed to remove table queue semaphore %d",
+				 queue->semaphore.semId);
+		success = false;
+	}
+
+	if (munmap((void *) queue, queue->size) != 0)
+	{
+		log_warn("Failed to release the table queue shared memory: %m");
+		success = false;
+	}
+
+	specs->tableQueue = NULL;
+
+	return success;
+}
+
+
+/*
+ * copydb_table_queue_pop fetches the next COPY job from the queue, and sets
+ * specsIndex to its index in the tableSpecsArray. The found flag is set to
+ * false when the queue is empty. Returns false on errors, and when
+ * interrupted, so that the table worker does not exit successfully with
+ * tables left in the queue.
+ *
+ * While the pre-data section is being restored, the next job is the first
+ * one in the queue whose table has been created on the target database
+ * already, and the jobs that are skipped keep their order. When none of the
+ * queued tables has been created yet, we wait for the next pre-data batch.
+ *
+ * With --copy-memory-budget, the jobs whose estimated memory does not fit in
+ * the budget left are skipped the same way, and the memory of the job that
+ * is returned has been reserved in the given grant.
+ */
+bool
+copydb_table_queue_pop(CopyDataSpec *specs, int *specsIndex,
+					   CopyMemoryGrant *grant, bool *found)
+{
+	CopyTableDataSpecsArray *tableSpecsArray = &(specs->tableSpecsArray);
+	CopyTableQueue *queue = specs->tableQueue;
+
+	*found = false;
+
+	for (;;)
+	{
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			return false;
+		}
+
+		PreDataProgress progress = { 0 };
+
+		if (!copydb_pre_data_progress(specs, &progress))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (progress.failed)
+		{
+			log_error("Failed to restore the pre-data section, "
+					  "see above for details");
+			return false;
+		}
+
+		bool empty = false;
+
+		if (!semaphore_lock(&(queue->semaphore)))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		for (int i = queue->next; i < queue->count; i++)
+		{
+			int index = queue->array[i];
+			CopyTableDataSpec *tableSpecs = &(tableSpecsArray->array[index]);
+			SourceTable *table = tableSpecs->sourceTable;
+
+			if (!copydb_pre_data_table_is_restored(specs, &progress, table))
+			{
+				continue;
+			}
+
+			bool fits = true;
+
+			if (!copydb_memory_reserve_job(specs->memoryBudget,
+										   tableSpecs,
+										   grant,
+										   &fits))
+			{
+				/* errors have already been logged */
+				(void) semaphore_unlock(&(queue->semaphore));
+				return false;
+			}
+
+			if (!fits)
+			{
+				continue;
+			}
+
+			/* keep the skipped jobs in the queue order */
+			memmove(&(queue->array[queue->next + 1]),
+					&(queue->array[queue->next]),
+					(i - queue->next) * sizeof(int));
+
+			queue->array[queue->next++] = index;
+			*specsIndex = index;
+			*found = true;
+			break;
+		}
+
+		empty = queue->next >= queue->count;
+
+		(void) semaphore_unlock(&(queue->semaphore));
+
+		if (*found || empty)
+		{
+			return true;
+		}
+
+		log_flush();
+
+		pg_usleep(100 * 1000); /* 100 ms */
+	}
+}
+
+
+/*
+ * copydb_start_table_worker forks a table worker sub-process, see
+ * copydb_table_worker(), and registers it in the given process slot.
+ */
+bool
+copydb_start_table_worker(CopyDataSpec *specs,
+						  TableDataProcess *process,
+						  int workerIndex)
+{
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	int fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork a table data worker process");
+			return false;
+		}
+
+		case 0:
+		{
+			/* child process runs the command */
+			if (!copydb_table_worker(specs, workerIndex))
+			{
+				/* errors have already been logged */
+				exit(EXIT_CODE_INTERNAL_ERROR);
+			}
+
+			exit(EXIT_CODE_QUIT);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			process->pid = fpid;
+
+			return true;
+		}
+	}
+}
+
+
+/*
+ * copydb_table_worker implements a table worker: it pulls tables (or table
+ * parts) from the shared table queue and copies them one after the other,
+ * until the queue is empty. The worker connections to the source and target
+ * databases are kept open from one table to the next, which saves the cost
+ * of a connection (and TLS handshake) per table.
+ *
+ * When a table fails to copy, the worker moves on to the next table, and
+ * exits with a non-zero status code when done. The indexes of the tables
+ * are queued for the index workers, so the table worker doesn't wait for
+ * them to be built.
+ *
+ * With --source-replica, each worker copies from one of the replicas, see
+ * copydb_table_data_source(). With --fanout-target, each worker also opens a
+ * connection to every extra target, and sends them the same COPY data.
+ */
+static bool
+copydb_table_worker(CopyDataSpec *specs, int workerIndex)
+{
+	CopyTableDataSpecsArray *tableSpecsArray = &(specs->tableSpecsArray);
+	TransactionSnapshot *source = copydb_table_data_source(specs, workerIndex);
+
+	PGSQL src = { 0 };
+	PGSQL dst = { 0 };
+	PGSQL fanout[MAX_FANOUT_TARGETS] = { 0 };
+
+	bool success = true;
+
+	char name[NAMEDATALEN] = { 0 };
+
+	sformat(name, sizeof(name), "table worker %d", workerIndex);
+	(void) trace_set_process_name(name);
+
+	/* initialize our connection objects, connections are opened lazily */
+	if (!pgsql_init(&src, source->pguri, PGSQL_CONN_SOURCE) ||
+		!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET) ||
+		!copydb_set_target_session(&(specs->bulkLoadProfile),
+								   BULK_LOAD_PHASE_COPY,
+								   &dst))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	for (int i = 0; i < specs->fanoutCount; i++)
+	{
+		if (!pgsql_init(&(fanout[i]), specs->fanoutTargets[i],
+						PGSQL_CONN_TARGET) ||
+			!copydb_set_target_session(&(specs->bulkLoadProfile),
+									   BULK_LOAD_PHASE_COPY,
+									   &(fanout[i])))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+	}
+
+	int specsIndex = 0;
+	ProgressSlot *progress = copydb_progress_table_slot(specs, workerIndex);
+	CopyMemoryGrant grant = { 0 };
+
+	for (;;)
+	{
+		instr_time waitStart;
+
+		INSTR_TIME_SET_CURRENT(waitStart);
+
+		/* with copy-cluster, wait for a table job slot of the whole cluster */
+		if (!copydb_job_budget_acquire(specs->budget, COPY_JOB_BUDGET_TABLE))
+		{
+			/* errors have already been logged */
+			success = false;
+			break;
+		}
+
+		bool found = false;
+
+		/* in adaptive mode, wait for our turn before fetching the next table */
+		if (!copydb_throttle_wait_for_turn(specs->throttle, workerIndex) ||
+			!copydb_table_queue_pop(specs, &specsIndex, &grant, &found))
+		{
+			/* errors have already been logged */
+			copydb_job_budget_release(specs->budget, COPY_JOB_BUDGET_TABLE);
+			success = false;
+			break;
+		}
+
+		(void) copydb_progress_add_wait(progress, waitStart);
+
+		if (!found)
+		{
+			copydb_job_budget_release(specs->budget, COPY_JOB_BUDGET_TABLE);
+			break;
+		}
+
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			copydb_memory_release_job(&grant);
+			copydb_job_budget_release(specs->budget, COPY_JOB_BUDGET_TABLE);
+			success = false;
+			break;
+		}
+
+		CopyTableDataSpec *tableSpecs = &(tableSpecsArray->array[specsIndex]);
+
+		/* we're in a sub-process, our table specs are a private copy */
+		tableSpecs->sourceSnapshot = source;
+		tableSpecs->fanout = fanout;
+		tableSpecs->fanoutCount = specs->fanoutCount;
+		tableSpecs->throttle = specs->throttle;
+		tableSpecs->memoryGrant = specs->memoryBudget == NULL ? NULL : &grant;
+		tableSpecs->progress = progress;
+
+		log_debug("[%d] is processing table %d \"%s\".\"%s\" part %d/%d",
+				  getpid(),
+				  specsIndex,
+				  tableSpecs->sourceTable->nspname,
+				  tableSpecs->sourceTable->relname,
+				  tableSpecs->part.partNumber + 1,
+				  tableSpecs->part.partCount);
+
+		if (!copydb_copy_table(tableSpecs, &src, &dst))
+		{
+			log_error("Failed to copy table \"%s\".\"%s\", "
+					  "see above for details",
+					  tableSpecs->sourceTable->nspname,
+					  tableSpecs->sourceTable->relname);
+			success = false;
+		}
+
+		copydb_memory_release_job(&grant);
+		copydb_job_budget_release(specs->budget, COPY_JOB_BUDGET_TABLE);
+	}
+
+	/* the source connection might be in a read-only transaction, fine */
+	pgsql_finish(&src);
+	pgsql_finish(&dst);
+
+	for (int i = 0; i < specs->fanoutCount; i++)
+	{
+		pgsql_finish(&(fanout[i]));
+	}
+
+	return success;
+}
+
+
+/*
+ * copydb_index_queue_init allocates the queue of CREATE INDEX jobs in shared
+ * memory, so that the table workers and the multiplexed COPY process can push
+ * jobs that the index workers then pull. The queue is sized from the index
+ * list of each table, as fetched in copydb_fetch_source_indexes().
+ */
+bool
+copydb_index_queue_init(CopyDataSpec *specs)
+{
+	CopyTableDataSpecsArray *tableSpecsArray = &(specs->tableSpecsArray);
+
+	int capacity = 0;
+
+	for (int i = 0; i < tableSpecsArray->count; i++)
+	{
+		CopyTableDataSpec *tableSpecs = &(tableSpecsArray->array[i]);
+
+		/* split tables are only queued once, by the last part done */
+		if (tableSpecs->part.partNumber == 0)
+		{
+			capacity += tableSpecs->tableIndexArray.count;
+		}
+	}
+
+	size_t size = sizeof(CopyIndexQueue) + capacity * sizeof(CopyIndexJob);
+
+	void *area = mmap(NULL, size,
+					  PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_ANONYMOUS,
+					  -1, 0);
+
+	if (area == MAP_FAILED)
+	{
+		log_error("Failed to allocate %lld bytes of shared memory for "
+				  "the index queue: %m",
+				  (long long) size);
+		return false;
+	}
+
+	CopyIndexQueue *queue = (CopyIndexQueue *) area;
+
+	queue->size = size;
+	queue->capacity = capacity;
+	queue->count = 0;
+	queue->next = 0;
+	queue->closed = false;
+
+	queue->workerCount = specs->indexJobs;
+	queue->workersRunning = 0;
+	queue->memoryBudget = specs->indexMemoryBudget;
+	queue->memoryInUse = 0;
+
+	/* the semaphore initValue defaults to 1: a mutex */
+	queue->semaphore.initValue = 1;
+
+	if (!semaphore_create(&(queue->semaphore)))
+	{
+		log_error("Failed to create the index queue semaphore");
+		(void) munmap(area, size);
+		return false;
+	}
+
+	for (int i = 0; i < tableSpecsArray->count; i++)
+	{
+		tableSpecsArray->array[i].indexQueue = queue;
+	}
+
+	specs->indexQueue = queue;
+
+	return true;
+}
+
+
+/*
+ * copydb_index_queue_close marks the index queue as closed: no more jobs are
+ * going to be pushed to it, and the index workers exit once it's empty.
+ */
+bool
+copydb_index_queue_close(CopyIndexQueue *queue)
+{
+	if (!semaphore_lock(&(queue->semaphore)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	queue->closed = true;
+
+	(void) semaphore_unlock(&(queue->semaphore));
+
+	return true;
+}
+
+
+/*
+ * copydb_index_queue_finish removes the index queue semaphore and releases
+ * the shared memory area.
+ */
+bool
+copydb_index_queue_finish(CopyDataSpec *specs)
+{
+	CopyIndexQueue *queue = specs->indexQueue;
+	bool success = true;
+
+	if (queue == NULL)
+	{
+		return true;
+	}
+
+	if (!semaphore_finish(&(queue->semaphore)))
+	{
+		log_warn("Failed to remove index queue semaphore %d",
+				 queue->semaphore.semId);
+		success = false;
+	}
+
+	if (munmap((void *) queue, queue->size) != 0)
+	{
+		log_warn("Failed to release the index queue shared memory: %m");
+		success = false;
+	}
+
+	specs->indexQueue = NULL;
+
+	return success;
+}
+
+
+/*
+ * copydb_index_queue_pop fetches the next CREATE INDEX job from the queue,
+ * and sets jobIndex to its index in the queue array. When the queue is empty
+ * the function waits until a job is pushed, and returns false when the queue
+ * has been closed, or when we're asked to quit.
+ *
+ * We don't use a counting semaphore to wait for jobs here, because our
+ * semaphores are using SEM_UNDO: the operations of a table worker would be
+ * undone when it exits.
+ */
+bool
+copydb_index_queue_pop(CopyIndexQueue *queue, int *jobIndex)
+{
+	for (;;)
+	{
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			return false;
+		}
+
+		bool found = false;
+		bool closed = false;
+
+		if (!semaphore_lock(&(queue->semaphore)))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		if (queue->next < queue->count)
+		{
+			*jobIndex = queue->next++;
+			found = true;
+		}
+
+		closed = queue->closed;
+
+		(void) semaphore_unlock(&(queue->semaphore));
+
+		if (found)
+		{
+			return true;
+		}
+
+		if (closed)
+		{
+			return false;
+		}
+
+		log_flush();
+
+		pg_usleep(100 * 1000); /* 100 ms */
+	}
+}
+
+
+/*
+ * copydb_index_queue_push pushes the jobs of a table to the index queue, one
+ * job per index, next to each other.
+ */
+static bool
+copydb_index_queue_push(CopyIndexQueue *queue,
+						CopyTableDataSpec *tableSpecs,
+						SourceIndexArray *indexArray)
+{
+	int jobCount = indexArray->count;
+
+	if (!semaphore_lock(&(queue->semaphore)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (queue->count + jobCount > queue->capacity)
+	{
+		(void) semaphore_unlock(&(queue->semaphore));
+
+		log_error("Failed to queue %d index jobs for table \"%s\".\"%s\": "
+				  "the index queue is full, with %d jobs out of %d, "
+				  "did the source schema change?",
+				  jobCount,
+				  tableSpecs->sourceTable->nspname,
+				  tableSpecs->sourceTable->relname,
+				  queue->count,
+				  queue->capacity);
+		return false;
+	}
+
+	int firstJob = queue->count;
+
+	for (int i = 0; i < jobCount; i++)
+	{
+		CopyIndexJob *job = &(queue->array[firstJob + i]);
+
+		job->tableSpecs = tableSpecs;
+		job->firstJob = firstJob;
+		job->jobCount = jobCount;
+		job->remaining = jobCount;
+		job->failed = false;
+		job->index = indexArray->array[i];
+	}
+
+	/* only publish the jobs once they're all ready */
+	queue->count += jobCount;
+
+	(void) semaphore_unlock(&(queue->semaphore));
+
+	return true;
+}
+
+
+/*
+ * copydb_index_queue_job_done registers that a job is done, and sets
+ * isLastJob to true when it was the last job of its table to be done.
+ * Then tableFailed is set when any of the table jobs has failed.
+ */
+static bool
+copydb_index_queue_job_done(CopyIndexQueue *queue,
+							int jobIndex,
+							bool success,
+							bool *isLastJob,
+							bool *tableFailed)
+{
+	CopyIndexJob *first = &(queue->array[queue->array[jobIndex].firstJob]);
+
+	if (!semaphore_lock(&(queue->semaphore)))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!success)
+	{
+		first->failed = true;
+	}
+
+	*isLastJob = --first->remaining == 0;
+	*tableFailed = first->failed;
+
+	(void) semaphore_unlock(&(queue->semaphore));
+
+	return true;
+}
+
+
+/*
+ * copydb_queue_table_indexes pushes the indexes of a table that has just been
+ * copied to the index queue. The list of indexes has been fetched once for
+ * all the tables by the main process, see copydb_fetch_source_indexes().
+ *
+ * The table is also pushed to the vacuum queue now when it has no index, and
+ * otherwise the index worker that creates its constraints pushes it there
+ * later. That's also the case with --analyze-only: ANALYZE takes a SHARE
+ * UPDATE EXCLUSIVE lock, which conflicts with the SHARE lock of CREATE INDEX.
+ */
+bool
+copydb_queue_table_indexes(CopyTableDataSpec *tableSpecs)
+{
+	SourceTable *table = tableSpecs->sourceTable;
+	SourceIndexArray indexArray = { 0 };
+
+	/* pgcopydb copy table-data has nothing more to do */
+	if (tableSpecs->section == DATA_SECTION_TABLE_DATA)
+	{
+		return true;
+	}
+
+	/* pgcopydb copy vacuum only needs to VACUUM the table */
+	if (tableSpecs->section != DATA_SECTION_VACUUM)
+	{
+		indexArray = tableSpecs->tableIndexArray;
+
+		if (indexArray.count >= 1)
+		{
+			log_info("Queueing %d index%s for table \"%s\".\"%s\"",
+					 indexArray.count,
+					 indexArray.count > 1 ? "es" : "",
+					 table->nspname,
+					 table->relname);
+		}
+		else
+		{
+			log_debug("Table \"%s\".\"%s\" has no index attached",
+					  table->nspname,
+					  table->relname);
+		}
+
+		/*
+		 * Create an index list file for the table, so that we can easily find
+		 * relevant indexing information from the table itself.
+		 */
+		CopyTableSummary summary = {
+			.pid = getpid(),
+			.table = table
+		};
+
+		TableFilePaths tablePaths = { 0 };
+
+		(void) copydb_table_file_paths(tableSpecs, &tablePaths);
+
+		if (!create_table_index_file(&summary,
+									 &indexArray,
+									 tablePaths.idxListFile))
+		{
+			/* this only means summary is missing some indexing information */
+			log_warn("Failed to create table \"%s\".\"%s\" "
+					 "index list file \"%s\"",
+					 table->nspname,
+					 table->relname,
+					 tablePaths.idxListFile);
+		}
+	}
+
+	bool success = true;
+
+	if (indexArray.count > 0)
+	{
+		success =
+			copydb_index_queue_push(tableSpecs->indexQueue,
+									tableSpecs,
+									&indexArray);
+	}
+
+	bool vacuum =
+		tableSpecs->section == DATA_SECTION_VACUUM ||
+		tableSpecs->section == DATA_SECTION_ALL;
+
+	if (success && vacuum && indexArray.count == 0)
+	{
+		success =
+			copydb_vacuum_queue_push(tableSpecs->vacuumQueue, tableSpecs);
+	}
+
+	return success;
+}
+
+
+/*
+ * copydb_start_index_worker forks an index worker sub-process, see
+ * copydb_index_worker(), and registers it in the given process slot.
+ */
+bool
+copydb_start_index_worker(CopyDataSpec *specs,
+						  TableDataProcess *process,
+						  int workerIndex)
+{
+	/* Flush stdio channels just before fork, to avoid double-output problems */
+	fflush(stdout);
+	fflush(stderr);
+
+	int fpid = fork();
+
+	switch (fpid)
+	{
+		case -1:
+		{
+			log_error("Failed to fork an index worker process");
+			return false;
+		}
+
+		case 0:
+		{
+			/* child process runs the command */
+			if (!copydb_index_worker(specs, workerIndex))
+			{
+				/* errors have already been logged */
+				exit(EXIT_CODE_INTERNAL_ERROR);
+			}
+
+			exit(EXIT_CODE_QUIT);
+		}
+
+		default:
+		{
+			/* fork succeeded, in parent */
+			process->pid = fpid;
+
+			return true;
+		}
+	}
+}
+
+
+/*
+ * copydb_index_worker implements an index worker: it pulls jobs from the
+ * shared index queue and runs them one after the other, until the queue is
+ * closed and empty. The worker connection to the target database is kept
+ * open from one job to the next, so that at most --index-jobs connections
+ * are used on the target to build indexes.
+ */
+static bool
+copydb_index_worker(CopyDataSpec *specs, int workerIndex)
+{
+	CopyIndexQueue *queue = specs->indexQueue;
+	ProgressSlot *progress = copydb_progress_index_slot(specs, workerIndex);
+
+	PGSQL dst = { 0 };
+
+	bool success = true;
+
+	char name[NAMEDATALEN] = { 0 };
+
+	sformat(name, sizeof(name), "index worker %d", workerIndex);
+	(void) trace_set_process_name(name);
+
+	if (!pgsql_init(&dst, specs->target_pguri, PGSQL_CONN_TARGET) ||
+		!copydb_set_target_session(&(specs->bulkLoadProfile),
+								   BULK_LOAD_PHASE_INDEX,
+								   &dst))
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	int jobIndex = 0;
+
+	for (;;)
+	{
+		instr_time waitStart;
+
+		INSTR_TIME_SET_CURRENT(waitStart);
+
+		bool found = copydb_index_queue_pop(queue, &jobIndex);
+
+		/* with copy-cluster, wait for an index job slot of the whole cluster */
+		if (found &&
+			!copydb_job_budget_acquire(specs->budget, COPY_JOB_BUDGET_INDEX))
+		{
+			/* errors have already been logged */
+			success = false;
+			break;
+		}
+
+		(void) copydb_progress_add_wait(progress, waitStart);
+
+		if (!found)
+		{
+			break;
+		}
+
+		/* the table specs are a private copy in this sub-process */
+		queue->array[jobIndex].tableSpecs->progress = progress;
+
+		/* re-open the connection when it's been lost */
+		if (dst.connection != NULL &&
+			PQstatus(dst.connection) != CONNECTION_OK)
+		{
+			pgsql_finish(&dst);
+		}
+
+		if (dst.connection == NULL && !pgsql_open_persistent_connection(&dst))
+		{
+			/* errors have already been logged */
+			success = false;
+		}
+
+		bool jobSuccess =
+			dst.connection != NULL &&
+			copydb_index_worker_run_job(queue, jobIndex, &dst);
+
+		copydb_job_budget_release(specs->budget, COPY_JOB_BUDGET_INDEX);
+
+		if (!jobSuccess)
+		{
+			success = false;
+		}
+
+		/* the last index of a table is done: constraints, then vacuum */
+		bool isLastJob = false;
+		bool tableFailed = false;
+
+		if (!copydb_index_queue_job_done(queue,
+										 jobIndex,
+										 jobSuccess,
+										 &isLastJob,
+										 &tableFailed))
+		{
+			/* errors have already been logged */
+			success = false;
+			break;
+		}
+
+		if (isLastJob)
+		{
+			CopyIndexJob *job = &(queue->array[jobIndex]);
+			CopyTableDataSpec *tableSpecs = job->tableSpecs;
+
+			if (tableFailed)
+			{
+				log_error("Skipping constraints and VACUUM for "
+						  "table \"%s\".\"%s\", see above for details",
+						  tableSpecs->sourceTable->nspname,
+						  tableSpecs->sourceTable->relname);
+				continue;
+			}
+
+			if (!copydb_index_worker_finalize_table(queue,
+													jobIndex,
+													&(specs->bulkLoadProfile),
+													&dst))
+			{
+				/* errors have already been logged */
+				success = false;
+			}
+		}
+	}
+
+	if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+	{
+		success = false;
+	}
+
+	pgsql_finish(&dst);
+
+	/* flush the journal records of the indexes and constraints we created */
+	if (!journal_sync(&(specs->journal)))
+	{
+		/* errors have already been logged */
+		success = false;
+	}
+
+	return success;
+}
+
+
+/*
+ * copydb_index_worker_run_job creates the index of the given job, unless
+ * we're not building indexes in this run (pgcopydb copy constraints).
+ */
+static bool
+copydb_index_worker_run_job(CopyIndexQueue *queue, int jobIndex, PGSQL *dst)
+{
+	CopyIndexJob *job = &(queue->array[jobIndex]);
+	CopyTableDataSpec *tableSpecs = job->tableSpecs;
+
+	if (tableSpecs->section != DATA_SECTION_INDEXES &&
+		tableSpecs->section != DATA_SECTION_ALL)
+	{
+		return true;
+	}
+
+	SourceIndexArray indexArray = { 0 };
+	IndexMemoryGrant grant = { 0 };
+
+	instr_time waitStart;
+
+	INSTR_TIME_SET_CURRENT(waitStart);
+
+	bool acquired = copydb_index_memory_acquire(queue, &(job->index), &grant);
+
+	(void) copydb_progress_add_wait(tableSpecs->progress, waitStart);
+
+	if (!acquired)
+	{
+		/* errors have already been logged */
+		return false;
+	}
+
+	if (!copydb_index_worker_prepare_table(queue, jobIndex, &indexArray))
+	{
+		/* errors have already been logged */
+		(void) copydb_index_memory_release(queue, &grant);
+		return false;
+	}
+
+	bool success =
+		copydb_create_index(tableSpecs, jobIndex - job->firstJob, dst, &grant);
+
+	(void) copydb_index_worker_release_table(queue, jobIndex, &indexArray);
+	(void) copydb_index_memory_release(queue, &grant);
+
+	return success;
+}
+
+
+/*
+ * copydb_index_worker_finalize_table creates the constraints of a table once
+ * all its indexes have been built, and then pushes the table to the vacuum
+ * queue. The ALTER TABLE commands are taking an exclusive lock on the table,
+ * so the constraints are created one after the other.
+ *
+ * The constraints settings of the bulk-load profile are only set for the
+ * duration of that step, and then reset to the index settings.
+ */
+static bool
+copydb_index_worker_finalize_table(CopyIndexQueue *queue,
+								   int jobIndex,
+								   BulkLoadProfile *profile,
+								   PGSQL *dst)
+{
+	CopyIndexJob *job = &(queue->array[jobIndex]);
+	CopyTableDataSpec *tableSpecs = job->tableSpecs;
+
+	if (tableSpecs->section == DATA_SECTION_CONSTRAINTS ||
+		tableSpecs->section == DATA_SECTION_ALL)
+	{
+		SourceIndexArray indexArray = { 0 };
+
+		if (!copydb_index_worker_prepare_table(queue, jobIndex, &indexArray))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		bool success =
+			copydb_bulk_load_begin_phase(profile,
+										 BULK_LOAD_PHASE_CONSTRAINTS,
+										 dst) &&
+			copydb_create_constraints(tableSpecs, dst);
+
+		/* the next jobs on this connection must not use those settings */
+		success = copydb_bulk_load_end_phase(profile,
+											 BULK_LOAD_PHASE_CONSTRAINTS,
+											 dst) && success;
+
+		(void) copydb_index_worker_release_table(queue, jobIndex, &indexArray);
+
+		if (!success)
+		{
+			log_error("Failed to create constraints, see above for details");
+			return false;
+		}
+	}
+
+	/* VACUUM or ANALYZE the table once all its indexes are built */
+	if (tableSpecs->section == DATA_SECTION_ALL)
+	{
+		return copydb_vacuum_queue_push(tableSpecs->vacuumQueue, tableSpecs);
+	}
+
+	return true;
+}
+
+
+/*
+ * copydb_index_worker_prepare_table builds the index array of the table of
+ * the given job from the queue, where the table jobs are next to each other,
+ * and then the index file paths.
+ */
+static bool
+copydb_index_worker_prepare_table(CopyIndexQueue *queue,
+								  int jobIndex,
+								  SourceIndexArray *indexArray)
+{
+	CopyIndexJob *job = &(queue->array[jobIndex]);
+	CopyTableDataSpec *tableSpecs = job->tableSpecs;
+
+	indexArray->count = job->jobCount;
+	indexArray->array =
+		(SourceIndex *) calloc(job->jobCount, sizeof(SourceIndex));
+
+	if (indexArray->array == NULL)
+	{
+		log_error(ALLOCATION_FAILED_ERROR);
+		return false;
+	}
+
+	for (int i = 0; i < job->jobCount; i++)
+	{
+		indexArray->array[i] = queue->array[job->firstJob + i].index;
+	}
+
+	tableSpecs->indexArray = indexArray;
+
+	return copydb_init_indexes_paths(tableSpecs);
+}
+
+
+/*
+ * copydb_index_worker_release_table releases the memory allocated in
+ * copydb_index_worker_prepare_table.
+ */
+static void
+copydb_index_worker_release_table(CopyIndexQueue *queue,
+								  int jobIndex,
+								  SourceIndexArray *indexArray)
+{
+	CopyTableDataSpec *tableSpecs = queue->array[jobIndex].tableSpecs;
+
+	free(tableSpecs->indexPathsArray.array);
+	free(indexArray->array);
+
+	tableSpecs->indexPathsArray.count = 0;
+	tableSpecs->indexPathsArray.array = NULL;
+	tableSpecs->indexArray = NULL;
+}
+
+
+/*
+ * copydb_index_memory_acquire computes the share of --index-memory-budget
+ * that the given index build gets, and waits until that much memory is
+ * available. The grant is sized from the source index: sorting the index
+ * tuples in memory needs about INDEX_MEMORY_SORT_FACTOR times the index size.
+ *
+ * Every index worker is entitled to a fair share of the budget, the budget
+ * divided by the count of index workers. Small indexes only take what they
+ * need, and large indexes may then borrow the memory that's not in use,
+ * keeping a fair share available for each of the idle index workers. The sum
+ * of the grants is never more than the budget.
+ *
+ * Large indexes also get parallel maintenance workers, one per
+ * INDEX_PARALLEL_BYTES_PER_WORKER of index size, as long as each participant
+ * has the INDEX_PARALLEL_MEMORY_PER_WORKER that Postgres needs.
+ */
+static bool
+copydb_index_memory_acquire(CopyIndexQueue *queue,
+							SourceIndex *index,
+							IndexMemoryGrant *grant)
+{
+	uint64_t budget = queue->memoryBudget;
+
+	grant->maintenanceWorkMem = 0;
+	grant->parallelWorkers = 0;
+
+	if (budget == 0)
+	{
+		return true;
+	}
+
+	int workerCount = queue->workerCount > 0 ? queue->workerCount : 1;
+	uint64_t fairShare = budget / workerCount;
+
+	uint64_t indexBytes = index->indexBytes > 0 ? index->indexBytes : 0;
+	uint64_t desired = indexBytes * INDEX_MEMORY_SORT_FACTOR;
+
+	if (desired < INDEX_MEMORY_MIN)
+	{
+		desired = INDEX_MEMORY_MIN;
+	}
+
+	if (desired > budget)
+	{
+		desired = budget;
+	}
+
+	uint64_t floor = desired < fairShare ? desired : fairShare;
+
+	TraceEvent event = { 0 };
+	bool waited = false;
+
+	trace_begin(&event, "wait", "index memory wait %s.%s",
+				index->indexNamespace,
+				index->indexRelname);
+
+	for (;;)
+	{
+		/* don't block user's interrupt (C-c and the like) */
+		if (asked_to_quit || asked_to_stop || asked_to_stop_fast)
+		{
+			return false;
+		}
+
+		if (!semaphore_lock(&(queue->semaphore)))
+		{
+			/* errors have already been logged */
+			return false;
+		}
+
+		uint64_t available = budget - queue->memoryInUse;
+
+		if (available >= floor)
+		{
+			/* keep a fair share for each of the other idle workers */
+			int idleWorkers = workerCount - queue->workersRunning - 1;
+			uint64_t reserved =
+				idleWorkers > 0 ? (uint64_t) idleWorkers * fairShare : 0;
+			uint64_t borrow = available > reserved ? available - reserved : 0;
+			uint64_t share = borrow > floor ? borrow : floor;
+
+			grant->maintenanceWorkMem = desired < share ? desired : share;
+
+			queue->memoryInUse += grant->maintenanceWorkMem;
+			++queue->workersRunning;
+		}
+
+		(void) semaphore_unlock(&(queue->semaphore));
+
+		if (grant->maintenanceWorkMem > 0)
+		{
+			break;
+		}
+
+		log_flush();
+
+		/* wait until some other index build releases its share */
+		pg_usleep(100 * 1000); /* 100 ms */
+		waited = true;
+	}
+
+	/* only trace the index builds that had to wait */
+	if (waited)
+	{
+		trace_end(&event);
+	}
+
+	if (indexBytes >= INDEX_PARALLEL_BYTES_PER_WORKER)
+	{
+		int64_t workers = indexBytes / INDEX_PARALLEL_BYTES_PER_WORKER;
+
+		/* the leader process is a participant too */
+		int64_t maxWorkers =
+			grant->maintenanceWorkMem / INDEX_PARALLEL_MEMORY_PER_WORKER - 1;
+
+		workers = workers < maxWorkers ? workers : maxWorkers;
+		workers = workers < INDEX_PARALLEL_MAX_WORKERS
+				  ? workers
+				  : INDEX_PARALLEL_MAX_WORKERS;
+
+		grant->parallelWorkers = workers > 0 ? workers : 0;
+	}
+
+	char pretty[BUFSIZE] = { 0 };
+
+	(void) pretty_print_bytes(pretty, sizeof(pretty), grant->maintenanceWorkMem);
+
+	log_debug("Index \"%s\".\"%s\" gets maintenance_work_mem %s "
+			  "and %d parallel workers",
+			  index->indexNamespace,
+			  index->indexRelname,
+			  pretty,
+			  grant->parallelWorkers);
+
+	return true;
+}
+
+
+/*
+ * copydb_index_memory_release gives back a grant to the memory budget.
+ */
+static void
+copydb_index_memory_release(CopyIndexQueue *queue, IndexMemoryGrant *grant)
+{
+	if (grant->maintenanceWorkMem == 0)
+	{
+		return;
+	}
+
+	if (!semaphore_lock(&(queue->semaphore)))
+	{
+		/* errors have already been logged */
+		return;
+	}
+
+	queue->memoryInUse -= grant->maintenanceWorkMem;
+	--queue->workersRunning;
+
+	(void) semaphore_unlock(&(queue->semaphore));
+
+	grant->maintenanceWorkMem = 0;
+}
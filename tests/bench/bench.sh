@@ -0,0 +1,31 @@
+#! /bin/bash
+
+# This script expects the following environment variables to be set:
+#
+#  - PGCOPYDB_SOURCE_PGURI
+#  - PGCOPYDB_TARGET_PGURI
+#  - PGCOPYDB_TARGET_TABLE_JOBS
+#  - PGCOPYDB_TARGET_INDEX_JOBS
+#  - BENCH_SHAPE, BENCH_SCALE: the data to generate, see generate.sh
+#  - BENCH_LABEL: where to save the JSON report, usually a git commit
+
+set -x
+set -e
+
+#
+# pgcopydb list tables include a retry loop, so we use that as a proxy to
+# depend on the source/target Postgres images to be ready
+#
+pgcopydb list tables --source ${PGCOPYDB_SOURCE_PGURI}
+pgcopydb list tables --source ${PGCOPYDB_TARGET_PGURI}
+
+/usr/src/pgcopydb/generate.sh ${BENCH_SHAPE} ${BENCH_SCALE} \
+    | psql -q -v ON_ERROR_STOP=1 -d ${PGCOPYDB_SOURCE_PGURI}
+
+# pgcopydb copy db uses the environment variables
+pgcopydb copy-db
+
+# keep the JSON report of the run, see pgcopydb copy-db
+mkdir -p /results/${BENCH_LABEL}
+cp ${XDG_RUNTIME_DIR:-/tmp}/pgcopydb/summary.json \
+   /results/${BENCH_LABEL}/${BENCH_SHAPE}-${BENCH_SCALE}.json
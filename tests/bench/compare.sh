@@ -0,0 +1,51 @@
+#! /bin/bash
+
+# Compares the JSON reports of two benchmark runs, saved by bench.sh in
+# results/<label>/<shape>-<scale>.json, phase by phase:
+#
+#   ./compare.sh results/abc1234 results/def5678
+#
+# This script uses jq.
+
+set -e
+
+base=$1
+head=$2
+
+if [ -z "${base}" -o -z "${head}" ]
+then
+    echo "usage: $0 <base results dir> <head results dir>" >&2
+    exit 1
+fi
+
+printf "%-24s %-18s %12s %12s %8s\n" "report" "phase" "base ms" "head ms" "change"
+
+for report in "${base}"/*.json
+do
+    name=$(basename "${report}")
+    other="${head}/${name}"
+
+    if [ ! -f "${other}" ]
+    then
+        continue
+    fi
+
+    for phase in $(jq -r '.phases[].name' "${report}")
+    do
+        b=$(jq -r --arg p "${phase}" \
+               '.phases[] | select(.name == $p) | ."wall-clock-ms"' "${report}")
+        h=$(jq -r --arg p "${phase}" \
+               '.phases[] | select(.name == $p) | ."wall-clock-ms"' "${other}")
+
+        if [ "${b}" != "0" ]
+        then
+            change=$(awk -v b="${b}" -v h="${h}" \
+                         'BEGIN { printf "%+.1f%%", (h - b) * 100 / b }')
+        else
+            change="-"
+        fi
+
+        printf "%-24s %-18s %12s %12s %8s\n" \
+               "${name%.json}" "${phase}" "${b}" "${h}" "${change}"
+    done
+done
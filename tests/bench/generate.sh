@@ -0,0 +1,133 @@
+#! /bin/bash
+
+# Prints the SQL script that generates the data of a benchmark shape, scaled
+# by an integer factor, to be piped to psql:
+#
+#   ./generate.sh tiny-tables 2 | psql -v ON_ERROR_STOP=1 -d ${PGURI}
+#
+# The data is generated server-side with generate_series(), and the scripts
+# that create many objects use \gexec so that each object is created in its
+# own transaction.
+
+set -e
+
+shape=${1:-huge-table}
+scale=${2:-1}
+
+case ${shape} in
+    # a single large table, with a primary key and a secondary index
+    huge-table)
+        cat <<SQL
+create table huge
+ (
+   id bigint primary key,
+   created timestamptz not null,
+   value double precision,
+   payload text
+ );
+
+insert into huge
+     select g,
+            now() - g * interval '1 second',
+            random(),
+            md5(g::text)
+       from generate_series(1, 10000000 * ${scale}) as g;
+
+create index on huge(created);
+SQL
+        ;;
+
+    # 50k tables with a few rows each: the per-table costs dominate
+    tiny-tables)
+        cat <<SQL
+create schema tiny;
+
+select format('create table tiny.t%s(id int primary key, v text);', i),
+       format('insert into tiny.t%s select g, md5(g::text) '
+              'from generate_series(1, 10) as g;', i)
+  from generate_series(1, 50000 * ${scale}) as i
+\gexec
+SQL
+        ;;
+
+    # rows of 32 kB of bytea, sent through TOAST
+    wide-bytea)
+        cat <<SQL
+create table wide
+ (
+   id bigint primary key,
+   data bytea
+ );
+
+insert into wide
+     select g, decode(repeat(md5(g::text), 2048), 'hex')
+       from generate_series(1, 20000 * ${scale}) as g;
+SQL
+        ;;
+
+    # a hundred tables with ten indexes each: CREATE INDEX dominates
+    many-indexes)
+        cat <<SQL
+create schema idx;
+
+select format('create table idx.t%s(id bigint primary key, '
+              'a int, b int, c int, d text, e text, f timestamptz);', i),
+       format('insert into idx.t%s select g, g %% 1000, g %% 100, '
+              'random() * 1000000, md5(g::text), md5((g+1)::text), '
+              'now() - g * interval ''1 minute'' '
+              'from generate_series(1, 100000) as g;', i),
+       format('create index on idx.t%1\$s(a); create index on idx.t%1\$s(b); '
+              'create index on idx.t%1\$s(c); create index on idx.t%1\$s(d); '
+              'create index on idx.t%1\$s(e); create index on idx.t%1\$s(f); '
+              'create index on idx.t%1\$s(a, b); create index on idx.t%1\$s(b, c); '
+              'create index on idx.t%1\$s(d, e); create index on idx.t%1\$s(f, a);',
+              i)
+  from generate_series(1, 100 * ${scale}) as i
+\gexec
+SQL
+        ;;
+
+    # a range partitioned table with a thousand partitions
+    partitions)
+        cat <<SQL
+create table measures
+ (
+   id bigint not null,
+   sensor int not null,
+   value double precision,
+   primary key (id)
+ )
+ partition by range (id);
+
+select format('create table measures_%s partition of measures '
+              'for values from (%s) to (%s);',
+              i, i * 10000, (i + 1) * 10000)
+  from generate_series(0, 1000 * ${scale} - 1) as i
+\gexec
+
+insert into measures
+     select g, g % 512, random()
+       from generate_series(0, 1000 * ${scale} * 10000 - 1) as g;
+SQL
+        ;;
+
+    # ten thousand sequences, each with its own last value
+    sequences)
+        cat <<SQL
+create schema seq;
+
+select format('create sequence seq.s%s;', i),
+       format('select setval(''seq.s%s'', %s);', i, i * 7)
+  from generate_series(1, 10000 * ${scale}) as i
+\gexec
+SQL
+        ;;
+
+    *)
+        echo "unknown benchmark shape: ${shape}" >&2
+        echo "known shapes: huge-table tiny-tables wide-bytea many-indexes partitions sequences" >&2
+        exit 1
+        ;;
+esac
+
+echo "vacuum analyze;"